@@ -17,6 +17,7 @@
 #include "qapi-types.h"
 #include "qapi-visit.h"
 #include "qemu/config-file.h"
+#include "qemu/main-loop.h"
 #include "qom/object_interfaces.h"
 
 #ifdef CONFIG_NUMA
@@ -200,6 +201,34 @@ static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
     return backend->prealloc || backend->force_prealloc;
 }
 
+/* Touching every page of a large backend can take seconds.  The pages
+ * are only read and written back, so drop the iothread lock meanwhile
+ * rather than stall all vCPUs while memory for a hotplugged DIMM is being
+ * populated.  Until it is done the backend counts as mapped, so that
+ * another monitor can neither delete it nor plug it into a device.
+ */
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz, Error **errp)
+{
+    int fd = memory_region_get_fd(&backend->mr);
+    bool locked = qemu_mutex_iothread_locked();
+
+    if (backend->preallocating) {
+        error_setg(errp, "memory backend is already being preallocated");
+        return;
+    }
+
+    backend->preallocating = true;
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    os_mem_prealloc(fd, ptr, sz, errp);
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+    backend->preallocating = false;
+}
+
 static void host_memory_backend_set_prealloc(Object *obj, bool value,
                                              Error **errp)
 {
@@ -220,11 +249,10 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, &local_err);
+        host_memory_backend_prealloc(backend, ptr, sz, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -256,7 +284,7 @@ void host_memory_backend_set_mapped(HostMemoryBackend *backend, bool mapped)
 
 bool host_memory_backend_is_mapped(HostMemoryBackend *backend)
 {
-    return backend->is_mapped;
+    return backend->is_mapped || backend->preallocating;
 }
 
 static void
@@ -327,8 +355,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            &local_err);
+            host_memory_backend_prealloc(backend, ptr, sz, &local_err);
             if (local_err) {
                 goto out;
             }
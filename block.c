@@ -739,7 +739,7 @@ static void bdrv_temp_snapshot_options(int *child_flags, QDict *child_options,
 
     /* aio=native doesn't work for cache.direct=off, so disable it for the
      * temporary snapshot */
-    *child_flags &= ~BDRV_O_NATIVE_AIO;
+    *child_flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
 }
 
 /*
@@ -1405,6 +1405,9 @@ void bdrv_set_backing_hd(BlockDriverState *bs, BlockDriverState *backing_hd)
         bdrv_ref(backing_hd);
     }
 
+    /* Unallocated sectors may read as zero depending on the backing file */
+    bdrv_block_status_cache_invalidate(bs);
+
     if (bs->backing) {
         assert(bs->backing_blocker);
         bdrv_op_unblock_all(bs->backing->bs, bs->backing_blocker);
@@ -1927,6 +1930,7 @@ BlockDriverState *bdrv_open(const char *filename, const char *reference,
 
 typedef struct BlockReopenQueueEntry {
      bool prepared;
+     bool was_read_only;
      BDRVReopenState state;
      QSIMPLEQ_ENTRY(BlockReopenQueueEntry) entry;
 } BlockReopenQueueEntry;
@@ -2108,9 +2112,24 @@ int bdrv_reopen_multiple(AioContext *ctx, BlockReopenQueue *bs_queue, Error **er
      * changes
      */
     QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        bs_entry->was_read_only = bdrv_is_read_only(bs_entry->state.bs);
         bdrv_reopen_commit(&bs_entry->state);
     }
 
+    /* The reopen can't be rolled back any more, so failures here are only
+     * reported */
+    QSIMPLEQ_FOREACH(bs_entry, bs_queue, entry) {
+        BlockDriverState *bs = bs_entry->state.bs;
+
+        if (bs_entry->was_read_only && !bdrv_is_read_only(bs) &&
+            bs->drv->bdrv_reopen_bitmaps_rw) {
+            if (bs->drv->bdrv_reopen_bitmaps_rw(bs, &local_err) < 0) {
+                error_report_err(local_err);
+                local_err = NULL;
+            }
+        }
+    }
+
     ret = 0;
 
 cleanup:
@@ -2322,9 +2341,6 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_flush(bs);
     bdrv_drain(bs); /* in case flush left pending I/O */
 
-    bdrv_release_named_dirty_bitmaps(bs);
-    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
-
     if (bs->drv) {
         BdrvChild *child, *next;
 
@@ -2363,6 +2379,10 @@ static void bdrv_close(BlockDriverState *bs)
         bs->full_open_options = NULL;
     }
 
+    /* Released only after .bdrv_close, which may store persistent bitmaps */
+    bdrv_release_named_dirty_bitmaps(bs);
+    assert(QLIST_EMPTY(&bs->dirty_bitmaps));
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -3258,6 +3278,7 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     bs->open_flags &= ~BDRV_O_INACTIVE;
+    bdrv_block_status_cache_invalidate(bs);
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -3808,6 +3829,7 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
     if (!bs->drv->bdrv_amend_options) {
         return -ENOTSUP;
     }
+    bdrv_block_status_cache_invalidate(bs);
     return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque);
 }
 
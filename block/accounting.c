@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,90 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    uint64_t *pos, *pos_end;
+
+    if (!hist->nbins) {
+        return;
+    }
+
+    /* Bisect for the first boundary above latency_ns, which is the upper
+     * limit of the bin to increment */
+    pos = hist->boundaries;
+    pos_end = pos + hist->nbins - 1;
+    while (pos < pos_end) {
+        uint64_t *mid = pos + (pos_end - pos) / 2;
+        if ((uint64_t) latency_ns < *mid) {
+            pos_end = mid;
+        } else {
+            pos = mid + 1;
+        }
+    }
+
+    hist->bins[pos - hist->boundaries]++;
+}
+
+/*
+ * Start collecting a latency histogram for @type, with the bins delimited by
+ * @boundaries (in nanoseconds, positive and strictly increasing).  Any histogram previously
+ * collected for @type is discarded; an empty list only disables it.
+ *
+ * Returns 0 on success, -EINVAL if @boundaries is not valid.
+ */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    uint64List *entry;
+    uint64_t *ptr;
+    uint64_t prev = 0;
+    int new_nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        /* prev starts at 0, so a zero boundary is rejected too */
+        if (entry->value <= prev) {
+            return -EINVAL;
+        }
+        new_nbins++;
+        prev = entry->value;
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+
+    if (!boundaries) {
+        *hist = (BlockLatencyHistogram) { 0 };
+        return 0;
+    }
+
+    hist->nbins = new_nbins;
+    hist->boundaries = g_new(uint64_t, new_nbins - 1);
+    hist->bins = g_new0(uint64_t, new_nbins);
+    for (entry = boundaries, ptr = hist->boundaries; entry;
+         entry = entry->next, ptr++) {
+        *ptr = entry->value;
+    }
+
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+        g_free(hist->bins);
+        g_free(hist->boundaries);
+        memset(hist, 0, sizeof(*hist));
+    }
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +191,9 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +217,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
@@ -26,6 +26,9 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK_DEFAULT (1 << 20)
+#define BACKUP_MAX_CHUNK_LIMIT (64 << 20)
+#define BACKUP_MAX_WORKERS_DEFAULT 16
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct BackupBlockJob {
@@ -44,8 +47,27 @@ typedef struct BackupBlockJob {
     bool compress;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Largest request of the copy, a multiple of cluster_size */
+    int64_t max_chunk;
+    bool use_copy_range;
+
+    /* Coroutines copying chunks for the background copy of sync=full/top */
+    int max_workers;
+    int nb_workers;
+    CoQueue worker_queue;
+    /* First failed chunk (in clusters) and its error, if any */
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -89,6 +111,27 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy @bytes at @offset with a single copy offload request, or return
+ * -ENOTSUP if the source and target don't support it. */
+static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
+                                                int64_t offset, int bytes,
+                                                bool is_write_notifier)
+{
+    int ret;
+
+    ret = blk_co_copy_range(job->common.blk, offset, job->target, offset,
+                            bytes,
+                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_copy_range_fail(job, offset / job->cluster_size,
+                                            ret);
+        if (ret == -ENOTSUP) {
+            job->use_copy_range = false;
+        }
+    }
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -101,7 +144,8 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t clusters_per_chunk = job->max_chunk / job->cluster_size;
+    int64_t start, end, nr_clusters;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
@@ -114,20 +158,42 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nr_clusters) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            nr_clusters = 1;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
+        /* Copy as many clusters as possible at once */
+        for (nr_clusters = 1; nr_clusters < clusters_per_chunk &&
+             start + nr_clusters < end &&
+             !test_bit(start + nr_clusters, job->done_bitmap); nr_clusters++) {
+            /* nothing */
+        }
+
+        n = MIN(nr_clusters * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
+        if (job->use_copy_range) {
+            ret = backup_cow_with_offload(job, start * job->cluster_size,
+                                          n * BDRV_SECTOR_SIZE,
+                                          is_write_notifier);
+            if (ret >= 0) {
+                goto copied;
+            }
+            /* Retry with a bounce buffer, which also tells apart read and
+             * write errors */
+        }
+
         if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
+            /* Large enough for all the following runs, too */
+            size_t len = MIN(end - start, clusters_per_chunk) *
+                         job->cluster_size;
+            bounce_buffer = blk_blockalign(blk, len);
         }
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
@@ -160,7 +226,8 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
             goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+copied:
+        bitmap_set(job->done_bitmap, start, nr_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -435,19 +502,149 @@ out:
     return ret;
 }
 
+/* Check whether any sector of @cluster is allocated in the topmost image */
+static bool coroutine_fn backup_cluster_is_allocated(BackupBlockJob *job,
+                                                     int64_t cluster)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * sectors_per_cluster + i,
+                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    return alloced != 0;
+}
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, w->cluster * sectors_per_cluster,
+                        w->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0 &&
+        (job->worker_ret == 0 || w->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = w->cluster;
+    }
+
+    job->nb_workers--;
+    qemu_co_queue_next(&job->worker_queue);
+    g_free(w);
+}
+
+/* Copy the whole device (or its topmost image for sync=top) in chunks of up
+ * to max_chunk bytes, with up to max_workers chunks in flight. */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    int64_t clusters_per_chunk = job->max_chunk / job->cluster_size;
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int ret = 0;
+
+    qemu_co_queue_init(&job->worker_queue);
+
+    for (;;) {
+        BackupWorker *w;
+        Coroutine *co;
+        int64_t n;
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        /* On error or at the end, wait for all workers before going on */
+        while (job->nb_workers >= job->max_workers ||
+               (job->nb_workers > 0 &&
+                (job->worker_ret < 0 || start >= end))) {
+            qemu_co_queue_wait(&job->worker_queue, NULL);
+        }
+
+        if (job->worker_ret < 0) {
+            /* Depending on error action, fail now or retry from the first
+             * failed chunk; clusters copied since are skipped */
+            BlockErrorAction action =
+                backup_error_action(job, job->worker_error_is_read,
+                                    -job->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            start = job->worker_error_cluster;
+            job->worker_ret = 0;
+            continue;
+        }
+
+        if (start >= end) {
+            break;
+        }
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+            !backup_cluster_is_allocated(job, start)) {
+            /* Not in the topmost image, skip this cluster. */
+            start++;
+            continue;
+        }
+
+        for (n = 1; n < clusters_per_chunk && start + n < end; n++) {
+            if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+                !backup_cluster_is_allocated(job, start + n)) {
+                break;
+            }
+        }
+
+        w = g_new(BackupWorker, 1);
+        *w = (BackupWorker) {
+            .job            = job,
+            .cluster        = start,
+            .nb_clusters    = n,
+        };
+        start += n;
+
+        job->nb_workers++;
+        co = qemu_coroutine_create(backup_worker_entry, w);
+        qemu_coroutine_enter(co);
+    }
+
+    while (job->nb_workers > 0) {
+        qemu_co_queue_wait(&job->worker_queue, NULL);
+    }
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -465,58 +662,7 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -546,7 +692,8 @@ static const BlockJobDriver backup_job_driver = {
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int64_t max_workers, int64_t max_chunk,
+                  bool copy_offload,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -584,6 +731,18 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > INT_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a positive value");
+        return NULL;
+    }
+
+    if (max_chunk < 0 || max_chunk > BACKUP_MAX_CHUNK_LIMIT) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-chunk",
+                   "a value in range [0, 64MB]");
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -633,6 +792,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = copy_offload && !compress;
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
@@ -651,6 +812,9 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     } else {
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
+    job->max_chunk = QEMU_ALIGN_UP(MAX(max_chunk ?: BACKUP_MAX_CHUNK_DEFAULT,
+                                       job->cluster_size),
+                                   job->cluster_size);
 
     block_job_add_bdrv(&job->common, target);
     job->common.len = len;
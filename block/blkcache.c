@@ -0,0 +1,1236 @@
+/*
+ * Block cache filter driver
+ *
+ * Keeps hot blocks of a slow backend in host RAM or in a local cache file
+ * and, by default, delays writes until the guest flushes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/jhash.h"
+#include "qemu/atomic.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+
+#define BLKCACHE_OPT_CACHE_SIZE "cache-size"
+#define BLKCACHE_OPT_BLOCK_SIZE "block-size"
+#define BLKCACHE_OPT_WRITEBACK  "writeback"
+#define BLKCACHE_OPT_SHARED_CACHE "shared-cache"
+#define BLKCACHE_OPT_SHARED_ID  "shared-id"
+
+#define BLKCACHE_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define BLKCACHE_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define BLKCACHE_MAX_BLOCK_SIZE     (16 * 1024 * 1024)
+
+#define BLKCACHE_SHARED_MAGIC   0x514543414348454bULL /* "QECACHEK" */
+#define BLKCACHE_SHARED_VERSION 1
+#define BLKCACHE_SHARED_WAYS    4
+#define BLKCACHE_SHARED_ALIGN   4096
+
+/*
+ * Blocks are replaced with ARC (adaptive replacement cache).  T1 holds
+ * blocks that were accessed once recently and T2 blocks that were accessed
+ * more than once.  B1 and B2 remember, without their data, blocks that were
+ * recently evicted from T1 and T2.  A miss that hits one of these ghost
+ * lists moves the target size of T1 towards the list that would have kept
+ * the block.  All lists have the most recently used entry first.
+ */
+typedef enum BlkcacheList {
+    BLKCACHE_T1,
+    BLKCACHE_T2,
+    BLKCACHE_B1,
+    BLKCACHE_B2,
+    BLKCACHE_NUM_LISTS,
+} BlkcacheList;
+
+typedef struct BlkcacheEntry {
+    int64_t index;
+    BlkcacheList list;
+    int slot;               /* -1 for ghost entries */
+
+    /* The slot does not hold the data yet; its owner is filling it */
+    bool loading;
+    /* Number of requests accessing the slot */
+    int pinned;
+    bool dirty;
+    /* Incremented by every write, to notice writes during a writeback */
+    uint64_t generation;
+
+    QTAILQ_ENTRY(BlkcacheEntry) next;
+} BlkcacheEntry;
+
+/*
+ * A shared cache is a file, usually in /dev/shm, that several processes map
+ * to share the blocks of read-only images such as common backing files.
+ * Blocks are keyed by an id of the image and their index, and live in a
+ * set-associative table.  Every slot has a sequence count that is odd while
+ * the slot is written; readers take no lock, but copy the data and treat
+ * the block as a miss if the count changed meanwhile.
+ *
+ * A process that dies while writing a slot leaves the count odd, and the
+ * slot unused until the file is recreated.
+ */
+typedef struct BlkcacheSharedHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nb_sets;
+} BlkcacheSharedHeader;
+
+typedef struct BlkcacheSharedSlot {
+    uint32_t seq;
+    uint32_t len;       /* 0 if the slot was never used */
+    uint64_t id;
+    uint64_t index;
+} BlkcacheSharedSlot;
+
+typedef struct BlkcacheSharedSet {
+    uint32_t hand;      /* next way to replace */
+    uint32_t reserved;
+    BlkcacheSharedSlot slots[BLKCACHE_SHARED_WAYS];
+} BlkcacheSharedSet;
+
+typedef struct BDRVBlkcacheState {
+    /* Local cache file, or NULL if the data is kept in RAM */
+    BdrvChild *cache_file;
+    uint8_t *data;
+
+    /* Mapping of the shared cache, or NULL */
+    void *shared;
+    size_t shared_size;
+    uint64_t shared_nb_sets;
+    BlkcacheSharedSet *shared_sets;
+    uint8_t *shared_data;
+    uint64_t shared_id;
+
+    uint64_t block_size;
+    int nb_slots;
+    int *free_slots;
+    int nb_free_slots;
+    bool writeback;
+
+    GHashTable *entries;
+    QTAILQ_HEAD(BlkcacheEntryList, BlkcacheEntry) lists[BLKCACHE_NUM_LISTS];
+    int list_len[BLKCACHE_NUM_LISTS];
+    int target_t1;
+    int nb_dirty;
+
+    /* Requests waiting for a slot to finish loading */
+    CoQueue load_queue;
+
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t write_hits;
+    uint64_t write_misses;
+    uint64_t writebacks;
+} BDRVBlkcacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = BLKCACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache",
+        },
+        {
+            .name = BLKCACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the blocks that are cached",
+        },
+        {
+            .name = BLKCACHE_OPT_WRITEBACK,
+            .type = QEMU_OPT_BOOL,
+            .help = "Delay writes to the backend until the next flush",
+        },
+        {
+            .name = BLKCACHE_OPT_SHARED_CACHE,
+            .type = QEMU_OPT_STRING,
+            .help = "File to share the cache with other processes",
+        },
+        {
+            .name = BLKCACHE_OPT_SHARED_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "Identifies the image in the shared cache",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void blkcache_list_add(BDRVBlkcacheState *s, BlkcacheEntry *e,
+                              BlkcacheList list)
+{
+    e->list = list;
+    QTAILQ_INSERT_HEAD(&s->lists[list], e, next);
+    s->list_len[list]++;
+}
+
+static void blkcache_list_remove(BDRVBlkcacheState *s, BlkcacheEntry *e)
+{
+    QTAILQ_REMOVE(&s->lists[e->list], e, next);
+    s->list_len[e->list]--;
+}
+
+static void blkcache_list_move(BDRVBlkcacheState *s, BlkcacheEntry *e,
+                               BlkcacheList list)
+{
+    blkcache_list_remove(s, e);
+    blkcache_list_add(s, e, list);
+}
+
+/* Forget about @e entirely; its slot (if any) becomes free */
+static void blkcache_drop(BDRVBlkcacheState *s, BlkcacheEntry *e)
+{
+    assert(!e->pinned && !e->dirty);
+
+    if (e->slot >= 0) {
+        s->free_slots[s->nb_free_slots++] = e->slot;
+    }
+    blkcache_list_remove(s, e);
+    g_hash_table_remove(s->entries, &e->index);
+    g_free(e);
+}
+
+static bool blkcache_evictable(BlkcacheEntry *e)
+{
+    return !e->loading && !e->pinned && !e->dirty;
+}
+
+/* Move the least recently used evictable block of @list to its ghost list */
+static bool blkcache_demote(BDRVBlkcacheState *s, BlkcacheList list)
+{
+    BlkcacheEntry *e;
+
+    QTAILQ_FOREACH_REVERSE(e, &s->lists[list], BlkcacheEntryList, next) {
+        if (blkcache_evictable(e)) {
+            s->free_slots[s->nb_free_slots++] = e->slot;
+            e->slot = -1;
+            blkcache_list_move(s, e, list == BLKCACHE_T1 ? BLKCACHE_B1
+                                                         : BLKCACHE_B2);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Return a free slot, evicting a block if necessary, or -1 if all slots are
+ * dirty or in use.  @in_b2 is true if the block that needs the slot was
+ * found in B2.
+ */
+static int blkcache_get_slot(BDRVBlkcacheState *s, bool in_b2)
+{
+    int t1 = s->list_len[BLKCACHE_T1];
+    bool from_t1;
+
+    if (!s->nb_free_slots) {
+        from_t1 = t1 > 0 &&
+                  (t1 > s->target_t1 || (in_b2 && t1 == s->target_t1));
+
+        /* If the preferred list has nothing to evict, use the other one */
+        if (from_t1) {
+            if (!blkcache_demote(s, BLKCACHE_T1)) {
+                blkcache_demote(s, BLKCACHE_T2);
+            }
+        } else {
+            if (!blkcache_demote(s, BLKCACHE_T2)) {
+                blkcache_demote(s, BLKCACHE_T1);
+            }
+        }
+    }
+
+    if (!s->nb_free_slots) {
+        return -1;
+    }
+    return s->free_slots[--s->nb_free_slots];
+}
+
+/* Keep |T1| + |B1| <= c and the whole directory <= 2c */
+static void blkcache_trim_ghosts(BDRVBlkcacheState *s)
+{
+    int *len = s->list_len;
+
+    while (len[BLKCACHE_T1] + len[BLKCACHE_B1] > s->nb_slots &&
+           len[BLKCACHE_B1] > 0)
+    {
+        blkcache_drop(s, QTAILQ_LAST(&s->lists[BLKCACHE_B1],
+                                     BlkcacheEntryList));
+    }
+    while (len[BLKCACHE_T1] + len[BLKCACHE_T2] + len[BLKCACHE_B1] +
+           len[BLKCACHE_B2] > 2 * s->nb_slots && len[BLKCACHE_B2] > 0)
+    {
+        blkcache_drop(s, QTAILQ_LAST(&s->lists[BLKCACHE_B2],
+                                     BlkcacheEntryList));
+    }
+}
+
+/*
+ * Look up block @index for an access and update the ARC lists.
+ *
+ * Returns the entry of the block, or NULL if no slot could be made
+ * available, in which case the request must bypass the cache.  If the data
+ * is not cached yet, the entry is returned with loading set and the caller
+ * must fill the slot and call blkcache_load_done().
+ */
+static BlkcacheEntry *coroutine_fn blkcache_co_get(BDRVBlkcacheState *s,
+                                                   int64_t index, bool *hit)
+{
+    BlkcacheEntry *e;
+    int slot;
+
+    e = g_hash_table_lookup(s->entries, &index);
+    while (e && e->loading) {
+        qemu_co_queue_wait(&s->load_queue, NULL);
+        e = g_hash_table_lookup(s->entries, &index);
+    }
+
+    if (e && e->slot >= 0) {
+        blkcache_list_move(s, e, BLKCACHE_T2);
+        *hit = true;
+        return e;
+    }
+
+    *hit = false;
+    if (e) {
+        int b1 = s->list_len[BLKCACHE_B1];
+        int b2 = s->list_len[BLKCACHE_B2];
+        bool in_b2 = e->list == BLKCACHE_B2;
+
+        if (in_b2) {
+            s->target_t1 = MAX(0, s->target_t1 - MAX(b1 / b2, 1));
+        } else {
+            s->target_t1 = MIN(s->nb_slots, s->target_t1 + MAX(b2 / b1, 1));
+        }
+
+        slot = blkcache_get_slot(s, in_b2);
+        if (slot < 0) {
+            return NULL;
+        }
+        e->slot = slot;
+        blkcache_list_move(s, e, BLKCACHE_T2);
+    } else {
+        slot = blkcache_get_slot(s, false);
+        if (slot < 0) {
+            return NULL;
+        }
+        e = g_new0(BlkcacheEntry, 1);
+        e->index = index;
+        e->slot = slot;
+        g_hash_table_insert(s->entries, &e->index, e);
+        blkcache_list_add(s, e, BLKCACHE_T1);
+    }
+
+    e->loading = true;
+    blkcache_trim_ghosts(s);
+    return e;
+}
+
+static void blkcache_load_done(BDRVBlkcacheState *s, BlkcacheEntry *e,
+                               int ret)
+{
+    e->loading = false;
+    if (ret < 0) {
+        blkcache_drop(s, e);
+    }
+    qemu_co_queue_restart_all(&s->load_queue);
+}
+
+/* Number of bytes of the image in block @index */
+static uint64_t blkcache_block_len(BlockDriverState *bs, int64_t index)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t start = index * s->block_size;
+
+    return MIN(s->block_size, bs->total_sectors * BDRV_SECTOR_SIZE - start);
+}
+
+/* Copy @bytes at @offset in the slot of @e from or to @qiov */
+static int coroutine_fn blkcache_co_slot_io(BlockDriverState *bs,
+                                            BlkcacheEntry *e, uint64_t offset,
+                                            uint64_t bytes, QEMUIOVector *qiov,
+                                            size_t qiov_offset, bool is_write)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t slot_offset = (uint64_t)e->slot * s->block_size + offset;
+    QEMUIOVector local_qiov;
+    int ret;
+
+    if (!s->cache_file) {
+        if (is_write) {
+            qemu_iovec_to_buf(qiov, qiov_offset, s->data + slot_offset, bytes);
+        } else {
+            qemu_iovec_from_buf(qiov, qiov_offset, s->data + slot_offset,
+                                bytes);
+        }
+        return 0;
+    }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+    e->pinned++;
+    if (is_write) {
+        ret = bdrv_co_pwritev(s->cache_file, slot_offset, bytes,
+                              &local_qiov, 0);
+    } else {
+        ret = bdrv_co_preadv(s->cache_file, slot_offset, bytes,
+                             &local_qiov, 0);
+    }
+    e->pinned--;
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+/* Copy the whole block of @e between the backend and the slot */
+static int coroutine_fn blkcache_co_transfer(BlockDriverState *bs,
+                                             BlkcacheEntry *e, bool to_slot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t len = blkcache_block_len(bs, e->index);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    int ret;
+
+    if (!s->cache_file) {
+        buf = s->data + (uint64_t)e->slot * s->block_size;
+    } else {
+        buf = qemu_try_blockalign(bs->file->bs, len);
+        if (!buf) {
+            return -ENOMEM;
+        }
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = len,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    e->pinned++;
+    if (to_slot) {
+        ret = bdrv_co_preadv(bs->file, e->index * s->block_size, len,
+                             &qiov, 0);
+        if (ret >= 0 && s->cache_file) {
+            ret = bdrv_co_pwritev(s->cache_file,
+                                  (uint64_t)e->slot * s->block_size, len,
+                                  &qiov, 0);
+        }
+    } else {
+        ret = 0;
+        if (s->cache_file) {
+            ret = bdrv_co_preadv(s->cache_file,
+                                 (uint64_t)e->slot * s->block_size, len,
+                                 &qiov, 0);
+        }
+        if (ret >= 0) {
+            ret = bdrv_co_pwritev(bs->file, e->index * s->block_size, len,
+                                  &qiov, 0);
+        }
+    }
+    e->pinned--;
+
+    if (s->cache_file) {
+        qemu_vfree(buf);
+    }
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_writeback(BlockDriverState *bs,
+                                              BlkcacheEntry *e)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t generation = e->generation;
+    int ret;
+
+    ret = blkcache_co_transfer(bs, e, false);
+    s->writebacks++;
+
+    /* A write that came in meanwhile may not have made it to the backend */
+    if (ret >= 0 && e->dirty && e->generation == generation) {
+        e->dirty = false;
+        s->nb_dirty--;
+    }
+    return ret;
+}
+
+/* Write back dirty blocks, least recently used first, until @target left */
+static int coroutine_fn blkcache_co_writeback_dirty(BlockDriverState *bs,
+                                                    int target)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *e;
+    int64_t *indexes;
+    int i, n = 0;
+    int ret = 0;
+
+    if (s->nb_dirty <= target) {
+        return 0;
+    }
+
+    /* Entries may be evicted while we yield, so only remember indexes */
+    indexes = g_new(int64_t, s->nb_dirty);
+    QTAILQ_FOREACH_REVERSE(e, &s->lists[BLKCACHE_T1], BlkcacheEntryList,
+                           next) {
+        if (e->dirty && n < s->nb_dirty) {
+            indexes[n++] = e->index;
+        }
+    }
+    QTAILQ_FOREACH_REVERSE(e, &s->lists[BLKCACHE_T2], BlkcacheEntryList,
+                           next) {
+        if (e->dirty && n < s->nb_dirty) {
+            indexes[n++] = e->index;
+        }
+    }
+
+    for (i = 0; i < n && s->nb_dirty > target; i++) {
+        e = g_hash_table_lookup(s->entries, &indexes[i]);
+        if (e && e->dirty) {
+            ret = blkcache_co_writeback(bs, e);
+            if (ret < 0) {
+                break;
+            }
+        }
+    }
+
+    g_free(indexes);
+    return ret;
+}
+
+static BlkcacheSharedSet *blkcache_shared_set(BDRVBlkcacheState *s,
+                                              int64_t index)
+{
+    uint32_t a, b, c;
+
+    a = JHASH_INITVAL + (uint32_t)s->shared_id;
+    b = JHASH_INITVAL + (uint32_t)(s->shared_id >> 32);
+    c = JHASH_INITVAL + (uint32_t)index + (uint32_t)((uint64_t)index >> 32);
+    __jhash_final(a, b, c);
+
+    return &s->shared_sets[c % s->shared_nb_sets];
+}
+
+static uint8_t *blkcache_shared_block(BDRVBlkcacheState *s,
+                                      BlkcacheSharedSet *set, int way)
+{
+    uint64_t slot = (set - s->shared_sets) * BLKCACHE_SHARED_WAYS + way;
+
+    return s->shared_data + slot * s->block_size;
+}
+
+/*
+ * Copy @bytes at @in_block of block @index from the shared cache to @qiov.
+ * Returns false if the block is not cached; @qiov may have been written to
+ * anyway.
+ */
+static bool blkcache_shared_read(BDRVBlkcacheState *s, int64_t index,
+                                 uint64_t in_block, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BlkcacheSharedSet *set = blkcache_shared_set(s, index);
+    int i;
+
+    for (i = 0; i < BLKCACHE_SHARED_WAYS; i++) {
+        BlkcacheSharedSlot *slot = &set->slots[i];
+        uint32_t seq = atomic_load_acquire(&slot->seq);
+
+        /* The key is checked again through the sequence count below */
+        if ((seq & 1) || slot->id != s->shared_id || slot->index != index ||
+            slot->len > s->block_size || slot->len < in_block + bytes) {
+            continue;
+        }
+
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            blkcache_shared_block(s, set, i) + in_block,
+                            bytes);
+
+        /* Finish copying before checking that the slot was not rewritten */
+        smp_rmb();
+        return atomic_read(&slot->seq) == seq;
+    }
+
+    return false;
+}
+
+static void blkcache_shared_insert(BDRVBlkcacheState *s, int64_t index,
+                                   const void *buf, uint32_t len)
+{
+    BlkcacheSharedSet *set = blkcache_shared_set(s, index);
+    BlkcacheSharedSlot *slot = NULL;
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < BLKCACHE_SHARED_WAYS; i++) {
+        BlkcacheSharedSlot *cur = &set->slots[i];
+
+        if (cur->id == s->shared_id && cur->index == index && cur->len) {
+            /* Another process was faster */
+            return;
+        }
+        if (!slot && !atomic_read(&cur->len)) {
+            slot = cur;
+        }
+    }
+    if (!slot) {
+        i = atomic_fetch_inc(&set->hand) % BLKCACHE_SHARED_WAYS;
+        slot = &set->slots[i];
+    }
+    i = slot - set->slots;
+
+    /* atomic_cmpxchg is a full barrier, so readers see the odd count before
+     * any of the new contents */
+    seq = atomic_read(&slot->seq);
+    if ((seq & 1) || atomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        return;
+    }
+
+    slot->id = s->shared_id;
+    slot->index = index;
+    slot->len = len;
+    memcpy(blkcache_shared_block(s, set, i), buf, len);
+
+    atomic_store_release(&slot->seq, seq + 2);
+}
+
+static int64_t blkcache_shared_count(BDRVBlkcacheState *s)
+{
+    uint64_t i;
+    int64_t n = 0;
+    int j;
+
+    for (i = 0; i < s->shared_nb_sets; i++) {
+        for (j = 0; j < BLKCACHE_SHARED_WAYS; j++) {
+            BlkcacheSharedSlot *slot = &s->shared_sets[i].slots[j];
+            if (slot->id == s->shared_id && slot->len &&
+                !(atomic_read(&slot->seq) & 1)) {
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+static uint64_t blkcache_shared_data_offset(uint64_t nb_sets)
+{
+    return QEMU_ALIGN_UP(sizeof(BlkcacheSharedHeader), BLKCACHE_SHARED_ALIGN) +
+           QEMU_ALIGN_UP(nb_sets * sizeof(BlkcacheSharedSet),
+                         BLKCACHE_SHARED_ALIGN);
+}
+
+/* 64-bit FNV-1a */
+static uint64_t blkcache_hash_str(const char *str)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*str) {
+        h ^= (uint8_t)*str++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#ifdef CONFIG_POSIX
+/*
+ * Map the shared cache at @path, creating it with @size bytes of data if it
+ * does not exist.  The block size of an existing cache overrides the one
+ * that was asked for.
+ */
+static int blkcache_shared_open(BDRVBlkcacheState *s, const char *path,
+                                uint64_t size, Error **errp)
+{
+    struct flock fl = {
+        .l_type     = F_WRLCK,
+        .l_whence   = SEEK_SET,
+    };
+    BlkcacheSharedHeader header;
+    struct stat st;
+    uint64_t nb_sets, map_size;
+    void *map;
+    int fd, ret;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not open shared cache '%s'",
+                         path);
+        return ret;
+    }
+
+    /* Only one process may initialize a new file */
+    if (fcntl(fd, F_SETLKW, &fl) < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock shared cache '%s'",
+                         path);
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        nb_sets = size / s->block_size / BLKCACHE_SHARED_WAYS;
+        if (!nb_sets) {
+            error_setg(errp, "Shared cache must hold at least %d blocks",
+                       BLKCACHE_SHARED_WAYS);
+            ret = -EINVAL;
+            goto out;
+        }
+        header = (BlkcacheSharedHeader) {
+            .magic      = BLKCACHE_SHARED_MAGIC,
+            .version    = BLKCACHE_SHARED_VERSION,
+            .block_size = s->block_size,
+            .nb_sets    = nb_sets,
+        };
+        map_size = blkcache_shared_data_offset(nb_sets) +
+                   nb_sets * BLKCACHE_SHARED_WAYS * s->block_size;
+        if (ftruncate(fd, map_size) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not create shared cache "
+                             "'%s'", path);
+            goto out;
+        }
+    } else {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            ret = -EIO;
+            error_setg(errp, "Could not read shared cache '%s'", path);
+            goto out;
+        }
+        if (header.magic != BLKCACHE_SHARED_MAGIC ||
+            header.version != BLKCACHE_SHARED_VERSION ||
+            header.block_size < BDRV_SECTOR_SIZE ||
+            header.block_size > BLKCACHE_MAX_BLOCK_SIZE ||
+            !is_power_of_2(header.block_size) || !header.nb_sets ||
+            header.nb_sets > INT_MAX / 2 / BLKCACHE_SHARED_WAYS)
+        {
+            ret = -EINVAL;
+            error_setg(errp, "'%s' is not a valid shared cache", path);
+            goto out;
+        }
+        s->block_size = header.block_size;
+        nb_sets = header.nb_sets;
+        map_size = blkcache_shared_data_offset(nb_sets) +
+                   nb_sets * BLKCACHE_SHARED_WAYS * s->block_size;
+        if (st.st_size < map_size) {
+            ret = -EINVAL;
+            error_setg(errp, "Shared cache '%s' is truncated", path);
+            goto out;
+        }
+    }
+
+    if (map_size > SIZE_MAX) {
+        ret = -EINVAL;
+        error_setg(errp, "Shared cache '%s' is too large", path);
+        goto out;
+    }
+
+        ret = -EINVAL;
+        error_setg(errp, "Shared cache '%s' is truncated", path);
+        goto out;
+    }
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map shared cache '%s'",
+                         path);
+        goto out;
+    }
+
+    s->shared = map;
+    s->shared_size = map_size;
+    s->shared_nb_sets = nb_sets;
+    s->shared_sets = (void *)((uint8_t *)map +
+                              QEMU_ALIGN_UP(sizeof(BlkcacheSharedHeader),
+                                            BLKCACHE_SHARED_ALIGN));
+    s->shared_data = (uint8_t *)map + blkcache_shared_data_offset(nb_sets);
+    ret = 0;
+
+out:
+    fl.l_type = F_UNLCK;
+    fcntl(fd, F_SETLK, &fl);
+    qemu_close(fd);
+    return ret;
+}
+#else
+static int blkcache_shared_open(BDRVBlkcacheState *s, const char *path,
+                                uint64_t size, Error **errp)
+{
+    error_setg(errp, "Shared caches are not supported on this host");
+    return -ENOTSUP;
+}
+#endif
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *shared_path, *shared_id;
+    uint64_t cache_size;
+    int64_t cache_file_len = 0;
+    int i, ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_file, true, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->block_size = qemu_opt_get_size(opts, BLKCACHE_OPT_BLOCK_SIZE,
+                                      BLKCACHE_DEFAULT_BLOCK_SIZE);
+    if (s->block_size < BDRV_SECTOR_SIZE ||
+        s->block_size > BLKCACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(s->block_size))
+    {
+        error_setg(errp, "Block size must be a power of two between %d and "
+                   "%d", BDRV_SECTOR_SIZE, BLKCACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = BLKCACHE_DEFAULT_CACHE_SIZE;
+    if (s->cache_file) {
+        cache_file_len = bdrv_getlength(s->cache_file->bs);
+        if (cache_file_len < 0) {
+            error_setg_errno(errp, -cache_file_len,
+                             "Could not get the size of the cache file");
+            ret = cache_file_len;
+            goto fail;
+        }
+        cache_size = cache_file_len;
+    }
+    cache_size = qemu_opt_get_size(opts, BLKCACHE_OPT_CACHE_SIZE, cache_size);
+    if (s->cache_file && cache_size > cache_file_len) {
+        error_setg(errp, "Cache size is larger than the cache file");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (cache_size < s->block_size ||
+        cache_size / s->block_size > INT_MAX / 2)
+    {
+        error_setg(errp, "Cache size must hold between one and %d blocks",
+                   INT_MAX / 2);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->nb_slots = cache_size / s->block_size;
+
+    shared_path = qemu_opt_get(opts, BLKCACHE_OPT_SHARED_CACHE);
+    if (shared_path) {
+        if (s->cache_file) {
+            error_setg(errp, "cache-file and shared-cache cannot be combined");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (flags & BDRV_O_RDWR) {
+            error_setg(errp, "shared-cache can only be used read-only");
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        shared_id = qemu_opt_get(opts, BLKCACHE_OPT_SHARED_ID);
+        if (!shared_id) {
+            shared_id = bs->file->bs->filename;
+        }
+        if (!shared_id[0]) {
+            error_setg(errp, "shared-id is needed for this image");
+            ret = -EINVAL;
+            goto fail;
+        }
+        /* Mix in the length so that a replaced image does not match */
+        s->shared_id = blkcache_hash_str(shared_id) ^
+                       bdrv_getlength(bs->file->bs);
+
+        ret = blkcache_shared_open(s, shared_path, cache_size, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        s->nb_slots = s->shared_nb_sets * BLKCACHE_SHARED_WAYS;
+    } else if (!s->cache_file) {
+        s->data = qemu_try_blockalign(bs->file->bs,
+                                      (size_t)s->nb_slots * s->block_size);
+        if (!s->data) {
+            error_setg(errp, "Could not allocate the cache");
+            ret = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    s->writeback = qemu_opt_get_bool(opts, BLKCACHE_OPT_WRITEBACK, true);
+
+    if (!s->shared) {
+        s->free_slots = g_new(int, s->nb_slots);
+        for (i = 0; i < s->nb_slots; i++) {
+            s->free_slots[i] = s->nb_slots - 1 - i;
+        }
+        s->nb_free_slots = s->nb_slots;
+    }
+
+    s->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < BLKCACHE_NUM_LISTS; i++) {
+        QTAILQ_INIT(&s->lists[i]);
+    }
+    qemu_co_queue_init(&s->load_queue);
+
+    bs->supported_write_flags = BDRV_REQ_FUA &
+        bs->file->bs->supported_write_flags;
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        bdrv_unref_child(bs, s->cache_file);
+        s->cache_file = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *e, *next_e;
+    int i;
+
+    for (i = 0; i < BLKCACHE_NUM_LISTS; i++) {
+        QTAILQ_FOREACH_SAFE(e, &s->lists[i], next, next_e) {
+            g_free(e);
+        }
+    }
+    g_hash_table_destroy(s->entries);
+    g_free(s->free_slots);
+    qemu_vfree(s->data);
+#ifdef CONFIG_POSIX
+    if (s->shared) {
+        munmap(s->shared, s->shared_size);
+    }
+#endif
+
+    bdrv_unref_child(bs, s->cache_file);
+    s->cache_file = NULL;
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn
+blkcache_co_preadv_shared(BlockDriverState *bs, uint64_t offset,
+                          uint64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t done = 0;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        int64_t index = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(s->block_size - in_block, bytes - done);
+        uint64_t len = blkcache_block_len(bs, index);
+        QEMUIOVector local_qiov;
+        struct iovec iov;
+
+        if (blkcache_shared_read(s, index, in_block, n, qiov, done)) {
+            s->read_hits++;
+            done += n;
+            continue;
+        }
+        s->read_misses++;
+
+        if (!buf) {
+            buf = qemu_try_blockalign(bs->file->bs, s->block_size);
+            if (!buf) {
+                return -ENOMEM;
+            }
+        }
+
+        iov = (struct iovec) {
+            .iov_base   = buf,
+            .iov_len    = len,
+        };
+        qemu_iovec_init_external(&local_qiov, &iov, 1);
+        ret = bdrv_co_preadv(bs->file, index * s->block_size, len,
+                             &local_qiov, 0);
+        if (ret < 0) {
+            break;
+        }
+
+        blkcache_shared_insert(s, index, buf, len);
+        qemu_iovec_from_buf(qiov, done, buf + in_block, n);
+        done += n;
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn
+blkcache_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                   QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret;
+
+    if (s->shared) {
+        return blkcache_co_preadv_shared(bs, offset, bytes, qiov);
+    }
+
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        int64_t index = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(s->block_size - in_block, bytes - done);
+        BlkcacheEntry *e;
+        bool hit;
+
+        e = blkcache_co_get(s, index, &hit);
+        if (!e) {
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init(&local_qiov, qiov->niov);
+            qemu_iovec_concat(&local_qiov, qiov, done, n);
+            ret = bdrv_co_preadv(bs->file, pos, n, &local_qiov, 0);
+            qemu_iovec_destroy(&local_qiov);
+        } else {
+            if (hit) {
+                s->read_hits++;
+                ret = 0;
+            } else {
+                s->read_misses++;
+                ret = blkcache_co_transfer(bs, e, true);
+                blkcache_load_done(s, e, ret);
+            }
+            if (ret >= 0) {
+                ret = blkcache_co_slot_io(bs, e, in_block, n, qiov, done,
+                                          false);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Update the cached copy of blocks that a write to the backend changed */
+static int coroutine_fn blkcache_co_update(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret;
+
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        int64_t index = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(s->block_size - in_block, bytes - done);
+        BlkcacheEntry *e;
+
+        e = g_hash_table_lookup(s->entries, &index);
+        while (e && e->loading) {
+            qemu_co_queue_wait(&s->load_queue, NULL);
+            e = g_hash_table_lookup(s->entries, &index);
+        }
+        if (e && e->slot >= 0) {
+            e->generation++;
+            ret = blkcache_co_slot_io(bs, e, in_block, n, qiov, done, true);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        done += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn
+blkcache_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                    QEMUIOVector *qiov, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t done = 0;
+    int ret;
+
+    if (!s->writeback || (flags & BDRV_REQ_FUA)) {
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+        if (ret < 0) {
+            return ret;
+        }
+        return blkcache_co_update(bs, offset, bytes, qiov);
+    }
+
+    while (done < bytes) {
+        uint64_t pos = offset + done;
+        int64_t index = pos / s->block_size;
+        uint64_t in_block = pos % s->block_size;
+        uint64_t n = MIN(s->block_size - in_block, bytes - done);
+        BlkcacheEntry *e;
+        bool hit;
+
+        e = blkcache_co_get(s, index, &hit);
+        if (!e) {
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init(&local_qiov, qiov->niov);
+            qemu_iovec_concat(&local_qiov, qiov, done, n);
+            ret = bdrv_co_pwritev(bs->file, pos, n, &local_qiov, 0);
+            qemu_iovec_destroy(&local_qiov);
+            if (ret < 0) {
+                return ret;
+            }
+            done += n;
+            continue;
+        }
+
+        ret = 0;
+        if (hit) {
+            s->write_hits++;
+        } else {
+            s->write_misses++;
+            /* Partial writes need the rest of the block first */
+            if (n < blkcache_block_len(bs, index)) {
+                ret = blkcache_co_transfer(bs, e, true);
+            }
+        }
+        if (ret >= 0) {
+            e->generation++;
+            ret = blkcache_co_slot_io(bs, e, in_block, n, qiov, done, true);
+        }
+        if (ret >= 0 && !e->dirty) {
+            e->dirty = true;
+            s->nb_dirty++;
+        }
+        if (!hit) {
+            blkcache_load_done(s, e, ret);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += n;
+    }
+
+    /* Keep enough clean blocks around that reads can still be cached */
+    if (s->nb_dirty > s->nb_slots / 2) {
+        return blkcache_co_writeback_dirty(bs, s->nb_slots / 4);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_flush_to_os(BlockDriverState *bs)
+{
+    return blkcache_co_writeback_dirty(bs, 0);
+}
+
+static void blkcache_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *e, *next_e;
+    int i;
+
+    /* The image may have been changed by someone else, e.g. the migration
+     * source, so drop everything that was read from it */
+    for (i = 0; i < BLKCACHE_NUM_LISTS; i++) {
+        QTAILQ_FOREACH_SAFE(e, &s->lists[i], next, next_e) {
+            if (blkcache_evictable(e)) {
+                blkcache_drop(s, e);
+            }
+        }
+    }
+    s->target_t1 = 0;
+}
+
+static BlockStatsSpecific *blkcache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new0(BlockStatsSpecific, 1);
+
+    stats->type = BLOCK_STATS_SPECIFIC_KIND_BLKCACHE;
+    stats->u.blkcache.data = g_new(BlockStatsSpecificBlkcache, 1);
+    *stats->u.blkcache.data = (BlockStatsSpecificBlkcache) {
+        .cache_size     = (int64_t)s->nb_slots * s->block_size,
+        .block_size     = s->block_size,
+        .cached_blocks  = s->shared ? blkcache_shared_count(s) :
+                          s->list_len[BLKCACHE_T1] +
+                          s->list_len[BLKCACHE_T2],
+        .dirty_blocks   = s->nb_dirty,
+        .read_hits      = s->read_hits,
+        .read_misses    = s->read_misses,
+        .write_hits     = s->write_hits,
+        .write_misses   = s->write_misses,
+        .writebacks     = s->writebacks,
+    };
+
+    return stats;
+}
+
+static bool blkcache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                      = "blkcache",
+    .protocol_name                    = "blkcache",
+    .instance_size                    = sizeof(BDRVBlkcacheState),
+
+    .bdrv_file_open                   = blkcache_open,
+    .bdrv_close                       = blkcache_close,
+    .bdrv_getlength                   = blkcache_getlength,
+    .bdrv_invalidate_cache            = blkcache_invalidate_cache,
+    .bdrv_get_specific_stats          = blkcache_get_specific_stats,
+
+    .bdrv_co_preadv                   = blkcache_co_preadv,
+    .bdrv_co_pwritev                  = blkcache_co_pwritev,
+    .bdrv_co_flush_to_os              = blkcache_co_flush_to_os,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = blkcache_recurse_is_first_non_filter,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
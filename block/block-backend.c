@@ -26,6 +26,9 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+/* Maximum number of requests that are held back for merging */
+#define BLK_MERGE_MAX_REQS 32
+
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
 
 struct BlockBackend {
@@ -62,6 +65,13 @@ struct BlockBackend {
     bool allow_write_beyond_eof;
 
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
+
+    /* Request merging, see blk_set_merge_requests() */
+    bool merge_requests;
+    unsigned int io_plugged;
+    bool merge_bh_scheduled;
+    unsigned int merge_queue_len;
+    QSIMPLEQ_HEAD(, BlkAioEmAIOCB) merge_queue;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -134,6 +144,8 @@ BlockBackend *blk_new(void)
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
 
+    QSIMPLEQ_INIT(&blk->merge_queue);
+
     QTAILQ_INSERT_TAIL(&block_backends, blk, link);
     return blk;
 }
@@ -965,8 +977,22 @@ typedef struct BlkAioEmAIOCB {
     BlkRwCo rwco;
     int bytes;
     bool has_returned;
+    CoroutineEntry *co_entry;
+    QSIMPLEQ_ENTRY(BlkAioEmAIOCB) merge_next;
 } BlkAioEmAIOCB;
 
+/* Contiguous requests of the same type, submitted as one */
+typedef struct BlkMergedReq {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    BlkAioEmAIOCB **reqs;
+    int nb_reqs;
+} BlkMergedReq;
+
+static void blk_aio_read_entry(void *opaque);
+static void blk_aio_write_entry(void *opaque);
+static void blk_merge_queue_add(BlockBackend *blk, BlkAioEmAIOCB *acb);
+
 static const AIOCBInfo blk_aio_em_aiocb_info = {
     .aiocb_size         = sizeof(BlkAioEmAIOCB),
 };
@@ -1006,6 +1032,13 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     };
     acb->bytes = bytes;
     acb->has_returned = false;
+    acb->co_entry = co_entry;
+
+    if (blk->merge_requests && qiov &&
+        (co_entry == blk_aio_read_entry || co_entry == blk_aio_write_entry)) {
+        blk_merge_queue_add(blk, acb);
+        return &acb->common;
+    }
 
     co = qemu_coroutine_create(co_entry, acb);
     qemu_coroutine_enter(co);
@@ -1041,6 +1074,165 @@ static void blk_aio_write_entry(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void blk_aio_merged_entry(void *opaque)
+{
+    BlkMergedReq *mr = opaque;
+    BlkAioEmAIOCB *first = mr->reqs[0];
+    int i, ret;
+
+    if (first->co_entry == blk_aio_write_entry) {
+        ret = blk_co_pwritev(mr->blk, first->rwco.offset, mr->qiov.size,
+                             &mr->qiov, first->rwco.flags);
+    } else {
+        ret = blk_co_preadv(mr->blk, first->rwco.offset, mr->qiov.size,
+                            &mr->qiov, first->rwco.flags);
+    }
+
+    for (i = 0; i < mr->nb_reqs; i++) {
+        mr->reqs[i]->rwco.ret = ret;
+        blk_aio_complete(mr->reqs[i]);
+    }
+
+    qemu_iovec_destroy(&mr->qiov);
+    g_free(mr->reqs);
+    g_free(mr);
+}
+
+/* Submits @nb_reqs contiguous requests with a single coroutine */
+static void blk_merge_submit(BlockBackend *blk, BlkAioEmAIOCB **reqs,
+                             int nb_reqs, int niov)
+{
+    Coroutine *co;
+    int i;
+
+    if (nb_reqs == 1) {
+        co = qemu_coroutine_create(reqs[0]->co_entry, reqs[0]);
+    } else {
+        BlkMergedReq *mr = g_new(BlkMergedReq, 1);
+
+        *mr = (BlkMergedReq) {
+            .blk        = blk,
+            .reqs       = g_memdup(reqs, nb_reqs * sizeof(reqs[0])),
+            .nb_reqs    = nb_reqs,
+        };
+        qemu_iovec_init(&mr->qiov, niov);
+        for (i = 0; i < nb_reqs; i++) {
+            qemu_iovec_concat(&mr->qiov, reqs[i]->rwco.qiov, 0,
+                              reqs[i]->bytes);
+        }
+        co = qemu_coroutine_create(blk_aio_merged_entry, mr);
+    }
+    qemu_coroutine_enter(co);
+
+    /* As in blk_aio_prwv(), requests that completed without yielding must
+     * not call back into the device model from here */
+    for (i = 0; i < nb_reqs; i++) {
+        reqs[i]->has_returned = true;
+        if (reqs[i]->rwco.ret != NOT_DONE) {
+            aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+                                    blk_aio_complete_bh, reqs[i]);
+        }
+    }
+}
+
+static int blk_merge_compare(const void *a, const void *b)
+{
+    const BlkAioEmAIOCB *req1 = *(BlkAioEmAIOCB * const *) a;
+    const BlkAioEmAIOCB *req2 = *(BlkAioEmAIOCB * const *) b;
+
+    /* Group reads and writes, then sort by offset */
+    if (req1->co_entry != req2->co_entry) {
+        return req1->co_entry == blk_aio_write_entry ? 1 : -1;
+    }
+    if (req1->rwco.offset != req2->rwco.offset) {
+        return req1->rwco.offset < req2->rwco.offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Submits all held back requests, merging contiguous ones */
+static void blk_merge_flush(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    BlkAioEmAIOCB **reqs;
+    uint64_t max_transfer = blk_get_max_transfer(blk);
+    int max_iov = bs ? blk_get_max_iov(blk) : IOV_MAX;
+    int n = blk->merge_queue_len;
+    int i, j;
+
+    if (n == 0) {
+        return;
+    }
+
+    reqs = g_new(BlkAioEmAIOCB *, n);
+    for (i = 0; i < n; i++) {
+        reqs[i] = QSIMPLEQ_FIRST(&blk->merge_queue);
+        QSIMPLEQ_REMOVE_HEAD(&blk->merge_queue, merge_next);
+    }
+    blk->merge_queue_len = 0;
+
+    qsort(reqs, n, sizeof(reqs[0]), blk_merge_compare);
+
+    if (bs) {
+        bdrv_io_plug(bs);
+    }
+    for (i = 0; i < n; i = j) {
+        uint64_t bytes = reqs[i]->bytes;
+        int niov = reqs[i]->rwco.qiov->niov;
+
+        for (j = i + 1; j < n; j++) {
+            BlkAioEmAIOCB *prev = reqs[j - 1];
+            BlkAioEmAIOCB *acb = reqs[j];
+
+            if (acb->co_entry != prev->co_entry ||
+                acb->rwco.flags != prev->rwco.flags ||
+                acb->rwco.offset != prev->rwco.offset + prev->bytes ||
+                bytes + acb->bytes > max_transfer ||
+                niov + acb->rwco.qiov->niov > max_iov) {
+                break;
+            }
+            bytes += acb->bytes;
+            niov += acb->rwco.qiov->niov;
+        }
+
+        blk_merge_submit(blk, &reqs[i], j - i, niov);
+    }
+    if (bs) {
+        bdrv_io_unplug(bs);
+    }
+
+    g_free(reqs);
+}
+
+static void blk_merge_flush_bh(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    blk->merge_bh_scheduled = false;
+    blk_merge_flush(blk);
+    blk_unref(blk);
+}
+
+/*
+ * Holds back @acb until the device model unplugs the BlockBackend or, at the
+ * latest, until the event loop runs again.  A bottom half is scheduled even
+ * while plugged, so that a nested event loop (e.g. in drain) never waits for
+ * requests that were not submitted yet.
+ */
+static void blk_merge_queue_add(BlockBackend *blk, BlkAioEmAIOCB *acb)
+{
+    QSIMPLEQ_INSERT_TAIL(&blk->merge_queue, acb, merge_next);
+
+    if (++blk->merge_queue_len >= BLK_MERGE_MAX_REQS) {
+        blk_merge_flush(blk);
+    } else if (!blk->merge_bh_scheduled) {
+        blk->merge_bh_scheduled = true;
+        blk_ref(blk);
+        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
+                                blk_merge_flush_bh, blk);
+    }
+}
+
 BlockAIOCB *blk_aio_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                                   int count, BdrvRequestFlags flags,
                                   BlockCompletionFunc *cb, void *opaque)
@@ -1210,6 +1402,25 @@ int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int count)
     return bdrv_co_pdiscard(blk_bs(blk), offset, count);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range(blk_in->root, off_in,
+                              blk_out->root, off_out, bytes, flags);
+}
+
 int blk_co_flush(BlockBackend *blk)
 {
     if (!blk_is_available(blk)) {
@@ -1353,6 +1564,20 @@ void blk_set_enable_write_cache(BlockBackend *blk, bool wce)
     blk->enable_write_cache = wce;
 }
 
+/*
+ * If @enable is true, read and write requests from blk_aio_preadv() and
+ * blk_aio_pwritev() are held back briefly and contiguous ones are submitted
+ * as a single request.  Requests are submitted when the BlockBackend is
+ * unplugged, when BLK_MERGE_MAX_REQS are pending, or from a bottom half.
+ */
+void blk_set_merge_requests(BlockBackend *blk, bool enable)
+{
+    blk->merge_requests = enable;
+    if (!enable) {
+        blk_merge_flush(blk);
+    }
+}
+
 void blk_invalidate_cache(BlockBackend *blk, Error **errp)
 {
     BlockDriverState *bs = blk_bs(blk);
@@ -1560,6 +1785,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    blk->io_plugged++;
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -1569,6 +1795,11 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    assert(blk->io_plugged);
+    if (--blk->io_plugged == 0) {
+        /* Submit while the BDS is still plugged so that it can batch */
+        blk_merge_flush(blk);
+    }
     if (bs) {
         bdrv_io_unplug(bs);
     }
@@ -388,6 +388,7 @@ int bdrv_commit(BlockDriverState *bs)
 
     if (drv->bdrv_make_empty) {
         ret = drv->bdrv_make_empty(bs);
+        bdrv_block_status_cache_invalidate(bs);
         if (ret < 0) {
             goto ro_cleanup;
         }
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -35,10 +36,20 @@
 #define BLOCK_CRYPTO_OPT_LUKS_HASH_ALG "hash-alg"
 #define BLOCK_CRYPTO_OPT_LUKS_ITER_TIME "iter-time"
 
+/* Upper bound on the threads encrypting for one image */
+#define BLOCK_CRYPTO_MAX_JOBS 8
+/* Requests are only split into pieces of at least this size */
+#define BLOCK_CRYPTO_MIN_JOB_SIZE (64 * 1024)
+
 typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+
+    /* Encryption jobs in the thread pool, at most max_jobs at a time */
+    int nb_jobs;
+    int max_jobs;
+    CoQueue job_queue;
 };
 
 
@@ -315,10 +326,20 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     if (flags & BDRV_O_NO_IO) {
         cflags |= QCRYPTO_BLOCK_OPEN_NO_IO;
     }
+
+    crypto->max_jobs = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    crypto->max_jobs = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                                  BLOCK_CRYPTO_MAX_JOBS));
+#endif
+    qemu_co_queue_init(&crypto->job_queue);
+
+    /* One more cipher for requests processed in the AioContext itself */
     crypto->block = qcrypto_block_open(open_opts,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       crypto->max_jobs + 1,
                                        errp);
 
     if (!crypto->block) {
@@ -393,7 +414,118 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+#define BLOCK_CRYPTO_MAX_SECTORS 2048
+
+typedef struct BlockCryptoRequest {
+    BlockCrypto *crypto;
+    bool encrypt;
+    int pending;
+    int ret;
+    Coroutine *co;
+} BlockCryptoRequest;
+
+typedef struct BlockCryptoJob {
+    BlockCryptoRequest *req;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+} BlockCryptoJob;
+
+static int block_crypto_job_func(void *opaque)
+{
+    BlockCryptoJob *job = opaque;
+    QCryptoBlock *block = job->req->crypto->block;
+    int ret;
+
+    if (job->req->encrypt) {
+        ret = qcrypto_block_encrypt(block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(block, job->sector_num,
+                                    job->buf, job->len, NULL);
+    }
+
+    return ret < 0 ? -EIO : 0;
+}
+
+static void block_crypto_job_cb(void *opaque, int ret)
+{
+    BlockCryptoJob *job = opaque;
+    BlockCryptoRequest *req = job->req;
+
+    if (ret < 0) {
+        req->ret = ret;
+    }
+    req->crypto->nb_jobs--;
+    qemu_co_enter_next(&req->crypto->job_queue);
+
+    if (--req->pending == 0 && req->co) {
+        aio_co_wake(req->co);
+    }
+}
+
+/*
+ * Encrypt or decrypt @len bytes of @buf in place.  Large buffers are
+ * split at sector boundaries and processed by several threads at once;
+ * the AioContext thread only waits for them.
+ */
+static coroutine_fn int
+block_crypto_co_crypt(BlockDriverState *bs, int64_t sector_num,
+                      uint8_t *buf, size_t len, bool encrypt)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoRequest req = {
+        .crypto = crypto,
+        .encrypt = encrypt,
+    };
+    BlockCryptoJob jobs[BLOCK_CRYPTO_MAX_JOBS];
+    size_t chunk;
+    int i, n;
+
+    n = MIN(crypto->max_jobs, len / BLOCK_CRYPTO_MIN_JOB_SIZE);
+    if (n <= 1) {
+        int ret;
+
+        if (encrypt) {
+            ret = qcrypto_block_encrypt(crypto->block, sector_num,
+                                        buf, len, NULL);
+        } else {
+            ret = qcrypto_block_decrypt(crypto->block, sector_num,
+                                        buf, len, NULL);
+        }
+        return ret < 0 ? -EIO : 0;
+    }
+
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(len, n), BDRV_SECTOR_SIZE);
+    for (i = 0; i < n && len; i++) {
+        while (crypto->nb_jobs >= crypto->max_jobs) {
+            qemu_co_queue_wait(&crypto->job_queue, NULL);
+        }
+
+        jobs[i] = (BlockCryptoJob) {
+            .req = &req,
+            .sector_num = sector_num,
+            .buf = buf,
+            .len = MIN(chunk, len),
+        };
+        crypto->nb_jobs++;
+        req.pending++;
+        thread_pool_submit_aio(pool, block_crypto_job_func, &jobs[i],
+                               block_crypto_job_cb, &jobs[i]);
+
+        sector_num += jobs[i].len / BDRV_SECTOR_SIZE;
+        buf += jobs[i].len;
+        len -= jobs[i].len;
+    }
+
+    if (req.pending) {
+        req.co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    return req.ret;
+}
 
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -439,11 +571,10 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num,
+                                    cipher_data, cur_nr_sectors * 512,
+                                    false);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -500,11 +631,10 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num,
+                                    cipher_data, cur_nr_sectors * 512,
+                                    true);
+        if (ret < 0) {
             goto cleanup;
         }
 
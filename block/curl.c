@@ -71,8 +71,11 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
                    CURLPROTO_FTP | CURLPROTO_FTPS)
 
 #define CURL_NUM_STATES 8
+#define CURL_MAX_STATES 64
 #define CURL_NUM_ACB    8
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define READ_AHEAD_MAX_DEFAULT (2 * 1024 * 1024)
+#define CURL_CACHE_BLOCK_SIZE (64 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -82,6 +85,9 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 
 #define CURL_BLOCK_OPT_URL       "url"
 #define CURL_BLOCK_OPT_READAHEAD "readahead"
+#define CURL_BLOCK_OPT_READAHEAD_MAX "readahead-max"
+#define CURL_BLOCK_OPT_CONNECTIONS "connections"
+#define CURL_BLOCK_OPT_CACHE_SIZE "cache-size"
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
 #define CURL_BLOCK_OPT_TIMEOUT "timeout"
 #define CURL_BLOCK_OPT_COOKIE    "cookie"
@@ -123,13 +129,31 @@ typedef struct CURLState
     char in_use;
 } CURLState;
 
+/* A CURL_CACHE_BLOCK_SIZE aligned block of the image in the LRU cache */
+typedef struct CURLCacheBlock {
+    gint64 index;
+    char *data;
+    QTAILQ_ENTRY(CURLCacheBlock) next;
+} CURLCacheBlock;
+
 typedef struct BDRVCURLState {
     CURLM *multi;
     QEMUTimer timer;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
+    /* Readahead grows from readahead_size up to readahead_max while the
+     * guest reads sequentially */
     size_t readahead_size;
+    size_t readahead_max;
+    size_t cur_readahead;
+    size_t last_end;
+    /* LRU cache of completed transfers, most recently used first */
+    GHashTable *cache;
+    QTAILQ_HEAD(CURLCacheBlockHead, CURLCacheBlock) cache_lru;
+    size_t cache_size;
+    size_t cache_used;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -217,8 +241,9 @@ static size_t curl_header_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     size_t realsize = size * nmemb;
     const char *accept_line = "Accept-Ranges: bytes";
 
+    /* HTTP/2 header names are lower case */
     if (realsize >= strlen(accept_line)
-        && strncmp((char *)ptr, accept_line, strlen(accept_line)) == 0) {
+        && strncasecmp((char *)ptr, accept_line, strlen(accept_line)) == 0) {
         s->accept_range = true;
     }
 
@@ -274,6 +299,108 @@ read_end:
     return size * nmemb;
 }
 
+static void curl_cache_free_block(BDRVCURLState *s, CURLCacheBlock *block)
+{
+    QTAILQ_REMOVE(&s->cache_lru, block, next);
+    g_hash_table_remove(s->cache, &block->index);
+    s->cache_used -= CURL_CACHE_BLOCK_SIZE;
+    g_free(block->data);
+    g_free(block);
+}
+
+static void curl_cache_clear(BDRVCURLState *s)
+{
+    while (!QTAILQ_EMPTY(&s->cache_lru)) {
+        curl_cache_free_block(s, QTAILQ_FIRST(&s->cache_lru));
+    }
+}
+
+/* Add the blocks that a finished transfer fully covers to the cache */
+static void curl_cache_insert(BDRVCURLState *s, CURLState *state)
+{
+    size_t end = state->buf_start + state->buf_off;
+    gint64 index;
+
+    if (!s->cache) {
+        return;
+    }
+
+    for (index = DIV_ROUND_UP(state->buf_start, CURL_CACHE_BLOCK_SIZE);
+         index * CURL_CACHE_BLOCK_SIZE < end; index++) {
+        size_t block_start = index * CURL_CACHE_BLOCK_SIZE;
+        size_t block_len = MIN(CURL_CACHE_BLOCK_SIZE, s->len - block_start);
+        CURLCacheBlock *block;
+
+        if (block_start + block_len > end) {
+            break;
+        }
+
+        block = g_hash_table_lookup(s->cache, &index);
+        if (block) {
+            QTAILQ_REMOVE(&s->cache_lru, block, next);
+            QTAILQ_INSERT_HEAD(&s->cache_lru, block, next);
+            continue;
+        }
+
+        while (s->cache_used + CURL_CACHE_BLOCK_SIZE > s->cache_size) {
+            curl_cache_free_block(s, QTAILQ_LAST(&s->cache_lru,
+                                                 CURLCacheBlockHead));
+        }
+
+        block = g_new(CURLCacheBlock, 1);
+        block->index = index;
+        block->data = g_malloc(block_len);
+        memcpy(block->data, state->orig_buf + block_start - state->buf_start,
+               block_len);
+        g_hash_table_insert(s->cache, &block->index, block);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, next);
+        s->cache_used += CURL_CACHE_BLOCK_SIZE;
+    }
+}
+
+/* Complete @acb from the cache if all of [start, start + len) is cached */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            CURLAIOCB *acb)
+{
+    size_t clamped_end = MIN(start + len, s->len);
+    size_t pos;
+    gint64 index;
+
+    if (!s->cache) {
+        return false;
+    }
+
+    for (pos = start; pos < clamped_end;
+         pos = QEMU_ALIGN_DOWN(pos, CURL_CACHE_BLOCK_SIZE) +
+               CURL_CACHE_BLOCK_SIZE) {
+        index = pos / CURL_CACHE_BLOCK_SIZE;
+        if (!g_hash_table_lookup(s->cache, &index)) {
+            return false;
+        }
+    }
+
+    for (pos = start; pos < clamped_end; ) {
+        size_t in_block = pos % CURL_CACHE_BLOCK_SIZE;
+        size_t n = MIN(CURL_CACHE_BLOCK_SIZE - in_block, clamped_end - pos);
+        CURLCacheBlock *block;
+
+        index = pos / CURL_CACHE_BLOCK_SIZE;
+        block = g_hash_table_lookup(s->cache, &index);
+        QTAILQ_REMOVE(&s->cache_lru, block, next);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, next);
+
+        qemu_iovec_from_buf(acb->qiov, pos - start, block->data + in_block, n);
+        pos += n;
+    }
+    if (clamped_end < start + len) {
+        qemu_iovec_memset(acb->qiov, clamped_end - start, 0,
+                          start + len - clamped_end);
+    }
+
+    acb->common.cb(acb->common.opaque, 0);
+    return true;
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
@@ -282,7 +409,7 @@ static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
     size_t clamped_end = MIN(end, s->len);
     size_t clamped_len = clamped_end - start;
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         CURLState *state = &s->states[i];
         size_t buf_end = (state->buf_start + state->buf_off);
         size_t buf_fend = (state->buf_start + state->buf_len);
@@ -353,7 +480,9 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                               (char **)&state);
 
             /* ACBs for successful messages get completed in curl_read_cb */
-            if (msg->data.result != CURLE_OK) {
+            if (msg->data.result == CURLE_OK) {
+                curl_cache_insert(s, state);
+            } else {
                 int i;
                 static int errcount = 100;
 
@@ -450,7 +579,7 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
     int i, j;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
+        for (i = 0; i < s->num_states; i++) {
             for (j=0; j<CURL_NUM_ACB; j++)
                 if (s->states[i].acb[j])
                     continue;
@@ -487,6 +616,13 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
         curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
         curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
         curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        /* Use HTTP/2 where the server supports it, so that range requests
+         * are multiplexed over a single connection */
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
         if (s->username) {
             curl_easy_setopt(state->curl, CURLOPT_USERNAME, s->username);
@@ -551,7 +687,7 @@ static void curl_detach_aio_context(BlockDriverState *bs)
     BDRVCURLState *s = bs->opaque;
     int i;
 
-    for (i = 0; i < CURL_NUM_STATES; i++) {
+    for (i = 0; i < s->num_states; i++) {
         if (s->states[i].in_use) {
             curl_clean_state(&s->states[i]);
         }
@@ -583,6 +719,13 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     s->multi = curl_multi_init();
     s->aio_context = new_context;
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    curl_multi_setopt(s->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      (long)s->num_states);
+#endif
 #ifdef NEED_CURL_TIMER_CALLBACK
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
@@ -603,6 +746,21 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = CURL_BLOCK_OPT_READAHEAD_MAX,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum readahead size for sequential reads",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of parallel transfers",
+        },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the in-memory block cache",
+        },
         {
             .name = CURL_BLOCK_OPT_SSLVERIFY,
             .type = QEMU_OPT_BOOL,
@@ -677,6 +835,34 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->readahead_max = qemu_opt_get_size(opts, CURL_BLOCK_OPT_READAHEAD_MAX,
+                                         MAX(s->readahead_size,
+                                             READ_AHEAD_MAX_DEFAULT));
+    if ((s->readahead_max & 0x1ff) != 0 ||
+        s->readahead_max < s->readahead_size) {
+        error_setg(errp, "readahead-max must be a multiple of 512 and not "
+                   "smaller than readahead");
+        goto out_noclean;
+    }
+    s->cur_readahead = s->readahead_size;
+    s->last_end = 0;
+
+    s->num_states = qemu_opt_get_number(opts, CURL_BLOCK_OPT_CONNECTIONS,
+                                        CURL_NUM_STATES);
+    if (s->num_states < 1 || s->num_states > CURL_MAX_STATES) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   CURL_MAX_STATES);
+        goto out_noclean;
+    }
+    s->states = g_new0(CURLState, s->num_states);
+
+    s->cache_size = qemu_opt_get_size(opts, CURL_BLOCK_OPT_CACHE_SIZE, 0);
+    QTAILQ_INIT(&s->cache_lru);
+    s->cache_used = 0;
+    if (s->cache_size >= CURL_CACHE_BLOCK_SIZE) {
+        s->cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
     if (s->timeout > CURL_TIMEOUT_MAX) {
@@ -781,6 +967,12 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    if (s->cache) {
+        g_hash_table_destroy(s->cache);
+        s->cache = NULL;
+    }
+    g_free(s->states);
+    s->states = NULL;
     g_free(s->cookie);
     g_free(s->url);
     qemu_opts_del(opts);
@@ -808,6 +1000,20 @@ static void curl_readv_bh_cb(void *p)
 
     aio_context_acquire(ctx);
 
+    /* Grow the readahead while the guest reads sequentially */
+    if (start == s->last_end) {
+        s->cur_readahead = MIN(MAX(s->cur_readahead * 2, BDRV_SECTOR_SIZE),
+                               s->readahead_max);
+    } else {
+        s->cur_readahead = s->readahead_size;
+    }
+    s->last_end = start + acb->nb_sectors * BDRV_SECTOR_SIZE;
+
+    if (curl_cache_read(s, start, acb->nb_sectors * BDRV_SECTOR_SIZE, acb)) {
+        qemu_aio_unref(acb);
+        goto out;
+    }
+
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
     switch (curl_find_buf(s, start, acb->nb_sectors * BDRV_SECTOR_SIZE, acb)) {
@@ -833,7 +1039,7 @@ static void curl_readv_bh_cb(void *p)
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = MIN(acb->end + s->readahead_size, s->len - start);
+    state->buf_len = MIN(acb->end + s->cur_readahead, s->len - start);
     end = start + state->buf_len - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -884,6 +1090,13 @@ static void curl_close(BlockDriverState *bs)
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
 
+    if (s->cache) {
+        curl_cache_clear(s);
+        g_hash_table_destroy(s->cache);
+        s->cache = NULL;
+    }
+    g_free(s->states);
+    s->states = NULL;
     g_free(s->cookie);
     g_free(s->url);
 }
@@ -33,6 +33,15 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+/* Time slice for the copy-on-read prefetch rate limit */
+#define BDRV_COR_PREFETCH_SLICE_NS (100 * SCALE_MS)
+/* Largest request sent by the copy-on-read prefetcher */
+#define BDRV_COR_PREFETCH_CHUNK (1 * 1024 * 1024)
+/* How long the prefetcher waits while guest requests are in flight */
+#define BDRV_COR_PREFETCH_IDLE_NS (10 * SCALE_MS)
+/* Smallest zeroed extent that detect-zeroes carves out of a write */
+#define BDRV_DETECT_ZEROES_MIN_BYTES (64 * 1024)
+
 static BlockAIOCB *bdrv_co_aio_prw_vector(BdrvChild *child,
                                           int64_t offset,
                                           QEMUIOVector *qiov,
@@ -138,6 +147,25 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs)
     bs->copy_on_read--;
 }
 
+/**
+ * Enable prefetching for copy-on-read.  Once the guest reads sequentially,
+ * up to @window bytes following its reads are copied from the backing file
+ * into the image in the background, at no more than @speed bytes per second
+ * (0 means unlimited).  The prefetcher backs off while guest requests are in
+ * flight.  A @window of 0 disables prefetching.
+ */
+void bdrv_set_copy_on_read_prefetch(BlockDriverState *bs, uint64_t window,
+                                    uint64_t speed)
+{
+    bs->cor_prefetch_window = window;
+    bs->cor_prefetch_limited = speed != 0;
+    if (speed) {
+        ratelimit_set_speed(&bs->cor_prefetch_limit, speed,
+                            BDRV_COR_PREFETCH_SLICE_NS);
+    }
+    bs->cor_prefetch_end = bs->cor_prefetch_offset;
+}
+
 /* Check if any requests are in-flight (including throttled requests) */
 bool bdrv_requests_pending(BlockDriverState *bs)
 {
@@ -925,6 +953,9 @@ bdrv_driver_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     return drv->bdrv_co_pwritev_compressed(bs, offset, bytes, qiov);
 }
 
+static void bdrv_cor_prefetch_update(BlockDriverState *bs, int64_t offset,
+                                     unsigned int bytes);
+
 static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         int64_t offset, unsigned int bytes, QEMUIOVector *qiov)
 {
@@ -1044,6 +1075,8 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
         unsigned int nb_sectors = end_sector - start_sector;
         int pnum;
 
+        bdrv_cor_prefetch_update(bs, offset, bytes);
+
         ret = bdrv_is_allocated(bs, start_sector, nb_sectors, &pnum);
         if (ret < 0) {
             goto out;
@@ -1098,6 +1131,124 @@ out:
     return ret < 0 ? ret : 0;
 }
 
+static void coroutine_fn bdrv_cor_prefetch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    int64_t cluster_size = bdrv_get_cluster_size(bs);
+    int64_t align = bs->bl.request_alignment;
+    int64_t max_bytes;
+    void *buf;
+
+    max_bytes = MIN_NON_ZERO(bs->bl.max_transfer, BDRV_COR_PREFETCH_CHUNK);
+    max_bytes = MAX(QEMU_ALIGN_DOWN(max_bytes, cluster_size), cluster_size);
+    buf = qemu_try_blockalign(bs, max_bytes + align);
+    if (!buf) {
+        goto out;
+    }
+
+    while (bs->drv && bs->copy_on_read && !bs->quiesce_counter &&
+           bs->cor_prefetch_offset < bs->cor_prefetch_end) {
+        int64_t offset = bs->cor_prefetch_offset;
+        int64_t bytes = MIN(max_bytes, bs->cor_prefetch_end - offset);
+        int64_t delay_ns = 0;
+        BdrvTrackedRequest req;
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int pnum, ret;
+
+        /* Stay out of the way of the guest; one request is our own */
+        if (atomic_read(&bs->in_flight) > 1) {
+            co_aio_sleep_ns(ctx, QEMU_CLOCK_REALTIME,
+                            BDRV_COR_PREFETCH_IDLE_NS);
+            continue;
+        }
+
+        ret = bdrv_is_allocated(bs, offset >> BDRV_SECTOR_BITS,
+                                DIV_ROUND_UP(bytes, BDRV_SECTOR_SIZE), &pnum);
+        if (ret < 0 || pnum == 0) {
+            break;
+        }
+        bytes = MIN(bytes, (int64_t) pnum << BDRV_SECTOR_BITS);
+
+        if (!ret) {
+            bytes = QEMU_ALIGN_UP(bytes, align);
+            iov = (struct iovec) { .iov_base = buf, .iov_len = bytes };
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+            ret = bdrv_aligned_preadv(bs, &req, offset, bytes, align, &qiov,
+                                      BDRV_REQ_COPY_ON_READ);
+            tracked_request_end(&req);
+            if (ret < 0) {
+                /* Leave it to guest requests to report the error */
+                break;
+            }
+
+            if (bs->cor_prefetch_limited) {
+                delay_ns = ratelimit_calculate_delay(&bs->cor_prefetch_limit,
+                                                     bytes);
+            }
+        }
+
+        /* The guest may have moved the window while we were busy */
+        if (bs->cor_prefetch_offset == offset) {
+            bs->cor_prefetch_offset = offset + bytes;
+        }
+
+        while (delay_ns > 0 && !bs->quiesce_counter) {
+            int64_t ns = MIN(delay_ns, BDRV_COR_PREFETCH_SLICE_NS);
+
+            co_aio_sleep_ns(ctx, QEMU_CLOCK_REALTIME, ns);
+            delay_ns -= ns;
+        }
+    }
+
+    qemu_vfree(buf);
+out:
+    bs->cor_prefetch_co = NULL;
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called for every guest copy-on-read request.  Sequential reads (give or
+ * take the prefetch window, to allow for requests completing out of order)
+ * move the prefetch window along; anything else stops prefetching.
+ */
+static void bdrv_cor_prefetch_update(BlockDriverState *bs, int64_t offset,
+                                     unsigned int bytes)
+{
+    int64_t window = bs->cor_prefetch_window;
+    int64_t end = offset + bytes;
+
+    if (!window || qemu_coroutine_self() == bs->cor_prefetch_co) {
+        return;
+    }
+
+    if (offset + window >= bs->cor_prefetch_next &&
+        offset <= bs->cor_prefetch_next + window) {
+        if (bs->cor_prefetch_offset < end ||
+            bs->cor_prefetch_offset > end + window) {
+            bs->cor_prefetch_offset = QEMU_ALIGN_UP(end,
+                                                    bdrv_get_cluster_size(bs));
+        }
+        bs->cor_prefetch_end = MIN(end + window,
+                                   bs->total_sectors * BDRV_SECTOR_SIZE);
+        bs->cor_prefetch_next = MAX(bs->cor_prefetch_next, end);
+    } else {
+        bs->cor_prefetch_end = bs->cor_prefetch_offset;
+        bs->cor_prefetch_next = end;
+    }
+
+    if (!bs->cor_prefetch_co && !bs->quiesce_counter &&
+        bs->cor_prefetch_offset < bs->cor_prefetch_end) {
+        bs->cor_prefetch_co = qemu_coroutine_create(bdrv_cor_prefetch_entry,
+                                                    bs);
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), bs->cor_prefetch_co);
+    }
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -1302,6 +1453,108 @@ fail:
     return ret;
 }
 
+/*
+ * Writes @bytes bytes at @offset from @qiov, starting @qiov_offset bytes
+ * into it, in pieces of at most @max_transfer bytes.
+ */
+static int coroutine_fn bdrv_driver_pwritev_fragmented(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    size_t qiov_offset, int max_transfer, int flags)
+{
+    uint64_t bytes_remaining = bytes;
+    int ret = 0;
+
+    if (qiov_offset == 0 && bytes == qiov->size && bytes <= max_transfer) {
+        return bdrv_driver_pwritev(bs, offset, bytes, qiov, flags);
+    }
+
+    while (bytes_remaining) {
+        int num = MIN(bytes_remaining, max_transfer);
+        QEMUIOVector local_qiov;
+        int local_flags = flags;
+
+        assert(num);
+        if (num < bytes_remaining && (flags & BDRV_REQ_FUA) &&
+            !(bs->supported_write_flags & BDRV_REQ_FUA)) {
+            /* If FUA is going to be emulated by flush, we only
+             * need to flush on the last iteration */
+            local_flags &= ~BDRV_REQ_FUA;
+        }
+        qemu_iovec_init(&local_qiov, qiov->niov);
+        qemu_iovec_concat(&local_qiov, qiov,
+                          qiov_offset + bytes - bytes_remaining, num);
+
+        ret = bdrv_driver_pwritev(bs, offset + bytes - bytes_remaining,
+                                  num, &local_qiov, local_flags);
+        qemu_iovec_destroy(&local_qiov);
+        if (ret < 0) {
+            break;
+        }
+        bytes_remaining -= num;
+    }
+    return ret;
+}
+
+/*
+ * Writes a request that is not entirely zero, turning every run of
+ * @granularity-aligned blocks of zeroes in it into a single write zeroes
+ * request and writing the rest as data.
+ */
+static int coroutine_fn bdrv_pwritev_detect_zeroes(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
+    int64_t granularity, int max_transfer, int flags)
+{
+    int64_t end = offset + bytes;
+    int64_t data_start = offset;
+    int64_t zero_start = QEMU_ALIGN_UP(offset, granularity);
+    int64_t zero_end;
+    int zero_flags = flags | BDRV_REQ_ZERO_WRITE;
+    int ret;
+
+    if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
+        zero_flags |= BDRV_REQ_MAY_UNMAP;
+    }
+
+    while (zero_start + granularity <= end) {
+        zero_end = zero_start;
+        while (zero_end + granularity <= end &&
+               qemu_iovec_is_zero_range(qiov, zero_end - offset,
+                                        granularity)) {
+            zero_end += granularity;
+        }
+        if (zero_end == zero_start) {
+            zero_start += granularity;
+            continue;
+        }
+
+        if (data_start < zero_start) {
+            bdrv_debug_event(bs, BLKDBG_PWRITEV);
+            ret = bdrv_driver_pwritev_fragmented(bs, data_start,
+                                                 zero_start - data_start, qiov,
+                                                 data_start - offset,
+                                                 max_transfer, flags);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        bdrv_debug_event(bs, BLKDBG_PWRITEV_ZERO);
+        ret = bdrv_co_do_pwrite_zeroes(bs, zero_start, zero_end - zero_start,
+                                       zero_flags);
+        if (ret < 0) {
+            return ret;
+        }
+        data_start = zero_start = zero_end;
+    }
+
+    if (data_start == end) {
+        return 0;
+    }
+    bdrv_debug_event(bs, BLKDBG_PWRITEV);
+    return bdrv_driver_pwritev_fragmented(bs, data_start, end - data_start,
+                                          qiov, data_start - offset,
+                                          max_transfer, flags);
+}
+
 /*
  * Forwards an already correctly aligned write request to the BlockDriver,
  * after possibly fragmenting it.
@@ -1316,7 +1569,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
 
     int64_t start_sector = offset >> BDRV_SECTOR_BITS;
     int64_t end_sector = DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE);
-    uint64_t bytes_remaining = bytes;
+    int64_t zero_granularity = 0;
     int max_transfer;
 
     assert(is_power_of_2(align));
@@ -1336,11 +1589,21 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
-        !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_pwrite_zeroes &&
-        qemu_iovec_is_zero(qiov)) {
-        flags |= BDRV_REQ_ZERO_WRITE;
-        if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
-            flags |= BDRV_REQ_MAY_UNMAP;
+        !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_pwrite_zeroes) {
+        if (qemu_iovec_is_zero(qiov)) {
+            flags |= BDRV_REQ_ZERO_WRITE;
+            if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
+                flags |= BDRV_REQ_MAY_UNMAP;
+            }
+        } else if (!(flags & BDRV_REQ_WRITE_COMPRESSED)) {
+            /* Look for zeroed extents at least as large as the block size
+             * at which the driver can zero efficiently, e.g. a cluster */
+            zero_granularity = QEMU_ALIGN_UP(BDRV_DETECT_ZEROES_MIN_BYTES,
+                                             MAX(bs->bl.pwrite_zeroes_alignment,
+                                                 align));
+            if (bytes <= zero_granularity) {
+                zero_granularity = 0;
+            }
         }
     }
 
@@ -1351,34 +1614,13 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
         ret = bdrv_co_do_pwrite_zeroes(bs, offset, bytes, flags);
     } else if (flags & BDRV_REQ_WRITE_COMPRESSED) {
         ret = bdrv_driver_pwritev_compressed(bs, offset, bytes, qiov);
-    } else if (bytes <= max_transfer) {
-        bdrv_debug_event(bs, BLKDBG_PWRITEV);
-        ret = bdrv_driver_pwritev(bs, offset, bytes, qiov, flags);
+    } else if (zero_granularity) {
+        ret = bdrv_pwritev_detect_zeroes(bs, offset, bytes, qiov,
+                                         zero_granularity, max_transfer, flags);
     } else {
         bdrv_debug_event(bs, BLKDBG_PWRITEV);
-        while (bytes_remaining) {
-            int num = MIN(bytes_remaining, max_transfer);
-            QEMUIOVector local_qiov;
-            int local_flags = flags;
-
-            assert(num);
-            if (num < bytes_remaining && (flags & BDRV_REQ_FUA) &&
-                !(bs->supported_write_flags & BDRV_REQ_FUA)) {
-                /* If FUA is going to be emulated by flush, we only
-                 * need to flush on the last iteration */
-                local_flags &= ~BDRV_REQ_FUA;
-            }
-            qemu_iovec_init(&local_qiov, qiov->niov);
-            qemu_iovec_concat(&local_qiov, qiov, bytes - bytes_remaining, num);
-
-            ret = bdrv_driver_pwritev(bs, offset + bytes - bytes_remaining,
-                                      num, &local_qiov, local_flags);
-            qemu_iovec_destroy(&local_qiov);
-            if (ret < 0) {
-                break;
-            }
-            bytes_remaining -= num;
-        }
+        ret = bdrv_driver_pwritev_fragmented(bs, offset, bytes, qiov, 0,
+                                             max_transfer, flags);
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
@@ -1521,6 +1763,7 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
      * only for bdrv_aligned_pwritev, but also for the reads of the RMW cycle.
      */
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+    req.qiov = qiov;
 
     if (!qiov) {
         ret = bdrv_co_do_zero_pwritev(bs, offset, bytes, flags, &req);
@@ -1689,6 +1932,51 @@ typedef struct BdrvCoGetBlockStatusData {
     bool done;
 } BdrvCoGetBlockStatusData;
 
+/*
+ * Forget the cached block status of @bs.  Needed whenever the allocation
+ * state of a node changes without going through the write, discard or
+ * truncate paths (which bump write_gen), e.g. when the driver empties the
+ * image or the backing file is changed.
+ */
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs)
+{
+    bs->block_status_cache.valid = false;
+    bs->block_status_cache.gen++;
+}
+
+/*
+ * Look up [sector_num, sector_num + nb_sectors) in the block status cache
+ * of @bs.  On a hit, return the cached status adjusted to @sector_num and
+ * set *pnum and *file accordingly; otherwise return -ENOENT.
+ */
+static int64_t bdrv_block_status_cache_lookup(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum,
+                                              BlockDriverState **file)
+{
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+    int64_t ret;
+
+    if (!c->valid || c->write_gen != bs->write_gen ||
+        sector_num < c->sector_num ||
+        sector_num >= c->sector_num + c->nb_sectors) {
+        return -ENOENT;
+    }
+    if (c->file && c->file != bs &&
+        (!bs->file || c->file != bs->file->bs ||
+         c->file_write_gen != c->file->write_gen)) {
+        return -ENOENT;
+    }
+
+    ret = c->ret;
+    if (ret & BDRV_BLOCK_OFFSET_VALID) {
+        ret += (sector_num - c->sector_num) * BDRV_SECTOR_SIZE;
+    }
+    *pnum = MIN(nb_sectors, c->sector_num + c->nb_sectors - sector_num);
+    *file = c->file;
+    return ret;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -1712,6 +2000,8 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
                                                      int nb_sectors, int *pnum,
                                                      BlockDriverState **file)
 {
+    BdrvBlockStatusCache *c = &bs->block_status_cache;
+    unsigned int cache_gen, write_gen;
     int64_t total_sectors;
     int64_t n;
     int64_t ret, ret2;
@@ -1740,7 +2030,15 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
         return ret;
     }
 
+    ret = bdrv_block_status_cache_lookup(bs, sector_num, nb_sectors, pnum,
+                                         file);
+    if (ret >= 0) {
+        return ret;
+    }
+
     *file = NULL;
+    cache_gen = c->gen;
+    write_gen = bs->write_gen;
     bdrv_inc_in_flight(bs);
     ret = bs->drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum,
                                             file);
@@ -1795,6 +2093,23 @@ static int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
         }
     }
 
+    /* Remember the extent unless the node changed while the driver looked
+     * it up (it may have yielded).  Only statuses pointing into bs itself or
+     * its file child are cached, so that the entry never outlives @file. */
+    if (*pnum > 0 && c->gen == cache_gen && bs->write_gen == write_gen &&
+        (!*file || *file == bs || (bs->file && *file == bs->file->bs))) {
+        *c = (BdrvBlockStatusCache) {
+            .valid          = true,
+            .gen            = cache_gen,
+            .write_gen      = write_gen,
+            .file_write_gen = *file ? (*file)->write_gen : 0,
+            .sector_num     = sector_num,
+            .nb_sectors     = *pnum,
+            .ret            = ret,
+            .file           = *file,
+        };
+    }
+
 out:
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2525,6 +2840,122 @@ int bdrv_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     return rwco.ret;
 }
 
+/*
+ * Common part of bdrv_co_copy_range_from() and bdrv_co_copy_range_to():
+ * @recurse_src selects whether the driver of @src or of @dst is called, and
+ * accordingly whether a read or a write request is tracked for the node.
+ */
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *bs = recurse_src ? src->bs : dst->bs;
+    uint64_t offset = recurse_src ? src_offset : dst_offset;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->bs->drv || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bytes > BDRV_REQUEST_MAX_BYTES) {
+        return -EINVAL;
+    }
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!recurse_src && bs->read_only) {
+        return -EPERM;
+    }
+    if ((recurse_src ? bs->drv->bdrv_co_copy_range_from
+                     : bs->drv->bdrv_co_copy_range_to) == NULL) {
+        return -ENOTSUP;
+    }
+    /* The drivers only pass aligned ranges to the host */
+    if (!QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+    assert(!(bs->open_flags & BDRV_O_INACTIVE));
+
+    bdrv_inc_in_flight(bs);
+
+    if (recurse_src) {
+        tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset,
+                                               dst, dst_offset, bytes, flags);
+    } else {
+        tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+        ret = notifier_with_return_list_notify(&bs->before_write_notifiers,
+                                               &req);
+        if (ret == 0) {
+            ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset,
+                                                 dst, dst_offset, bytes,
+                                                 flags);
+        }
+
+        ++bs->write_gen;
+        bdrv_set_dirty(bs, offset >> BDRV_SECTOR_BITS,
+                       DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE) -
+                       (offset >> BDRV_SECTOR_BITS));
+        if (bs->wr_highest_offset < offset + bytes) {
+            bs->wr_highest_offset = offset + bytes;
+        }
+        if (ret >= 0) {
+            bs->total_sectors = MAX(bs->total_sectors,
+                                    DIV_ROUND_UP(offset + bytes,
+                                                 BDRV_SECTOR_SIZE));
+        }
+    }
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/*
+ * Copy @bytes from @src to @dst without a bounce buffer, going down the
+ * source side of the graph until a node whose driver can reach @dst.
+ * Returns -ENOTSUP if the nodes in between don't support this; callers
+ * are expected to fall back to a read and a write then.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/*
+ * Like bdrv_co_copy_range_from(), but going down the destination side.  The
+ * driver that finally performs the copy is the one of the destination node.
+ */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 int bdrv_co_ioctl(BlockDriverState *bs, int req, void *buf)
 {
     BlockDriver *drv = bs->drv;
@@ -48,14 +48,32 @@
 #include <scsi/sg.h>
 #endif
 
+#define ISCSI_MAX_SESSIONS 8
+
+/* One logged in session (I_T nexus) to the target */
+typedef struct IscsiSession {
+    struct iscsi_context *iscsi;
+    struct IscsiLun *iscsilun;
+    int events;
+    unsigned in_flight;
+    bool request_timed_out;
+} IscsiSession;
+
 typedef struct IscsiLun {
+    /* The first session, used for everything except reads and writes */
     struct iscsi_context *iscsi;
+    /* Reads and writes are spread across all sessions */
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int num_sessions;
+    int next_session;
+    /* Maximum number of reads and writes in flight per session, or 0 */
+    unsigned max_tasks;
+    CoQueue task_queue;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -85,7 +103,6 @@ typedef struct IscsiLun {
     bool lbprz;
     bool dpofua;
     bool has_write_same;
-    bool request_timed_out;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -96,6 +113,7 @@ typedef struct IscsiTask {
     struct scsi_task *task;
     Coroutine *co;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     QEMUTimer retry_timer;
     int err_code;
 } IscsiTask;
@@ -281,7 +299,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
                     /* make sure the request is rescheduled AFTER the
                      * reconnect is initiated */
                     retry_time = EVENT_INTERVAL * 2;
-                    iTask->iscsilun->request_timed_out = true;
+                    iTask->session->request_timed_out = true;
                 }
                 error_report("iSCSI Busy/TaskSetFull/TimeOut"
                              " (retry #%u in %u ms): %s",
@@ -314,9 +332,50 @@ static void iscsi_co_init_iscsitask(IscsiLun *iscsilun, struct IscsiTask *iTask)
     *iTask = (struct IscsiTask) {
         .co         = qemu_coroutine_self(),
         .iscsilun   = iscsilun,
+        .session    = &iscsilun->sessions[0],
     };
 }
 
+/*
+ * Pick the session with the fewest reads and writes in flight, going
+ * round-robin among equally loaded ones.  If max_tasks is set and every
+ * session is full, wait for a request to complete.
+ */
+static IscsiSession *coroutine_fn iscsi_co_get_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best;
+    int i;
+
+    for (;;) {
+        best = NULL;
+        for (i = 0; i < iscsilun->num_sessions; i++) {
+            IscsiSession *s = &iscsilun->sessions[(iscsilun->next_session + i) %
+                                                  iscsilun->num_sessions];
+            if (!best || s->in_flight < best->in_flight) {
+                best = s;
+            }
+        }
+        if (!iscsilun->max_tasks || best->in_flight < iscsilun->max_tasks) {
+            break;
+        }
+        qemu_co_queue_wait(&iscsilun->task_queue, NULL);
+    }
+
+    iscsilun->next_session = (best - iscsilun->sessions + 1) %
+                             iscsilun->num_sessions;
+    best->in_flight++;
+    return best;
+}
+
+static void coroutine_fn iscsi_co_put_session(IscsiLun *iscsilun,
+                                              IscsiSession *session)
+{
+    session->in_flight--;
+    if (iscsilun->max_tasks) {
+        qemu_co_queue_next(&iscsilun->task_queue);
+    }
+}
+
 static void
 iscsi_abort_task_cb(struct iscsi_context *iscsi, int status, void *command_data,
                     void *private_data)
@@ -353,37 +412,42 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsi),
+    if (ev != session->events) {
+        aio_set_fd_handler(session->iscsilun->aio_context, iscsi_get_fd(iscsi),
                            false,
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
                            NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           session);
+        session->events = ev;
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    if (iscsilun->request_timed_out) {
-        iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+        /* check for timed out requests */
+        iscsi_service(session->iscsi, 0);
+
+        if (session->request_timed_out) {
+            session->request_timed_out = false;
+            iscsi_reconnect(session->iscsi);
+        }
 
-    /* newer versions of libiscsi may return zero events. Ensure we are able
-     * to return to service once this situation changes. */
-    iscsi_set_events(iscsilun);
+        /* newer versions of libiscsi may return zero events. Ensure we are
+         * able to return to service once this situation changes. */
+        iscsi_set_events(session);
+    }
 
     timer_mod(iscsilun->event_timer,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
@@ -392,24 +456,24 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    IscsiLun *iscsilun = session->iscsilun;
 
     aio_context_acquire(iscsilun->aio_context);
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLIN);
+    iscsi_set_events(session);
     aio_context_release(iscsilun->aio_context);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    IscsiLun *iscsilun = session->iscsilun;
 
     aio_context_acquire(iscsilun->aio_context);
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(session->iscsi, POLLOUT);
+    iscsi_set_events(session);
     aio_context_release(iscsilun->aio_context);
 }
 
@@ -580,14 +644,49 @@ static inline bool iscsi_allocmap_is_valid(IscsiLun *iscsilun,
                                sector_num / iscsilun->cluster_sectors) == size);
 }
 
+/*
+ * Look up the provisioning state of the cluster containing @sector_num in
+ * the allocmap.  On success, *allocated is set and *pnum is the number of
+ * sectors from @sector_num (at most @nb_sectors) that are known to be in
+ * the same state.  Returns false if the allocmap has no valid information.
+ */
+static bool iscsi_allocmap_lookup(IscsiLun *iscsilun, int64_t sector_num,
+                                  int nb_sectors, bool *allocated, int *pnum)
+{
+    int64_t cl_num = sector_num / iscsilun->cluster_sectors;
+    int64_t size, next;
+
+    if (iscsilun->allocmap_valid == NULL ||
+        !test_bit(cl_num, iscsilun->allocmap_valid)) {
+        return false;
+    }
+
+    size = MIN(DIV_ROUND_UP(sector_num + nb_sectors,
+                            iscsilun->cluster_sectors),
+               iscsilun->allocmap_size);
+    size = find_next_zero_bit(iscsilun->allocmap_valid, size, cl_num);
+
+    *allocated = test_bit(cl_num, iscsilun->allocmap);
+    if (*allocated) {
+        next = find_next_zero_bit(iscsilun->allocmap, size, cl_num);
+    } else {
+        next = find_next_bit(iscsilun->allocmap, size, cl_num);
+    }
+
+    *pnum = MIN(next * iscsilun->cluster_sectors - sector_num, nb_sectors);
+    return true;
+}
+
 static int coroutine_fn
 iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
                       QEMUIOVector *iov, int flags)
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     uint64_t lba;
     uint32_t num_sectors;
+    int ret = 0;
     bool fua = flags & BDRV_REQ_FUA;
 
     if (fua) {
@@ -604,42 +703,45 @@ iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     lba = sector_qemu2lun(sector_num, iscsilun);
     num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
     iscsi_co_init_iscsitask(iscsilun, &iTask);
+    iTask.session = iscsi_co_get_session(iscsilun);
+    iscsi = iTask.session->iscsi;
 retry:
     if (iscsilun->use_16_for_rw) {
 #if LIBISCSI_API_VERSION >= (20160603)
-        iTask.task = iscsi_write16_iov_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write16_iov_task(iscsi, iscsilun->lun, lba,
                                             NULL, num_sectors * iscsilun->block_size,
                                             iscsilun->block_size, 0, 0, fua, 0, 0,
                                             iscsi_co_generic_cb, &iTask,
                                             (struct scsi_iovec *)iov->iov, iov->niov);
     } else {
-        iTask.task = iscsi_write10_iov_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write10_iov_task(iscsi, iscsilun->lun, lba,
                                             NULL, num_sectors * iscsilun->block_size,
                                             iscsilun->block_size, 0, 0, fua, 0, 0,
                                             iscsi_co_generic_cb, &iTask,
                                             (struct scsi_iovec *)iov->iov, iov->niov);
     }
 #else
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write16_task(iscsi, iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_write10_task(iscsi, iscsilun->lun, lba,
                                         NULL, num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     }
 #endif
     if (iTask.task == NULL) {
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
     }
 #if LIBISCSI_API_VERSION < (20160603)
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
 #endif
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -655,12 +757,15 @@ retry:
 
     if (iTask.status != SCSI_STATUS_GOOD) {
         iscsi_allocmap_set_invalid(iscsilun, sector_num, nb_sectors);
-        return iTask.err_code;
+        ret = iTask.err_code;
+        goto out;
     }
 
     iscsi_allocmap_set_allocated(iscsilun, sector_num, nb_sectors);
 
-    return 0;
+out:
+    iscsi_co_put_session(iscsilun, iTask.session);
+    return ret;
 }
 
 
@@ -675,6 +780,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     struct scsi_lba_status_descriptor *lbasd = NULL;
     struct IscsiTask iTask;
     int64_t ret;
+    bool allocated;
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 
@@ -693,6 +799,18 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
         goto out;
     }
 
+    /* Answer from the allocmap without a GET LBA STATUS round trip if a
+     * previous lookup or write already told us the state of this extent.
+     * Unallocated clusters are only cached if they read as zeroes. */
+    if (iscsi_allocmap_lookup(iscsilun, sector_num, nb_sectors,
+                              &allocated, pnum)) {
+        if (!allocated) {
+            ret &= ~BDRV_BLOCK_DATA;
+            ret |= BDRV_BLOCK_ZERO;
+        }
+        goto out;
+    }
+
 retry:
     if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
@@ -703,7 +821,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -772,8 +890,10 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
 {
     IscsiLun *iscsilun = bs->opaque;
     struct IscsiTask iTask;
+    struct iscsi_context *iscsi;
     uint64_t lba;
     uint32_t num_sectors;
+    int ret = 0;
 
     if (!is_sector_request_lun_aligned(sector_num, nb_sectors, iscsilun)) {
         return -EINVAL;
@@ -818,16 +938,18 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
     num_sectors = sector_qemu2lun(nb_sectors, iscsilun);
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
+    iTask.session = iscsi_co_get_session(iscsilun);
+    iscsi = iTask.session->iscsi;
 retry:
     if (iscsilun->use_16_for_rw) {
 #if LIBISCSI_API_VERSION >= (20160603)
-        iTask.task = iscsi_read16_iov_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_iov_task(iscsi, iscsilun->lun, lba,
                                            num_sectors * iscsilun->block_size,
                                            iscsilun->block_size, 0, 0, 0, 0, 0,
                                            iscsi_co_generic_cb, &iTask,
                                            (struct scsi_iovec *)iov->iov, iov->niov);
     } else {
-        iTask.task = iscsi_read10_iov_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_iov_task(iscsi, iscsilun->lun, lba,
                                            num_sectors * iscsilun->block_size,
                                            iscsilun->block_size,
                                            0, 0, 0, 0, 0,
@@ -835,12 +957,12 @@ retry:
                                            (struct scsi_iovec *)iov->iov, iov->niov);
     }
 #else
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
@@ -848,13 +970,14 @@ retry:
     }
 #endif
     if (iTask.task == NULL) {
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out;
     }
 #if LIBISCSI_API_VERSION < (20160603)
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 #endif
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -869,10 +992,12 @@ retry:
     }
 
     if (iTask.status != SCSI_STATUS_GOOD) {
-        return iTask.err_code;
+        ret = iTask.err_code;
     }
 
-    return 0;
+out:
+    iscsi_co_put_session(iscsilun, iTask.session);
+    return ret;
 }
 
 static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
@@ -888,7 +1013,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1067,7 +1192,7 @@ static BlockAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(&iscsilun->sessions[0]);
 
     return &acb->common;
 }
@@ -1113,7 +1238,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1204,7 +1329,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1330,18 +1455,27 @@ static char *get_initiator_name(QemuOpts *opts)
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
     aio_context_acquire(iscsilun->aio_context);
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        goto out;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
+
+        if (iscsi_get_nops_in_flight(session->iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            session->request_timed_out = true;
+        } else if (iscsi_nop_out_async(session->iscsi, NULL, NULL, 0,
+                                       NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            goto out;
+        }
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
 out:
     aio_context_release(iscsilun->aio_context);
@@ -1458,10 +1592,15 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *session = &iscsilun->sessions[i];
 
-    aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsilun->iscsi),
-                       false, NULL, NULL, NULL, NULL);
-    iscsilun->events = 0;
+        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(session->iscsi),
+                           false, NULL, NULL, NULL, NULL);
+        session->events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1479,9 +1618,12 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
     iscsilun->aio_context = new_context;
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
@@ -1686,10 +1828,108 @@ static QemuOptsList runtime_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
         },
+        {
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+        },
+        {
+            .name = "max-tasks",
+            .type = QEMU_OPT_NUMBER,
+        },
         { /* end of list */ }
     },
 };
 
+/*
+ * Create an iSCSI context from the options and log in to @lun.  Every
+ * context gets its own ISID from libiscsi, so each call opens a separate
+ * session.
+ */
+static int iscsi_session_connect(QemuOpts *opts, const char *initiator_name,
+                                 int lun, struct iscsi_context **piscsi,
+                                 Error **errp)
+{
+    struct iscsi_context *iscsi;
+    const char *portal = qemu_opt_get(opts, "portal");
+    const char *target = qemu_opt_get(opts, "target");
+    Error *local_err = NULL;
+    int ret = 0;
+
+    iscsi = iscsi_create_context(initiator_name);
+    if (iscsi == NULL) {
+        error_setg(errp, "iSCSI: Failed to create iSCSI context.");
+        return -ENOMEM;
+    }
+#if LIBISCSI_API_VERSION >= (20160603)
+    if (iscsi_init_transport(iscsi,
+                             strcmp(qemu_opt_get(opts, "transport"), "iser") ?
+                             TCP_TRANSPORT : ISER_TRANSPORT)) {
+        error_setg(errp, ("Error initializing transport."));
+        ret = -EINVAL;
+        goto out;
+    }
+#endif
+    if (iscsi_set_targetname(iscsi, target)) {
+        error_setg(errp, "iSCSI: Failed to set target name.");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* check if we got CHAP username/password via the options */
+    apply_chap(iscsi, opts, &local_err);
+    if (local_err != NULL) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
+        error_setg(errp, "iSCSI: Failed to set session type to normal.");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* check if we got HEADER_DIGEST via the options */
+    apply_header_digest(iscsi, opts, &local_err);
+    if (local_err != NULL) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* timeout handling is broken in libiscsi before 1.15.0 */
+#if LIBISCSI_API_VERSION >= 20150621
+    iscsi_set_timeout(iscsi, qemu_opt_get_number(opts, "timeout", 0));
+#endif
+
+    if (iscsi_full_connect_sync(iscsi, portal, lun) != 0) {
+        error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
+            iscsi_get_error(iscsi));
+        ret = -EINVAL;
+        goto out;
+    }
+
+out:
+    if (ret) {
+        iscsi_destroy_context(iscsi);
+        iscsi = NULL;
+    }
+    *piscsi = iscsi;
+    return ret;
+}
+
+static void iscsi_session_close(IscsiSession *session)
+{
+    if (session->iscsi == NULL) {
+        return;
+    }
+    if (iscsi_is_logged_in(session->iscsi)) {
+        iscsi_logout_sync(session->iscsi);
+    }
+    iscsi_destroy_context(session->iscsi);
+    session->iscsi = NULL;
+}
+
 static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -1702,10 +1942,8 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *transport_name, *portal, *target;
-#if LIBISCSI_API_VERSION >= (20160603)
-    enum iscsi_transport_type transport;
-#endif
-    int i, ret = 0, timeout = 0, lun;
+    int i, ret = 0, lun, num_sessions;
+    uint64_t max_tasks;
 
     opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -1726,83 +1964,55 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         goto out;
     }
 
-    if (!strcmp(transport_name, "tcp")) {
+    /* TCP is what older libiscsi versions always use */
+    if (strcmp(transport_name, "tcp")
 #if LIBISCSI_API_VERSION >= (20160603)
-        transport = TCP_TRANSPORT;
-    } else if (!strcmp(transport_name, "iser")) {
-        transport = ISER_TRANSPORT;
-#else
-        /* TCP is what older libiscsi versions always use */
+        && strcmp(transport_name, "iser")
 #endif
-    } else {
+        ) {
         error_setg(errp, "Unknown transport: %s", transport_name);
         ret = -EINVAL;
         goto out;
     }
 
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = get_initiator_name(opts);
-
-    iscsi = iscsi_create_context(initiator_name);
-    if (iscsi == NULL) {
-        error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
-    }
-#if LIBISCSI_API_VERSION >= (20160603)
-    if (iscsi_init_transport(iscsi, transport)) {
-        error_setg(errp, ("Error initializing transport."));
-        ret = -EINVAL;
-        goto out;
-    }
-#endif
-    if (iscsi_set_targetname(iscsi, target)) {
-        error_setg(errp, "iSCSI: Failed to set target name.");
+    num_sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (num_sessions < 1 || num_sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
         ret = -EINVAL;
         goto out;
     }
 
-    /* check if we got CHAP username/password via the options */
-    apply_chap(iscsi, opts, &local_err);
-    if (local_err != NULL) {
-        error_propagate(errp, local_err);
+    max_tasks = qemu_opt_get_number(opts, "max-tasks", 0);
+    if (max_tasks > UINT_MAX) {
+        error_setg(errp, "iSCSI: max-tasks is too large");
         ret = -EINVAL;
         goto out;
     }
 
-    if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
-        error_setg(errp, "iSCSI: Failed to set session type to normal.");
-        ret = -EINVAL;
-        goto out;
-    }
+    memset(iscsilun, 0, sizeof(IscsiLun));
 
-    /* check if we got HEADER_DIGEST via the options */
-    apply_header_digest(iscsi, opts, &local_err);
-    if (local_err != NULL) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
+    initiator_name = get_initiator_name(opts);
 
-    /* timeout handling is broken in libiscsi before 1.15.0 */
-    timeout = qemu_opt_get_number(opts, "timeout", 0);
-#if LIBISCSI_API_VERSION >= 20150621
-    iscsi_set_timeout(iscsi, timeout);
-#else
-    if (timeout) {
+#if LIBISCSI_API_VERSION < 20150621
+    if (qemu_opt_get_number(opts, "timeout", 0)) {
         error_report("iSCSI: ignoring timeout value for libiscsi <1.15.0");
     }
 #endif
 
-    if (iscsi_full_connect_sync(iscsi, portal, lun) != 0) {
-        error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
-            iscsi_get_error(iscsi));
-        ret = -EINVAL;
+    ret = iscsi_session_connect(opts, initiator_name, lun, &iscsi, errp);
+    if (ret < 0) {
         goto out;
     }
 
     iscsilun->iscsi = iscsi;
+    iscsilun->sessions[0] = (IscsiSession) {
+        .iscsi      = iscsi,
+        .iscsilun   = iscsilun,
+    };
+    iscsilun->num_sessions = 1;
+    iscsilun->max_tasks = max_tasks;
+    qemu_co_queue_init(&iscsilun->task_queue);
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun = lun;
     iscsilun->has_write_same = true;
@@ -1890,6 +2100,22 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     scsi_free_scsi_task(task);
     task = NULL;
 
+    /* Additional sessions only carry reads and writes, which we only
+     * issue ourselves for disks; everything else goes through session 0. */
+    if (iscsilun->type == TYPE_DISK) {
+        for (i = 1; i < num_sessions; i++) {
+            IscsiSession *session = &iscsilun->sessions[i];
+
+            ret = iscsi_session_connect(opts, initiator_name, lun,
+                                        &session->iscsi, errp);
+            if (ret < 0) {
+                goto out;
+            }
+            session->iscsilun = iscsilun;
+            iscsilun->num_sessions++;
+        }
+    }
+
     iscsi_attach_aio_context(bs, iscsilun->aio_context);
 
     /* Guess the internal cluster (page) size of the iscsi target by the means
@@ -1912,11 +2138,8 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            if (iscsi_is_logged_in(iscsi)) {
-                iscsi_logout_sync(iscsi);
-            }
-            iscsi_destroy_context(iscsi);
+        for (i = 0; i < ISCSI_MAX_SESSIONS; i++) {
+            iscsi_session_close(&iscsilun->sessions[i]);
         }
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
@@ -1926,13 +2149,12 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    int i;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_session_close(&iscsilun->sessions[i]);
     }
-    iscsi_destroy_context(iscsi);
     g_free(iscsilun->zeroblock);
     iscsi_allocmap_free(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
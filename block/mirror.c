@@ -70,6 +70,15 @@ typedef struct MirrorBlockJob {
     int target_cluster_sectors;
     int max_iov;
     bool initial_zeroing_ongoing;
+
+    MirrorCopyMode copy_mode;
+    NotifierWithReturn before_write;
+    /* In write-blocking mode, chunks whose dirty bit was only set by guest
+     * writes that have already been copied to the target.  The background
+     * copy drops such chunks from the dirty bitmap instead of copying them.
+     */
+    unsigned long *active_clean_bitmap;
+    int active_writes_in_flight;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -346,13 +355,21 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         assert(sector_num >= 0);
     }
 
+    block_job_pause_point(&s->common);
+
     first_chunk = sector_num / sectors_per_chunk;
     while (test_bit(first_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
         mirror_wait_for_io(s);
     }
 
-    block_job_pause_point(&s->common);
+    if (s->active_clean_bitmap &&
+        test_bit(first_chunk, s->active_clean_bitmap)) {
+        /* The target already has what the guest wrote here */
+        bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
+                                sectors_per_chunk);
+        return 0;
+    }
 
     /* Find the number of consective dirty chunks following the first dirty
      * one, and wait for in flight requests in them. */
@@ -367,6 +384,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
         if (test_bit(next_chunk, s->in_flight_bitmap)) {
             break;
         }
+        if (s->active_clean_bitmap &&
+            test_bit(next_chunk, s->active_clean_bitmap)) {
+            break;
+        }
 
         next_dirty = bdrv_dirty_iter_next(s->dbi);
         if (next_dirty > next_sector || next_dirty < 0) {
@@ -385,6 +406,11 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num,
                             nb_chunks * sectors_per_chunk);
     bitmap_set(s->in_flight_bitmap, sector_num / sectors_per_chunk, nb_chunks);
+    if (s->active_clean_bitmap) {
+        /* From now on, guest writes to these chunks dirty them for real */
+        bitmap_clear(s->active_clean_bitmap, sector_num / sectors_per_chunk,
+                     nb_chunks);
+    }
     while (nb_chunks > 0 && sector_num < end) {
         int ret;
         int io_sectors, io_sectors_acct;
@@ -626,6 +652,75 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
     return 0;
 }
 
+/* Write-blocking mode: copy a guest write to the target before it reaches
+ * the source.  The source write marks the chunks dirty afterwards; for the
+ * chunks whose target copy is then known to be up to date this is recorded
+ * in active_clean_bitmap, so that the background copy can skip them.
+ *
+ * Writes that overlap a copy in flight, zero writes and discards are not
+ * mirrored; they only make the chunks they touch dirty for real.  Guest
+ * writes never fail because of the target: on error the data is simply
+ * copied again by the background loop, which applies on-target-error.
+ */
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    BlockDriverState *bs = blk_bs(s->common.blk);
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end, chunk, first_chunk, nb_chunks;
+    bool copy;
+    int ret;
+
+    end = MIN(req->offset + req->bytes, s->bdev_length);
+    if (req->offset >= end) {
+        return 0;
+    }
+    first_chunk = req->offset / s->granularity;
+    nb_chunks = DIV_ROUND_UP(end, s->granularity) - first_chunk;
+
+    copy = req->type == BDRV_TRACKED_WRITE && req->qiov &&
+           end == req->offset + req->bytes && !s->cow_bitmap;
+    for (chunk = first_chunk; copy && chunk < first_chunk + nb_chunks;
+         chunk++) {
+        copy = !test_bit(chunk, s->in_flight_bitmap);
+    }
+    if (!copy) {
+        bitmap_clear(s->active_clean_bitmap, first_chunk, nb_chunks);
+        return 0;
+    }
+
+    /* A chunk stays clean if the write covers all of it, or if the target
+     * copy of the rest of the chunk is already up to date */
+    for (chunk = first_chunk; chunk < first_chunk + nb_chunks; chunk++) {
+        int64_t chunk_start = chunk * s->granularity;
+
+        if ((req->offset <= chunk_start &&
+             req->offset + req->bytes >= chunk_start + s->granularity) ||
+            !bdrv_get_dirty(bs, s->dirty_bitmap,
+                            chunk * sectors_per_chunk)) {
+            set_bit(chunk, s->active_clean_bitmap);
+        }
+    }
+
+    bitmap_set(s->in_flight_bitmap, first_chunk, nb_chunks);
+    s->active_writes_in_flight++;
+
+    ret = blk_co_pwritev(s->target, req->offset, req->bytes, req->qiov, 0);
+    if (ret < 0) {
+        bitmap_clear(s->active_clean_bitmap, first_chunk, nb_chunks);
+    }
+
+    bitmap_clear(s->in_flight_bitmap, first_chunk, nb_chunks);
+    s->active_writes_in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+    return 0;
+}
+
 /* Called when going out of the streaming phase to flush the bulk of the
  * data to the medium, or just before completing.
  */
@@ -709,6 +804,12 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        s->active_clean_bitmap = bitmap_new(length);
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+    }
+
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap, 0);
     for (;;) {
@@ -815,6 +916,13 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->active_clean_bitmap) {
+        notifier_with_return_remove(&s->before_write);
+        while (s->active_writes_in_flight > 0) {
+            mirror_wait_for_io(s);
+        }
+    }
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -829,6 +937,7 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->active_clean_bitmap);
     bdrv_dirty_iter_free(s->dbi);
     bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
 
@@ -966,7 +1075,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              BlockMirrorBackingMode backing_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -1008,6 +1117,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1040,7 +1150,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, Error **errp)
+                  bool unmap, MirrorCopyMode copy_mode, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1053,8 +1163,9 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, BLOCK_JOB_DEFAULT, target, replaces,
                      speed, granularity, buf_size, backing_mode,
-                     on_source_error, on_target_error, unmap, NULL, NULL, errp,
-                     &mirror_job_driver, is_none_mode, base, false);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     NULL, NULL, errp, &mirror_job_driver, is_none_mode,
+                     base, false);
 }
 
 void commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1101,7 +1212,8 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
 
     mirror_start_job(job_id, bs, creation_flags, base, NULL, speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN,
-                     on_error, on_error, true, cb, opaque, &local_err,
+                     on_error, on_error, true, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err,
                      &commit_active_job_driver, false, base, auto_complete);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -33,9 +33,9 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(BlockDriverState *bs)
+static void nbd_recv_coroutines_enter_all(BlockDriverState *bs,
+                                          NBDClientSession *s)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
@@ -46,10 +46,9 @@ static void nbd_recv_coroutines_enter_all(BlockDriverState *bs)
     BDRV_POLL_WHILE(bs, s->read_reply_co);
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BlockDriverState *bs,
+                                    NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -58,9 +57,9 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     qio_channel_shutdown(client->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(bs);
+    nbd_recv_coroutines_enter_all(bs, client);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(client->sioc));
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -106,11 +105,10 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, ret, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -152,27 +150,65 @@ static int nbd_co_send_request(BlockDriverState *bs,
 static void nbd_co_receive_reply(NBDClientSession *s,
                                  NBDRequest *request,
                                  NBDReply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
+    uint32_t error = 0;
     int ret;
 
-    /* Wait until we're woken up by nbd_read_reply_entry.  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+    for (;;) {
+        /* Wait until we're woken up by nbd_read_reply_entry.  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return;
         }
 
-        /* Tell the read handler to read another header.  */
+        if (s->info.structured_reply) {
+            ret = nbd_receive_structured_chunk(s->ioc, reply, request->from,
+                                               request->len, qiov, extent);
+        } else {
+            ret = -EINVAL;
+        }
         s->reply.handle = 0;
+        if (ret < 0) {
+            reply->error = EIO;
+            return;
+        }
+
+        /* Report the first error of the reply, but keep reading chunks
+         * until the server says it is done.  */
+        if (!error) {
+            error = reply->error;
+        }
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            reply->error = error;
+            return;
+        }
+
+        /* More chunks follow; kick the read_reply_co to get the next one
+         * while keeping our slot in recv_coroutine.  */
+        if (!s->read_reply_co) {
+            reply->error = EIO;
+            return;
+        }
+        aio_co_wake(s->read_reply_co);
     }
 }
 
@@ -190,10 +226,9 @@ static void nbd_coroutine_start(NBDClientSession *s,
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(BlockDriverState *bs,
+static void nbd_coroutine_end(NBDClientSession *s,
                               NBDRequest *request)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int i = HANDLE_TO_INDEX(s, request->handle);
 
     s->recv_coroutine[i] = NULL;
@@ -222,13 +257,13 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     assert(!flags);
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        nbd_co_receive_reply(client, &request, &reply, qiov, NULL);
     }
-    nbd_coroutine_end(bs, &request);
+    nbd_coroutine_end(client, &request);
     return -reply.error;
 }
 
@@ -252,13 +287,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
+    ret = nbd_co_send_request(client, &request, qiov);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(bs, &request);
+    nbd_coroutine_end(client, &request);
     return -reply.error;
 }
 
@@ -287,13 +322,13 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     }
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(bs, &request);
+    nbd_coroutine_end(client, &request);
     return -reply.error;
 }
 
@@ -312,13 +347,13 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.len = 0;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(bs, &request);
+    nbd_coroutine_end(client, &request);
     return -reply.error;
 }
 
@@ -338,63 +373,132 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     }
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
-    nbd_coroutine_end(bs, &request);
+    nbd_coroutine_end(client, &request);
     return -reply.error;
 
 }
 
-void nbd_client_detach_aio_context(BlockDriverState *bs)
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->sioc));
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .len = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS)
+               << BDRV_SECTOR_BITS,
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+    };
+    NBDExtent extent = { 0 };
+    NBDReply reply;
+    ssize_t ret;
+
+    if (!client->info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA;
+    }
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, &extent);
+        if (!reply.error && !extent.length) {
+            reply.error = EIO;
+        }
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    /* The server may use a finer granularity than sectors; a descriptor
+     * shorter than a sector cannot describe the whole sector.  */
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        *pnum = 1;
+        return BDRV_BLOCK_DATA;
+    }
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
 }
 
-void nbd_client_attach_aio_context(BlockDriverState *bs,
-                                   AioContext *new_context)
+void nbd_client_detach_aio_context(BlockDriverState *bs)
+{
+    NBDClientSession *clients;
+    unsigned i, count;
+
+    clients = nbd_get_client_sessions(bs, &count);
+    for (i = 0; i < count; i++) {
+        qio_channel_detach_aio_context(QIO_CHANNEL(clients[i].sioc));
+    }
+}
+
+static void nbd_client_attach_session(NBDClientSession *client,
+                                      AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     qio_channel_attach_aio_context(QIO_CHANNEL(client->sioc), new_context);
     aio_co_schedule(new_context, client->read_reply_co);
 }
 
+void nbd_client_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+    NBDClientSession *clients;
+    unsigned i, count;
+
+    clients = nbd_get_client_sessions(bs, &count);
+    for (i = 0; i < count; i++) {
+        nbd_client_attach_session(&clients[i], new_context);
+    }
+}
+
 void nbd_client_close(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *clients;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    unsigned i, count;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    clients = nbd_get_client_sessions(bs, &count);
+    for (i = 0; i < count; i++) {
+        if (clients[i].ioc == NULL) {
+            continue;
+        }
 
-    nbd_send_request(client->ioc, &request);
+        nbd_send_request(clients[i].ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(bs, &clients[i]);
+    }
 }
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sioc,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    client->info.structured_reply = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 &client->nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
+                                &client->ioc, &client->info,
                                 &client->size, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -422,7 +526,7 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_client_attach_session(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
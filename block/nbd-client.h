@@ -17,11 +17,18 @@
 
 #define MAX_NBD_REQUESTS    16
 
+/* Maximum number of connections to one export */
+#define NBD_MAX_CONNECTIONS 16
+
+/* One connection to the server.  If the server advertises
+ * NBD_FLAG_CAN_MULTI_CONN, a BlockDriverState may use several of them
+ * and spread its requests over them. */
 typedef struct NBDClientSession {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     uint16_t nbdflags;
     off_t size;
+    NBDExportInfo info;
 
     CoMutex send_mutex;
     CoQueue free_sema;
@@ -35,8 +42,11 @@ typedef struct NBDClientSession {
 } NBDClientSession;
 
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
+NBDClientSession *nbd_get_client_sessions(BlockDriverState *bs,
+                                          unsigned *count);
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sock,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
@@ -52,6 +62,10 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
@@ -44,7 +44,9 @@
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NBDClientSession client;
+    NBDClientSession client[NBD_MAX_CONNECTIONS];
+    unsigned num_clients;
+    unsigned next_client;
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
@@ -285,7 +287,7 @@ static SocketAddress *nbd_config(BDRVNBDState *s, QDict *options, Error **errp)
         goto done;
     }
 
-    s->client.is_unix = saddr->type == SOCKET_ADDRESS_KIND_UNIX;
+    s->client[0].is_unix = saddr->type == SOCKET_ADDRESS_KIND_UNIX;
 
 done:
     QDECREF(addr);
@@ -294,10 +296,37 @@ done:
     return saddr;
 }
 
+/* Pick the connection for a new request: the least busy one, going
+ * round-robin among equally busy connections. */
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
-    return &s->client;
+    NBDClientSession *best = NULL;
+    unsigned i;
+
+    if (s->num_clients <= 1) {
+        return &s->client[0];
+    }
+
+    for (i = 0; i < s->num_clients; i++) {
+        NBDClientSession *client;
+
+        client = &s->client[(s->next_client + i) % s->num_clients];
+        if (!best || client->in_flight < best->in_flight) {
+            best = client;
+        }
+    }
+    s->next_client = (best - s->client + 1) % s->num_clients;
+    return best;
+}
+
+NBDClientSession *nbd_get_client_sessions(BlockDriverState *bs,
+                                          unsigned *count)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    *count = s->num_clients;
+    return s->client;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -382,6 +411,12 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the export, "
+                    "if the server allows it (default: 1)",
+        },
     },
 };
 
@@ -394,6 +429,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QIOChannelSocket *sioc = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    uint64_t connections;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -416,6 +452,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->export = g_strdup(qemu_opt_get(opts, "export"));
 
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     s->tlscredsid = g_strdup(qemu_opt_get(opts, "tls-creds"));
     if (s->tlscredsid) {
         tlscreds = nbd_get_tls_creds(s->tlscredsid, errp);
@@ -430,18 +473,33 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.data->host;
     }
 
-    /* establish TCP connection, return error if it fails
-     * TODO: Configurable retry-until-timeout behaviour.
-     */
-    sioc = nbd_establish_connection(s->saddr, errp);
-    if (!sioc) {
-        ret = -ECONNREFUSED;
-        goto error;
-    }
+    s->num_clients = 0;
+    do {
+        /* establish TCP connection, return error if it fails
+         * TODO: Configurable retry-until-timeout behaviour.
+         */
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+
+        /* NBD handshake */
+        ret = nbd_client_init(bs, &s->client[s->num_clients], sioc,
+                              s->export, tlscreds, hostname, errp);
+        object_unref(OBJECT(sioc));
+        sioc = NULL;
+        if (ret < 0) {
+            goto error;
+        }
+        s->num_clients++;
+
+        /* Without NBD_FLAG_CAN_MULTI_CONN, a flush on one connection
+         * need not cover writes made through the others; stay with a
+         * single connection then. */
+    } while (s->num_clients < connections &&
+             (s->client[0].nbdflags & NBD_FLAG_CAN_MULTI_CONN));
 
-    /* NBD handshake */
-    ret = nbd_client_init(bs, sioc, s->export,
-                          tlscreds, hostname, errp);
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -450,6 +508,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         object_unref(OBJECT(tlscreds));
     }
     if (ret < 0) {
+        nbd_client_close(bs);
         qapi_free_SocketAddress(s->saddr);
         g_free(s->export);
         g_free(s->tlscredsid);
@@ -485,7 +544,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.size;
+    return s->client[0].size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -547,6 +606,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put(opts, "tls-creds", qstring_from_str(s->tlscredsid));
     }
+    if (s->num_clients > 1) {
+        qdict_put(opts, "connections", qint_from_int(s->num_clients));
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -564,6 +626,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -583,6 +646,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -602,6 +666,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -63,6 +62,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -92,6 +92,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     QCowExtension ext;
     uint64_t offset;
     int ret;
+    Qcow2BitmapHeaderExt bitmaps_ext;
 
 #ifdef DEBUG_EXT
     printf("qcow2_read_extensions: start=%ld end=%ld\n", start_offset, end_offset);
@@ -162,6 +163,78 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* The extension is dropped with the next header update */
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent. Some clusters may be "
+                             "leaked, run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                break;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext");
+                return ret;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be32_to_cpus(&bitmaps_ext.reserved32);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "found bitmaps extension with zero bitmaps");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Image has %" PRIu32 " bitmaps, exceeding the "
+                           "QEMU supported maximum of %d",
+                           bitmaps_ext.nb_bitmaps, QCOW2_MAX_BITMAPS);
+                return -EINVAL;
+            }
+
+            if (offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "bitmap directory size (%" PRIu64 ") exceeds "
+                           "the maximum supported size (%d)",
+                           bitmaps_ext.bitmap_directory_size,
+                           QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -319,10 +392,78 @@ int qcow2_mark_consistent(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Read the active L1 table if it has not been read yet.  Read-only opens
+ * defer this until the first cluster lookup, so that metadata-only queries
+ * such as 'qemu-img info --backing-chain' and 'qemu-img map' do not read
+ * the L1 table of every image in a long backing chain.
+ */
+int qcow2_load_l1_table(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i, ret;
+
+    if (s->l1_size == 0 || s->l1_table) {
+        return 0;
+    }
+
+    s->l1_table = qemu_try_blockalign(bs->file->bs,
+        align_offset(s->l1_size * sizeof(uint64_t), 512));
+    if (s->l1_table == NULL) {
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(bs->file, s->l1_table_offset, s->l1_table,
+                     s->l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        qemu_vfree(s->l1_table);
+        s->l1_table = NULL;
+        return ret;
+    }
+    for (i = 0; i < s->l1_size; i++) {
+        be64_to_cpus(&s->l1_table[i]);
+    }
+    return 0;
+}
+
+/*
+ * Load all metadata whose loading was deferred by a read-only open.  This
+ * must be called before anything that may modify the image or walk all
+ * metadata, e.g. when reopening read-write or checking the image.
+ */
+int qcow2_load_deferred_metadata(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_load_l1_table(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->refcount_table_deferred) {
+        ret = qcow2_refcount_init(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        s->refcount_table_deferred = false;
+    }
+    return 0;
+}
+
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    ret = qcow2_load_deferred_metadata(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Reserved clusters would show up as leaks */
+    qcow2_drop_cluster_pool(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -451,6 +592,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -461,6 +607,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of data clusters to reserve at once for "
+                    "allocating writes (0 = disabled)",
+        },
         { /* end of list */ }
     },
 };
@@ -521,6 +673,7 @@ static void qcow2_attach_aio_context(BlockDriverState *bs,
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
                              uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -536,6 +689,18 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
 
+    *l2_cache_entry_size = qemu_opt_get_size(
+        opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE, s->cluster_size);
+
+    if (*l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return;
+    }
+
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
             error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
@@ -581,10 +746,13 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t cluster_pool_size;
+    bool stored_bitmaps;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -596,7 +764,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -610,15 +778,15 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* get L2 table/refcount block cache size from command line options */
-    read_cache_sizes(bs, opts, &l2_cache_size, &refcount_cache_size,
-                     &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -656,8 +824,11 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -682,6 +853,18 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Size of the data cluster pool, in clusters */
+    r->cluster_pool_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE,
+                          s->cluster_pool_size << s->cluster_bits);
+    r->cluster_pool_size = DIV_ROUND_UP(r->cluster_pool_size, s->cluster_size);
+    if (r->cluster_pool_size > s->l2_size) {
+        error_setg(errp, "Cluster pool size too big (can be at most %" PRIu64
+                   " bytes)", (uint64_t) s->l2_size << s->cluster_bits);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -772,6 +955,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -785,6 +969,11 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         s->cache_clean_interval = r->cache_clean_interval;
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
+
+    if (s->cluster_pool_size != r->cluster_pool_size) {
+        qcow2_drop_cluster_pool(bs);
+        s->cluster_pool_size = r->cluster_pool_size;
+    }
 }
 
 static void qcow2_update_options_abort(BlockDriverState *bs,
@@ -818,12 +1007,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int len, i;
+    unsigned int len;
     int ret = 0;
     QCowHeader header;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    uint64_t autoclear_features;
+    bool lazy_metadata;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -877,6 +1068,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         header.autoclear_features       = 0;
         header.refcount_order           = 4;
         header.header_length            = 72;
+        header.compression_type         = QCOW2_COMPRESSION_TYPE_ZLIB;
     } else {
         be64_to_cpus(&header.incompatible_features);
         be64_to_cpus(&header.compatible_features);
@@ -889,6 +1081,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
             ret = -EINVAL;
             goto fail;
         }
+
+        if (header.header_length <= offsetof(QCowHeader, compression_type)) {
+            header.compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+        }
     }
 
     if (header.header_length > s->cluster_size) {
@@ -950,6 +1146,38 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Check support for various header values */
+    switch (header.compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        break;
+#endif
+    default:
+        error_setg(errp, "qcow2: Unsupported compression type %" PRIu8,
+                   header.compression_type);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    if (header.compression_type != QCOW2_COMPRESSION_TYPE_ZLIB &&
+        !(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+        error_setg(errp, "qcow2: Compression type is set but the "
+                   "compression type feature bit is not");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->compression_type = header.compression_type;
+
+    if (has_subclusters(s) &&
+        s->cluster_bits < MIN_CLUSTER_BITS + ctz32(
+            QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)) {
+        error_setg(errp, "qcow2: Extended L2 entries need a cluster size of "
+                   "at least %d bytes", QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER <<
+                   MIN_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     if (header.refcount_order > 6) {
         error_setg(errp, "Reference count entry width too large; may not "
                    "exceed 64 bits");
@@ -992,7 +1220,13 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster =
+        has_subclusters(s) ? QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER : 1;
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1066,24 +1300,20 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
     s->l1_table_offset = header.l1_table_offset;
 
+    /* A read-only image only needs its L1 table for cluster lookups and
+     * its refcount table not at all, so don't read them before they are
+     * actually used. */
+    lazy_metadata = bs->read_only && !(flags & BDRV_O_CHECK);
 
-    if (s->l1_size > 0) {
-        s->l1_table = qemu_try_blockalign(bs->file->bs,
-            align_offset(s->l1_size * sizeof(uint64_t), 512));
-        if (s->l1_table == NULL) {
+    if (!lazy_metadata) {
+        ret = qcow2_load_l1_table(bs);
+        if (ret == -ENOMEM) {
             error_setg(errp, "Could not allocate L1 table");
-            ret = -ENOMEM;
             goto fail;
-        }
-        ret = bdrv_pread(bs->file, s->l1_table_offset, s->l1_table,
-                         s->l1_size * sizeof(uint64_t));
-        if (ret < 0) {
+        } else if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not read L1 table");
             goto fail;
         }
-        for(i = 0;i < s->l1_size; i++) {
-            be64_to_cpus(&s->l1_table[i]);
-        }
     }
 
     /* Parse driver-specific options */
@@ -1092,23 +1322,19 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file->bs, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
-    s->cluster_cache_offset = -1;
+    qemu_co_queue_init(&s->compress_wait_queue);
+    s->nb_compress_threads = 0;
     s->flags = flags;
 
-    ret = qcow2_refcount_init(bs);
-    if (ret != 0) {
-        error_setg_errno(errp, -ret, "Could not initialize refcount handling");
-        goto fail;
+    if (lazy_metadata) {
+        s->refcount_table_deferred = true;
+    } else {
+        ret = qcow2_refcount_init(bs);
+        if (ret != 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not initialize refcount handling");
+            goto fail;
+        }
     }
 
     QLIST_INIT(&s->cluster_allocs);
@@ -1151,9 +1377,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if there is
+     * no bitmaps extension that goes with it */
+    autoclear_features = s->autoclear_features & QCOW2_AUTOCLEAR_MASK;
+    if (s->nb_bitmaps == 0) {
+        autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        s->autoclear_features != autoclear_features) {
+        s->autoclear_features = autoclear_features;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1177,6 +1409,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* Persistent bitmaps are only tracked while the image is writable */
+    if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only) {
+        ret = qcow2_load_persistent_dirty_bitmaps(bs, &local_err);
+        if (ret < 0) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1200,8 +1441,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1267,8 +1506,27 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
         goto fail;
     }
 
+    /* Writes need the metadata a read-only open may have skipped */
+    if (state->flags & BDRV_O_RDWR) {
+        ret = qcow2_load_deferred_metadata(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not load image metadata");
+            goto fail;
+        }
+    }
+
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        BDRVQcow2State *s = state->bs->opaque;
+
+        if (s->dirty_bitmaps_loaded) {
+            ret = qcow2_store_persistent_dirty_bitmaps(state->bs, errp);
+            if (ret < 0) {
+                goto fail;
+            }
+            r->stored_bitmaps = true;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1283,6 +1541,9 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 
 fail:
+    if (r->stored_bitmaps) {
+        qcow2_reopen_bitmaps_rw(state->bs, NULL);
+    }
     qcow2_update_options_abort(state->bs, r);
     g_free(r);
     return ret;
@@ -1296,8 +1557,17 @@ static void qcow2_reopen_commit(BDRVReopenState *state)
 
 static void qcow2_reopen_abort(BDRVReopenState *state)
 {
-    qcow2_update_options_abort(state->bs, state->opaque);
-    g_free(state->opaque);
+    Qcow2ReopenState *r = state->opaque;
+    Error *local_err = NULL;
+
+    /* The image stays writable, so the bitmaps are in use again */
+    if (r->stored_bitmaps &&
+        qcow2_reopen_bitmaps_rw(state->bs, &local_err) < 0) {
+        error_report_err(local_err);
+    }
+
+    qcow2_update_options_abort(state->bs, r);
+    g_free(r);
 }
 
 static void qcow2_join_options(QDict *options, QDict *old_options)
@@ -1403,6 +1673,60 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
     return n1;
 }
 
+/*
+ * Reads the compressed cluster described by the L2 entry @l2_entry and
+ * copies @bytes bytes at @offset_in_cluster of the uncompressed data into
+ * @qiov.  As for normal clusters, this runs without s->lock; the
+ * decompression runs in the thread pool, so several clusters can be
+ * decompressed at once.
+ */
+static int coroutine_fn
+qcow2_co_preadv_compressed(BlockDriverState *bs, uint64_t l2_entry,
+                           int offset_in_cluster, unsigned int bytes,
+                           QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret, csize, nb_csectors;
+    uint64_t coffset;
+    uint8_t *buf, *out_buf;
+    struct iovec iov;
+    QEMUIOVector local_qiov;
+
+    coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * BDRV_SECTOR_SIZE -
+            (coffset & (BDRV_SECTOR_SIZE - 1));
+
+    buf = g_try_malloc(csize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = csize;
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_preadv(bs->file, coffset, csize, &local_qiov, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, out_buf + offset_in_cluster, bytes);
+
+fail:
+    qemu_vfree(out_buf);
+    g_free(buf);
+
+    return ret;
+}
+
 static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                                         uint64_t bytes, QEMUIOVector *qiov,
                                         int flags)
@@ -1418,8 +1742,6 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (bytes != 0) {
 
         /* prepare next request */
@@ -1429,7 +1751,17 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes, &cluster_offset);
+        /* s->lock is only needed if the lookup has to load an L2 slice, so
+         * reads of cached mappings don't wait for allocating writes */
+        if (qcow2_get_cluster_offset_nowait(bs, offset)) {
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, offset, &cur_bytes,
+                                           &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1453,10 +1785,8 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                     qemu_iovec_concat(&local_qiov, &hd_qiov, 0, n1);
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_preadv(bs->backing, offset, n1,
                                          &local_qiov, 0);
-                    qemu_co_mutex_lock(&s->lock);
 
                     qemu_iovec_destroy(&local_qiov);
 
@@ -1475,15 +1805,12 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_co_preadv_compressed(bs, cluster_offset,
+                                             offset_in_cluster, cur_bytes,
+                                             &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                                s->cluster_cache + offset_in_cluster,
-                                cur_bytes);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1516,11 +1843,9 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_preadv(bs->file,
                                  cluster_offset + offset_in_cluster,
                                  cur_bytes, &hd_qiov, 0);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -1554,14 +1879,50 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
     return ret;
 }
 
+/* Check if it's possible to merge a write request with the writing of
+ * the data from the COW regions */
+static bool merge_cow(uint64_t offset, unsigned bytes,
+                      QEMUIOVector *hd_qiov, QCowL2Meta *l2meta)
+{
+    QCowL2Meta *m;
+
+    for (m = l2meta; m != NULL; m = m->next) {
+        /* If both COW regions are empty then there's nothing to merge */
+        if (m->cow_start.nb_bytes == 0 && m->cow_end.nb_bytes == 0) {
+            continue;
+        }
+
+        /* The data (middle) region must be immediately after the
+         * start region */
+        if (l2meta_cow_start(m) + m->cow_start.nb_bytes != offset) {
+            continue;
+        }
+
+        /* The end region must be immediately after the data (middle)
+         * region */
+        if (m->offset + m->cow_end.offset != offset + bytes) {
+            continue;
+        }
+
+        /* Make sure that adding both COW regions to the QEMUIOVector
+         * does not exceed IOV_MAX */
+        if (hd_qiov->niov > IOV_MAX - 2) {
+            continue;
+        }
+
+        m->data_qiov = hd_qiov;
+        return true;
+    }
+
+    return false;
+}
+
 static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                          uint64_t bytes, QEMUIOVector *qiov,
                                          int flags)
@@ -1580,8 +1941,6 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -1644,16 +2003,22 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
             goto fail;
         }
 
-        qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                cluster_offset + offset_in_cluster);
-        ret = bdrv_co_pwritev(bs->file,
-                              cluster_offset + offset_in_cluster,
-                              cur_bytes, &hd_qiov, 0);
-        qemu_co_mutex_lock(&s->lock);
-        if (ret < 0) {
-            goto fail;
+        /* If we need to do COW, check if it's possible to merge the
+         * writing of the guest data together with that of the COW regions.
+         * If it's not possible (or not necessary) then write the
+         * guest data now. */
+        if (!merge_cow(offset, cur_bytes, &hd_qiov, l2meta)) {
+            qemu_co_mutex_unlock(&s->lock);
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    cluster_offset + offset_in_cluster);
+            ret = bdrv_co_pwritev(bs->file,
+                                  cluster_offset + offset_in_cluster,
+                                  cur_bytes, &hd_qiov, 0);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         while (l2meta != NULL) {
@@ -1710,6 +2075,17 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    qcow2_drop_cluster_pool(bs);
+
+    ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_report_err(local_err);
+        error_report("Persistent bitmaps are lost for node '%s'",
+                     bdrv_get_device_or_node_name(bs));
+    }
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1756,8 +2132,6 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1853,7 +2227,6 @@ int qcow2_update_header(BlockDriverState *bs)
         goto fail;
     }
 
-    header_length = sizeof(*header) + s->unknown_header_fields_size;
     total_size = bs->total_sectors * BDRV_SECTOR_SIZE;
     refcount_table_clusters = s->refcount_table_size >> (s->cluster_bits - 3);
 
@@ -1878,7 +2251,7 @@ int qcow2_update_header(BlockDriverState *bs)
         .compatible_features    = cpu_to_be64(s->compatible_features),
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
-        .header_length          = cpu_to_be32(header_length),
+        .compression_type       = s->compression_type,
     };
 
     /* For older versions, write a shorter header */
@@ -1887,13 +2260,23 @@ int qcow2_update_header(BlockDriverState *bs)
         ret = offsetof(QCowHeader, incompatible_features);
         break;
     case 3:
-        ret = sizeof(*header);
+        /* The compression type field is only needed for non-default types,
+         * or to keep unknown fields that follow it in place */
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB ||
+            s->unknown_header_fields_size) {
+            ret = sizeof(*header);
+        } else {
+            ret = offsetof(QCowHeader, compression_type);
+        }
         break;
     default:
         ret = -EINVAL;
         goto fail;
     }
 
+    header_length = ret + s->unknown_header_fields_size;
+    header->header_length = cpu_to_be32(header_length);
+
     buf += ret;
     buflen -= ret;
     memset(buf, 0, buflen);
@@ -1937,11 +2320,26 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1953,6 +2351,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2047,8 +2464,11 @@ static int preallocate(BlockDriverState *bs)
 
             ret = qcow2_alloc_cluster_link_l2(bs, meta);
             if (ret < 0) {
-                qcow2_free_any_clusters(bs, meta->alloc_offset,
-                                        meta->nb_clusters, QCOW2_DISCARD_NEVER);
+                if (!meta->keep_old_clusters) {
+                    qcow2_free_any_clusters(bs, meta->alloc_offset,
+                                            meta->nb_clusters,
+                                            QCOW2_DISCARD_NEVER);
+                }
                 return ret;
             }
 
@@ -2087,7 +2507,8 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         Qcow2CompressionType compression_type,
+                         bool extended_l2, Error **errp)
 {
     int cluster_bits;
     QDict *options;
@@ -2129,6 +2550,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         int64_t meta_size = 0;
         uint64_t nreftablee, nrefblocke, nl1e, nl2e;
         int64_t aligned_total_size = align_offset(total_size, cluster_size);
+        size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
         int refblock_bits, refblock_size;
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
@@ -2142,11 +2564,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2e_size);
+        meta_size += nl2e * l2e_size;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2e_size / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2212,8 +2634,17 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         .header_length              = cpu_to_be32(sizeof(*header)),
+        .compression_type           = compression_type,
     };
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        header->incompatible_features |=
+            cpu_to_be64(QCOW2_INCOMPAT_COMPRESSION);
+    } else {
+        header->header_length =
+            cpu_to_be32(offsetof(QCowHeader, compression_type));
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header->crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -2225,6 +2656,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (extended_l2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
     if (ret < 0) {
@@ -2342,6 +2777,8 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    bool extended_l2;
     Error *local_err = NULL;
     int ret;
 
@@ -2415,9 +2852,54 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE__MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+#ifndef CONFIG_ZSTD
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "zstd compression is not supported by this build");
+        ret = -ENOTSUP;
+        goto finish;
+    }
+#endif
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Non-zlib compression types require compatibility "
+                   "level 1.1 or above (use compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (extended_l2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 or "
+                       "greater)");
+            ret = -EINVAL;
+            goto finish;
+        }
+        if (cluster_size < (QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER <<
+                            MIN_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries are only supported with "
+                       "cluster sizes of at least %d bytes",
+                       QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER << MIN_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto finish;
+        }
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, extended_l2, &local_err);
     error_propagate(errp, local_err);
 
 finish:
@@ -2476,7 +2958,9 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         count = s->cluster_size;
         nr = s->cluster_size;
         ret = qcow2_get_cluster_offset(bs, offset, &nr, &off);
-        if (ret != QCOW2_CLUSTER_UNALLOCATED && ret != QCOW2_CLUSTER_ZERO) {
+        /* With subclusters, the whole cluster must have the same type */
+        if ((ret != QCOW2_CLUSTER_UNALLOCATED && ret != QCOW2_CLUSTER_ZERO) ||
+            nr != s->cluster_size) {
             qemu_co_mutex_unlock(&s->lock);
             return -ENOTSUP;
         }
@@ -2561,8 +3045,8 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
 
@@ -2588,38 +3072,18 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     }
 
     qemu_co_mutex_lock(&s->lock);
@@ -2680,6 +3144,10 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    /* The new refcount structure won't have the pool clusters allocated */
+    s->cluster_pool_offset = 0;
+    s->cluster_pool_nb_clusters = 0;
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -2815,13 +3283,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
+    if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
-         * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * the dirty flag) and only as long as there are no snapshots or stored
+         * bitmaps (because it completely empties the image). Furthermore, the
+         * L1 table and three additional clusters (image header, refcount
+         * table, one refcount block) have to fit inside one refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2905,6 +3373,11 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .compression_type   = s->compression_type,
+            .has_compression_type =
+                s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB,
+            .extended_l2        = has_subclusters(s),
+            .has_extended_l2    = has_subclusters(s),
         };
     } else {
         /* if this assertion fails, this probably means a new version was
@@ -2980,6 +3453,31 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("compat=0.10 requires compression_type=zlib");
+        return -ENOTSUP;
+    }
+
+    if (has_subclusters(s)) {
+        error_report("compat=0.10 does not support extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (s->nb_bitmaps || s->dirty_bitmaps_loaded) {
+        BdrvDirtyBitmap *bitmap;
+
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+                break;
+            }
+        }
+        if (s->nb_bitmaps || bitmap) {
+            error_report("compat=0.10 does not support persistent bitmaps");
+            return -ENOTSUP;
+        }
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3162,6 +3660,22 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                              "not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            const char *type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (type && strcmp(type,
+                    Qcow2CompressionType_lookup[s->compression_type])) {
+                error_report("Changing the compression type is not "
+                             "supported");
+                return -ENOTSUP;
+            }
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            bool extended_l2 = qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2,
+                                                 has_subclusters(s));
+            if (extended_l2 != has_subclusters(s)) {
+                error_report("Changing the extended L2 entries option is not "
+                             "supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -3373,6 +3887,18 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for compressed clusters "
+                    "(zlib, zstd)",
+        },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 entries: allocate 32 subclusters per cluster "
+                    "(needs a cluster size of at least 16k)",
+        },
         { /* end of list */ }
     }
 };
@@ -3419,6 +3945,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
+    .bdrv_reopen_bitmaps_rw     = qcow2_reopen_bitmaps_rw,
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
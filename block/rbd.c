@@ -53,6 +53,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* rbd_set_image_notification and rbd_poll_io_events added in 1.12.0 */
+#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(1, 12, 0) && defined(CONFIG_EVENTFD)
+#define LIBRBD_SUPPORTS_EVENTFD
+#else
+#undef LIBRBD_SUPPORTS_EVENTFD
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -61,6 +68,10 @@
 #define RBD_MAX_POOL_NAME_SIZE 128
 #define RBD_MAX_SNAP_NAME_SIZE 128
 #define RBD_MAX_SNAPS 100
+#define RBD_MAX_IMAGE_HANDLES 16
+
+/* Private return value that stops rbd_diff_iterate2() early */
+#define QEMU_RBD_EXIT_DIFF_ITERATE2 -9000
 
 typedef enum {
     RBD_AIO_READ,
@@ -69,28 +80,27 @@ typedef enum {
     RBD_AIO_FLUSH
 } RBDAIOCmd;
 
-typedef struct RBDAIOCB {
-    BlockAIOCB common;
-    int64_t ret;
-    QEMUIOVector *qiov;
-    char *bounce;
-    RBDAIOCmd cmd;
-    int error;
-    struct BDRVRBDState *s;
-} RBDAIOCB;
-
-typedef struct RADOSCB {
-    RBDAIOCB *acb;
-    struct BDRVRBDState *s;
-    int64_t size;
-    char *buf;
+typedef struct RBDTask {
+    Coroutine *co;
     int64_t ret;
-} RADOSCB;
+} RBDTask;
+
+typedef struct RBDImage {
+    rbd_image_t image;
+    unsigned in_flight;
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+    EventNotifier completion;
+#endif
+} RBDImage;
 
 typedef struct BDRVRBDState {
     rados_t cluster;
     rados_ioctx_t io_ctx;
-    rbd_image_t image;
+    /* All handles are open on the same image; images[0] is used for
+     * everything except reads and writes */
+    RBDImage images[RBD_MAX_IMAGE_HANDLES];
+    int num_images;
+    int next_image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     char *snap;
 } BDRVRBDState;
@@ -406,50 +416,6 @@ shutdown:
     return ret;
 }
 
-/*
- * This aio completion is being called from rbd_finish_bh() and runs in qemu
- * BH context.
- */
-static void qemu_rbd_complete_aio(RADOSCB *rcb)
-{
-    RBDAIOCB *acb = rcb->acb;
-    int64_t r;
-
-    r = rcb->ret;
-
-    if (acb->cmd != RBD_AIO_READ) {
-        if (r < 0) {
-            acb->ret = r;
-            acb->error = 1;
-        } else if (!acb->error) {
-            acb->ret = rcb->size;
-        }
-    } else {
-        if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
-            acb->ret = r;
-            acb->error = 1;
-        } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
-            if (!acb->error) {
-                acb->ret = rcb->size;
-            }
-        } else if (!acb->error) {
-            acb->ret = r;
-        }
-    }
-
-    g_free(rcb);
-
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
-    }
-    qemu_vfree(acb->bounce);
-    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
-
-    qemu_aio_unref(acb);
-}
-
 /* TODO Convert to fine grained options */
 static QemuOptsList runtime_opts = {
     .name = "rbd",
@@ -465,10 +431,65 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of secret providing the password",
         },
+        {
+            .name = "image-handles",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of librbd handles to issue I/O through "
+                    "(default: 1)",
+        },
         { /* end of list */ }
     },
 };
 
+static void qemu_rbd_close_images(BDRVRBDState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_images; i++) {
+        rbd_close(s->images[i].image);
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+        event_notifier_cleanup(&s->images[i].completion);
+#endif
+    }
+    s->num_images = 0;
+}
+
+static int qemu_rbd_open_image(BDRVRBDState *s, RBDImage *img, Error **errp)
+{
+    int r;
+
+    r = rbd_open(s->io_ctx, s->name, &img->image, s->snap);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "error reading header from %s", s->name);
+        return r;
+    }
+    img->in_flight = 0;
+
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+    r = event_notifier_init(&img->completion, false);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "failed to create completion eventfd");
+        goto failed_close;
+    }
+    r = rbd_set_image_notification(img->image,
+                                   event_notifier_get_fd(&img->completion),
+                                   EVENT_TYPE_EVENTFD);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "failed to set up completion eventfd");
+        event_notifier_cleanup(&img->completion);
+        goto failed_close;
+    }
+#endif
+
+    return 0;
+
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+failed_close:
+    rbd_close(img->image);
+    return r;
+#endif
+}
+
 static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
                          Error **errp)
 {
@@ -482,6 +503,7 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     QemuOpts *opts;
     Error *local_err = NULL;
     const char *filename;
+    uint64_t num_images, features;
     int r;
 
     opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
@@ -495,6 +517,20 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     filename = qemu_opt_get(opts, "filename");
     secretid = qemu_opt_get(opts, "password-secret");
 
+    num_images = qemu_opt_get_number(opts, "image-handles", 1);
+    if (num_images < 1 || num_images > RBD_MAX_IMAGE_HANDLES) {
+        error_setg(errp, "image-handles must be between 1 and %d",
+                   RBD_MAX_IMAGE_HANDLES);
+        r = -EINVAL;
+        goto failed_opts;
+    }
+    if (num_images > 1 && !(flags & BDRV_O_NOCACHE)) {
+        /* Separate librbd caches would not see each other's writes */
+        error_setg(errp, "image-handles > 1 requires cache.direct=on");
+        r = -EINVAL;
+        goto failed_opts;
+    }
+
     if (qemu_rbd_parsename(filename, pool, sizeof(pool),
                            snap_buf, sizeof(snap_buf),
                            s->name, sizeof(s->name),
@@ -562,17 +598,47 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
         goto failed_shutdown;
     }
 
-    r = rbd_open(s->io_ctx, s->name, &s->image, s->snap);
+    s->num_images = 0;
+    s->next_image = 0;
+    r = qemu_rbd_open_image(s, &s->images[0], errp);
     if (r < 0) {
-        error_setg_errno(errp, -r, "error reading header from %s", s->name);
         goto failed_open;
     }
+    s->num_images = 1;
+
+    if (num_images > 1) {
+        r = rbd_get_features(s->images[0].image, &features);
+        if (r < 0) {
+            error_setg_errno(errp, -r, "error reading features of %s",
+                             s->name);
+            goto failed_images;
+        }
+        if (features & RBD_FEATURE_EXCLUSIVE_LOCK) {
+            /* The handles would keep taking the lock from each other */
+            error_setg(errp, "image-handles > 1 is not supported for images "
+                       "with the exclusive-lock feature");
+            r = -EINVAL;
+            goto failed_images;
+        }
+    }
+
+    while (s->num_images < num_images) {
+        r = qemu_rbd_open_image(s, &s->images[s->num_images], errp);
+        if (r < 0) {
+            goto failed_images;
+        }
+        s->num_images++;
+    }
+
+    qemu_rbd_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     bs->read_only = (s->snap != NULL);
 
     qemu_opts_del(opts);
     return 0;
 
+failed_images:
+    qemu_rbd_close_images(s);
 failed_open:
     rados_ioctx_destroy(s->io_ctx);
 failed_shutdown:
@@ -587,39 +653,103 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
-    rbd_close(s->image);
+    qemu_rbd_detach_aio_context(bs);
+    qemu_rbd_close_images(s);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
     rados_shutdown(s->cluster);
 }
 
-static const AIOCBInfo rbd_aiocb_info = {
-    .aiocb_size = sizeof(RBDAIOCB),
-};
+/*
+ * Pick the handle with the fewest requests in flight, going round-robin
+ * among equally loaded handles.
+ */
+static RBDImage *qemu_rbd_get_image(BDRVRBDState *s)
+{
+    RBDImage *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_images; i++) {
+        RBDImage *img = &s->images[(s->next_image + i) % s->num_images];
+
+        if (!best || img->in_flight < best->in_flight) {
+            best = img;
+        }
+    }
+    s->next_image = (best - s->images + 1) % s->num_images;
+    return best;
+}
 
-static void rbd_finish_bh(void *opaque)
+static void rbd_complete_task(rbd_completion_t c, RBDTask *task)
 {
-    RADOSCB *rcb = opaque;
-    qemu_rbd_complete_aio(rcb);
+    task->ret = rbd_aio_get_return_value(c);
+    rbd_aio_release(c);
+    aio_co_wake(task->co);
+}
+
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+/*
+ * librbd signals completions on the image's eventfd; they are collected
+ * here, in the AioContext of the BDS, and the waiting coroutines are
+ * entered directly.
+ */
+static void qemu_rbd_completion_read(EventNotifier *e)
+{
+    RBDImage *img = container_of(e, RBDImage, completion);
+    rbd_completion_t comps[32];
+    int i, n;
+
+    event_notifier_test_and_clear(e);
+    do {
+        n = rbd_poll_io_events(img->image, comps, ARRAY_SIZE(comps));
+        for (i = 0; i < n; i++) {
+            rbd_complete_task(comps[i], rbd_aio_get_arg(comps[i]));
+        }
+    } while (n == ARRAY_SIZE(comps));
 }
 
+#define RBD_COMPLETION_CB NULL
+#else
 /*
- * This is the callback function for rbd_aio_read and _write
+ * This is the callback function for rbd_aio_* requests
  *
- * Note: this function is being called from a non qemu thread so
- * we need to be careful about what we do here. Generally we only
- * schedule a BH, and do the rest of the io completion handling
- * from rbd_finish_bh() which runs in a qemu context.
+ * Note: this function is being called from a non qemu thread.
+ * aio_co_wake() schedules the coroutine in its own AioContext.
  */
-static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
+static void rbd_finish_aiocb(rbd_completion_t c, RBDTask *task)
 {
-    RBDAIOCB *acb = rcb->acb;
+    rbd_complete_task(c, task);
+}
 
-    rcb->ret = rbd_aio_get_return_value(c);
-    rbd_aio_release(c);
+#define RBD_COMPLETION_CB ((rbd_callback_t) rbd_finish_aiocb)
+#endif
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+    BDRVRBDState *s = bs->opaque;
+    int i;
 
-    aio_bh_schedule_oneshot(bdrv_get_aio_context(acb->common.bs),
-                            rbd_finish_bh, rcb);
+    for (i = 0; i < s->num_images; i++) {
+        aio_set_event_notifier(new_context, &s->images[i].completion,
+                               false, qemu_rbd_completion_read, NULL);
+    }
+#endif
+}
+
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef LIBRBD_SUPPORTS_EVENTFD
+    BDRVRBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->num_images; i++) {
+        aio_set_event_notifier(bdrv_get_aio_context(bs),
+                               &s->images[i].completion,
+                               false, NULL, NULL);
+    }
+#endif
 }
 
 static int rbd_aio_discard_wrapper(rbd_image_t image,
@@ -644,129 +774,221 @@ static int rbd_aio_flush_wrapper(rbd_image_t image,
 #endif
 }
 
-static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
-                                 int64_t off,
-                                 QEMUIOVector *qiov,
-                                 int64_t size,
-                                 BlockCompletionFunc *cb,
-                                 void *opaque,
-                                 RBDAIOCmd cmd)
+static int coroutine_fn qemu_rbd_start_co(BlockDriverState *bs,
+                                          RBDImage *img,
+                                          uint64_t offset,
+                                          uint64_t bytes,
+                                          QEMUIOVector *qiov,
+                                          RBDAIOCmd cmd)
 {
-    RBDAIOCB *acb;
-    RADOSCB *rcb = NULL;
+    RBDTask task = { .co = qemu_coroutine_self() };
     rbd_completion_t c;
-    char *buf;
+    char *buf = NULL;
     int r;
 
-    BDRVRBDState *s = bs->opaque;
+    assert(!qiov || qiov->size == bytes);
 
-    acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
-    acb->cmd = cmd;
-    acb->qiov = qiov;
-    assert(!qiov || qiov->size == size);
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
-        acb->bounce = qemu_try_blockalign(bs, qiov->size);
-        if (acb->bounce == NULL) {
-            goto failed;
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    /* No vectored I/O in librbd, go through a linear bounce buffer */
+    if (qiov) {
+        buf = qemu_try_blockalign(bs, bytes);
+        if (buf == NULL) {
+            return -ENOMEM;
+        }
+        if (cmd == RBD_AIO_WRITE) {
+            qemu_iovec_to_buf(qiov, 0, buf, bytes);
         }
     }
-    acb->ret = 0;
-    acb->error = 0;
-    acb->s = s;
-
-    if (cmd == RBD_AIO_WRITE) {
-        qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
-    }
-
-    buf = acb->bounce;
+#endif
 
-    rcb = g_new(RADOSCB, 1);
-    rcb->acb = acb;
-    rcb->buf = buf;
-    rcb->s = acb->s;
-    rcb->size = size;
-    r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
+    r = rbd_aio_create_completion(&task, RBD_COMPLETION_CB, &c);
     if (r < 0) {
-        goto failed;
+        goto out;
     }
 
     switch (cmd) {
     case RBD_AIO_WRITE:
-        r = rbd_aio_write(s->image, off, size, buf, c);
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(img->image, qiov->iov, qiov->niov, offset, c);
+#else
+        r = rbd_aio_write(img->image, offset, bytes, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
-        r = rbd_aio_read(s->image, off, size, buf, c);
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(img->image, qiov->iov, qiov->niov, offset, c);
+#else
+        r = rbd_aio_read(img->image, offset, bytes, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
-        r = rbd_aio_discard_wrapper(s->image, off, size, c);
+        r = rbd_aio_discard_wrapper(img->image, offset, bytes, c);
         break;
     case RBD_AIO_FLUSH:
-        r = rbd_aio_flush_wrapper(s->image, c);
+        r = rbd_aio_flush_wrapper(img->image, c);
         break;
     default:
         r = -EINVAL;
     }
 
     if (r < 0) {
-        goto failed_completion;
+        rbd_aio_release(c);
+        goto out;
     }
 
-    return &acb->common;
+    /* The completion always wakes us up exactly once */
+    img->in_flight++;
+    qemu_coroutine_yield();
+    img->in_flight--;
 
-failed_completion:
-    rbd_aio_release(c);
-failed:
-    g_free(rcb);
-    qemu_vfree(acb->bounce);
-    qemu_aio_unref(acb);
-    return NULL;
+    if (task.ret < 0) {
+        r = task.ret;
+        goto out;
+    }
+
+    r = 0;
+    if (cmd == RBD_AIO_READ) {
+        /* Short read: the rest is beyond the end of the image */
+#ifndef LIBRBD_SUPPORTS_IOVEC
+        qemu_iovec_from_buf(qiov, 0, buf, task.ret);
+#endif
+        if (task.ret < bytes) {
+            qemu_iovec_memset(qiov, task.ret, 0, bytes - task.ret);
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    return r;
 }
 
-static BlockAIOCB *qemu_rbd_aio_readv(BlockDriverState *bs,
-                                      int64_t sector_num,
-                                      QEMUIOVector *qiov,
-                                      int nb_sectors,
-                                      BlockCompletionFunc *cb,
-                                      void *opaque)
+static int coroutine_fn qemu_rbd_co_preadv(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov, int flags)
 {
-    return rbd_start_aio(bs, sector_num << BDRV_SECTOR_BITS, qiov,
-                         (int64_t) nb_sectors << BDRV_SECTOR_BITS, cb, opaque,
-                         RBD_AIO_READ);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque),
+                             offset, bytes, qiov, RBD_AIO_READ);
 }
 
-static BlockAIOCB *qemu_rbd_aio_writev(BlockDriverState *bs,
-                                       int64_t sector_num,
-                                       QEMUIOVector *qiov,
-                                       int nb_sectors,
-                                       BlockCompletionFunc *cb,
-                                       void *opaque)
+static int coroutine_fn qemu_rbd_co_pwritev(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov, int flags)
 {
-    return rbd_start_aio(bs, sector_num << BDRV_SECTOR_BITS, qiov,
-                         (int64_t) nb_sectors << BDRV_SECTOR_BITS, cb, opaque,
-                         RBD_AIO_WRITE);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque),
+                             offset, bytes, qiov, RBD_AIO_WRITE);
 }
 
-#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
-static BlockAIOCB *qemu_rbd_aio_flush(BlockDriverState *bs,
-                                      BlockCompletionFunc *cb,
-                                      void *opaque)
+static int coroutine_fn qemu_rbd_co_flush(BlockDriverState *bs)
 {
-    return rbd_start_aio(bs, 0, NULL, 0, cb, opaque, RBD_AIO_FLUSH);
-}
+    BDRVRBDState *s = bs->opaque;
+    int i, r;
 
+    /* Each handle has its own writeback cache, if any */
+    for (i = 0; i < s->num_images; i++) {
+#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
+        r = qemu_rbd_start_co(bs, &s->images[i], 0, 0, NULL, RBD_AIO_FLUSH);
+#elif LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
+        /* rbd_flush added in 0.1.1 */
+        r = rbd_flush(s->images[i].image);
 #else
+        r = 0;
+#endif
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+#ifdef RBD_FLAG_FAST_DIFF_INVALID
+typedef struct RBDDiffIterateReq {
+    uint64_t offs;
+    uint64_t bytes;
+    bool exists;
+} RBDDiffIterateReq;
 
-static int qemu_rbd_co_flush(BlockDriverState *bs)
+/*
+ * Called by rbd_diff_iterate2() for each allocated extent, in order.
+ * Only the first run of allocated or unallocated data starting at
+ * req->offs is of interest.
+ */
+static int qemu_rbd_diff_iterate_cb(uint64_t offs, size_t len,
+                                    int exists, void *opaque)
 {
-#if LIBRBD_VERSION_CODE >= LIBRBD_VERSION(0, 1, 1)
-    /* rbd_flush added in 0.1.1 */
-    BDRVRBDState *s = bs->opaque;
-    return rbd_flush(s->image);
-#else
+    RBDDiffIterateReq *req = opaque;
+
+    assert(req->offs + req->bytes <= offs);
+
+    if (!exists) {
+        /* A hole, same as unallocated data */
+        return 0;
+    }
+
+    if (!req->exists && offs > req->offs) {
+        /* Started in a hole, which ends here */
+        req->bytes = offs - req->offs;
+        return QEMU_RBD_EXIT_DIFF_ITERATE2;
+    }
+
+    if (req->exists && offs > req->offs + req->bytes) {
+        /* Allocated data followed by a hole */
+        return QEMU_RBD_EXIT_DIFF_ITERATE2;
+    }
+
+    req->bytes += len;
+    req->exists = true;
     return 0;
-#endif
+}
+
+/*
+ * With the object map and fast-diff features, rbd_diff_iterate2() looks
+ * up allocation status without touching the data objects, so sparse
+ * copies (convert, mirror) can skip unallocated areas cheaply.
+ */
+static int64_t coroutine_fn
+qemu_rbd_co_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum,
+                             BlockDriverState **file)
+{
+    BDRVRBDState *s = bs->opaque;
+    rbd_image_t image = s->images[0].image;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int64_t bytes = (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    RBDDiffIterateReq req = { .offs = offset };
+    uint64_t features, flags;
+    int64_t status = BDRV_BLOCK_DATA;
+    int r;
+
+    *pnum = nb_sectors;
+    *file = bs;
+
+    r = rbd_get_features(image, &features);
+    if (r < 0 || !(features & RBD_FEATURE_FAST_DIFF)) {
+        goto out;
+    }
+    r = rbd_get_flags(image, &flags);
+    if (r < 0 || (flags & RBD_FLAG_FAST_DIFF_INVALID)) {
+        goto out;
+    }
+
+    r = rbd_diff_iterate2(image, NULL, offset, bytes, true, true,
+                          qemu_rbd_diff_iterate_cb, &req);
+    if (r < 0 && r != QEMU_RBD_EXIT_DIFF_ITERATE2) {
+        goto out;
+    }
+    assert(req.bytes <= bytes);
+
+    if (!req.exists) {
+        if (r == 0) {
+            /* Nothing allocated in the whole range */
+            req.bytes = bytes;
+        }
+        status = BDRV_BLOCK_ZERO;
+    }
+    *pnum = DIV_ROUND_UP(req.bytes, BDRV_SECTOR_SIZE);
+
+out:
+    return status | BDRV_BLOCK_OFFSET_VALID | offset;
 }
 #endif
 
@@ -776,7 +998,7 @@ static int qemu_rbd_getinfo(BlockDriverState *bs, BlockDriverInfo *bdi)
     rbd_image_info_t info;
     int r;
 
-    r = rbd_stat(s->image, &info, sizeof(info));
+    r = rbd_stat(s->images[0].image, &info, sizeof(info));
     if (r < 0) {
         return r;
     }
@@ -791,7 +1013,7 @@ static int64_t qemu_rbd_getlength(BlockDriverState *bs)
     rbd_image_info_t info;
     int r;
 
-    r = rbd_stat(s->image, &info, sizeof(info));
+    r = rbd_stat(s->images[0].image, &info, sizeof(info));
     if (r < 0) {
         return r;
     }
@@ -804,7 +1026,7 @@ static int qemu_rbd_truncate(BlockDriverState *bs, int64_t offset)
     BDRVRBDState *s = bs->opaque;
     int r;
 
-    r = rbd_resize(s->image, offset);
+    r = rbd_resize(s->images[0].image, offset);
     if (r < 0) {
         return r;
     }
@@ -835,7 +1057,7 @@ static int qemu_rbd_snap_create(BlockDriverState *bs,
         return -ERANGE;
     }
 
-    r = rbd_snap_create(s->image, sn_info->name);
+    r = rbd_snap_create(s->images[0].image, sn_info->name);
     if (r < 0) {
         error_report("failed to create snap: %s", strerror(-r));
         return r;
@@ -866,7 +1088,7 @@ static int qemu_rbd_snap_remove(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    r = rbd_snap_remove(s->image, snapshot_name);
+    r = rbd_snap_remove(s->images[0].image, snapshot_name);
     if (r < 0) {
         error_setg_errno(errp, -r, "Failed to remove the snapshot");
     }
@@ -878,7 +1100,7 @@ static int qemu_rbd_snap_rollback(BlockDriverState *bs,
 {
     BDRVRBDState *s = bs->opaque;
 
-    return rbd_snap_rollback(s->image, snapshot_name);
+    return rbd_snap_rollback(s->images[0].image, snapshot_name);
 }
 
 static int qemu_rbd_snap_list(BlockDriverState *bs,
@@ -892,7 +1114,7 @@ static int qemu_rbd_snap_list(BlockDriverState *bs,
 
     do {
         snaps = g_new(rbd_snap_info_t, max_snaps);
-        snap_count = rbd_snap_list(s->image, snaps, &max_snaps);
+        snap_count = rbd_snap_list(s->images[0].image, snaps, &max_snaps);
         if (snap_count <= 0) {
             g_free(snaps);
         }
@@ -925,14 +1147,11 @@ static int qemu_rbd_snap_list(BlockDriverState *bs,
 }
 
 #ifdef LIBRBD_SUPPORTS_DISCARD
-static BlockAIOCB *qemu_rbd_aio_pdiscard(BlockDriverState *bs,
-                                         int64_t offset,
-                                         int count,
-                                         BlockCompletionFunc *cb,
-                                         void *opaque)
+static int coroutine_fn qemu_rbd_co_pdiscard(BlockDriverState *bs,
+                                             int64_t offset, int count)
 {
-    return rbd_start_aio(bs, offset, NULL, count, cb, opaque,
-                         RBD_AIO_DISCARD);
+    return qemu_rbd_start_co(bs, qemu_rbd_get_image(bs->opaque),
+                             offset, count, NULL, RBD_AIO_DISCARD);
 }
 #endif
 
@@ -941,9 +1160,14 @@ static void qemu_rbd_invalidate_cache(BlockDriverState *bs,
                                       Error **errp)
 {
     BDRVRBDState *s = bs->opaque;
-    int r = rbd_invalidate_cache(s->image);
-    if (r < 0) {
-        error_setg_errno(errp, -r, "Failed to invalidate the cache");
+    int i, r;
+
+    for (i = 0; i < s->num_images; i++) {
+        r = rbd_invalidate_cache(s->images[i].image);
+        if (r < 0) {
+            error_setg_errno(errp, -r, "Failed to invalidate the cache");
+            return;
+        }
     }
 }
 #endif
@@ -985,19 +1209,21 @@ static BlockDriver bdrv_rbd = {
     .bdrv_truncate      = qemu_rbd_truncate,
     .protocol_name      = "rbd",
 
-    .bdrv_aio_readv         = qemu_rbd_aio_readv,
-    .bdrv_aio_writev        = qemu_rbd_aio_writev,
-
-#ifdef LIBRBD_SUPPORTS_AIO_FLUSH
-    .bdrv_aio_flush         = qemu_rbd_aio_flush,
-#else
+    .bdrv_co_preadv         = qemu_rbd_co_preadv,
+    .bdrv_co_pwritev        = qemu_rbd_co_pwritev,
     .bdrv_co_flush_to_disk  = qemu_rbd_co_flush,
-#endif
 
 #ifdef LIBRBD_SUPPORTS_DISCARD
-    .bdrv_aio_pdiscard      = qemu_rbd_aio_pdiscard,
+    .bdrv_co_pdiscard       = qemu_rbd_co_pdiscard,
 #endif
 
+#ifdef RBD_FLAG_FAST_DIFF_INVALID
+    .bdrv_co_get_block_status = qemu_rbd_co_get_block_status,
+#endif
+
+    .bdrv_attach_aio_context = qemu_rbd_attach_aio_context,
+    .bdrv_detach_aio_context = qemu_rbd_detach_aio_context,
+
     .bdrv_snapshot_create   = qemu_rbd_snap_create,
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
     .bdrv_snapshot_list     = qemu_rbd_snap_list,
@@ -310,12 +310,14 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->active_disk->bs->drv->bdrv_make_empty(s->active_disk->bs);
+    bdrv_block_status_cache_invalidate(s->active_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make active disk empty");
         return;
     }
 
     ret = s->hidden_disk->bs->drv->bdrv_make_empty(s->hidden_disk->bs);
+    bdrv_block_status_cache_invalidate(s->hidden_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make hidden disk empty");
         return;
@@ -511,6 +513,7 @@ static void replication_start(ReplicationState *rs, ReplicationMode mode,
 
         job = backup_job_create(NULL, s->secondary_disk->bs, s->hidden_disk->bs,
                                 0, MIRROR_SYNC_MODE_NONE, NULL, false,
+                                0, 0, true,
                                 BLOCKDEV_ON_ERROR_REPORT,
                                 BLOCKDEV_ON_ERROR_REPORT, BLOCK_JOB_INTERNAL,
                                 backup_job_completed, bs, NULL, &local_err);
@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "sysemu/block-backend.h"
 #include "block/throttle-groups.h"
 #include "qemu/queue.h"
@@ -52,15 +53,31 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * To keep the lock off the fast path, a BlockBackend that gets a
+ * request through while nobody in the group is being throttled is
+ * also given a credit: a share of the I/O that the group could still
+ * do without throttling, which is accounted in the ThrottleState right
+ * away.  Following requests of the same type are charged against the
+ * credit without taking the lock, as long as no other member of the
+ * group has to wait.  Whatever is left of a credit is given back the
+ * next time the BlockBackend goes through the slow path, and credits
+ * granted before the last throttle_group_config() are simply dropped
+ * (the configuration resets the buckets).
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
+    unsigned nb_members;
     BlockBackend *tokens[2];
+    /* Also read without the lock to decide whether credits can be used */
     bool any_timer_armed[2];
+    /* Generation of the credits, bumped on every configuration change.
+     * Also read without the lock. */
+    unsigned credit_gen;
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -254,7 +271,7 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
     /* If a timer just got armed, set blk as the current token */
     if (must_wait) {
         tg->tokens[is_write] = blk;
-        tg->any_timer_armed[is_write] = true;
+        atomic_set(&tg->any_timer_armed[is_write], true);
     }
 
     return must_wait;
@@ -293,12 +310,104 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
             ThrottleTimers *tt = &blk_get_public(token)->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
             timer_mod(tt->timers[is_write], now + 1);
-            tg->any_timer_armed[is_write] = true;
+            atomic_set(&tg->any_timer_armed[is_write], true);
         }
         tg->tokens[is_write] = token;
     }
 }
 
+/* Charge an I/O request against the credit of a BlockBackend, if the
+ * credit is large enough and still valid.
+ *
+ * This is called without tg->lock.
+ *
+ * @blk:       the current BlockBackend
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request was covered by the credit
+ */
+static bool throttle_group_use_credit(BlockBackend *blk, unsigned int bytes,
+                                      bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    double units = 1.0;
+
+    /* Requests that are already queued go first, and so do the other
+     * members of the group if they are being throttled */
+    if (blkp->pending_reqs[is_write] ||
+        blkp->throttle_credit_gen[is_write] != atomic_read(&tg->credit_gen) ||
+        atomic_read(&tg->any_timer_armed[is_write])) {
+        return false;
+    }
+
+    /* Same as throttle_account() */
+    if (blkp->throttle_credit_op_size &&
+        bytes > blkp->throttle_credit_op_size) {
+        units = (double) bytes / blkp->throttle_credit_op_size;
+    }
+
+    if (blkp->throttle_credit_bytes[is_write] < bytes ||
+        blkp->throttle_credit_units[is_write] < units) {
+        return false;
+    }
+
+    blkp->throttle_credit_bytes[is_write] -= bytes;
+    blkp->throttle_credit_units[is_write] -= units;
+    return true;
+}
+
+/* Give back what is left of a BlockBackend's credit.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the BlockBackend
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_return_credit(BlockBackend *blk, bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    if (blkp->throttle_credit_gen[is_write] == tg->credit_gen) {
+        throttle_reserve(&tg->ts, is_write,
+                         -blkp->throttle_credit_bytes[is_write],
+                         -blkp->throttle_credit_units[is_write]);
+    }
+    blkp->throttle_credit_bytes[is_write] = 0;
+    blkp->throttle_credit_units[is_write] = 0;
+}
+
+/* Give a BlockBackend a share of the I/O that the group can do before it
+ * has to throttle.  Half of the headroom is split among the members, so
+ * that those without a credit still find some room.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @blk:       the BlockBackend
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_credit(BlockBackend *blk, bool is_write)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    double bytes, units;
+
+    if (tg->any_timer_armed[is_write] || blkp->pending_reqs[is_write]) {
+        return;
+    }
+
+    throttle_compute_headroom(&tg->ts, is_write, &bytes, &units);
+    bytes /= 2 * tg->nb_members;
+    units /= 2 * tg->nb_members;
+    throttle_reserve(&tg->ts, is_write, bytes, units);
+
+    blkp->throttle_credit_bytes[is_write] = bytes;
+    blkp->throttle_credit_units[is_write] = units;
+    blkp->throttle_credit_gen[is_write] = tg->credit_gen;
+    blkp->throttle_credit_op_size = tg->ts.cfg.op_size;
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -316,7 +425,13 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    if (throttle_group_use_credit(blk, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
+    throttle_group_return_credit(blk, is_write);
 
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(blk, is_write);
@@ -337,6 +452,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
 
+    throttle_group_grant_credit(blk, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -368,12 +485,14 @@ void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_mutex_lock(&tg->lock);
     /* throttle_config() cancels the timers */
     if (timer_pending(tt->timers[0])) {
-        tg->any_timer_armed[0] = false;
+        atomic_set(&tg->any_timer_armed[0], false);
     }
     if (timer_pending(tt->timers[1])) {
-        tg->any_timer_armed[1] = false;
+        atomic_set(&tg->any_timer_armed[1], false);
     }
     throttle_config(ts, tt, cfg);
+    /* The buckets are empty now, so outstanding credits are void */
+    atomic_set(&tg->credit_gen, tg->credit_gen + 1);
     qemu_mutex_unlock(&tg->lock);
 
     qemu_co_enter_next(&blkp->throttled_reqs[0]);
@@ -412,7 +531,7 @@ static void timer_cb(BlockBackend *blk, bool is_write)
 
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
-    tg->any_timer_armed[is_write] = false;
+    atomic_set(&tg->any_timer_armed[is_write], false);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -470,6 +589,7 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     }
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
+    tg->nb_members++;
 
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
@@ -503,6 +623,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 
     qemu_mutex_lock(&tg->lock);
     for (i = 0; i < 2; i++) {
+        throttle_group_return_credit(blk, i);
         if (tg->tokens[i] == blk) {
             BlockBackend *token = throttle_group_next_blk(blk);
             /* Take care of the case where this is the last blk in the group */
@@ -515,6 +636,7 @@ void throttle_group_unregister_blk(BlockBackend *blk)
 
     /* remove the current blk from the list */
     QLIST_REMOVE(blkp, round_robin);
+    tg->nb_members--;
     throttle_timers_destroy(&blkp->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
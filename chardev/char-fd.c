@@ -91,10 +91,10 @@ static void fd_chr_update_read_handler(Chardev *chr,
 
     remove_fd_in_watch(chr);
     if (s->ioc_in) {
-        chr->fd_in_tag = io_add_watch_poll(chr, s->ioc_in,
-                                           fd_chr_read_poll,
-                                           fd_chr_read, chr,
-                                           context);
+        chr->gsource = io_add_watch_poll(chr, s->ioc_in,
+                                         fd_chr_read_poll,
+                                         fd_chr_read, chr,
+                                         context);
     }
 }
 
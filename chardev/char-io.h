@@ -29,12 +29,12 @@
 #include "sysemu/char.h"
 
 /* Can only be used for read */
-guint io_add_watch_poll(Chardev *chr,
-                        QIOChannel *ioc,
-                        IOCanReadHandler *fd_can_read,
-                        QIOChannelFunc fd_read,
-                        gpointer user_data,
-                        GMainContext *context);
+GSource *io_add_watch_poll(Chardev *chr,
+                           QIOChannel *ioc,
+                           IOCanReadHandler *fd_can_read,
+                           QIOChannelFunc fd_read,
+                           gpointer user_data,
+                           GMainContext *context);
 
 void remove_fd_in_watch(Chardev *chr);
 
@@ -215,11 +215,11 @@ static void pty_chr_state(Chardev *chr, int connected)
             s->connected = 1;
             s->open_tag = g_idle_add(qemu_chr_be_generic_open_func, chr);
         }
-        if (!chr->fd_in_tag) {
-            chr->fd_in_tag = io_add_watch_poll(chr, s->ioc,
-                                               pty_chr_read_poll,
-                                               pty_chr_read,
-                                               chr, NULL);
+        if (!chr->gsource) {
+            chr->gsource = io_add_watch_poll(chr, s->ioc,
+                                             pty_chr_read_poll,
+                                             pty_chr_read,
+                                             chr, NULL);
         }
     }
 }
@@ -26,6 +26,8 @@
 #include "io/channel-socket.h"
 #include "io/channel-tls.h"
 #include "qemu/error-report.h"
+#include "qemu/buffer.h"
+#include "qemu/iov.h"
 #include "qapi/error.h"
 #include "qapi/clone-visitor.h"
 
@@ -35,6 +37,9 @@
 /* TCP Net console */
 
 #define TCP_MAX_FDS 16
+#define TCP_READ_BUF_LEN 65536
+/* Coalesced writes beyond this are pushed to the socket right away */
+#define TCP_WRITE_BUF_LEN 65536
 
 typedef struct {
     Chardev parent;
@@ -52,6 +57,12 @@ typedef struct {
     size_t read_msgfds_num;
     int *write_msgfds;
     size_t write_msgfds_num;
+    uint8_t read_buf[TCP_READ_BUF_LEN];
+
+    /* Output not yet handed to the channel when coalescing */
+    Buffer write_buf;
+    int64_t write_coalesce;
+    guint write_timer;
 
     SocketAddress *addr;
     bool is_listen;
@@ -99,16 +110,152 @@ static gboolean tcp_chr_accept(QIOChannel *chan,
 
 static int tcp_chr_read_poll(void *opaque);
 static void tcp_chr_disconnect(Chardev *chr);
+static gboolean tcp_chr_write_timeout(gpointer opaque);
+
+/*
+ * Send whatever is left in write_buf followed by @iov, with a single
+ * writev so that the caller's data is not copied.  Returns how many
+ * bytes of @iov went out, or -1 with errno set if none did.
+ */
+static ssize_t tcp_chr_write_pending(SocketChardev *s,
+                                     const struct iovec *iov, int iovcnt)
+{
+    size_t pending = s->write_buf.offset;
+    struct iovec local[8];
+    struct iovec *vec = local;
+    int nvec = 0;
+    ssize_t ret;
+
+    if (iovcnt >= ARRAY_SIZE(local)) {
+        vec = g_new(struct iovec, iovcnt + 1);
+    }
+    if (pending) {
+        vec[nvec].iov_base = s->write_buf.buffer;
+        vec[nvec].iov_len = pending;
+        nvec++;
+    }
+    if (iovcnt) {
+        memcpy(vec + nvec, iov, iovcnt * sizeof(*iov));
+    }
+    nvec = MIN(nvec + iovcnt, IOV_MAX);
+
+    ret = nvec ? qio_channel_writev(s->ioc, vec, nvec, NULL) : 0;
+    if (vec != local) {
+        g_free(vec);
+    }
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        errno = EAGAIN;
+        return -1;
+    } else if (ret < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ret < pending) {
+        buffer_advance(&s->write_buf, ret);
+        if (iovcnt) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
+    }
+    buffer_advance(&s->write_buf, pending);
+    return ret - pending;
+}
+
+static void tcp_chr_arm_write_timer(Chardev *chr)
+{
+    SocketChardev *s = SOCKET_CHARDEV(chr);
+
+    if (s->write_timer || buffer_empty(&s->write_buf)) {
+        return;
+    }
+    s->write_timer = g_timeout_add(s->write_coalesce,
+                                   tcp_chr_write_timeout, chr);
+}
+
+/* Copy @iov from @offset on to the end of write_buf */
+static void tcp_chr_hold_back(SocketChardev *s, const struct iovec *iov,
+                              int iovcnt, size_t offset, size_t len)
+{
+    buffer_reserve(&s->write_buf, len);
+    iov_to_buf(iov, iovcnt, offset, buffer_end(&s->write_buf), len);
+    s->write_buf.offset += len;
+}
 
 /* Called with chr_write_lock held.  */
-static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
+static int tcp_chr_write_coalesced(Chardev *chr, const struct iovec *iov,
+                                   int iovcnt)
+{
+    SocketChardev *s = SOCKET_CHARDEV(chr);
+    size_t len = iov_size(iov, iovcnt);
+    ssize_t ret;
+
+    if (s->write_buf.offset + len < TCP_WRITE_BUF_LEN) {
+        tcp_chr_hold_back(s, iov, iovcnt, 0, len);
+        tcp_chr_arm_write_timer(chr);
+        return len;
+    }
+
+    /* Too much to hold back, flush the backlog together with @iov */
+    ret = tcp_chr_write_pending(s, iov, iovcnt);
+    if (ret < 0 && errno != EAGAIN) {
+        return ret;
+    }
+    if (ret < 0) {
+        ret = 0;
+    }
+    if (s->write_buf.offset + (len - ret) < TCP_WRITE_BUF_LEN) {
+        tcp_chr_hold_back(s, iov, iovcnt, ret, len - ret);
+        ret = len;
+    }
+    tcp_chr_arm_write_timer(chr);
+
+    if (!ret) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return ret;
+}
+
+/* Called with chr_write_lock held.  */
+static int tcp_chr_writev(Chardev *chr, const struct iovec *iov, int iovcnt)
 {
     SocketChardev *s = SOCKET_CHARDEV(chr);
+    int ret;
 
-    if (s->connected) {
-        int ret =  io_channel_send_full(s->ioc, buf, len,
-                                        s->write_msgfds,
-                                        s->write_msgfds_num);
+    if (!s->connected) {
+        /* XXX: indicate an error ? */
+        return iov_size(iov, iovcnt);
+    }
+
+    if (s->write_coalesce && !s->write_msgfds_num) {
+        ret = tcp_chr_write_coalesced(chr, iov, iovcnt);
+    } else if (!buffer_empty(&s->write_buf) &&
+               (tcp_chr_write_pending(s, NULL, 0) < 0 ||
+                !buffer_empty(&s->write_buf))) {
+        /* The fds go along with @iov, so the backlog must be gone first */
+        if (!buffer_empty(&s->write_buf)) {
+            errno = EAGAIN;
+        }
+        ret = -1;
+    } else {
+        if (iovcnt == 1) {
+            ret = io_channel_send_full(s->ioc, iov->iov_base, iov->iov_len,
+                                       s->write_msgfds,
+                                       s->write_msgfds_num);
+        } else {
+            ret = qio_channel_writev_full(s->ioc, iov, MIN(iovcnt, IOV_MAX),
+                                          s->write_msgfds,
+                                          s->write_msgfds_num, NULL);
+            if (ret == QIO_CHANNEL_ERR_BLOCK) {
+                errno = EAGAIN;
+                ret = -1;
+            } else if (ret < 0) {
+                errno = EINVAL;
+                ret = -1;
+            }
+        }
 
         /* free the written msgfds, no matter what */
         if (s->write_msgfds_num) {
@@ -116,19 +263,49 @@ static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
             s->write_msgfds = 0;
             s->write_msgfds_num = 0;
         }
+    }
 
-        if (ret < 0 && errno != EAGAIN) {
-            if (tcp_chr_read_poll(chr) <= 0) {
-                tcp_chr_disconnect(chr);
-                return len;
-            } /* else let the read handler finish it properly */
-        }
+    if (ret < 0 && errno != EAGAIN) {
+        if (tcp_chr_read_poll(chr) <= 0) {
+            tcp_chr_disconnect(chr);
+            return iov_size(iov, iovcnt);
+        } /* else let the read handler finish it properly */
+    }
 
-        return ret;
-    } else {
-        /* XXX: indicate an error ? */
-        return len;
+    return ret;
+}
+
+/* Called with chr_write_lock held.  */
+static int tcp_chr_write(Chardev *chr, const uint8_t *buf, int len)
+{
+    struct iovec iov = { .iov_base = (uint8_t *)buf, .iov_len = len };
+
+    return tcp_chr_writev(chr, &iov, 1);
+}
+
+static gboolean tcp_chr_write_timeout(gpointer opaque)
+{
+    Chardev *chr = CHARDEV(opaque);
+    SocketChardev *s = SOCKET_CHARDEV(opaque);
+    bool failed = false;
+    bool again;
+
+    qemu_mutex_lock(&chr->chr_write_lock);
+    if (s->connected && tcp_chr_write_pending(s, NULL, 0) < 0) {
+        failed = errno != EAGAIN;
     }
+    /* Keep polling while the socket is full */
+    again = !failed && !buffer_empty(&s->write_buf);
+    if (!again) {
+        s->write_timer = 0;
+    }
+    qemu_mutex_unlock(&chr->chr_write_lock);
+
+    if (failed && tcp_chr_read_poll(chr) <= 0) {
+        tcp_chr_disconnect(chr);
+    }
+
+    return again;
 }
 
 static int tcp_chr_read_poll(void *opaque)
@@ -328,6 +505,11 @@ static void tcp_chr_free_connection(Chardev *chr)
     }
 
     tcp_set_msgfds(chr, NULL, 0);
+    if (s->write_timer) {
+        g_source_remove(s->write_timer);
+        s->write_timer = 0;
+    }
+    buffer_reset(&s->write_buf);
     remove_fd_in_watch(chr);
     object_unref(OBJECT(s->sioc));
     s->sioc = NULL;
@@ -389,13 +571,13 @@ static gboolean tcp_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
 {
     Chardev *chr = CHARDEV(opaque);
     SocketChardev *s = SOCKET_CHARDEV(opaque);
-    uint8_t buf[CHR_READ_BUF_LEN];
+    uint8_t *buf = s->read_buf;
     int len, size;
 
     if (!s->connected || s->max_size <= 0) {
         return TRUE;
     }
-    len = sizeof(buf);
+    len = sizeof(s->read_buf);
     if (len > s->max_size) {
         len = s->max_size;
     }
@@ -481,10 +663,10 @@ static void tcp_chr_connect(void *opaque)
 
     s->connected = 1;
     if (s->ioc) {
-        chr->fd_in_tag = io_add_watch_poll(chr, s->ioc,
-                                           tcp_chr_read_poll,
-                                           tcp_chr_read,
-                                           chr, NULL);
+        chr->gsource = io_add_watch_poll(chr, s->ioc,
+                                         tcp_chr_read_poll,
+                                         tcp_chr_read,
+                                         chr, chr->gcontext);
     }
     qemu_chr_be_generic_open(chr);
 }
@@ -500,10 +682,10 @@ static void tcp_chr_update_read_handler(Chardev *chr,
 
     remove_fd_in_watch(chr);
     if (s->ioc) {
-        chr->fd_in_tag = io_add_watch_poll(chr, s->ioc,
-                                           tcp_chr_read_poll,
-                                           tcp_chr_read, chr,
-                                           context);
+        chr->gsource = io_add_watch_poll(chr, s->ioc,
+                                         tcp_chr_read_poll,
+                                         tcp_chr_read, chr,
+                                         context);
     }
 }
 
@@ -749,6 +931,7 @@ static void char_socket_finalize(Object *obj)
     SocketChardev *s = SOCKET_CHARDEV(obj);
 
     tcp_chr_free_connection(chr);
+    buffer_free(&s->write_buf);
 
     if (s->reconnect_timer) {
         g_source_remove(s->reconnect_timer);
@@ -829,6 +1012,13 @@ static void qmp_chardev_open_socket(Chardev *chr,
     s->is_listen = is_listen;
     s->is_telnet = is_telnet;
     s->do_nodelay = do_nodelay;
+    buffer_init(&s->write_buf, "chardev-socket-%s", chr->label);
+    s->write_coalesce = sock->has_coalesce ? sock->coalesce : 0;
+    if (s->write_coalesce < 0 || s->write_coalesce > G_MAXUINT32) {
+        error_setg(errp, "Invalid coalesce value %" PRId64,
+                   s->write_coalesce);
+        return;
+    }
     if (sock->tls_creds) {
         Object *creds;
         creds = object_resolve_path_component(
@@ -932,6 +1122,7 @@ static void qemu_chr_parse_socket(QemuOpts *opts, ChardevBackend *backend,
     bool is_telnet      = qemu_opt_get_bool(opts, "telnet", false);
     bool do_nodelay     = !qemu_opt_get_bool(opts, "delay", true);
     int64_t reconnect   = qemu_opt_get_number(opts, "reconnect", 0);
+    int64_t coalesce    = qemu_opt_get_number(opts, "coalesce", 0);
     const char *path = qemu_opt_get(opts, "path");
     const char *host = qemu_opt_get(opts, "host");
     const char *port = qemu_opt_get(opts, "port");
@@ -969,6 +1160,8 @@ static void qemu_chr_parse_socket(QemuOpts *opts, ChardevBackend *backend,
     sock->wait = is_waitconnect;
     sock->has_reconnect = true;
     sock->reconnect = reconnect;
+    sock->has_coalesce = true;
+    sock->coalesce = coalesce;
     sock->tls_creds = g_strdup(tls_creds);
 
     addr = g_new0(SocketAddress, 1);
@@ -1002,6 +1195,7 @@ static void char_socket_class_init(ObjectClass *oc, void *data)
     cc->open = qmp_chardev_open_socket;
     cc->chr_wait_connected = tcp_chr_wait_connected;
     cc->chr_write = tcp_chr_write;
+    cc->chr_writev = tcp_chr_writev;
     cc->chr_sync_read = tcp_chr_sync_read;
     cc->chr_disconnect = tcp_chr_disconnect;
     cc->get_msgfds = tcp_get_msgfds;
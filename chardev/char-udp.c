@@ -103,10 +103,10 @@ static void udp_chr_update_read_handler(Chardev *chr,
 
     remove_fd_in_watch(chr);
     if (s->ioc) {
-        chr->fd_in_tag = io_add_watch_poll(chr, s->ioc,
-                                           udp_chr_read_poll,
-                                           udp_chr_read, chr,
-                                           context);
+        chr->gsource = io_add_watch_poll(chr, s->ioc,
+                                         udp_chr_read_poll,
+                                         udp_chr_read, chr,
+                                         context);
     }
 }
 
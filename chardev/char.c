@@ -169,6 +169,52 @@ int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len)
     return ret;
 }
 
+int qemu_chr_fe_writev(CharBackend *be, const struct iovec *iov, int iovcnt)
+{
+    Chardev *s = be->chr;
+    ChardevClass *cc;
+    int ret, i;
+
+    if (!s) {
+        return 0;
+    }
+
+    cc = CHARDEV_GET_CLASS(s);
+    if (!cc->chr_writev || qemu_chr_replay(s)) {
+        int done = 0;
+
+        for (i = 0; i < iovcnt; i++) {
+            ret = qemu_chr_fe_write(be, iov[i].iov_base, iov[i].iov_len);
+            if (ret < 0) {
+                return done ? done : ret;
+            }
+            done += ret;
+            if (ret < iov[i].iov_len) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    ret = cc->chr_writev(s, iov, iovcnt);
+
+    if (ret > 0 && s->logfd >= 0) {
+        size_t left = ret;
+
+        for (i = 0; i < iovcnt && left; i++) {
+            size_t len = MIN(left, iov[i].iov_len);
+
+            qemu_chr_fe_write_log(s, iov[i].iov_base, len);
+            left -= len;
+        }
+    }
+
+    qemu_mutex_unlock(&s->chr_write_lock);
+
+    return ret;
+}
+
 int qemu_chr_write_all(Chardev *s, const uint8_t *buf, int len)
 {
     int offset;
@@ -568,6 +614,7 @@ void qemu_chr_fe_set_handlers(CharBackend *b,
     b->chr_read = fd_read;
     b->chr_event = fd_event;
     b->opaque = opaque;
+    s->gcontext = context;
     if (cc->chr_update_read_handler) {
         cc->chr_update_read_handler(s, context);
     }
@@ -1173,6 +1220,9 @@ QemuOptsList qemu_chardev_opts = {
         },{
             .name = "reconnect",
             .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "coalesce",
+            .type = QEMU_OPT_NUMBER,
         },{
             .name = "telnet",
             .type = QEMU_OPT_BOOL,
@@ -27,6 +27,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
 #include "exec/log.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
@@ -227,24 +228,51 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
 
 static void cpu_exec_step(CPUState *cpu)
 {
+    CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
     TranslationBlock *tb;
     target_ulong cs_base, pc;
     uint32_t flags;
 
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = tb_gen_code(cpu, pc, cs_base, flags,
-                     1 | CF_NOCACHE | CF_IGNORE_ICOUNT);
-    tb->orig_tb = NULL;
-    /* execute the generated code */
-    trace_exec_tb_nocache(tb, pc);
-    cpu_tb_exec(cpu, tb);
-    tb_phys_invalidate(tb, -1);
-    tb_free(tb);
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        mmap_lock();
+        tb_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags,
+                         1 | CF_NOCACHE | CF_IGNORE_ICOUNT);
+        tb->orig_tb = NULL;
+        tb_unlock();
+        mmap_unlock();
+
+        cc->cpu_exec_enter(cpu);
+        /* execute the generated code */
+        trace_exec_tb_nocache(tb, pc);
+        cpu_tb_exec(cpu, tb);
+        cc->cpu_exec_exit(cpu);
+
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* We may have exited due to another problem here, so we need
+         * to reset any tb_locks we may have taken but didn't release.
+         * The mmap_lock is dropped by tb_gen_code if it runs out of
+         * memory.
+         */
+        tb_lock_reset();
+        if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+            qemu_mutex_unlock_iothread();
+        }
+    }
 }
 
 void cpu_exec_step_atomic(CPUState *cpu)
 {
+    /* The system emulator reaches this from outside cpu_exec, so it
+     * must provide the RCU critical section that TLB fills rely on.
+     */
+    rcu_read_lock();
     start_exclusive();
 
     /* Since we got here, we know that parallel_cpus must be true.  */
@@ -253,6 +281,7 @@ void cpu_exec_step_atomic(CPUState *cpu)
     parallel_cpus = true;
 
     end_exclusive();
+    rcu_read_unlock();
 }
 
 struct tb_desc {
@@ -290,14 +319,14 @@ static bool tb_cmp(const void *p, const void *d)
     return false;
 }
 
-static TranslationBlock *tb_htable_lookup(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint32_t flags)
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags)
 {
+    TranslationBlock *tb;
     tb_page_addr_t phys_pc;
     struct tb_desc desc;
     uint32_t h;
+    unsigned int h2;
 
     desc.env = (CPUArchState *)cpu->env_ptr;
     desc.cs_base = cs_base;
@@ -305,8 +334,24 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu,
     desc.pc = pc;
     phys_pc = get_page_addr_code(desc.env, pc);
     desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+
+    /* The second level of the jump cache does not depend on the virtual
+     * mapping, so check the hit against the physical pages like the hash
+     * table does.  Stale entries can at worst point to a recycled TB
+     * descriptor, which tb_cmp() then rejects.
+     */
+    h2 = tb_jmp_cache2_hash_func(pc, cs_base, flags);
+    tb = atomic_rcu_read(&cpu->tb_jmp_cache2[h2]);
+    if (tb && tb_cmp(tb, &desc)) {
+        return tb;
+    }
+
     h = tb_hash_func(phys_pc, pc, flags);
-    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+    tb = qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
+    if (tb) {
+        atomic_set(&cpu->tb_jmp_cache2[h2], tb);
+    }
+    return tb;
 }
 
 static inline TranslationBlock *tb_find(CPUState *cpu,
@@ -330,8 +375,9 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
         if (!tb) {
 
             /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-             * taken outside tb_lock. As system emulation is currently
-             * single threaded the locks are NOPs.
+             * taken outside tb_lock.  In system emulation mmap_lock is a
+             * NOP, but tb_lock serialises translation between vCPU
+             * threads under MTTCG.
              */
             mmap_lock();
             tb_lock();
@@ -344,6 +390,8 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
             if (!tb) {
                 /* if no translated code available, then translate it now */
                 tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+                atomic_set(&cpu->tb_jmp_cache2[
+                               tb_jmp_cache2_hash_func(pc, cs_base, flags)], tb);
             }
 
             mmap_unlock();
@@ -356,8 +404,16 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
     /* We don't take care of direct jumps when address mapping changes in
      * system emulation. So it's not safe to make a direct jump to a TB
      * spanning two pages because the mapping for the second page can change.
+     *
+     * The exception is a jump from a TB that spans the very same pages:
+     * such a TB is itself only entered through this function (or from
+     * another such TB), so the mapping of the second page was checked by
+     * the lookup that started the chain.
      */
-    if (tb->page_addr[1] != -1) {
+    if (tb->page_addr[1] != -1 &&
+        !(last_tb && last_tb->page_addr[0] == tb->page_addr[0] &&
+          last_tb->page_addr[1] == tb->page_addr[1] &&
+          (last_tb->pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK))) {
         last_tb = NULL;
     }
 #endif
@@ -384,8 +440,16 @@ static inline bool cpu_handle_halt(CPUState *cpu)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
             X86CPU *x86_cpu = X86_CPU(cpu);
+            bool need_lock = !qemu_mutex_iothread_locked();
+
+            if (need_lock) {
+                qemu_mutex_lock_iothread();
+            }
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            if (need_lock) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -439,7 +503,15 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
 #else
             if (replay_exception()) {
                 CPUClass *cc = CPU_GET_CLASS(cpu);
+                bool need_lock = !qemu_mutex_iothread_locked();
+
+                if (need_lock) {
+                    qemu_mutex_lock_iothread();
+                }
                 cc->do_interrupt(cpu);
+                if (need_lock) {
+                    qemu_mutex_unlock_iothread();
+                }
                 cpu->exception_index = -1;
             } else if (!replay_has_interrupt()) {
                 /* give a chance to iothread in replay mode */
@@ -465,9 +537,20 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
                                         TranslationBlock **last_tb)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
-    int interrupt_request = cpu->interrupt_request;
 
-    if (unlikely(interrupt_request)) {
+    if (unlikely(atomic_read(&cpu->interrupt_request))) {
+        int interrupt_request;
+        bool need_lock = !qemu_mutex_iothread_locked();
+        bool ret = false;
+
+        /* Interrupt delivery touches device state (interrupt controllers,
+         * timers), which is protected by the BQL.  Under MTTCG we run
+         * guest code without it, so take it for the slow path.
+         */
+        if (need_lock) {
+            qemu_mutex_lock_iothread();
+        }
+        interrupt_request = cpu->interrupt_request;
         if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
             /* Mask out external interrupts for this step. */
             interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -475,7 +558,8 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
         if (interrupt_request & CPU_INTERRUPT_DEBUG) {
             cpu->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
             cpu->exception_index = EXCP_DEBUG;
-            return true;
+            ret = true;
+            goto out_unlock;
         }
         if (replay_mode == REPLAY_MODE_PLAY && !replay_has_interrupt()) {
             /* Do nothing */
@@ -484,7 +568,8 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
             cpu->interrupt_request &= ~CPU_INTERRUPT_HALT;
             cpu->halted = 1;
             cpu->exception_index = EXCP_HLT;
-            return true;
+            ret = true;
+            goto out_unlock;
         }
 #if defined(TARGET_I386)
         else if (interrupt_request & CPU_INTERRUPT_INIT) {
@@ -494,13 +579,15 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
             cpu_svm_check_intercept_param(env, SVM_EXIT_INIT, 0, 0);
             do_cpu_init(x86_cpu);
             cpu->exception_index = EXCP_HALTED;
-            return true;
+            ret = true;
+            goto out_unlock;
         }
 #else
         else if (interrupt_request & CPU_INTERRUPT_RESET) {
             replay_interrupt();
             cpu_reset(cpu);
-            return true;
+            ret = true;
+            goto out_unlock;
         }
 #endif
         /* The target hook has 3 exit conditions:
@@ -522,6 +609,14 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
                the program flow was changed */
             *last_tb = NULL;
         }
+
+    out_unlock:
+        if (need_lock) {
+            qemu_mutex_unlock_iothread();
+        }
+        if (ret) {
+            return true;
+        }
     }
     if (unlikely(atomic_read(&cpu->exit_request) || replay_has_interrupt())) {
         atomic_set(&cpu->exit_request, 0);
@@ -640,6 +735,12 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
         cpu->can_do_io = 1;
         tb_lock_reset();
+        /* A helper or interrupt hook may have longjmp'd out with the BQL
+         * taken on our behalf; MTTCG vCPUs must not keep it.
+         */
+        if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 
     /* if an exception is pending, we execute it here */
@@ -650,12 +751,14 @@ int cpu_exec(CPUState *cpu)
         while (!cpu_handle_interrupt(cpu, &last_tb)) {
             TranslationBlock *tb = tb_find(cpu, last_tb, tb_exit);
             cpu_loop_exec_tb(cpu, tb, &last_tb, &tb_exit, &sc);
+            tlb_drain_coalesced_mmio(cpu);
             /* Try to align the host and virtual clocks
                if the guest is in advance */
             align_clocks(&sc, cpu);
         }
     }
 
+    tlb_drain_coalesced_mmio(cpu);
     cc->cpu_exec_exit(cpu);
     rcu_read_unlock();
 
@@ -154,6 +154,46 @@ void do_run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data,
     }
 }
 
+void do_run_on_all_cpus(run_on_cpu_func func, run_on_cpu_data data,
+                        QemuMutex *mutex)
+{
+    struct qemu_work_item *wis;
+    CPUState *cpu, *self = NULL;
+    int n = 0, i;
+
+    CPU_FOREACH(cpu) {
+        n++;
+    }
+    wis = g_new0(struct qemu_work_item, n);
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        wis[i].func = func;
+        wis[i].data = data;
+        if (qemu_cpu_is_self(cpu)) {
+            self = cpu;
+            wis[i].done = true;
+        } else {
+            queue_work_on_cpu(cpu, &wis[i]);
+        }
+        i++;
+    }
+
+    if (self) {
+        func(self, data);
+    }
+
+    for (i = 0; i < n; i++) {
+        while (!atomic_mb_read(&wis[i].done)) {
+            CPUState *self_cpu = current_cpu;
+
+            qemu_cond_wait(&qemu_work_cond, mutex);
+            current_cpu = self_cpu;
+        }
+    }
+    g_free(wis);
+}
+
 void async_run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data)
 {
     struct qemu_work_item *wi;
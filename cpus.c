@@ -38,6 +38,7 @@
 #include "sysemu/hax.h"
 #include "qmp-commands.h"
 #include "exec/exec-all.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -48,6 +49,7 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "qemu/lock-profile.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -77,6 +79,8 @@ int64_t max_advance;
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* Set while CPUState::throttle_percentage is in effect */
+static bool vcpu_throttle_enabled;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -114,6 +118,87 @@ static bool all_cpu_threads_idle(void)
     return true;
 }
 
+/***********************************************************/
+/* multi-threaded TCG */
+
+/*
+ * Once a guest architecture has been converted to the new primitives
+ * (atomic instructions, memory ordering barriers, BQL-safe helpers) it
+ * opts in by setting TARGET_SUPPORTS_MTTCG in configure.  There are
+ * two remaining limitations to check:
+ *
+ * - The guest can't be oversized (e.g. 64 bit guest on 32 bit host)
+ * - The host must have a stronger memory order than the guest
+ *
+ * It may be possible in future to support strong guests on weak hosts
+ * but that will require tagging all load/stores in a guest with their
+ * implicit memory order requirements which would likely slow things
+ * down a lot.
+ */
+static bool check_tcg_memory_orders_compatible(void)
+{
+#if defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_TARGET_DEFAULT_MO)
+    return (TCG_GUEST_DEFAULT_MO & ~TCG_TARGET_DEFAULT_MO) == 0;
+#else
+    return false;
+#endif
+}
+
+static bool default_mttcg_enabled(void)
+{
+    if (use_icount || TCG_OVERSIZED_GUEST) {
+        return false;
+    }
+#ifdef TARGET_SUPPORTS_MTTCG
+    return check_tcg_memory_orders_compatible();
+#else
+    return false;
+#endif
+}
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+    const char *ra = qemu_opt_get(opts, "regalloc");
+
+    if (!ra || strcmp(ra, "bb") == 0) {
+        tcg_regalloc_ebb = false;
+    } else if (strcmp(ra, "ebb") == 0) {
+        tcg_regalloc_ebb = true;
+    } else {
+        error_setg(errp, "Invalid 'regalloc' setting %s", ra);
+        return;
+    }
+
+    if (!t) {
+        mttcg_enabled = default_mttcg_enabled();
+        return;
+    }
+
+    if (strcmp(t, "multi") == 0) {
+        if (TCG_OVERSIZED_GUEST) {
+            error_setg(errp, "No MTTCG when guest word size > hosts");
+        } else if (use_icount) {
+            error_setg(errp, "No MTTCG when icount is enabled");
+        } else {
+#ifndef TARGET_SUPPORTS_MTTCG
+            error_report("Guest not yet converted to MTTCG - "
+                         "you may get unexpected results");
+#endif
+            if (!check_tcg_memory_orders_compatible()) {
+                error_report("Guest expects a stronger memory ordering "
+                             "than the host provides");
+                error_printf("This may cause strange/hard to debug errors\n");
+            }
+            mttcg_enabled = true;
+        }
+    } else if (strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /***********************************************************/
 /* guest cycle counter */
 
@@ -560,18 +645,13 @@ static const VMStateDescription vmstate_timers = {
 
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
-    double throttle_ratio;
-    long sleeptime_ns;
+    long sleeptime_ns = opaque.host_ulong;
 
-    if (!cpu_throttle_get_percentage()) {
+    if (!cpu_throttle_vcpu_get_percentage(cpu)) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
-
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
     g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
@@ -581,22 +661,33 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
+    int max_pct = 0;
+    double period_ns;
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, cpu_throttle_vcpu_get_percentage(cpu));
+    }
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    /* The most throttled vCPU runs for one timeslice per period, the
+     * others sleep for their own percentage of the same period.
+     */
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - (double)max_pct / 100);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        int pct = cpu_throttle_vcpu_get_percentage(cpu);
+
+        if (pct && !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns * pct / 100));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -611,14 +702,47 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_vcpu_set(CPUState *cpu, int new_throttle_pct)
+{
+    CPUState *other;
+
+    if (!atomic_read(&vcpu_throttle_enabled)) {
+        /* Forget what was left over from the last cpu_throttle_stop */
+        CPU_FOREACH(other) {
+            atomic_set(&other->throttle_percentage, 0);
+        }
+        atomic_set(&vcpu_throttle_enabled, true);
+    }
+
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                       CPU_THROTTLE_TIMESLICE_NS);
+}
+
 void cpu_throttle_stop(void)
 {
     atomic_set(&throttle_percentage, 0);
+    atomic_set(&vcpu_throttle_enabled, false);
 }
 
 bool cpu_throttle_active(void)
 {
-    return (cpu_throttle_get_percentage() != 0);
+    return (cpu_throttle_get_percentage() != 0) ||
+           atomic_read(&vcpu_throttle_enabled);
+}
+
+int cpu_throttle_vcpu_get_percentage(CPUState *cpu)
+{
+    int pct = cpu_throttle_get_percentage();
+
+    if (atomic_read(&vcpu_throttle_enabled)) {
+        pct = MAX(pct, atomic_read(&cpu->throttle_percentage));
+    }
+    return pct;
 }
 
 int cpu_throttle_get_percentage(void)
@@ -734,6 +858,11 @@ void cpu_synchronize_all_post_init(void)
 {
     CPUState *cpu;
 
+    if (kvm_enabled()) {
+        kvm_cpu_synchronize_all_post_init();
+        return;
+    }
+
     CPU_FOREACH(cpu) {
         cpu_synchronize_post_init(cpu);
     }
@@ -899,6 +1028,52 @@ static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static unsigned iothread_requesting_mutex;
 
+/* Lock profiling state of the current holder, protected by
+ * qemu_global_mutex.  iothread_lock_start_ns is zero if the current
+ * acquisition is not being profiled.
+ */
+static const char *iothread_lock_file;
+static int iothread_lock_line;
+static int64_t iothread_lock_wait_ns;
+static int64_t iothread_lock_start_ns;
+
+static void iothread_lock_profile_acquired(const char *file, int line,
+                                           int64_t wait_start_ns)
+{
+    int64_t now = get_clock();
+
+    iothread_lock_file = file;
+    iothread_lock_line = line;
+    iothread_lock_wait_ns = now - wait_start_ns;
+    iothread_lock_start_ns = now;
+}
+
+static void iothread_lock_profile_release(void)
+{
+    if (iothread_lock_start_ns) {
+        lock_profile_record(LOCK_PROFILE_TYPE_BQL, iothread_lock_file,
+                            iothread_lock_line, iothread_lock_wait_ns,
+                            get_clock() - iothread_lock_start_ns);
+        iothread_lock_start_ns = 0;
+    }
+}
+
+/* Wait on @cond, which releases the BQL.  The time spent waiting is not
+ * counted as hold time of the call site that took the lock.
+ */
+static void qemu_cond_wait_iothread(QemuCond *cond)
+{
+    const char *file = iothread_lock_file;
+    int line = iothread_lock_line;
+    bool profiled = iothread_lock_start_ns != 0;
+
+    iothread_lock_profile_release();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    if (profiled && lock_profile_active()) {
+        iothread_lock_profile_acquired(file, line, get_clock());
+    }
+}
+
 static QemuThread io_thread;
 
 /* cpu creation */
@@ -922,6 +1097,11 @@ void run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data)
     do_run_on_cpu(cpu, func, data, &qemu_global_mutex);
 }
 
+void run_on_all_cpus(run_on_cpu_func func, run_on_cpu_data data)
+{
+    do_run_on_all_cpus(func, data, &qemu_global_mutex);
+}
+
 static void qemu_kvm_destroy_vcpu(CPUState *cpu)
 {
     if (kvm_destroy_vcpu(cpu) < 0) {
@@ -945,14 +1125,14 @@ static void qemu_wait_io_event_common(CPUState *cpu)
     cpu->thread_kicked = false;
 }
 
-static void qemu_tcg_wait_io_event(CPUState *cpu)
+static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
 {
     while (all_cpu_threads_idle()) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_io_proceeded_cond);
     }
 
     CPU_FOREACH(cpu) {
@@ -960,10 +1140,19 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+static void qemu_tcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait_iothread(cpu->halt_cond);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
 
     qemu_kvm_eat_signals(cpu);
@@ -1115,9 +1304,18 @@ static int tcg_cpu_exec(CPUState *cpu)
         cpu->icount_decr.u16.low = decr;
         cpu->icount_extra = count;
     }
+    if (qemu_tcg_mttcg_enabled()) {
+        /* In MTTCG mode guest code runs without the BQL; the slow paths
+         * in cpu-exec.c and cputlb.c take it when they touch device state.
+         */
+        qemu_mutex_unlock_iothread();
+    }
     cpu_exec_start(cpu);
     ret = cpu_exec(cpu);
     cpu_exec_end(cpu);
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock_iothread();
+    }
 #ifdef CONFIG_PROFILER
     tcg_time += profile_getclock() - ti;
 #endif
@@ -1150,7 +1348,13 @@ static void deal_with_unplugged_cpus(void)
     }
 }
 
-static void *qemu_tcg_cpu_thread_fn(void *arg)
+/* Single-threaded TCG
+ *
+ * In the single-threaded case each vCPU is simulated in turn.  The
+ * BQL is held while guest code runs, so there is no need to worry
+ * about concurrent access to device or TCG state.
+ */
+static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
@@ -1168,7 +1372,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* wait for initial kick-off after machine start */
     while (first_cpu->stopped) {
-        qemu_cond_wait(first_cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(first_cpu->halt_cond);
 
         /* process any pending work */
         CPU_FOREACH(cpu) {
@@ -1215,13 +1419,69 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
         handle_icount_deadline();
 
-        qemu_tcg_wait_io_event(QTAILQ_FIRST(&cpus));
+        qemu_tcg_rr_wait_io_event(QTAILQ_FIRST(&cpus));
         deal_with_unplugged_cpus();
     }
 
     return NULL;
 }
 
+/* Multi-threaded TCG
+ *
+ * In the multi-threaded case each vCPU has its own thread and runs
+ * guest code without holding the BQL.  The TLS variable current_cpu
+ * can be used deep in the code to find the current CPUState for a
+ * given thread.
+ */
+static void *qemu_tcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* process any pending work */
+    cpu->exit_request = 1;
+
+    do {
+        if (cpu_can_run(cpu)) {
+            int r;
+            r = tcg_cpu_exec(cpu);
+            switch (r) {
+            case EXCP_DEBUG:
+                cpu_handle_guest_debug(cpu);
+                break;
+            case EXCP_ATOMIC:
+                /* start_exclusive() must not be called with the BQL held */
+                qemu_mutex_unlock_iothread();
+                cpu_exec_step_atomic(cpu);
+                qemu_mutex_lock_iothread();
+                break;
+            default:
+                /* EXCP_HALTED and friends are handled by wait_io_event */
+                break;
+            }
+        }
+
+        atomic_mb_set(&cpu->exit_request, 0);
+        qemu_tcg_wait_io_event(cpu);
+    } while (!cpu->unplug || cpu_can_run(cpu));
+
+    qemu_tcg_destroy_vcpu(cpu);
+    cpu->created = false;
+    qemu_cond_signal(&qemu_cpu_cond);
+    qemu_mutex_unlock_iothread();
+    return NULL;
+}
+
 static void *qemu_hax_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
@@ -1246,7 +1506,7 @@ static void *qemu_hax_cpu_thread_fn(void *arg)
         }
 
         while (cpu_thread_is_idle(cpu)) {
-            qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+            qemu_cond_wait_iothread(cpu->halt_cond);
         }
 #ifdef _WIN32
         SleepEx(0, TRUE);
@@ -1304,7 +1564,11 @@ void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
-        qemu_cpu_kick_no_halt();
+        if (qemu_tcg_mttcg_enabled()) {
+            cpu_exit(cpu);
+        } else {
+            qemu_cpu_kick_no_halt();
+        }
     } else {
         if (hax_enabled()) {
             /*
@@ -1340,13 +1604,16 @@ bool qemu_mutex_iothread_locked(void)
     return iothread_locked;
 }
 
-void qemu_mutex_lock_iothread(void)
+void qemu_mutex_lock_iothread_impl(const char *file, int line)
 {
+    int64_t wait_start_ns = lock_profile_active() ? get_clock() : 0;
+
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
-     * TCG code execution.
+     * TCG code execution.  MTTCG vCPUs never hold the lock while running
+     * guest code, so they never need a kick either.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
@@ -1359,11 +1626,16 @@ void qemu_mutex_lock_iothread(void)
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
     iothread_locked = true;
+
+    if (wait_start_ns) {
+        iothread_lock_profile_acquired(file, line, wait_start_ns);
+    }
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
     iothread_locked = false;
+    iothread_lock_profile_release();
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -1392,7 +1664,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1402,7 +1674,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_pause_cond);
         CPU_FOREACH(cpu) {
             qemu_cpu_kick(cpu);
         }
@@ -1437,7 +1709,7 @@ void cpu_remove_sync(CPUState *cpu)
 {
     cpu_remove(cpu);
     while (cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1447,29 +1719,40 @@ void cpu_remove_sync(CPUState *cpu)
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
-    static QemuCond *tcg_halt_cond;
-    static QemuThread *tcg_cpu_thread;
+    static QemuCond *single_tcg_halt_cond;
+    static QemuThread *single_tcg_cpu_thread;
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    if (qemu_tcg_mttcg_enabled() || !single_tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
-        tcg_halt_cond = cpu->halt_cond;
         snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
                  cpu->cpu_index);
-        qemu_thread_create(cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
-                           cpu, QEMU_THREAD_JOINABLE);
+
+        if (qemu_tcg_mttcg_enabled()) {
+            /* create a thread per vCPU with TCG (MTTCG) */
+            parallel_cpus = true;
+            qemu_thread_create(cpu->thread, thread_name,
+                               qemu_tcg_cpu_thread_fn,
+                               cpu, QEMU_THREAD_JOINABLE);
+        } else {
+            /* share a single thread for all cpus with TCG */
+            qemu_thread_create(cpu->thread, thread_name,
+                               qemu_tcg_rr_cpu_thread_fn,
+                               cpu, QEMU_THREAD_JOINABLE);
+            single_tcg_halt_cond = cpu->halt_cond;
+            single_tcg_cpu_thread = cpu->thread;
+        }
 #ifdef _WIN32
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_cond_wait_iothread(&qemu_cpu_cond);
         }
-        tcg_cpu_thread = cpu->thread;
     } else {
-        cpu->thread = tcg_cpu_thread;
-        cpu->halt_cond = tcg_halt_cond;
+        /* For non-MTTCG cases we share the thread */
+        cpu->thread = single_tcg_cpu_thread;
+        cpu->halt_cond = single_tcg_halt_cond;
     }
 }
 
@@ -1489,7 +1772,7 @@ static void qemu_hax_start_vcpu(CPUState *cpu)
     cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1505,7 +1788,7 @@ static void qemu_kvm_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, thread_name, qemu_kvm_cpu_thread_fn,
                        cpu, QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1521,7 +1804,7 @@ static void qemu_dummy_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, thread_name, qemu_dummy_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1550,6 +1833,16 @@ void qemu_init_vcpu(CPUState *cpu)
     } else {
         qemu_dummy_start_vcpu(cpu);
     }
+
+    /* With round-robin TCG, the last vCPU sharing the thread wins */
+    if (!bitmap_empty(cpu->host_cpus, QEMU_THREAD_MAX_HOST_CPUS)) {
+        int ret = qemu_thread_set_affinity(cpu->thread, cpu->host_cpus,
+                                           QEMU_THREAD_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_report("cannot set affinity of vCPU %d thread: %s",
+                         cpu->cpu_index, strerror(-ret));
+        }
+    }
 }
 
 void cpu_stop_current(void)
@@ -31,6 +31,8 @@
 #include "exec/log.h"
 #include "exec/helper-proto.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "sysemu/cpus.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -57,56 +59,277 @@
     } \
 } while (0)
 
+/* run_on_cpu_data.target_ptr should always be big enough for a
+ * target_ulong even on 32 bit builds */
+QEMU_BUILD_BUG_ON(sizeof(target_ulong) > sizeof(run_on_cpu_data));
+
+/* We currently embed a 16 bit MMU index bitmap in the low bits of a
+ * page-aligned address when queueing per-page flushes on other vCPUs.
+ */
+QEMU_BUILD_BUG_ON(NB_MMU_MODES > 16);
+QEMU_BUILD_BUG_ON(NB_MMU_MODES > TARGET_PAGE_BITS_MIN);
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
+
+/* In MTTCG mode each vCPU owns its TLB: only the vCPU thread may
+ * modify it, other threads queue the work on it instead.  In
+ * round-robin mode all vCPUs share one thread and the BQL, so
+ * flushes can always be done directly.
+ */
+#define assert_cpu_is_self(this_cpu) do {                         \
+        if (DEBUG_TLB_GATE) {                                     \
+            g_assert(!qemu_tcg_mttcg_enabled() ||                 \
+                     !(this_cpu)->created ||                     \
+                     qemu_cpu_is_self(this_cpu));                 \
+        }                                                         \
+    } while (0)
+
+static inline bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu);
+}
+
 /* statistics */
 int tlb_flush_count;
 
+static inline size_t tlb_vtlb_size(CPUTLBDesc *desc)
+{
+    return CPU_VTLB_MIN_SIZE << desc->vtlb_shift;
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+        size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+#else
+        size_t n_entries = CPU_TLB_SIZE;
+#endif
+
+        env->tlb_mask[mmu_idx] = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+        memset(&env->tlb_d[mmu_idx], 0, sizeof(env->tlb_d[0]));
+        env->tlb_d[mmu_idx].clean = true;
+    }
+    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    env->tlb_flush_addr = -1;
+    env->tlb_flush_mask = 0;
+}
+
+/* Resize the main TLB of @mmu_idx according to the share of its entries
+ * that were filled since the last flush: it doubles when more than 70%
+ * were in use, and halves when less than 30% were.  Only backends that
+ * load the index mask from env can use a resized main TLB.  Called
+ * right after the main TLB has been cleared.
+ */
+static void tlb_mmu_resize_main(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    size_t old_size = tlb_n_entries(env, mmu_idx);
+    size_t rate = (size_t)desc->n_used_entries * 100 / old_size;
+    size_t new_size = old_size;
+
+    if (rate > 70 && old_size < (1 << CPU_TLB_DYN_MAX_BITS)) {
+        /* entries past old_size may hold stale data */
+        memset(&env->tlb_table[mmu_idx][old_size], -1,
+               old_size * sizeof(CPUTLBEntry));
+        new_size = old_size * 2;
+    } else if (rate < 30 && old_size > (1 << CPU_TLB_DYN_MIN_BITS)) {
+        new_size = old_size / 2;
+    }
+    env->tlb_mask[mmu_idx] = (new_size - 1) << CPU_TLB_ENTRY_BITS;
+#endif
+    desc->n_used_entries = 0;
+}
+
+/* Resize the victim TLB of @mmu_idx according to its use since the last
+ * flush.  It grows when every entry was recycled while still catching a
+ * fair share of main TLB misses, and shrinks when it was mostly idle.
+ * Called right after the victim TLB has been cleared.
+ */
+static void tlb_mmu_resize_vtlb(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t old_size = tlb_vtlb_size(desc);
+
+    if (old_size < CPU_VTLB_SIZE &&
+        desc->window_evictions >= old_size &&
+        desc->window_vtlb_hits * 8 >= desc->window_evictions) {
+        /* entries past old_size may hold stale data */
+        memset(&env->tlb_v_table[mmu_idx][old_size], -1,
+               old_size * sizeof(CPUTLBEntry));
+        desc->vtlb_shift++;
+    } else if (old_size > CPU_VTLB_MIN_SIZE &&
+               desc->window_evictions < old_size / 4) {
+        desc->vtlb_shift--;
+    }
+    desc->window_evictions = 0;
+    desc->window_vtlb_hits = 0;
+}
+
+static void tlb_flush_one_mmuidx(CPUArchState *env, int mmu_idx)
+{
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+
+    /* Entries only ever reach the victim TLB from the main one, so a
+     * clean main TLB implies a clean victim TLB.
+     */
+    if (!desc->clean) {
+        memset(env->tlb_table[mmu_idx], -1,
+               tlb_n_entries(env, mmu_idx) * sizeof(CPUTLBEntry));
+        memset(env->tlb_v_table[mmu_idx], -1,
+               tlb_vtlb_size(desc) * sizeof(CPUTLBEntry));
+        desc->clean = true;
+    }
+    tlb_mmu_resize_main(env, mmu_idx);
+    tlb_mmu_resize_vtlb(env, mmu_idx);
+    desc->vtlb_index = 0;
+    desc->flushes++;
+}
+
 /* This is OK because CPU architectures generally permit an
  * implementation to drop entries from the TLB at any time, so
  * flushing more entries than required is only an efficiency issue,
  * not a correctness issue.
  */
-void tlb_flush(CPUState *cpu)
+static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    assert_cpu_is_self(cpu);
+    tlb_debug("(count: %d)\n", tlb_flush_count);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx(env, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
-    env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+    atomic_inc(&tlb_flush_count);
+
+    atomic_mb_set(&cpu->pending_tlb_flush, 0);
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+static void tlb_flush_global_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_flush_nocheck(cpu);
+}
+
+void tlb_flush(CPUState *cpu)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        /* Only queue one full flush at a time; it subsumes everything
+         * else that may already be pending.
+         */
+        if (atomic_mb_read(&cpu->pending_tlb_flush) != ALL_MMUIDX_BITS) {
+            atomic_mb_set(&cpu->pending_tlb_flush, ALL_MMUIDX_BITS);
+            async_run_on_cpu(cpu, tlb_flush_global_async_work,
+                             RUN_ON_CPU_NULL);
+        }
+    } else {
+        tlb_flush_nocheck(cpu);
+    }
+}
+
+void tlb_flush_all_cpus(CPUState *src_cpu)
+{
+    CPUState *cpu;
+
+    /* Queue the flush on every other vCPU, then do our own directly */
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu &&
+            atomic_mb_read(&cpu->pending_tlb_flush) != ALL_MMUIDX_BITS) {
+            atomic_mb_set(&cpu->pending_tlb_flush, ALL_MMUIDX_BITS);
+            async_run_on_cpu(cpu, tlb_flush_global_async_work,
+                             RUN_ON_CPU_NULL);
+        }
+    }
+
+    tlb_flush(src_cpu);
+}
+
+static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
+    unsigned long mmu_idx_bitmask = data.host_int;
+    int mmu_idx;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("start: mmu_idx:0x%04lx\n", mmu_idx_bitmask);
 
-    tlb_debug("start\n");
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (test_bit(mmu_idx, &mmu_idx_bitmask)) {
+            tlb_debug("%d\n", mmu_idx);
+
+            tlb_flush_one_mmuidx(env, mmu_idx);
+        }
+    }
+
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+
+    atomic_and(&cpu->pending_tlb_flush, ~mmu_idx_bitmask);
+}
+
+/* Convert a -1 terminated list of MMU indexes into a bitmap */
+static uint16_t make_mmu_index_bitmap(va_list args)
+{
+    uint16_t bitmap = 0;
 
     for (;;) {
-        int mmu_idx = va_arg(argp, int);
+        int mmu_idx = va_arg(args, int);
 
         if (mmu_idx < 0) {
             break;
         }
+        g_assert(mmu_idx < NB_MMU_MODES);
+        bitmap |= 1 << mmu_idx;
+    }
+
+    return bitmap;
+}
 
-        tlb_debug("%d\n", mmu_idx);
+static void tlb_flush_by_mmuidx_bitmap(CPUState *cpu, uint16_t idxmap)
+{
+    tlb_debug("mmu_idx: 0x%" PRIx16 "\n", idxmap);
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
-    }
+    if (tlb_flush_is_remote(cpu)) {
+        uint16_t pending = atomic_mb_read(&cpu->pending_tlb_flush);
+        uint16_t to_clean = idxmap & ~pending;
 
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        /* Indexes that already have a flush queued need no more work */
+        if (to_clean) {
+            atomic_or(&cpu->pending_tlb_flush, to_clean);
+            async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work,
+                             RUN_ON_CPU_HOST_INT(to_clean));
+        }
+    } else {
+        tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(idxmap));
+    }
 }
 
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    uint16_t idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = make_mmu_index_bitmap(argp);
     va_end(argp);
+
+    tlb_flush_by_mmuidx_bitmap(cpu, idxmap);
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -121,12 +344,14 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
+    target_ulong addr = (target_ulong) data.target_ptr;
     int mmu_idx;
 
+    assert_cpu_is_self(cpu);
+
     tlb_debug("page :" TARGET_FMT_lx "\n", addr);
 
     /* Check if we need to flush due to large pages.  */
@@ -135,20 +360,19 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu);
+        tlb_flush_nocheck(cpu);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr);
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        int k, vsize = tlb_vtlb_size(&env->tlb_d[mmu_idx]);
+        for (k = 0; k < vsize; k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
@@ -156,15 +380,59 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     tb_flush_jmp_cache(cpu, addr);
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    tlb_debug("page :" TARGET_FMT_lx "\n", addr);
+
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_page_async_work,
+                         RUN_ON_CPU_TARGET_PTR(addr));
+    } else {
+        tlb_flush_page_async_work(cpu, RUN_ON_CPU_TARGET_PTR(addr));
+    }
+}
+
+/* The mmu_idx_bitmap is encoded in the low bits of the (page aligned)
+ * address, which is possible because NB_MMU_MODES <= TARGET_PAGE_BITS_MIN.
+ */
+static void tlb_flush_page_by_mmuidx_async_work(CPUState *cpu,
+                                                run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
+    target_ulong addr_and_mmuidx = (target_ulong) data.target_ptr;
+    target_ulong addr = addr_and_mmuidx & TARGET_PAGE_MASK;
+    unsigned long mmu_idx_bitmap = addr_and_mmuidx & ALL_MMUIDX_BITS;
+    int mmu_idx;
+    int i;
 
-    va_start(argp, addr);
+    assert_cpu_is_self(cpu);
 
-    tlb_debug("addr "TARGET_FMT_lx"\n", addr);
+    tlb_debug("addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
+              addr, mmu_idx_bitmap);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (test_bit(mmu_idx, &mmu_idx_bitmap)) {
+            tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr);
+
+            /* check whether there are vltb entries that need to be flushed */
+            for (i = 0; i < tlb_vtlb_size(&env->tlb_d[mmu_idx]); i++) {
+                tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], addr);
+            }
+        }
+    }
+
+    tb_flush_jmp_cache(cpu, addr);
+}
+
+static void tlb_check_page_and_flush_by_mmuidx_async_work(CPUState *cpu,
+                                                          run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong addr_and_mmuidx = (target_ulong) data.target_ptr;
+    target_ulong addr = addr_and_mmuidx & TARGET_PAGE_MASK;
+    unsigned long mmu_idx_bitmap = addr_and_mmuidx & ALL_MMUIDX_BITS;
+
+    tlb_debug("addr:"TARGET_FMT_lx" mmu_idx: %04lx\n", addr, mmu_idx_bitmap);
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
@@ -172,33 +440,190 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_async_work(cpu,
+                                       RUN_ON_CPU_HOST_INT(mmu_idx_bitmap));
+    } else {
+        tlb_flush_page_by_mmuidx_async_work(cpu, data);
+    }
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    target_ulong addr_and_mmu_idx;
+    va_list argp;
+    uint16_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = make_mmu_index_bitmap(argp);
+    va_end(argp);
+
+    tlb_debug("addr: "TARGET_FMT_lx" mmu_idx:%" PRIx16 "\n", addr, idxmap);
+
+    /* This should already be page aligned */
+    addr_and_mmu_idx = addr & TARGET_PAGE_MASK;
+    addr_and_mmu_idx |= idxmap;
+
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_check_page_and_flush_by_mmuidx_async_work,
+                         RUN_ON_CPU_TARGET_PTR(addr_and_mmu_idx));
+    } else {
+        tlb_check_page_and_flush_by_mmuidx_async_work(
+            cpu, RUN_ON_CPU_TARGET_PTR(addr_and_mmu_idx));
+    }
+}
+
+typedef struct TLBFlushRangeData {
+    target_ulong addr;
+    target_ulong len;
+    uint16_t idxmap;
+} TLBFlushRangeData;
+
+/* Does the page of @tlb_addr lie in [start, last]?  */
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong start,
+                                 target_ulong last)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) &&
+           (tlb_addr & TARGET_PAGE_MASK) >= start &&
+           (tlb_addr & TARGET_PAGE_MASK) <= last;
+}
+
+static inline void tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong start,
+                                         target_ulong last)
+{
+    if (tlb_hit_range(tlb_entry->addr_read, start, last) ||
+        tlb_hit_range(tlb_entry->addr_write, start, last) ||
+        tlb_hit_range(tlb_entry->addr_code, start, last)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+    }
+}
+
+static void tlb_flush_range_locked(CPUState *cpu, target_ulong addr,
+                                   target_ulong len, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    unsigned long mmu_idx_bitmap = idxmap;
+    target_ulong start, last, page, nb_pages, large_last, i;
+    int mmu_idx, k;
+
+    assert_cpu_is_self(cpu);
+
+    if (len == 0) {
         return;
     }
+    start = addr & TARGET_PAGE_MASK;
+    last = addr + len - 1;
+    if (last < addr) {
+        last = -1;
+    }
+    nb_pages = ((last - start) >> TARGET_PAGE_BITS) + 1;
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    tlb_debug("start:" TARGET_FMT_lx " pages:" TARGET_FMT_lu
+              " mmu_idx:0x%04" PRIx16 "\n", start, nb_pages, idxmap);
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
+    /* A range that overlaps a large page, or that covers at least as
+     * many pages as the TLB has entries, is cheaper to flush entirely.
+     */
+    large_last = env->tlb_flush_addr | ~env->tlb_flush_mask;
+    if (nb_pages == 0 || nb_pages >= CPU_TLB_SIZE ||
+        (env->tlb_flush_addr != (target_ulong)-1 &&
+         start <= large_last && last >= env->tlb_flush_addr)) {
+        if (idxmap == ALL_MMUIDX_BITS) {
+            tlb_flush_nocheck(cpu);
+        } else {
+            tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(idxmap));
+        }
+        return;
+    }
 
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int vsize;
+
+        if (!test_bit(mmu_idx, &mmu_idx_bitmap) ||
+            env->tlb_d[mmu_idx].clean) {
+            continue;
+        }
+        if (nb_pages >= tlb_n_entries(env, mmu_idx)) {
+            /* the range covers this mode's whole (resized) main TLB */
+            tlb_flush_one_mmuidx(env, mmu_idx);
+            continue;
+        }
+        for (i = 0; i < nb_pages; i++) {
+            page = start + (i << TARGET_PAGE_BITS);
+            tlb_flush_entry(tlb_entry(env, mmu_idx, page), page);
         }
+        /* one walk of the victim TLB covers the whole range */
+        vsize = tlb_vtlb_size(&env->tlb_d[mmu_idx]);
+        for (k = 0; k < vsize; k++) {
+            tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][k], start, last);
+        }
+    }
+
+    for (i = 0; i < nb_pages; i++) {
+        tb_flush_jmp_cache(cpu, start + (i << TARGET_PAGE_BITS));
+    }
+}
 
-        tlb_debug("idx %d\n", mmu_idx);
+static void tlb_flush_range_async_work(CPUState *cpu, run_on_cpu_data data)
+{
+    TLBFlushRangeData *d = data.host_ptr;
 
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+    tlb_flush_range_locked(cpu, d->addr, d->len, d->idxmap);
+    g_free(d);
+}
 
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap)
+{
+    tlb_debug("addr: " TARGET_FMT_lx " len: " TARGET_FMT_lx
+              " mmu_idx:%" PRIx16 "\n", addr, len, idxmap);
+
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushRangeData *d = g_new(TLBFlushRangeData, 1);
+
+        d->addr = addr;
+        d->len = len;
+        d->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_range_async_work,
+                         RUN_ON_CPU_HOST_PTR(d));
+    } else {
+        tlb_flush_range_locked(cpu, addr, len, idxmap);
+    }
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    tlb_flush_range_by_mmuidx(cpu, addr, len, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
+                                        target_ulong len, uint16_t idxmap)
+{
+    CPUState *cpu;
+
+    tlb_debug("addr: " TARGET_FMT_lx " len: " TARGET_FMT_lx
+              " mmu_idx:%" PRIx16 "\n", addr, len, idxmap);
+
+    /* Queue the flush on every other vCPU, then do our own directly */
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu) {
+            TLBFlushRangeData *d = g_new(TLBFlushRangeData, 1);
+
+            d->addr = addr;
+            d->len = len;
+            d->idxmap = idxmap;
+            async_run_on_cpu(cpu, tlb_flush_range_async_work,
+                             RUN_ON_CPU_HOST_PTR(d));
         }
     }
-    va_end(argp);
 
-    tb_flush_jmp_cache(cpu, addr);
+    tlb_flush_range_locked(src_cpu, addr, len, idxmap);
+}
+
+void tlb_flush_range_all_cpus(CPUState *src_cpu, target_ulong addr,
+                              target_ulong len)
+{
+    tlb_flush_range_by_mmuidx_all_cpus(src_cpu, addr, len, ALL_MMUIDX_BITS);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -229,7 +654,15 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+            /* This may race with the owning vCPU under MTTCG; the store
+             * must at least not tear.
+             */
+#if TCG_OVERSIZED_GUEST
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#else
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
+#endif
         }
     }
 }
@@ -256,12 +689,16 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
+        if (env->tlb_d[mmu_idx].clean) {
+            continue;
+        }
+
+        for (i = 0; i < tlb_n_entries(env, mmu_idx); i++) {
             tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                   start1, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        for (i = 0; i < tlb_vtlb_size(&env->tlb_d[mmu_idx]); i++) {
             tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
                                   start1, length);
         }
@@ -280,23 +717,53 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        int k, vsize = tlb_vtlb_size(&env->tlb_d[mmu_idx]);
+        for (k = 0; k < vsize; k++) {
             tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
         }
     }
 }
 
+/* Main TLB hits are resolved by generated code and are not counted: a
+ * main TLB miss either hits in the victim TLB or ends up in tlb_fill()
+ * and then tlb_set_page_with_attrs().
+ */
+void tlb_dump_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+    int mmu_idx;
+
+    cpu_fprintf(f, "\nSoftmmu TLB (up to %d entries per MMU mode):\n",
+                CPU_TLB_SIZE);
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+            uint64_t misses = desc->fills + desc->vtlb_hits;
+
+            if (!misses) {
+                continue;
+            }
+            cpu_fprintf(f, "cpu %d mmu %d: misses %" PRIu64
+                        " victim hits %" PRIu64 " (%" PRIu64 "%%)"
+                        " flushes %" PRIu64 " size %" PRIuPTR
+                        " victim size %zd\n",
+                        cpu->cpu_index, mmu_idx, misses, desc->vtlb_hits,
+                        desc->vtlb_hits * 100 / misses, desc->flushes,
+                        tlb_n_entries(env, mmu_idx), tlb_vtlb_size(desc));
+        }
+    }
+}
+
 /* Our TLB does not support large pages, so remember the area covered by
    large pages and trigger a full TLB flush if these are invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
@@ -332,6 +799,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
                              int mmu_idx, target_ulong size)
 {
     CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
     MemoryRegionSection *section;
     unsigned int index;
     target_ulong address;
@@ -339,7 +807,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te;
     hwaddr iotlb, xlat, sz;
-    unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+    unsigned vidx = desc->vtlb_index++ & (tlb_vtlb_size(desc) - 1);
     int asidx = cpu_asidx_from_attrs(cpu, attrs);
 
     assert(size >= TARGET_PAGE_SIZE);
@@ -369,12 +837,18 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    if (tlb_entry_is_empty(te)) {
+        desc->n_used_entries++;
+    }
+    desc->window_evictions++;
+    desc->fills++;
+    desc->clean = false;
 
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
@@ -465,8 +939,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
@@ -488,6 +962,115 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Writes to ranges registered with memory_region_add_coalescing() are
+ * not dispatched immediately.  As with KVM's coalesced MMIO ring, the
+ * vCPU queues them and they are replayed in order, with the BQL taken
+ * once for the whole batch, when the queue fills up, before the vCPU
+ * performs any other MMIO access, when it returns to its execution loop,
+ * and whenever qemu_flush_coalesced_mmio_buffer() is called.
+ *
+ * The queue is filled by its vCPU under coalesced_mmio_lock only; it
+ * is emptied with both the BQL and coalesced_mmio_lock held, so that
+ * successive batches are dispatched in order.
+ */
+#define COALESCED_MMIO_QUEUE_LEN 64
+
+typedef struct CoalescedMMIOWrite {
+    MemoryRegion *mr;
+    hwaddr addr;
+    uint64_t val;
+    unsigned size;
+    MemTxAttrs attrs;
+} CoalescedMMIOWrite;
+
+typedef struct CoalescedMMIOQueue {
+    unsigned len;
+    CoalescedMMIOWrite w[COALESCED_MMIO_QUEUE_LEN];
+} CoalescedMMIOQueue;
+
+void tcg_flush_coalesced_mmio(CPUState *cpu)
+{
+    CoalescedMMIOWrite w[COALESCED_MMIO_QUEUE_LEN];
+    CoalescedMMIOQueue *q;
+    unsigned i, len = 0;
+
+    g_assert(qemu_mutex_iothread_locked());
+
+    qemu_mutex_lock(&cpu->coalesced_mmio_lock);
+    q = cpu->coalesced_mmio;
+    if (q) {
+        len = q->len;
+        memcpy(w, q->w, len * sizeof(w[0]));
+        atomic_set(&q->len, 0);
+    }
+    qemu_mutex_unlock(&cpu->coalesced_mmio_lock);
+
+    for (i = 0; i < len; i++) {
+        memory_region_dispatch_write(w[i].mr, w[i].addr, w[i].val,
+                                     w[i].size, w[i].attrs);
+    }
+}
+
+static inline bool coalesced_mmio_pending(CPUState *cpu)
+{
+    return cpu->coalesced_mmio && atomic_read(&cpu->coalesced_mmio->len);
+}
+
+void tlb_drain_coalesced_mmio(CPUState *cpu)
+{
+    if (coalesced_mmio_pending(cpu)) {
+        if (qemu_mutex_iothread_locked()) {
+            tcg_flush_coalesced_mmio(cpu);
+        } else {
+            qemu_mutex_lock_iothread();
+            tcg_flush_coalesced_mmio(cpu);
+            qemu_mutex_unlock_iothread();
+        }
+    }
+}
+
+/* Queue a write to a coalesced range; return false if the queue was
+   full, in which case the caller must drain it and dispatch the write
+   itself.  */
+static bool coalesced_mmio_queue(CPUState *cpu, MemoryRegion *mr,
+                                 hwaddr addr, uint64_t val, unsigned size,
+                                 MemTxAttrs attrs)
+{
+    CoalescedMMIOQueue *q;
+    bool queued = false;
+
+    qemu_mutex_lock(&cpu->coalesced_mmio_lock);
+    q = cpu->coalesced_mmio;
+    if (unlikely(!q)) {
+        q = cpu->coalesced_mmio = g_new0(CoalescedMMIOQueue, 1);
+    }
+    if (q->len < COALESCED_MMIO_QUEUE_LEN) {
+        CoalescedMMIOWrite *w = &q->w[q->len];
+
+        w->mr = mr;
+        w->addr = addr;
+        w->val = val;
+        w->size = size;
+        w->attrs = attrs;
+        atomic_set(&q->len, q->len + 1);
+        queued = true;
+    }
+    qemu_mutex_unlock(&cpu->coalesced_mmio_lock);
+
+    return queued;
+}
+
+/* Called with the BQL held, if needed, before an MMIO access that is not
+   queued: earlier queued writes must reach their devices first.  */
+static void io_flush_coalesced_mmio(CPUState *cpu, MemoryRegion *mr)
+{
+    if (mr->flush_coalesced_mmio) {
+        qemu_flush_coalesced_mmio_buffer();
+    } else if (coalesced_mmio_pending(cpu)) {
+        tcg_flush_coalesced_mmio(cpu);
+    }
+}
+
 static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
                          target_ulong addr, uintptr_t retaddr, int size)
 {
@@ -495,6 +1078,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
     uint64_t val;
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     cpu->mem_io_pc = retaddr;
@@ -503,7 +1087,19 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     }
 
     cpu->mem_io_vaddr = addr;
+
+    if ((mr->global_locking || mr->flush_coalesced_mmio
+         || coalesced_mmio_pending(cpu))
+        && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    io_flush_coalesced_mmio(cpu, mr);
     memory_region_dispatch_read(mr, physaddr, &val, size, iotlbentry->attrs);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+
     return val;
 }
 
@@ -514,6 +1110,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    bool locked = false;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
@@ -522,7 +1119,24 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+
+    if (!use_icount && memory_region_is_coalesced(mr, physaddr, size)
+        && coalesced_mmio_queue(cpu, mr, physaddr, val, size,
+                                iotlbentry->attrs)) {
+        return;
+    }
+
+    if ((mr->global_locking || mr->flush_coalesced_mmio
+         || coalesced_mmio_pending(cpu))
+        && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    io_flush_coalesced_mmio(cpu, mr);
     memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 /* Return true if ADDR is present in the victim tlb, and has been copied
@@ -530,8 +1144,10 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
                            size_t elt_ofs, target_ulong page)
 {
-    size_t vidx;
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
+    CPUTLBDesc *desc = &env->tlb_d[mmu_idx];
+    size_t vidx, vsize = tlb_vtlb_size(desc);
+
+    for (vidx = 0; vidx < vsize; ++vidx) {
         CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
         target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
 
@@ -543,6 +1159,8 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 
             tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
             tmpio = *io; *io = *vio; *vio = tmpio;
+            desc->window_vtlb_hits++;
+            desc->vtlb_hits++;
             return true;
         }
     }
@@ -563,7 +1181,7 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr)
 {
-    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int index = tlb_index(env, mmu_idx, addr);
     target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
 
     if ((addr & TARGET_PAGE_MASK)
@@ -581,7 +1199,7 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
                                TCGMemOpIdx oi, uintptr_t retaddr)
 {
     size_t mmu_idx = get_mmuidx(oi);
-    size_t index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    size_t index = tlb_index(env, mmu_idx, addr);
     CPUTLBEntry *tlbe = &env->tlb_table[mmu_idx][index];
     target_ulong tlb_addr = tlbe->addr_write;
     TCGMemOp mop = get_memop(oi);
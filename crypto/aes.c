@@ -1651,3 +1651,141 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}
 	}
 }
+
+/*
+ * Single rounds on the host's AES instructions.
+ */
+
+#if defined(CONFIG_AVX2_OPT) || defined(__AES__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#endif
+#include <wmmintrin.h>
+
+void aes_accel_enc(uint8_t *st, const uint8_t *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128((__m128i *)st);
+    __m128i k = _mm_loadu_si128((__m128i *)rk);
+
+    s = last ? _mm_aesenclast_si128(s, k) : _mm_aesenc_si128(s, k);
+    _mm_storeu_si128((__m128i *)st, s);
+}
+
+void aes_accel_dec(uint8_t *st, const uint8_t *rk, bool last)
+{
+    __m128i s = _mm_loadu_si128((__m128i *)st);
+    __m128i k = _mm_loadu_si128((__m128i *)rk);
+
+    s = last ? _mm_aesdeclast_si128(s, k) : _mm_aesdec_si128(s, k);
+    _mm_storeu_si128((__m128i *)st, s);
+}
+
+void aes_accel_mc(uint8_t *st, bool inverse)
+{
+    __m128i s = _mm_loadu_si128((__m128i *)st);
+    __m128i zero = _mm_setzero_si128();
+
+    if (inverse) {
+        s = _mm_aesimc_si128(s);
+    } else {
+        /* There is no MixColumns alone, but InvShiftRows(InvSubBytes())
+         * undoes everything but the MixColumns step of AESENC.
+         */
+        s = _mm_aesenc_si128(_mm_aesdeclast_si128(s, zero), zero);
+    }
+    _mm_storeu_si128((__m128i *)st, s);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static bool aes_accel;
+
+static void __attribute__((constructor)) init_aes_accel(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        aes_accel = (c & bit_AES) && (d & bit_SSE2);
+    }
+}
+
+bool aes_accel_available(void)
+{
+    return aes_accel;
+}
+#else
+bool aes_accel_available(void)
+{
+    return true;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO) && \
+    !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+
+void aes_accel_enc(uint8_t *st, const uint8_t *rk, bool last)
+{
+    /* AESE does AddRoundKey first: apply a zero key there and the real
+     * one after the other steps, as the x86 instructions do.
+     */
+    uint8x16_t s = vaeseq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    if (!last) {
+        s = vaesmcq_u8(s);
+    }
+    vst1q_u8(st, veorq_u8(s, vld1q_u8(rk)));
+}
+
+void aes_accel_dec(uint8_t *st, const uint8_t *rk, bool last)
+{
+    uint8x16_t s = vaesdq_u8(vld1q_u8(st), vdupq_n_u8(0));
+
+    if (!last) {
+        s = vaesimcq_u8(s);
+    }
+    vst1q_u8(st, veorq_u8(s, vld1q_u8(rk)));
+}
+
+void aes_accel_mc(uint8_t *st, bool inverse)
+{
+    uint8x16_t s = vld1q_u8(st);
+
+    vst1q_u8(st, inverse ? vaesimcq_u8(s) : vaesmcq_u8(s));
+}
+
+bool aes_accel_available(void)
+{
+    return true;
+}
+
+#else
+bool aes_accel_available(void)
+{
+    return false;
+}
+
+void aes_accel_enc(uint8_t *st, const uint8_t *rk, bool last)
+{
+    abort();
+}
+
+void aes_accel_dec(uint8_t *st, const uint8_t *rk, bool last)
+{
+    abort();
+}
+
+void aes_accel_mc(uint8_t *st, bool inverse)
+{
+    abort();
+}
+#endif
@@ -107,3 +107,50 @@ int qcrypto_hash_bytesv(QCryptoHashAlgorithm alg,
     gcry_md_close(md);
     return -1;
 }
+
+
+int qcrypto_hash_bytes_batch(QCryptoHashAlgorithm alg,
+                             const struct iovec *bufs,
+                             size_t nbufs,
+                             uint8_t *results,
+                             Error **errp)
+{
+    size_t i, len;
+    int ret;
+    gcry_md_hd_t md;
+    unsigned char *digest;
+
+    if (!qcrypto_hash_supports(alg)) {
+        error_setg(errp,
+                   "Unknown hash algorithm %d",
+                   alg);
+        return -1;
+    }
+
+    ret = gcry_md_open(&md, qcrypto_hash_alg_map[alg], 0);
+
+    if (ret < 0) {
+        error_setg(errp,
+                   "Unable to initialize hash algorithm: %s",
+                   gcry_strerror(ret));
+        return -1;
+    }
+
+    len = qcrypto_hash_digest_len(alg);
+    for (i = 0; i < nbufs; i++) {
+        gcry_md_reset(md);
+        gcry_md_write(md, bufs[i].iov_base, bufs[i].iov_len);
+
+        digest = gcry_md_read(md, 0);
+        if (!digest) {
+            error_setg(errp,
+                       "No digest produced");
+            gcry_md_close(md);
+            return -1;
+        }
+        memcpy(results + i * len, digest, len);
+    }
+
+    gcry_md_close(md);
+    return 0;
+}
@@ -95,3 +95,38 @@ int qcrypto_hash_bytesv(QCryptoHashAlgorithm alg,
     g_checksum_free(cs);
     return -1;
 }
+
+
+int qcrypto_hash_bytes_batch(QCryptoHashAlgorithm alg,
+                             const struct iovec *bufs,
+                             size_t nbufs,
+                             uint8_t *results,
+                             Error **errp)
+{
+    size_t i, len;
+    gsize digestlen;
+    GChecksum *cs;
+
+    if (!qcrypto_hash_supports(alg)) {
+        error_setg(errp,
+                   "Unknown hash algorithm %d",
+                   alg);
+        return -1;
+    }
+
+    cs = g_checksum_new(qcrypto_hash_alg_map[alg]);
+
+    len = qcrypto_hash_digest_len(alg);
+    for (i = 0; i < nbufs; i++) {
+        if (i) {
+            g_checksum_reset(cs);
+        }
+        g_checksum_update(cs, bufs[i].iov_base, bufs[i].iov_len);
+
+        digestlen = len;
+        g_checksum_get_digest(cs, results + i * len, &digestlen);
+    }
+
+    g_checksum_free(cs);
+    return 0;
+}
@@ -152,3 +152,41 @@ int qcrypto_hash_bytesv(QCryptoHashAlgorithm alg,
 
     return 0;
 }
+
+
+int qcrypto_hash_bytes_batch(QCryptoHashAlgorithm alg,
+                             const struct iovec *bufs,
+                             size_t nbufs,
+                             uint8_t *results,
+                             Error **errp)
+{
+    size_t i;
+    union qcrypto_hash_ctx ctx;
+    struct qcrypto_hash_alg *h;
+
+    if (!qcrypto_hash_supports(alg)) {
+        error_setg(errp,
+                   "Unknown hash algorithm %d",
+                   alg);
+        return -1;
+    }
+
+    h = &qcrypto_hash_alg_map[alg];
+
+    /* The digest functions reset the context for the next buffer */
+    h->init(&ctx);
+    for (i = 0; i < nbufs; i++) {
+        size_t len = bufs[i].iov_len;
+        uint8_t *base = bufs[i].iov_base;
+
+        while (len) {
+            size_t shortlen = MIN(len, UINT_MAX);
+            h->write(&ctx, shortlen, base);
+            len -= shortlen;
+            base += shortlen;
+        }
+        h->result(&ctx, h->len, results + i * h->len);
+    }
+
+    return 0;
+}
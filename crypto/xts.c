@@ -26,6 +26,9 @@
 #include "qemu/osdep.h"
 #include "crypto/xts.h"
 
+/* Number of blocks handed to the cipher function in one call */
+#define XTS_BATCH_BLOCKS 32
+
 static void xts_mult_x(uint8_t *I)
 {
     int x;
@@ -42,6 +45,50 @@ static void xts_mult_x(uint8_t *I)
 }
 
 
+/**
+ * xts_tweak_crypt_batch:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing @nblocks blocks of XTS_BLOCK_SIZE bytes
+ * @dst: buffer to output @nblocks blocks of XTS_BLOCK_SIZE bytes
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @nblocks: number of blocks, at most XTS_BATCH_BLOCKS
+ *
+ * Encrypt or decrypt several consecutive blocks with their tweaks.
+ * The tweaks do not depend on the data, so all blocks go through
+ * @func in a single call, which lets the underlying ECB implementation
+ * keep several blocks in flight (e.g. interleaved AES-NI rounds).
+ */
+static void xts_tweak_crypt_batch(const void *ctx,
+                                  xts_cipher_func *func,
+                                  const uint8_t *src,
+                                  uint8_t *dst,
+                                  uint8_t *iv,
+                                  unsigned long nblocks)
+{
+    uint8_t T[XTS_BATCH_BLOCKS][XTS_BLOCK_SIZE];
+    unsigned long i, x;
+
+    g_assert(nblocks <= XTS_BATCH_BLOCKS);
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(T[i], iv, XTS_BLOCK_SIZE);
+        for (x = 0; x < XTS_BLOCK_SIZE; x++) {
+            dst[i * XTS_BLOCK_SIZE + x] = src[i * XTS_BLOCK_SIZE + x] ^ T[i][x];
+        }
+        xts_mult_x(iv);
+    }
+
+    func(ctx, nblocks * XTS_BLOCK_SIZE, dst, dst);
+
+    for (i = 0; i < nblocks; i++) {
+        for (x = 0; x < XTS_BLOCK_SIZE; x++) {
+            dst[i * XTS_BLOCK_SIZE + x] ^= T[i][x];
+        }
+    }
+}
+
+
 /**
  * xts_tweak_uncrypt:
  * @param ctxt: the cipher context
@@ -104,11 +151,13 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_decrypt(datactx, decfunc, src, dst, T);
+    for (i = 0; i < lim; i += XTS_BATCH_BLOCKS) {
+        unsigned long n = MIN(lim - i, XTS_BATCH_BLOCKS);
 
-        src += XTS_BLOCK_SIZE;
-        dst += XTS_BLOCK_SIZE;
+        xts_tweak_crypt_batch(datactx, decfunc, src, dst, T, n);
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
     }
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
@@ -199,11 +248,13 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_encrypt(datactx, encfunc, src, dst, T);
+    for (i = 0; i < lim; i += XTS_BATCH_BLOCKS) {
+        unsigned long n = MIN(lim - i, XTS_BATCH_BLOCKS);
+
+        xts_tweak_crypt_batch(datactx, encfunc, src, dst, T, n);
 
-        dst += XTS_BLOCK_SIZE;
-        src += XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        src += n * XTS_BLOCK_SIZE;
     }
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
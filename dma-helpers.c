@@ -49,8 +49,24 @@ void qemu_sglist_init(QEMUSGList *qsg, DeviceState *dev, int alloc_hint,
     object_ref(OBJECT(dev));
 }
 
+/*
+ * Guests commonly describe a physically contiguous buffer with many
+ * page-sized descriptors.  Merge them while building the list, so that
+ * dma_blk_io() maps them with a single translation and hands the block
+ * layer one well-sized iovec instead of a long run of tiny ones.
+ */
 void qemu_sglist_add(QEMUSGList *qsg, dma_addr_t base, dma_addr_t len)
 {
+    if (qsg->nsg > 0) {
+        ScatterGatherEntry *last = &qsg->sg[qsg->nsg - 1];
+
+        if (last->base + last->len == base) {
+            last->len += len;
+            qsg->size += len;
+            return;
+        }
+    }
+
     if (qsg->nsg == qsg->nalloc) {
         qsg->nalloc = 2 * qsg->nalloc + 1;
         qsg->sg = g_realloc(qsg->sg, qsg->nalloc * sizeof(ScatterGatherEntry));
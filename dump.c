@@ -13,6 +13,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "elf.h"
 #include "cpu.h"
 #include "exec/cpu-all.h"
@@ -1181,20 +1183,262 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/* Guest memory handed to the compression threads at a time */
+#define DUMP_COMPRESS_BATCH_SIZE    (4 * 1024 * 1024)
+/* Pages a thread claims from the batch at a time */
+#define DUMP_COMPRESS_CHUNK         16
+#define DUMP_COMPRESS_MAX_THREADS   8
+
+typedef struct DumpCompressPage {
+    uint8_t *buf;       /* the guest page */
+    uint8_t *data;      /* what to write: buf or the compressed copy */
+    size_t size;        /* size of data, 0 for a zero page */
+    uint32_t flags;     /* DUMP_DH_COMPRESSED_* used for data, or 0 */
+} DumpCompressPage;
+
+/*
+ * Compression of a batch of pages is shared between the dumping thread and
+ * up to DUMP_COMPRESS_MAX_THREADS - 1 helpers.  Each page has its own slot
+ * in pages[] and buf_out, so the results are written in pfn order once the
+ * whole batch is done, exactly as if it had been compressed serially.
+ */
+typedef struct DumpCompress {
+    DumpState *s;
+    DumpCompressPage *pages;
+    uint8_t *buf_out;
+    size_t len_buf_out;
+    int batch;          /* capacity of pages[] */
+    int npages;
+    int next;           /* first page nobody has claimed yet */
+
+    QemuMutex mutex;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    unsigned int generation;
+    int active;
+    bool quit;
+    int nthreads;
+    QemuThread *threads;
+} DumpCompress;
+
+static void dump_compress_page(DumpState *s, DumpCompressPage *p,
+                               uint8_t *buf_out, size_t len_buf_out,
+                               void *wrkmem)
+{
+    size_t size_out = len_buf_out;
+
+    if (is_zero_page(p->buf, s->dump_info.page_size)) {
+        p->size = 0;
+        return;
+    }
+
+    /*
+     * only one compression format will be used here, for
+     * s->flag_compress is set. But when compression fails to work,
+     * we fall back to save in plaintext.
+     */
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(buf_out, (uLongf *)&size_out, p->buf,
+                       s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        p->flags = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(p->buf, s->dump_info.page_size, buf_out,
+            (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        p->flags = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)p->buf, s->dump_info.page_size,
+            (char *)buf_out, &size_out) == SNAPPY_OK) &&
+            (size_out < s->dump_info.page_size)) {
+        p->flags = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        /* fall back to save in plaintext */
+        p->flags = 0;
+        p->data = p->buf;
+        p->size = s->dump_info.page_size;
+        return;
+    }
+
+    p->data = buf_out;
+    p->size = size_out;
+}
+
+/* Compress pages of the current batch until none is left */
+static void dump_compress_run(DumpCompress *dc, void *wrkmem)
+{
+    int i, end;
+
+    while ((i = atomic_fetch_add(&dc->next, DUMP_COMPRESS_CHUNK)) <
+           dc->npages) {
+        end = MIN(i + DUMP_COMPRESS_CHUNK, dc->npages);
+        for (; i < end; i++) {
+            dump_compress_page(dc->s, &dc->pages[i],
+                               dc->buf_out + i * dc->len_buf_out,
+                               dc->len_buf_out, wrkmem);
+        }
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompress *dc = opaque;
+    unsigned int seen = 0;
+    void *wrkmem = NULL;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&dc->mutex);
+    while (true) {
+        while (!dc->quit && dc->generation == seen) {
+            qemu_cond_wait(&dc->work_cond, &dc->mutex);
+        }
+        if (dc->quit) {
+            break;
+        }
+        seen = dc->generation;
+        qemu_mutex_unlock(&dc->mutex);
+
+        dump_compress_run(dc, wrkmem);
+
+        qemu_mutex_lock(&dc->mutex);
+        if (--dc->active == 0) {
+            qemu_cond_signal(&dc->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&dc->mutex);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_compress_init(DumpCompress *dc, DumpState *s,
+                               size_t len_buf_out)
+{
+    int i, n = DUMP_COMPRESS_MAX_THREADS;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = MIN(n, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+
+    memset(dc, 0, sizeof(*dc));
+    dc->s = s;
+    dc->len_buf_out = len_buf_out;
+    dc->batch = MAX(DUMP_COMPRESS_BATCH_SIZE / s->dump_info.page_size, 1);
+    dc->pages = g_new0(DumpCompressPage, dc->batch);
+    dc->buf_out = g_malloc(dc->batch * len_buf_out);
+
+    qemu_mutex_init(&dc->mutex);
+    qemu_cond_init(&dc->work_cond);
+    qemu_cond_init(&dc->done_cond);
+
+    /* The dumping thread is one of them */
+    dc->nthreads = MAX(n - 1, 0);
+    dc->threads = g_new0(QemuThread, dc->nthreads);
+    for (i = 0; i < dc->nthreads; i++) {
+        qemu_thread_create(&dc->threads[i], "dump_compress",
+                           dump_compress_thread, dc, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Compress the dc->npages pages of the batch */
+static void dump_compress_batch(DumpCompress *dc, void *wrkmem)
+{
+    dc->next = 0;
+    if (dc->nthreads) {
+        qemu_mutex_lock(&dc->mutex);
+        dc->active = dc->nthreads;
+        dc->generation++;
+        qemu_cond_broadcast(&dc->work_cond);
+        qemu_mutex_unlock(&dc->mutex);
+    }
+
+    dump_compress_run(dc, wrkmem);
+
+    if (dc->nthreads) {
+        qemu_mutex_lock(&dc->mutex);
+        while (dc->active) {
+            qemu_cond_wait(&dc->done_cond, &dc->mutex);
+        }
+        qemu_mutex_unlock(&dc->mutex);
+    }
+}
+
+static void dump_compress_cleanup(DumpCompress *dc)
+{
+    int i;
+
+    qemu_mutex_lock(&dc->mutex);
+    dc->quit = true;
+    qemu_cond_broadcast(&dc->work_cond);
+    qemu_mutex_unlock(&dc->mutex);
+    for (i = 0; i < dc->nthreads; i++) {
+        qemu_thread_join(&dc->threads[i]);
+    }
+
+    qemu_cond_destroy(&dc->done_cond);
+    qemu_cond_destroy(&dc->work_cond);
+    qemu_mutex_destroy(&dc->mutex);
+    g_free(dc->threads);
+    g_free(dc->buf_out);
+    g_free(dc->pages);
+}
+
+/* Write the descriptors and data of the compressed batch, in order */
+static int dump_write_batch(DumpState *s, DumpCompress *dc,
+                            DataCache *page_desc, DataCache *page_data,
+                            PageDescriptor *pd_zero, off_t *offset_data,
+                            Error **errp)
+{
+    PageDescriptor pd;
+    DumpCompressPage *p;
+    int i;
+
+    for (i = 0; i < dc->npages; i++) {
+        p = &dc->pages[i];
+        if (!p->size) {
+            /* zero pages all share the first page of the page section */
+            pd = *pd_zero;
+        } else {
+            if (write_cache(page_data, p->data, p->size, false) < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                return -1;
+            }
+            pd.flags = cpu_to_dump32(s, p->flags);
+            pd.size = cpu_to_dump32(s, p->size);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, *offset_data);
+            *offset_data += p->size;
+        }
+
+        if (write_cache(page_desc, &pd, sizeof(PageDescriptor), false) < 0) {
+            error_setg(errp, "dump: failed to write page desc");
+            return -1;
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+    return 0;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompress dc;
+    size_t len_buf_out;
+    void *wrkmem = NULL;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1211,7 +1455,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
 #endif
 
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_init(&dc, s, len_buf_out);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1232,100 +1476,26 @@ static void write_dump_pages(DumpState *s, Error **errp)
     offset_data += s->dump_info.page_size;
 
     /*
-     * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * dump memory to vmcore a batch of pages at a time: compress the batch,
+     * then write the compressed pages into the cache of page_data and
+     * their descriptors into the cache of page_desc
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+    while (more) {
+        dc.npages = 0;
+        while (dc.npages < dc.batch &&
+               (more = get_next_page(&block_iter, &pfn_iter, &buf, s))) {
+            dc.pages[dc.npages++].buf = buf;
+        }
+        if (!dc.npages) {
+            break;
+        }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
+        dump_compress_batch(&dc, wrkmem);
+        ret = dump_write_batch(s, &dc, &page_desc, &page_data, &pd_zero,
+                               &offset_data, errp);
+        if (ret < 0) {
+            goto out;
         }
-        s->written_size += s->dump_info.page_size;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1343,11 +1513,8 @@ out:
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
 
-#ifdef CONFIG_LZO
+    dump_compress_cleanup(&dc);
     g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
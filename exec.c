@@ -172,6 +172,9 @@ typedef struct PhysPageMap {
 
 struct AddressSpaceDispatch {
     struct rcu_head rcu;
+    /* Number of address spaces using this tree, protected by the BQL.  */
+    int ref;
+    bool compacted;
 
     MemoryRegionSection *mru_section;
     /* This is a multi-level map on the physical address space.
@@ -708,6 +711,8 @@ void cpu_exec_realizefn(CPUState *cpu, Error **errp)
     cpu_list_add(cpu);
 
 #ifndef CONFIG_USER_ONLY
+    tlb_init(cpu);
+
     if (qdev_get_vmsd(DEVICE(cpu)) == NULL) {
         vmstate_register(NULL, cpu->cpu_index, &vmstate_cpu_common, cpu);
     }
@@ -1053,6 +1058,96 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+struct DirtyBitmapSnapshot {
+    ram_addr_t start;
+    ram_addr_t end;
+    unsigned long dirty[];
+};
+
+/*
+ * The snapshot is taken a word at a time, so it covers (and clears) the
+ * range rounded out to BITS_PER_LONG pages.
+ */
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+     (ram_addr_t start, ram_addr_t length, unsigned client)
+{
+    DirtyMemoryBlocks *blocks;
+    ram_addr_t align = (ram_addr_t)TARGET_PAGE_SIZE * BITS_PER_LONG;
+    ram_addr_t first = QEMU_ALIGN_DOWN(start, align);
+    ram_addr_t last = QEMU_ALIGN_UP(start + length, align);
+    DirtyBitmapSnapshot *snap;
+    unsigned long page, end, dest;
+
+    snap = g_malloc0(sizeof(*snap) +
+                     ((last - first) >> (TARGET_PAGE_BITS + 3)));
+    snap->start = first;
+    snap->end = last;
+
+    page = first >> TARGET_PAGE_BITS;
+    end = last >> TARGET_PAGE_BITS;
+    dest = 0;
+
+    rcu_read_lock();
+
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        assert(QEMU_IS_ALIGNED(offset, BITS_PER_LONG));
+        assert(QEMU_IS_ALIGNED(num, BITS_PER_LONG));
+
+        bitmap_copy_and_clear_atomic(snap->dirty + dest,
+                                     blocks->blocks[idx] + BIT_WORD(offset),
+                                     num);
+        page += num;
+        dest += BIT_WORD(num);
+    }
+
+    rcu_read_unlock();
+
+    if (tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return snap;
+}
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length)
+{
+    unsigned long page, end;
+
+    assert(start >= snap->start);
+    assert(start + length <= snap->end);
+
+    end = TARGET_PAGE_ALIGN(start + length - snap->start) >> TARGET_PAGE_BITS;
+    page = (start - snap->start) >> TARGET_PAGE_BITS;
+
+    return find_next_bit(snap->dirty, end, page) < end;
+}
+
+/* Called from RCU critical section.  The range may span several blocks.  */
+void cpu_physical_memory_clear_dirty_log(ram_addr_t start, ram_addr_t length)
+{
+    ram_addr_t end = start + length;
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t block_start = MAX(start, block->offset);
+        ram_addr_t block_end = MIN(end, block->offset + block->used_length);
+
+        if (block_start < block_end) {
+            memory_region_clear_dirty_bitmap(block->mr,
+                                             block_start - block->offset,
+                                             block_end - block_start);
+        }
+    }
+}
+
 /* Called from RCU critical section */
 hwaddr memory_region_section_get_iotlb(CPUState *cpu,
                                        MemoryRegionSection *section,
@@ -1208,6 +1303,11 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (as->dispatch_src) {
+        /* The tree is built through dispatch_src.  */
+        return;
+    }
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1236,8 +1336,15 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 
 void qemu_flush_coalesced_mmio_buffer(void)
 {
-    if (kvm_enabled())
+    if (kvm_enabled()) {
         kvm_flush_coalesced_mmio_buffer();
+    } else if (tcg_enabled()) {
+        CPUState *cpu;
+
+        CPU_FOREACH(cpu) {
+            tcg_flush_coalesced_mmio(cpu);
+        }
+    }
 }
 
 void qemu_mutex_lock_ramlist(void)
@@ -1472,6 +1579,16 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
+void *qemu_ram_get_host_addr(RAMBlock *rb)
+{
+    return rb->host;
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1518,6 +1635,135 @@ size_t qemu_ram_pagesize(RAMBlock *rb)
     return rb->page_size;
 }
 
+bool qemu_ram_is_shared(RAMBlock *rb)
+{
+    return rb->flags & RAM_SHARED;
+}
+
+/* Ranges of guest RAM whose transparent huge pages were split, and that
+ * are collapsed back a few huge pages at a time.  MADV_COLLAPSE copies
+ * the small pages into a new huge page synchronously, so the work has to
+ * be spread out instead of stalling the main loop for the whole of RAM.
+ */
+typedef struct RAMCollapseRange {
+    uint8_t *host;
+    size_t length;
+    QSIMPLEQ_ENTRY(RAMCollapseRange) next;
+} RAMCollapseRange;
+
+#define RAM_COLLAPSE_INTERVAL_MS 100
+#define RAM_COLLAPSE_BYTES_PER_TICK (16 * 1024 * 1024)
+
+static struct {
+    QemuMutex lock;
+    QEMUTimer *timer;
+    bool disabled;
+    QSIMPLEQ_HEAD(, RAMCollapseRange) queue;
+} ram_collapse = {
+    .queue = QSIMPLEQ_HEAD_INITIALIZER(ram_collapse.queue),
+};
+
+static void ram_collapse_tick(void *opaque)
+{
+    size_t budget = RAM_COLLAPSE_BYTES_PER_TICK;
+    RAMCollapseRange *r;
+
+    qemu_mutex_lock(&ram_collapse.lock);
+    while (budget && (r = QSIMPLEQ_FIRST(&ram_collapse.queue))) {
+        size_t len = MIN(r->length, budget);
+        RAMBlock *block;
+        ram_addr_t offset;
+
+        /* The block may have gone away since the range was queued */
+        block = qemu_ram_block_from_host(r->host, false, &offset);
+        if (block && offset + len <= block->used_length &&
+            qemu_madvise(r->host, len, QEMU_MADV_COLLAPSE) &&
+            errno == EINVAL) {
+            /* The kernel does not support MADV_COLLAPSE */
+            ram_collapse.disabled = true;
+        }
+
+        if (ram_collapse.disabled) {
+            while ((r = QSIMPLEQ_FIRST(&ram_collapse.queue))) {
+                QSIMPLEQ_REMOVE_HEAD(&ram_collapse.queue, next);
+                g_free(r);
+            }
+            break;
+        }
+
+        r->host += len;
+        r->length -= len;
+        budget -= len;
+        if (!r->length) {
+            QSIMPLEQ_REMOVE_HEAD(&ram_collapse.queue, next);
+            g_free(r);
+        }
+    }
+
+    if (!QSIMPLEQ_EMPTY(&ram_collapse.queue)) {
+        timer_mod(ram_collapse.timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  RAM_COLLAPSE_INTERVAL_MS);
+    }
+    qemu_mutex_unlock(&ram_collapse.lock);
+}
+
+static void __attribute__((constructor)) ram_collapse_init(void)
+{
+    qemu_mutex_init(&ram_collapse.lock);
+}
+
+/*
+ * qemu_ram_collapse_schedule: ask for the transparent huge pages of a
+ * range of anonymous guest RAM to be put back together in the background,
+ * after they were split by discarding or by placing small pages in it.
+ * Only the huge pages entirely within the range are collapsed.
+ *
+ * Can be called from any thread.
+ */
+void qemu_ram_collapse_schedule(void *host, size_t length)
+{
+    size_t thp_pagesize = qemu_thp_pagesize();
+    uintptr_t start, end;
+    RAMCollapseRange *r;
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    if (QEMU_MADV_COLLAPSE == QEMU_MADV_INVALID || !thp_pagesize ||
+        ram_collapse.disabled) {
+        return;
+    }
+
+    /* File backed memory is either hugetlbfs or not collapsed by us */
+    block = qemu_ram_block_from_host(host, false, &offset);
+    if (!block || block->fd >= 0) {
+        return;
+    }
+
+    start = QEMU_ALIGN_UP((uintptr_t)host, thp_pagesize);
+    end = QEMU_ALIGN_DOWN((uintptr_t)host + length, thp_pagesize);
+    if (end <= start) {
+        return;
+    }
+
+    r = g_new(RAMCollapseRange, 1);
+    r->host = (uint8_t *)start;
+    r->length = end - start;
+
+    qemu_mutex_lock(&ram_collapse.lock);
+    if (!ram_collapse.timer) {
+        ram_collapse.timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                          ram_collapse_tick, NULL);
+    }
+    if (QSIMPLEQ_EMPTY(&ram_collapse.queue)) {
+        timer_mod(ram_collapse.timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  RAM_COLLAPSE_INTERVAL_MS);
+    }
+    QSIMPLEQ_INSERT_TAIL(&ram_collapse.queue, r, next);
+    qemu_mutex_unlock(&ram_collapse.lock);
+}
+
 static int memory_try_enable_merging(void *addr, size_t len)
 {
     if (!machine_mem_merge(current_machine)) {
@@ -2049,6 +2295,10 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
 {
     bool locked = false;
 
+    if (current_cpu &&
+        !cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         locked = true;
         tb_lock();
@@ -2383,6 +2633,8 @@ static void mem_begin(MemoryListener *listener)
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
+    d->ref = 1;
+
     n = dummy_section(&d->map, as, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
     n = dummy_section(&d->map, as, &io_mem_notdirty);
@@ -2403,17 +2655,39 @@ static void address_space_dispatch_free(AddressSpaceDispatch *d)
     g_free(d);
 }
 
+/* Several address spaces may point to D; it is freed one grace period
+ * after the last of them stops doing so.
+ */
+static void address_space_dispatch_unref(AddressSpaceDispatch *d)
+{
+    if (--d->ref == 0) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
 
-    phys_page_compact_all(next, next->map.nodes_nb);
+    if (as->dispatch_src) {
+        /* The FlatView is identical to that of dispatch_src, so use its
+         * tree and throw away the empty one from mem_begin.
+         */
+        address_space_dispatch_free(next);
+        next = as->dispatch_src->next_dispatch;
+        as->next_dispatch = next;
+        next->ref++;
+    }
+    if (!next->compacted) {
+        phys_page_compact_all(next, next->map.nodes_nb);
+        next->compacted = true;
+    }
 
     atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(cur);
     }
 }
 
@@ -2459,7 +2733,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
 
     atomic_rcu_set(&as->dispatch, NULL);
     if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
+        address_space_dispatch_unref(d);
     }
 }
 
@@ -2876,7 +3150,50 @@ typedef struct {
     bool in_use;
 } BounceBuffer;
 
-static BounceBuffer bounce;
+/* Several devices (or several requests of one device) can map MMIO or
+ * IOMMU-protected memory at the same time, so keep a small pool of
+ * bounce buffers instead of serializing everyone on a single one.
+ */
+#define BOUNCE_BUFFER_COUNT 16
+
+static BounceBuffer bounce[BOUNCE_BUFFER_COUNT];
+
+static BounceBuffer *bounce_buffer_get(void)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFER_COUNT; i++) {
+        if (!atomic_read(&bounce[i].in_use) &&
+            !atomic_xchg(&bounce[i].in_use, true)) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+static BounceBuffer *bounce_buffer_find(void *buffer)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFER_COUNT; i++) {
+        if (atomic_read(&bounce[i].in_use) && bounce[i].buffer == buffer) {
+            return &bounce[i];
+        }
+    }
+    return NULL;
+}
+
+static bool bounce_buffer_available(void)
+{
+    int i;
+
+    for (i = 0; i < BOUNCE_BUFFER_COUNT; i++) {
+        if (!atomic_read(&bounce[i].in_use)) {
+            return true;
+        }
+    }
+    return false;
+}
 
 typedef struct MapClient {
     QEMUBH *bh;
@@ -2911,7 +3228,7 @@ void cpu_register_map_client(QEMUBH *bh)
     qemu_mutex_lock(&map_client_list_lock);
     client->bh = bh;
     QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
+    if (bounce_buffer_available()) {
         cpu_notify_map_clients_locked();
     }
     qemu_mutex_unlock(&map_client_list_lock);
@@ -3029,26 +3346,28 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *b = bounce_buffer_get();
+
+        if (!b) {
             rcu_read_unlock();
             return NULL;
         }
         /* Avoid unbounded allocations */
         l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        b->addr = addr;
+        b->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        b->mr = mr;
+        ptr = qemu_memalign(TARGET_PAGE_SIZE, l);
         if (!is_write) {
-            address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+            address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED, ptr, l);
         }
+        atomic_mb_set(&b->buffer, ptr);
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return ptr;
     }
 
 
@@ -3067,7 +3386,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *b = bounce_buffer_find(buffer);
+
+    if (!b) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3083,13 +3404,13 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, b->addr, MEMTXATTRS_UNSPECIFIED,
+                            b->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
+    qemu_vfree(b->buffer);
+    b->buffer = NULL;
+    memory_region_unref(b->mr);
+    atomic_mb_set(&b->in_use, false);
     cpu_notify_map_clients();
 }
 
@@ -3169,6 +3490,115 @@ void address_space_cache_destroy(MemoryRegionCache *cache)
     cache->mr = NULL;
 }
 
+/* One translation of an AddressSpaceWindow, valid until the memory
+ * map of its address space changes.
+ */
+typedef struct AddressSpaceWindowMap {
+    struct rcu_head rcu;
+    unsigned gen;
+    /* Length of the prefix of the window that CACHE maps, 0 if the
+     * window does not start in RAM.
+     */
+    hwaddr len;
+    MemoryRegionCache cache;
+} AddressSpaceWindowMap;
+
+static void address_space_window_map_free(AddressSpaceWindowMap *map)
+{
+    address_space_cache_destroy(&map->cache);
+    g_free(map);
+}
+
+/* Called from RCU critical section.  */
+static AddressSpaceWindowMap *address_space_window_map(AddressSpaceWindow *w)
+{
+    AddressSpaceWindowMap *map = atomic_rcu_read(&w->map);
+    AddressSpaceWindowMap *new, *old;
+    unsigned gen = atomic_mb_read(&w->as->topology_gen);
+    AddressSpaceDispatch *d;
+    MemoryRegionSection *section;
+    hwaddr xlat, plen = w->len;
+    int64_t l;
+
+    if (likely(map && map->gen == gen)) {
+        return map;
+    }
+
+    new = g_new0(AddressSpaceWindowMap, 1);
+    new->gen = gen;
+    d = atomic_rcu_read(&w->as->dispatch);
+    section = address_space_translate_internal(d, w->addr, &xlat, &plen, true);
+    if (!section->mr->iommu_ops) {
+        l = address_space_cache_init(&new->cache, w->as, w->addr, w->len,
+                                     w->is_write);
+        if (l > 0) {
+            new->len = l;
+        }
+    }
+
+    old = atomic_cmpxchg(&w->map, map, new);
+    if (old != map) {
+        /* Another thread retranslated the window first.  */
+        address_space_window_map_free(new);
+        return old;
+    }
+    if (map) {
+        call_rcu(map, address_space_window_map_free, rcu);
+    }
+    return new;
+}
+
+void address_space_window_init(AddressSpaceWindow *w, AddressSpace *as,
+                               hwaddr addr, hwaddr len, bool is_write)
+{
+    assert(len > 0);
+
+    w->as = as;
+    w->addr = addr;
+    w->len = len;
+    w->is_write = is_write;
+    w->map = NULL;
+}
+
+MemTxResult address_space_window_rw(AddressSpaceWindow *w, hwaddr addr,
+                                    MemTxAttrs attrs, void *buf, hwaddr len,
+                                    bool is_write)
+{
+    AddressSpaceWindowMap *map;
+    MemTxResult result = MEMTX_OK;
+
+    assert(addr < w->len && len <= w->len - addr);
+
+    rcu_read_lock();
+    map = address_space_window_map(w);
+    if (likely(addr + len <= map->len && (!is_write || w->is_write))) {
+        void *ptr = map->cache.ptr + addr;
+
+        if (is_write) {
+            memcpy(ptr, buf, len);
+            invalidate_and_set_dirty(map->cache.mr, map->cache.xlat + addr,
+                                     len);
+        } else {
+            memcpy(buf, ptr, len);
+        }
+    } else {
+        result = address_space_rw(w->as, w->addr + addr, attrs,
+                                  buf, len, is_write);
+    }
+    rcu_read_unlock();
+
+    return result;
+}
+
+void address_space_window_destroy(AddressSpaceWindow *w)
+{
+    AddressSpaceWindowMap *map = atomic_xchg(&w->map, NULL);
+
+    if (map) {
+        call_rcu(map, address_space_window_map_free, rcu);
+    }
+}
+
 /* Called from RCU critical section.  This function has the same
  * semantics as address_space_translate, but it only works on a
  * predefined range of a MemoryRegion that was mapped with
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 
 #include "fpu/softfloat.h"
 
@@ -2164,7 +2166,8 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2187,7 +2190,8 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2210,7 +2214,8 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2275,7 +2280,8 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2673,7 +2679,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -3959,7 +3965,8 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -3982,7 +3989,8 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -4005,7 +4013,8 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4068,7 +4077,8 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b,
+                                float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4481,7 +4491,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -4529,6 +4539,284 @@ float64 float64_sqrt(float64 a, float_status *status)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast paths for the basic single- and double-precision operations.
+|
+| The host FPU is used when the guest is in round-to-nearest-even mode and
+| the inexact flag has already been raised, so that the only exceptions left
+| to detect are overflow, which shows up as an infinite result, and
+| underflow, which is excluded by falling back to softfloat for any result
+| of magnitude at most the smallest normal.  Inputs must be zero or normal,
+| which rules out NaN propagation and input denormal handling.  Anything
+| else goes through the softfloat implementation above.
+|
+| The fast path is disabled where the C compiler does not evaluate float and
+| double in their own precision, since double rounding would then give
+| results that differ from IEEE.
+*----------------------------------------------------------------------------*/
+
+#if defined(__FAST_MATH__) || !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD != 0
+# define QEMU_NO_HARDFLOAT 1
+#else
+# define QEMU_NO_HARDFLOAT 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(const float_status *s)
+{
+    if (QEMU_NO_HARDFLOAT) {
+        return false;
+    }
+    return likely(s->float_exception_flags & float_flag_inexact &&
+                  s->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool float32_is_zon(float32 a)
+{
+    return extractFloat32Exp(a) != 0xFF &&
+           (extractFloat32Exp(a) != 0 || extractFloat32Frac(a) == 0);
+}
+
+static inline bool float64_is_zon(float64 a)
+{
+    return extractFloat64Exp(a) != 0x7FF &&
+           (extractFloat64Exp(a) != 0 || extractFloat64Frac(a) == 0);
+}
+
+typedef float32 (*soft_f32_op2_fn)(float32, float32, float_status *);
+typedef float64 (*soft_f64_op2_fn)(float64, float64, float_status *);
+
+/* PRE returns true if the inputs are suitable for the host FPU; POST
+ * returns true if a result no larger than the smallest normal may have
+ * underflowed and must be recomputed in software.
+ */
+typedef bool (*f32_check_fn)(float32, float32);
+typedef bool (*f64_check_fn)(float64, float64);
+
+static inline bool f32_is_zon2(float32 a, float32 b)
+{
+    return float32_is_zon(a) && float32_is_zon(b);
+}
+
+static inline bool f64_is_zon2(float64 a, float64 b)
+{
+    return float64_is_zon(a) && float64_is_zon(b);
+}
+
+static inline float32
+float32_gen2(float32 a, float32 b, float_status *s, int op,
+             soft_f32_op2_fn soft, f32_check_fn pre, f32_check_fn post)
+{
+    union_float32 ua, ub, ur;
+
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+    ua.s = float32_squash_input_denormal(a, s);
+    ub.s = float32_squash_input_denormal(b, s);
+    if (unlikely(!pre(ua.s, ub.s))) {
+        goto soft;
+    }
+
+    switch (op) {
+    case 0:
+        ur.h = ua.h + ub.h;
+        break;
+    case 1:
+        ur.h = ua.h - ub.h;
+        break;
+    case 2:
+        ur.h = ua.h * ub.h;
+        break;
+    default:
+        ur.h = ua.h / ub.h;
+        break;
+    }
+
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && post(ua.s, ub.s)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(a, b, s);
+}
+
+static inline float64
+float64_gen2(float64 a, float64 b, float_status *s, int op,
+             soft_f64_op2_fn soft, f64_check_fn pre, f64_check_fn post)
+{
+    union_float64 ua, ub, ur;
+
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+    ua.s = float64_squash_input_denormal(a, s);
+    ub.s = float64_squash_input_denormal(b, s);
+    if (unlikely(!pre(ua.s, ub.s))) {
+        goto soft;
+    }
+
+    switch (op) {
+    case 0:
+        ur.h = ua.h + ub.h;
+        break;
+    case 1:
+        ur.h = ua.h - ub.h;
+        break;
+    case 2:
+        ur.h = ua.h * ub.h;
+        break;
+    default:
+        ur.h = ua.h / ub.h;
+        break;
+    }
+
+    if (unlikely(isinf(ur.h))) {
+        s->float_exception_flags |= float_flag_overflow;
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) && post(ua.s, ub.s)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft(a, b, s);
+}
+
+/* A tiny sum is exact unless both addends were zero.  */
+static inline bool f32_addsub_post(float32 a, float32 b)
+{
+    return !(float32_is_zero(a) && float32_is_zero(b));
+}
+
+static inline bool f64_addsub_post(float64 a, float64 b)
+{
+    return !(float64_is_zero(a) && float64_is_zero(b));
+}
+
+static inline bool f32_mul_post(float32 a, float32 b)
+{
+    return !(float32_is_zero(a) || float32_is_zero(b));
+}
+
+static inline bool f64_mul_post(float64 a, float64 b)
+{
+    return !(float64_is_zero(a) || float64_is_zero(b));
+}
+
+/* Division by zero must raise divbyzero, so leave it to softfloat.  */
+static inline bool f32_div_pre(float32 a, float32 b)
+{
+    return float32_is_zon(a) && float32_is_zon(b) && !float32_is_zero(b);
+}
+
+static inline bool f64_div_pre(float64 a, float64 b)
+{
+    return float64_is_zon(a) && float64_is_zon(b) && !float64_is_zero(b);
+}
+
+static inline bool f32_div_post(float32 a, float32 b)
+{
+    return !float32_is_zero(a);
+}
+
+static inline bool f64_div_post(float64 a, float64 b)
+{
+    return !float64_is_zero(a);
+}
+
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, 0, soft_float32_add,
+                        f32_is_zon2, f32_addsub_post);
+}
+
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, 1, soft_float32_sub,
+                        f32_is_zon2, f32_addsub_post);
+}
+
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, 2, soft_float32_mul,
+                        f32_is_zon2, f32_mul_post);
+}
+
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    return float32_gen2(a, b, status, 3, soft_float32_div,
+                        f32_div_pre, f32_div_post);
+}
+
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, 0, soft_float64_add,
+                        f64_is_zon2, f64_addsub_post);
+}
+
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, 1, soft_float64_sub,
+                        f64_is_zon2, f64_addsub_post);
+}
+
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, 2, soft_float64_mul,
+                        f64_is_zon2, f64_mul_post);
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    return float64_gen2(a, b, status, 3, soft_float64_div,
+                        f64_div_pre, f64_div_post);
+}
+
+/* The square root of a zero or positive normal number can neither
+ * overflow nor underflow.
+ */
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    union_float32 ua, ur;
+
+    if (unlikely(!can_use_fpu(status))) {
+        return soft_float32_sqrt(a, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    if (unlikely(!float32_is_zon(ua.s) || float32_is_neg(ua.s))) {
+        return soft_float32_sqrt(a, status);
+    }
+    ur.h = sqrtf(ua.h);
+    return ur.s;
+}
+
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    union_float64 ua, ur;
+
+    if (unlikely(!can_use_fpu(status))) {
+        return soft_float64_sqrt(a, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    if (unlikely(!float64_is_zon(ua.s) || float64_is_neg(ua.s))) {
+        return soft_float64_sqrt(a, status);
+    }
+    ur.h = sqrt(ua.h);
+    return ur.s;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary log of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
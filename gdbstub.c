@@ -30,7 +30,7 @@
 #include "exec/gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 16384
 
 #include "qemu/sockets.h"
 #include "sysemu/hw_accel.h"
@@ -1072,19 +1072,23 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         put_packet(s, "OK");
         break;
     case 'm':
+    case 'x': /* binary reply, about half the size of 'm' on the wire */
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
 
-        /* memtohex() doubles the required space */
-        if (len > MAX_PACKET_LENGTH / 2) {
-            put_packet (s, "E22");
-            break;
-        }
+        /* memtohex() doubles the required space, plus the final NUL, and
+         * memtox() at most doubles it after the 'b'; the reply may be
+         * shorter than asked for */
+        len = MIN(len, (MAX_PACKET_LENGTH - 1) / 2);
 
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
             put_packet (s, "E14");
+        } else if (ch == 'x') {
+            buf[0] = 'b';
+            len = memtox(buf + 1, (const char *)mem_buf, len);
+            put_packet_binary(s, buf, len + 1);
         } else {
             memtohex(buf, mem_buf, len);
             put_packet(s, buf);
@@ -1279,7 +1283,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (is_query_packet(p, "Supported", ':')) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, sizeof(buf), "PacketSize=%x;binary-upload+",
+                     MAX_PACKET_LENGTH);
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file != NULL) {
                 pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
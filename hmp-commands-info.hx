@@ -273,6 +273,23 @@ STEXI
 @item info jit
 @findex jit
 Show dynamic compiler info.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "max:i?",
+        .params     = "[max]",
+        .help       = "show the most executed and most expensive TBs",
+        .cmd        = hmp_info_tb_profile,
+    },
+
+STEXI
+@item info tb-profile [@var{max}]
+@findex tb-profile
+Show the @var{max} (default 10) translation blocks with the highest
+execution counts and translation costs, with their guest PC, guest
+instruction count and size, and host code size.  Only blocks translated
+while the @code{tbprofile} log item is enabled are counted.
 ETEXI
 
     {
@@ -557,6 +574,49 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "migrate_iterations",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show statistics of each iteration of the last migration",
+        .cmd        = hmp_info_migrate_iterations,
+    },
+
+STEXI
+@item info migrate_iterations
+@findex migrate_iterations
+Show pages sent, bandwidth, dirty rate, bitmap sync time and vCPU throttle
+for each iteration of the current or last outgoing migration.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last dirty rate measurement",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the result of the last @code{calc_dirty_rate} measurement.
+ETEXI
+
+    {
+        .name       = "vmstate_cost",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the cost of saving or loading each device state",
+        .cmd        = hmp_info_vmstate_cost,
+    },
+
+STEXI
+@item info vmstate_cost
+@findex vmstate_cost
+Show the bytes and time each savevm section took in the last save or load.
 ETEXI
 
     {
@@ -799,6 +859,21 @@ STEXI
 @item info hotpluggable-cpus
 @findex hotpluggable-cpus
 Show information about hotpluggable CPUs
+ETEXI
+
+    {
+        .name       = "stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show metrics in Prometheus text format",
+        .cmd        = hmp_info_stats,
+    },
+
+STEXI
+@item info stats
+@findex stats
+Show the metrics registered by QEMU's subsystems, in the Prometheus text
+exposition format.
 ETEXI
 
 STEXI
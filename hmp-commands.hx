@@ -961,6 +961,23 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "calc_time:i,sample_pages:i?",
+        .params     = "calc_time [sample_pages]",
+        .help       = "start measuring the guest dirty rate over calc_time "
+                      "seconds, sampling sample_pages pages per GiB",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{calc_time} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start estimating how fast the guest dirties its memory over @var{calc_time}
+seconds, without starting a migration.  The result is shown by
+@code{info dirty_rate}.
 ETEXI
 
     {
@@ -245,10 +245,32 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache hit rate: %0.2f\n",
+                       info->xbzrle_cache->cache_hit_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        intList *t;
+
+        monitor_printf(mon, "compression method: %s\n",
+                       MigrationCompressMethod_lookup[info->compression->method]);
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+        monitor_printf(mon, "compression throughput: %0.2f MB/cpu-s\n",
+                       info->compression->throughput);
+        monitor_printf(mon, "compression thread cpu time:");
+        for (t = info->compression->thread_cpu_time; t; t = t->next) {
+            monitor_printf(mon, " %" PRIu64, t->value);
+        }
+        monitor_printf(mon, " milliseconds\n");
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -323,6 +345,30 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        assert(params->has_compress_method);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        assert(params->has_x_postcopy_prefetch_pages);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES],
+            params->x_postcopy_prefetch_pages);
+        assert(params->has_x_load_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_LOAD_THREADS],
+            params->x_load_threads);
+        assert(params->has_x_rdma_pin_limit);
+        monitor_printf(mon, " %s: %" PRId64 " bytes",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_RDMA_PIN_LIMIT],
+            params->x_rdma_pin_limit);
+        assert(params->has_x_block_queue_depth);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH],
+            params->x_block_queue_depth);
         monitor_printf(mon, "\n");
     }
 
@@ -335,6 +381,70 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_iterations(Monitor *mon, const QDict *qdict)
+{
+    MigrationIterationList *list = qmp_query_migrate_iterations(NULL);
+    MigrationIterationList *entry;
+
+    for (entry = list; entry; entry = entry->next) {
+        MigrationIteration *it = entry->value;
+
+        monitor_printf(mon, "%" PRIu64 ": at %" PRId64 " ms, sent %" PRIu64
+                       " pages %" PRIu64 " kbytes (%" PRIu64 " kbytes/s), "
+                       "dirtied %" PRIu64 " pages (%" PRIu64 " pages/s), "
+                       "remaining %" PRIu64 " pages, sync %" PRId64
+                       " us, throttle %d%%\n",
+                       it->iteration, it->time, it->pages, it->bytes >> 10,
+                       it->bandwidth >> 10, it->dirty_pages, it->dirty_rate,
+                       it->remaining, it->sync_time, it->throttle_percentage);
+    }
+
+    qapi_free_MigrationIterationList(list);
+}
+
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+
+    monitor_printf(mon, "status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "start time: %" PRId64 "\n", info->start_time);
+        monitor_printf(mon, "calc time: %" PRId64 " seconds\n",
+                       info->calc_time);
+        monitor_printf(mon, "sample pages: %" PRId64 " per GiB\n",
+                       info->sample_pages);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+        for (block = info->blocks; block; block = block->next) {
+            monitor_printf(mon, "  %s: %" PRId64 " MB/s\n",
+                           block->value->id, block->value->dirty_rate);
+        }
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
+void hmp_info_vmstate_cost(Monitor *mon, const QDict *qdict)
+{
+    VMStateCostList *list = qmp_query_vmstate_cost(NULL);
+    VMStateCostList *entry;
+
+    for (entry = list; entry; entry = entry->next) {
+        VMStateCost *cost = entry->value;
+
+        monitor_printf(mon, "%s/%" PRId64 ": setup %" PRIu64 " bytes %"
+                       PRId64 " us, complete %" PRIu64 " bytes %" PRId64
+                       " us\n", cost->idstr, cost->instance_id,
+                       cost->setup_bytes, cost->setup_time,
+                       cost->complete_bytes, cost->complete_time);
+    }
+
+    qapi_free_VMStateCostList(list);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1303,6 +1413,22 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "calc_time");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, has_sample_pages, sample_pages, &err);
+    if (err) {
+        error_report_err(err);
+        return;
+    }
+    monitor_printf(mon, "Measuring the dirty rate for %" PRId64 " seconds, "
+                   "use 'info dirty_rate' to see the result\n", calc_time);
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
@@ -1401,6 +1527,40 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                p.has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                p.has_compress_method = true;
+                p.compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                break;
+            case MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES:
+                p.has_x_postcopy_prefetch_pages = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_LOAD_THREADS:
+                p.has_x_load_threads = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_RDMA_PIN_LIMIT:
+                p.has_x_rdma_pin_limit = true;
+                valuebw = qemu_strtosz(valuestr, &endp);
+                if (valuebw < 0 || *endp != '\0') {
+                    error_setg(&err, "Invalid size %s", valuestr);
+                    goto cleanup;
+                }
+                p.x_rdma_pin_limit = valuebw;
+                break;
+            case MIGRATION_PARAMETER_X_BLOCK_QUEUE_DEPTH:
+                p.has_x_block_queue_depth = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1418,6 +1578,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.x_multifd_channels = valueint;
+                p.x_postcopy_prefetch_pages = valueint;
+                p.x_load_threads = valueint;
+                p.x_block_queue_depth = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
@@ -2169,6 +2333,49 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_stats(Monitor *mon, const QDict *qdict)
+{
+    StatsInfoList *info_list = qmp_query_stats(NULL);
+    StatsInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        StatsInfo *value = info->value;
+        StatsBucketList *bucket;
+        uint64_t cumulative = 0;
+        char *name, *p;
+
+        /* Prometheus metric names may only contain [a-zA-Z0-9_:] */
+        name = g_strdup_printf("qemu_%s", value->name);
+        for (p = name; *p; p++) {
+            if (!g_ascii_isalnum(*p) && *p != '_') {
+                *p = '_';
+            }
+        }
+
+        monitor_printf(mon, "# HELP %s %s\n", name, value->help);
+        monitor_printf(mon, "# TYPE %s %s\n", name,
+                       StatsType_lookup[value->kind]);
+        if (value->kind == STATS_TYPE_COUNTER) {
+            monitor_printf(mon, "%s %" PRIu64 "\n", name, value->value);
+            g_free(name);
+            continue;
+        }
+
+        for (bucket = value->buckets; bucket; bucket = bucket->next) {
+            cumulative += bucket->value->count;
+            monitor_printf(mon, "%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                           name, bucket->value->le, cumulative);
+        }
+        monitor_printf(mon, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+                       name, value->count);
+        monitor_printf(mon, "%s_sum %" PRIu64 "\n", name, value->value);
+        monitor_printf(mon, "%s_count %" PRIu64 "\n", name, value->count);
+        g_free(name);
+    }
+
+    qapi_free_StatsInfoList(info_list);
+}
+
 void hmp_qom_list(Monitor *mon, const QDict *qdict)
 {
     const char *path = qdict_get_try_str(qdict, "path");
@@ -0,0 +1,206 @@
+/*
+ * 9p attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Caches the result of lstat() per path, including negative (ENOENT)
+ * lookups, so that Twalk/Tgetattr storms don't bounce every component
+ * through the thread pool.  Only path name based backends are supported:
+ * the cache is keyed on the V9fsPath string and invalidated by the
+ * coroutine wrappers whenever a request modifies a path.  Changes made
+ * behind the server's back are picked up once the entry expires.
+ *
+ * All functions are called from the QEMU main thread, outside of the
+ * v9fs_co_run_in_worker() blocks, so no locking is needed.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "9p.h"
+#include "trace.h"
+
+/* Drop everything once that many entries have accumulated */
+#define V9FS_ATTR_CACHE_MAX 16384
+
+typedef struct V9fsAttrCacheEntry {
+    int64_t expires;
+    int err;
+    struct stat stbuf;
+} V9fsAttrCacheEntry;
+
+void v9fs_attr_cache_init(V9fsState *s)
+{
+    if (!s->attr_cache_ttl ||
+        !(s->ctx.export_flags & V9FS_PATHNAME_FSCONTEXT)) {
+        return;
+    }
+    s->attr_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, g_free);
+}
+
+void v9fs_attr_cache_destroy(V9fsState *s)
+{
+    if (s->attr_cache) {
+        g_hash_table_destroy(s->attr_cache);
+        s->attr_cache = NULL;
+    }
+}
+
+void v9fs_attr_cache_flush(V9fsState *s)
+{
+    if (s->attr_cache) {
+        g_hash_table_remove_all(s->attr_cache);
+        s->attr_cache_gen++;
+    }
+}
+
+/*
+ * "a/b/../c" and "a/c" name the same file; rather than canonicalizing,
+ * simply don't cache paths that went through "." or "..".
+ */
+static bool v9fs_attr_cache_path_ok(V9fsPath *path)
+{
+    const char *p = path->data;
+
+    if (!p) {
+        return false;
+    }
+    for (;;) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? end - p : strlen(p);
+
+        if ((len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return false;
+        }
+        if (!end) {
+            return true;
+        }
+        p = end + 1;
+    }
+}
+
+bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                            struct stat *stbuf, int *err)
+{
+    V9fsAttrCacheEntry *e;
+
+    if (!s->attr_cache || !v9fs_attr_cache_path_ok(path)) {
+        return false;
+    }
+    e = g_hash_table_lookup(s->attr_cache, path->data);
+    if (!e) {
+        return false;
+    }
+    if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) >= e->expires) {
+        g_hash_table_remove(s->attr_cache, path->data);
+        return false;
+    }
+    if (!e->err) {
+        *stbuf = e->stbuf;
+    }
+    *err = e->err;
+    trace_v9fs_attr_cache_hit(path->data, e->err);
+    return true;
+}
+
+void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path, uint64_t gen,
+                            const struct stat *stbuf, int err)
+{
+    V9fsAttrCacheEntry *e;
+
+    /* Something was modified while the lstat() was in flight */
+    if (!s->attr_cache || gen != s->attr_cache_gen) {
+        return;
+    }
+    if (err && err != -ENOENT) {
+        return;
+    }
+    /*
+     * Other names of a hard linked file can change its attributes
+     * without us knowing which entries to drop.
+     */
+    if (!err && !S_ISDIR(stbuf->st_mode) && stbuf->st_nlink > 1) {
+        return;
+    }
+    if (!v9fs_attr_cache_path_ok(path)) {
+        return;
+    }
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+
+    e = g_new0(V9fsAttrCacheEntry, 1);
+    e->expires = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                 s->attr_cache_ttl * SCALE_MS;
+    e->err = err;
+    if (!err) {
+        e->stbuf = *stbuf;
+    }
+    g_hash_table_replace(s->attr_cache, g_strdup(path->data), e);
+}
+
+void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path)
+{
+    if (!s->attr_cache) {
+        return;
+    }
+    s->attr_cache_gen++;
+    if (path->data) {
+        g_hash_table_remove(s->attr_cache, path->data);
+    }
+}
+
+static gboolean v9fs_attr_cache_in_tree(gpointer key, gpointer value,
+                                        gpointer opaque)
+{
+    const char *name = key;
+    const char *root = opaque;
+    size_t len = strlen(root);
+
+    return !strncmp(name, root, len) && (!name[len] || name[len] == '/');
+}
+
+void v9fs_attr_cache_invalidate_dirent(V9fsState *s, V9fsPath *path)
+{
+    const char *slash;
+
+    if (!s->attr_cache || !path->data) {
+        return;
+    }
+    s->attr_cache_gen++;
+
+    /* The entry itself and, if it is a directory, everything below it */
+    g_hash_table_foreach_remove(s->attr_cache, v9fs_attr_cache_in_tree,
+                                path->data);
+
+    /* The parent's mtime and link count */
+    slash = strrchr(path->data, '/');
+    if (slash && slash != path->data) {
+        char *parent = g_strndup(path->data, slash - path->data);
+
+        g_hash_table_remove(s->attr_cache, parent);
+        g_free(parent);
+    }
+}
+
+void v9fs_attr_cache_invalidate_name(V9fsState *s, V9fsPath *dirpath,
+                                     const char *name)
+{
+    V9fsPath path;
+
+    if (!s->attr_cache) {
+        return;
+    }
+    s->attr_cache_gen++;
+    g_hash_table_remove(s->attr_cache, dirpath->data);
+
+    v9fs_path_init(&path);
+    if (!v9fs_name_to_path(s, dirpath, name, &path)) {
+        v9fs_attr_cache_invalidate_dirent(s, &path);
+    }
+    v9fs_path_free(&path);
+}
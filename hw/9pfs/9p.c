@@ -537,6 +537,8 @@ static void coroutine_fn virtfs_reset(V9fsPDU *pdu)
     V9fsState *s = pdu->s;
     V9fsFidState *fidp;
 
+    v9fs_attr_cache_flush(s);
+
     /* Free all fids */
     while (s->fid_list) {
         fidp = s->fid_list;
@@ -1859,83 +1861,65 @@ out_nofid:
     pdu_complete(pdu, err);
 }
 
-static size_t v9fs_readdir_data_size(V9fsString *name)
+static void v9fs_free_dirents(V9fsDirEnt *e)
 {
-    /*
-     * Size of each dirent on the wire: size of qid (13) + size of offset (8)
-     * size of type (1) + size of name.size (2) + strlen(name.data)
-     */
-    return 24 + v9fs_string_size(name);
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->name);
+        g_free(e);
+    }
 }
 
 static int coroutine_fn v9fs_do_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
-                                        int32_t max_count)
+                                        off_t offset, int32_t max_count)
 {
     size_t size;
     V9fsQID qid;
     V9fsString name;
-    int len, err = 0;
+    int len, err;
     int32_t count = 0;
-    off_t saved_dir_pos;
-    struct dirent *dent;
+    V9fsDirEnt *entries, *e;
 
-    /* save the directory position */
-    saved_dir_pos = v9fs_co_telldir(pdu, fidp);
-    if (saved_dir_pos < 0) {
-        return saved_dir_pos;
+    /*
+     * Fetch the whole batch in one go rather than bouncing to the
+     * worker thread for every single entry.
+     */
+    err = v9fs_co_readdir_many(pdu, fidp, &entries, offset, max_count);
+    if (err < 0) {
+        goto out;
     }
 
-    while (1) {
-        v9fs_readdir_lock(&fidp->fs.dir);
-
-        err = v9fs_co_readdir(pdu, fidp, &dent);
-        if (err || !dent) {
-            break;
-        }
+    for (e = entries; e; e = e->next) {
         v9fs_string_init(&name);
-        v9fs_string_sprintf(&name, "%s", dent->d_name);
-        if ((count + v9fs_readdir_data_size(&name)) > max_count) {
-            v9fs_readdir_unlock(&fidp->fs.dir);
-
-            /* Ran out of buffer. Set dir back to old position and return */
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            return count;
-        }
+        v9fs_string_sprintf(&name, "%s", e->name);
         /*
          * Fill up just the path field of qid because the client uses
          * only that. To fill the entire qid structure we will have
          * to stat each dirent found, which is expensive
          */
-        size = MIN(sizeof(dent->d_ino), sizeof(qid.path));
-        memcpy(&qid.path, &dent->d_ino, size);
+        size = MIN(sizeof(e->ino), sizeof(qid.path));
+        memcpy(&qid.path, &e->ino, size);
         /* Fill the other fields with dummy values */
         qid.type = 0;
         qid.version = 0;
 
         /* 11 = 7 + 4 (7 = start offset, 4 = space for storing count) */
         len = pdu_marshal(pdu, 11 + count, "Qqbs",
-                          &qid, dent->d_off,
-                          dent->d_type, &name);
-
-        v9fs_readdir_unlock(&fidp->fs.dir);
-
+                          &qid, e->off, e->type, &name);
+        v9fs_string_free(&name);
         if (len < 0) {
-            v9fs_co_seekdir(pdu, fidp, saved_dir_pos);
-            v9fs_string_free(&name);
-            return len;
+            err = len;
+            goto out;
         }
         count += len;
-        v9fs_string_free(&name);
-        saved_dir_pos = dent->d_off;
     }
+    err = count;
 
-    v9fs_readdir_unlock(&fidp->fs.dir);
-
-    if (err < 0) {
-        return err;
-    }
-    return count;
+out:
+    v9fs_free_dirents(entries);
+    return err;
 }
 
 static void coroutine_fn v9fs_readdir(void *opaque)
@@ -1965,12 +1949,7 @@ static void coroutine_fn v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out;
     }
-    if (initial_offset == 0) {
-        v9fs_co_rewinddir(pdu, fidp);
-    } else {
-        v9fs_co_seekdir(pdu, fidp, initial_offset);
-    }
-    count = v9fs_do_readdir(pdu, fidp, max_count);
+    count = v9fs_do_readdir(pdu, fidp, initial_offset, max_count);
     if (count < 0) {
         retval = count;
         goto out;
@@ -3533,6 +3512,8 @@ int v9fs_device_realize_common(V9fsState *s, Error **errp)
     }
     v9fs_path_free(&path);
 
+    v9fs_attr_cache_init(s);
+
     rc = 0;
 out:
     if (rc) {
@@ -3548,6 +3529,7 @@ out:
 
 void v9fs_device_unrealize_common(V9fsState *s, Error **errp)
 {
+    v9fs_attr_cache_destroy(s);
     if (s->ops->cleanup) {
         s->ops->cleanup(&s->ctx);
     }
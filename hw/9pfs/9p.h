@@ -187,6 +187,15 @@ static inline void v9fs_readdir_init(V9fsDir *dir)
     qemu_mutex_init(&dir->readdir_mutex);
 }
 
+/* Directory entries returned by v9fs_co_readdir_many() */
+typedef struct V9fsDirEnt {
+    char *name;
+    ino_t ino;
+    off_t off;
+    uint8_t type;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 /*
  * Filled by fs driver on open and other
  * calls.
@@ -240,6 +249,10 @@ typedef struct V9fsState
     Error *migration_blocker;
     V9fsConf fsconf;
     V9fsQID root_qid;
+    /* lstat() results by path name, see 9p-attr-cache.c */
+    GHashTable *attr_cache;
+    uint64_t attr_cache_gen;
+    uint32_t attr_cache_ttl;
 } V9fsState;
 
 /* 9p2000.L open flags */
@@ -328,6 +341,17 @@ static inline uint8_t v9fs_request_cancelled(V9fsPDU *pdu)
 }
 
 void coroutine_fn v9fs_reclaim_fd(V9fsPDU *pdu);
+void v9fs_attr_cache_init(V9fsState *s);
+void v9fs_attr_cache_destroy(V9fsState *s);
+void v9fs_attr_cache_flush(V9fsState *s);
+bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                            struct stat *stbuf, int *err);
+void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path, uint64_t gen,
+                            const struct stat *stbuf, int err);
+void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path);
+void v9fs_attr_cache_invalidate_dirent(V9fsState *s, V9fsPath *path);
+void v9fs_attr_cache_invalidate_name(V9fsState *s, V9fsPath *dirpath,
+                                     const char *name);
 void v9fs_path_init(V9fsPath *path);
 void v9fs_path_free(V9fsPath *path);
 void v9fs_path_sprintf(V9fsPath *path, const char *fmt, ...);
@@ -42,6 +42,78 @@ int coroutine_fn v9fs_co_readdir(V9fsPDU *pdu, V9fsFidState *fidp,
     return err;
 }
 
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, off_t offset,
+                           int32_t maxsize)
+{
+    V9fsDirEnt **tail = entries;
+    V9fsDirEnt *e;
+    struct dirent *dent;
+    off_t saved_dir_pos;
+    int32_t size = 0, len;
+
+    if (offset == 0) {
+        s->ops->rewinddir(&s->ctx, &fidp->fs);
+    } else {
+        s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+    }
+    saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (saved_dir_pos < 0) {
+        return -errno;
+    }
+
+    while (1) {
+        errno = 0;
+        dent = s->ops->readdir(&s->ctx, &fidp->fs);
+        if (!dent) {
+            return errno ? -errno : size;
+        }
+        /* Size on the wire: qid[13] offset[8] type[1] name[s] */
+        len = 24 + strlen(dent->d_name);
+        if (size + len > maxsize) {
+            /* Ran out of buffer. Set dir back to old position and return */
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            return size;
+        }
+        e = g_new0(V9fsDirEnt, 1);
+        e->name = g_strdup(dent->d_name);
+        e->ino = dent->d_ino;
+        e->off = dent->d_off;
+        e->type = dent->d_type;
+        *tail = e;
+        tail = &e->next;
+
+        size += len;
+        saved_dir_pos = dent->d_off;
+    }
+}
+
+/*
+ * Position the directory stream at @offset and read as many entries as
+ * fit in @maxsize bytes of a Rreaddir reply, all in a single trip to the
+ * worker thread.  The entries are returned in @entries, even on error,
+ * and must be freed by the caller.
+ */
+int coroutine_fn v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                                      V9fsDirEnt **entries,
+                                      off_t offset, int32_t maxsize)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            v9fs_readdir_lock(&fidp->fs.dir);
+            err = do_readdir_many(s, fidp, entries, offset, maxsize);
+            v9fs_readdir_unlock(&fidp->fs.dir);
+        });
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -119,6 +191,7 @@ int coroutine_fn v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate_name(s, &fidp->path, name->data);
     v9fs_path_unlock(s);
     return err;
 }
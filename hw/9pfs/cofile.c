@@ -44,12 +44,18 @@ int coroutine_fn v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int coroutine_fn v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    uint64_t gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
     v9fs_path_read_lock(s);
+    if (v9fs_attr_cache_lookup(s, path, stbuf, &err)) {
+        v9fs_path_unlock(s);
+        return err;
+    }
+    gen = s->attr_cache_gen;
     v9fs_co_run_in_worker(
         {
             err = s->ops->lstat(&s->ctx, path, stbuf);
@@ -57,6 +63,7 @@ int coroutine_fn v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_insert(s, path, gen, stbuf, err);
     v9fs_path_unlock(s);
     return err;
 }
@@ -112,6 +119,9 @@ int coroutine_fn v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
                 err = 0;
             }
         });
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s, &fidp->path);
+    }
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -167,6 +177,12 @@ int coroutine_fn v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp,
                 v9fs_path_free(&path);
             }
         });
+    if (!err) {
+        /* fidp->path now points to the new file */
+        v9fs_attr_cache_invalidate_dirent(s, &fidp->path);
+    } else {
+        v9fs_attr_cache_invalidate_name(s, &fidp->path, name->data);
+    }
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -234,6 +250,8 @@ int coroutine_fn v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &oldfid->path);
+    v9fs_attr_cache_invalidate_name(s, &newdirfid->path, name->data);
     v9fs_path_unlock(s);
     return err;
 }
@@ -254,6 +272,7 @@ int coroutine_fn v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     return err;
 }
 
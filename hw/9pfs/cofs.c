@@ -109,6 +109,7 @@ int coroutine_fn v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -130,6 +131,7 @@ int coroutine_fn v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -155,6 +157,7 @@ int coroutine_fn v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -175,6 +178,7 @@ int coroutine_fn v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -214,6 +218,7 @@ int coroutine_fn v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate_name(s, &fidp->path, name->data);
     v9fs_path_unlock(s);
     return err;
 }
@@ -235,6 +240,7 @@ int coroutine_fn v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate_dirent(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -256,6 +262,7 @@ int coroutine_fn v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate_name(s, path, name->data);
     v9fs_path_unlock(s);
     return err;
 }
@@ -277,6 +284,8 @@ int coroutine_fn v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate_dirent(s, oldpath);
+    v9fs_attr_cache_invalidate_dirent(s, newpath);
     return err;
 }
 
@@ -298,6 +307,8 @@ int coroutine_fn v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate_name(s, olddirpath, oldname->data);
+    v9fs_attr_cache_invalidate_name(s, newdirpath, newname->data);
     return err;
 }
 
@@ -336,6 +347,7 @@ int coroutine_fn v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate_name(s, &dfidp->path, name->data);
     v9fs_path_unlock(s);
     return err;
 }
@@ -217,6 +217,8 @@ static const VMStateDescription vmstate_virtio_9p = {
 static Property virtio_9p_properties[] = {
     DEFINE_PROP_STRING("mount_tag", V9fsVirtioState, state.fsconf.tag),
     DEFINE_PROP_STRING("fsdev", V9fsVirtioState, state.fsconf.fsdev_id),
+    DEFINE_PROP_UINT32("attr_cache_ttl", V9fsVirtioState, state.attr_cache_ttl,
+                       0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
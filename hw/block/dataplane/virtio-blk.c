@@ -40,10 +40,79 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;
+    int nb_iothreads;
+    AioContext *ctx;                /* BlockBackend and notify bh context */
 };
 
+/* Virtqueues are assigned round-robin to the iothreads.  The first one
+ * also runs the BlockBackend; handlers in the others submit requests
+ * directly under its AioContext lock (see virtio_blk_handle_vq()).
+ */
+static AioContext *vq_aio_context(VirtIOBlockDataPlane *s, unsigned i)
+{
+    if (!s->nb_iothreads) {
+        return s->ctx;
+    }
+    return iothread_get_aio_context(s->iothreads[i % s->nb_iothreads]);
+}
+
+static void put_iothreads(VirtIOBlockDataPlane *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
+    s->iothreads = NULL;
+    s->nb_iothreads = 0;
+}
+
+static bool get_iothreads(VirtIOBlockDataPlane *s, VirtIOBlkConf *conf,
+                          Error **errp)
+{
+    char **ids;
+    int i;
+
+    if (conf->iothread) {
+        s->iothreads = g_new(IOThread *, 1);
+        s->iothreads[0] = conf->iothread;
+        object_ref(OBJECT(s->iothreads[0]));
+        s->nb_iothreads = 1;
+        return true;
+    }
+    if (!conf->iothreads) {
+        return true;
+    }
+
+    ids = g_strsplit(conf->iothreads, ":", -1);
+    s->iothreads = g_new(IOThread *, g_strv_length(ids));
+    for (i = 0; ids[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread = (IOThread *)object_dynamic_cast(obj,
+                                                             TYPE_IOTHREAD);
+
+        if (!iothread) {
+            error_setg(errp, "'%s' is not an iothread", ids[i]);
+            g_strfreev(ids);
+            put_iothreads(s);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->iothreads[s->nb_iothreads++] = iothread;
+    }
+    g_strfreev(ids);
+
+    if (!s->nb_iothreads) {
+        error_setg(errp, "iothreads must list at least one iothread");
+        put_iothreads(s);
+        return false;
+    }
+    return true;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
@@ -58,8 +127,13 @@ static void notify_guest_bh(void *opaque)
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
+    /* Requests may complete in other iothreads, which set bits with
+     * our AioContext held.
+     */
+    aio_context_acquire(s->ctx);
     memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
     memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    aio_context_release(s->ctx);
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
         unsigned long bits = bitmap[j];
@@ -86,7 +160,11 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothreads) {
+        error_setg(errp, "iothread and iothreads cannot be used together");
+        return;
+    }
+    if (conf->iothread || conf->iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -115,10 +193,12 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    if (!get_iothreads(s, conf, errp)) {
+        g_free(s);
+        return;
+    }
+    if (s->nb_iothreads) {
+        s->ctx = iothread_get_aio_context(s->iothreads[0]);
     } else {
         s->ctx = qemu_get_aio_context();
     }
@@ -141,9 +221,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
-    }
+    put_iothreads(s);
     g_free(s);
 }
 
@@ -209,14 +287,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = vq_aio_context(s, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -249,15 +328,18 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = vq_aio_context(s, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        aio_context_release(ctx);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
@@ -18,6 +18,10 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * To process the I/O queues in an I/O thread:
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,drive=<drive_id>,serial=<serial>,iothread=<iothread_id>
  */
 
 #include "qemu/osdep.h"
@@ -29,11 +33,18 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "qemu/error-report.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
 
+/* Whether queue @qid is processed in the I/O thread of the controller */
+static bool nvme_queue_in_iothread(NvmeCtrl *n, uint16_t qid)
+{
+    return qid && n->iothread;
+}
+
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
     return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
@@ -68,17 +79,90 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_irq_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (msix_enabled(&(n->parent_obj))) {
+        msix_notify(&(n->parent_obj), cq->vector);
+    } else {
+        pci_irq_pulse(&n->parent_obj);
+    }
+}
+
+static void nvme_cq_notify_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_irq_notify(cq->ctrl, cq);
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
-            msix_notify(&(n->parent_obj), cq->vector);
+        /* Interrupt delivery needs the global mutex, which the I/O thread
+         * cannot take while it holds the AioContext */
+        if (cq->notify_bh) {
+            qemu_bh_schedule(cq->notify_bh);
         } else {
-            pci_irq_pulse(&n->parent_obj);
+            nvme_irq_notify(n, cq);
         }
     }
 }
 
+static void nvme_kick_sq(NvmeSQueue *sq)
+{
+    if (nvme_queue_in_iothread(sq->ctrl, sq->sqid)) {
+        event_notifier_set(&sq->notifier);
+    } else {
+        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+}
+
+/* Refresh the tail of @sq from the shadow doorbell if the guest set up a
+ * doorbell buffer, else from the last MMIO doorbell write. */
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    if (sq->db_addr) {
+        pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &tail, sizeof(tail));
+        tail = le32_to_cpu(tail);
+    } else {
+        tail = atomic_read(&sq->db_tail);
+    }
+    if (tail < sq->size) {
+        sq->tail = tail;
+    }
+}
+
+/* Publish the tail we have seen, so that the guest only rings the MMIO
+ * doorbell once it queues past it. */
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t head, v;
+
+    if (cq->db_addr) {
+        pci_dma_read(&n->parent_obj, cq->db_addr, &head, sizeof(head));
+        head = le32_to_cpu(head);
+        v = cpu_to_le32(head);
+        pci_dma_write(&n->parent_obj, cq->ei_addr, &v, sizeof(v));
+    } else if (nvme_queue_in_iothread(n, cq->cqid)) {
+        head = atomic_read(&cq->db_head);
+    } else {
+        return;
+    }
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -165,6 +249,18 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    bool was_full;
+
+    aio_context_acquire(n->ctx);
+    was_full = nvme_cq_full(cq);
+    nvme_update_cq_head(cq);
+    if (was_full && !nvme_cq_full(cq)) {
+        NvmeSQueue *sq;
+
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            nvme_kick_sq(sq);
+        }
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
@@ -186,6 +282,7 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     nvme_isr_notify(n, cq);
+    aio_context_release(n->ctx);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -203,6 +300,7 @@ static void nvme_rw_cb(void *opaque, int ret)
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
 
+    aio_context_acquire(n->ctx);
     if (!ret) {
         block_acct_done(blk_get_stats(n->conf.blk), &req->acct);
         req->status = NVME_SUCCESS;
@@ -214,6 +312,7 @@ static void nvme_rw_cb(void *opaque, int ret)
         qemu_sglist_destroy(&req->qsg);
     }
     nvme_enqueue_req_completion(cq, req);
+    aio_context_release(n->ctx);
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -292,6 +391,10 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
     timer_free(sq->timer);
+    if (nvme_queue_in_iothread(n, sq->sqid)) {
+        aio_set_event_notifier(n->ctx, &sq->notifier, true, NULL, NULL);
+        event_notifier_cleanup(&sq->notifier);
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -311,6 +414,10 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     }
 
     sq = n->sq[qid];
+    if (nvme_queue_in_iothread(n, qid)) {
+        /* Synchronous cancellation cannot wait for another thread */
+        blk_drain(n->conf.blk);
+    }
     while (!QTAILQ_EMPTY(&sq->out_req_list)) {
         req = QTAILQ_FIRST(&sq->out_req_list);
         assert(req->aiocb);
@@ -333,6 +440,48 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+static void nvme_sq_notifier_read(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/* Busy-polled by the I/O thread: look for new entries without waiting for
+ * a doorbell write.  With a doorbell buffer this only reads guest memory. */
+static bool nvme_sq_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+    NvmeCtrl *n = sq->ctrl;
+    bool progress;
+
+    aio_context_acquire(n->ctx);
+    nvme_update_sq_tail(sq);
+    progress = !nvme_sq_empty(sq) && !QTAILQ_EMPTY(&sq->req_list);
+    if (progress) {
+        nvme_process_sq(sq);
+    }
+    aio_context_release(n->ctx);
+    return progress;
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    /* Doorbell stride is 4 bytes: the SQ tail comes first, then the CQ
+     * head of the same queue pair */
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+}
+
 static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t sqid, uint16_t cqid, uint16_t size)
 {
@@ -344,7 +493,8 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->sqid = sqid;
     sq->size = size;
     sq->cqid = cqid;
-    sq->head = sq->tail = 0;
+    sq->head = sq->tail = sq->db_tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -353,12 +503,29 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (nvme_queue_in_iothread(n, sqid)) {
+        sq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_process_sq, sq);
+    } else {
+        sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    }
+
+    /* Only I/O queues use the doorbell buffer; the guest keeps ringing
+     * the admin queue doorbells */
+    if (sqid && n->dbbuf_dbs) {
+        nvme_init_sq_dbbuf(sq, n);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (nvme_queue_in_iothread(n, sqid)) {
+        event_notifier_init(&sq->notifier, 0);
+        aio_set_event_notifier(n->ctx, &sq->notifier, true,
+                               nvme_sq_notifier_read, nvme_sq_poll);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -397,6 +564,10 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    if (cq->notify_bh) {
+        qemu_bh_delete(cq->notify_bh);
+        cq->notify_bh = NULL;
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -431,12 +602,23 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->phase = 1;
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
-    cq->head = cq->tail = 0;
+    cq->head = cq->tail = cq->db_head = 0;
+    cq->db_addr = cq->ei_addr = 0;
+    if (cqid && n->dbbuf_dbs) {
+        nvme_init_cq_dbbuf(cq, n);
+    }
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (nvme_queue_in_iothread(n, cqid)) {
+        cq->timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  nvme_post_cqes, cq);
+        cq->notify_bh = qemu_bh_new(nvme_cq_notify_bh, cq);
+    } else {
+        cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+        cq->notify_bh = NULL;
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -577,6 +759,31 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    /* Both buffers are one page, page aligned */
+    if (!dbs_addr || !eis_addr ||
+        (dbs_addr | eis_addr) & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i], n);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i], n);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -594,6 +801,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DB_BUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -610,30 +819,52 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
-
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    aio_context_acquire(n->ctx);
+    nvme_update_sq_tail(sq);
+    for (;;) {
+        while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+            pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmd.cid;
+
+            status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
+                nvme_admin_cmd(n, &cmd, req);
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
+        }
+
+        if (!sq->db_addr) {
+            break;
+        }
+
+        /* The guest skips the doorbell write for entries queued before
+         * it sees the new EventIdx, so look at the shadow doorbell again
+         * once it is visible. */
+        nvme_update_sq_eventidx(sq);
+        smp_mb(); /* EventIdx write before the shadow doorbell read */
+        nvme_update_sq_tail(sq);
+        if (nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list)) {
+            break;
         }
     }
+    aio_context_release(n->ctx);
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    aio_context_acquire(n->ctx);
+    blk_drain(n->conf.blk);
+
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -646,6 +877,8 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     }
 
     blk_flush(n->conf.blk);
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    aio_context_release(n->ctx);
     n->bar.cc = 0;
 }
 
@@ -774,6 +1007,13 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
+        if (nvme_queue_in_iothread(n, qid)) {
+            /* nvme_post_cqes picks up the new head in the I/O thread */
+            atomic_set(&cq->db_head, new_head);
+            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+            return;
+        }
+
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
         if (start_sqs) {
@@ -801,8 +1041,8 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        atomic_set(&sq->db_tail, new_tail);
+        nvme_kick_sq(sq);
     }
 }
 
@@ -852,6 +1092,21 @@ static int nvme_init(PCIDevice *pci_dev)
     blkconf_blocksizes(&n->conf);
     blkconf_apply_backend_options(&n->conf);
 
+    if (n->iothread) {
+        Error *local_err = NULL;
+
+        if (blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE,
+                              &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+        object_ref(OBJECT(n->iothread));
+        n->ctx = iothread_get_aio_context(n->iothread);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -883,7 +1138,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -933,6 +1188,13 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->cq);
     g_free(n->sq);
     msix_uninit_exclusive_bar(pci_dev);
+
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+        aio_context_release(n->ctx);
+        object_unref(OBJECT(n->iothread));
+    }
 }
 
 static Property nvme_props[] = {
@@ -972,6 +1234,10 @@ static void nvme_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
 static const TypeInfo nvme_info = {
@@ -36,7 +36,9 @@
 
 static int batch_maps   = 0;
 
-static int max_requests = 32;
+/* Largest shared ring we accept, in log2 pages (the "ring-page-order"
+ * extension of the blkif protocol) */
+#define MAX_RING_PAGE_ORDER 4
 
 /* ------------------------------------------------------------- */
 
@@ -94,7 +96,8 @@ struct XenBlkDev {
     bool                directiosafe;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
+    unsigned int        ring_ref[1 << MAX_RING_PAGE_ORDER];
+    unsigned int        nr_ring_ref;
     void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
@@ -102,6 +105,7 @@ struct XenBlkDev {
     blkif_back_rings_t  rings;
     int                 more_work;
     int                 cnt_map;
+    int                 max_requests;
 
     /* request lists */
     QLIST_HEAD(inflight_head, ioreq) inflight;
@@ -199,7 +203,7 @@ static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
     struct ioreq *ioreq = NULL;
 
     if (QLIST_EMPTY(&blkdev->freelist)) {
-        if (blkdev->requests_total >= max_requests) {
+        if (blkdev->requests_total >= blkdev->max_requests) {
             goto out;
         }
         /* allocate new struct */
@@ -863,6 +867,8 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
     xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
     blk_send_response_all(blkdev);
+    /* Let the block layer submit everything we find on the ring at once */
+    blk_io_plug(blkdev->blk);
     while (rc != rp) {
         /* pull request from ring */
         if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc)) {
@@ -904,8 +910,9 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
         ioreq_runio_qemu_aio(ioreq);
     }
+    blk_io_unplug(blkdev->blk);
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
+    if (blkdev->more_work && blkdev->requests_inflight < blkdev->max_requests) {
         qemu_bh_schedule(blkdev->bh);
     }
 }
@@ -938,11 +945,6 @@ static void blk_alloc(struct XenDevice *xendev)
     if (xen_mode != XEN_EMULATE) {
         batch_maps = 1;
     }
-    if (xengnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
-        xen_pv_printf(xendev, 0, "xengnttab_set_max_grants failed: %s\n",
-                      strerror(errno));
-    }
 }
 
 static void blk_parse_discard(struct XenBlkDev *blkdev)
@@ -1028,6 +1030,8 @@ static int blk_init(struct XenDevice *xendev)
      */
     xenstore_write_be_int(&blkdev->xendev, "feature-flush-cache", 1);
     xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          MAX_RING_PAGE_ORDER);
     xenstore_write_be_int(&blkdev->xendev, "info", info);
 
     blk_parse_discard(blkdev);
@@ -1054,7 +1058,8 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-    int pers, index, qflags;
+    int pers, index, qflags, order, ref;
+    unsigned int ring_size, i;
     bool readonly = true;
     bool writethrough = true;
 
@@ -1131,7 +1136,27 @@ static int blk_connect(struct XenDevice *xendev)
     xenstore_write_be_int64(&blkdev->xendev, "sectors",
                             blkdev->file_size / blkdev->file_blk);
 
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order", &order)) {
+        /* Single page ring, named ring-ref */
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &ref) == -1) {
+            return -1;
+        }
+        blkdev->nr_ring_ref = 1;
+        blkdev->ring_ref[0] = ref;
+    } else if (order >= 0 && order <= MAX_RING_PAGE_ORDER) {
+        blkdev->nr_ring_ref = 1 << order;
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char *key = g_strdup_printf("ring-ref%u", i);
+            int rc = xenstore_read_fe_int(&blkdev->xendev, key, &ref);
+
+            g_free(key);
+            if (rc == -1) {
+                return -1;
+            }
+            blkdev->ring_ref[i] = ref;
+        }
+    } else {
+        xen_pv_printf(xendev, 0, "invalid ring-page-order: %d\n", order);
         return -1;
     }
     if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
@@ -1156,41 +1181,59 @@ static int blk_connect(struct XenDevice *xendev)
         blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     }
 
-    blkdev->sring = xengnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-                                            blkdev->xendev.dom,
-                                            blkdev->ring_ref,
-                                            PROT_READ | PROT_WRITE);
+    ring_size = XC_PAGE_SIZE * blkdev->nr_ring_ref;
+    /* Enough requests to keep the whole ring in flight */
+    blkdev->max_requests = __CONST_RING_SIZE(blkif, ring_size);
+
+    if (xengnttab_set_max_grants(xendev->gnttabdev,
+            MAX_GRANTS(blkdev->max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST) +
+            blkdev->nr_ring_ref) < 0) {
+        xen_pv_printf(xendev, 0, "xengnttab_set_max_grants failed: %s\n",
+                      strerror(errno));
+    }
+
+    if (blkdev->nr_ring_ref == 1) {
+        blkdev->sring = xengnttab_map_grant_ref(blkdev->xendev.gnttabdev,
+                                                blkdev->xendev.dom,
+                                                blkdev->ring_ref[0],
+                                                PROT_READ | PROT_WRITE);
+    } else {
+        blkdev->sring = xengnttab_map_domain_grant_refs(
+            blkdev->xendev.gnttabdev, blkdev->nr_ring_ref, blkdev->xendev.dom,
+            blkdev->ring_ref, PROT_READ | PROT_WRITE);
+    }
     if (!blkdev->sring) {
         return -1;
     }
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_ref;
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
         blkif_sring_t *sring_native = blkdev->sring;
-        BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.native, sring_native, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
         blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
         blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, ring_size);
         break;
     }
     }
 
     if (blkdev->feature_persistent) {
         /* Init persistent grants */
-        blkdev->max_grants = max_requests * BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->max_grants = blkdev->max_requests *
+                             BLKIF_MAX_SEGMENTS_PER_REQUEST;
         blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
                                              NULL, NULL,
                                              batch_maps ?
@@ -1208,9 +1251,9 @@ static int blk_connect(struct XenDevice *xendev)
     xen_pv_printf(&blkdev->xendev, 3, "grant copy operation %s\n",
                   blkdev->feature_grant_copy ? "enabled" : "disabled");
 
-    xen_pv_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
+    xen_pv_printf(&blkdev->xendev, 1, "ok: proto %s, nr-ring-ref %u, "
                   "remote port %d, local port %d\n",
-                  blkdev->xendev.protocol, blkdev->ring_ref,
+                  blkdev->xendev.protocol, blkdev->nr_ring_ref,
                   blkdev->xendev.remote_port, blkdev->xendev.local_port);
     return 0;
 }
@@ -1227,8 +1270,9 @@ static void blk_disconnect(struct XenDevice *xendev)
     xen_pv_unbind_evtchn(&blkdev->xendev);
 
     if (blkdev->sring) {
-        xengnttab_unmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-        blkdev->cnt_map--;
+        xengnttab_unmap(blkdev->xendev.gnttabdev, blkdev->sring,
+                        blkdev->nr_ring_ref);
+        blkdev->cnt_map -= blkdev->nr_ring_ref;
         blkdev->sring = NULL;
     }
 
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "sysemu/char.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "trace.h"
 #include "hw/virtio/virtio-serial.h"
 #include "qapi-event.h"
@@ -42,20 +43,10 @@ static gboolean chr_write_unblocked(GIOChannel *chan, GIOCondition cond,
     return FALSE;
 }
 
-/* Callback function that's called when the guest sends us data */
-static ssize_t flush_buf(VirtIOSerialPort *port,
-                         const uint8_t *buf, ssize_t len)
+/* Throttle the port if the backend took less than @len bytes */
+static ssize_t flush_done(VirtIOSerialPort *port, ssize_t len, ssize_t ret)
 {
     VirtConsole *vcon = VIRTIO_CONSOLE(port);
-    ssize_t ret;
-
-    if (!qemu_chr_fe_get_driver(&vcon->chr)) {
-        /* If there's no backend, we can just say we consumed all data. */
-        return len;
-    }
-
-    ret = qemu_chr_fe_write(&vcon->chr, buf, len);
-    trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < len) {
         VirtIOSerialPortClass *k = VIRTIO_SERIAL_PORT_GET_CLASS(port);
@@ -101,6 +92,42 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
     return ret;
 }
 
+/* Callback function that's called when the guest sends us data */
+static ssize_t flush_buf(VirtIOSerialPort *port,
+                         const uint8_t *buf, ssize_t len)
+{
+    VirtConsole *vcon = VIRTIO_CONSOLE(port);
+    ssize_t ret;
+
+    if (!qemu_chr_fe_get_driver(&vcon->chr)) {
+        /* If there's no backend, we can just say we consumed all data. */
+        return len;
+    }
+
+    ret = qemu_chr_fe_write(&vcon->chr, buf, len);
+    trace_virtio_console_flush_buf(port->id, len, ret);
+
+    return flush_done(port, len, ret);
+}
+
+/* Same as flush_buf, for a whole guest buffer at once */
+static ssize_t flush_iov(VirtIOSerialPort *port,
+                         const struct iovec *iov, int iovcnt)
+{
+    VirtConsole *vcon = VIRTIO_CONSOLE(port);
+    ssize_t len = iov_size(iov, iovcnt);
+    ssize_t ret;
+
+    if (!qemu_chr_fe_get_driver(&vcon->chr)) {
+        return len;
+    }
+
+    ret = qemu_chr_fe_writev(&vcon->chr, iov, iovcnt);
+    trace_virtio_console_flush_buf(port->id, len, ret);
+
+    return flush_done(port, len, ret);
+}
+
 /* Callback function that's called when the guest opens/closes the port */
 static void set_guest_connected(VirtIOSerialPort *port, int guest_connected)
 {
@@ -232,6 +259,7 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     k->realize = virtconsole_realize;
     k->unrealize = virtconsole_unrealize;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->set_guest_connected = set_guest_connected;
     k->guest_writable = guest_writable;
     dc->props = virtserialport_properties;
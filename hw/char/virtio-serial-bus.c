@@ -154,6 +154,69 @@ static void discard_throttle_data(VirtIOSerialPort *port)
     }
 }
 
+static void flush_elem(VirtIOSerialPort *port, VirtIOSerialPortClass *vsc)
+{
+    unsigned int i;
+
+    for (i = port->iov_idx; i < port->elem->out_num; i++) {
+        size_t buf_size;
+        ssize_t ret;
+
+        buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
+        ret = vsc->have_data(port,
+                              port->elem->out_sg[i].iov_base
+                              + port->iov_offset,
+                              buf_size);
+        if (port->throttled) {
+            port->iov_idx = i;
+            if (ret > 0) {
+                port->iov_offset += ret;
+            }
+            break;
+        }
+        port->iov_offset = 0;
+    }
+}
+
+/* Pass the unsent part of port->elem to the port in a single call */
+static void flush_elem_iov(VirtIOSerialPort *port,
+                           VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elem = port->elem;
+    unsigned int cnt = elem->out_num - port->iov_idx;
+    struct iovec *iov;
+    size_t len;
+    ssize_t ret;
+
+    if (!cnt) {
+        return;
+    }
+
+    iov = g_new(struct iovec, cnt);
+    len = iov_size(elem->out_sg + port->iov_idx, cnt) - port->iov_offset;
+    cnt = iov_copy(iov, cnt, elem->out_sg + port->iov_idx, cnt,
+                   port->iov_offset, len);
+    ret = vsc->have_data_iov(port, iov, cnt);
+    g_free(iov);
+
+    if (!port->throttled || ret <= 0) {
+        return;
+    }
+
+    /* Resume after the consumed bytes once the port is unthrottled */
+    while (port->iov_idx < elem->out_num) {
+        size_t left = elem->out_sg[port->iov_idx].iov_len - port->iov_offset;
+
+        if (ret < left) {
+            port->iov_offset += ret;
+            break;
+        }
+        ret -= left;
+        port->iov_idx++;
+        port->iov_offset = 0;
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -165,8 +228,6 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
     vsc = VIRTIO_SERIAL_PORT_GET_CLASS(port);
 
     while (!port->throttled) {
-        unsigned int i;
-
         /* Pop an elem only if we haven't left off a previous one mid-way */
         if (!port->elem) {
             port->elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -177,23 +238,10 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem->out_num; i++) {
-            size_t buf_size;
-            ssize_t ret;
-
-            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
-            ret = vsc->have_data(port,
-                                  port->elem->out_sg[i].iov_base
-                                  + port->iov_offset,
-                                  buf_size);
-            if (port->throttled) {
-                port->iov_idx = i;
-                if (ret > 0) {
-                    port->iov_offset += ret;
-                }
-                break;
-            }
-            port->iov_offset = 0;
+        if (vsc->have_data_iov) {
+            flush_elem_iov(port, vsc);
+        } else {
+            flush_elem(port, vsc);
         }
         if (port->throttled) {
             break;
@@ -691,7 +739,7 @@ static void virtio_serial_save_device(VirtIODevice *vdev, QEMUFile *f)
         if (elem_popped) {
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
-            qemu_put_virtqueue_element(f, port->elem);
+            qemu_put_virtqueue_element(vdev, f, port->elem);
         }
     }
 }
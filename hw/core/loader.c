@@ -118,6 +118,27 @@ ssize_t load_image_size(const char *filename, void *addr, size_t size)
     return actsize;
 }
 
+void *load_image_mapped(const char *filename, size_t *size, Error **errp)
+{
+    GMappedFile *mapping;
+    GError *gerr = NULL;
+
+    mapping = g_mapped_file_new(filename, false, &gerr);
+    if (!mapping) {
+        error_setg(errp, "%s", gerr->message);
+        g_error_free(gerr);
+        return NULL;
+    }
+
+    *size = g_mapped_file_get_length(mapping);
+    if (!*size) {
+        /* Empty files have no mapping */
+        g_mapped_file_unref(mapping);
+        return g_malloc0(1);
+    }
+    return g_mapped_file_get_contents(mapping);
+}
+
 /* read()-like version */
 ssize_t read_targphys(const char *name,
                       int fd, hwaddr dst_addr, size_t nbytes)
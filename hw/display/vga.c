@@ -1449,6 +1449,28 @@ void vga_dirty_log_stop(VGACommonState *s)
     memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
 }
 
+/*
+ * Convert display lines [y, y + h) of a linear framebuffer in one go.
+ * pixman has SIMD paths for the common formats, and it avoids the
+ * function call per line.
+ */
+static void vga_convert_lines(VGACommonState *s, DisplaySurface *surface,
+                              pixman_image_t *src, int y, int h, int width)
+{
+    uint8_t *d;
+    int i;
+
+    pixman_image_composite(PIXMAN_OP_SRC, src, NULL, surface->image,
+                           0, y, 0, 0, 0, y, width, h);
+    if (s->cursor_draw_line) {
+        d = surface_data(surface) + y * surface_stride(surface);
+        for (i = y; i < y + h; i++) {
+            s->cursor_draw_line(s, d, i);
+            d += surface_stride(surface);
+        }
+    }
+}
+
 /*
  * graphic modes
  */
@@ -1457,13 +1479,15 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     DisplaySurface *surface = qemu_console_surface(s->con);
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
     int width, height, shift_control, line_offset, bwidth, bits;
-    ram_addr_t page0, page1, page_min, page_max;
+    ram_addr_t page0, page1, region_start, region_end;
     int disp_width, multi_scan, multi_run;
     uint8_t *d;
     uint32_t v, addr1, addr;
     vga_draw_line_func *vga_draw_line = NULL;
-    bool share_surface;
+    bool share_surface, linear;
     pixman_format_code_t format;
+    pixman_image_t *src = NULL;
+    DirtyBitmapSnapshot *snap;
 #ifdef HOST_WORDS_BIGENDIAN
     bool byteswap = !s->big_endian_fb;
 #else
@@ -1616,9 +1640,32 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+
+    /*
+     * Without CGA addressing, line compare or repeated lines, scanlines
+     * follow each other at line_offset: only that range of vram needs
+     * to be looked at, and the lines can be converted in runs.
+     */
+    region_start = addr1;
+    region_end = addr1 + (ram_addr_t)line_offset * (height - 1) + bwidth;
+    linear = (s->cr[VGA_CRTC_MODE] & 3) == 3 && !multi_scan &&
+             s->line_compare >= height && region_end <= s->vram_size;
+    if (!linear) {
+        region_start = 0;
+        region_end = s->vram_size;
+    }
+    snap = memory_region_snapshot_and_clear_dirty(&s->vram, region_start,
+                                                  region_end - region_start,
+                                                  DIRTY_MEMORY_VGA);
+
+    if (linear && format && !share_surface && bits >= 15 &&
+        !(line_offset & 3)) {
+        src = pixman_image_create_bits(format, width, height,
+                                       (uint32_t *)(s->vram_ptr + addr1),
+                                       line_offset);
+    }
+
     y_start = -1;
-    page_min = -1;
-    page_max = 0;
     d = surface_data(surface);
     linesize = surface_stride(surface);
     y1 = 0;
@@ -1636,24 +1683,26 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         update = full_update;
         page0 = addr;
         page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
+        if (page0 >= region_start && page1 < region_end) {
+            update |= memory_region_snapshot_get_dirty(&s->vram, snap, page0,
+                                                       page1 - page0);
+        }
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
         if (update) {
             if (y_start < 0)
                 y_start = y;
-            if (page0 < page_min)
-                page_min = page0;
-            if (page1 > page_max)
-                page_max = page1;
-            if (!(is_buffer_shared(surface))) {
+            if (!(is_buffer_shared(surface)) && !src) {
                 vga_draw_line(s, d, s->vram_ptr + addr, width);
                 if (s->cursor_draw_line)
                     s->cursor_draw_line(s, d, y);
             }
         } else {
             if (y_start >= 0) {
+                if (src) {
+                    vga_convert_lines(s, surface, src, y_start, y - y_start,
+                                      width);
+                }
                 /* flush to display */
                 dpy_gfx_update(s->con, 0, y_start,
                                disp_width, y - y_start);
@@ -1675,17 +1724,17 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         d += linesize;
     }
     if (y_start >= 0) {
+        if (src) {
+            vga_convert_lines(s, surface, src, y_start, y - y_start, width);
+        }
         /* flush to display */
         dpy_gfx_update(s->con, 0, y_start,
                        disp_width, y - y_start);
     }
-    /* reset modified pages */
-    if (page_max >= page_min) {
-        memory_region_reset_dirty(&s->vram,
-                                  page_min,
-                                  page_max - page_min,
-                                  DIRTY_MEMORY_VGA);
+    if (src) {
+        pixman_image_unref(src);
     }
+    g_free(snap);
     memset(s->invalidated_y_table, 0, ((height + 31) >> 5) * 4);
 }
 
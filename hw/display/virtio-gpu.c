@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "qemu/log.h"
+#include "qemu/error-report.h"
 #include "qapi/error.h"
 
 #define VIRTIO_GPU_VM_VERSION 1
@@ -29,6 +30,8 @@ static struct virtio_gpu_simple_resource*
 virtio_gpu_find_resource(VirtIOGPU *g, uint32_t resource_id);
 
 static void virtio_gpu_cleanup_mapping(struct virtio_gpu_simple_resource *res);
+static void virtio_gpu_resource_unshare(VirtIOGPU *g,
+                                        struct virtio_gpu_simple_resource *res);
 
 #ifdef CONFIG_VIRGL
 #include <virglrenderer.h>
@@ -365,6 +368,10 @@ static void virtio_gpu_resource_create_2d(VirtIOGPU *g,
 static void virtio_gpu_resource_destroy(VirtIOGPU *g,
                                         struct virtio_gpu_simple_resource *res)
 {
+    if (res->zero_copy && res->scanout_bitmask) {
+        /* the scanout surfaces may outlive the backing */
+        virtio_gpu_resource_unshare(g, res);
+    }
     pixman_image_unref(res->image);
     virtio_gpu_cleanup_mapping(res);
     QTAILQ_REMOVE(&g->reslist, res, next);
@@ -429,23 +436,40 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
     format = pixman_image_get_format(res->image);
     bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
     stride = pixman_image_get_stride(res->image);
+    dst_offset = t2d.r.y * stride + t2d.r.x * bpp;
+
+    if (res->zero_copy) {
+        if (t2d.offset == dst_offset) {
+            /* the pixels are already in place */
+            return;
+        }
+        virtio_gpu_resource_unshare(g, res);
+    }
+
+    if (t2d.r.x || t2d.r.width != pixman_image_get_width(res->image)) {
+        uint8_t *img_data = (uint8_t *)pixman_image_get_data(res->image);
+        struct iovec *iov = res->iov;
+        unsigned int iov_cnt = res->iov_cnt;
+        size_t iov_offset = 0;
 
-    if (t2d.offset || t2d.r.x || t2d.r.y ||
-        t2d.r.width != pixman_image_get_width(res->image)) {
-        void *img_data = pixman_image_get_data(res->image);
         for (h = 0; h < t2d.r.height; h++) {
             src_offset = t2d.offset + stride * h;
-            dst_offset = (t2d.r.y + h) * stride + (t2d.r.x * bpp);
 
-            iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                       (uint8_t *)img_data
-                       + dst_offset, t2d.r.width * bpp);
+            /* rows only move forward, don't rescan the iovec for each */
+            while (iov_cnt > 1 && src_offset >= iov_offset + iov->iov_len) {
+                iov_offset += iov->iov_len;
+                iov++;
+                iov_cnt--;
+            }
+            iov_to_buf(iov, iov_cnt, src_offset - iov_offset,
+                       img_data + dst_offset + stride * h,
+                       t2d.r.width * bpp);
         }
     } else {
-        iov_to_buf(res->iov, res->iov_cnt, 0,
-                   pixman_image_get_data(res->image),
-                   pixman_image_get_stride(res->image)
-                   * pixman_image_get_height(res->image));
+        /* full rows are contiguous on both sides */
+        iov_to_buf(res->iov, res->iov_cnt, t2d.offset,
+                   (uint8_t *)pixman_image_get_data(res->image) + dst_offset,
+                   stride * t2d.r.height);
     }
 }
 
@@ -519,14 +543,135 @@ static void virtio_unref_resource(pixman_image_t *image, void *data)
     pixman_image_unref(data);
 }
 
+/* Point the surface of a scanout at the rectangle @r of @res */
+static bool virtio_gpu_scanout_surface(VirtIOGPU *g, uint32_t scanout_id,
+                                       struct virtio_gpu_simple_resource *res,
+                                       struct virtio_gpu_rect *r)
+{
+    struct virtio_gpu_scanout *scanout = &g->scanout[scanout_id];
+    pixman_format_code_t format;
+    uint32_t offset;
+    int bpp;
+
+    format = pixman_image_get_format(res->image);
+    bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
+    offset = (r->x * bpp) + r->y * pixman_image_get_stride(res->image);
+    if (!scanout->ds || surface_data(scanout->ds)
+        != ((uint8_t *)pixman_image_get_data(res->image) + offset) ||
+        scanout->width != r->width ||
+        scanout->height != r->height) {
+        pixman_image_t *rect;
+        void *ptr = (uint8_t *)pixman_image_get_data(res->image) + offset;
+        rect = pixman_image_create_bits(format, r->width, r->height, ptr,
+                                        pixman_image_get_stride(res->image));
+        pixman_image_ref(res->image);
+        pixman_image_set_destroy_function(rect, virtio_unref_resource,
+                                          res->image);
+        /* realloc the surface ptr */
+        scanout->ds = qemu_create_displaysurface_pixman(rect);
+        if (!scanout->ds) {
+            return false;
+        }
+        pixman_image_unref(rect);
+        dpy_gfx_replace_surface(scanout->con, scanout->ds);
+    }
+    return true;
+}
+
+/*
+ * If the backing of a resource is a single host-contiguous range of
+ * guest RAM laid out like the host image, use it as the image: transfers
+ * then need no copy at all, and scanouts read the guest pixels directly.
+ */
+static void virtio_gpu_resource_share(VirtIOGPU *g,
+                                      struct virtio_gpu_simple_resource *res)
+{
+    pixman_format_code_t format = pixman_image_get_format(res->image);
+    uint32_t stride = pixman_image_get_stride(res->image);
+    size_t size = (size_t)stride * res->height;
+    uint8_t *base;
+    pixman_image_t *image;
+    size_t len = 0;
+    int i;
+
+    if (!res->iov_cnt) {
+        return;
+    }
+    base = res->iov[0].iov_base;
+    if (res->scanout_bitmask || ((uintptr_t)base & 3) ||
+        qemu_ram_addr_from_host(base) == RAM_ADDR_INVALID) {
+        return;
+    }
+    for (i = 0; i < res->iov_cnt && len < size; i++) {
+        if (res->iov[i].iov_base != base + len) {
+            return;
+        }
+        len += res->iov[i].iov_len;
+    }
+    if (len < size) {
+        return;
+    }
+
+    image = pixman_image_create_bits(format, res->width, res->height,
+                                     (uint32_t *)base, stride);
+    if (!image) {
+        return;
+    }
+    pixman_image_unref(res->image);
+    res->image = image;
+    res->zero_copy = true;
+    trace_virtio_gpu_res_zero_copy(res->resource_id, true);
+}
+
+static void virtio_gpu_free_image_data(pixman_image_t *image, void *data)
+{
+    g_free(data);
+}
+
+/* Give the resource its own host image again, e.g. before detaching */
+static void virtio_gpu_resource_unshare(VirtIOGPU *g,
+                                        struct virtio_gpu_simple_resource *res)
+{
+    pixman_format_code_t format = pixman_image_get_format(res->image);
+    uint32_t stride = pixman_image_get_stride(res->image);
+    pixman_image_t *image;
+    void *data;
+    int i;
+
+    data = g_memdup(pixman_image_get_data(res->image),
+                    (size_t)stride * res->height);
+    image = pixman_image_create_bits(format, res->width, res->height,
+                                     data, stride);
+    pixman_image_set_destroy_function(image, virtio_gpu_free_image_data,
+                                      data);
+    pixman_image_unref(res->image);
+    res->image = image;
+    res->zero_copy = false;
+    trace_virtio_gpu_res_zero_copy(res->resource_id, false);
+
+    for (i = 0; i < g->conf.max_outputs; i++) {
+        struct virtio_gpu_scanout *scanout = &g->scanout[i];
+        struct virtio_gpu_rect r;
+
+        if (!(res->scanout_bitmask & (1 << i)) ||
+            scanout->resource_id != res->resource_id) {
+            continue;
+        }
+        r.x = scanout->x;
+        r.y = scanout->y;
+        r.width = scanout->width;
+        r.height = scanout->height;
+        if (!virtio_gpu_scanout_surface(g, i, res, &r)) {
+            error_report("virtio-gpu: cannot update scanout %d", i);
+        }
+    }
+}
+
 static void virtio_gpu_set_scanout(VirtIOGPU *g,
                                    struct virtio_gpu_ctrl_command *cmd)
 {
     struct virtio_gpu_simple_resource *res;
     struct virtio_gpu_scanout *scanout;
-    pixman_format_code_t format;
-    uint32_t offset;
-    int bpp;
     struct virtio_gpu_set_scanout ss;
 
     VIRTIO_GPU_FILL_CMD(ss);
@@ -588,28 +733,9 @@ static void virtio_gpu_set_scanout(VirtIOGPU *g,
 
     scanout = &g->scanout[ss.scanout_id];
 
-    format = pixman_image_get_format(res->image);
-    bpp = (PIXMAN_FORMAT_BPP(format) + 7) / 8;
-    offset = (ss.r.x * bpp) + ss.r.y * pixman_image_get_stride(res->image);
-    if (!scanout->ds || surface_data(scanout->ds)
-        != ((uint8_t *)pixman_image_get_data(res->image) + offset) ||
-        scanout->width != ss.r.width ||
-        scanout->height != ss.r.height) {
-        pixman_image_t *rect;
-        void *ptr = (uint8_t *)pixman_image_get_data(res->image) + offset;
-        rect = pixman_image_create_bits(format, ss.r.width, ss.r.height, ptr,
-                                        pixman_image_get_stride(res->image));
-        pixman_image_ref(res->image);
-        pixman_image_set_destroy_function(rect, virtio_unref_resource,
-                                          res->image);
-        /* realloc the surface ptr */
-        scanout->ds = qemu_create_displaysurface_pixman(rect);
-        if (!scanout->ds) {
-            cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-            return;
-        }
-        pixman_image_unref(rect);
-        dpy_gfx_replace_surface(g->scanout[ss.scanout_id].con, scanout->ds);
+    if (!virtio_gpu_scanout_surface(g, ss.scanout_id, res, &ss.r)) {
+        cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        return;
     }
 
     res->scanout_bitmask |= (1 << ss.scanout_id);
@@ -727,6 +853,7 @@ virtio_gpu_resource_attach_backing(VirtIOGPU *g,
     }
 
     res->iov_cnt = ab.nr_entries;
+    virtio_gpu_resource_share(g, res);
 }
 
 static void
@@ -746,6 +873,9 @@ virtio_gpu_resource_detach_backing(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
         return;
     }
+    if (res->zero_copy) {
+        virtio_gpu_resource_unshare(g, res);
+    }
     virtio_gpu_cleanup_mapping(res);
 }
 
@@ -2571,6 +2571,15 @@ struct AcpiBuildState {
     void *rsdp;
     MemoryRegion *rsdp_mr;
     MemoryRegion *linker_mr;
+
+    /* Last tables built by acpi_build_update(), and the inputs they were
+     * built from; see acpi_build_key().
+     */
+    AcpiBuildTables cache;
+    GByteArray *cache_key;
+    /* Bumped on every device realize/unrealize, i.e. on hotplug */
+    DeviceListener device_listener;
+    uint32_t device_gen;
 } AcpiBuildState;
 
 static bool acpi_get_mcfg(AcpiMcfgInfo *mcfg)
@@ -2766,10 +2775,50 @@ static void acpi_ram_update(MemoryRegion *mr, GArray *data)
     memory_region_set_dirty(mr, 0, size);
 }
 
+static int acpi_build_key_add_pci(Object *obj, void *opaque)
+{
+    GByteArray *key = opaque;
+    PCIDevice *dev = (PCIDevice *)object_dynamic_cast(obj, TYPE_PCI_DEVICE);
+
+    if (dev) {
+        g_byte_array_append(key, dev->config, PCI_CONFIG_SPACE_SIZE);
+    }
+    return 0;
+}
+
+/*
+ * What acpi_build() depends on beyond the command line is the set of
+ * devices, which only changes through hotplug, and state that firmware
+ * programs into PCI config space: bus numbers, bridge windows and BARs
+ * (the PCI holes), and the PM and MMCONFIG base registers.  Rebooting a
+ * guest usually reproduces all of that exactly, so the tables built on
+ * the previous boot can be reused.
+ */
+static GByteArray *acpi_build_key(AcpiBuildState *build_state)
+{
+    GByteArray *key = g_byte_array_new();
+
+    g_byte_array_append(key, (guint8 *)&build_state->device_gen,
+                        sizeof(build_state->device_gen));
+    object_child_foreach_recursive(qdev_get_machine(),
+                                   acpi_build_key_add_pci, key);
+    return key;
+}
+
+static void acpi_build_device_changed(DeviceListener *listener,
+                                      DeviceState *dev)
+{
+    AcpiBuildState *build_state = container_of(listener, AcpiBuildState,
+                                               device_listener);
+
+    build_state->device_gen++;
+}
+
 static void acpi_build_update(void *build_opaque)
 {
     AcpiBuildState *build_state = build_opaque;
     AcpiBuildTables tables;
+    GByteArray *key;
 
     /* No state to update or already patched? Nothing to do. */
     if (!build_state || build_state->patched) {
@@ -2777,9 +2826,21 @@ static void acpi_build_update(void *build_opaque)
     }
     build_state->patched = 1;
 
-    acpi_build_tables_init(&tables);
-
-    acpi_build(&tables, MACHINE(qdev_get_machine()));
+    key = acpi_build_key(build_state);
+    if (build_state->cache_key && key->len == build_state->cache_key->len &&
+        !memcmp(key->data, build_state->cache_key->data, key->len)) {
+        g_byte_array_free(key, true);
+        tables = build_state->cache;
+    } else {
+        if (build_state->cache_key) {
+            acpi_build_tables_cleanup(&build_state->cache, true);
+            g_byte_array_free(build_state->cache_key, true);
+        }
+        acpi_build_tables_init(&tables);
+        acpi_build(&tables, MACHINE(qdev_get_machine()));
+        build_state->cache = tables;
+        build_state->cache_key = key;
+    }
 
     acpi_ram_update(build_state->table_mr, tables.table_data);
 
@@ -2790,7 +2851,6 @@ static void acpi_build_update(void *build_opaque)
     }
 
     acpi_ram_update(build_state->linker_mr, tables.linker->cmd_blob);
-    acpi_build_tables_cleanup(&tables, true);
 }
 
 static void acpi_build_reset(void *build_opaque)
@@ -2878,6 +2938,10 @@ void acpi_setup(void)
                                                   ACPI_BUILD_RSDP_FILE, 0);
     }
 
+    build_state->device_listener.realize = acpi_build_device_changed;
+    build_state->device_listener.unrealize = acpi_build_device_changed;
+    device_listener_register(&build_state->device_listener);
+
     qemu_register_reset(acpi_build_reset, build_state);
     acpi_build_reset(build_state);
     vmstate_register(NULL, 0, &vmstate_acpi_build, build_state);
@@ -218,6 +218,7 @@ static void vtd_reset_iotlb(IntelIOMMUState *s)
 {
     assert(s->iotlb);
     g_hash_table_remove_all(s->iotlb);
+    s->iotlb_gen++;
 }
 
 static uint64_t vtd_get_iotlb_key(uint64_t gfn, uint16_t source_id,
@@ -252,10 +253,10 @@ out:
     return entry;
 }
 
-static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
-                             uint16_t domain_id, hwaddr addr, uint64_t slpte,
-                             bool read_flags, bool write_flags,
-                             uint32_t level)
+static VTDIOTLBEntry *vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
+                                       uint16_t domain_id, hwaddr addr,
+                                       uint64_t slpte, bool read_flags,
+                                       bool write_flags, uint32_t level)
 {
     VTDIOTLBEntry *entry = g_malloc(sizeof(*entry));
     uint64_t *key = g_malloc(sizeof(*key));
@@ -275,6 +276,7 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     entry->mask = vtd_slpt_level_page_mask(level);
     *key = vtd_get_iotlb_key(gfn, source_id, level);
     g_hash_table_replace(s->iotlb, key, entry);
+    return entry;
 }
 
 /* Given the reg addr of both the message data and address, generate an
@@ -807,6 +809,21 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
      */
     assert(!vtd_is_interrupt_addr(addr));
 
+    /* Devices usually DMA to the same page many times in a row, so check
+     * the last translation of this device before the IOTLB hash table.
+     */
+    if (vtd_as->iotlb_gen == s->iotlb_gen &&
+        cc_entry->context_cache_gen == s->context_cache_gen &&
+        ((addr & vtd_as->iotlb_entry.mask) >> VTD_PAGE_SHIFT_4K) ==
+        vtd_as->iotlb_entry.gfn) {
+        iotlb_entry = &vtd_as->iotlb_entry;
+        slpte = iotlb_entry->slpte;
+        reads = iotlb_entry->read_flags;
+        writes = iotlb_entry->write_flags;
+        page_mask = iotlb_entry->mask;
+        goto out;
+    }
+
     /* Try to fetch slpte form IOTLB */
     iotlb_entry = vtd_lookup_iotlb(s, source_id, addr);
     if (iotlb_entry) {
@@ -816,7 +833,7 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
         reads = iotlb_entry->read_flags;
         writes = iotlb_entry->write_flags;
         page_mask = iotlb_entry->mask;
-        goto out;
+        goto cache;
     }
     /* Try to fetch context-entry from cache first */
     if (cc_entry->context_cache_gen == s->context_cache_gen) {
@@ -858,8 +875,13 @@ static void vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
     }
 
     page_mask = vtd_slpt_level_page_mask(level);
-    vtd_update_iotlb(s, source_id, VTD_CONTEXT_ENTRY_DID(ce.hi), addr, slpte,
-                     reads, writes, level);
+    iotlb_entry = vtd_update_iotlb(s, source_id, VTD_CONTEXT_ENTRY_DID(ce.hi),
+                                   addr, slpte, reads, writes, level);
+cache:
+    if (cc_entry->context_cache_gen == s->context_cache_gen) {
+        vtd_as->iotlb_entry = *iotlb_entry;
+        vtd_as->iotlb_gen = s->iotlb_gen;
+    }
 out:
     entry->iova = addr & page_mask;
     entry->translated_addr = vtd_get_slpte_addr(slpte) & page_mask;
@@ -1018,6 +1040,7 @@ static void vtd_iotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
 {
     g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_domain,
                                 &domain_id);
+    s->iotlb_gen++;
 }
 
 static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
@@ -1030,6 +1053,7 @@ static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
     info.addr = addr;
     info.mask = ~((1 << am) - 1);
     g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_page, &info);
+    s->iotlb_gen++;
 }
 
 /* Flush IOTLB
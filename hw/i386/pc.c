@@ -835,7 +835,9 @@ static void load_linux(PCMachineState *pcms,
     int setup_size, kernel_size, initrd_size = 0, cmdline_size;
     int dtb_size, setup_data_offset;
     uint32_t initrd_max;
-    uint8_t header[8192], *setup, *kernel, *initrd_data;
+    uint8_t header[8192], *setup, *kernel, *kernel_file, *initrd_data;
+    size_t mapped_size;
+    Error *err = NULL;
     hwaddr real_addr, prot_addr, cmdline_addr, initrd_addr = 0;
     FILE *f;
     char *vmode;
@@ -963,18 +965,18 @@ static void load_linux(PCMachineState *pcms,
             exit(1);
         }
 
-        initrd_size = get_image_size(initrd_filename);
-        if (initrd_size < 0) {
+        /* Served straight from the page cache by fw_cfg */
+        initrd_data = load_image_mapped(initrd_filename, &mapped_size, &err);
+        if (!initrd_data || mapped_size > INT_MAX) {
             fprintf(stderr, "qemu: error reading initrd %s: %s\n",
-                    initrd_filename, strerror(errno));
+                    initrd_filename,
+                    err ? error_get_pretty(err) : "file too large");
             exit(1);
         }
+        initrd_size = mapped_size;
 
         initrd_addr = (initrd_max-initrd_size) & ~4095;
 
-        initrd_data = g_malloc(initrd_size);
-        load_image(initrd_filename, initrd_data);
-
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_ADDR, initrd_addr);
         fw_cfg_add_i32(fw_cfg, FW_CFG_INITRD_SIZE, initrd_size);
         fw_cfg_add_bytes(fw_cfg, FW_CFG_INITRD_DATA, initrd_data, initrd_size);
@@ -995,18 +997,18 @@ static void load_linux(PCMachineState *pcms,
     }
     kernel_size -= setup_size;
 
-    setup  = g_malloc(setup_size);
-    kernel = g_malloc(kernel_size);
-    fseek(f, 0, SEEK_SET);
-    if (fread(setup, 1, setup_size, f) != setup_size) {
-        fprintf(stderr, "fread() failed\n");
-        exit(1);
-    }
-    if (fread(kernel, 1, kernel_size, f) != kernel_size) {
-        fprintf(stderr, "fread() failed\n");
+    fclose(f);
+
+    /* The setup header is patched below, the kernel is passed on as is */
+    kernel_file = load_image_mapped(kernel_filename, &mapped_size, &err);
+    if (!kernel_file || mapped_size != setup_size + kernel_size) {
+        fprintf(stderr, "qemu: could not load kernel '%s': %s\n",
+                kernel_filename,
+                err ? error_get_pretty(err) : "file changed while loading");
         exit(1);
     }
-    fclose(f);
+    setup = g_memdup(kernel_file, setup_size);
+    kernel = kernel_file + setup_size;
 
     /* append dtb to kernel */
     if (dtb_filename) {
@@ -1023,8 +1025,10 @@ static void load_linux(PCMachineState *pcms,
         }
 
         setup_data_offset = QEMU_ALIGN_UP(kernel_size, 16);
+        kernel = g_malloc0(setup_data_offset + sizeof(struct setup_data) +
+                           dtb_size);
+        memcpy(kernel, kernel_file + setup_size, kernel_size);
         kernel_size = setup_data_offset + sizeof(struct setup_data) + dtb_size;
-        kernel = g_realloc(kernel, kernel_size);
 
         stq_p(header+0x250, prot_addr + setup_data_offset);
 
@@ -77,6 +77,7 @@ typedef struct Peer {
 typedef struct MSIVector {
     PCIDevice *pdev;
     int virq;
+    MSIMessage msg;     /* what the KVM route of virq delivers */
 } MSIVector;
 
 typedef struct IVShmemState {
@@ -318,11 +319,16 @@ static int ivshmem_vector_unmask(PCIDevice *dev, unsigned vector,
 
     IVSHMEM_DPRINTF("vector unmask %p %d\n", dev, vector);
 
-    ret = kvm_irqchip_update_msi_route(kvm_state, v->virq, msg, dev);
-    if (ret < 0) {
-        return ret;
+    /* Guests mask and unmask without reprogramming the vector; only
+     * rewrite the routing table when the message actually changed */
+    if (v->msg.address != msg.address || v->msg.data != msg.data) {
+        ret = kvm_irqchip_update_msi_route(kvm_state, v->virq, msg, dev);
+        if (ret < 0) {
+            return ret;
+        }
+        kvm_irqchip_commit_routes(kvm_state);
+        v->msg = msg;
     }
-    kvm_irqchip_commit_routes(kvm_state);
 
     return kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, n, NULL, v->virq);
 }
@@ -455,6 +461,7 @@ static void ivshmem_add_kvm_msi_virq(IVShmemState *s, int vector,
 
     s->msi_vectors[vector].virq = ret;
     s->msi_vectors[vector].pdev = pdev;
+    s->msi_vectors[vector].msg = msix_get_message(pdev, vector);
 }
 
 static void setup_interrupt(IVShmemState *s, int vector, Error **errp)
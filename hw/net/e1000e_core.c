@@ -155,7 +155,12 @@ e1000e_intrmgr_on_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_interrupts();
         return;
     }
+    timer->core->itr_intr_pending = false;
 
+    /*
+     * The interrupt is only raised if its causes were not cleared in the
+     * meantime, and raising it starts the next interval.
+     */
     if (msi_enabled(timer->core->owner)) {
         trace_e1000e_irq_msi_notify_postponed();
         e1000e_set_interrupt_cause(timer->core, 0);
@@ -179,6 +184,10 @@ e1000e_intrmgr_on_msix_throttling_timer(void *opaque)
         trace_e1000e_irq_throttling_no_pending_vec(idx);
         return;
     }
+    timer->core->eitr_intr_pending[idx] = false;
+
+    /* Like any other, the postponed interrupt starts a new interval */
+    e1000e_intrmgr_rearm_timer(timer);
 
     trace_e1000e_irq_msix_notify_postponed_vec(idx);
     msix_notify(timer->core->owner, idx);
@@ -422,9 +431,11 @@ e1000e_intrmgr_reset(E1000ECore *core)
     e1000e_intrmgr_stop_delay_timers(core);
 
     e1000e_intrmgr_stop_timer(&core->itr);
+    core->itr_intr_pending = false;
 
     for (i = 0; i < E1000E_MSIX_VEC_NUM; i++) {
         e1000e_intrmgr_stop_timer(&core->eitr[i]);
+        core->eitr_intr_pending[i] = false;
     }
 }
 
@@ -581,7 +592,7 @@ e1000e_rss_calc_hash(E1000ECore *core,
         type = NetPktRssIpV4Tcp;
         break;
     case E1000_MRQ_RSS_TYPE_IPV6TCP:
-        type = NetPktRssIpV6Tcp;
+        type = NetPktRssIpV6TcpEx;
         break;
     case E1000_MRQ_RSS_TYPE_IPV6:
         type = NetPktRssIpV6;
@@ -16,6 +16,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -25,6 +26,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -36,6 +38,14 @@
 /* for now, only allow larger queues; with virtio-1, guest can downsize */
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 
+/* Completed TX packets returned to the guest with one index update */
+#define VIRTIO_NET_TX_PUSH_BATCH 32
+
+/* Pooled elements hold up to this many buffers; this covers a 64k GSO
+ * packet in 4k pages plus the header.
+ */
+#define VIRTIO_NET_POOL_SG 18
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -44,22 +54,36 @@
     (offsetof(container, field) + sizeof(((container *)0)->field))
 
 typedef struct VirtIOFeature {
-    uint32_t flags;
+    uint64_t flags;
     size_t end;
 } VirtIOFeature;
 
 static VirtIOFeature feature_sizes[] = {
-    {.flags = 1 << VIRTIO_NET_F_MAC,
+    {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
-    {.flags = 1 << VIRTIO_NET_F_STATUS,
+    {.flags = 1ULL << VIRTIO_NET_F_STATUS,
      .end = endof(struct virtio_net_config, status)},
-    {.flags = 1 << VIRTIO_NET_F_MQ,
+    {.flags = 1ULL << VIRTIO_NET_F_MQ,
      .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
-    {.flags = 1 << VIRTIO_NET_F_MTU,
+    {.flags = 1ULL << VIRTIO_NET_F_MTU,
      .end = endof(struct virtio_net_config, mtu)},
+    {.flags = 1ULL << VIRTIO_NET_F_RSS,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
+    {.flags = 1ULL << VIRTIO_NET_F_HASH_REPORT,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -79,12 +103,20 @@ static int vq2q(int queue_index)
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
-    struct virtio_net_config netcfg;
+    struct virtio_net_config netcfg = {};
 
     virtio_stw_p(vdev, &netcfg.status, n->status);
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
     virtio_stw_p(vdev, &netcfg.mtu, n->net_conf.mtu);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
+    if (n->host_features & ((1ULL << VIRTIO_NET_F_RSS) |
+                            (1ULL << VIRTIO_NET_F_HASH_REPORT))) {
+        netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+        virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                     VIRTIO_NET_RSS_MAX_TABLE_LEN);
+        virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                     VIRTIO_NET_RSS_SUPPORTED_HASHES);
+    }
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -231,14 +263,49 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
-static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
+/* Queue pairs running in an iothread raise interrupts through irqfd */
+static void virtio_net_notify(VirtIONetQueue *q, VirtQueue *vq)
 {
-    unsigned int dropped = virtqueue_drop_all(vq);
-    if (dropped) {
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->ctx) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
         virtio_notify(vdev, vq);
     }
 }
 
+static void virtio_net_drop_tx_queue_data(VirtIONetQueue *q)
+{
+    unsigned int dropped = virtqueue_drop_all(q->tx_vq);
+    if (dropped) {
+        virtio_net_notify(q, q->tx_vq);
+    }
+}
+
+/*
+ * Lock out the iothreads while the main loop changes state that the
+ * queue pairs look at.  AioContext locks are recursive, and iothreads
+ * only ever take their own context, so taking all of them is safe.
+ */
+static void virtio_net_dataplane_acquire(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->nb_iothreads; i++) {
+        aio_context_acquire(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_dataplane_release(VirtIONet *n)
+{
+    int i;
+
+    for (i = n->nb_iothreads - 1; i >= 0; i--) {
+        aio_context_release(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -246,6 +313,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_dataplane_acquire(n);
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -289,10 +357,11 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                  * and disabled notification */
                 q->tx_waiting = 0;
                 virtio_queue_set_notification(q->tx_vq, 1);
-                virtio_net_drop_tx_queue_data(vdev, q->tx_vq);
+                virtio_net_drop_tx_queue_data(q);
             }
         }
     }
+    virtio_net_dataplane_release(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -414,9 +483,18 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    n->rss_data.enabled = false;
+    n->rss_data.redirect = false;
+}
+
+static void virtio_net_rsc_purge(VirtioNetRscChain *chain);
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -427,6 +505,9 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    virtio_net_disable_rss(n);
+    virtio_net_rsc_purge(&n->rsc4_chain);
+    virtio_net_rsc_purge(&n->rsc6_chain);
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -440,6 +521,12 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    /* Queued tx packets may point into guest buffers, complete them
+     * while the rings are still set up */
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -468,15 +555,18 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
+    n->rss_data.populate_hash = version_1 && hash_report;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -575,6 +665,14 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+    }
+
+    /* Coalesced segments are passed up like GSO packets */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4) &&
+        !virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
     }
 
     if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
@@ -582,9 +680,22 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* Both are configured through the control queue */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* RSS, hash reporting and coalescing are done in the QEMU receive
+     * path */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSC_EXT);
+
     return vhost_net_get_features(get_vhost_net(nc->peer), features);
 }
 
@@ -639,11 +750,22 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     virtio_net_set_multiqueue(n,
                               virtio_has_feature(features, VIRTIO_NET_F_MQ));
 
+    if (!virtio_has_feature(features, VIRTIO_NET_F_RSS) &&
+        !virtio_has_feature(features, VIRTIO_NET_F_HASH_REPORT)) {
+        virtio_net_disable_rss(n);
+    }
+
+    /* The header length may change below */
+    virtio_net_rsc_purge(&n->rsc4_chain);
+    virtio_net_rsc_purge(&n->rsc6_chain);
+
     virtio_net_set_mrg_rx_bufs(n,
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -879,6 +1001,94 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/* Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG (@do_rss) or
+ * VIRTIO_NET_CTRL_MQ_HASH_CONFIG command and enable it.  The latter has
+ * the layout of the former with a single indirection table entry.
+ * Returns the number of queue pairs to use, or 0 on error. */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    size_t s, offset = 0, size_get;
+    uint16_t queues, i;
+    struct {
+        uint16_t us;
+        uint8_t b;
+    } QEMU_PACKED temp;
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        goto error;
+    }
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    rss->indirections_len = do_rss ?
+        virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1 : 1;
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        goto error;
+    }
+    rss->default_queue = do_rss ?
+        virtio_lduw_p(vdev, &cfg.unclassified_queue) : 0;
+    if (rss->default_queue >= n->max_queues) {
+        goto error;
+    }
+    offset += size_get;
+
+    size_get = sizeof(uint16_t) * rss->indirections_len;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table, size_get);
+    if (s != size_get) {
+        goto error;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        rss->indirections_table[i] =
+            virtio_lduw_p(vdev, &rss->indirections_table[i]);
+        if (rss->indirections_table[i] >= n->max_queues) {
+            goto error;
+        }
+    }
+    offset += size_get;
+
+    size_get = sizeof(temp);
+    s = iov_to_buf(iov, iov_cnt, offset, &temp, size_get);
+    if (s != size_get) {
+        goto error;
+    }
+    queues = do_rss ? virtio_lduw_p(vdev, &temp.us) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        goto error;
+    }
+    if (temp.b > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        goto error;
+    }
+    if (!temp.b) {
+        /* No key: only acceptable to switch everything off */
+        if (rss->hash_types) {
+            goto error;
+        }
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+    offset += size_get;
+
+    size_get = temp.b;
+    memset(rss->key, 0, sizeof(rss->key));
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, size_get);
+    if (s != size_get) {
+        goto error;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    return queues;
+
+error:
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -887,17 +1097,33 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+        return queues ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
     }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        /* Steering goes back to the default, hash reporting stays */
+        if (n->rss_data.redirect) {
+            virtio_net_disable_rss(n);
+        }
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
@@ -924,6 +1150,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    virtio_net_dataplane_acquire(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -965,6 +1192,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_dataplane_release(n);
 }
 
 /* RX */
@@ -1130,8 +1358,95 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/* Returns the NetRxPktRssType to hash @types with, or -1 for none */
+static int virtio_net_get_hash_type(bool isip4, bool isip6,
+                                    bool isudp, bool istcp, uint32_t types)
+{
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            return NetPktRssIpV6TcpEx;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            return NetPktRssIpV6Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            return NetPktRssIpV6UdpEx;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return NetPktRssIpV6Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            return NetPktRssIpV6Ex;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            return NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+/* Compute the Toeplitz hash of a received packet, fill @hash for the
+ * guest header and return the queue it should be delivered to, or -1
+ * to keep it on the queue of @nc. */
+static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
+                                  size_t size, VirtIONetRxHash *hash)
+{
+    static const uint16_t reports[] = {
+        [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtioNetRssData *rss = &n->rss_data;
+    bool isip4, isip6, isudp, istcp;
+    int type;
+    uint32_t h;
+    unsigned int index;
+
+    net_rx_pkt_set_protocols(q->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(q->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+    type = virtio_net_get_hash_type(isip4, isip6, isudp, istcp,
+                                    rss->hash_types);
+    if (type < 0) {
+        index = rss->default_queue;
+    } else {
+        h = net_rx_pkt_calc_rss_hash(q->rx_pkt, type, rss->key);
+        if (rss->populate_hash) {
+            hash->value = cpu_to_le32(h);
+            hash->report = cpu_to_le16(reports[type]);
+        }
+        index = rss->indirections_table[h & (rss->indirections_len - 1)];
+    }
+
+    /* Queues serviced by iothreads can only be filled from their own
+     * thread, so packets stay where the backend delivered them */
+    if (!rss->redirect || q->ctx || index == nc->queue_index) {
+        return -1;
+    }
+    return index;
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size,
+                                      const VirtIONetRxHash *hash)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1180,7 +1495,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return -1;
         }
 
@@ -1195,6 +1510,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->rss_data.populate_hash) {
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(struct virtio_net_hdr_v1_hash,
+                                      hash_value),
+                             hash, sizeof(*hash));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1212,13 +1533,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_free_element(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1229,34 +1550,440 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(q, q->rx_vq);
+    }
 
     return size;
 }
 
+/* Receive segment coalescing
+ *
+ * In-order TCP segments of a flow are appended to the first one of a
+ * chain and delivered as a single buffer, reported to the guest like a
+ * GSO packet plus the number of segments (VIRTIO_NET_HDR_F_RSC_INFO).
+ * Cached segments are delivered at the end of each burst from the
+ * backend, or after rsc_timeout for backends that do not batch.
+ */
+
+#define VIRTIO_NET_TCP_ECE 0x40
+#define VIRTIO_NET_TCP_CWR 0x80
+
+typedef enum {
+    RSC_BYPASS,         /* not TCP or not parseable: deliver as is */
+    RSC_FINAL,          /* deliver the flow's cached data, then this */
+    RSC_CANDIDATE,      /* may be coalesced */
+} VirtioNetRscState;
+
+typedef struct VirtioNetRscUnit {
+    uint8_t *ip;        /* IPv4 or IPv6 header */
+    struct tcp_header *tcp;
+    uint16_t ip_hdrlen;
+    uint16_t tcp_hdrlen;
+    uint16_t payload;   /* TCP payload bytes */
+} VirtioNetRscUnit;
+
+static VirtioNetRscState virtio_net_rsc_parse(VirtioNetRscChain *chain,
+                                             const uint8_t *buf, size_t size,
+                                             VirtioNetRscUnit *unit)
+{
+    size_t ip_off = chain->n->host_hdr_len + ETH_HLEN;
+    uint8_t *ip = (uint8_t *)buf + ip_off;
+    size_t l3_len;
+    uint16_t flags;
+    bool ecn;
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip4 = (struct ip_header *)ip;
+
+        /* No IP options, no fragments */
+        if (size < ip_off + sizeof(*ip4) + sizeof(struct tcp_header) ||
+            ip4->ip_ver_len != 0x45 || ip4->ip_p != IP_PROTO_TCP ||
+            (lduw_be_p(&ip4->ip_off) & (IP_MF | IP_OFFMASK))) {
+            return RSC_BYPASS;
+        }
+        unit->ip_hdrlen = sizeof(*ip4);
+        l3_len = lduw_be_p(&ip4->ip_len);
+        ecn = ip4->ip_tos & 0x3;
+    } else {
+        struct ip6_header *ip6 = (struct ip6_header *)ip;
+
+        /* No extension headers */
+        if (size < ip_off + sizeof(*ip6) + sizeof(struct tcp_header) ||
+            (ip[0] >> 4) != 6 || ip6->ip6_nxt != IP_PROTO_TCP) {
+            return RSC_BYPASS;
+        }
+        unit->ip_hdrlen = sizeof(*ip6);
+        l3_len = sizeof(*ip6) +
+                 lduw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+        ecn = (ldl_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_flow) >> 20) & 0x3;
+    }
+
+    unit->ip = ip;
+    unit->tcp = (struct tcp_header *)(ip + unit->ip_hdrlen);
+    unit->tcp_hdrlen = TCP_HEADER_DATA_OFFSET(unit->tcp);
+    if (l3_len > size - ip_off ||
+        unit->tcp_hdrlen < sizeof(struct tcp_header) ||
+        unit->ip_hdrlen + unit->tcp_hdrlen > l3_len) {
+        return RSC_BYPASS;
+    }
+    unit->payload = l3_len - unit->ip_hdrlen - unit->tcp_hdrlen;
+
+    flags = lduw_be_p(&unit->tcp->th_offset_flags) & 0xff;
+    if (ecn || (flags & (TH_SYN | TH_FIN | TH_RST | TH_URG |
+                         VIRTIO_NET_TCP_ECE | VIRTIO_NET_TCP_CWR))) {
+        return RSC_FINAL;
+    }
+    return RSC_CANDIDATE;
+}
+
+static bool virtio_net_rsc_same_flow(VirtioNetRscChain *chain,
+                                     VirtioNetRscUnit *a, VirtioNetRscUnit *b)
+{
+    size_t addr_off, addr_len;
+
+    if (chain->proto == ETH_P_IP) {
+        addr_off = offsetof(struct ip_header, ip_src);
+        addr_len = 2 * sizeof(uint32_t);
+    } else {
+        addr_off = offsetof(struct ip6_header, ip6_src);
+        addr_len = 2 * sizeof(struct in6_address);
+    }
+
+    /* Addresses, then source and destination ports */
+    return !memcmp(a->ip + addr_off, b->ip + addr_off, addr_len) &&
+           !memcmp(a->tcp, b->tcp, 2 * sizeof(uint16_t));
+}
+
+static void virtio_net_rsc_stw(VirtIONet *n, __virtio16 *p, uint16_t v)
+{
+    /* The header is still in the backend's layout: receive_header()
+     * converts it for the guest */
+    *p = n->needs_vnet_hdr_swap ? v : virtio_tswap16(VIRTIO_DEVICE(n), v);
+}
+
+static void virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
+                                     VirtioNetRscSeg *seg)
+{
+    VirtIONet *n = chain->n;
+    struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)seg->buf;
+    VirtioNetRscUnit unit;
+
+    QTAILQ_REMOVE(&chain->buffers, seg, next);
+
+    if (seg->packets > 1) {
+        virtio_net_rsc_parse(chain, seg->buf, seg->size, &unit);
+        if (chain->proto == ETH_P_IP) {
+            struct ip_header *ip4 = (struct ip_header *)unit.ip;
+
+            ip4->ip_sum = 0;
+            stw_be_p(&ip4->ip_sum, net_raw_checksum(unit.ip, sizeof(*ip4)));
+        }
+        hdr->flags = VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_RSC_INFO;
+        hdr->gso_type = chain->gso_type;
+        virtio_net_rsc_stw(n, &hdr->hdr_len,
+                           ETH_HLEN + unit.ip_hdrlen + unit.tcp_hdrlen);
+        virtio_net_rsc_stw(n, &hdr->gso_size, seg->mss);
+        /* csum_start: coalesced segments, csum_offset: duplicate acks */
+        virtio_net_rsc_stw(n, &hdr->csum_start, seg->packets);
+        virtio_net_rsc_stw(n, &hdr->csum_offset, 0);
+    }
+
+    virtio_net_receive_rcu(seg->nc, seg->buf, seg->size, &seg->hash);
+    g_free(seg->buf);
+    g_free(seg);
+}
+
+/* Deliver the segments cached for @nc, or all of them if NULL */
+static void virtio_net_rsc_drain_chain(VirtioNetRscChain *chain,
+                                       NetClientState *nc)
+{
+    VirtioNetRscSeg *seg, *next;
+
+    rcu_read_lock();
+    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, next) {
+        if (!nc || seg->nc == nc) {
+            virtio_net_rsc_drain_seg(chain, seg);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void virtio_net_rsc_drain_timer(void *opaque)
+{
+    virtio_net_rsc_drain_chain(opaque, NULL);
+}
+
+/* Throw away cached segments, on reset or when coalescing is disabled */
+static void virtio_net_rsc_purge(VirtioNetRscChain *chain)
+{
+    VirtioNetRscSeg *seg, *next;
+
+    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, next) {
+        QTAILQ_REMOVE(&chain->buffers, seg, next);
+        g_free(seg->buf);
+        g_free(seg);
+    }
+    timer_del(chain->drain_timer);
+}
+
+static void virtio_net_rsc_cache(VirtioNetRscChain *chain, NetClientState *nc,
+                                 const uint8_t *buf, VirtioNetRscUnit *unit,
+                                 const VirtIONetRxHash *hash)
+{
+    VirtIONet *n = chain->n;
+    VirtioNetRscSeg *seg = g_new0(VirtioNetRscSeg, 1);
+    size_t hdr_size = n->host_hdr_len + ETH_HLEN + unit->ip_hdrlen +
+                      unit->tcp_hdrlen;
+
+    /* Room for an IP datagram of the maximum size */
+    seg->buf = g_malloc(n->host_hdr_len + ETH_HLEN + unit->ip_hdrlen +
+                        ETH_MAX_IP_DGRAM_LEN);
+    seg->size = hdr_size + unit->payload;   /* without Ethernet padding */
+    memcpy(seg->buf, buf, seg->size);
+    seg->nc = nc;
+    seg->packets = 1;
+    seg->mss = unit->payload;
+    seg->hash = *hash;
+    QTAILQ_INSERT_TAIL(&chain->buffers, seg, next);
+
+    if (!timer_pending(chain->drain_timer)) {
+        timer_mod(chain->drain_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_HOST) + n->rsc_timeout);
+    }
+}
+
+/* Append the payload of @unit to @seg.  Returns false if the segment
+ * does not directly follow the cached data of the flow. */
+static bool virtio_net_rsc_coalesce(VirtioNetRscChain *chain,
+                                    VirtioNetRscSeg *seg,
+                                    VirtioNetRscUnit *o,
+                                    VirtioNetRscUnit *unit)
+{
+    uint32_t seq = ldl_be_p(&unit->tcp->th_seq);
+    uint32_t oseq = ldl_be_p(&o->tcp->th_seq);
+    uint16_t flags;
+
+    if (seq != oseq + o->payload || unit->payload == 0) {
+        /* Out of order, retransmitted, or a pure ack */
+        if (seq == oseq + o->payload && unit->payload == 0 &&
+            unit->tcp->th_ack == o->tcp->th_ack &&
+            unit->tcp->th_win != o->tcp->th_win) {
+            /* Window update: fold it into the cached segment */
+            o->tcp->th_win = unit->tcp->th_win;
+            return true;
+        }
+        return false;
+    }
+
+    /* Same header fields, options included, as for GRO */
+    if (unit->tcp_hdrlen != o->tcp_hdrlen ||
+        memcmp(unit->tcp + 1, o->tcp + 1,
+               unit->tcp_hdrlen - sizeof(struct tcp_header))) {
+        return false;
+    }
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip4 = (struct ip_header *)unit->ip;
+        struct ip_header *oip4 = (struct ip_header *)o->ip;
+
+        if (ip4->ip_tos != oip4->ip_tos || ip4->ip_ttl != oip4->ip_ttl ||
+            ip4->ip_off != oip4->ip_off) {
+            return false;
+        }
+        if (o->ip_hdrlen + o->tcp_hdrlen + o->payload + unit->payload >
+            ETH_MAX_IP_DGRAM_LEN) {
+            return false;
+        }
+        stw_be_p(&oip4->ip_len, lduw_be_p(&oip4->ip_len) + unit->payload);
+    } else {
+        struct ip6_header *ip6 = (struct ip6_header *)unit->ip;
+        struct ip6_header *oip6 = (struct ip6_header *)o->ip;
+
+        if (ip6->ip6_ctlun.ip6_un1.ip6_un1_flow !=
+            oip6->ip6_ctlun.ip6_un1.ip6_un1_flow ||
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim !=
+            oip6->ip6_ctlun.ip6_un1.ip6_un1_hlim) {
+            return false;
+        }
+        if (o->tcp_hdrlen + o->payload + unit->payload >
+            ETH_MAX_IP_DGRAM_LEN) {
+            return false;
+        }
+        stw_be_p(&oip6->ip6_ctlun.ip6_un1.ip6_un1_plen,
+                 lduw_be_p(&oip6->ip6_ctlun.ip6_un1.ip6_un1_plen) +
+                 unit->payload);
+    }
+
+    memcpy(seg->buf + seg->size,
+           (uint8_t *)unit->tcp + unit->tcp_hdrlen, unit->payload);
+    seg->size += unit->payload;
+    seg->packets++;
+
+    /* Latest ack and window; PSH is carried over */
+    o->tcp->th_ack = unit->tcp->th_ack;
+    o->tcp->th_win = unit->tcp->th_win;
+    flags = lduw_be_p(&unit->tcp->th_offset_flags);
+    if (flags & TH_PUSH) {
+        stw_be_p(&o->tcp->th_offset_flags,
+                 lduw_be_p(&o->tcp->th_offset_flags) | TH_PUSH);
+    }
+    return true;
+}
+
+static VirtioNetRscChain *virtio_net_rsc_chain(NetClientState *nc,
+                                               const uint8_t *buf,
+                                               size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
+    uint16_t proto;
+    uint64_t tso;
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(n), VIRTIO_NET_F_RSC_EXT) ||
+        !n->has_vnet_hdr || size < n->host_hdr_len + ETH_HLEN ||
+        virtio_net_get_subqueue(nc)->ctx || !virtio_net_can_receive(nc)) {
+        return NULL;
+    }
+
+    /* Only complete segments whose checksum needs no further checking */
+    if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        !(hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID |
+                        VIRTIO_NET_HDR_F_NEEDS_CSUM))) {
+        return NULL;
+    }
+
+    proto = lduw_be_p(buf + n->host_hdr_len + offsetof(struct eth_header,
+                                                       h_proto));
+    if (proto == ETH_P_IP) {
+        tso = 1ULL << VIRTIO_NET_F_GUEST_TSO4;
+        return (n->curr_guest_offloads & tso) ? &n->rsc4_chain : NULL;
+    } else if (proto == ETH_P_IPV6) {
+        tso = 1ULL << VIRTIO_NET_F_GUEST_TSO6;
+        return (n->curr_guest_offloads & tso) ? &n->rsc6_chain : NULL;
+    }
+    return NULL;
+}
+
+static ssize_t virtio_net_rsc_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size,
+                                      const VirtIONetRxHash *hash)
+{
+    VirtioNetRscChain *chain = virtio_net_rsc_chain(nc, buf, size);
+    VirtioNetRscUnit unit, o;
+    VirtioNetRscSeg *seg;
+    VirtioNetRscState state;
+
+    if (!chain) {
+        return virtio_net_receive_rcu(nc, buf, size, hash);
+    }
+
+    state = virtio_net_rsc_parse(chain, buf, size, &unit);
+    if (state == RSC_BYPASS) {
+        return virtio_net_receive_rcu(nc, buf, size, hash);
+    }
+
+    QTAILQ_FOREACH(seg, &chain->buffers, next) {
+        if (seg->nc != nc) {
+            continue;
+        }
+        virtio_net_rsc_parse(chain, seg->buf, seg->size, &o);
+        if (!virtio_net_rsc_same_flow(chain, &o, &unit)) {
+            continue;
+        }
+        if (state == RSC_CANDIDATE &&
+            virtio_net_rsc_coalesce(chain, seg, &o, &unit)) {
+            if (lduw_be_p(&o.tcp->th_offset_flags) & TH_PUSH) {
+                virtio_net_rsc_drain_seg(chain, seg);
+            }
+            return size;
+        }
+        /* Keep the flow in order */
+        virtio_net_rsc_drain_seg(chain, seg);
+        if (state == RSC_CANDIDATE && unit.payload) {
+            break;
+        }
+        return virtio_net_receive_rcu(nc, buf, size, hash);
+    }
+
+    if (state != RSC_CANDIDATE || !unit.payload) {
+        return virtio_net_receive_rcu(nc, buf, size, hash);
+    }
+    virtio_net_rsc_cache(chain, nc, buf, &unit, hash);
+    return size;
+}
+
+static void virtio_net_rsc_init(VirtIONet *n, VirtioNetRscChain *chain,
+                                uint16_t proto, uint8_t gso_type)
+{
+    chain->n = n;
+    chain->proto = proto;
+    chain->gso_type = gso_type;
+    chain->drain_timer = timer_new_ns(QEMU_CLOCK_HOST,
+                                      virtio_net_rsc_drain_timer, chain);
+    QTAILQ_INIT(&chain->buffers);
+}
+
+static void virtio_net_rsc_cleanup(VirtioNetRscChain *chain)
+{
+    virtio_net_rsc_purge(chain);
+    timer_free(chain->drain_timer);
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetRxHash hash = {};
     ssize_t r;
+    int index;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss_data.enabled && virtio_net_can_receive(nc)) {
+        index = virtio_net_process_rss(nc, buf, size, &hash);
+        if (index >= 0) {
+            r = virtio_net_rsc_receive(qemu_get_subqueue(n->nic, index),
+                                       buf, size, &hash);
+            rcu_read_unlock();
+            /* Drop the packet if the target queue is full, as hardware
+             * would: queueing it here would stall the source queue until
+             * its own guest buffers are refilled. */
+            return r <= 0 ? size : r;
+        }
+    }
+    r = virtio_net_rsc_receive(nc, buf, size, &hash);
     rcu_read_unlock();
     return r;
 }
 
+/* One interrupt for a whole burst of packets from the backend */
+static void virtio_net_batch(NetClientState *nc, bool start)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONet *n = q->n;
+
+    if (!start && !q->ctx) {
+        virtio_net_rsc_drain_chain(&n->rsc4_chain, nc);
+        virtio_net_rsc_drain_chain(&n->rsc6_chain, nc);
+    }
+    q->rx_batch = start;
+    if (!start && q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(q, q->rx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(q, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -1264,11 +1991,31 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
+static void virtio_net_tx_push_done(VirtIONetQueue *q,
+                                    VirtQueueElement **done,
+                                    unsigned int *num_done)
+{
+    unsigned int i;
+
+    if (!*num_done) {
+        return;
+    }
+
+    virtqueue_push_batch(q->tx_vq, done, NULL, *num_done);
+    virtio_net_notify(q, q->tx_vq);
+    for (i = 0; i < *num_done; i++) {
+        virtqueue_free_element(q->tx_vq, done[i]);
+    }
+    *num_done = 0;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *done[VIRTIO_NET_TX_PUSH_BATCH];
+    unsigned int num_done = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1285,6 +2032,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
+        bool in_guest_memory = true;
 
         elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1296,7 +2044,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(q->tx_vq, elem);
+            virtio_net_tx_push_done(q, done, &num_done);
             return -EINVAL;
         }
 
@@ -1305,7 +2054,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_free_element(q->tx_vq, elem);
+                virtio_net_tx_push_done(q, done, &num_done);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1320,6 +2070,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 		}
                 out_num += 1;
                 out_sg = sg2;
+                in_guest_memory = false;
 	    }
         }
         /*
@@ -1339,23 +2090,37 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /* elem is held until virtio_net_tx_complete() if the packet is
+         * queued, so guest memory can be queued without a copy.  The
+         * swapped header lives on the stack and can't. */
+        if (in_guest_memory) {
+            ret = qemu_sendv_packet_async_nocopy(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        } else {
+            ret = qemu_sendv_packet_async(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        }
         if (ret == 0) {
+            /* The completion callback pushes elem, don't reorder */
+            virtio_net_tx_push_done(q, done, &num_done);
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        done[num_done++] = elem;
+        if (num_done == ARRAY_SIZE(done)) {
+            virtio_net_tx_push_done(q, done, &num_done);
+        }
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_push_done(q, done, &num_done);
     return num_packets;
 }
 
@@ -1365,7 +2130,7 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
-        virtio_net_drop_tx_queue_data(vdev, vq);
+        virtio_net_drop_tx_queue_data(q);
         return;
     }
 
@@ -1396,7 +2161,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
     if (unlikely((n->status & VIRTIO_NET_S_LINK_UP) == 0)) {
-        virtio_net_drop_tx_queue_data(vdev, vq);
+        virtio_net_drop_tx_queue_data(q);
         return;
     }
 
@@ -1484,12 +2249,263 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+/* Dataplane: queue pairs processed in iothreads */
+
+static void virtio_net_tx_bh_aio(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = q->ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(ctx);
+}
+
+static bool virtio_net_handle_rx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    AioContext *ctx = n->vqs[vq2q(virtio_get_queue_index(vq))].ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(ctx);
+
+    /* New rx buffers only matter once the backend has packets for them */
+    return false;
+}
+
+static bool virtio_net_handle_tx_aio(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    AioContext *ctx = q->ctx;
+    bool progress;
+
+    aio_context_acquire(ctx);
+    progress = !q->tx_waiting;
+    virtio_net_handle_tx_bh(vdev, vq);
+    aio_context_release(ctx);
+
+    return progress;
+}
+
+static int virtio_net_dataplane_queues(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queues : 1;
+}
+
+static void virtio_net_dataplane_realize(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    char **ids;
+    int i;
+
+    if (!n->net_conf.iothread && !n->net_conf.iothreads) {
+        return;
+    }
+
+    if (n->net_conf.iothread && n->net_conf.iothreads) {
+        error_setg(errp, "iothread and iothreads cannot be used together");
+        return;
+    }
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "tx=timer is incompatible with iothread");
+        return;
+    }
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return;
+    }
+
+    if (n->net_conf.iothread) {
+        n->iothreads = g_new(IOThread *, 1);
+        n->iothreads[0] = n->net_conf.iothread;
+        object_ref(OBJECT(n->iothreads[0]));
+        n->nb_iothreads = 1;
+        return;
+    }
+
+    /* Queue pairs are assigned round-robin to the listed iothreads */
+    ids = g_strsplit(n->net_conf.iothreads, ":", -1);
+    n->iothreads = g_new(IOThread *, g_strv_length(ids));
+    for (i = 0; ids[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+        IOThread *iothread = (IOThread *)object_dynamic_cast(obj,
+                                                             TYPE_IOTHREAD);
+
+        if (!iothread) {
+            error_setg(errp, "'%s' is not an iothread", ids[i]);
+            g_strfreev(ids);
+            return;
+        }
+        object_ref(OBJECT(iothread));
+        n->iothreads[n->nb_iothreads++] = iothread;
+    }
+    g_strfreev(ids);
+
+    if (!n->nb_iothreads) {
+        error_setg(errp, "iothreads must list at least one iothread");
+    }
+}
+
+static void virtio_net_dataplane_unrealize(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->nb_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->nb_iothreads = 0;
+}
+
+/* Called with ioeventfd started and all host notifiers in the main loop */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = virtio_net_dataplane_queues(n);
+    int i, r;
+
+    if (!n->nb_iothreads || n->dataplane_started || n->dataplane_disabled) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (!qemu_can_set_aio_context(qemu_get_subqueue(n->nic, i)->peer)) {
+            error_report("virtio-net: backend of queue pair %d cannot run in "
+                         "an iothread (only tap without netfilters can), "
+                         "falling back to the main loop", i);
+            n->dataplane_disabled = true;
+            return;
+        }
+    }
+
+    /* Without vhost there is no backend to mask interrupts for us, so
+     * let the transport tear down and set up irqfds instead.
+     */
+    n->saved_guest_notifier_mask = vdev->use_guest_notifier_mask;
+    vdev->use_guest_notifier_mask = false;
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net: failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set; falling back to the "
+                     "main loop", r);
+        vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+        n->dataplane_disabled = true;
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = iothread_get_aio_context(
+                              n->iothreads[i % n->nb_iothreads]);
+
+        aio_context_acquire(ctx);
+        q->ctx = ctx;
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh_aio, q);
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, ctx);
+
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                                                   virtio_net_handle_rx_aio);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                                   virtio_net_handle_tx_aio);
+        aio_context_release(ctx);
+
+        /* Kick right away in case a notification raced with the switch */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+    }
+
+    n->dataplane_started = true;
+}
+
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = virtio_net_dataplane_queues(n);
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = q->ctx;
+
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx, NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   virtio_queue_host_notifier_read);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   virtio_queue_host_notifier_read);
+
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+        q->ctx = NULL;
+        aio_context_release(ctx);
+    }
+
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+    vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+
+    n->dataplane_started = false;
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    int r;
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r == 0) {
+        virtio_net_dataplane_start(VIRTIO_NET(vdev));
+    }
+    return r;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    virtio_net_dataplane_stop(VIRTIO_NET(vdev));
+    virtio_device_stop_ioeventfd_impl(vdev);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
+    virtio_queue_set_element_pool(n->vqs[index].rx_vq,
+                                  sizeof(VirtQueueElement),
+                                  VIRTIO_NET_POOL_SG,
+                                  n->net_conf.rx_queue_size);
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
@@ -1501,9 +2517,13 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
             virtio_add_queue(vdev, 256, virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
+    virtio_queue_set_element_pool(n->vqs[index].tx_vq,
+                                  sizeof(VirtQueueElement),
+                                  VIRTIO_NET_POOL_SG, 256);
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    net_rx_pkt_init(&n->vqs[index].rx_pkt, false);
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1522,6 +2542,8 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         qemu_bh_delete(q->tx_bh);
     }
     virtio_del_queue(vdev, index * 2 + 1);
+    net_rx_pkt_uninit(q->rx_pkt);
+    q->rx_pkt = NULL;
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -1577,7 +2599,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                               VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1770,6 +2794,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1820,6 +2888,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1829,6 +2901,7 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .batch = virtio_net_batch,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -1881,10 +2954,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
     if (n->net_conf.mtu) {
-        n->host_features |= (0x1 << VIRTIO_NET_F_MTU);
+        n->host_features |= (1ULL << VIRTIO_NET_F_MTU);
     }
 
     virtio_net_set_config_size(n, n->host_features);
@@ -1926,6 +3000,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         error_report("Defaulting to \"bh\"");
     }
 
+    virtio_net_dataplane_realize(n, &err);
+    if (err) {
+        error_propagate(errp, err);
+        virtio_net_dataplane_unrealize(n);
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -1936,6 +3019,10 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->status = VIRTIO_NET_S_LINK_UP;
     n->announce_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL,
                                      virtio_net_announce_timer, n);
+    virtio_net_rsc_init(n, &n->rsc4_chain, ETH_P_IP,
+                        VIRTIO_NET_HDR_GSO_TCPV4);
+    virtio_net_rsc_init(n, &n->rsc6_chain, ETH_P_IPV6,
+                        VIRTIO_NET_HDR_GSO_TCPV6);
 
     if (n->netclient_type) {
         /*
@@ -1962,7 +3049,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -1999,6 +3086,9 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
+    virtio_net_rsc_cleanup(&n->rsc4_chain);
+    virtio_net_rsc_cleanup(&n->rsc6_chain);
+    virtio_net_dataplane_unrealize(n);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_cleanup(vdev);
@@ -2013,6 +3103,10 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
@@ -2039,45 +3133,56 @@ static const VMStateDescription vmstate_virtio_net = {
 };
 
 static Property virtio_net_properties[] = {
-    DEFINE_PROP_BIT("csum", VirtIONet, host_features, VIRTIO_NET_F_CSUM, true),
-    DEFINE_PROP_BIT("guest_csum", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_CSUM, true),
-    DEFINE_PROP_BIT("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
-    DEFINE_PROP_BIT("guest_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO4, true),
-    DEFINE_PROP_BIT("guest_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO6, true),
-    DEFINE_PROP_BIT("guest_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ECN, true),
-    DEFINE_PROP_BIT("guest_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_UFO, true),
-    DEFINE_PROP_BIT("guest_announce", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ANNOUNCE, true),
-    DEFINE_PROP_BIT("host_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO4, true),
-    DEFINE_PROP_BIT("host_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO6, true),
-    DEFINE_PROP_BIT("host_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_ECN, true),
-    DEFINE_PROP_BIT("host_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_UFO, true),
-    DEFINE_PROP_BIT("mrg_rxbuf", VirtIONet, host_features,
-                    VIRTIO_NET_F_MRG_RXBUF, true),
-    DEFINE_PROP_BIT("status", VirtIONet, host_features,
-                    VIRTIO_NET_F_STATUS, true),
-    DEFINE_PROP_BIT("ctrl_vq", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VQ, true),
-    DEFINE_PROP_BIT("ctrl_rx", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX, true),
-    DEFINE_PROP_BIT("ctrl_vlan", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VLAN, true),
-    DEFINE_PROP_BIT("ctrl_rx_extra", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX_EXTRA, true),
-    DEFINE_PROP_BIT("ctrl_mac_addr", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_MAC_ADDR, true),
-    DEFINE_PROP_BIT("ctrl_guest_offloads", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
-    DEFINE_PROP_BIT("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_CSUM, true),
+    DEFINE_PROP_BIT64("guest_csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_CSUM, true),
+    DEFINE_PROP_BIT64("gso", VirtIONet, host_features,
+                      VIRTIO_NET_F_GSO, true),
+    DEFINE_PROP_BIT64("guest_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO4, true),
+    DEFINE_PROP_BIT64("guest_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO6, true),
+    DEFINE_PROP_BIT64("guest_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ECN, true),
+    DEFINE_PROP_BIT64("guest_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_UFO, true),
+    DEFINE_PROP_BIT64("guest_announce", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ANNOUNCE, true),
+    DEFINE_PROP_BIT64("host_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO4, true),
+    DEFINE_PROP_BIT64("host_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO6, true),
+    DEFINE_PROP_BIT64("host_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_ECN, true),
+    DEFINE_PROP_BIT64("host_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_UFO, true),
+    DEFINE_PROP_BIT64("mrg_rxbuf", VirtIONet, host_features,
+                      VIRTIO_NET_F_MRG_RXBUF, true),
+    DEFINE_PROP_BIT64("status", VirtIONet, host_features,
+                      VIRTIO_NET_F_STATUS, true),
+    DEFINE_PROP_BIT64("ctrl_vq", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VQ, true),
+    DEFINE_PROP_BIT64("ctrl_rx", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX, true),
+    DEFINE_PROP_BIT64("ctrl_vlan", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VLAN, true),
+    DEFINE_PROP_BIT64("ctrl_rx_extra", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX_EXTRA, true),
+    DEFINE_PROP_BIT64("ctrl_mac_addr", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_MAC_ADDR, true),
+    DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
+    DEFINE_PROP_BIT64("mq", VirtIONet, host_features,
+                      VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSC_EXT, false),
+    DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
+                       VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -2086,6 +3191,7 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("host_mtu", VirtIONet, net_conf.mtu, 0),
+    DEFINE_PROP_STRING("iothreads", VirtIONet, net_conf.iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2108,6 +3214,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->set_status = virtio_net_set_status;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
     vdc->vmsd = &vmstate_virtio_net_device;
 }
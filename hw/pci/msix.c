@@ -161,6 +161,11 @@ void msix_write_config(PCIDevice *dev, uint32_t addr,
         return;
     }
 
+    /* Without vector notifiers, masking has no side effect to apply */
+    if (dev->msix_function_masked && !dev->msix_vector_use_notifier) {
+        return;
+    }
+
     for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
         msix_handle_mask_update(dev, vector,
                                 msix_vector_masked(dev, vector, was_masked));
@@ -182,6 +187,11 @@ static void msix_table_mmio_write(void *opaque, hwaddr addr,
     int vector = addr / PCI_MSIX_ENTRY_SIZE;
     bool was_masked;
 
+    /* Guests often rewrite an entry with its current value */
+    if (pci_get_long(dev->msix_table + addr) == val) {
+        return;
+    }
+
     was_masked = msix_is_masked(dev, vector);
     pci_set_long(dev->msix_table + addr, val);
     msix_handle_mask_update(dev, vector, was_masked);
@@ -1259,6 +1259,8 @@ static void pci_update_mappings(PCIDevice *d)
     int i;
     pcibus_t new_addr;
 
+    /* Commit all BAR moves to the memory map at once */
+    memory_region_transaction_begin();
     for(i = 0; i < PCI_NUM_REGIONS; i++) {
         r = &d->io_regions[i];
 
@@ -1292,6 +1294,7 @@ static void pci_update_mappings(PCIDevice *d)
     }
 
     pci_update_vga(d);
+    memory_region_transaction_commit();
 }
 
 static inline int pci_irq_disabled(PCIDevice *d)
@@ -1325,6 +1328,7 @@ uint32_t pci_default_read_config(PCIDevice *d,
 void pci_default_write_config(PCIDevice *d, uint32_t addr, uint32_t val_in, int l)
 {
     int i, was_irq_disabled = pci_irq_disabled(d);
+    uint16_t old_cmd = pci_get_word(d->config + PCI_COMMAND);
     uint32_t val = val_in;
 
     for (i = 0; i < l; val >>= 8, ++i) {
@@ -1334,11 +1338,17 @@ void pci_default_write_config(PCIDevice *d, uint32_t addr, uint32_t val_in, int
         d->config[addr + i] = (d->config[addr + i] & ~wmask) | (val & wmask);
         d->config[addr + i] &= ~(val & w1cmask); /* W1C: Write 1 to Clear */
     }
+    /* Only BAR writes and toggling the decode enables can move a BAR;
+     * guests flip the other command bits (bus master, INTx disable)
+     * far more often.
+     */
     if (ranges_overlap(addr, l, PCI_BASE_ADDRESS_0, 24) ||
         ranges_overlap(addr, l, PCI_ROM_ADDRESS, 4) ||
         ranges_overlap(addr, l, PCI_ROM_ADDRESS1, 4) ||
-        range_covers_byte(addr, l, PCI_COMMAND))
+        ((pci_get_word(d->config + PCI_COMMAND) ^ old_cmd) &
+         (PCI_COMMAND_IO | PCI_COMMAND_MEMORY))) {
         pci_update_mappings(d);
+    }
 
     if (range_covers_byte(addr, l, PCI_COMMAND)) {
         pci_update_irq_disabled(d, was_irq_disabled);
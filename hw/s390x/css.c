@@ -354,20 +354,49 @@ static void copy_sense_id_to_guest(SenseId *dest, SenseId *src)
     }
 }
 
-static CCW1 copy_ccw_from_guest(hwaddr addr, bool fmt1)
+/*
+ * When the ORB allows prefetching, ccws are read from guest memory an
+ * aligned block at a time instead of with one access each; a block never
+ * crosses a page, so it is readable if the ccw in it is.
+ */
+#define CCW_PREFETCH_SIZE 64
+
+typedef struct CcwPrefetch {
+    hwaddr addr;
+    bool valid;
+    uint8_t buf[CCW_PREFETCH_SIZE];
+} CcwPrefetch;
+
+static void fetch_ccw(CcwPrefetch *pf, hwaddr addr, void *ccw)
+{
+    hwaddr block = addr & ~(hwaddr)(CCW_PREFETCH_SIZE - 1);
+
+    if (!pf || (addr & 7)) {
+        cpu_physical_memory_read(addr, ccw, 8);
+        return;
+    }
+    if (!pf->valid || pf->addr != block) {
+        cpu_physical_memory_read(block, pf->buf, CCW_PREFETCH_SIZE);
+        pf->addr = block;
+        pf->valid = true;
+    }
+    memcpy(ccw, pf->buf + (addr - block), 8);
+}
+
+static CCW1 copy_ccw_from_guest(hwaddr addr, bool fmt1, CcwPrefetch *pf)
 {
     CCW0 tmp0;
     CCW1 tmp1;
     CCW1 ret;
 
     if (fmt1) {
-        cpu_physical_memory_read(addr, &tmp1, sizeof(tmp1));
+        fetch_ccw(pf, addr, &tmp1);
         ret.cmd_code = tmp1.cmd_code;
         ret.flags = tmp1.flags;
         ret.count = be16_to_cpu(tmp1.count);
         ret.cda = be32_to_cpu(tmp1.cda);
     } else {
-        cpu_physical_memory_read(addr, &tmp0, sizeof(tmp0));
+        fetch_ccw(pf, addr, &tmp0);
         ret.cmd_code = tmp0.cmd_code;
         ret.flags = tmp0.flags;
         ret.count = be16_to_cpu(tmp0.count);
@@ -380,7 +409,7 @@ static CCW1 copy_ccw_from_guest(hwaddr addr, bool fmt1)
 }
 
 static int css_interpret_ccw(SubchDev *sch, hwaddr ccw_addr,
-                             bool suspend_allowed)
+                             bool suspend_allowed, CcwPrefetch *pf)
 {
     int ret;
     bool check_len;
@@ -392,7 +421,7 @@ static int css_interpret_ccw(SubchDev *sch, hwaddr ccw_addr,
     }
 
     /* Translate everything to format-1 ccws - the information is the same. */
-    ccw = copy_ccw_from_guest(ccw_addr, sch->ccw_fmt_1);
+    ccw = copy_ccw_from_guest(ccw_addr, sch->ccw_fmt_1, pf);
 
     /* Check for invalid command codes. */
     if ((ccw.cmd_code & 0x0f) == 0) {
@@ -507,6 +536,8 @@ static void sch_handle_start_func(SubchDev *sch, ORB *orb)
     int path;
     int ret;
     bool suspend_allowed;
+    CcwPrefetch prefetch = { .valid = false };
+    CcwPrefetch *pf = NULL;
 
     /* Path management: In our simple css, we always choose the only path. */
     path = 0x80;
@@ -529,6 +560,9 @@ static void sch_handle_start_func(SubchDev *sch, ORB *orb)
         s->flags |= (sch->ccw_fmt_1) ? SCSW_FLAGS_MASK_FMT : 0;
         sch->ccw_no_data_cnt = 0;
         suspend_allowed = !!(orb->ctrl0 & ORB_CTRL0_MASK_SPND);
+        if (orb->ctrl0 & ORB_CTRL0_MASK_PFCH) {
+            pf = &prefetch;
+        }
     } else {
         /* Start Function resumed via rsch, i.e. we don't have an
          * ORB */
@@ -538,7 +572,7 @@ static void sch_handle_start_func(SubchDev *sch, ORB *orb)
     }
     sch->last_cmd_valid = false;
     do {
-        ret = css_interpret_ccw(sch, sch->channel_prog, suspend_allowed);
+        ret = css_interpret_ccw(sch, sch->channel_prog, suspend_allowed, pf);
         switch (ret) {
         case -EAGAIN:
             /* ccw chain, continue processing */
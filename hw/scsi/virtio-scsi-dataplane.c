@@ -15,12 +15,38 @@
 #include "qapi/error.h"
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
 #include "sysemu/block-backend.h"
 #include "hw/scsi/scsi.h"
 #include "block/scsi.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+static void virtio_scsi_notify_bh(void *opaque)
+{
+    VirtIOSCSI *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned nvqs = VIRTIO_SCSI_COMMON(s)->conf.num_queues + 2;
+    unsigned i;
+
+    for (i = find_first_bit(s->notify_vqs, nvqs); i < nvqs;
+         i = find_next_bit(s->notify_vqs, nvqs, i + 1)) {
+        clear_bit(i, s->notify_vqs);
+        virtio_notify_irqfd(vdev, virtio_get_queue(vdev, i));
+    }
+}
+
+/*
+ * Raise an interrupt to signal guest, if necessary.  The requests that
+ * complete in one go (a batch submitted together, or the completions of
+ * one aio_poll) share a single notification per virtqueue.
+ */
+void virtio_scsi_dataplane_notify(VirtIOSCSI *s, VirtQueue *vq)
+{
+    set_bit(virtio_get_queue_index(vq), s->notify_vqs);
+    qemu_bh_schedule(s->notify_bh);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
 {
@@ -47,6 +73,22 @@ void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
         }
         s->ctx = qemu_get_aio_context();
     }
+
+    s->notify_bh = aio_bh_new(s->ctx, virtio_scsi_notify_bh, s);
+    s->notify_vqs = bitmap_new(vs->conf.num_queues + 2);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    if (!s->notify_bh) {
+        return;
+    }
+
+    qemu_bh_delete(s->notify_bh);
+    s->notify_bh = NULL;
+    g_free(s->notify_vqs);
+    s->notify_vqs = NULL;
 }
 
 static bool virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
@@ -199,6 +241,12 @@ void virtio_scsi_dataplane_stop(VirtIODevice *vdev)
 
     blk_drain_all(); /* ensure there are no in-flight requests */
 
+    /* Last chance to notify the guest before the irqfds go away */
+    aio_context_acquire(s->ctx);
+    qemu_bh_cancel(s->notify_bh);
+    virtio_scsi_notify_bh(s);
+    aio_context_release(s->ctx);
+
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
@@ -51,6 +51,8 @@
 #define EV_QUEUE (((3 * 24) + 16) * MAXSLOTS)
 
 #define TRB_LINK_LIMIT  4
+#define TRB_PREFETCH    16
+#define EV_BATCH        16
 #define COMMAND_LIMIT   256
 #define TRANSFER_LIMIT  256
 
@@ -329,6 +331,11 @@ typedef enum EPType {
 typedef struct XHCIRing {
     dma_addr_t dequeue;
     bool ccs;
+
+    /* TRBs read ahead of dequeue, valid until the next doorbell */
+    dma_addr_t prefetch_addr;
+    unsigned int prefetch_len;
+    uint8_t prefetch[TRB_PREFETCH * TRB_SIZE];
 } XHCIRing;
 
 typedef struct XHCIPort {
@@ -435,6 +442,12 @@ typedef struct XHCIInterrupter {
     uint32_t er_size;
     unsigned int er_ep_idx;
 
+    /* Event TRBs not written to the ring yet, see xhci_event_batch_end */
+    XHCITRB er_batch[EV_BATCH];
+    unsigned int er_batch_idx;
+    unsigned int er_batch_len;
+    bool er_batch_raise;
+
     /* kept for live migration compat only */
     bool er_full_unused;
     XHCIEvent ev_buffer[EV_QUEUE];
@@ -484,6 +497,7 @@ struct XHCIState {
     int64_t mfindex_start;
     QEMUTimer *mfwrap_timer;
     XHCIInterrupter intr[MAXINTRS];
+    unsigned int event_batch;
 
     XHCIRing cmd_ring;
 
@@ -838,6 +852,53 @@ static void xhci_die(XHCIState *xhci)
     DPRINTF("xhci: asserted controller error\n");
 }
 
+static void xhci_er_flush(XHCIState *xhci, int v)
+{
+    XHCIInterrupter *intr = &xhci->intr[v];
+    uint8_t buf[EV_BATCH * TRB_SIZE];
+    unsigned int i;
+
+    if (!intr->er_batch_len) {
+        return;
+    }
+    for (i = 0; i < intr->er_batch_len; i++) {
+        memcpy(buf + i * TRB_SIZE, &intr->er_batch[i], TRB_SIZE);
+    }
+    pci_dma_write(PCI_DEVICE(xhci),
+                  intr->er_start + TRB_SIZE * intr->er_batch_idx,
+                  buf, intr->er_batch_len * TRB_SIZE);
+    intr->er_batch_len = 0;
+}
+
+/*
+ * Between xhci_event_batch_begin and xhci_event_batch_end, events are
+ * collected and written to each event ring with a single DMA, and the
+ * interrupters are raised once at the end.
+ */
+static void xhci_event_batch_begin(XHCIState *xhci)
+{
+    xhci->event_batch++;
+}
+
+static void xhci_event_batch_end(XHCIState *xhci)
+{
+    int v;
+
+    assert(xhci->event_batch);
+    if (--xhci->event_batch) {
+        return;
+    }
+    for (v = 0; v < xhci->numintrs; v++) {
+        XHCIInterrupter *intr = &xhci->intr[v];
+
+        xhci_er_flush(xhci, v);
+        if (intr->er_batch_raise) {
+            intr->er_batch_raise = false;
+            xhci_intr_raise(xhci, v);
+        }
+    }
+}
+
 static void xhci_write_event(XHCIState *xhci, XHCIEvent *event, int v)
 {
     PCIDevice *pci_dev = PCI_DEVICE(xhci);
@@ -858,8 +919,20 @@ static void xhci_write_event(XHCIState *xhci, XHCIEvent *event, int v)
                                event_name(event), ev_trb.parameter,
                                ev_trb.status, ev_trb.control);
 
-    addr = intr->er_start + TRB_SIZE*intr->er_ep_idx;
-    pci_dma_write(pci_dev, addr, &ev_trb, TRB_SIZE);
+    if (xhci->event_batch) {
+        if (intr->er_batch_len == EV_BATCH ||
+            (intr->er_batch_len &&
+             intr->er_batch_idx + intr->er_batch_len != intr->er_ep_idx)) {
+            xhci_er_flush(xhci, v);
+        }
+        if (!intr->er_batch_len) {
+            intr->er_batch_idx = intr->er_ep_idx;
+        }
+        intr->er_batch[intr->er_batch_len++] = ev_trb;
+    } else {
+        addr = intr->er_start + TRB_SIZE * intr->er_ep_idx;
+        pci_dma_write(pci_dev, addr, &ev_trb, TRB_SIZE);
+    }
 
     intr->er_ep_idx++;
     if (intr->er_ep_idx >= intr->er_size) {
@@ -903,7 +976,11 @@ static void xhci_event(XHCIState *xhci, XHCIEvent *event, int v)
         xhci_write_event(xhci, event, v);
     }
 
-    xhci_intr_raise(xhci, v);
+    if (xhci->event_batch) {
+        intr->er_batch_raise = true;
+    } else {
+        xhci_intr_raise(xhci, v);
+    }
 }
 
 static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
@@ -911,17 +988,49 @@ static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
 {
     ring->dequeue = base;
     ring->ccs = 1;
+    ring->prefetch_len = 0;
+}
+
+/*
+ * Called whenever the guest may have added TRBs, i.e. on each doorbell.
+ * Until then, TRBs we saw as not owned by us stay that way.
+ */
+static void xhci_ring_prefetch_reset(XHCIRing *ring)
+{
+    ring->prefetch_len = 0;
+}
+
+/*
+ * Read the TRB at @addr.  Reads ahead up to TRB_PREFETCH TRBs, but not
+ * past the end of the 4 KiB page, so that a ring segment ending in a
+ * link TRB never makes us touch memory outside the page it lives in.
+ */
+static void xhci_ring_read(XHCIState *xhci, XHCIRing *ring,
+                           dma_addr_t addr, XHCITRB *trb)
+{
+    dma_addr_t offset = addr - ring->prefetch_addr;
+
+    if (addr < ring->prefetch_addr || offset & (TRB_SIZE - 1) ||
+        offset >= ring->prefetch_len * TRB_SIZE) {
+        unsigned int len = (4096 - (addr & 4095)) / TRB_SIZE;
+
+        len = MAX(MIN(len, TRB_PREFETCH), 1);
+        pci_dma_read(PCI_DEVICE(xhci), addr, ring->prefetch, len * TRB_SIZE);
+        ring->prefetch_addr = addr;
+        ring->prefetch_len = len;
+        offset = 0;
+    }
+    memcpy(trb, ring->prefetch + offset, TRB_SIZE);
 }
 
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
                                dma_addr_t *addr)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
     uint32_t link_cnt = 0;
 
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, ring->dequeue, trb, TRB_SIZE);
+        xhci_ring_read(xhci, ring, ring->dequeue, trb);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
         le64_to_cpus(&trb->parameter);
@@ -956,9 +1065,8 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, XHCIRing *ring)
 {
-    PCIDevice *pci_dev = PCI_DEVICE(xhci);
     XHCITRB trb;
     int length = 0;
     dma_addr_t dequeue = ring->dequeue;
@@ -969,7 +1077,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        pci_dma_read(pci_dev, dequeue, &trb, TRB_SIZE);
+        xhci_ring_read(xhci, ring, dequeue, &trb);
         le64_to_cpus(&trb.parameter);
         le32_to_cpus(&trb.status);
         le32_to_cpus(&trb.control);
@@ -1038,6 +1146,7 @@ static void xhci_er_reset(XHCIState *xhci, int v)
 
     intr->er_ep_idx = 0;
     intr->er_pcs = 1;
+    intr->er_batch_len = 0;
 
     DPRINTF("xhci: event ring[%d]:" DMA_ADDR_FMT " [%d]\n",
             v, intr->er_start, intr->er_size);
@@ -2139,8 +2248,10 @@ static void xhci_kick_epctx(XHCIEPContext *epctx, unsigned int streamid)
         xhci_set_ep_state(xhci, epctx, NULL, EP_RUNNING);
     }
     assert(ring->dequeue != 0);
+    xhci_ring_prefetch_reset(ring);
 
     epctx->kick_active++;
+    xhci_event_batch_begin(xhci);
     while (1) {
         length = xhci_ring_chain_length(xhci, ring);
         if (length <= 0) {
@@ -2181,6 +2292,7 @@ static void xhci_kick_epctx(XHCIEPContext *epctx, unsigned int streamid)
             break;
         }
     }
+    xhci_event_batch_end(xhci);
     epctx->kick_active--;
 
     ep = xhci_epid_to_usbep(epctx);
@@ -2635,7 +2747,9 @@ static void xhci_process_commands(XHCIState *xhci)
     }
 
     xhci->crcr_low |= CRCR_CRR;
+    xhci_ring_prefetch_reset(&xhci->cmd_ring);
 
+    xhci_event_batch_begin(xhci);
     while ((type = xhci_ring_fetch(xhci, &xhci->cmd_ring, &trb, &addr))) {
         event.ptr = addr;
         switch (type) {
@@ -2746,9 +2860,10 @@ static void xhci_process_commands(XHCIState *xhci)
 
         if (count++ > COMMAND_LIMIT) {
             trace_usb_xhci_enforced_limit("commands");
-            return;
+            break;
         }
     }
+    xhci_event_batch_end(xhci);
 }
 
 static bool xhci_port_have_device(XHCIPort *port)
@@ -78,6 +78,7 @@ struct USBHostDevice {
     struct USBAutoFilter             match;
     int32_t                          bootindex;
     uint32_t                         iso_urb_count;
+    uint32_t                         iso_urb_max;
     uint32_t                         iso_urb_frames;
     uint32_t                         options;
     uint32_t                         loglevel;
@@ -136,6 +137,8 @@ struct USBHostIsoRing {
     QTAILQ_HEAD(, USBHostIsoXfer)    inflight;
     QTAILQ_HEAD(, USBHostIsoXfer)    copy;
     QTAILQ_ENTRY(USBHostIsoRing)     next;
+    unsigned int                     xfers;
+    bool                             underrun;
 };
 
 static QTAILQ_HEAD(, USBHostDevice) hostdevs =
@@ -464,6 +467,7 @@ usb_host_req_complete_iso(struct libusb_transfer *transfer)
     if (QTAILQ_EMPTY(&xfer->ring->inflight)) {
         USBHostDevice *s = xfer->ring->host;
         trace_usb_host_iso_stop(s->bus_num, s->addr, xfer->ring->ep->nr);
+        xfer->ring->underrun = true;
     }
     if (xfer->ring->ep->pid == USB_TOKEN_IN) {
         QTAILQ_INSERT_TAIL(&xfer->ring->copy, xfer, next);
@@ -473,12 +477,37 @@ usb_host_req_complete_iso(struct libusb_transfer *transfer)
     }
 }
 
-static USBHostIsoRing *usb_host_iso_alloc(USBHostDevice *s, USBEndpoint *ep)
+static void usb_host_iso_add_xfer(USBHostIsoRing *ring)
 {
-    USBHostIsoRing *ring = g_new0(USBHostIsoRing, 1);
+    USBHostDevice *s = ring->host;
     USBHostIsoXfer *xfer;
     /* FIXME: check interval (for now assume one xfer per frame) */
     int packets = s->iso_urb_frames;
+
+    xfer = g_new0(USBHostIsoXfer, 1);
+    xfer->ring = ring;
+    xfer->xfer = libusb_alloc_transfer(packets);
+    xfer->xfer->dev_handle = s->dh;
+    xfer->xfer->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+
+    xfer->xfer->endpoint = ring->ep->nr;
+    if (ring->ep->pid == USB_TOKEN_IN) {
+        xfer->xfer->endpoint |= USB_DIR_IN;
+    }
+    xfer->xfer->callback = usb_host_req_complete_iso;
+    xfer->xfer->user_data = xfer;
+
+    xfer->xfer->num_iso_packets = packets;
+    xfer->xfer->length = ring->ep->max_packet_size * packets;
+    xfer->xfer->buffer = g_malloc0(xfer->xfer->length);
+
+    QTAILQ_INSERT_TAIL(&ring->unused, xfer, next);
+    ring->xfers++;
+}
+
+static USBHostIsoRing *usb_host_iso_alloc(USBHostDevice *s, USBEndpoint *ep)
+{
+    USBHostIsoRing *ring = g_new0(USBHostIsoRing, 1);
     int i;
 
     ring->host = s;
@@ -489,29 +518,29 @@ static USBHostIsoRing *usb_host_iso_alloc(USBHostDevice *s, USBEndpoint *ep)
     QTAILQ_INSERT_TAIL(&s->isorings, ring, next);
 
     for (i = 0; i < s->iso_urb_count; i++) {
-        xfer = g_new0(USBHostIsoXfer, 1);
-        xfer->ring = ring;
-        xfer->xfer = libusb_alloc_transfer(packets);
-        xfer->xfer->dev_handle = s->dh;
-        xfer->xfer->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
-
-        xfer->xfer->endpoint = ring->ep->nr;
-        if (ring->ep->pid == USB_TOKEN_IN) {
-            xfer->xfer->endpoint |= USB_DIR_IN;
-        }
-        xfer->xfer->callback = usb_host_req_complete_iso;
-        xfer->xfer->user_data = xfer;
-
-        xfer->xfer->num_iso_packets = packets;
-        xfer->xfer->length = ring->ep->max_packet_size * packets;
-        xfer->xfer->buffer = g_malloc0(xfer->xfer->length);
-
-        QTAILQ_INSERT_TAIL(&ring->unused, xfer, next);
+        usb_host_iso_add_xfer(ring);
     }
 
     return ring;
 }
 
+/*
+ * The stream ran dry, either on the host side while the guest was still
+ * consuming, or because the guest filled every buffer before the host
+ * returned one.  Add a buffer, up to the isobufs-max property.
+ */
+static bool usb_host_iso_grow(USBHostIsoRing *ring)
+{
+    USBHostDevice *s = ring->host;
+
+    if (ring->xfers >= MAX(s->iso_urb_max, s->iso_urb_count)) {
+        return false;
+    }
+    usb_host_iso_add_xfer(ring);
+    trace_usb_host_iso_grow(s->bus_num, s->addr, ring->ep->nr, ring->xfers);
+    return true;
+}
+
 static USBHostIsoRing *usb_host_iso_find(USBHostDevice *s, USBEndpoint *ep)
 {
     USBHostIsoRing *ring;
@@ -620,6 +649,12 @@ static void usb_host_iso_data_in(USBHostDevice *s, USBPacket *p)
         }
     }
 
+    /* the host had nothing left to fill while the guest kept reading */
+    if (ring->underrun) {
+        ring->underrun = false;
+        usb_host_iso_grow(ring);
+    }
+
     /* submit empty bufs to host */
     while ((xfer = QTAILQ_FIRST(&ring->unused)) != NULL) {
         QTAILQ_REMOVE(&ring->unused, xfer, next);
@@ -666,7 +701,10 @@ static void usb_host_iso_data_out(USBHostDevice *s, USBPacket *p)
         xfer = QTAILQ_FIRST(&ring->unused);
         if (xfer == NULL) {
             trace_usb_host_iso_out_of_bufs(s->bus_num, s->addr, p->ep->nr);
-            return;
+            if (!usb_host_iso_grow(ring)) {
+                return;
+            }
+            xfer = QTAILQ_FIRST(&ring->unused);
         }
         QTAILQ_REMOVE(&ring->unused, xfer, next);
         usb_host_iso_reset_xfer(xfer);
@@ -675,9 +713,14 @@ static void usb_host_iso_data_out(USBHostDevice *s, USBPacket *p)
     usb_host_iso_data_copy(xfer, p);
 
     if (QTAILQ_EMPTY(&ring->inflight)) {
+        /* the host played everything we gave it, keep more queued */
+        if (ring->underrun) {
+            ring->underrun = false;
+            usb_host_iso_grow(ring);
+        }
         /* wait until half of our buffers are filled
            before kicking the iso out stream */
-        if (filled*2 < s->iso_urb_count) {
+        if (filled * 2 < ring->xfers) {
             return;
         }
     }
@@ -1549,6 +1592,7 @@ static Property usb_host_dev_properties[] = {
     DEFINE_PROP_UINT32("vendorid",  USBHostDevice, match.vendor_id,  0),
     DEFINE_PROP_UINT32("productid", USBHostDevice, match.product_id, 0),
     DEFINE_PROP_UINT32("isobufs",  USBHostDevice, iso_urb_count,    4),
+    DEFINE_PROP_UINT32("isobufs-max", USBHostDevice, iso_urb_max,   16),
     DEFINE_PROP_UINT32("isobsize", USBHostDevice, iso_urb_frames,   32),
     DEFINE_PROP_UINT32("loglevel",  USBHostDevice, loglevel,
                        LIBUSB_LOG_LEVEL_WARNING),
@@ -29,9 +29,11 @@
 #include "hw/vfio/vfio.h"
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
+#include "exec/ram_addr.h"
 #include "hw/hw.h"
 #include "qemu/error-report.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
 #include "sysemu/kvm.h"
 #include "trace.h"
 #include "qapi/error.h"
@@ -385,6 +387,145 @@ out:
     rcu_read_unlock();
 }
 
+/*
+ * Error handling for the memory listener.  On the initfn path, store the
+ * first error in the container so we can gracefully fail.  Runtime,
+ * there's not much we can do other than throw a hardware error.
+ */
+static void vfio_listener_set_error(VFIOContainer *container, int ret)
+{
+    if (!container->initialized) {
+        if (!container->error) {
+            container->error = ret;
+        }
+    } else {
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
+/*
+ * Pinning dominates the cost of mapping a large range of fresh guest RAM,
+ * and most of that is spent faulting in and zeroing the pages.  The kernel
+ * pins serially under the container's lock, but the faults themselves can
+ * be taken in parallel beforehand, leaving only the page table walk to the
+ * ioctl.  MADV_POPULATE_* never changes the contents of the memory, so this
+ * is safe while the guest is running.
+ */
+#define VFIO_PREFAULT_MAX_THREADS 16
+#define VFIO_PREFAULT_CHUNK (256 * 1024 * 1024)
+
+typedef struct VFIOPrefaultChunk {
+    void *vaddr;
+    size_t size;
+    bool readonly;
+} VFIOPrefaultChunk;
+
+typedef struct VFIOPrefault {
+    GArray *chunks;
+    unsigned next;
+} VFIOPrefault;
+
+#ifdef MADV_POPULATE_WRITE
+static void *vfio_prefault_thread(void *opaque)
+{
+    VFIOPrefault *pf = opaque;
+    unsigned i;
+
+    while ((i = atomic_fetch_inc(&pf->next)) < pf->chunks->len) {
+        VFIOPrefaultChunk *c = &g_array_index(pf->chunks, VFIOPrefaultChunk,
+                                              i);
+
+        /* Errors are reported by the map ioctl that follows */
+        madvise(c->vaddr, c->size,
+                c->readonly ? MADV_POPULATE_READ : MADV_POPULATE_WRITE);
+    }
+
+    return NULL;
+}
+#endif
+
+static void vfio_prefault_pending(VFIOContainer *container)
+{
+#ifdef MADV_POPULATE_WRITE
+    VFIODMARange *range;
+    VFIOPrefault pf = { 0 };
+    QemuThread threads[VFIO_PREFAULT_MAX_THREADS];
+    long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads, i;
+
+    pf.chunks = g_array_new(false, false, sizeof(VFIOPrefaultChunk));
+    QSIMPLEQ_FOREACH(range, &container->pending_maps, next) {
+        uint64_t off;
+
+        for (off = 0; off < range->size; off += VFIO_PREFAULT_CHUNK) {
+            VFIOPrefaultChunk c = {
+                .vaddr = range->vaddr + off,
+                .size = MIN(VFIO_PREFAULT_CHUNK, range->size - off),
+                .readonly = range->readonly,
+            };
+
+            g_array_append_val(pf.chunks, c);
+        }
+    }
+
+    nthreads = MIN(MIN(host_cpus, VFIO_PREFAULT_MAX_THREADS),
+                   pf.chunks->len);
+    if (nthreads > 1) {
+        trace_vfio_listener_prefault(pf.chunks->len, nthreads);
+        for (i = 0; i < nthreads; i++) {
+            qemu_thread_create(&threads[i], "vfio-prefault",
+                               vfio_prefault_thread, &pf,
+                               QEMU_THREAD_JOINABLE);
+        }
+        for (i = 0; i < nthreads; i++) {
+            qemu_thread_join(&threads[i]);
+        }
+    }
+    g_array_free(pf.chunks, true);
+#endif
+}
+
+static void vfio_listener_begin(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+
+    assert(QSIMPLEQ_EMPTY(&container->pending_maps));
+}
+
+/*
+ * Map the RAM sections added since the start of the transaction.  The
+ * sections are not merged with their neighbours: type1 v2 refuses to
+ * unmap part of a mapping, and each section is unmapped on its own by
+ * region_del.
+ */
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    VFIODMARange *range;
+    int ret;
+
+    if (QSIMPLEQ_EMPTY(&container->pending_maps)) {
+        return;
+    }
+
+    vfio_prefault_pending(container);
+
+    while ((range = QSIMPLEQ_FIRST(&container->pending_maps))) {
+        QSIMPLEQ_REMOVE_HEAD(&container->pending_maps, next);
+
+        ret = vfio_dma_map(container, range->iova, range->size,
+                           range->vaddr, range->readonly);
+        if (ret) {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
+                         container, range->iova, range->size,
+                         range->vaddr, ret);
+            vfio_listener_set_error(container, ret);
+        }
+        g_free(range);
+    }
+}
+
 static void vfio_listener_region_add(MemoryListener *listener,
                                      MemoryRegionSection *section)
 {
@@ -395,6 +536,7 @@ static void vfio_listener_region_add(MemoryListener *listener,
     int ret;
     VFIOHostDMAWindow *hostwin;
     bool hostwin_found;
+    VFIODMARange *range;
 
     if (vfio_listener_skipped_section(section)) {
         trace_vfio_listener_region_add_skip(
@@ -498,30 +640,21 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
-    ret = vfio_dma_map(container, iova, int128_get64(llsize),
-                       vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)",
-                     container, iova, int128_get64(llsize), vaddr, ret);
-        goto fail;
-    }
+    /*
+     * The mapping is done by vfio_listener_commit.  The reference taken
+     * above keeps vaddr valid until then.
+     */
+    range = g_new0(VFIODMARange, 1);
+    range->iova = iova;
+    range->size = int128_get64(llsize);
+    range->vaddr = vaddr;
+    range->readonly = section->readonly;
+    QSIMPLEQ_INSERT_TAIL(&container->pending_maps, range, next);
 
     return;
 
 fail:
-    /*
-     * On the initfn path, store the first error in the container so we
-     * can gracefully fail.  Runtime, there's not much we can do other
-     * than throw a hardware error.
-     */
-    if (!container->initialized) {
-        if (!container->error) {
-            container->error = ret;
-        }
-    } else {
-        hw_error("vfio: DMA mapping failed, unable to continue");
-    }
+    vfio_listener_set_error(container, ret);
 }
 
 static void vfio_listener_region_del(MemoryListener *listener,
@@ -603,9 +736,140 @@ static void vfio_listener_region_del(MemoryListener *listener,
     }
 }
 
+static int vfio_dirty_pages_ioctl(VFIOContainer *container, uint32_t flags)
+{
+    struct vfio_iommu_type1_dirty_bitmap dirty = {
+        .argsz = sizeof(dirty),
+        .flags = flags,
+    };
+
+    if (ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, &dirty)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Start logging the pages written by device DMA.  Kernels or IOMMU types
+ * without VFIO_IOMMU_DIRTY_PAGES can't tell which pages were written, so
+ * vfio_listener_log_sync() then has to report all mapped RAM as dirty.
+ */
+static void vfio_listener_log_global_start(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    int ret = -ENOTTY;
+
+    if (container->iommu_type == VFIO_TYPE1_IOMMU ||
+        container->iommu_type == VFIO_TYPE1v2_IOMMU) {
+        ret = vfio_dirty_pages_ioctl(container,
+                                     VFIO_IOMMU_DIRTY_PAGES_FLAG_START);
+    }
+
+    container->dirty_tracking = true;
+    container->dirty_pages_supported = !ret;
+    trace_vfio_listener_log_global_start(container->fd, ret);
+}
+
+static void vfio_listener_log_global_stop(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+
+    if (container->dirty_pages_supported) {
+        vfio_dirty_pages_ioctl(container, VFIO_IOMMU_DIRTY_PAGES_FLAG_STOP);
+    }
+
+    container->dirty_tracking = false;
+    container->dirty_pages_supported = false;
+}
+
+static int vfio_get_dirty_bitmap(VFIOContainer *container, hwaddr iova,
+                                 uint64_t size, ram_addr_t ram_addr)
+{
+    struct vfio_iommu_type1_dirty_bitmap *dbitmap;
+    struct vfio_iommu_type1_dirty_bitmap_get *range;
+    uint64_t pages = size / qemu_real_host_page_size;
+    unsigned long *bitmap;
+    int ret = 0;
+
+    dbitmap = g_malloc0(sizeof(*dbitmap) + sizeof(*range));
+    dbitmap->argsz = sizeof(*dbitmap) + sizeof(*range);
+    dbitmap->flags = VFIO_IOMMU_DIRTY_PAGES_FLAG_GET_BITMAP;
+    range = (struct vfio_iommu_type1_dirty_bitmap_get *)&dbitmap->data;
+    range->iova = iova;
+    range->size = size;
+
+    /* The kernel fills in whole 64-bit words */
+    bitmap = bitmap_new(ROUND_UP(pages, 64));
+    range->bitmap.pgsize = qemu_real_host_page_size;
+    range->bitmap.size = ROUND_UP(pages, 64) / BITS_PER_BYTE;
+    range->bitmap.data = (__u64 *)bitmap;
+
+    if (ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, dbitmap)) {
+        ret = -errno;
+        error_report("Failed to get dirty bitmap for iova: 0x%"HWADDR_PRIx
+                     " size: 0x%"PRIx64": %s", iova, size, strerror(errno));
+    } else {
+        cpu_physical_memory_set_dirty_lebitmap(bitmap, ram_addr, pages);
+    }
+
+    g_free(bitmap);
+    g_free(dbitmap);
+    return ret;
+}
+
+/*
+ * Merge the pages of @section that were written by device DMA into the
+ * dirty bitmap of guest RAM.
+ */
+static void vfio_listener_log_sync(MemoryListener *listener,
+                                   MemoryRegionSection *section)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer, listener);
+    hwaddr iova;
+    Int128 llend;
+    uint64_t size;
+    ram_addr_t ram_addr;
+
+    /* Also called for VGA dirty logging, which VFIO does not take part in */
+    if (!container->dirty_tracking ||
+        vfio_listener_skipped_section(section) ||
+        memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    iova = TARGET_PAGE_ALIGN(section->offset_within_address_space);
+    llend = int128_make64(section->offset_within_address_space);
+    llend = int128_add(llend, section->size);
+    llend = int128_and(llend, int128_exts64(TARGET_PAGE_MASK));
+    if (int128_ge(int128_make64(iova), llend)) {
+        return;
+    }
+    size = int128_get64(int128_sub(llend, int128_make64(iova)));
+
+    ram_addr = memory_region_get_ram_addr(section->mr) +
+               section->offset_within_region +
+               (iova - section->offset_within_address_space);
+
+    trace_vfio_listener_log_sync(iova, iova + size - 1,
+                                 container->dirty_pages_supported);
+
+    if (!container->dirty_pages_supported ||
+        vfio_get_dirty_bitmap(container, iova, size, ram_addr)) {
+        cpu_physical_memory_set_dirty_range(ram_addr, size,
+                                            tcg_enabled() ? DIRTY_CLIENTS_ALL
+                                            : DIRTY_CLIENTS_NOCODE);
+    }
+}
+
 static const MemoryListener vfio_memory_listener = {
+    .begin = vfio_listener_begin,
+    .commit = vfio_listener_commit,
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
+    .log_global_start = vfio_listener_log_global_start,
+    .log_global_stop = vfio_listener_log_global_stop,
+    .log_sync = vfio_listener_log_sync,
 };
 
 static void vfio_listener_release(VFIOContainer *container)
@@ -967,6 +1231,7 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
     container = g_malloc0(sizeof(*container));
     container->space = space;
     container->fd = fd;
+    QSIMPLEQ_INIT(&container->pending_maps);
     if (ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU) ||
         ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1v2_IOMMU)) {
         bool v2 = !!ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1v2_IOMMU);
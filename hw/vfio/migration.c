@@ -0,0 +1,450 @@
+/*
+ * Migration support for VFIO devices
+ *
+ * The device state is saved and restored through the kernel's v2
+ * migration interface: the device is moved between the states of
+ * enum vfio_device_mig_state with VFIO_DEVICE_FEATURE, and its opaque
+ * migration data is read from (STOP_COPY) or written to (RESUMING) the
+ * data_fd returned by the transition.  Pages dirtied by device DMA are
+ * reported by the container, see vfio_listener_log_sync().
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
+
+#include "hw/vfio/vfio-common.h"
+#include "hw/hw.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+/*
+ * Markers of the VFIO sections of the migration stream.  The device's own
+ * data is sent in DEV_DATA_STATE chunks, followed by one DEV_CONFIG_STATE
+ * with the emulated state (e.g. PCI config space) of the QEMU device.
+ */
+#define VFIO_MIG_FLAG_END_OF_STATE      (0xffffffffef100001ULL)
+#define VFIO_MIG_FLAG_DEV_CONFIG_STATE  (0xffffffffef100002ULL)
+#define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100003ULL)
+#define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100004ULL)
+
+/* Size of the chunks the device data is copied in */
+#define VFIO_MIG_DATA_BUFFER_SIZE (1 * 1024 * 1024)
+
+static const char *mig_state_to_str(uint32_t state)
+{
+    switch (state) {
+    case VFIO_DEVICE_STATE_ERROR:
+        return "ERROR";
+    case VFIO_DEVICE_STATE_STOP:
+        return "STOP";
+    case VFIO_DEVICE_STATE_RUNNING:
+        return "RUNNING";
+    case VFIO_DEVICE_STATE_STOP_COPY:
+        return "STOP_COPY";
+    case VFIO_DEVICE_STATE_RESUMING:
+        return "RESUMING";
+    default:
+        return "UNKNOWN STATE";
+    }
+}
+
+/*
+ * Move the device to @new_state.  If that fails, try to move it to
+ * @recover_state instead, and reset the device if even that fails.
+ */
+static int vfio_migration_set_state(VFIODevice *vbasedev, uint32_t new_state,
+                                    uint32_t recover_state)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+                              sizeof(struct vfio_device_feature_mig_state),
+                              sizeof(uint64_t))] = {};
+    struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+    struct vfio_device_feature_mig_state *mig_state =
+        (struct vfio_device_feature_mig_state *)feature->data;
+    int ret;
+
+    feature->argsz = sizeof(buf);
+    feature->flags =
+        VFIO_DEVICE_FEATURE_SET | VFIO_DEVICE_FEATURE_MIG_DEVICE_STATE;
+    mig_state->device_state = new_state;
+    if (ioctl(vbasedev->fd, VFIO_DEVICE_FEATURE, feature)) {
+        ret = -errno;
+        error_report("%s: Failed changing device state to %s: %s",
+                     vbasedev->name, mig_state_to_str(new_state),
+                     strerror(errno));
+
+        mig_state->device_state = recover_state;
+        if (ioctl(vbasedev->fd, VFIO_DEVICE_FEATURE, feature)) {
+            error_report("%s: Failed changing device state to %s: %s, "
+                         "resetting the device", vbasedev->name,
+                         mig_state_to_str(recover_state), strerror(errno));
+            if (ioctl(vbasedev->fd, VFIO_DEVICE_RESET)) {
+                hw_error("%s: Failed resetting device: %s",
+                         vbasedev->name, strerror(errno));
+            }
+            migration->device_state = VFIO_DEVICE_STATE_RUNNING;
+        } else {
+            migration->device_state = recover_state;
+        }
+        return ret;
+    }
+
+    migration->device_state = new_state;
+    if (mig_state->data_fd != -1) {
+        if (migration->data_fd != -1) {
+            /* A transfer session is already open, this one can't be used */
+            close(mig_state->data_fd);
+            error_report("%s: data_fd out of sync", vbasedev->name);
+            return -EBADF;
+        }
+
+        migration->data_fd = mig_state->data_fd;
+    }
+
+    trace_vfio_migration_set_state(vbasedev->name,
+                                   mig_state_to_str(new_state));
+
+    return 0;
+}
+
+static void vfio_migration_close_data_fd(VFIOMigration *migration)
+{
+    if (migration->data_fd != -1) {
+        close(migration->data_fd);
+        migration->data_fd = -1;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static int vfio_save_setup(QEMUFile *f, void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOContainer *container = vbasedev->group->container;
+
+    if (migrate_postcopy_ram()) {
+        error_report("%s: VFIO migration is not compatible with postcopy",
+                     vbasedev->name);
+        return -EINVAL;
+    }
+
+    /* Dirty pages are only tracked for directly mapped guest RAM */
+    if (!QLIST_EMPTY(&container->giommu_list)) {
+        error_report("%s: VFIO migration is not supported with a vIOMMU",
+                     vbasedev->name);
+        return -EINVAL;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_SETUP_STATE);
+    qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+
+    trace_vfio_save_setup(vbasedev->name);
+
+    return qemu_file_get_error(f);
+}
+
+/* Returns the size of the chunk that was sent, 0 at the end of the data */
+static ssize_t vfio_save_block(QEMUFile *f, VFIOMigration *migration)
+{
+    ssize_t data_size;
+
+    do {
+        data_size = read(migration->data_fd, migration->data_buffer,
+                         migration->data_buffer_size);
+    } while (data_size < 0 && errno == EINTR);
+
+    if (data_size < 0) {
+        return -errno;
+    }
+    if (data_size == 0) {
+        return 0;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
+    qemu_put_be64(f, data_size);
+    qemu_put_buffer(f, migration->data_buffer, data_size);
+
+    return data_size;
+}
+
+/*
+ * Runs with the VM stopped, so vfio_vmstate_change() has already moved the
+ * device to STOP and no more pages are dirtied by its DMA.
+ */
+static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t total = 0;
+    ssize_t data_size;
+    int ret;
+
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP_COPY,
+                                   VFIO_DEVICE_STATE_STOP);
+    if (ret) {
+        return ret;
+    }
+
+    do {
+        data_size = vfio_save_block(f, migration);
+        if (data_size < 0) {
+            error_report("%s: Failed reading migration data: %s",
+                         vbasedev->name, strerror(-data_size));
+            ret = data_size;
+            break;
+        }
+        total += data_size;
+    } while (data_size);
+
+    vfio_migration_close_data_fd(migration);
+    if (ret) {
+        vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP,
+                                 VFIO_DEVICE_STATE_ERROR);
+        return ret;
+    }
+
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP,
+                                   VFIO_DEVICE_STATE_ERROR);
+    if (ret) {
+        return ret;
+    }
+
+    qemu_put_be64(f, VFIO_MIG_FLAG_DEV_CONFIG_STATE);
+    vbasedev->ops->vfio_save_config(vbasedev, f);
+    qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
+
+    trace_vfio_save_complete_precopy(vbasedev->name, total);
+
+    return qemu_file_get_error(f);
+}
+
+static int vfio_load_buffer(QEMUFile *f, VFIODevice *vbasedev,
+                            uint64_t data_size)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    while (data_size) {
+        size_t len = MIN(data_size, migration->data_buffer_size);
+        size_t done = 0;
+
+        if (qemu_get_buffer(f, migration->data_buffer, len) != len) {
+            return -EIO;
+        }
+
+        while (done < len) {
+            ssize_t ret = write(migration->data_fd,
+                                migration->data_buffer + done, len - done);
+
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error_report("%s: Failed writing migration data: %s",
+                             vbasedev->name, strerror(errno));
+                return -errno;
+            }
+            done += ret;
+        }
+        data_size -= len;
+    }
+
+    return 0;
+}
+
+static int vfio_load_state(QEMUFile *f, void *opaque, int version_id)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    uint64_t data;
+    int ret = 0;
+
+    data = qemu_get_be64(f);
+    while (data != VFIO_MIG_FLAG_END_OF_STATE) {
+        trace_vfio_load_state(vbasedev->name, data);
+
+        switch (data) {
+        case VFIO_MIG_FLAG_DEV_SETUP_STATE:
+            ret = vfio_migration_set_state(vbasedev,
+                                           VFIO_DEVICE_STATE_RESUMING,
+                                           migration->device_state);
+            break;
+        case VFIO_MIG_FLAG_DEV_DATA_STATE:
+            if (migration->device_state != VFIO_DEVICE_STATE_RESUMING) {
+                error_report("%s: Migration data received out of order",
+                             vbasedev->name);
+                return -EINVAL;
+            }
+            ret = vfio_load_buffer(f, vbasedev, qemu_get_be64(f));
+            break;
+        case VFIO_MIG_FLAG_DEV_CONFIG_STATE:
+            /* All of the device's own data has been written by now */
+            vfio_migration_close_data_fd(migration);
+            ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP,
+                                           VFIO_DEVICE_STATE_ERROR);
+            if (!ret) {
+                ret = vbasedev->ops->vfio_load_config(vbasedev, f);
+            }
+            break;
+        default:
+            error_report("%s: Unknown tag 0x%"PRIx64, vbasedev->name, data);
+            return -EINVAL;
+        }
+
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+        if (ret) {
+            return ret;
+        }
+        data = qemu_get_be64(f);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static SaveVMHandlers savevm_vfio_handlers = {
+    .save_live_setup = vfio_save_setup,
+    .save_live_complete_precopy = vfio_save_complete_precopy,
+    .load_state = vfio_load_state,
+};
+
+/* ---------------------------------------------------------------------- */
+
+static void vfio_vmstate_change(void *opaque, int running, RunState state)
+{
+    VFIODevice *vbasedev = opaque;
+    uint32_t new_state;
+
+    new_state = running ? VFIO_DEVICE_STATE_RUNNING : VFIO_DEVICE_STATE_STOP;
+    if (vbasedev->migration->device_state == new_state) {
+        return;
+    }
+
+    /*
+     * A failure leaves the device reset, or in the state it was in; the
+     * error has been reported, and there is nobody to return it to.
+     */
+    vfio_migration_set_state(vbasedev, new_state, VFIO_DEVICE_STATE_ERROR);
+    trace_vfio_vmstate_change(vbasedev->name, running, RunState_lookup[state],
+                              mig_state_to_str(new_state));
+}
+
+static int vfio_migration_query_flags(VFIODevice *vbasedev,
+                                      uint64_t *mig_flags)
+{
+    uint64_t buf[DIV_ROUND_UP(sizeof(struct vfio_device_feature) +
+                              sizeof(struct vfio_device_feature_migration),
+                              sizeof(uint64_t))] = {};
+    struct vfio_device_feature *feature = (struct vfio_device_feature *)buf;
+    struct vfio_device_feature_migration *mig =
+        (struct vfio_device_feature_migration *)feature->data;
+
+    feature->argsz = sizeof(buf);
+    feature->flags = VFIO_DEVICE_FEATURE_GET | VFIO_DEVICE_FEATURE_MIGRATION;
+    if (ioctl(vbasedev->fd, VFIO_DEVICE_FEATURE, feature)) {
+        return -errno;
+    }
+
+    *mig_flags = mig->flags;
+
+    return 0;
+}
+
+static int vfio_migration_init(VFIODevice *vbasedev, DeviceState *dev)
+{
+    VFIOMigration *migration;
+    uint64_t mig_flags = 0;
+    int ret;
+
+    if (!vbasedev->ops->vfio_save_config || !vbasedev->ops->vfio_load_config) {
+        return -EINVAL;
+    }
+
+    ret = vfio_migration_query_flags(vbasedev, &mig_flags);
+    if (ret) {
+        return ret;
+    }
+
+    /* Basic migration functionality must be supported */
+    if (!(mig_flags & VFIO_MIGRATION_STOP_COPY)) {
+        return -EOPNOTSUPP;
+    }
+
+    migration = g_new0(VFIOMigration, 1);
+    migration->vbasedev = vbasedev;
+    migration->dev = dev;
+    migration->device_state = VFIO_DEVICE_STATE_RUNNING;
+    migration->data_fd = -1;
+    migration->data_buffer_size = VFIO_MIG_DATA_BUFFER_SIZE;
+    migration->data_buffer = g_malloc(migration->data_buffer_size);
+    vbasedev->migration = migration;
+
+    register_savevm_live(dev, "vfio", -1, 1, &savevm_vfio_handlers, vbasedev);
+    migration->vm_state = qemu_add_vm_change_state_handler(vfio_vmstate_change,
+                                                           vbasedev);
+
+    return 0;
+}
+
+/*
+ * vfio_migration_probe:
+ *
+ * Set up migration for @vbasedev if its kernel driver supports it, and
+ * block migration otherwise.  Fails only if the blocker can't be added,
+ * e.g. because a migration is in progress.
+ */
+int vfio_migration_probe(VFIODevice *vbasedev, DeviceState *dev,
+                         Error **errp)
+{
+    Error *local_err = NULL;
+    int ret = -ENOTSUP;
+
+    if (vbasedev->enable_migration) {
+        ret = vfio_migration_init(vbasedev, dev);
+    }
+    trace_vfio_migration_probe(vbasedev->name, ret);
+    if (!ret) {
+        return 0;
+    }
+
+    error_setg(&vbasedev->migration_blocker,
+               "VFIO device %s doesn't support migration", vbasedev->name);
+    ret = migrate_add_blocker(vbasedev->migration_blocker, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        error_free(vbasedev->migration_blocker);
+        vbasedev->migration_blocker = NULL;
+    }
+
+    return ret;
+}
+
+void vfio_migration_finalize(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    if (migration) {
+        qemu_del_vm_change_state_handler(migration->vm_state);
+        unregister_savevm(migration->dev, "vfio", vbasedev);
+        vfio_migration_close_data_fd(migration);
+        g_free(migration->data_buffer);
+        g_free(migration);
+        vbasedev->migration = NULL;
+    }
+
+    if (vbasedev->migration_blocker) {
+        migrate_del_blocker(vbasedev->migration_blocker);
+        error_free(vbasedev->migration_blocker);
+        vbasedev->migration_blocker = NULL;
+    }
+}
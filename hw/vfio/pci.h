@@ -15,6 +15,7 @@
 #include "qemu-common.h"
 #include "exec/memory.h"
 #include "hw/pci/pci.h"
+#include "hw/pci/msi.h"
 #include "hw/vfio/vfio-common.h"
 #include "qemu/event_notifier.h"
 #include "qemu/queue.h"
@@ -77,6 +78,14 @@ typedef struct VFIOMSIVector {
     struct VFIOPCIDevice *vdev; /* back pointer to device */
     int virq;
     bool use;
+    /*
+     * Last message programmed into the KVM route, and the handler of the
+     * QEMU path.  Guests that mask and unmask on every interrupt send the
+     * same ones each time, so they are only pushed down when they change.
+     */
+    bool msg_valid;
+    MSIMessage msg;
+    void (*handler)(void *opaque);
 } VFIOMSIVector;
 
 enum {
@@ -0,0 +1,498 @@
+/*
+ * Vhost-user filesystem virtio device
+ *
+ * The FUSE requests are handled by an external vhost-user daemon such
+ * as virtiofsd.  QEMU only sets up the virtqueues and, if a DAX window
+ * is configured, maps file ranges into it on behalf of the daemon.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include "standard-headers/linux/virtio_fs.h"
+#include "qapi/error.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/vhost-user-fs.h"
+#include "trace.h"
+
+#define VHOST_USER_FS_TAG_LEN sizeof(((struct virtio_fs_config *)0)->tag)
+
+static const int user_feature_bits[] = {
+    VIRTIO_F_NOTIFY_ON_EMPTY,
+    VIRTIO_RING_F_INDIRECT_DESC,
+    VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_VERSION_1,
+    VHOST_INVALID_FEATURE_BIT
+};
+
+static VHostUserFS *vhost_user_fs_from_dev(struct vhost_dev *dev)
+{
+    if (!dev->vdev ||
+        !object_dynamic_cast(OBJECT(dev->vdev), TYPE_VHOST_USER_FS)) {
+        return NULL;
+    }
+    return VHOST_USER_FS(dev->vdev);
+}
+
+/* Check that [offset, offset + len) lies within the DAX window */
+static bool vhost_user_fs_cache_range_ok(VHostUserFS *fs, uint64_t offset,
+                                         uint64_t len)
+{
+    return offset < fs->conf.cache_size &&
+           len <= fs->conf.cache_size - offset &&
+           QEMU_IS_ALIGNED(offset | len, getpagesize());
+}
+
+int vhost_user_fs_slave_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
+                            int fd)
+{
+    VHostUserFS *fs = vhost_user_fs_from_dev(dev);
+    unsigned int i;
+    int ret = 0;
+
+    if (!fs || !fs->cache_ptr) {
+        error_report("vhost-user-fs: map request without a DAX window");
+        return -EINVAL;
+    }
+    if (fd < 0) {
+        error_report("vhost-user-fs: map request without a file descriptor");
+        return -EBADF;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        int prot = 0;
+        void *ptr;
+
+        if (sm->len[i] == 0) {
+            continue;
+        }
+        if (!vhost_user_fs_cache_range_ok(fs, sm->c_offset[i], sm->len[i])) {
+            error_report("vhost-user-fs: bad map range %" PRIx64
+                         "+%" PRIx64, sm->c_offset[i], sm->len[i]);
+            ret = -EINVAL;
+            break;
+        }
+
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_R) {
+            prot |= PROT_READ;
+        }
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_W) {
+            prot |= PROT_WRITE;
+        }
+
+        ptr = mmap(fs->cache_ptr + sm->c_offset[i], sm->len[i], prot,
+                   MAP_SHARED | MAP_FIXED, fd, sm->fd_offset[i]);
+        if (ptr == MAP_FAILED) {
+            ret = -errno;
+            error_report("vhost-user-fs: map failed: %s", strerror(errno));
+            break;
+        }
+        trace_vhost_user_fs_map(sm->c_offset[i], sm->len[i], sm->fd_offset[i],
+                                sm->flags[i]);
+    }
+
+    if (ret) {
+        /* Don't leave a partially mapped request behind */
+        while (i-- > 0) {
+            if (sm->len[i]) {
+                mmap(fs->cache_ptr + sm->c_offset[i], sm->len[i], PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            }
+        }
+    }
+    return ret;
+}
+
+int vhost_user_fs_slave_unmap(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
+{
+    VHostUserFS *fs = vhost_user_fs_from_dev(dev);
+    unsigned int i;
+    int ret = 0;
+
+    if (!fs || !fs->cache_ptr) {
+        error_report("vhost-user-fs: unmap request without a DAX window");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        uint64_t offset = sm->c_offset[i];
+        uint64_t len = sm->len[i];
+        void *ptr;
+
+        if (len == 0) {
+            continue;
+        }
+        /* ~0 means the whole window */
+        if (len == ~(uint64_t)0) {
+            offset = 0;
+            len = fs->conf.cache_size;
+        }
+        if (!vhost_user_fs_cache_range_ok(fs, offset, len)) {
+            error_report("vhost-user-fs: bad unmap range %" PRIx64
+                         "+%" PRIx64, offset, len);
+            ret = -EINVAL;
+            continue;
+        }
+
+        ptr = mmap(fs->cache_ptr + offset, len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (ptr == MAP_FAILED) {
+            ret = -errno;
+            error_report("vhost-user-fs: unmap failed: %s", strerror(errno));
+            continue;
+        }
+        trace_vhost_user_fs_unmap(offset, len);
+    }
+    return ret;
+}
+
+int vhost_user_fs_slave_sync(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
+{
+    VHostUserFS *fs = vhost_user_fs_from_dev(dev);
+    unsigned int i;
+    int ret = 0;
+
+    if (!fs || !fs->cache_ptr) {
+        error_report("vhost-user-fs: sync request without a DAX window");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        if (sm->len[i] == 0) {
+            continue;
+        }
+        if (!vhost_user_fs_cache_range_ok(fs, sm->c_offset[i], sm->len[i])) {
+            ret = -EINVAL;
+            continue;
+        }
+        if (msync(fs->cache_ptr + sm->c_offset[i], sm->len[i], MS_SYNC)) {
+            ret = -errno;
+            error_report("vhost-user-fs: msync failed: %s", strerror(errno));
+        }
+    }
+    return ret;
+}
+
+static void vhost_user_fs_get_config(VirtIODevice *vdev, uint8_t *config)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    struct virtio_fs_config fscfg = {};
+
+    memcpy(fscfg.tag, fs->conf.tag,
+           MIN(strlen(fs->conf.tag), sizeof(fscfg.tag)));
+    virtio_stl_p(vdev, &fscfg.num_request_queues,
+                 fs->conf.num_request_queues);
+    memcpy(config, &fscfg, sizeof(fscfg));
+}
+
+static void vhost_user_fs_start(VirtIODevice *vdev)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int ret;
+    int i;
+
+    if (!k->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return;
+    }
+
+    ret = vhost_dev_enable_notifiers(&fs->vhost_dev, vdev);
+    if (ret < 0) {
+        error_report("Error enabling host notifiers: %d", -ret);
+        return;
+    }
+
+    ret = k->set_guest_notifiers(qbus->parent, fs->vhost_dev.nvqs, true);
+    if (ret < 0) {
+        error_report("Error binding guest notifier: %d", -ret);
+        goto err_host_notifiers;
+    }
+
+    fs->vhost_dev.acked_features = vdev->guest_features;
+    ret = vhost_dev_start(&fs->vhost_dev, vdev);
+    if (ret < 0) {
+        error_report("Error starting vhost: %d", -ret);
+        goto err_guest_notifiers;
+    }
+
+    /* guest_notifier_mask/pending not used yet, so just unmask
+     * everything here.  virtio-pci will do the right thing by
+     * enabling/disabling irqfd.
+     */
+    for (i = 0; i < fs->vhost_dev.nvqs; i++) {
+        vhost_virtqueue_mask(&fs->vhost_dev, vdev, i, false);
+    }
+
+    return;
+
+err_guest_notifiers:
+    k->set_guest_notifiers(qbus->parent, fs->vhost_dev.nvqs, false);
+err_host_notifiers:
+    vhost_dev_disable_notifiers(&fs->vhost_dev, vdev);
+}
+
+static void vhost_user_fs_stop(VirtIODevice *vdev)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int ret;
+
+    if (!k->set_guest_notifiers) {
+        return;
+    }
+
+    vhost_dev_stop(&fs->vhost_dev, vdev);
+
+    ret = k->set_guest_notifiers(qbus->parent, fs->vhost_dev.nvqs, false);
+    if (ret < 0) {
+        error_report("vhost guest notifier cleanup failed: %d", ret);
+        return;
+    }
+
+    vhost_dev_disable_notifiers(&fs->vhost_dev, vdev);
+}
+
+static void vhost_user_fs_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+    bool should_start = status & VIRTIO_CONFIG_S_DRIVER_OK;
+
+    if (!vdev->vm_running) {
+        should_start = false;
+    }
+
+    if (fs->vhost_dev.started == should_start) {
+        return;
+    }
+
+    if (should_start) {
+        vhost_user_fs_start(vdev);
+    } else {
+        vhost_user_fs_stop(vdev);
+    }
+}
+
+static void vhost_user_fs_reset(VirtIODevice *vdev)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+
+    /* The driver forgets all its mappings across a reset */
+    if (fs->cache_ptr) {
+        mmap(fs->cache_ptr, fs->conf.cache_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+}
+
+static uint64_t vhost_user_fs_get_features(VirtIODevice *vdev,
+                                           uint64_t requested_features,
+                                           Error **errp)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+
+    return vhost_get_features(&fs->vhost_dev, user_feature_bits,
+                              requested_features);
+}
+
+static void vhost_user_fs_handle_output(VirtIODevice *vdev, VirtQueue *vq)
+{
+    /* The queues are processed by the vhost-user daemon */
+}
+
+static void vhost_user_fs_guest_notifier_mask(VirtIODevice *vdev, int idx,
+                                              bool mask)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+
+    vhost_virtqueue_mask(&fs->vhost_dev, vdev, idx, mask);
+}
+
+static bool vhost_user_fs_guest_notifier_pending(VirtIODevice *vdev, int idx)
+{
+    VHostUserFS *fs = VHOST_USER_FS(vdev);
+
+    return vhost_virtqueue_pending(&fs->vhost_dev, idx);
+}
+
+static void vhost_user_fs_device_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserFS *fs = VHOST_USER_FS(dev);
+    unsigned int i;
+    size_t len;
+    int ret;
+
+    if (!qemu_chr_fe_get_driver(&fs->conf.chardev)) {
+        error_setg(errp, "missing chardev");
+        return;
+    }
+
+    if (!fs->conf.tag) {
+        error_setg(errp, "missing tag property");
+        return;
+    }
+    len = strlen(fs->conf.tag);
+    if (len == 0) {
+        error_setg(errp, "tag property cannot be empty");
+        return;
+    }
+    if (len > VHOST_USER_FS_TAG_LEN) {
+        error_setg(errp, "tag property must be %zu bytes or less",
+                   VHOST_USER_FS_TAG_LEN);
+        return;
+    }
+
+    if (fs->conf.num_request_queues == 0) {
+        error_setg(errp, "num-request-queues property must be larger than 0");
+        return;
+    }
+    /* One high priority queue plus the request queues */
+    if (fs->conf.num_request_queues + 1 > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-request-queues property must be less than %u",
+                   VIRTIO_QUEUE_MAX);
+        return;
+    }
+
+    if (!is_power_of_2(fs->conf.queue_size)) {
+        error_setg(errp, "queue-size property must be a power of 2");
+        return;
+    }
+    if (fs->conf.queue_size > VIRTQUEUE_MAX_SIZE) {
+        error_setg(errp, "queue-size property must be %u or smaller",
+                   VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
+    if (fs->conf.cache_size &&
+        (!is_power_of_2(fs->conf.cache_size) ||
+         fs->conf.cache_size < getpagesize())) {
+        error_setg(errp, "cache-size property must be a power of 2 "
+                   "no smaller than the page size");
+        return;
+    }
+
+    if (fs->conf.cache_size) {
+        /*
+         * Reserve the address space; the daemon asks us to mmap() file
+         * ranges over it with VHOST_USER_SLAVE_FS_MAP.
+         */
+        fs->cache_ptr = mmap(NULL, fs->conf.cache_size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (fs->cache_ptr == MAP_FAILED) {
+            error_setg_errno(errp, errno, "unable to reserve DAX window");
+            fs->cache_ptr = NULL;
+            return;
+        }
+        memory_region_init_ram_ptr(&fs->cache, OBJECT(vdev),
+                                   "virtio-fs-cache", fs->conf.cache_size,
+                                   fs->cache_ptr);
+    }
+
+    virtio_init(vdev, "vhost-user-fs", VIRTIO_ID_FS,
+                sizeof(struct virtio_fs_config));
+
+    /* Hiprio queue */
+    virtio_add_queue(vdev, fs->conf.queue_size, vhost_user_fs_handle_output);
+
+    /* Request queues */
+    for (i = 0; i < fs->conf.num_request_queues; i++) {
+        virtio_add_queue(vdev, fs->conf.queue_size,
+                         vhost_user_fs_handle_output);
+    }
+
+    fs->vhost_dev.nvqs = 1 + fs->conf.num_request_queues;
+    fs->vhost_vqs = g_new0(struct vhost_virtqueue, fs->vhost_dev.nvqs);
+    fs->vhost_dev.vqs = fs->vhost_vqs;
+    ret = vhost_dev_init(&fs->vhost_dev, &fs->conf.chardev,
+                         VHOST_BACKEND_TYPE_USER, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "vhost_dev_init failed");
+        goto err_virtio;
+    }
+
+    return;
+
+err_virtio:
+    g_free(fs->vhost_vqs);
+    fs->vhost_vqs = NULL;
+    virtio_cleanup(vdev);
+    if (fs->cache_ptr) {
+        object_unparent(OBJECT(&fs->cache));
+        munmap(fs->cache_ptr, fs->conf.cache_size);
+        fs->cache_ptr = NULL;
+    }
+}
+
+static void vhost_user_fs_device_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VHostUserFS *fs = VHOST_USER_FS(dev);
+
+    /* This will stop vhost backend if appropriate. */
+    vhost_user_fs_set_status(vdev, 0);
+
+    vhost_dev_cleanup(&fs->vhost_dev);
+    g_free(fs->vhost_vqs);
+    fs->vhost_vqs = NULL;
+    virtio_cleanup(vdev);
+
+    if (fs->cache_ptr) {
+        object_unparent(OBJECT(&fs->cache));
+        munmap(fs->cache_ptr, fs->conf.cache_size);
+        fs->cache_ptr = NULL;
+    }
+}
+
+static const VMStateDescription vmstate_vhost_user_fs = {
+    .name = "vhost-user-fs",
+    .unmigratable = 1,
+};
+
+static Property vhost_user_fs_properties[] = {
+    DEFINE_PROP_CHR("chardev", VHostUserFS, conf.chardev),
+    DEFINE_PROP_STRING("tag", VHostUserFS, conf.tag),
+    DEFINE_PROP_UINT16("num-request-queues", VHostUserFS,
+                       conf.num_request_queues, 1),
+    DEFINE_PROP_UINT16("queue-size", VHostUserFS, conf.queue_size, 128),
+    DEFINE_PROP_SIZE("cache-size", VHostUserFS, conf.cache_size, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_fs_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = vhost_user_fs_properties;
+    dc->vmsd = &vmstate_vhost_user_fs;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    vdc->realize = vhost_user_fs_device_realize;
+    vdc->unrealize = vhost_user_fs_device_unrealize;
+    vdc->get_features = vhost_user_fs_get_features;
+    vdc->get_config = vhost_user_fs_get_config;
+    vdc->set_status = vhost_user_fs_set_status;
+    vdc->reset = vhost_user_fs_reset;
+    vdc->guest_notifier_mask = vhost_user_fs_guest_notifier_mask;
+    vdc->guest_notifier_pending = vhost_user_fs_guest_notifier_pending;
+}
+
+static const TypeInfo vhost_user_fs_info = {
+    .name = TYPE_VHOST_USER_FS,
+    .parent = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VHostUserFS),
+    .class_init = vhost_user_fs_class_init,
+};
+
+static void vhost_user_fs_register_types(void)
+{
+    type_register_static(&vhost_user_fs_info);
+}
+
+type_init(vhost_user_fs_register_types)
@@ -12,10 +12,12 @@
 #include "qapi/error.h"
 #include "hw/virtio/vhost.h"
 #include "hw/virtio/vhost-backend.h"
+#include "hw/virtio/vhost-user-fs.h"
 #include "hw/virtio/virtio-net.h"
 #include "sysemu/char.h"
 #include "sysemu/kvm.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 
@@ -27,17 +29,25 @@
 #define VHOST_MEMORY_MAX_NREGIONS    8
 #define VHOST_USER_F_PROTOCOL_FEATURES 30
 
+/* Upper bound on memory slots with VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS */
+#define VHOST_USER_MAX_RAM_SLOTS 512
+
 enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_MQ = 0,
     VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
     VHOST_USER_PROTOCOL_F_RARP = 2,
     VHOST_USER_PROTOCOL_F_REPLY_ACK = 3,
     VHOST_USER_PROTOCOL_F_NET_MTU = 4,
+    VHOST_USER_PROTOCOL_F_SLAVE_REQ = 5,
+    /* Bits 6-14 belong to features that QEMU does not implement */
+    VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
 
-#define VHOST_USER_PROTOCOL_FEATURE_MASK ((1 << VHOST_USER_PROTOCOL_F_MAX) - 1)
+#define VHOST_USER_PROTOCOL_FEATURE_MASK \
+    (((1ULL << (VHOST_USER_PROTOCOL_F_SLAVE_REQ + 1)) - 1) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -61,9 +71,23 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_SEND_RARP = 19,
     VHOST_USER_NET_SET_MTU = 20,
+    VHOST_USER_SET_SLAVE_REQ_FD = 21,
+    VHOST_USER_GET_MAX_MEM_SLOTS = 36,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
+/* Requests sent by the slave on the VHOST_USER_SET_SLAVE_REQ_FD channel */
+typedef enum VhostUserSlaveRequest {
+    VHOST_USER_SLAVE_NONE = 0,
+    /* Ids 1-5 belong to requests that QEMU does not implement */
+    VHOST_USER_SLAVE_FS_MAP = 6,
+    VHOST_USER_SLAVE_FS_UNMAP = 7,
+    VHOST_USER_SLAVE_FS_SYNC = 8,
+    VHOST_USER_SLAVE_MAX
+} VhostUserSlaveRequest;
+
 typedef struct VhostUserMemoryRegion {
     uint64_t guest_phys_addr;
     uint64_t memory_size;
@@ -77,6 +101,11 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserLog {
     uint64_t mmap_size;
     uint64_t mmap_offset;
@@ -97,7 +126,9 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
         VhostUserLog log;
+        VhostUserFSSlaveMsg fs;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -111,6 +142,18 @@ static VhostUserMsg m __attribute__ ((unused));
 /* The version of the protocol we support */
 #define VHOST_USER_VERSION    (0x1)
 
+struct vhost_user {
+    CharBackend *chr;
+    /* Memory slots the slave accepts with CONFIGURE_MEM_SLOTS */
+    uint64_t max_slots;
+    /* Regions the slave has mapped, to send only the changes */
+    VhostUserMemoryRegion *shadow_regions;
+    int *shadow_fds;
+    int num_shadow_regions;
+    /* Our end of the VHOST_USER_PROTOCOL_F_SLAVE_REQ channel, or -1 */
+    int slave_fd;
+};
+
 static bool ioeventfd_enabled(void)
 {
     return kvm_enabled() && kvm_eventfds_enabled();
@@ -118,7 +161,8 @@ static bool ioeventfd_enabled(void)
 
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
-    CharBackend *chr = dev->opaque;
+    struct vhost_user *u = dev->opaque;
+    CharBackend *chr = u->chr;
     uint8_t *p = (uint8_t *) msg;
     int r, size = VHOST_USER_HDR_SIZE;
 
@@ -189,6 +233,8 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
     case VHOST_USER_SET_MEM_TABLE:
     case VHOST_USER_GET_QUEUE_NUM:
     case VHOST_USER_NET_SET_MTU:
+    case VHOST_USER_ADD_MEM_REG:
+    case VHOST_USER_REM_MEM_REG:
         return true;
     default:
         return false;
@@ -199,7 +245,8 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
 static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
                             int *fds, int fd_num)
 {
-    CharBackend *chr = dev->opaque;
+    struct vhost_user *u = dev->opaque;
+    CharBackend *chr = u->chr;
     int ret, size = VHOST_USER_HDR_SIZE + msg->size;
 
     /*
@@ -266,23 +313,16 @@ static int vhost_user_set_log_base(struct vhost_dev *dev, uint64_t base,
     return 0;
 }
 
-static int vhost_user_set_mem_table(struct vhost_dev *dev,
-                                    struct vhost_memory *mem)
+/*
+ * Describe the fd-backed regions of dev->mem in @regions and @fds, which
+ * have room for @max entries.  Returns the number of regions.
+ */
+static int vhost_user_fill_regions(struct vhost_dev *dev,
+                                   VhostUserMemoryRegion *regions,
+                                   int *fds, int max)
 {
-    int fds[VHOST_MEMORY_MAX_NREGIONS];
     int i, fd;
-    size_t fd_num = 0;
-    bool reply_supported = virtio_has_feature(dev->protocol_features,
-                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
-
-    VhostUserMsg msg = {
-        .request = VHOST_USER_SET_MEM_TABLE,
-        .flags = VHOST_USER_VERSION,
-    };
-
-    if (reply_supported) {
-        msg.flags |= VHOST_USER_NEED_REPLY_MASK;
-    }
+    int fd_num = 0;
 
     for (i = 0; i < dev->mem->nregions; ++i) {
         struct vhost_memory_region *reg = dev->mem->regions + i;
@@ -294,15 +334,157 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
                                      &offset);
         fd = memory_region_get_fd(mr);
         if (fd > 0) {
-            msg.payload.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
-            msg.payload.memory.regions[fd_num].memory_size  = reg->memory_size;
-            msg.payload.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
-            msg.payload.memory.regions[fd_num].mmap_offset = offset;
-            assert(fd_num < VHOST_MEMORY_MAX_NREGIONS);
+            assert(fd_num < max);
+            regions[fd_num].userspace_addr = reg->userspace_addr;
+            regions[fd_num].memory_size  = reg->memory_size;
+            regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
+            regions[fd_num].mmap_offset = offset;
             fds[fd_num++] = fd;
         }
     }
 
+    return fd_num;
+}
+
+static bool vhost_user_region_equal(const VhostUserMemoryRegion *a,
+                                    const VhostUserMemoryRegion *b)
+{
+    return a->guest_phys_addr == b->guest_phys_addr &&
+           a->memory_size == b->memory_size &&
+           a->userspace_addr == b->userspace_addr &&
+           a->mmap_offset == b->mmap_offset;
+}
+
+static int vhost_user_send_mem_reg(struct vhost_dev *dev,
+                                   VhostUserRequest request,
+                                   const VhostUserMemoryRegion *reg, int fd)
+{
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .payload.mem_reg.padding = 0,
+        .payload.mem_reg.region = *reg,
+        .size = sizeof(msg.payload.mem_reg),
+    };
+
+    if (reply_supported) {
+        msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+
+    if (vhost_user_write(dev, &msg, &fd, 1) < 0) {
+        return -1;
+    }
+
+    if (reply_supported) {
+        return process_message_reply(dev, msg.request);
+    }
+
+    return 0;
+}
+
+/*
+ * With CONFIGURE_MEM_SLOTS, only tell the slave about the regions that
+ * went away or appeared since the last update, so that it does not have
+ * to remap (and stall on) everything else when a DIMM is plugged.
+ */
+static int vhost_user_add_remove_regions(struct vhost_dev *dev)
+{
+    struct vhost_user *u = dev->opaque;
+    VhostUserMemoryRegion *regions;
+    int *fds;
+    int nregions, i, j, ret = 0;
+
+    /* Shared with the other queue pairs, only the first one updates it */
+    if (dev->vq_index != 0) {
+        return 0;
+    }
+
+    regions = g_new(VhostUserMemoryRegion, u->max_slots);
+    fds = g_new(int, u->max_slots);
+    nregions = vhost_user_fill_regions(dev, regions, fds, u->max_slots);
+    if (!nregions) {
+        error_report("Failed initializing vhost-user memory map, "
+                     "consider using -object memory-backend-file share=on");
+        ret = -1;
+        goto out;
+    }
+
+    /* Remove first, so that a replacement never exceeds the slot limit */
+    for (i = 0; i < u->num_shadow_regions; ) {
+        for (j = 0; j < nregions; j++) {
+            if (vhost_user_region_equal(&u->shadow_regions[i], &regions[j])) {
+                break;
+            }
+        }
+        if (j < nregions) {
+            i++;
+            continue;
+        }
+
+        ret = vhost_user_send_mem_reg(dev, VHOST_USER_REM_MEM_REG,
+                                      &u->shadow_regions[i],
+                                      u->shadow_fds[i]);
+        if (ret < 0) {
+            goto out;
+        }
+        u->num_shadow_regions--;
+        u->shadow_regions[i] = u->shadow_regions[u->num_shadow_regions];
+        u->shadow_fds[i] = u->shadow_fds[u->num_shadow_regions];
+    }
+
+    for (j = 0; j < nregions; j++) {
+        for (i = 0; i < u->num_shadow_regions; i++) {
+            if (vhost_user_region_equal(&u->shadow_regions[i], &regions[j])) {
+                break;
+            }
+        }
+        if (i < u->num_shadow_regions) {
+            continue;
+        }
+
+        ret = vhost_user_send_mem_reg(dev, VHOST_USER_ADD_MEM_REG,
+                                      &regions[j], fds[j]);
+        if (ret < 0) {
+            goto out;
+        }
+        u->shadow_regions[u->num_shadow_regions] = regions[j];
+        u->shadow_fds[u->num_shadow_regions] = fds[j];
+        u->num_shadow_regions++;
+    }
+
+out:
+    g_free(regions);
+    g_free(fds);
+    return ret;
+}
+
+static int vhost_user_set_mem_table(struct vhost_dev *dev,
+                                    struct vhost_memory *mem)
+{
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    size_t fd_num;
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_MEM_TABLE,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (virtio_has_feature(dev->protocol_features,
+                           VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
+        return vhost_user_add_remove_regions(dev);
+    }
+
+    if (reply_supported) {
+        msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+
+    fd_num = vhost_user_fill_regions(dev, msg.payload.memory.regions, fds,
+                                     VHOST_MEMORY_MAX_NREGIONS);
+
     msg.payload.memory.nregions = fd_num;
 
     if (!fd_num) {
@@ -568,14 +750,172 @@ static int vhost_user_reset_device(struct vhost_dev *dev)
     return 0;
 }
 
+static void slave_read(void *opaque)
+{
+    struct vhost_dev *dev = opaque;
+    struct vhost_user *u = dev->opaque;
+    VhostUserMsg msg = { 0 };
+    int fd[VHOST_MEMORY_MAX_NREGIONS];
+    char control[CMSG_SPACE(sizeof(fd))];
+    struct cmsghdr *cmsg;
+    struct msghdr msgh;
+    struct iovec iov;
+    int i, fd_num = 0;
+    ssize_t size;
+    int ret = 0;
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = &msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = control;
+    msgh.msg_controllen = sizeof(control);
+
+    do {
+        size = recvmsg(u->slave_fd, &msgh, 0);
+    } while (size < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (size != VHOST_USER_HDR_SIZE) {
+        error_report("Failed to read msg header from slave.");
+        goto err;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fd, CMSG_DATA(cmsg), fd_num * sizeof(int));
+            break;
+        }
+    }
+
+    if (msgh.msg_flags & MSG_CTRUNC) {
+        error_report("Truncated ancillary data in slave msg.");
+        goto err;
+    }
+
+    if (msg.size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("Failed to read msg header from slave."
+                     " Size %d exceeds the maximum %zu.", msg.size,
+                     VHOST_USER_PAYLOAD_SIZE);
+        goto err;
+    }
+
+    do {
+        size = read(u->slave_fd, &msg.payload, msg.size);
+    } while (size < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (size != msg.size) {
+        error_report("Failed to read msg payload from slave."
+                     " Read %zd instead of %d.", size, msg.size);
+        goto err;
+    }
+
+    switch (msg.request) {
+#ifdef CONFIG_VHOST_USER_FS
+    case VHOST_USER_SLAVE_FS_MAP:
+        ret = vhost_user_fs_slave_map(dev, &msg.payload.fs,
+                                      fd_num ? fd[0] : -1);
+        break;
+    case VHOST_USER_SLAVE_FS_UNMAP:
+        ret = vhost_user_fs_slave_unmap(dev, &msg.payload.fs);
+        break;
+    case VHOST_USER_SLAVE_FS_SYNC:
+        ret = vhost_user_fs_slave_sync(dev, &msg.payload.fs);
+        break;
+#endif
+    default:
+        error_report("Received unexpected msg type %d from slave.",
+                     msg.request);
+        ret = -EINVAL;
+    }
+
+    for (i = 0; i < fd_num; i++) {
+        close(fd[i]);
+    }
+    fd_num = 0;
+
+    if (msg.flags & VHOST_USER_NEED_REPLY_MASK) {
+        msg.flags = VHOST_USER_REPLY_MASK | VHOST_USER_VERSION;
+        msg.payload.u64 = !!ret;
+        msg.size = sizeof(msg.payload.u64);
+
+        size = qemu_write_full(u->slave_fd, &msg,
+                               VHOST_USER_HDR_SIZE + msg.size);
+        if (size != VHOST_USER_HDR_SIZE + msg.size) {
+            error_report("Failed to send msg reply to slave.");
+            goto err;
+        }
+    }
+    return;
+
+err:
+    for (i = 0; i < fd_num; i++) {
+        close(fd[i]);
+    }
+    qemu_set_fd_handler(u->slave_fd, NULL, NULL, NULL);
+    close(u->slave_fd);
+    u->slave_fd = -1;
+}
+
+static int vhost_setup_slave_channel(struct vhost_dev *dev)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_SLAVE_REQ_FD,
+        .flags = VHOST_USER_VERSION,
+    };
+    struct vhost_user *u = dev->opaque;
+    bool reply_supported = virtio_has_feature(dev->protocol_features,
+                                              VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    int sv[2];
+    int ret;
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_SLAVE_REQ)) {
+        return 0;
+    }
+
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        error_report("socketpair() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    u->slave_fd = sv[0];
+    qemu_set_fd_handler(u->slave_fd, slave_read, NULL, dev);
+
+    if (reply_supported) {
+        msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+    }
+
+    ret = vhost_user_write(dev, &msg, &sv[1], 1);
+    if (!ret && reply_supported) {
+        ret = process_message_reply(dev, msg.request);
+    }
+
+    close(sv[1]);
+    if (ret) {
+        qemu_set_fd_handler(u->slave_fd, NULL, NULL, NULL);
+        close(u->slave_fd);
+        u->slave_fd = -1;
+    }
+    return ret;
+}
+
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
     uint64_t features;
+    struct vhost_user *u;
     int err;
 
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
-    dev->opaque = opaque;
+    u = g_new0(struct vhost_user, 1);
+    u->chr = opaque;
+    u->max_slots = VHOST_MEMORY_MAX_NREGIONS;
+    u->slave_fd = -1;
+    dev->opaque = u;
 
     err = vhost_user_get_features(dev, &features);
     if (err < 0) {
@@ -605,6 +945,23 @@ static int vhost_user_init(struct vhost_dev *dev, void *opaque)
                 return err;
             }
         }
+
+        if (virtio_has_feature(dev->protocol_features,
+                               VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_MAX_MEM_SLOTS,
+                                     &u->max_slots);
+            if (err < 0) {
+                return err;
+            }
+
+            if (u->max_slots < 1) {
+                error_report("vhost-user slave reported no memory slots");
+                return -1;
+            }
+            u->max_slots = MIN(u->max_slots, VHOST_USER_MAX_RAM_SLOTS);
+            u->shadow_regions = g_new0(VhostUserMemoryRegion, u->max_slots);
+            u->shadow_fds = g_new0(int, u->max_slots);
+        }
     }
 
     if (dev->migration_blocker == NULL &&
@@ -615,13 +972,28 @@ static int vhost_user_init(struct vhost_dev *dev, void *opaque)
                    "VHOST_USER_PROTOCOL_F_LOG_SHMFD feature.");
     }
 
+    err = vhost_setup_slave_channel(dev);
+    if (err < 0) {
+        return err;
+    }
+
     return 0;
 }
 
 static int vhost_user_cleanup(struct vhost_dev *dev)
 {
+    struct vhost_user *u;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
+    u = dev->opaque;
+    if (u->slave_fd >= 0) {
+        qemu_set_fd_handler(u->slave_fd, NULL, NULL, NULL);
+        close(u->slave_fd);
+    }
+    g_free(u->shadow_regions);
+    g_free(u->shadow_fds);
+    g_free(u);
     dev->opaque = 0;
 
     return 0;
@@ -636,7 +1008,9 @@ static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
 
 static int vhost_user_memslots_limit(struct vhost_dev *dev)
 {
-    return VHOST_MEMORY_MAX_NREGIONS;
+    struct vhost_user *u = dev->opaque;
+
+    return u->max_slots;
 }
 
 static bool vhost_user_requires_shm_log(struct vhost_dev *dev)
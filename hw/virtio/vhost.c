@@ -21,6 +21,8 @@
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include <linux/vhost.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
@@ -43,6 +45,9 @@
 static struct vhost_log *vhost_log;
 static struct vhost_log *vhost_log_shm;
 
+/* Number of log chunks tested together for the common all-clean case */
+#define VHOST_LOG_SYNC_BLOCK 64
+
 static unsigned int used_memslots;
 static QLIST_HEAD(, vhost_dev) vhost_devices =
     QLIST_HEAD_INITIALIZER(vhost_devices);
@@ -78,32 +83,69 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
+    while (from < to) {
+        size_t n = MIN(to - from, VHOST_LOG_SYNC_BLOCK);
+
         /* We first check with non-atomic: much cheaper,
-         * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+         * and we expect non-dirty to be the common case. A whole block
+         * of chunks is tested at once so that clean parts of the log
+         * cost little more than a memory scan. */
+        if (buffer_is_zero(from, n * sizeof(*from))) {
+            from += n;
+            addr += n * VHOST_LOG_CHUNK;
             continue;
         }
-        /* Data must be read atomically. We don't really need barrier semantics
-         * but it's easier to use atomic_* than roll our own. */
-        log = atomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+
+        for (; n; n--, from++, addr += VHOST_LOG_CHUNK) {
+            vhost_log_chunk_t log;
+
+            if (!*from) {
+                continue;
+            }
+            /* Data must be read atomically. We don't really need barrier
+             * semantics but it's easier to use atomic_* than roll our own. */
+            log = atomic_xchg(from, 0);
+            while (log) {
+                /* Mark each run of consecutive dirty pages in one go */
+                int bit = ctzl(log);
+                int len = cto64((uint64_t)log >> bit);
+                hwaddr page_addr;
+                hwaddr section_offset;
+                hwaddr mr_offset;
+                page_addr = addr + bit * VHOST_LOG_PAGE;
+                section_offset = page_addr -
+                                 section->offset_within_address_space;
+                mr_offset = section_offset + section->offset_within_region;
+                memory_region_set_dirty(section->mr, mr_offset,
+                                        (hwaddr)len * VHOST_LOG_PAGE);
+                if (bit + len >= VHOST_LOG_BITS) {
+                    log = 0;
+                } else {
+                    log &= ~(((0x1ull << len) - 1) << bit);
+                }
+            }
         }
-        addr += VHOST_LOG_CHUNK;
     }
 }
 
+/* All devices logging to the same vhost_log get a log_sync callback for
+ * every section, but the log only needs to be scanned once: clearing it
+ * on the first pass leaves nothing for the others.  Pick the first
+ * running device on the log to do the work.  Its memory table covers
+ * the used rings of the other devices as well, since those live in
+ * guest RAM. */
+static bool vhost_dev_log_is_syncer(struct vhost_dev *dev)
+{
+    struct vhost_dev *hdev;
+
+    QLIST_FOREACH(hdev, &vhost_devices, entry) {
+        if (hdev->log_enabled && hdev->started && hdev->log == dev->log) {
+            return hdev == dev;
+        }
+    }
+    return false;
+}
+
 static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
                                    MemoryRegionSection *section,
                                    hwaddr first,
@@ -141,6 +183,10 @@ static void vhost_log_sync(MemoryListener *listener,
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
+
+    if (!vhost_dev_log_is_syncer(dev)) {
+        return;
+    }
     vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
 }
 
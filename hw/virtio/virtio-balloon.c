@@ -15,6 +15,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu-common.h"
 #include "hw/virtio/virtio.h"
@@ -23,6 +24,7 @@
 #include "hw/virtio/virtio-balloon.h"
 #include "sysemu/kvm.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
 #include "trace.h"
@@ -32,15 +34,192 @@
 
 #define BALLOON_PAGE_SIZE  (1 << VIRTIO_BALLOON_PFN_SHIFT)
 
+static bool balloon_discard_allowed(void)
+{
+    return !qemu_balloon_is_inhibited() && (!kvm_enabled() ||
+                                            kvm_has_sync_mmu());
+}
+
 static void balloon_page(void *addr, int deflate)
 {
-    if (!qemu_balloon_is_inhibited() && (!kvm_enabled() ||
-                                         kvm_has_sync_mmu())) {
+    if (balloon_discard_allowed()) {
         qemu_madvise(addr, BALLOON_PAGE_SIZE,
                 deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
     }
 }
 
+/*
+ * With transparent huge pages, discarding one balloon page splits the
+ * huge page that contains it for good.  Inflated pages are therefore
+ * tracked per huge page, and a huge page is discarded in one go once the
+ * guest has put all of it in the balloon.  Huge pages that are still
+ * partially inflated when the balloon stops inflating are discarded a run
+ * at a time, and are collapsed again after the guest took them back.
+ */
+typedef struct BalloonTHPPage {
+    unsigned long *inflated;
+    unsigned long *discarded;
+    unsigned int nr_inflated;
+    bool split;
+} BalloonTHPPage;
+
+#define BALLOON_THP_FLUSH_DELAY_MS 1000
+
+static unsigned int balloon_thp_nr_pages(VirtIOBalloon *s)
+{
+    return s->thp_pagesize / BALLOON_PAGE_SIZE;
+}
+
+static void balloon_thp_page_free(gpointer data)
+{
+    BalloonTHPPage *page = data;
+
+    g_free(page->inflated);
+    g_free(page->discarded);
+    g_free(page);
+}
+
+static bool balloon_thp_tracked(VirtIOBalloon *s, void *addr)
+{
+    RAMBlock *rb;
+    ram_addr_t offset;
+
+    if (!s->thp_pagesize) {
+        return false;
+    }
+
+    rb = qemu_ram_block_from_host(addr, false, &offset);
+    return rb && !qemu_ram_is_shared(rb) &&
+           qemu_ram_pagesize(rb) == getpagesize();
+}
+
+static void balloon_inflate_page(VirtIOBalloon *s, void *addr)
+{
+    unsigned int nr_pages = balloon_thp_nr_pages(s);
+    BalloonTHPPage *page;
+    uintptr_t base;
+    unsigned long nr;
+
+    if (!balloon_discard_allowed()) {
+        return;
+    }
+    if (!balloon_thp_tracked(s, addr)) {
+        balloon_page(addr, 0);
+        return;
+    }
+
+    base = QEMU_ALIGN_DOWN((uintptr_t)addr, s->thp_pagesize);
+    nr = ((uintptr_t)addr - base) / BALLOON_PAGE_SIZE;
+    page = g_hash_table_lookup(s->thp_pages, (gpointer)base);
+    if (!page) {
+        page = g_new0(BalloonTHPPage, 1);
+        page->inflated = bitmap_new(nr_pages);
+        page->discarded = bitmap_new(nr_pages);
+        g_hash_table_insert(s->thp_pages, (gpointer)base, page);
+    }
+
+    if (test_and_set_bit(nr, page->inflated)) {
+        return;
+    }
+
+    if (++page->nr_inflated == nr_pages) {
+        trace_virtio_balloon_thp_discard(base, s->thp_pagesize);
+        qemu_madvise((void *)base, s->thp_pagesize, QEMU_MADV_DONTNEED);
+        bitmap_set(page->discarded, 0, nr_pages);
+    } else {
+        timer_mod(s->thp_flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  BALLOON_THP_FLUSH_DELAY_MS);
+    }
+}
+
+static void balloon_deflate_page(VirtIOBalloon *s, void *addr)
+{
+    BalloonTHPPage *page;
+    uintptr_t base;
+    unsigned long nr;
+
+    if (s->thp_pagesize) {
+        base = QEMU_ALIGN_DOWN((uintptr_t)addr, s->thp_pagesize);
+        nr = ((uintptr_t)addr - base) / BALLOON_PAGE_SIZE;
+        page = g_hash_table_lookup(s->thp_pages, (gpointer)base);
+        if (page && test_and_clear_bit(nr, page->inflated)) {
+            if (!--page->nr_inflated) {
+                if (page->split) {
+                    qemu_ram_collapse_schedule((void *)base, s->thp_pagesize);
+                }
+                g_hash_table_remove(s->thp_pages, (gpointer)base);
+            } else {
+                /* Touching the page can fault in the whole huge page,
+                 * so the rest of it has to be discarded again.
+                 */
+                bitmap_zero(page->discarded, balloon_thp_nr_pages(s));
+                timer_mod(s->thp_flush_timer,
+                          qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                          BALLOON_THP_FLUSH_DELAY_MS);
+            }
+        }
+    }
+
+    balloon_page(addr, 1);
+}
+
+/* Discard the pages of partially inflated huge pages */
+static void balloon_thp_flush(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    unsigned int nr_pages = balloon_thp_nr_pages(s);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!balloon_discard_allowed()) {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, s->thp_pages);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        BalloonTHPPage *page = value;
+        unsigned long start = 0, end;
+
+        while ((start = find_next_bit(page->inflated, nr_pages, start)) <
+               nr_pages) {
+            end = find_next_zero_bit(page->inflated, nr_pages, start);
+            if (find_next_zero_bit(page->discarded, end, start) < end) {
+                uint8_t *host = (uint8_t *)key + start * BALLOON_PAGE_SIZE;
+                size_t len = (end - start) * BALLOON_PAGE_SIZE;
+
+                trace_virtio_balloon_thp_discard((uintptr_t)host, len);
+                qemu_madvise(host, len, QEMU_MADV_DONTNEED);
+                bitmap_set(page->discarded, start, end - start);
+                page->split = true;
+            }
+            start = end;
+        }
+    }
+}
+
+/* The guest forgot about its balloon, e.g. because it was reset */
+static void balloon_thp_reset(VirtIOBalloon *s)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!s->thp_pages) {
+        return;
+    }
+
+    timer_del(s->thp_flush_timer);
+    g_hash_table_iter_init(&iter, s->thp_pages);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        BalloonTHPPage *page = value;
+
+        if (page->split) {
+            qemu_ram_collapse_schedule(key, s->thp_pagesize);
+        }
+        g_hash_table_iter_remove(&iter);
+    }
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -49,6 +228,9 @@ static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_MEMFREE] = "stat-free-memory",
    [VIRTIO_BALLOON_S_MEMTOT] = "stat-total-memory",
    [VIRTIO_BALLOON_S_AVAIL] = "stat-available-memory",
+   [VIRTIO_BALLOON_S_CACHES] = "stat-disk-caches",
+   [VIRTIO_BALLOON_S_HTLB_PGALLOC] = "stat-htlb-pgalloc",
+   [VIRTIO_BALLOON_S_HTLB_PGFAIL] = "stat-htlb-pgfail",
    [VIRTIO_BALLOON_S_NR] = NULL
 };
 
@@ -241,8 +423,13 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             /* Using memory_region_get_ram_ptr is bending the rules a bit, but
                should be OK because we only want a single page.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
+            if (vq == s->dvq) {
+                balloon_deflate_page(s, memory_region_get_ram_ptr(section.mr) +
+                                     addr);
+            } else {
+                balloon_inflate_page(s, memory_region_get_ram_ptr(section.mr) +
+                                     addr);
+            }
             memory_region_unref(section.mr);
         }
 
@@ -252,6 +439,229 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * Free page reporting: the guest passes ranges of free memory, usually
+ * 2 MiB or more each, as device-writable buffers.  The whole batch is
+ * discarded and returned at once, instead of one element and one madvise
+ * per 4 KiB page as with the inflate queue.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    bool notify = false;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        unsigned int i;
+
+        /* Discarded pages read back as zeroes, not as the poison value
+         * that the guest may check when it allocates them again.
+         */
+        if (!balloon_discard_allowed() || s->poison_val) {
+            goto done;
+        }
+
+        for (i = 0; i < elem->in_num; i++) {
+            void *addr = elem->in_sg[i].iov_base;
+            size_t size = elem->in_sg[i].iov_len;
+            ram_addr_t offset;
+            size_t pagesize;
+            RAMBlock *rb;
+
+            rb = qemu_ram_block_from_host(addr, false, &offset);
+            if (!rb || qemu_ram_is_shared(rb)) {
+                /* Dropping the pages of a shared mapping frees nothing */
+                trace_virtio_balloon_bad_addr(elem->in_addr[i]);
+                continue;
+            }
+
+            pagesize = qemu_ram_pagesize(rb);
+            if (!QEMU_IS_ALIGNED(offset | size, pagesize)) {
+                trace_virtio_balloon_bad_addr(elem->in_addr[i]);
+                continue;
+            }
+
+            trace_virtio_balloon_handle_report(elem->in_addr[i], size);
+            qemu_madvise(addr, size, QEMU_MADV_DONTNEED);
+        }
+
+done:
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        notify = true;
+    }
+
+    if (notify) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static bool virtio_balloon_free_page_support(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+static bool virtio_balloon_page_poison_support(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_PAGE_POISON);
+}
+
+/*
+ * Free page hinting: while a migration round is running, the guest is
+ * asked (through the command id in the config space) to report its free
+ * pages.  It first sends the command id in a driver buffer, then the free
+ * ranges in device-writable buffers; migration skips those ranges until
+ * it syncs the dirty bitmap again.  The guest holds on to the pages until
+ * the command id reads VIRTIO_BALLOON_CMD_ID_DONE.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+    bool notify = false;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        unsigned int i;
+
+        if (elem->out_num) {
+            uint32_t id;
+            size_t size;
+
+            size = iov_to_buf(elem->out_sg, elem->out_num, 0,
+                              &id, sizeof(id));
+            virtqueue_push(vq, elem, 0);
+            g_free(elem);
+            if (size != sizeof(id)) {
+                virtio_error(vdev, "received an incorrect free page "
+                             "hint command id");
+                return;
+            }
+
+            id = virtio_ldl_p(vdev, &id);
+            trace_virtio_balloon_free_page_hint_cmd(id,
+                                                s->free_page_hint_status);
+            if (s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED &&
+                id == s->free_page_hint_cmd_id) {
+                s->free_page_hint_status = FREE_PAGE_HINT_S_START;
+            } else if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+                /* The guest is done with this round */
+                s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+            }
+            notify = true;
+            continue;
+        }
+
+        /* Hints for an old round, or sent after the bitmap sync started,
+         * may describe pages that are not free anymore.
+         */
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_START &&
+            !s->poison_val) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
+        }
+
+        virtqueue_push(vq, elem, 0);
+        g_free(elem);
+        notify = true;
+    }
+
+    if (notify) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_balloon_free_page_set_status(VirtIOBalloon *s,
+                                                uint32_t status)
+{
+    if (s->free_page_hint_status != status) {
+        s->free_page_hint_status = status;
+        virtio_notify_config(VIRTIO_DEVICE(s));
+    }
+}
+
+static void virtio_balloon_free_page_start(VirtIOBalloon *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+
+    /* Pages skipped by migration arrive as zeroes on the destination */
+    if (!vdev->vm_running || s->poison_val) {
+        virtio_balloon_free_page_set_status(s, FREE_PAGE_HINT_S_DONE);
+        return;
+    }
+
+    if (s->free_page_hint_cmd_id == UINT32_MAX) {
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+    } else {
+        s->free_page_hint_cmd_id++;
+    }
+    s->free_page_hint_status = FREE_PAGE_HINT_S_REQUESTED;
+    trace_virtio_balloon_free_page_start(s->free_page_hint_cmd_id);
+    virtio_notify_config(vdev);
+}
+
+static void virtio_balloon_free_page_stop(VirtIOBalloon *s)
+{
+    if (s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED ||
+        s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+        virtio_balloon_free_page_set_status(s, FREE_PAGE_HINT_S_STOP);
+    }
+}
+
+static void virtio_balloon_free_page_hint_notify(Notifier *notifier,
+                                                 void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_notify);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    PrecopyNotifyReason *reason = data;
+
+    if (!virtio_balloon_free_page_support(s) ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    switch (*reason) {
+    case PRECOPY_NOTIFY_SETUP:
+        break;
+    case PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC:
+        virtio_balloon_free_page_stop(s);
+        break;
+    case PRECOPY_NOTIFY_AFTER_BITMAP_SYNC:
+        virtio_balloon_free_page_start(s);
+        break;
+    case PRECOPY_NOTIFY_COMPLETE:
+    case PRECOPY_NOTIFY_CLEANUP:
+        virtio_balloon_free_page_set_status(s, FREE_PAGE_HINT_S_DONE);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    uint64_t features = s->host_features;
+
+    if (virtio_has_feature(features, VIRTIO_BALLOON_F_PAGE_POISON)) {
+        return offsetof(struct virtio_balloon_config, poison_val) +
+               sizeof(uint32_t);
+    }
+    if (virtio_has_feature(features, VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return offsetof(struct virtio_balloon_config, free_page_hint_cmd_id) +
+               sizeof(uint32_t);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_hint_cmd_id);
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -307,13 +717,27 @@ out:
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    struct virtio_balloon_config config;
+    struct virtio_balloon_config config = {};
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    config.poison_val = cpu_to_le32(dev->poison_val);
+
+    switch (dev->free_page_hint_status) {
+    case FREE_PAGE_HINT_S_REQUESTED:
+    case FREE_PAGE_HINT_S_START:
+        config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
+        break;
+    case FREE_PAGE_HINT_S_STOP:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    default:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    }
 
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -353,12 +777,15 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
                                       const uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    struct virtio_balloon_config config;
+    struct virtio_balloon_config config = {};
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
+    if (virtio_balloon_page_poison_support(dev)) {
+        dev->poison_val = le32_to_cpu(config.poison_val);
+    }
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
                         ((ram_addr_t) dev->actual << VIRTIO_BALLOON_PFN_SHIFT),
@@ -409,6 +836,29 @@ static int virtio_balloon_post_load_device(void *opaque, int version_id)
     return 0;
 }
 
+static const VMStateDescription vmstate_virtio_balloon_free_page_hint = {
+    .name = "virtio-balloon-device/free-page-hint",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_balloon_free_page_support,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(free_page_hint_cmd_id, VirtIOBalloon),
+        VMSTATE_UINT32(free_page_hint_status, VirtIOBalloon),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_balloon_page_poison = {
+    .name = "virtio-balloon-device/page-poison",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_balloon_page_poison_support,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(poison_val, VirtIOBalloon),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_balloon_device = {
     .name = "virtio-balloon-device",
     .version_id = 1,
@@ -419,6 +869,11 @@ static const VMStateDescription vmstate_virtio_balloon_device = {
         VMSTATE_UINT32(actual, VirtIOBalloon),
         VMSTATE_END_OF_LIST()
     },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_balloon_free_page_hint,
+        &vmstate_virtio_balloon_page_poison,
+        NULL
+    }
 };
 
 static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
@@ -427,8 +882,17 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
     int ret;
 
+    /* Both features hand free guest pages to the host, which must then
+     * know whether the guest expects to find them poisoned.
+     */
+    if (virtio_has_feature(s->host_features,
+                           VIRTIO_BALLOON_F_FREE_PAGE_HINT) ||
+        virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->host_features |= 1U << VIRTIO_BALLOON_F_PAGE_POISON;
+    }
+
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -443,6 +907,30 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (virtio_has_feature(s->host_features,
+                           VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, VIRTQUEUE_MAX_SIZE,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+        s->free_page_hint_notify.notify =
+            virtio_balloon_free_page_hint_notify;
+        precopy_add_notifier(&s->free_page_hint_notify);
+    }
+
+    if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
+
+    s->thp_pagesize = qemu_thp_pagesize();
+    if (s->thp_pagesize) {
+        s->thp_pages = g_hash_table_new_full(NULL, NULL, NULL,
+                                             balloon_thp_page_free);
+        s->thp_flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                          balloon_thp_flush, s);
+    }
+
     reset_stats(s);
 }
 
@@ -451,6 +939,15 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->thp_pages) {
+        balloon_thp_reset(s);
+        timer_free(s->thp_flush_timer);
+        g_hash_table_destroy(s->thp_pages);
+    }
+
+    if (s->free_page_vq) {
+        precopy_remove_notifier(&s->free_page_hint_notify);
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
     virtio_cleanup(vdev);
@@ -465,6 +962,12 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
     }
+
+    balloon_thp_reset(s);
+    s->poison_val = 0;
+    if (s->free_page_vq) {
+        s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+    }
 }
 
 static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
@@ -505,6 +1008,10 @@ static const VMStateDescription vmstate_virtio_balloon = {
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1172,6 +1172,28 @@ static int virtio_pci_add_mem_cap(VirtIOPCIProxy *proxy,
     return offset;
 }
 
+#ifdef CONFIG_VHOST_USER_FS
+/* Describe a shared memory region in @bar, e.g. a DAX window */
+static int virtio_pci_add_shm_cap(VirtIOPCIProxy *proxy, uint8_t bar,
+                                  uint64_t offset, uint64_t length,
+                                  uint8_t id)
+{
+    struct virtio_pci_cap64 cap = {
+        .cap.cap_len = sizeof cap,
+        .cap.cfg_type = VIRTIO_PCI_CAP_SHARED_MEMORY_CFG,
+    };
+
+    cap.cap.bar = bar;
+    cap.cap.id = id;
+    cap.cap.offset = cpu_to_le32(offset);
+    cap.cap.length = cpu_to_le32(length);
+    cap.offset_hi = cpu_to_le32(offset >> 32);
+    cap.length_hi = cpu_to_le32(length >> 32);
+
+    return virtio_pci_add_mem_cap(proxy, &cap.cap);
+}
+#endif
+
 static uint64_t virtio_pci_common_read(void *opaque, hwaddr addr,
                                        unsigned size)
 {
@@ -2148,6 +2170,83 @@ static const TypeInfo vhost_vsock_pci_info = {
 };
 #endif
 
+/* vhost-user-fs-pci */
+
+#ifdef CONFIG_VHOST_USER_FS
+static Property vhost_user_fs_pci_properties[] = {
+    DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                       DEV_NVECTORS_UNSPECIFIED),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void vhost_user_fs_pci_realize(VirtIOPCIProxy *vpci_dev, Error **errp)
+{
+    VHostUserFSPCI *dev = VHOST_USER_FS_PCI(vpci_dev);
+    DeviceState *vdev = DEVICE(&dev->vdev);
+    uint64_t cache_size = dev->vdev.conf.cache_size;
+    Error *err = NULL;
+
+    if (cache_size &&
+        (vpci_dev->flags & VIRTIO_PCI_FLAG_MODERN_PIO_NOTIFY) &&
+        vpci_dev->modern_io_bar_idx == VIRTIO_FS_PCI_CACHE_BAR) {
+        error_setg(errp, "cache-size cannot be used with modern-pio-notify");
+        return;
+    }
+
+    if (vpci_dev->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        /* Hiprio queue, request queues and config changes */
+        vpci_dev->nvectors = dev->vdev.conf.num_request_queues + 2;
+    }
+
+    qdev_set_parent_bus(vdev, BUS(&vpci_dev->bus));
+    virtio_pci_force_virtio_1(vpci_dev);
+    object_property_set_bool(OBJECT(vdev), true, "realized", &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    if (cache_size) {
+        virtio_pci_add_shm_cap(vpci_dev, VIRTIO_FS_PCI_CACHE_BAR, 0,
+                               cache_size, VIRTIO_FS_SHMCAP_ID_CACHE);
+        pci_register_bar(&vpci_dev->pci_dev, VIRTIO_FS_PCI_CACHE_BAR,
+                         PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64,
+                         &dev->vdev.cache);
+    }
+}
+
+static void vhost_user_fs_pci_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioPCIClass *k = VIRTIO_PCI_CLASS(klass);
+    PCIDeviceClass *pcidev_k = PCI_DEVICE_CLASS(klass);
+    k->realize = vhost_user_fs_pci_realize;
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+    dc->props = vhost_user_fs_pci_properties;
+    pcidev_k->vendor_id = PCI_VENDOR_ID_REDHAT_QUMRANET;
+    pcidev_k->revision = 0x00;
+    pcidev_k->class_id = PCI_CLASS_STORAGE_OTHER;
+}
+
+static void vhost_user_fs_pci_instance_init(Object *obj)
+{
+    VHostUserFSPCI *dev = VHOST_USER_FS_PCI(obj);
+
+    virtio_instance_init_common(obj, &dev->vdev, sizeof(dev->vdev),
+                                TYPE_VHOST_USER_FS);
+}
+
+static const TypeInfo vhost_user_fs_pci_info = {
+    .name          = TYPE_VHOST_USER_FS_PCI,
+    .parent        = TYPE_VIRTIO_PCI,
+    .instance_size = sizeof(VHostUserFSPCI),
+    .instance_init = vhost_user_fs_pci_instance_init,
+    .class_init    = vhost_user_fs_pci_class_init,
+};
+#endif
+
 /* virtio-balloon-pci */
 
 static Property virtio_balloon_pci_properties[] = {
@@ -2580,6 +2679,9 @@ static void virtio_pci_register_types(void)
 #ifdef CONFIG_VHOST_VSOCK
     type_register_static(&vhost_vsock_pci_info);
 #endif
+#ifdef CONFIG_VHOST_USER_FS
+    type_register_static(&vhost_user_fs_pci_info);
+#endif
 }
 
 type_init(virtio_pci_register_types)
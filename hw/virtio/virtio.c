@@ -60,6 +60,29 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completed element waiting for virtqueue_flush() to write it back to a
+ * packed ring.  Unlike the split ring, used entries are written over the
+ * descriptors themselves, so they cannot be stored until the whole batch is
+ * known.
+ */
+typedef struct VRingPackedUsedElem {
+    uint16_t id;
+    uint32_t len;
+    unsigned int ndescs;
+} VRingPackedUsedElem;
+
 typedef struct VRingMemoryRegionCaches {
     struct rcu_head rcu;
     MemoryRegionCache desc;
@@ -84,11 +107,23 @@ struct VirtQueue
 
     /* Next head to pop */
     uint16_t last_avail_idx;
+    bool last_avail_wrap_counter;
 
     /* Last avail_idx read from VQ. */
     uint16_t shadow_avail_idx;
 
     uint16_t used_idx;
+    bool used_wrap_counter;
+
+    /* Elements filled but not yet flushed, packed ring only */
+    VRingPackedUsedElem *used_elems;
+
+    /* Free elements, see virtio_queue_set_element_pool() */
+    VirtQueueElement **elem_pool;
+    unsigned int elem_pool_len;
+    unsigned int elem_pool_size;
+    size_t elem_pool_sz;
+    unsigned int elem_pool_max_sg;
 
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
@@ -131,8 +166,13 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     VRingMemoryRegionCaches *new;
     hwaddr addr, size;
     int event_size;
+    bool packed = virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
 
     event_size = virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX) ? 2 : 0;
+    if (packed) {
+        /* The event suppression structures have a fixed size */
+        event_size = 0;
+    }
 
     addr = vq->vring.desc;
     if (!addr) {
@@ -141,7 +181,7 @@ static void virtio_init_region_cache(VirtIODevice *vdev, int n)
     new = g_new0(VRingMemoryRegionCaches, 1);
     size = virtio_queue_get_desc_size(vdev, n);
     address_space_cache_init(&new->desc, vdev->dma_as,
-                             addr, size, false);
+                             addr, size, packed);
 
     size = virtio_queue_get_used_size(vdev, n) + event_size;
     address_space_cache_init(&new->used, vdev->dma_as,
@@ -284,12 +324,128 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     virtio_stw_phys_cached(vq->vdev, &caches->used, pa, val);
 }
 
+/* Called within rcu_read_lock().  */
+static uint16_t vring_packed_desc_read_flags(VirtIODevice *vdev,
+                                             MemoryRegionCache *cache, int i)
+{
+    return virtio_lduw_phys_cached(vdev, cache,
+                                   i * sizeof(VRingPackedDesc) +
+                                   offsetof(VRingPackedDesc, flags));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   MemoryRegionCache *cache, int i,
+                                   bool with_barrier)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    desc->flags = vring_packed_desc_read_flags(vdev, cache, i);
+    if (with_barrier) {
+        /* Make sure flags is read before the rest of the descriptor. */
+        smp_rmb();
+    }
+
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
+                              &desc->addr, sizeof(desc->addr));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
+                              &desc->id, sizeof(desc->id));
+    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
+                              &desc->len, sizeof(desc->len));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap32s(vdev, &desc->len);
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_desc_write(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                    MemoryRegionCache *cache, int i,
+                                    bool strict_order)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap32s(vdev, &desc->len);
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, id),
+                               &desc->id, sizeof(desc->id));
+    address_space_write_cached(cache, off + offsetof(VRingPackedDesc, len),
+                               &desc->len, sizeof(desc->len));
+    if (strict_order) {
+        /* Make sure id, len and the buffers are visible before flags. */
+        smp_wmb();
+    }
+    virtio_stw_phys_cached(vdev, cache,
+                           off + offsetof(VRingPackedDesc, flags),
+                           desc->flags);
+    address_space_cache_invalidate(cache, off, sizeof(VRingPackedDesc));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_event_read(VirtIODevice *vdev,
+                                    MemoryRegionCache *cache,
+                                    VRingPackedDescEvent *e)
+{
+    e->flags = virtio_lduw_phys_cached(vdev, cache,
+                                       offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is read before off_wrap. */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys_cached(vdev, cache,
+                                          offsetof(VRingPackedDescEvent,
+                                                   off_wrap));
+}
+
+/* Called within rcu_read_lock().  */
+static void vring_packed_event_write(VirtIODevice *vdev,
+                                     MemoryRegionCache *cache,
+                                     VRingPackedDescEvent *e)
+{
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, off_wrap),
+                           e->off_wrap);
+    /* Make sure off_wrap is written before flags. */
+    smp_wmb();
+    virtio_stw_phys_cached(vdev, cache,
+                           offsetof(VRingPackedDescEvent, flags), e->flags);
+    address_space_cache_invalidate(cache, 0, sizeof(VRingPackedDescEvent));
+}
+
+/* A descriptor is available when its AVAIL bit matches the driver's wrap
+ * counter and its USED bit does not.
+ */
+static bool vring_packed_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Called within rcu_read_lock().  */
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+    VRingPackedDescEvent e;
+
+    e.off_wrap = vq->last_avail_idx |
+                 vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    if (!enable) {
+        e.flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        e.flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        e.flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    vring_packed_event_write(vq->vdev, &caches->used, &e);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
 
     rcu_read_lock();
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -308,11 +464,31 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+/* Called within rcu_read_lock().  */
+static int virtio_queue_packed_empty_rcu(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+    uint16_t flags;
+
+    if (!caches ||
+        caches->desc.len < vq->vring.num * sizeof(VRingPackedDesc)) {
+        return 1;
+    }
+
+    flags = vring_packed_desc_read_flags(vq->vdev, &caches->desc,
+                                         vq->last_avail_idx);
+    return !vring_packed_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers.
  * Called within rcu_read_lock().  */
 static int virtio_queue_empty_rcu(VirtQueue *vq)
 {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty_rcu(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -324,6 +500,13 @@ int virtio_queue_empty(VirtQueue *vq)
 {
     bool empty;
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        rcu_read_lock();
+        empty = virtio_queue_packed_empty_rcu(vq);
+        rcu_read_unlock();
+        return empty;
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -371,10 +554,20 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
+    vq->inuse -= elem->ndescs;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+static void virtqueue_packed_rewind(VirtQueue *vq, unsigned int num)
+{
+    if (vq->last_avail_idx < num) {
+        vq->last_avail_idx = vq->vring.num + vq->last_avail_idx - num;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= num;
+    }
+}
+
 /* virtqueue_unpop:
  * @vq: The #VirtQueue
  * @elem: The #VirtQueueElement
@@ -386,7 +579,11 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_rewind(vq, elem->ndescs);
+    } else {
+        vq->last_avail_idx--;
+    }
     virtqueue_detach_element(vq, elem, len);
 }
 
@@ -397,7 +594,9 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  * Pretend that elements weren't popped from the virtqueue.  The next
  * virtqueue_pop() will refetch the oldest element.
  *
- * Use virtqueue_unpop() instead if you have a VirtQueueElement.
+ * Use virtqueue_unpop() instead if you have a VirtQueueElement.  On a packed
+ * ring @num counts descriptors, so it is only equal to the number of elements
+ * if none of them were chained.
  *
  * Returns: true on success, false if @num is greater than the number of in use
  * elements.
@@ -407,11 +606,31 @@ bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
     if (num > vq->inuse) {
         return false;
     }
-    vq->last_avail_idx -= num;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_rewind(vq, num);
+    } else {
+        vq->last_avail_idx -= num;
+    }
     vq->inuse -= num;
     return true;
 }
 
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    if (idx >= vq->vring.num) {
+        virtio_error(vq->vdev, "Used element %u out of range", idx);
+        return;
+    }
+
+    if (!vq->used_elems) {
+        vq->used_elems = g_new(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
+    }
+    vq->used_elems[idx].id = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
@@ -426,6 +645,11 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -433,6 +657,63 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_write_used(VirtQueue *vq,
+                                        VRingMemoryRegionCaches *caches,
+                                        const VRingPackedUsedElem *uelem,
+                                        unsigned int offset, bool strict_order)
+{
+    unsigned int head = vq->used_idx + offset;
+    bool wrap_counter = vq->used_wrap_counter;
+    VRingPackedDesc desc = {
+        .id = uelem->id,
+        .len = uelem->len,
+    };
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+
+    /* Both AVAIL and USED equal to the wrap counter mark the slot as used */
+    if (wrap_counter) {
+        desc.flags = (1 << VRING_PACKED_DESC_F_AVAIL) |
+                     (1 << VRING_PACKED_DESC_F_USED);
+    }
+    vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head,
+                            strict_order);
+}
+
+/* Called within rcu_read_lock().  */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+    unsigned int i, ndescs = 0;
+
+    if (!count || !vq->used_elems) {
+        return;
+    }
+
+    /* The driver stops at the first descriptor that isn't used yet, so
+     * write the batch back to front: the first element, written last and
+     * after a barrier, publishes all of them at once.
+     */
+    for (i = 1; i < count; i++) {
+        ndescs += vq->used_elems[i - 1].ndescs;
+        virtqueue_packed_write_used(vq, caches, &vq->used_elems[i], ndescs,
+                                    false);
+    }
+    virtqueue_packed_write_used(vq, caches, &vq->used_elems[0], 0, true);
+    ndescs += vq->used_elems[count - 1].ndescs;
+
+    vq->inuse -= ndescs;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
@@ -443,6 +724,12 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        trace_virtqueue_flush(vq, count);
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -463,6 +750,28 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     rcu_read_unlock();
 }
 
+/* virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: the completed elements
+ * @lens: number of bytes written to each element, or NULL if none were
+ * @num: number of elements in @elems
+ *
+ * Return several elements to the guest with a single index update, which
+ * is cheaper than calling virtqueue_push() for each of them.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *lens, unsigned int num)
+{
+    unsigned int i;
+
+    rcu_read_lock();
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(vq, elems[i], lens ? lens[i] : 0, i);
+    }
+    virtqueue_flush(vq, num);
+    rcu_read_unlock();
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -529,6 +838,151 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
+/* Called within rcu_read_lock().  */
+static int virtqueue_packed_read_next_desc(VirtQueue *vq,
+                                           VRingPackedDesc *desc,
+                                           MemoryRegionCache *desc_cache,
+                                           unsigned int max,
+                                           unsigned int *next,
+                                           bool indirect)
+{
+    /* Indirect tables don't chain, every entry of theirs is part of the
+     * buffer.  In the ring, chains continue in the next slot.
+     */
+    if (!indirect && !(desc->flags & VRING_DESC_F_NEXT)) {
+        return VIRTQUEUE_READ_DESC_DONE;
+    }
+
+    ++*next;
+    if (*next == max) {
+        if (indirect) {
+            return VIRTQUEUE_READ_DESC_DONE;
+        }
+        *next -= vq->vring.num;
+    }
+
+    vring_packed_desc_read(vq->vdev, desc, desc_cache, *next, false);
+    return VIRTQUEUE_READ_DESC_MORE;
+}
+
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int max, idx;
+    unsigned int total_bufs, in_total, out_total;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    int64_t len = 0;
+    bool wrap_counter;
+    int rc;
+
+    rcu_read_lock();
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+    total_bufs = in_total = out_total = 0;
+
+    max = vq->vring.num;
+    caches = atomic_rcu_read(&vq->vring.caches);
+    if (caches->desc.len < max * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto err;
+    }
+
+    for (;;) {
+        MemoryRegionCache *desc_cache = &caches->desc;
+        unsigned int num_bufs = total_bufs;
+        unsigned int i = idx;
+        VRingPackedDesc desc;
+
+        vring_packed_desc_read(vdev, &desc, desc_cache, idx, true);
+        if (!vring_packed_desc_avail(desc.flags, wrap_counter)) {
+            break;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            len = address_space_cache_init(&indirect_desc_cache,
+                                           vdev->dma_as,
+                                           desc.addr, desc.len, false);
+            desc_cache = &indirect_desc_cache;
+            if (len < desc.len) {
+                virtio_error(vdev, "Cannot map indirect buffer");
+                goto err;
+            }
+
+            max = desc.len / sizeof(VRingPackedDesc);
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+        }
+
+        do {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max,
+                                                 &i, desc_cache ==
+                                                 &indirect_desc_cache);
+        } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+        if (desc_cache == &indirect_desc_cache) {
+            address_space_cache_destroy(&indirect_desc_cache);
+            max = vq->vring.num;
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+    rcu_read_unlock();
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -541,6 +995,12 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     int64_t len = 0;
     int rc;
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     rcu_read_lock();
     idx = vq->last_avail_idx;
     total_bufs = in_total = out_total = 0;
@@ -746,7 +1206,78 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
     virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, &elem->out_num, 0);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/* The allocation size only depends on the total number of buffers, because
+ * the in and out arrays of each type are adjacent.
+ */
+static size_t virtqueue_element_size(size_t sz, unsigned int num_sg)
+{
+    VirtQueueElement *elem;
+    size_t addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t addr_end = addr_ofs + num_sg * sizeof(elem->in_addr[0]);
+    size_t sg_ofs = QEMU_ALIGN_UP(addr_end, __alignof__(elem->in_sg[0]));
+
+    return sg_ofs + num_sg * sizeof(elem->in_sg[0]);
+}
+
+static void virtio_queue_free_element_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_len) {
+        g_free(vq->elem_pool[--vq->elem_pool_len]);
+    }
+    g_free(vq->elem_pool);
+    vq->elem_pool = NULL;
+    vq->elem_pool_size = 0;
+}
+
+/* virtio_queue_set_element_pool:
+ * @vq: The #VirtQueue
+ * @sz: largest element size that will be popped from @vq
+ * @max_sg: largest number of buffers that a pooled element can hold
+ * @nr: number of elements to preallocate
+ *
+ * Preallocate elements for virtqueue_pop() and virtqueue_pop_batch(), so
+ * that the data path does not go through the allocator.  Elements that do
+ * not fit fall back to g_malloc().  Devices must release the elements with
+ * virtqueue_free_element() to return them to the pool; g_free() is still
+ * allowed, it just loses the element.
+ *
+ * This must be called before the queue is used.
+ */
+void virtio_queue_set_element_pool(VirtQueue *vq, size_t sz,
+                                   unsigned int max_sg, unsigned int nr)
+{
+    size_t elem_sz = virtqueue_element_size(sz, max_sg);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    virtio_queue_free_element_pool(vq);
+
+    vq->elem_pool = g_new(VirtQueueElement *, nr);
+    for (vq->elem_pool_len = 0; vq->elem_pool_len < nr; vq->elem_pool_len++) {
+        vq->elem_pool[vq->elem_pool_len] = g_malloc(elem_sz);
+    }
+    vq->elem_pool_size = nr;
+    vq->elem_pool_sz = sz;
+    vq->elem_pool_max_sg = max_sg;
+}
+
+/* virtqueue_free_element:
+ * @vq: The #VirtQueue the element was popped from
+ * @elem: The #VirtQueueElement
+ *
+ * Free an element that has been pushed or detached, recycling it if it
+ * came from the element pool of @vq.
+ */
+void virtqueue_free_element(VirtQueue *vq, VirtQueueElement *elem)
+{
+    if (elem->pooled && vq->elem_pool_len < vq->elem_pool_size) {
+        vq->elem_pool[vq->elem_pool_len++] = elem;
+    } else {
+        g_free(elem);
+    }
+}
+
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
@@ -757,7 +1288,14 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (vq && vq->elem_pool_len && sz <= vq->elem_pool_sz &&
+        out_num + in_num <= vq->elem_pool_max_sg) {
+        elem = vq->elem_pool[--vq->elem_pool_len];
+        elem->pooled = true;
+    } else {
+        elem = g_malloc(out_sg_end);
+        elem->pooled = false;
+    }
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -767,31 +1305,155 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
     VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem = NULL;
-    unsigned out_num, in_num;
+    unsigned out_num, in_num, elem_entries;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
-    VRingDesc desc;
+    VRingPackedDesc desc;
+    uint16_t id;
     int rc;
 
-    if (unlikely(vdev->broken)) {
-        return NULL;
-    }
     rcu_read_lock();
-    if (virtio_queue_empty_rcu(vq)) {
+    max = vq->vring.num;
+    caches = atomic_rcu_read(&vq->vring.caches);
+    if (caches && caches->desc.len < max * sizeof(VRingPackedDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        goto done;
+    }
+
+    if (virtio_queue_packed_empty_rcu(vq)) {
         goto done;
     }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = elem_entries = 0;
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        goto done;
+    }
+
+    i = vq->last_avail_idx;
+
+    desc_cache = &caches->desc;
+    vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            goto done;
+        }
+
+        /* loop over the indirect descriptor table */
+        len = address_space_cache_init(&indirect_desc_cache, vdev->dma_as,
+                                       desc.addr, desc.len, false);
+        desc_cache = &indirect_desc_cache;
+        if (len < desc.len) {
+            virtio_error(vdev, "Cannot map indirect buffer");
+            goto done;
+        }
+
+        max = desc.len / sizeof(VRingPackedDesc);
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_cache, i, false);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++elem_entries > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        /* The buffer id of a chain is in its last descriptor */
+        if (desc_cache != &indirect_desc_cache) {
+            id = desc.id;
+        }
+
+        rc = virtqueue_packed_read_next_desc(vq, &desc, desc_cache, max, &i,
+                                             desc_cache ==
+                                             &indirect_desc_cache);
+    } while (rc == VIRTQUEUE_READ_DESC_MORE);
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse += elem->ndescs;
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+done:
+    address_space_cache_destroy(&indirect_desc_cache);
+    rcu_read_unlock();
+
+    return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    goto done;
+}
+
+/* Pop the element at last_avail_idx, which the caller has checked to be
+ * available.
+ * Called within rcu_read_lock().  */
+static VirtQueueElement *virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, head, max;
+    VRingMemoryRegionCaches *caches;
+    MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
+    MemoryRegionCache *desc_cache;
+    int64_t len;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingDesc desc;
+    int rc;
 
     /* When we start there are none of either input nor output. */
     out_num = in_num = 0;
@@ -807,10 +1469,6 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
     caches = atomic_rcu_read(&vq->vring.caches);
@@ -877,8 +1535,9 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -893,7 +1552,6 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
 done:
     address_space_cache_destroy(&indirect_desc_cache);
-    rcu_read_unlock();
 
     return elem;
 
@@ -902,6 +1560,125 @@ err_undo_map:
     goto done;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem = NULL;
+
+    if (unlikely(vdev->broken)) {
+        return NULL;
+    }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+
+    rcu_read_lock();
+    if (!virtio_queue_empty_rcu(vq)) {
+        /* Needed after virtio_queue_empty(), see comment in
+         * virtqueue_num_heads(). */
+        smp_rmb();
+        elem = virtqueue_split_pop_rcu(vq, sz);
+        if (elem && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+            vring_set_avail_event(vq, vq->last_avail_idx);
+        }
+    }
+    rcu_read_unlock();
+
+    return elem;
+}
+
+/* virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: the size of the elements, as for virtqueue_pop()
+ * @elems: array that receives the elements
+ * @max: size of @elems
+ *
+ * Pop up to @max elements.  The avail index is read, and the barrier that
+ * orders it against the descriptors is issued, once for the whole batch.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned int n = 0;
+    int num_heads;
+
+    if (unlikely(vdev->broken)) {
+        return 0;
+    }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        while (n < max && (elems[n] = virtqueue_packed_pop(vq, sz))) {
+            n++;
+        }
+        return n;
+    }
+
+    rcu_read_lock();
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads > 0) {
+        max = MIN(max, num_heads);
+        while (n < max && (elem = virtqueue_split_pop_rcu(vq, sz))) {
+            elems[n++] = elem;
+        }
+    }
+    if (n && virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    rcu_read_unlock();
+
+    return n;
+}
+
+static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement elem = {};
+    VRingPackedDesc desc;
+    unsigned int dropped = 0;
+    unsigned int idx;
+
+    rcu_read_lock();
+    caches = atomic_rcu_read(&vq->vring.caches);
+
+    while (!virtio_queue_packed_empty_rcu(vq) && vq->inuse < vq->vring.num) {
+        /* works similar to virtqueue_pop but does not map buffers
+         * and does not allocate any memory */
+        idx = vq->last_avail_idx;
+        vring_packed_desc_read(vdev, &desc, &caches->desc, idx, true);
+        elem.ndescs = 1;
+        while (virtqueue_packed_read_next_desc(vq, &desc, &caches->desc,
+                                               vq->vring.num, &idx, false) ==
+               VIRTQUEUE_READ_DESC_MORE) {
+            if (++elem.ndescs > vq->vring.num - vq->inuse) {
+                virtio_error(vdev, "Looped descriptor");
+                goto out;
+            }
+        }
+        elem.index = desc.id;
+
+        vq->inuse += elem.ndescs;
+        vq->last_avail_idx += elem.ndescs;
+        if (vq->last_avail_idx >= vq->vring.num) {
+            vq->last_avail_idx -= vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->shadow_avail_idx = vq->last_avail_idx;
+
+        /* immediately push the element, nothing to unmap
+         * as both in_num and out_num are set to 0 */
+        virtqueue_push(vq, &elem, 0);
+        dropped++;
+    }
+
+out:
+    rcu_read_unlock();
+    return dropped;
+}
+
 /* virtqueue_drop_all:
  * @vq: The #VirtQueue
  * Drops all queued buffers and indicates them to the guest
@@ -918,6 +1695,9 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
     if (unlikely(vdev->broken)) {
         return 0;
     }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_drop_all(vq);
+    }
 
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
@@ -926,6 +1706,7 @@ unsigned int virtqueue_drop_all(VirtQueue *vq)
         if (!virtqueue_get_head(vq, vq->last_avail_idx, &elem.index)) {
             break;
         }
+        elem.ndescs = 1;
         vq->inuse++;
         vq->last_avail_idx++;
         if (fEventIdx) {
@@ -975,8 +1756,9 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -998,11 +1780,16 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
         elem->out_sg[i].iov_len = data.out_sg[i].iov_len;
     }
 
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
+
     virtqueue_map(vdev, elem);
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -1031,6 +1818,11 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    /* Packed rings count in-flight descriptors, not elements */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -1144,8 +1936,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1514,6 +2308,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtio_queue_free_element_pool(&vdev->vq[n]);
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1528,6 +2325,48 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
     }
 }
 
+/* The event offset is relative to the driver's wrap counter: if that
+ * differs from ours, it points into the previous lap of the ring.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+/* Called within rcu_read_lock().  */
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = atomic_rcu_read(&vq->vring.caches);
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vdev, &caches->avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 /* Called within rcu_read_lock().  */
 static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
@@ -1541,6 +2380,10 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1641,6 +2484,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1694,6 +2544,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1812,6 +2688,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
         NULL
@@ -2061,6 +2938,17 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
+
+            /* The packed ring state comes from its own subsection, and the
+             * caches were sized for a split ring before the guest features
+             * were known.
+             */
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+                virtio_init_region_cache(vdev, i);
+                continue;
+            }
+
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -2159,6 +3047,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -2191,34 +3081,63 @@ hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDesc) * vdev->vq[n].vring.num;
+    }
     return sizeof(VRingDesc) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    /* For a packed ring, "avail" is the driver event suppression area */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    /* ... and "used" is the device event suppression area */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
 
+/* For packed rings the index passed to and from vhost carries the wrap
+ * counter in bit 15, as ring sizes are at most 32768.
+ */
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return vdev->vq[n].last_avail_idx |
+               vdev->vq[n].last_avail_wrap_counter << 15;
+    }
     return vdev->vq[n].last_avail_idx;
 }
 
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vdev->vq[n].last_avail_wrap_counter = !!(idx & 0x8000);
+        idx &= 0x7fff;
+    }
     vdev->vq[n].last_avail_idx = idx;
     vdev->vq[n].shadow_avail_idx = idx;
 }
 
 void virtio_queue_update_used_idx(VirtIODevice *vdev, int n)
 {
+    /* vhost has completed everything it popped when it stops */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vdev->vq[n].used_idx = vdev->vq[n].last_avail_idx;
+        vdev->vq[n].used_wrap_counter = vdev->vq[n].last_avail_wrap_counter;
+        return;
+    }
+
     rcu_read_lock();
     if (vdev->vq[n].vring.desc) {
         vdev->vq[n].used_idx = vring_used_idx(&vdev->vq[n]);
@@ -2440,6 +3359,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         caches = atomic_read(&vdev->vq[i].vring.caches);
         atomic_set(&vdev->vq[i].vring.caches, NULL);
         virtio_free_region_cache(caches);
+        g_free(vdev->vq[i].used_elems);
+        virtio_queue_free_element_pool(&vdev->vq[i]);
     }
     g_free(vdev->vq);
 }
@@ -2460,7 +3381,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r, err;
@@ -2511,7 +3432,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,6 +43,18 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+/*
+ * Latency histogram: bins[i] counts the requests whose latency lies in
+ * [boundaries[i - 1], boundaries[i]), where boundaries[-1] is 0 and
+ * boundaries[nbins - 1] is +inf.  An empty histogram (nbins == 0) is not
+ * collected.
+ */
+typedef struct BlockLatencyHistogram {
+    int nbins;
+    uint64_t *boundaries; /* nbins - 1 strictly increasing values, in ns */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -51,6 +64,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -77,5 +91,8 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
 
 #endif
@@ -19,6 +19,9 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -50,6 +53,16 @@ typedef void IOHandler(void *opaque);
 struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+
+typedef QSLIST_HEAD(, QEMUBH) BHList;
+
+/* A BH list detached by one (possibly nested) aio_bh_poll() call */
+typedef struct BHListSlice BHListSlice;
+struct BHListSlice {
+    BHList bh_list;
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
 
 struct AioContext {
     GSource source;
@@ -57,6 +70,13 @@ struct AioContext {
     /* Used by AioContext users to protect from multi-threaded access.  */
     QemuRecMutex lock;
 
+    /* Lock profiling state of the current owner, protected by lock */
+    unsigned lock_depth;
+    const char *lock_file;
+    int lock_line;
+    int64_t lock_wait_ns;
+    int64_t lock_start_ns;      /* zero if not being profiled */
+
     /* The list of registered AIO handlers.  Protected by ctx->list_lock. */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
@@ -85,14 +105,17 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* A lock to protect between QEMUBH and AioHandler adders and deleter,
-     * and to ensure that no callbacks are removed while we're walking and
+    /* A lock to protect between AioHandler adders and deleter, and to
+     * ensure that no callbacks are removed while we're walking and
      * dispatching them.
      */
     QemuLockCnt list_lock;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom Halves pending aio_bh_poll() processing */
+    BHList bh_list;
+
+    /* Chained BH list slices for each nested aio_bh_poll() call */
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
 
     /* Used by aio_notify.
      *
@@ -116,6 +139,8 @@ struct AioContext {
      * Has its own locking.
      */
     struct ThreadPool *thread_pool;
+    int64_t thread_pool_min;    /* workers kept alive even when idle */
+    int64_t thread_pool_max;    /* upper bound on the number of workers */
 
 #ifdef CONFIG_LINUX_AIO
     /* State for native Linux AIO.  Uses aio_context_acquire/release for
@@ -123,6 +148,12 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
      * locking.
@@ -147,6 +178,12 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring(7) ring used to monitor fds, preferred over epoll(7) */
+    struct io_uring fdmon_ring;
+    bool fdmon_io_uring_enabled;
+#endif
 };
 
 /**
@@ -185,8 +222,12 @@ void aio_context_unref(AioContext *ctx);
  *
  * Bottom halves, timers and callbacks can be created or removed without
  * acquiring the AioContext.
+ *
+ * The caller's location is recorded for lock profiling.
  */
-void aio_context_acquire(AioContext *ctx);
+#define aio_context_acquire(ctx) \
+    aio_context_acquire_impl(ctx, __FILE__, __LINE__)
+void aio_context_acquire_impl(AioContext *ctx, const char *file, int line);
 
 /* Relinquish ownership of the AioContext. */
 void aio_context_release(AioContext *ctx);
@@ -384,6 +425,11 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Return the LuringState bound to this AioContext, or NULL if the host
+ * does not support io_uring
+ */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -536,6 +582,15 @@ static inline bool aio_context_in_iothread(AioContext *ctx)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_destroy:
+ * @ctx: the aio context
+ *
+ * Release what aio_context_setup() allocated.  Called when the last
+ * reference to @ctx is dropped, after all of its handlers are removed.
+ */
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -549,4 +604,16 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept even when idle
+ * @max: maximum number of worker threads
+ *
+ * Workers are created by the AioContext's thread, so they inherit its CPU
+ * and NUMA affinity.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
 #endif
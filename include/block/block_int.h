@@ -35,6 +35,7 @@
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
+#include "qemu/ratelimit.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
@@ -56,6 +57,8 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -70,6 +73,9 @@ typedef struct BdrvTrackedRequest {
     int64_t offset;
     unsigned int bytes;
     enum BdrvTrackedRequestType type;
+    /* Data of a BDRV_TRACKED_WRITE, NULL for zero writes.  It covers exactly
+     * offset and bytes, i.e. without any alignment padding. */
+    QEMUIOVector *qiov;
 
     bool serialising;
     int64_t overlap_offset;
@@ -165,6 +171,24 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy a range without a bounce buffer.  bdrv_co_copy_range_from() is
+     * called on the node @src points to and usually forwards the request
+     * to a child of @bs; the protocol driver at the bottom then calls
+     * bdrv_co_copy_range_to() to go down the destination side.  There the
+     * protocol driver does the copy if it can access both @src and @dst.
+     * Either may return -ENOTSUP, in which case the caller falls back to a
+     * read and a write.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -175,6 +199,12 @@ struct BlockDriver {
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /*
+     * Called after a read-only node was reopened read-write, once all nodes
+     * of the reopen queue have committed (so that bs->file is writable too).
+     */
+    int (*bdrv_reopen_bitmaps_rw)(BlockDriverState *bs, Error **errp);
+
     /*
      * Flushes all data for all layers by calling bdrv_co_flush for underlying
      * layers, if needed. This function is needed for deterministic
@@ -221,6 +251,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -320,6 +351,16 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Return whether a new persistent dirty bitmap with the given name and
+     * granularity could be stored in the image.  Drivers that implement this
+     * store all persistent bitmaps of the node in .bdrv_inactivate.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -375,6 +416,28 @@ typedef struct BlockLimits {
     int max_iov;
 } BlockLimits;
 
+/*
+ * The last extent returned by bdrv_co_get_block_status() for a node.
+ *
+ * The entry is only valid as long as neither the node nor (if the status
+ * points into bs->file) @file has been written, discarded or truncated
+ * since it was filled in; this is tracked through their write_gen.  Other
+ * changes to the node's allocation state must call
+ * bdrv_block_status_cache_invalidate().
+ */
+typedef struct BdrvBlockStatusCache {
+    bool valid;
+    /* Bumped by every invalidation, so that lookups racing with one do not
+     * store their (possibly stale) result */
+    unsigned int gen;
+    unsigned int write_gen;
+    unsigned int file_write_gen;
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t ret;
+    BlockDriverState *file;
+} BdrvBlockStatusCache;
+
 typedef struct BdrvOpBlocker BdrvOpBlocker;
 
 typedef struct BdrvAioNotifier {
@@ -507,6 +570,19 @@ struct BlockDriverState {
      */
     int copy_on_read;
 
+    /* Copy-on-read prefetch, see bdrv_set_copy_on_read_prefetch().  The
+     * prefetcher copies [cor_prefetch_offset, cor_prefetch_end) in the
+     * background; cor_prefetch_next is where the next sequential guest
+     * read is expected to start.
+     */
+    uint64_t cor_prefetch_window;
+    bool cor_prefetch_limited;
+    RateLimit cor_prefetch_limit;
+    int64_t cor_prefetch_next;
+    int64_t cor_prefetch_offset;
+    int64_t cor_prefetch_end;
+    Coroutine *cor_prefetch_co;
+
     /* If we are reading a disk image, give its size in sectors.
      * Generally read-only; it is written to by load_vmstate and save_vmstate,
      * but the block layer is quiescent during those.
@@ -538,6 +614,8 @@ struct BlockDriverState {
     unsigned int write_gen;               /* Current data generation */
     unsigned int flushed_gen;             /* Flushed write generation */
 
+    BdrvBlockStatusCache block_status_cache;
+
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
 
     /* do we need to tell the quest if we have a volatile write cache? */
@@ -584,6 +662,14 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -745,6 +831,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: When to trigger writes to the target.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -758,7 +845,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap, Error **errp);
+                  bool unmap, MirrorCopyMode copy_mode, Error **errp);
 
 /*
  * backup_job_create:
@@ -769,6 +856,10 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: Whether to write compressed data to @target.
+ * @max_workers: How many chunks are copied in parallel, or 0 for the default.
+ * @max_chunk: Maximum size of one copy request, or 0 for the default.
+ * @copy_offload: Whether to try copying without a bounce buffer first.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -784,7 +875,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BlockDriverState *target, int64_t speed,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
-                            bool compress,
+                            bool compress, int64_t max_workers,
+                            int64_t max_chunk, bool copy_offload,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
@@ -808,6 +900,7 @@ bool blk_dev_is_tray_open(BlockBackend *blk);
 bool blk_dev_is_medium_locked(BlockBackend *blk);
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int64_t nr_sect);
+void bdrv_block_status_cache_invalidate(BlockDriverState *bs);
 bool bdrv_requests_pending(BlockDriverState *bs);
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
@@ -64,4 +64,23 @@ extern const uint32_t AES_Te0[256], AES_Te1[256], AES_Te2[256],
 extern const uint32_t AES_Td0[256], AES_Td1[256], AES_Td2[256],
                       AES_Td3[256], AES_Td4[256];
 
+/*
+ * Single AES rounds on the host's AES instructions, for emulating the
+ * guest's.  The 16 byte state is in the order of the x86 XMM and ARM Q
+ * registers, least significant byte first, and is updated in place:
+ *
+ * aes_accel_enc: MixColumns(ShiftRows(SubBytes(st))) ^ rk, with no
+ *                MixColumns if last (x86 AESENC and AESENCLAST)
+ * aes_accel_dec: InvMixColumns(InvShiftRows(InvSubBytes(st))) ^ rk, with
+ *                no InvMixColumns if last (x86 AESDEC and AESDECLAST)
+ * aes_accel_mc:  MixColumns(st), or InvMixColumns(st) if inverse
+ *
+ * They may only be called if aes_accel_available() returns true;
+ * otherwise the tables above have to be used.
+ */
+bool aes_accel_available(void);
+void aes_accel_enc(uint8_t *st, const uint8_t *rk, bool last);
+void aes_accel_dec(uint8_t *st, const uint8_t *rk, bool last);
+void aes_accel_mc(uint8_t *st, bool inverse);
+
 #endif
@@ -74,6 +74,7 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: allow concurrent I/O from up to @n_threads threads
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
@@ -105,6 +106,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -165,6 +167,9 @@ QCryptoBlockInfo *qcrypto_block_get_info(QCryptoBlock *block,
  * Decrypt @len bytes of cipher text in @buf, writing
  * plain text back into @buf
  *
+ * This may be called from up to @n_threads threads at
+ * once, as given to qcrypto_block_open()
+ *
  * Returns 0 on success, -1 on failure
  */
 int qcrypto_block_decrypt(QCryptoBlock *block,
@@ -184,6 +189,9 @@ int qcrypto_block_decrypt(QCryptoBlock *block,
  * Encrypt @len bytes of plain text in @buf, writing
  * cipher text back into @buf
  *
+ * This may be called from up to @n_threads threads at
+ * once, as given to qcrypto_block_open()
+ *
  * Returns 0 on success, -1 on failure
  */
 int qcrypto_block_encrypt(QCryptoBlock *block,
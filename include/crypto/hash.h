@@ -97,6 +97,30 @@ int qcrypto_hash_bytes(QCryptoHashAlgorithm alg,
                        size_t *resultlen,
                        Error **errp);
 
+/**
+ * qcrypto_hash_bytes_batch:
+ * @alg: the hash algorithm
+ * @bufs: the array of memory regions to hash
+ * @nbufs: the length of @bufs
+ * @results: buffer to hold the output hashes
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Computes a separate hash of each memory region in
+ * @bufs, for example to fingerprint many pages at
+ * once.  The hash of @bufs[i] is stored as raw bytes
+ * at offset i * qcrypto_hash_digest_len(@alg) in
+ * @results, which must be large enough to hold
+ * @nbufs hashes.  The hash state is set up once for
+ * the whole batch.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qcrypto_hash_bytes_batch(QCryptoHashAlgorithm alg,
+                             const struct iovec *bufs,
+                             size_t nbufs,
+                             uint8_t *results,
+                             Error **errp);
+
 /**
  * qcrypto_hash_digestv:
  * @alg: the hash algorithm
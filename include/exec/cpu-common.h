@@ -63,7 +63,11 @@ RAMBlock *qemu_ram_block_from_host(void *ptr, bool round_offset,
 void qemu_ram_set_idstr(RAMBlock *block, const char *name, DeviceState *dev);
 void qemu_ram_unset_idstr(RAMBlock *block);
 const char *qemu_ram_get_idstr(RAMBlock *rb);
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb);
+void *qemu_ram_get_host_addr(RAMBlock *rb);
 size_t qemu_ram_pagesize(RAMBlock *block);
+bool qemu_ram_is_shared(RAMBlock *rb);
+void qemu_ram_collapse_schedule(void *host, size_t length);
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
                             int len, int is_write);
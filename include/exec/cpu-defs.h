@@ -55,8 +55,13 @@ typedef uint64_t target_ulong;
 #endif
 
 #if !defined(CONFIG_USER_ONLY)
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/* use a fully associative victim tlb.  Each MMU mode starts out with
+ * CPU_VTLB_MIN_SIZE entries and may grow up to CPU_VTLB_SIZE entries
+ * when it is flushed, depending on how much it was used since the
+ * previous flush.
+ */
+#define CPU_VTLB_MIN_SIZE 8
+#define CPU_VTLB_SIZE 64
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -64,8 +69,8 @@ typedef uint64_t target_ulong;
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
-/* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_BITS to ensure that
- * the TLB is not unnecessarily small, but still small enough for the
+/* TCG_TARGET_TLB_DISPLACEMENT_BITS is used in CPU_TLB_FIXED_BITS to ensure
+ * that the TLB is not unnecessarily small, but still small enough for the
  * TLB lookup instruction sequence used by the TCG target.
  *
  * TCG will have to generate an operand as large as the distance between
@@ -86,7 +91,7 @@ typedef uint64_t target_ulong;
  * 0x18 (the offset of the addend field in each TLB entry) plus the offset
  * of tlb_table inside env (which is non-trivial but not huge).
  */
-#define CPU_TLB_BITS                                             \
+#define CPU_TLB_FIXED_BITS                                       \
     MIN(8,                                                       \
         TCG_TARGET_TLB_DISPLACEMENT_BITS - CPU_TLB_ENTRY_BITS -  \
         (NB_MMU_MODES <= 1 ? 0 :                                 \
@@ -94,6 +99,22 @@ typedef uint64_t target_ulong;
          NB_MMU_MODES <= 4 ? 2 :                                 \
          NB_MMU_MODES <= 8 ? 3 : 4))
 
+/* A TCG backend that defines TCG_TARGET_IMPLEMENTS_DYN_TLB loads the
+ * index mask of the main TLB from env->tlb_mask[] instead of using a
+ * constant.  The main TLB of each MMU mode is then resized on flush
+ * between CPU_TLB_DYN_MIN_BITS and CPU_TLB_DYN_MAX_BITS; the tables are
+ * allocated at the maximum size, so their offsets in env do not change.
+ * All the other backends keep a main TLB of CPU_TLB_FIXED_BITS.
+ */
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 10
+#define CPU_TLB_BITS CPU_TLB_DYN_MAX_BITS
+#else
+#define CPU_TLB_BITS CPU_TLB_FIXED_BITS
+#endif
+
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
 typedef struct CPUTLBEntry {
@@ -129,15 +150,38 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Per MMU mode TLB state that is only used from C code.  A zeroed
+ * descriptor is valid: it describes a minimal victim TLB and a main
+ * TLB that must be cleared on the next flush.
+ */
+typedef struct CPUTLBDesc {
+    /* main TLB entries filled since the last flush, drives its resizing */
+    unsigned int n_used_entries;
+    /* the victim TLB has CPU_VTLB_MIN_SIZE << vtlb_shift entries */
+    unsigned int vtlb_shift;
+    unsigned int vtlb_index;
+    /* usage since the last flush, drives the victim TLB resizing */
+    unsigned int window_evictions;
+    unsigned int window_vtlb_hits;
+    /* true if tlb_table holds no valid entry for this MMU mode */
+    bool clean;
+    /* statistics */
+    uint64_t fills;
+    uint64_t vtlb_hits;
+    uint64_t flushes;
+} CPUTLBDesc;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
+    /* (number of main TLB entries - 1) << CPU_TLB_ENTRY_BITS */     \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
-    target_ulong vtlb_index;                                            \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
 
 #else
 
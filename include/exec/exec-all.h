@@ -83,6 +83,13 @@ void cpu_reloading_memory_map(void);
  */
 void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Give every MMU mode of the specified CPU its initial, empty TLB.
+ */
+void tlb_init(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -102,6 +109,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr);
  * use one of the other functions for efficiency.
  */
 void tlb_flush(CPUState *cpu);
+/**
+ * tlb_flush_all_cpus:
+ * @src_cpu: source CPU of the flush
+ *
+ * Like tlb_flush(), on every CPU.  @src_cpu must be the calling vCPU:
+ * its own TLB is flushed immediately, while the flush is queued as
+ * asynchronous work on all the others.
+ */
+void tlb_flush_all_cpus(CPUState *src_cpu);
 /**
  * tlb_flush_page_by_mmuidx:
  * @cpu: CPU whose TLB should be flushed
@@ -121,6 +137,54 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_flush_range_by_mmuidx:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ * @idxmap: bitmap of MMU indexes to flush
+ *
+ * Flush every page overlapping [@addr, @addr + @len) from the TLB of
+ * the specified CPU, for the specified MMU indexes.  This is much
+ * cheaper than calling tlb_flush_page_by_mmuidx() for every page; if
+ * @cpu is not the calling vCPU the flush is queued as asynchronous
+ * work on it.
+ */
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Like tlb_flush_range_by_mmuidx(), for all MMU indexes.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
+/**
+ * tlb_flush_range_by_mmuidx_all_cpus:
+ * @src_cpu: source CPU of the flush
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ * @idxmap: bitmap of MMU indexes to flush
+ *
+ * Like tlb_flush_range_by_mmuidx(), on every CPU.  Used to implement
+ * broadcast TLB maintenance operations.  @src_cpu must be the calling
+ * vCPU: its own TLB is flushed immediately, while the flush is queued
+ * as asynchronous work on all the others.
+ */
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
+                                        target_ulong len, uint16_t idxmap);
+/**
+ * tlb_flush_range_all_cpus:
+ * @src_cpu: source CPU of the flush
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Like tlb_flush_range_by_mmuidx_all_cpus(), for all MMU indexes.
+ */
+void tlb_flush_range_all_cpus(CPUState *src_cpu, target_ulong addr,
+                              target_ulong len);
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -159,6 +223,10 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr);
 #else
+static inline void tlb_init(CPUState *cpu)
+{
+}
+
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
 }
@@ -167,6 +235,10 @@ static inline void tlb_flush(CPUState *cpu)
 {
 }
 
+static inline void tlb_flush_all_cpus(CPUState *src_cpu)
+{
+}
+
 static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
                                             target_ulong addr, ...)
 {
@@ -175,6 +247,29 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                             target_ulong len, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
+
+static inline void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu,
+                                                      target_ulong addr,
+                                                      target_ulong len,
+                                                      uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_range_all_cpus(CPUState *src_cpu,
+                                            target_ulong addr,
+                                            target_ulong len)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -211,6 +306,7 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_PROFILE     0x80000 /* Count executions in exec_count */
 
     uint16_t invalid;
 
@@ -251,11 +347,21 @@ struct TranslationBlock {
      */
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_list_first;
+
+    /* Per-TB profile for "info tb-profile".  exec_count is only
+     * incremented by the generated code when cflags has CF_PROFILE;
+     * it is not atomic, so counts are approximate with MTTCG.
+     */
+    uint64_t exec_count;
+    int64_t gen_ticks;    /* host ticks spent translating */
+    uint32_t tc_size;     /* size of the generated host code */
 };
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -375,6 +481,10 @@ static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong
 {
     return addr;
 }
+
+static inline void tlb_drain_coalesced_mmio(CPUState *cpu)
+{
+}
 #else
 static inline void mmap_lock(void) {}
 static inline void mmap_unlock(void) {}
@@ -382,6 +492,12 @@ static inline void mmap_unlock(void) {}
 /* cputlb.c */
 tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 
+/* Dispatch the writes to coalesced MMIO ranges that CPU has queued;
+ * the caller must hold the BQL.  */
+void tcg_flush_coalesced_mmio(CPUState *cpu);
+/* Likewise, called by CPU itself; takes the BQL if needed.  */
+void tlb_drain_coalesced_mmio(CPUState *cpu);
+
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr);
 
@@ -13,17 +13,30 @@ static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count, flag, imm;
 
-    exitreq_label = gen_new_label();
-    flag = tcg_temp_new_i32();
-    tcg_gen_ld_i32(flag, cpu_env,
-                   offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
-    tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
-    tcg_temp_free_i32(flag);
+    if (tb->cflags & CF_PROFILE) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+        TCGv_i64 execs = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(execs, ptr, 0);
+        tcg_gen_addi_i64(execs, execs, 1);
+        tcg_gen_st_i64(execs, ptr, 0);
+        tcg_temp_free_i64(execs);
+        tcg_temp_free_ptr(ptr);
+    }
 
     if (!(tb->cflags & CF_USE_ICOUNT)) {
+        exitreq_label = gen_new_label();
+        flag = tcg_temp_new_i32();
+        tcg_gen_ld_i32(flag, cpu_env,
+                       offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
+        tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
+        tcg_temp_free_i32(flag);
         return;
     }
 
+    /* With icount, exit requests set the high half of icount_decr, which
+     * makes the budget check below fail; a single test covers both.
+     */
     icount_label = gen_new_label();
     count = tcg_temp_local_new_i32();
     tcg_gen_ld_i32(count, cpu_env,
@@ -47,10 +60,10 @@ static inline void gen_tb_start(TranslationBlock *tb)
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
-    gen_set_label(exitreq_label);
-    tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
-
-    if (tb->cflags & CF_USE_ICOUNT) {
+    if (!(tb->cflags & CF_USE_ICOUNT)) {
+        gen_set_label(exitreq_label);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    } else {
         /* Update the num_insn immediate parameter now that we know
          * the actual insn count.  */
         tcg_set_insn_param(icount_start_insn_idx, 1, num_insns);
@@ -239,6 +239,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -269,11 +270,17 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    /* Incremented, under the BQL, after each memory map change.  */
+    unsigned topology_gen;
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
+    /* During a commit, the AddressSpace with an identical FlatView whose
+     * dispatch tree this one shares.
+     */
+    struct AddressSpace *dispatch_src;
     MemoryListener dispatch_listener;
     QTAILQ_HEAD(memory_listeners_as, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
@@ -876,6 +883,21 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Clear the dirty log of accelerators
+ *                                   for part of a region
+ *
+ * Accelerators that do not rearm dirty logging when it is synced (kvm
+ * with manual dirty log protection) are told that the range is about to
+ * be processed, so that writes from now on are logged again.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the range, relative to the start of the region.
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -891,6 +913,45 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client);
 
+/**
+ * memory_region_snapshot_and_clear_dirty: Get a snapshot of the dirty
+ *                                         bitmap and clear it.
+ *
+ * Creates a snapshot of the dirty bitmap, clears the dirty bitmap and
+ * returns the snapshot.  The snapshot can then be used to query dirty
+ * status, using memory_region_snapshot_get_dirty.  Unlike
+ * memory_region_test_and_clear_dirty this allows to query the same
+ * page multiple times, which is especially useful for display updates
+ * where the scanlines often are not page aligned.
+ *
+ * The dirty bitmap region which gets copied into the snapshot (and
+ * cleared afterwards) can be larger than requested, since it is
+ * processed a word of the bitmap at a time.  Free the snapshot with
+ * g_free().
+ *
+ * @mr: the memory region being queried.
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ * @client: the user of the logging information; typically %DIRTY_MEMORY_VGA.
+ */
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client);
+
+/**
+ * memory_region_snapshot_get_dirty: Check whether a range of bytes is dirty
+ *                                   in the specified dirty bitmap snapshot.
+ *
+ * @mr: the memory region being queried.
+ * @snap: the dirty bitmap snapshot
+ * @addr: the address (relative to the start of the region) being queried.
+ * @size: the size of the range being queried.
+ */
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
@@ -953,6 +1014,20 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_is_coalesced: Check whether an access may be coalesced.
+ *
+ * Returns true if [@addr, @addr + @size) lies entirely within one of the
+ * ranges set up by memory_region_set_coalescing() or
+ * memory_region_add_coalescing().  May be called without the iothread
+ * lock, from within an RCU critical section.
+ *
+ * @mr: the memory region being accessed.
+ * @addr: the offset of the access within @mr.
+ * @size: the size of the access in bytes.
+ */
+bool memory_region_is_coalesced(MemoryRegion *mr, hwaddr addr, unsigned size);
+
 /**
  * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
  *                                    accesses.
@@ -1472,6 +1547,63 @@ void address_space_cache_invalidate(MemoryRegionCache *cache,
  */
 void address_space_cache_destroy(MemoryRegionCache *cache);
 
+struct AddressSpaceWindow {
+    AddressSpace *as;
+    hwaddr addr;
+    hwaddr len;
+    bool is_write;
+    struct AddressSpaceWindowMap *map;
+};
+
+/**
+ * address_space_window_init: prepare for repeated DMA to a range of an
+ * address space
+ *
+ * Unlike a #MemoryRegionCache, an #AddressSpaceWindow may cover any
+ * range: accesses to the part of it that is backed by RAM go straight
+ * to host memory, while the rest goes through address_space_rw().  The
+ * translation is redone automatically, and the old one released after
+ * an RCU grace period, whenever the memory map of @as changes, so a
+ * device can keep the window across requests.  Windows that start
+ * behind an IOMMU are never cached.
+ *
+ * Note that addresses passed to address_space_window_rw are relative
+ * to @addr.
+ *
+ * @w: #AddressSpaceWindow to be initialized
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the window
+ * @is_write: whether writes should also use the fast path
+ */
+void address_space_window_init(AddressSpaceWindow *w, AddressSpace *as,
+                               hwaddr addr, hwaddr len, bool is_write);
+
+/**
+ * address_space_window_rw: read from or write to an #AddressSpaceWindow
+ *
+ * Return a MemTxResult indicating whether the operation succeeded
+ * or failed (eg unassigned memory, device rejected the transaction,
+ * IOMMU fault).
+ *
+ * @w: #AddressSpaceWindow to be accessed
+ * @addr: address relative to the start of the window
+ * @attrs: memory transaction attributes, for accesses that are not to RAM
+ * @buf: buffer with the data transferred
+ * @len: length of the data transferred
+ * @is_write: indicates the transfer direction
+ */
+MemTxResult address_space_window_rw(AddressSpaceWindow *w, hwaddr addr,
+                                    MemTxAttrs attrs, void *buf, hwaddr len,
+                                    bool is_write);
+
+/**
+ * address_space_window_destroy: release an #AddressSpaceWindow
+ *
+ * @w: The #AddressSpaceWindow whose translation should be released.
+ */
+void address_space_window_destroy(AddressSpaceWindow *w);
+
 /* address_space_ld*_cached: load from a cached #MemoryRegion
  * address_space_st*_cached: store into a cached #MemoryRegion
  *
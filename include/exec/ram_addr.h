@@ -39,6 +39,17 @@ struct RAMBlock {
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
     int fd;
     size_t page_size;
+    /* Pages present in an x-mapped-ram file, and where they are stored;
+     * with x-lazy-restore, only those that are not restored yet
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    /* COLO Secondary: RAM as of the checkpoint being received, and the
+     * pages of it that have to be copied to host on completion
+     */
+    uint8_t *colo_cache;
+    unsigned long *colo_bmap;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -342,6 +353,16 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
+    (ram_addr_t start, ram_addr_t length, unsigned client);
+
+bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
+                                            ram_addr_t start,
+                                            ram_addr_t length);
+
+/* Rearm the accelerators' dirty logging for a range of guest RAM */
+void cpu_physical_memory_clear_dirty_log(ram_addr_t start, ram_addr_t length);
+
 static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
                                                          ram_addr_t length)
 {
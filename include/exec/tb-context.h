@@ -26,6 +26,8 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+#define CODE_GEN_MAX_REGIONS     16
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
 
@@ -34,11 +36,16 @@ struct TBContext {
     TranslationBlock *tbs;
     struct qht htable;
     int nb_tbs;
+    /* TBs allocated from each code buffer region; region r owns the
+     * descriptors starting at tbs[r * (code_gen_max_blocks / regions)].
+     */
+    int region_nb_tbs[CODE_GEN_MAX_REGIONS];
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_region_reclaim_count;
     int tb_phys_invalidate_count;
 };
 
@@ -18,6 +18,10 @@
         .driver   = "pci-bridge",\
         .property = "shpc",\
         .value    = "on",\
+    },{\
+        .driver   = "vhost-vsock-device",\
+        .property = "seqpacket",\
+        .value    = "off",\
     },
 
 #define HW_COMPAT_2_7 \
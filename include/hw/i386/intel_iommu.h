@@ -86,6 +86,11 @@ struct VTDAddressSpace {
     MemoryRegion iommu_ir;      /* Interrupt region: 0xfeeXXXXX */
     IntelIOMMUState *iommu_state;
     VTDContextCacheEntry context_cache_entry;
+    /* The last IOTLB entry used by this device.  It is obsolete if
+     * iotlb_gen!=IntelIOMMUState.iotlb_gen.
+     */
+    uint64_t iotlb_gen;
+    struct VTDIOTLBEntry iotlb_entry;
 };
 
 struct VTDBus {
@@ -280,6 +285,7 @@ struct IntelIOMMUState {
 
     uint32_t context_cache_gen;     /* Should be in [1,MAX] */
     GHashTable *iotlb;              /* IOTLB */
+    uint64_t iotlb_gen;             /* Bumped on any IOTLB invalidation */
 
     MemoryRegionIOMMUOps iommu_ops;
     GHashTable *vtd_as_by_busptr;   /* VTDBus objects indexed by PCIBus* reference */
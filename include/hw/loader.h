@@ -15,6 +15,21 @@ int get_image_size(const char *filename);
 int load_image(const char *filename, uint8_t *addr); /* deprecated */
 ssize_t load_image_size(const char *filename, void *addr, size_t size);
 
+/**
+ * load_image_mapped: map an image file into memory
+ * @filename: Path to the image file
+ * @size: Filled with the size of the image
+ * @errp: Error object
+ *
+ * Maps the file read-only instead of reading it, so that its pages are
+ * only read in once something accesses them, e.g. a fw_cfg DMA transfer
+ * straight into guest memory.  The mapping is never released.  The file
+ * must not be modified while QEMU runs.
+ *
+ * Returns the contents of the file, or NULL with @errp set on failure.
+ */
+void *load_image_mapped(const char *filename, size_t *size, Error **errp);
+
 /**load_image_targphys_as:
  * @filename: Path to the image file
  * @addr: Address to load the image to
@@ -73,6 +73,15 @@ typedef struct VFIOAddressSpace {
 
 struct VFIOGroup;
 
+/* A RAM mapping queued by region_add until the listener's commit */
+typedef struct VFIODMARange {
+    hwaddr iova;
+    uint64_t size;
+    void *vaddr;
+    bool readonly;
+    QSIMPLEQ_ENTRY(VFIODMARange) next;
+} VFIODMARange;
+
 typedef struct VFIOContainer {
     VFIOAddressSpace *space;
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
@@ -81,6 +90,8 @@ typedef struct VFIOContainer {
     unsigned iommu_type;
     int error;
     bool initialized;
+    bool dirty_tracking; /* between log_global_start and _stop */
+    bool dirty_pages_supported; /* VFIO_IOMMU_DIRTY_PAGES started */
     /*
      * This assumes the host IOMMU can support only a single
      * contiguous IOVA window.  We may need to generalize that in
@@ -89,6 +100,7 @@ typedef struct VFIOContainer {
     QLIST_HEAD(, VFIOGuestIOMMU) giommu_list;
     QLIST_HEAD(, VFIOHostDMAWindow) hostwin_list;
     QLIST_HEAD(, VFIOGroup) group_list;
+    QSIMPLEQ_HEAD(, VFIODMARange) pending_maps;
     QLIST_ENTRY(VFIOContainer) next;
 } VFIOContainer;
 
@@ -109,6 +121,16 @@ typedef struct VFIOHostDMAWindow {
 
 typedef struct VFIODeviceOps VFIODeviceOps;
 
+typedef struct VFIOMigration {
+    struct VFIODevice *vbasedev;
+    DeviceState *dev;
+    struct vm_change_state_entry *vm_state;
+    uint32_t device_state;
+    int data_fd;
+    void *data_buffer;
+    size_t data_buffer_size;
+} VFIOMigration;
+
 typedef struct VFIODevice {
     QLIST_ENTRY(VFIODevice) next;
     struct VFIOGroup *group;
@@ -119,16 +141,22 @@ typedef struct VFIODevice {
     bool reset_works;
     bool needs_reset;
     bool no_mmap;
+    bool enable_migration;
     VFIODeviceOps *ops;
     unsigned int num_irqs;
     unsigned int num_regions;
     unsigned int flags;
+    VFIOMigration *migration;
+    Error *migration_blocker;
 } VFIODevice;
 
 struct VFIODeviceOps {
     void (*vfio_compute_needs_reset)(VFIODevice *vdev);
     int (*vfio_hot_reset_multi)(VFIODevice *vdev);
     void (*vfio_eoi)(VFIODevice *vdev);
+    /* Emulated device state, sent after the device's own migration data */
+    void (*vfio_save_config)(VFIODevice *vdev, QEMUFile *f);
+    int (*vfio_load_config)(VFIODevice *vdev, QEMUFile *f);
 };
 
 typedef struct VFIOGroup {
@@ -178,4 +206,8 @@ int vfio_spapr_create_window(VFIOContainer *container,
 int vfio_spapr_remove_window(VFIOContainer *container,
                              hwaddr offset_within_address_space);
 
+int vfio_migration_probe(VFIODevice *vbasedev, DeviceState *dev,
+                         Error **errp);
+void vfio_migration_finalize(VFIODevice *vbasedev);
+
 #endif /* HW_VFIO_VFIO_COMMON_H */
@@ -0,0 +1,67 @@
+/*
+ * Vhost-user filesystem virtio device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef _QEMU_VHOST_USER_FS_H
+#define _QEMU_VHOST_USER_FS_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/vhost.h"
+#include "sysemu/char.h"
+
+#define TYPE_VHOST_USER_FS "vhost-user-fs-device"
+#define VHOST_USER_FS(obj) \
+        OBJECT_CHECK(VHostUserFS, (obj), TYPE_VHOST_USER_FS)
+
+/* Shared memory region ids, see VIRTIO_PCI_CAP_SHARED_MEMORY_CFG */
+#define VIRTIO_FS_SHMCAP_ID_CACHE 0
+
+/* Payload of the VHOST_USER_SLAVE_FS_* slave requests */
+#define VHOST_USER_FS_SLAVE_ENTRIES 8
+
+#define VHOST_USER_FS_FLAG_MAP_R (1ULL << 0)
+#define VHOST_USER_FS_FLAG_MAP_W (1ULL << 1)
+
+typedef struct VhostUserFSSlaveMsg {
+    /* Offsets within the file passed in the ancillary data */
+    uint64_t fd_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* Offsets within the DAX window */
+    uint64_t c_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* Lengths of the sections, entries with zero length are skipped */
+    uint64_t len[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* VHOST_USER_FS_FLAG_* */
+    uint64_t flags[VHOST_USER_FS_SLAVE_ENTRIES];
+} VhostUserFSSlaveMsg;
+
+typedef struct {
+    CharBackend chardev;
+    char *tag;
+    uint16_t num_request_queues;
+    uint16_t queue_size;
+    uint64_t cache_size;
+} VHostUserFSConf;
+
+typedef struct {
+    /*< private >*/
+    VirtIODevice parent;
+    VHostUserFSConf conf;
+    struct vhost_virtqueue *vhost_vqs;
+    struct vhost_dev vhost_dev;
+
+    /* DAX window, PROT_NONE except where the slave mapped file pages */
+    MemoryRegion cache;
+    void *cache_ptr;
+
+    /*< public >*/
+} VHostUserFS;
+
+int vhost_user_fs_slave_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
+                            int fd);
+int vhost_user_fs_slave_unmap(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm);
+int vhost_user_fs_slave_sync(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm);
+
+#endif /* _QEMU_VHOST_USER_FS_H */
@@ -24,6 +24,7 @@
 typedef struct {
     uint64_t guest_cid;
     char *vhostfd;
+    OnOffAuto seqpacket;
 } VHostVSockConf;
 
 typedef struct {
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -74,6 +75,12 @@ typedef struct VirtIOBlockReq {
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Requests popped from a virtqueue in one go */
+#define VIRTIO_BLK_POP_BATCH 16
+
+/* Pooled requests hold up to 32 data buffers plus header and status */
+#define VIRTIO_BLK_POOL_SG (32 + 2)
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
@@ -38,6 +38,7 @@ struct virtio_gpu_simple_resource {
     unsigned int iov_cnt;
     uint32_t scanout_bitmask;
     pixman_image_t *image;
+    bool zero_copy;     /* image data is the guest backing itself */
     uint64_t hostmem;
     QTAILQ_ENTRY(virtio_gpu_simple_resource) next;
 };
@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -37,8 +38,54 @@ typedef struct virtio_net_conf
     char *tx;
     uint16_t rx_queue_size;
     uint16_t mtu;
+    IOThread *iothread;
+    char *iothreads;
 } virtio_net_conf;
 
+/* Limits advertised for VIRTIO_NET_F_RSS */
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtioNetRssData {
+    bool enabled;           /* a hash or RSS configuration is active */
+    bool redirect;          /* steer packets by the indirection table */
+    bool populate_hash;     /* report the hash in the packet header */
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+} VirtioNetRssData;
+
+/* Hash fields of struct virtio_net_hdr_v1_hash, little endian */
+typedef struct VirtIONetRxHash {
+    uint32_t value;
+    uint16_t report;
+    uint16_t padding;
+} QEMU_PACKED VirtIONetRxHash;
+
+/* Receive segment coalescing, see VIRTIO_NET_F_RSC_EXT */
+#define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000 /* 300 us */
+
+/* TCP segments of one flow, coalesced in place and not delivered yet */
+typedef struct VirtioNetRscSeg {
+    QTAILQ_ENTRY(VirtioNetRscSeg) next;
+    NetClientState *nc;     /* queue the segments were received on */
+    uint8_t *buf;           /* backend header and frame */
+    size_t size;
+    uint16_t packets;       /* number of segments coalesced */
+    uint16_t mss;           /* payload size of the first segment */
+    VirtIONetRxHash hash;
+} VirtioNetRscSeg;
+
+typedef struct VirtioNetRscChain {
+    struct VirtIONet *n;
+    uint16_t proto;         /* ETH_P_IP or ETH_P_IPV6 */
+    uint8_t gso_type;       /* reported for coalesced segments */
+    QEMUTimer *drain_timer;
+    QTAILQ_HEAD(, VirtioNetRscSeg) buffers;
+} VirtioNetRscChain;
+
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
@@ -52,6 +99,10 @@ typedef struct VirtIONetQueue {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    AioContext *ctx;    /* iothread running this queue pair, or NULL */
+    bool rx_batch;          /* backend is delivering a burst */
+    bool rx_notify_pending; /* rx interrupt deferred to the end of it */
+    struct NetRxPkt *rx_pkt; /* parsed headers for RSS hashing */
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -66,7 +117,7 @@ typedef struct VirtIONet {
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
-    uint32_t host_features;
+    uint64_t host_features;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -97,6 +148,15 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    IOThread **iothreads;
+    int nb_iothreads;
+    bool dataplane_started;
+    bool dataplane_disabled;
+    bool saved_guest_notifier_mask;
+    VirtioNetRssData rss_data;
+    uint32_t rsc_timeout;
+    VirtioNetRscChain rsc4_chain;
+    VirtioNetRscChain rsc6_chain;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
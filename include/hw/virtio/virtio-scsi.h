@@ -32,6 +32,9 @@
         OBJECT_CHECK(VirtIOSCSI, (obj), TYPE_VIRTIO_SCSI)
 
 #define VIRTIO_SCSI_VQ_SIZE     128
+#define VIRTIO_SCSI_POP_BATCH   16
+/* Pooled requests hold up to 32 data buffers plus request and response */
+#define VIRTIO_SCSI_POOL_SG     (32 + 2)
 #define VIRTIO_SCSI_MAX_CHANNEL 0
 #define VIRTIO_SCSI_MAX_TARGET  255
 #define VIRTIO_SCSI_MAX_LUN     16383
@@ -82,6 +85,8 @@ typedef struct VirtIOSCSI {
     bool dataplane_starting;
     bool dataplane_stopping;
     bool dataplane_fenced;
+    QEMUBH *notify_bh;              /* bh for guest notification */
+    unsigned long *notify_vqs;      /* virtqueues to notify from notify_bh */
     uint32_t host_features;
 } VirtIOSCSI;
 
@@ -135,7 +140,9 @@ void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
 int virtio_scsi_dataplane_start(VirtIODevice *s);
 void virtio_scsi_dataplane_stop(VirtIODevice *s);
+void virtio_scsi_dataplane_notify(VirtIOSCSI *s, VirtQueue *vq);
 
 #endif /* QEMU_VIRTIO_SCSI_H */
@@ -79,6 +79,14 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+
+    /*
+     * Optional scatter-gather variant of have_data, handed everything
+     * that is left of a guest buffer at once.  Used instead of have_data
+     * when implemented.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port,
+                             const struct iovec *iov, int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
@@ -0,0 +1,89 @@
+/*
+ * Compression methods for migrating RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qapi-types.h"
+
+/**
+ * migration_compress_method_supported: Check that QEMU was built with
+ * support for a compression method
+ *
+ * @method: the compression method
+ */
+bool migration_compress_method_supported(MigrationCompressMethod method);
+
+/**
+ * migration_compress_bound: Returns the largest size that @size bytes
+ * of data can compress to with @method
+ *
+ * @method: the compression method
+ * @size: size of the uncompressed data
+ */
+size_t migration_compress_bound(MigrationCompressMethod method, size_t size);
+
+/**
+ * migration_compressor_new: Create a compressor
+ *
+ * Returns a compressor that may be used by one thread at a time, or NULL
+ * with @errp set if @method is not supported.
+ *
+ * @method: the compression method
+ * @level: compression level, from 0 to 9; how it is interpreted depends
+ *         on @method
+ * @errp: pointer to a NULL-initialized error object
+ */
+MigrationCompressor *migration_compressor_new(MigrationCompressMethod method,
+                                              int level, Error **errp);
+
+/**
+ * migration_compressor_free: Free a compressor created by
+ * migration_compressor_new
+ *
+ * @c: the compressor, may be NULL
+ */
+void migration_compressor_free(MigrationCompressor *c);
+
+/**
+ * migration_compressor_bound: Like migration_compress_bound, for the
+ * method of @c
+ *
+ * @c: the compressor
+ * @size: size of the uncompressed data
+ */
+size_t migration_compressor_bound(MigrationCompressor *c, size_t size);
+
+/**
+ * migration_compress: Compress a buffer
+ *
+ * Returns the compressed size, or -1 on error
+ *
+ * @c: the compressor
+ * @dst: output buffer
+ * @dlen: size of @dst, at least migration_compress_bound(@slen)
+ * @src: data to compress
+ * @slen: size of @src
+ */
+ssize_t migration_compress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                           const uint8_t *src, size_t slen);
+
+/**
+ * migration_decompress: Decompress a buffer
+ *
+ * Returns the decompressed size, or -1 on error
+ *
+ * @c: the compressor
+ * @dst: output buffer
+ * @dlen: size of @dst
+ * @src: data to decompress
+ * @slen: size of @src
+ */
+ssize_t migration_decompress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen);
+
+#endif
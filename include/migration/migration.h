@@ -236,10 +236,21 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+QIOChannel *socket_send_channel_create(Error **errp);
+
+void socket_cleanup_outgoing_migration(void);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+int file_mapped_ram_open(bool writable, bool direct, Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
@@ -266,6 +277,14 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_load_threads_create(void);
+void migrate_load_threads_join(void);
+int multifd_load_setup(QIOChannel *listener, Error **errp);
+void multifd_load_cleanup(void);
+void multifd_save_shutdown(void);
+int postcopy_preempt_load_setup(QIOChannel *listener, Error **errp);
+void postcopy_preempt_load_cleanup(bool drain);
+void postcopy_preempt_save_shutdown(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -284,6 +303,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+double xbzrle_mig_cache_hit_rate(void);
+CompressionStats *compress_mig_stats(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -292,9 +313,37 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
+int ram_lazy_restore_fill(RAMBlock *rb, ram_addr_t offset, size_t len,
+                          uint8_t *buf);
+bool ram_lazy_restore_next(RAMBlock **rb, ram_addr_t *offset,
+                           size_t pagesize);
+void ram_lazy_restore_cleanup(void);
+bool ram_write_tracking_supported(void);
+void ram_write_tracking_prepare(void);
+int ram_write_tracking_start(void);
+void ram_write_tracking_stop(void);
+void ram_write_tracking_copy(RAMBlock *rb, ram_addr_t offset, size_t len);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 void ram_postcopy_migrated_memory_release(MigrationState *ms);
 
+/* Points of a precopy migration at which precopy notifiers are called;
+ * the notifier's data is a pointer to the PrecopyNotifyReason.
+ */
+typedef enum PrecopyNotifyReason {
+    PRECOPY_NOTIFY_SETUP,
+    PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC,
+    PRECOPY_NOTIFY_AFTER_BITMAP_SYNC,
+    PRECOPY_NOTIFY_COMPLETE,
+    PRECOPY_NOTIFY_CLEANUP,
+} PrecopyNotifyReason;
+
+void precopy_add_notifier(Notifier *n);
+void precopy_remove_notifier(Notifier *n);
+void qemu_guest_free_page_hint(void *addr, size_t len);
+int colo_init_ram_cache(void);
+void colo_flush_ram_cache(void);
+void colo_release_ram_cache(void);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -322,6 +371,7 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool test_xbzrle_encode_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -331,8 +381,24 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_use_mapped_ram(void);
+bool migrate_use_direct_io(void);
+bool migrate_lazy_restore(void);
+bool migrate_background_snapshot(void);
+bool migrate_zero_page_runs(void);
+bool migrate_ignore_shared(void);
+int migrate_multifd_channels(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_load_threads(void);
+int64_t migrate_rdma_pin_limit(void);
+int migrate_block_queue_depth(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_use_vcpu_throttle(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
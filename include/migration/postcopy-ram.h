@@ -96,4 +96,26 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Start the guest's RAM empty, and fill it from the x-mapped-ram file
+ * of the incoming migration as its pages are faulted in and in the
+ * background, through ram_lazy_restore_fill and ram_lazy_restore_next.
+ * Cleans up by itself once all pages are in.
+ * returns 0 on success
+ */
+int postcopy_lazy_restore_start(MigrationIncomingState *mis);
+
+/* Return true if the host can write protect RAM with userfaultfd */
+bool postcopy_wp_supported_by_host(void);
+
+/*
+ * Write protect all of RAM; the first write to each page then blocks
+ * until ram_write_tracking_copy has run for it.
+ * returns 0 on success
+ */
+int postcopy_wp_start(void);
+
+/* Drop the write protection, if any; safe to call at any time */
+void postcopy_wp_stop(void);
+
 #endif
@@ -33,6 +33,10 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The data stays valid until the sent callback runs, so a packet that
+ * has to be queued keeps pointing to it instead of being copied.
+ * Ignored without a sent callback. */
+#define QEMU_NET_PACKET_FLAG_NOCOPY (1 << 1)
 
 /* Returns:
  *   >0 - success
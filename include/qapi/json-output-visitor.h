@@ -0,0 +1,30 @@
+/*
+ * JSON Output Visitor
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef JSON_OUTPUT_VISITOR_H
+#define JSON_OUTPUT_VISITOR_H
+
+#include "qapi/visitor.h"
+#include "qapi/qmp/qstring.h"
+
+typedef struct JSONOutputVisitor JSONOutputVisitor;
+
+/*
+ * Create a new JSON output visitor.
+ *
+ * The visit is appended to @str as compact JSON text, formatted like
+ * qobject_to_json() formats the result of a QObject output visitor,
+ * but without building the QObject first.  Members appear in schema
+ * order.
+ *
+ * If everything else succeeds, pass @str to visit_complete() to
+ * finish the visit.  On failure, @str may hold a partial result.
+ */
+Visitor *json_output_visitor_new(QString *str);
+
+#endif
@@ -16,19 +16,24 @@
 
 #include "qapi/qmp/qobject.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
 
 typedef void (QmpCommandFunc)(QDict *, QObject **, Error **);
+/* Like QmpCommandFunc, but appends the return value as JSON text */
+typedef void (QmpCommandJSONFunc)(QDict *, QString *, Error **);
 
 typedef enum QmpCommandOptions
 {
     QCO_NO_OPTIONS = 0x0,
     QCO_NO_SUCCESS_RESP = 0x1,
+    QCO_ALLOW_OOB = 0x2,
 } QmpCommandOptions;
 
 typedef struct QmpCommand
 {
     const char *name;
     QmpCommandFunc *fn;
+    QmpCommandJSONFunc *json_fn;
     QmpCommandOptions options;
     QTAILQ_ENTRY(QmpCommand) node;
     bool enabled;
@@ -36,14 +41,17 @@ typedef struct QmpCommand
 
 void qmp_register_command(const char *name, QmpCommandFunc *fn,
                           QmpCommandOptions options);
+void qmp_register_command_json(const char *name, QmpCommandJSONFunc *json_fn);
 void qmp_unregister_command(const char *name);
 QmpCommand *qmp_find_command(const char *name);
 QObject *qmp_dispatch(QObject *request);
+QString *qmp_dispatch_json(QObject *request, QObject *id);
 void qmp_disable_command(const char *name);
 void qmp_enable_command(const char *name);
 bool qmp_command_is_enabled(const QmpCommand *cmd);
 const char *qmp_command_name(const QmpCommand *cmd);
 bool qmp_has_success_response(const QmpCommand *cmd);
+bool qmp_command_allows_oob(const QmpCommand *cmd);
 QObject *qmp_build_error_object(Error *err);
 typedef void (*qmp_cmd_callback_fn)(QmpCommand *cmd, void *opaque);
 void qmp_for_each_command(qmp_cmd_callback_fn fn, void *opaque);
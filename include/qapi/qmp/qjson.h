@@ -24,4 +24,8 @@ QObject *qobject_from_jsonv(const char *string, va_list *ap) GCC_FMT_ATTR(1, 0);
 QString *qobject_to_json(const QObject *obj);
 QString *qobject_to_json_pretty(const QObject *obj);
 
+void qjson_append_qobject(QString *str, const QObject *obj);
+void qjson_append_string(QString *str, const char *s);
+void qjson_append_number(QString *str, double number);
+
 #endif /* QJSON_H */
@@ -233,7 +233,7 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
  * @hb: HBitmap to operate on.
  *
  * Repair HBitmap after calling hbitmap_deserialize_data. Actually, all HBitmap
- * layers are restored here.
+ * layers and the number of set bits are restored here.
  */
 void hbitmap_deserialize_finish(HBitmap *hb);
 
@@ -0,0 +1,47 @@
+/*
+ * Lock contention profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_LOCK_PROFILE_H
+#define QEMU_LOCK_PROFILE_H
+
+#include "qapi-types.h"
+#include "qemu/atomic.h"
+
+extern bool lock_profile_enabled;
+
+/* Callers sample the clock around lock operations only if this is true */
+static inline bool lock_profile_active(void)
+{
+    return atomic_read(&lock_profile_enabled);
+}
+
+/**
+ * lock_profile_record:
+ * @kind: the lock that was held
+ * @file: source file of the call site that took the lock
+ * @line: source line of the call site that took the lock
+ * @wait_ns: time spent waiting for the lock
+ * @hold_ns: time the lock was held
+ *
+ * Account one acquisition of a lock.  Call it when the lock is released.
+ */
+void lock_profile_record(LockProfileType kind, const char *file, int line,
+                         int64_t wait_ns, int64_t hold_ns);
+
+/**
+ * lock_profile_set_enabled:
+ * @enable: whether to collect statistics
+ *
+ * Statistics are cleared when profiling is enabled, and kept when it is
+ * disabled so that they can still be queried.
+ */
+void lock_profile_set_enabled(bool enable);
+
+/* Return the statistics collected for each call site */
+LockProfileInfoList *lock_profile_query(void);
+
+#endif
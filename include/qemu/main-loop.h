@@ -261,8 +261,12 @@ bool qemu_mutex_iothread_locked(void);
  *
  * NOTE: tools currently are single-threaded and qemu_mutex_lock_iothread
  * is a no-op there.
+ *
+ * The caller's location is recorded for lock profiling.
  */
-void qemu_mutex_lock_iothread(void);
+#define qemu_mutex_lock_iothread() \
+    qemu_mutex_lock_iothread_impl(__FILE__, __LINE__)
+void qemu_mutex_lock_iothread_impl(const char *file, int line);
 
 /**
  * qemu_mutex_unlock_iothread: Unlock the main loop mutex.
@@ -0,0 +1,66 @@
+/*
+ * Always-on metrics registry
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_METRICS_H
+#define QEMU_METRICS_H
+
+#include "qapi-types.h"
+
+/*
+ * Metrics are registered once by a subsystem and live until QEMU exits.
+ * Updates never take a lock: each metric is split into cacheline-sized
+ * shards and every thread updates the shard it was assigned, so threads
+ * running on different cores rarely touch the same cache line.  Readers
+ * (query-stats, "info stats") add up all shards.
+ *
+ * Names are dot-separated, e.g. "main-loop.iterations".
+ */
+
+typedef struct QemuMetric QemuMetric;
+
+/**
+ * qemu_metric_counter_new:
+ * @name: unique name of the metric
+ * @help: one-line description
+ *
+ * Register a counter, i.e. a monotonically increasing count.
+ */
+QemuMetric *qemu_metric_counter_new(const char *name, const char *help);
+
+/**
+ * qemu_metric_histogram_new:
+ * @name: unique name of the metric
+ * @help: one-line description
+ *
+ * Register a histogram.  Samples are counted in power-of-two buckets: bucket
+ * 0 holds zeroes and bucket i holds values in [2^(i-1), 2^i).
+ */
+QemuMetric *qemu_metric_histogram_new(const char *name, const char *help);
+
+/**
+ * qemu_metric_add:
+ * @m: a counter
+ * @n: value to add
+ */
+void qemu_metric_add(QemuMetric *m, uint64_t n);
+
+static inline void qemu_metric_inc(QemuMetric *m)
+{
+    qemu_metric_add(m, 1);
+}
+
+/**
+ * qemu_metric_observe:
+ * @m: a histogram
+ * @value: the sample
+ */
+void qemu_metric_observe(QemuMetric *m, uint64_t value);
+
+/* Return a snapshot of every registered metric */
+StatsInfoList *qemu_metrics_query(void);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Process-wide memory barrier system call
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_SYS_MEMBARRIER_H
+#define QEMU_SYS_MEMBARRIER_H
+
+#include "qemu/atomic.h"
+
+#ifdef CONFIG_MEMBARRIER
+extern bool have_sys_membarrier;
+
+/* Stands for a memory barrier on the fast side of an asymmetric pair.
+ * When smp_mb_global() can force ordering on all other threads through a
+ * system call, only compiler reordering needs to be blocked here.
+ */
+static inline void smp_mb_placeholder(void)
+{
+    if (likely(have_sys_membarrier)) {
+        barrier();
+    } else {
+        /* Pairs with the smp_mb() fallback of smp_mb_global() */
+        smp_mb();
+    }
+}
+
+/* Run a memory barrier on every thread of the process.  Pairs with
+ * smp_mb_placeholder().
+ */
+void smp_mb_global(void);
+
+/* Detect membarrier(2).  Must run while the process has a single thread. */
+void smp_mb_global_init(void);
+#else
+/* Without membarrier(2) both sides of the pair are full barriers */
+static inline void smp_mb_placeholder(void)
+{
+    /* Pairs with smp_mb_global() */
+    smp_mb();
+}
+
+static inline void smp_mb_global(void)
+{
+    /* Pairs with smp_mb_placeholder() */
+    smp_mb();
+}
+
+static inline void smp_mb_global_init(void)
+{
+}
+#endif
+
+#endif
@@ -20,6 +20,9 @@ typedef struct QemuThread QemuThread;
 #define QEMU_THREAD_JOINABLE 0
 #define QEMU_THREAD_DETACHED 1
 
+/* Size of the host CPU bitmaps passed to qemu_thread_set_affinity() */
+#define QEMU_THREAD_MAX_HOST_CPUS 1024
+
 void qemu_mutex_init(QemuMutex *mutex);
 void qemu_mutex_destroy(QemuMutex *mutex);
 void qemu_mutex_lock(QemuMutex *mutex);
@@ -59,6 +62,13 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+/*
+ * Restrict @thread to the host CPUs set in the @nbits long bitmap
+ * @host_cpus.  Threads that @thread creates afterwards inherit the
+ * affinity.  Returns 0 on success or a negative errno value.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, unsigned long *host_cpus,
+                             unsigned long nbits);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
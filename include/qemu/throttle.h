@@ -153,4 +153,10 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
+void throttle_compute_headroom(ThrottleState *ts, bool is_write,
+                               double *bytes, double *units);
+
+void throttle_reserve(ThrottleState *ts, bool is_write,
+                      double bytes, double units);
+
 #endif
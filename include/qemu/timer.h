@@ -67,7 +67,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    unsigned int heap_index;    /* position in the timer list's heap */
+    uint64_t seq;               /* orders timers with equal expire_time */
     int scale;
 };
 
@@ -0,0 +1,43 @@
+/*
+ * VFIO utility
+ *
+ * Copyright 2017 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+#include "qemu/typedefs.h"
+
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/*
+ * Take a PCI device, given as a sysfs address such as "0000:44:00.0",
+ * away from the host kernel.  The device must already be bound to
+ * vfio-pci.  All guest RAM is mapped for DMA and stays mapped while
+ * RAM blocks are added or removed.
+ */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/*
+ * Map [host, host + size) for DMA and return its IOVA in *iova.
+ * Temporary mappings are for buffers outside guest RAM; they are dropped
+ * all at once by qemu_vfio_dma_reset_temporary().
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp);
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
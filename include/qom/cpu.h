@@ -230,12 +230,17 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* Second level of the jump cache, hashed on pc, cs_base and flags */
+#define TB_JMP_CACHE2_BITS 14
+#define TB_JMP_CACHE2_SIZE (1 << TB_JMP_CACHE2_BITS)
+
 /* work queue */
 
 /* The union type allows passing of 64 bit target pointers on 32 bit
@@ -276,7 +281,10 @@ struct qemu_work_item;
  * @unplug: Indicates a pending CPU unplug request.
  * @crash_occurred: Indicates the OS reported a crash (panic) for this CPU
  * @tcg_exit_req: Set to force TCG to stop executing linked TBs for this
- *           CPU and return to its top level loop.
+ *           CPU and return to its top level loop.  With icount, the high
+ *           half of @icount_decr is used for this instead.
+ * @pending_tlb_flush: Bitmap of MMU indexes for which a flush has been
+ *           queued on this CPU by another vCPU thread but not yet run.
  * @singlestep_enabled: Flags for single-stepping.
  * @icount_extra: Instructions until next timer event.
  * @icount_decr: Number of cycles left, with interrupt flag in high bit.
@@ -299,8 +307,12 @@ struct qemu_work_item;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: This vCPU's KVM dirty ring, if it is in use.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to collect.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
+ * @coalesced_mmio_lock: Lock protecting @coalesced_mmio.
+ * @coalesced_mmio: Writes to coalesced MMIO ranges queued by TCG.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
  *
  * State of one CPU core or thread.
@@ -319,6 +331,8 @@ struct CPUState {
     HANDLE hThread;
 #endif
     int thread_id;
+    /* Host CPUs that the vCPU thread may run on, empty for all */
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
     uint32_t host_tid;
     bool running, has_waiter;
     struct QemuCond *halt_cond;
@@ -337,6 +351,9 @@ struct CPUState {
     QemuMutex work_mutex;
     struct qemu_work_item *queued_work_first, *queued_work_last;
 
+    QemuMutex coalesced_mmio_lock;
+    struct CoalescedMMIOQueue *coalesced_mmio;
+
     CPUAddressSpace *cpu_ases;
     int num_ases;
     AddressSpace *as;
@@ -346,6 +363,13 @@ struct CPUState {
 
     /* Writes protected by tb_lock, reads not thread-safe  */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /* Entries are re-validated against the TLB on every hit, so they
+     * survive TLB flushes; they are cleared when their TB goes away.
+     */
+    struct TranslationBlock *tb_jmp_cache2[TB_JMP_CACHE2_SIZE];
+
+    /* Written atomically by other vCPU threads, cleared by this one */
+    uint16_t pending_tlb_flush;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -370,6 +394,8 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /*
      * Used for events with 'vcpu' and *without* the 'disabled' properties.
@@ -392,6 +418,13 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle applied to this vCPU alone, see cpu_throttle_vcpu_set() */
+    int throttle_percentage;
+    /* Guest pages this vCPU dirtied for migration.  Only counted by
+     * accelerators that can tell which vCPU wrote a page; migration
+     * reads and resets it with atomic_xchg().
+     */
+    unsigned long dirty_pages;
 
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
@@ -415,6 +448,15 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running MultiThread TCG or not.
+ *
+ * Returns: %true if we are in MTTCG mode %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -686,6 +728,29 @@ void do_run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data,
  */
 void run_on_cpu(CPUState *cpu, run_on_cpu_func func, run_on_cpu_data data);
 
+/**
+ * do_run_on_all_cpus:
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ * @mutex: Mutex to release while waiting for @func to run.
+ *
+ * Used internally in the implementation of run_on_all_cpus.
+ */
+void do_run_on_all_cpus(run_on_cpu_func func, run_on_cpu_data data,
+                        QemuMutex *mutex);
+
+/**
+ * run_on_all_cpus:
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on every vCPU, and waits until
+ * all of them have run it.  Unlike calling run_on_cpu() in a loop, the vCPU
+ * threads are kicked all at once; a @func that releases the BQL can thus
+ * run concurrently on all vCPUs.
+ */
+void run_on_all_cpus(run_on_cpu_func func, run_on_cpu_data data);
+
 /**
  * async_run_on_cpu:
  * @cpu: The vCPU to run on.
@@ -767,6 +832,26 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_vcpu_set:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Like cpu_throttle_set, but only makes @cpu sleep, so that vCPUs which
+ * do not dirty memory keep running at full speed.  The throttle stays in
+ * effect until cpu_throttle_stop is called.
+ */
+void cpu_throttle_vcpu_set(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_vcpu_get_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The percentage @cpu is throttled by, from either
+ * cpu_throttle_set or cpu_throttle_vcpu_set, or 0 if it runs unthrottled.
+ */
+int cpu_throttle_vcpu_get_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
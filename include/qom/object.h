@@ -494,11 +494,17 @@ struct TypeInfo
  * this object type.
  *
  * If an invalid object is passed to this function, a run time assert will be
- * generated.
+ * generated.  Without QOM cast debugging the check, which could never fail
+ * there anyway, is compiled out and the macro is a plain pointer cast.
  */
+#ifdef CONFIG_QOM_CAST_DEBUG
 #define OBJECT_CHECK(type, obj, name) \
     ((type *)object_dynamic_cast_assert(OBJECT(obj), (name), \
                                         __FILE__, __LINE__, __func__))
+#else
+#define OBJECT_CHECK(type, obj, name) \
+    ((type *)((void)(name), OBJECT(obj)))
+#endif
 
 /**
  * OBJECT_CLASS_CHECK:
@@ -569,10 +575,16 @@ struct InterfaceClass
  * @name: the interface type name
  *
  * Returns: @obj casted to @interface if cast is valid, otherwise raise error.
+ * Like OBJECT_CHECK, this is a plain pointer cast without QOM cast debugging.
  */
+#ifdef CONFIG_QOM_CAST_DEBUG
 #define INTERFACE_CHECK(interface, obj, name) \
     ((interface *)object_dynamic_cast_assert(OBJECT((obj)), (name), \
                                              __FILE__, __LINE__, __func__))
+#else
+#define INTERFACE_CHECK(interface, obj, name) \
+    ((interface *)((void)(name), OBJECT((obj))))
+#endif
 
 /**
  * object_new:
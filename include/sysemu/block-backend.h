@@ -75,6 +75,15 @@ typedef struct BlockBackendPublic {
      * it is zero.  */
     unsigned int io_limits_disabled;
 
+    /* Share of the group's limits that has already been accounted for
+     * this BlockBackend, so that requests covered by it need not take
+     * the ThrottleGroup lock.  Only valid while throttle_credit_gen[]
+     * matches the group's generation.  */
+    double       throttle_credit_bytes[2];
+    double       throttle_credit_units[2];
+    unsigned     throttle_credit_gen[2];
+    uint64_t     throttle_credit_op_size;
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -157,6 +166,9 @@ int blk_ioctl(BlockBackend *blk, unsigned long int req, void *buf);
 BlockAIOCB *blk_aio_ioctl(BlockBackend *blk, unsigned long int req, void *buf,
                           BlockCompletionFunc *cb, void *opaque);
 int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int count);
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags);
 int blk_co_flush(BlockBackend *blk);
 int blk_flush(BlockBackend *blk);
 int blk_commit_all(void);
@@ -173,6 +185,7 @@ int blk_is_read_only(BlockBackend *blk);
 int blk_is_sg(BlockBackend *blk);
 int blk_enable_write_cache(BlockBackend *blk);
 void blk_set_enable_write_cache(BlockBackend *blk, bool wce);
+void blk_set_merge_requests(BlockBackend *blk, bool enable);
 void blk_invalidate_cache(BlockBackend *blk, Error **errp);
 bool blk_is_inserted(BlockBackend *blk);
 bool blk_is_available(BlockBackend *blk);
@@ -93,7 +93,9 @@ struct Chardev {
     char *filename;
     int logfd;
     int be_open;
-    guint fd_in_tag;
+    GSource *gsource;
+    /* Context the frontend wants its read handlers to run in */
+    GMainContext *gcontext;
     DECLARE_BITMAP(features, QEMU_CHAR_FEATURE_LAST);
     QTAILQ_ENTRY(Chardev) next;
 };
@@ -242,6 +244,21 @@ guint qemu_chr_fe_add_watch(CharBackend *be, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Like @qemu_chr_fe_write, but gathers the data from an I/O vector.
+ * Backends that implement chr_writev pass the vector down to the channel
+ * untouched; others get one chr_write per element, stopping at the first
+ * short write.  This function is thread-safe.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed (0 if no associated Chardev)
+ */
+int qemu_chr_fe_writev(CharBackend *be, const struct iovec *iov, int iovcnt);
+
 /**
  * @qemu_chr_fe_write_all:
  *
@@ -476,6 +493,7 @@ typedef struct ChardevClass {
                  bool *be_opened, Error **errp);
 
     int (*chr_write)(Chardev *s, const uint8_t *buf, int len);
+    int (*chr_writev)(Chardev *s, const struct iovec *iov, int iovcnt);
     int (*chr_sync_read)(Chardev *s, const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(Chardev *s, GIOCondition cond);
     void (*chr_update_read_handler)(Chardev *s, GMainContext *context);
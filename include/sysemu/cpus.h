@@ -10,6 +10,7 @@ void cpu_stop_current(void);
 void cpu_ticks_init(void);
 
 void configure_icount(QemuOpts *opts, Error **errp);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 
@@ -15,6 +15,7 @@
 #define IOTHREAD_H
 
 #include "block/aio.h"
+#include "qemu/bitmap.h"
 #include "qemu/thread.h"
 
 #define TYPE_IOTHREAD "iothread"
@@ -33,6 +34,15 @@ typedef struct {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* Thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* Host placement; the thread pool workers inherit it */
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+    int64_t host_node;
+    Error *bind_err;
 } IOThread;
 
 #define IOTHREAD(obj) \
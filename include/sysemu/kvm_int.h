@@ -20,6 +20,10 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Bits returned by the last KVM_GET_DIRTY_LOG that have not been
+     * cleared yet with KVM_CLEAR_DIRTY_LOG; only with manual protection.
+     */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
@@ -24,6 +24,14 @@
 #include "io/channel-watch.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#include <poll.h>
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
 
 #define SOCKET_MAX_FDS 16
 
@@ -152,6 +160,20 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+#ifdef QEMU_MSG_ZEROCOPY
+    /* Only TCP sockets support MSG_ZEROCOPY */
+    if (ioc->localAddr.ss_family == AF_INET ||
+        ioc->localAddr.ss_family == AF_INET6) {
+        int v = 1;
+
+        if (qemu_setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY,
+                            &v, sizeof(v)) == 0) {
+            qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        }
+    }
+#endif
+
     return 0;
 }
 
@@ -552,6 +574,114 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
     return ret;
 }
+
+#ifdef QEMU_MSG_ZEROCOPY
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = { NULL, };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    ssize_t ret;
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            struct pollfd pfd = { .fd = sioc->fd };
+
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                error_setg_errno(errp, errno,
+                                 "Unable to read socket error queue");
+                return -1;
+            }
+            /* Completions are reported as POLLERR, even with no events */
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                error_setg_errno(errp, errno, "Unable to poll socket");
+                return -1;
+            }
+            if ((pfd.revents & (POLLHUP | POLLNVAL)) &&
+                !(pfd.revents & POLLERR)) {
+                error_setg(errp, "Socket closed with zero copy writes "
+                           "in flight");
+                return -1;
+            }
+            continue;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+              (cm->cmsg_level == SOL_IPV6 &&
+               cm->cmsg_type == IPV6_RECVERR))) {
+            error_setg(errp, "Unexpected message in socket error queue");
+            return -1;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_errno,
+                             "Error reported on socket");
+            return -1;
+        }
+
+        /* The notification covers an inclusive range of send calls;
+         * SO_EE_CODE_ZEROCOPY_COPIED just means the kernel fell back
+         * to copying, which is not an error.
+         */
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+    }
+
+    return 0;
+}
+
+static ssize_t qio_channel_socket_writev_zero_copy(QIOChannel *ioc,
+                                                   const struct iovec *iov,
+                                                   size_t niov,
+                                                   Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct msghdr msg = { NULL, };
+    ssize_t ret;
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = niov;
+
+ retry:
+    ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+    if (ret <= 0) {
+        if (errno == EAGAIN) {
+            return QIO_CHANNEL_ERR_BLOCK;
+        }
+        if (errno == EINTR) {
+            goto retry;
+        }
+        /* The pages pinned by earlier sends count against the locked
+         * memory limit; wait for them to be released and try again.
+         */
+        if (errno == ENOBUFS &&
+            sioc->zero_copy_sent < sioc->zero_copy_queued) {
+            if (qio_channel_socket_flush(ioc, errp) < 0) {
+                return -1;
+            }
+            goto retry;
+        }
+        error_setg_errno(errp, errno,
+                         "Unable to write to socket");
+        return -1;
+    }
+
+    sioc->zero_copy_queued++;
+    return ret;
+}
+#endif /* QEMU_MSG_ZEROCOPY */
 #else /* WIN32 */
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
@@ -758,6 +888,10 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_close = qio_channel_socket_close;
     ioc_klass->io_shutdown = qio_channel_socket_shutdown;
     ioc_klass->io_set_cork = qio_channel_socket_set_cork;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_writev_zero_copy = qio_channel_socket_writev_zero_copy;
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
     ioc_klass->io_set_aio_fd_handler = qio_channel_socket_set_aio_fd_handler;
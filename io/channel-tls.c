@@ -21,8 +21,11 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
+#include "qemu/iov.h"
 #include "trace.h"
 
+/* Largest plaintext that fits in a single TLS record */
+#define QIO_CHANNEL_TLS_RECORD_SIZE 16384
 
 static ssize_t qio_channel_tls_write_handler(const char *buf,
                                              size_t len,
@@ -227,6 +230,7 @@ static void qio_channel_tls_finalize(Object *obj)
 
     object_unref(OBJECT(ioc->master));
     qcrypto_tls_session_free(ioc->session);
+    g_free(ioc->record);
 }
 
 
@@ -275,13 +279,40 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
                                       Error **errp)
 {
     QIOChannelTLS *tioc = QIO_CHANNEL_TLS(ioc);
-    size_t i;
+    size_t i = 0, skip = 0;
     ssize_t done = 0;
 
-    for (i = 0 ; i < niov ; i++) {
-        ssize_t ret = qcrypto_tls_session_write(tioc->session,
-                                                iov[i].iov_base,
-                                                iov[i].iov_len);
+    for (;;) {
+        const char *buf;
+        size_t len;
+        ssize_t ret;
+
+        while (i < niov && skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            i++;
+        }
+        if (i == niov) {
+            break;
+        }
+
+        buf = (const char *)iov[i].iov_base + skip;
+        len = iov[i].iov_len - skip;
+        if (len < QIO_CHANNEL_TLS_RECORD_SIZE && i + 1 < niov) {
+            /*
+             * Every call makes at least one record and one write to the
+             * master channel, so gather small elements into full records.
+             * A retry after EAGAIN gathers the same bytes again, as
+             * gnutls requires.
+             */
+            if (!tioc->record) {
+                tioc->record = g_malloc(QIO_CHANNEL_TLS_RECORD_SIZE);
+            }
+            len = iov_to_buf(iov + i, niov - i, skip, tioc->record,
+                             QIO_CHANNEL_TLS_RECORD_SIZE);
+            buf = tioc->record;
+        }
+
+        ret = qcrypto_tls_session_write(tioc->session, buf, len);
         if (ret <= 0) {
             if (errno == EAGAIN) {
                 if (done) {
@@ -296,7 +327,8 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
             return -1;
         }
         done += ret;
-        if (ret < iov[i].iov_len) {
+        skip += ret;
+        if (ret < len) {
             break;
         }
     }
@@ -17,11 +17,18 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
+#include "qapi-visit.h"
+#include "sysemu/sysemu.h"
+
+#ifdef CONFIG_NUMA
+#include <numaif.h>
+#endif
 
 typedef ObjectClass IOThreadClass;
 
@@ -43,11 +50,48 @@ AioContext *qemu_get_current_aio_context(void)
     return my_iothread ? my_iothread->ctx : qemu_get_aio_context();
 }
 
+/* Apply the host placement from the iothread itself, before it can start
+ * thread pool workers that would not inherit it.
+ */
+static void iothread_bind(IOThread *iothread)
+{
+    if (!bitmap_empty(iothread->host_cpus, QEMU_THREAD_MAX_HOST_CPUS)) {
+        QemuThread self;
+        int ret;
+
+        qemu_thread_get_self(&self);
+        ret = qemu_thread_set_affinity(&self, iothread->host_cpus,
+                                       QEMU_THREAD_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_setg_errno(&iothread->bind_err, -ret,
+                             "cannot set iothread CPU affinity");
+            return;
+        }
+    }
+
+#ifdef CONFIG_NUMA
+    /* Allocations made in this thread, such as the requests of the
+     * virtqueues it services, come from the node it runs on.
+     */
+    if (iothread->host_node >= 0) {
+        DECLARE_BITMAP(nodes, MAX_NODES + 1);
+
+        bitmap_zero(nodes, MAX_NODES + 1);
+        set_bit(iothread->host_node, nodes);
+        if (set_mempolicy(MPOL_PREFERRED, nodes, MAX_NODES + 1)) {
+            error_setg_errno(&iothread->bind_err, errno,
+                             "cannot bind iothread memory to host NUMA node");
+        }
+    }
+#endif
+}
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
 
     rcu_register_thread();
+    iothread_bind(iothread);
 
     my_iothread = iothread;
     qemu_mutex_lock(&iothread->init_done_lock);
@@ -82,6 +126,8 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS;
+    iothread->host_node = -1;
 }
 
 static void iothread_instance_finalize(Object *obj)
@@ -116,6 +162,12 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
@@ -143,6 +195,11 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                        &iothread->init_done_lock);
     }
     qemu_mutex_unlock(&iothread->init_done_lock);
+
+    if (iothread->bind_err) {
+        error_propagate(errp, iothread->bind_err);
+        iothread->bind_err = NULL;
+    }
 }
 
 typedef struct {
@@ -159,6 +216,12 @@ static PollParamInfo poll_grow_info = {
 static PollParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static PollParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static PollParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
 
 static void iothread_get_poll_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
@@ -204,6 +267,156 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    if (value < 0 || value > INT_MAX) {
+        error_setg(&local_err, "%s value must be in range [0, %d]",
+                   info->name, INT_MAX);
+        goto out;
+    }
+
+    if (iothread->ctx) {
+        int64_t min = iothread->thread_pool_min;
+        int64_t max = iothread->thread_pool_max;
+
+        if (info == &thread_pool_min_info) {
+            min = value;
+        } else {
+            max = value;
+        }
+        aio_context_set_thread_pool_params(iothread->ctx, min, max,
+                                           &local_err);
+        if (local_err) {
+            goto out;
+        }
+    }
+
+    *field = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_host_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **tail = &host_cpus;
+    unsigned long cpu;
+
+    for (cpu = find_first_bit(iothread->host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+         cpu < QEMU_THREAD_MAX_HOST_CPUS;
+         cpu = find_next_bit(iothread->host_cpus, QEMU_THREAD_MAX_HOST_CPUS,
+                             cpu + 1)) {
+        *tail = g_new0(uint16List, 1);
+        (*tail)->value = cpu;
+        tail = &(*tail)->next;
+    }
+
+    visit_type_uint16List(v, name, &host_cpus, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+static void iothread_set_host_cpus(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+    uint16List *list = NULL, *l;
+    Error *local_err = NULL;
+    int ret;
+
+    visit_type_uint16List(v, name, &list, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    bitmap_zero(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+    for (l = list; l; l = l->next) {
+        if (l->value >= QEMU_THREAD_MAX_HOST_CPUS) {
+            error_setg(&local_err, "host CPU %d is out of range [0, %d]",
+                       l->value, QEMU_THREAD_MAX_HOST_CPUS - 1);
+            goto out;
+        }
+        set_bit(l->value, host_cpus);
+    }
+
+    /* A running iothread is moved right away */
+    if (iothread->ctx && !bitmap_empty(host_cpus, QEMU_THREAD_MAX_HOST_CPUS)) {
+        ret = qemu_thread_set_affinity(&iothread->thread, host_cpus,
+                                       QEMU_THREAD_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_setg_errno(&local_err, -ret,
+                             "cannot set iothread CPU affinity");
+            goto out;
+        }
+    }
+
+    bitmap_copy(iothread->host_cpus, host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+
+out:
+    qapi_free_uint16List(list);
+    error_propagate(errp, local_err);
+}
+
+static void iothread_get_host_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, name, &iothread->host_node, errp);
+}
+
+static void iothread_set_host_node(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    if (iothread->ctx) {
+        error_setg(&local_err, "cannot change the host node of a running "
+                   "iothread");
+        goto out;
+    }
+
+    visit_type_int64(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+#ifdef CONFIG_NUMA
+    if (value < -1 || value >= MAX_NODES) {
+        error_setg(&local_err, "%s value must be in range [-1, %d]",
+                   name, MAX_NODES - 1);
+        goto out;
+    }
+    iothread->host_node = value;
+#else
+    if (value != -1) {
+        error_setg(&local_err, "NUMA node binding are not supported by this "
+                   "QEMU");
+        goto out;
+    }
+#endif
+
+out:
+    error_propagate(errp, local_err);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -221,6 +434,22 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info, &error_abort);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info, &error_abort);
+    object_class_property_add(klass, "host-cpus", "int",
+                              iothread_get_host_cpus,
+                              iothread_set_host_cpus,
+                              NULL, NULL, &error_abort);
+    object_class_property_add(klass, "host-node", "int",
+                              iothread_get_host_node,
+                              iothread_set_host_node,
+                              NULL, NULL, &error_abort);
 }
 
 static const TypeInfo iothread_info = {
@@ -20,9 +20,11 @@
 
 #include "qemu-common.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -61,9 +63,16 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Address spaces whose slots can show up in dirty ring entries */
+#define KVM_MAX_ADDRESS_SPACES  2
+
+/* How often the reaper thread empties the dirty rings, in microseconds */
+#define KVM_DIRTY_RING_REAP_INTERVAL_US 1000000
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t dirty_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -95,12 +104,25 @@ struct KVMState
 #ifdef KVM_CAP_IRQ_ROUTING
     struct kvm_irq_routing *irq_routes;
     int nr_allocated_irq_routes;
+    /* irq_routes changed since the last KVM_SET_GSI_ROUTING */
+    bool irq_routes_dirty;
     unsigned long *used_gsi_bitmap;
     unsigned int gsi_count;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    KVMMemoryListener *as_listeners[KVM_MAX_ADDRESS_SPACES];
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* Entries in each vCPU's dirty ring, 0 when dirty bitmaps are used */
+    uint32_t kvm_dirty_ring_size;
+    QemuThread dirty_ring_reaper;
+    /* KVM_GET_DIRTY_LOG leaves pages writable until KVM_CLEAR_DIRTY_LOG */
+    bool manual_dirty_log_protect;
+    /* Protects the slots of all address spaces.  The memory listener
+     * callbacks run under the BQL, except log_clear which is called by
+     * the migration thread.
+     */
+    QemuMutex slots_lock;
 };
 
 KVMState *kvm_state;
@@ -252,6 +274,168 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+/*
+ * Dirty ring support.  With KVM_CAP_DIRTY_LOG_RING enabled, KVM pushes
+ * the guest frames written by each vCPU onto a ring shared with that
+ * vCPU, instead of setting bits in one bitmap per memory slot.  Entries
+ * are collected by log_sync, by a vCPU whose ring filled up, and
+ * periodically by the reaper thread so that rings rarely fill up.  All
+ * of them run under the BQL, which also keeps the slots stable.
+ */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    ram_addr_t addr;
+    uint8_t clients = tcg_enabled() ? DIRTY_CLIENTS_ALL
+                                    : DIRTY_CLIENTS_NOCODE;
+
+    if (as_id >= KVM_MAX_ADDRESS_SPACES || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listeners[as_id];
+    if (!kml) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+    if (offset >= mem->memory_size / qemu_real_host_page_size) {
+        return;
+    }
+
+    addr = qemu_ram_addr_from_host(mem->ram +
+                                   offset * qemu_real_host_page_size);
+    if (addr == RAM_ADDR_INVALID) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_range(addr, qemu_real_host_page_size,
+                                        clients);
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    uint32_t mask = s->kvm_dirty_ring_size - 1;
+    uint32_t count = 0;
+
+    for (;;) {
+        struct kvm_dirty_gfn *gfn =
+            &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index & mask];
+
+        if (!(atomic_load_acquire(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+        atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    if (count) {
+        atomic_add(&cpu->dirty_pages, count);
+    }
+    return count;
+}
+
+/* Must be called with the BQL held.  */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS, 0);
+        if (ret < 0) {
+            error_report("KVM_RESET_DIRTY_RINGS failed: %s", strerror(-ret));
+            abort();
+        }
+    }
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL_US);
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("accel"), NULL);
+    uint64_t size = opts ? qemu_opt_get_number(opts, "dirty-ring-size", 0) : 0;
+    int ret;
+
+    if (!size) {
+        return 0;
+    }
+    if (!is_power_of_2(size) || size > UINT32_MAX) {
+        error_report("dirty-ring-size must be a power of two");
+        return -EINVAL;
+    }
+
+#ifdef KVM_DIRTY_LOG_PAGE_OFFSET
+    ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0) {
+        error_report("warning: KVM dirty ring not supported by the host, "
+                     "using dirty bitmaps");
+        return 0;
+    }
+    if (size * sizeof(struct kvm_dirty_gfn) > ret) {
+        error_report("dirty-ring-size %" PRIu64 " exceeds the host's maximum "
+                     "of %zu entries", size,
+                     ret / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0,
+                            size * sizeof(struct kvm_dirty_gfn));
+    if (ret < 0) {
+        error_report("Enabling the KVM dirty ring failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_size = size;
+    qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                       kvm_dirty_ring_reaper_thread, s, QEMU_THREAD_DETACHED);
+#else
+    error_report("warning: KVM dirty ring not supported on this target, "
+                 "using dirty bitmaps");
+#endif
+    return 0;
+}
+
+static void kvm_manual_dirty_log_init(KVMState *s)
+{
+    int flags = kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+
+    /* The dirty rings have their own way of rearming dirty logging */
+    if (s->kvm_dirty_ring_size ||
+        !(flags & KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE)) {
+        return;
+    }
+    if (kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                          KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE) < 0) {
+        error_report("warning: enabling manual dirty log protection failed");
+        return;
+    }
+    s->manual_dirty_log_protect = true;
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -261,6 +445,17 @@ int kvm_destroy_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_destroy_vcpu\n");
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Hand back whatever the vCPU logged before it goes away */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns,
+                     s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
         ret = mmap_size;
@@ -276,21 +471,25 @@ int kvm_destroy_vcpu(CPUState *cpu)
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->dirty_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *dirty_fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
+    *dirty_fetch_index = 0;
     QLIST_FOREACH(cpu, &s->kvm_parked_vcpus, node) {
         if (cpu->vcpu_id == vcpu_id) {
             int kvm_fd;
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *dirty_fetch_index = cpu->dirty_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
@@ -307,7 +506,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -337,6 +536,21 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+#ifdef KVM_DIRTY_LOG_PAGE_OFFSET
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns =
+            mmap(NULL, s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn),
+                 PROT_READ | PROT_WRITE, MAP_SHARED, cpu->kvm_fd,
+                 PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+#endif
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -372,6 +586,10 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
     if (mem->flags == old_flags) {
         return 0;
     }
+    if (!(mem->flags & KVM_MEM_LOG_DIRTY_PAGES)) {
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
+    }
 
     return kvm_set_user_memory_region(kml, mem);
 }
@@ -401,7 +619,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -418,7 +638,9 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -444,8 +666,13 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection the bitmap is kept in the slot, so
+ * that kvm_log_clear knows which pages it may write protect again.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
+ *
+ * Called with slots_lock held.
  */
 static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
@@ -453,11 +680,18 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     KVMState *s = kvm_state;
     unsigned long size, allocated_size = 0;
     struct kvm_dirty_log d = {};
+    void *bitmap = NULL;
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
+    if (s->kvm_dirty_ring_size) {
+        /* KVM_GET_DIRTY_LOG is refused once the rings are enabled */
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
@@ -479,13 +713,24 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            /* KVM copies out its whole bitmap, including the bits that
+             * kvm_log_clear has not got to yet.
+             */
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!bitmap) {
+                bitmap = g_malloc(size);
+            } else if (size > allocated_size) {
+                bitmap = g_realloc(bitmap, size);
+            }
+            allocated_size = size;
+            memset(bitmap, 0, allocated_size);
+            d.dirty_bitmap = bitmap;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -497,7 +742,7 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(bitmap);
 
     return ret;
 }
@@ -753,6 +998,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -857,7 +1104,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -865,7 +1114,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -875,12 +1126,78 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
+/* KVM_CLEAR_DIRTY_LOG works on multiples of 64 pages, except at the end
+ * of the slot, so the range is widened.  That is safe because only pages
+ * reported by the last KVM_GET_DIRTY_LOG are write protected again, and
+ * those are still dirty in the bitmaps of the dirty log's clients.
+ */
+static int kvm_log_clear_slot(KVMMemoryListener *kml, KVMSlot *mem,
+                              hwaddr start, hwaddr end)
+{
+    struct kvm_clear_dirty_log d = {};
+    uint64_t psize = qemu_real_host_page_size;
+    uint64_t slot_pages = mem->memory_size / psize;
+    uint64_t first, last;
+    int ret;
+
+    first = QEMU_ALIGN_DOWN((start - mem->start_addr) / psize, 64);
+    last = MIN(QEMU_ALIGN_UP(DIV_ROUND_UP(end - mem->start_addr, psize), 64),
+               slot_pages);
+    if (find_next_bit(mem->dirty_bmap, last, first) >= last) {
+        return 0;
+    }
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    d.first_page = first;
+    d.num_pages = last - first;
+    d.dirty_bitmap = mem->dirty_bmap + first / BITS_PER_LONG;
+    ret = kvm_vm_ioctl(kvm_state, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0) {
+        error_report("KVM_CLEAR_DIRTY_LOG failed: %s", strerror(-ret));
+        return ret;
+    }
+    trace_kvm_log_clear(d.slot, first, last - first);
+    bitmap_clear(mem->dirty_bmap, first, last - first);
+    return 0;
+}
+
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+    KVMSlot *mem;
+    int i;
+
+    if (!kvm_state->manual_dirty_log_protect) {
+        return;
+    }
+
+    qemu_mutex_lock(&kvm_state->slots_lock);
+    for (i = 0; i < kvm_state->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (!mem->dirty_bmap || end_addr <= mem->start_addr ||
+            start_addr >= mem->start_addr + mem->memory_size) {
+            continue;
+        }
+        if (kvm_log_clear_slot(kml, mem, MAX(start_addr, mem->start_addr),
+                               MIN(end_addr,
+                                   mem->start_addr + mem->memory_size)) < 0) {
+            abort();
+        }
+    }
+    qemu_mutex_unlock(&kvm_state->slots_lock);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -957,6 +1274,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_ADDRESS_SPACES);
+    s->as_listeners[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -967,6 +1286,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1034,6 +1354,8 @@ void kvm_init_irq_routing(KVMState *s)
 
     s->irq_routes = g_malloc0(sizeof(*s->irq_routes));
     s->nr_allocated_irq_routes = 0;
+    /* the first commit replaces the kernel's default routing */
+    s->irq_routes_dirty = true;
 
     if (!kvm_direct_msi_allowed) {
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
@@ -1056,10 +1378,18 @@ void kvm_irqchip_commit_routes(KVMState *s)
         return;
     }
 
+    /* KVM_SET_GSI_ROUTING replaces the whole table and waits for an SRCU
+     * grace period in the kernel, so skip it when nothing has changed.
+     */
+    if (!s->irq_routes_dirty) {
+        return;
+    }
+
     s->irq_routes->flags = 0;
     trace_kvm_irqchip_commit_routes();
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->irq_routes_dirty = false;
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -1084,6 +1414,7 @@ static void kvm_add_routing_entry(KVMState *s,
     *new = *entry;
 
     set_gsi(s, entry->gsi);
+    s->irq_routes_dirty = true;
 }
 
 static int kvm_update_routing_entry(KVMState *s,
@@ -1103,6 +1434,7 @@ static int kvm_update_routing_entry(KVMState *s,
         }
 
         *entry = *new_entry;
+        s->irq_routes_dirty = true;
 
         return 0;
     }
@@ -1138,17 +1470,22 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
         if (e->gsi == virq) {
             s->irq_routes->nr--;
             *e = s->irq_routes->entries[s->irq_routes->nr];
+            s->irq_routes_dirty = true;
         }
     }
     clear_gsi(s, virq);
     kvm_arch_release_virq_post(virq);
 }
 
-static unsigned int kvm_hash_msi(uint32_t data)
+static unsigned int kvm_hash_msi(MSIMessage msg)
 {
-    /* This is optimized for IA32 MSI layout. However, no other arch shall
-     * repeat the mistake of not providing a direct MSI injection API. */
-    return data & 0xff;
+    /* Mix the whole message: guests commonly reuse the same vector
+     * number (the low byte of data on x86) for many destinations.
+     */
+    uint64_t h = (msg.address ^ ((uint64_t)msg.data << 32)) *
+                 0x9e3779b97f4a7c15ULL;
+
+    return (h >> 32) % KVM_MSI_HASHTAB_SIZE;
 }
 
 static void kvm_flush_dynamic_msi_routes(KVMState *s)
@@ -1190,7 +1527,7 @@ static int kvm_irqchip_get_virq(KVMState *s)
 
 static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
 {
-    unsigned int hash = kvm_hash_msi(msg.data);
+    unsigned int hash = kvm_hash_msi(msg);
     KVMMSIRoute *route;
 
     QTAILQ_FOREACH(route, &s->msi_hashtab[hash], entry) {
@@ -1238,8 +1575,7 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
         kvm_add_routing_entry(s, &route->kroute);
         kvm_irqchip_commit_routes(s);
 
-        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
-                           entry);
+        QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg)], route, entry);
     }
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
@@ -1596,6 +1932,7 @@ static int kvm_init(MachineState *ms)
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
     QLIST_INIT(&s->kvm_parked_vcpus);
+    qemu_mutex_init(&s->slots_lock);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1695,6 +2032,12 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    ret = kvm_dirty_ring_init(s);
+    if (ret < 0) {
+        goto err;
+    }
+    kvm_manual_dirty_log_init(s);
+
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
     if (ret > 0) {
@@ -1893,6 +2236,24 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
     run_on_cpu(cpu, do_kvm_cpu_synchronize_post_init, RUN_ON_CPU_NULL);
 }
 
+static void do_kvm_cpu_synchronize_all_post_init(CPUState *cpu,
+                                                 run_on_cpu_data arg)
+{
+    /* All vCPUs are stopped and the caller waits for every one of them, so
+     * nobody else looks at this vCPU's state.  Release the BQL so that the
+     * vCPU threads load their registers into KVM concurrently.
+     */
+    qemu_mutex_unlock_iothread();
+    kvm_arch_put_registers(cpu, KVM_PUT_FULL_STATE);
+    qemu_mutex_lock_iothread();
+    cpu->kvm_vcpu_dirty = false;
+}
+
+void kvm_cpu_synchronize_all_post_init(void)
+{
+    run_on_all_cpus(do_kvm_cpu_synchronize_all_post_init, RUN_ON_CPU_NULL);
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
@@ -1972,6 +2333,13 @@ int kvm_cpu_exec(CPUState *cpu)
                              run->mmio.is_write);
             ret = 0;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty_ring_full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
@@ -2195,6 +2563,11 @@ int kvm_has_intx_set_mask(void)
     return kvm_state->intx_set_mask;
 }
 
+int kvm_has_manual_dirty_log_protect(void)
+{
+    return kvm_state->manual_dirty_log_protect;
+}
+
 #ifdef KVM_CAP_SET_GUEST_DEBUG
 struct kvm_sw_breakpoint *kvm_find_sw_breakpoint(CPUState *cpu,
                                                  target_ulong pc)
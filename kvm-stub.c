@@ -59,6 +59,10 @@ void kvm_cpu_synchronize_post_init(CPUState *cpu)
 {
 }
 
+void kvm_cpu_synchronize_all_post_init(void)
+{
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     abort();
@@ -74,6 +78,11 @@ int kvm_has_many_ioeventfds(void)
     return 0;
 }
 
+int kvm_has_manual_dirty_log_protect(void)
+{
+    return 0;
+}
+
 int kvm_update_guest_debug(CPUState *cpu, unsigned long reinject_trap)
 {
     return -ENOSYS;
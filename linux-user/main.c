@@ -3836,6 +3836,11 @@ static void handle_arg_help(const char *arg)
     usage(EXIT_SUCCESS);
 }
 
+static void handle_arg_perfmap(const char *arg)
+{
+    perf_enable_perfmap();
+}
+
 static void handle_arg_log(const char *arg)
 {
     int mask;
@@ -4051,6 +4056,8 @@ static const struct qemu_argument arg_table[] = {
      "(use '-d help' for a list of items)"},
     {"D",          "QEMU_LOG_FILENAME", true, handle_arg_log_filename,
      "logfile",     "write logs to 'logfile' (default stderr)"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "generate a /tmp/perf-${pid}.map file for perf"},
     {"p",          "QEMU_PAGESIZE",    true,  handle_arg_pagesize,
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
@@ -24,20 +24,79 @@
 
 //#define DEBUG_MMAP
 
-static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* The mmap lock is split into shards, each covering the guest addresses
+ * that are equal modulo MMAP_LOCK_SHARDS << MMAP_LOCK_SHARD_BITS.
+ * mprotect, munmap and MAP_FIXED mmap only take the shards for the host
+ * pages they touch, so threads working on disjoint ranges do not
+ * serialize.  Everything else, including translation and any search for
+ * a free area, takes all of them with mmap_lock().
+ *
+ * Shards are always acquired in ascending order.  A thread that already
+ * holds some shards may only nest requests for a subset of them.
+ */
+#define MMAP_LOCK_SHARD_BITS 24
+#define MMAP_LOCK_SHARDS     16
+#define MMAP_LOCK_ALL        ((1u << MMAP_LOCK_SHARDS) - 1)
+
+static pthread_mutex_t mmap_mutex[MMAP_LOCK_SHARDS] = {
+    [0 ... MMAP_LOCK_SHARDS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 static __thread int mmap_lock_count;
+static __thread uint32_t mmap_lock_held;
 
-void mmap_lock(void)
+static void mmap_lock_shards(uint32_t mask)
+{
+    int i;
+
+    if (mmap_lock_count++ > 0) {
+        g_assert((mmap_lock_held & mask) == mask);
+        return;
+    }
+    for (i = 0; i < MMAP_LOCK_SHARDS; i++) {
+        if (mask & (1u << i)) {
+            pthread_mutex_lock(&mmap_mutex[i]);
+        }
+    }
+    mmap_lock_held = mask;
+}
+
+/* Lock the shards covering the host pages of [start, start + len).  */
+static void mmap_lock_range(abi_ulong start, abi_ulong len)
 {
-    if (mmap_lock_count++ == 0) {
-        pthread_mutex_lock(&mmap_mutex);
+    abi_ulong first, last, i;
+    uint32_t mask = 0;
+
+    first = start & qemu_host_page_mask;
+    last = HOST_PAGE_ALIGN(start + len) - 1;
+    if (len == 0 || last < first ||
+        (last >> MMAP_LOCK_SHARD_BITS) - (first >> MMAP_LOCK_SHARD_BITS)
+        >= MMAP_LOCK_SHARDS - 1) {
+        mask = MMAP_LOCK_ALL;
+    } else {
+        for (i = first >> MMAP_LOCK_SHARD_BITS;
+             i <= last >> MMAP_LOCK_SHARD_BITS; i++) {
+            mask |= 1u << (i % MMAP_LOCK_SHARDS);
+        }
     }
+    mmap_lock_shards(mask);
+}
+
+void mmap_lock(void)
+{
+    mmap_lock_shards(MMAP_LOCK_ALL);
 }
 
 void mmap_unlock(void)
 {
+    int i;
+
     if (--mmap_lock_count == 0) {
-        pthread_mutex_unlock(&mmap_mutex);
+        for (i = MMAP_LOCK_SHARDS - 1; i >= 0; i--) {
+            if (mmap_lock_held & (1u << i)) {
+                pthread_mutex_unlock(&mmap_mutex[i]);
+            }
+        }
+        mmap_lock_held = 0;
     }
 }
 
@@ -49,17 +108,26 @@ bool have_mmap_lock(void)
 /* Grab lock to make sure things are in a consistent state after fork().  */
 void mmap_fork_start(void)
 {
+    int i;
+
     if (mmap_lock_count)
         abort();
-    pthread_mutex_lock(&mmap_mutex);
+    for (i = 0; i < MMAP_LOCK_SHARDS; i++) {
+        pthread_mutex_lock(&mmap_mutex[i]);
+    }
 }
 
 void mmap_fork_end(int child)
 {
-    if (child)
-        pthread_mutex_init(&mmap_mutex, NULL);
-    else
-        pthread_mutex_unlock(&mmap_mutex);
+    int i;
+
+    for (i = MMAP_LOCK_SHARDS - 1; i >= 0; i--) {
+        if (child) {
+            pthread_mutex_init(&mmap_mutex[i], NULL);
+        } else {
+            pthread_mutex_unlock(&mmap_mutex[i]);
+        }
+    }
 }
 
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
@@ -86,7 +154,7 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
     if (len == 0)
         return 0;
 
-    mmap_lock();
+    mmap_lock_range(start, len);
     host_start = start & qemu_host_page_mask;
     host_end = HOST_PAGE_ALIGN(end);
     if (start > host_start) {
@@ -363,7 +431,11 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
 {
     abi_ulong ret, end, real_start, real_end, retaddr, host_offset, host_len;
 
-    mmap_lock();
+    if (flags & MAP_FIXED) {
+        mmap_lock_range(start, TARGET_PAGE_ALIGN(len));
+    } else {
+        mmap_lock();
+    }
 #ifdef DEBUG_MMAP
     {
         printf("mmap: start=0x" TARGET_ABI_FMT_lx
@@ -624,7 +696,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
     len = TARGET_PAGE_ALIGN(len);
     if (len == 0)
         return -EINVAL;
-    mmap_lock();
+    mmap_lock_range(start, len);
     end = start + len;
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
@@ -156,6 +156,7 @@ enum ListenerDirection { Forward, Reverse };
     } while(0)
 
 struct CoalescedMemoryRange {
+    struct rcu_head rcu;
     AddrRange addr;
     QTAILQ_ENTRY(CoalescedMemoryRange) link;
 };
@@ -877,17 +878,87 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+static gboolean flatview_equal(gconstpointer a, gconstpointer b)
+{
+    const FlatView *va = a, *vb = b;
+    unsigned i;
+
+    if (va->nr != vb->nr) {
+        return false;
+    }
+    for (i = 0; i < va->nr; i++) {
+        if (!flatrange_equal(&va->ranges[i], &vb->ranges[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static guint flatview_hash(gconstpointer v)
+{
+    const FlatView *view = v;
+    guint h = view->nr;
+    unsigned i;
+
+    for (i = 0; i < view->nr; i++) {
+        h = h * 31 + g_direct_hash(view->ranges[i].mr);
+        h = h * 31 + int128_getlo(view->ranges[i].addr.start);
+    }
+    return h;
+}
+
+/* The FlatViews rendered during one memory_region_transaction_commit.  */
+typedef struct TopologyUpdate {
+    /* Root region -> FlatView, to render each root only once.  */
+    GHashTable *roots;
+    /* FlatView -> first AddressSpace using it, keyed by contents, so
+     * that address spaces with different roots but identical maps
+     * also share a FlatView and its dispatch tree.
+     */
+    GHashTable *views;
+    /* Replaced FlatViews whose release is already queued.  */
+    GHashTable *old_views;
+} TopologyUpdate;
+
+static void address_space_update_topology(AddressSpace *as,
+                                          TopologyUpdate *u)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(u->roots, as->root);
+    AddressSpace *src;
+
+    if (!new_view) {
+        gpointer key, value;
+
+        new_view = generate_memory_topology(as->root);
+        if (g_hash_table_lookup_extended(u->views, new_view, &key, &value)) {
+            flatview_unref(new_view);
+            new_view = key;
+        } else {
+            g_hash_table_insert(u->views, new_view, as);
+        }
+        g_hash_table_insert(u->roots, as->root, new_view);
+    }
+    flatview_ref(new_view);
+
+    /* Read by the dispatch listener during the passes below.  */
+    src = g_hash_table_lookup(u->views, new_view);
+    as->dispatch_src = src == as ? NULL : src;
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    if (g_hash_table_lookup(u->old_views, old_view)) {
+        /* Another address space shared OLD_VIEW, and the reference it
+         * dropped via call_rcu keeps the view alive for RCU readers.
+         */
+        flatview_unref(old_view);
+    } else {
+        g_hash_table_insert(u->old_views, old_view, old_view);
+        call_rcu(old_view, flatview_unref, rcu);
+    }
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -920,13 +991,28 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            TopologyUpdate u;
+
+            u.roots = g_hash_table_new(g_direct_hash, g_direct_equal);
+            u.views = g_hash_table_new_full(flatview_hash, flatview_equal,
+                                            (GDestroyNotify)flatview_unref,
+                                            NULL);
+            u.old_views = g_hash_table_new(g_direct_hash, g_direct_equal);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, &u);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+            QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                as->dispatch_src = NULL;
+                atomic_inc(&as->topology_gen);
+            }
+            g_hash_table_destroy(u.roots);
+            g_hash_table_destroy(u.views);
+            g_hash_table_destroy(u.old_views);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1716,6 +1802,7 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
                                         hwaddr size, unsigned client)
 {
     assert(mr->ram_block);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
     return cpu_physical_memory_test_and_clear_dirty(
                 memory_region_get_ram_addr(mr) + addr, size, client);
 }
@@ -1749,6 +1836,41 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryListener *listener;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (!listener->log_clear) {
+            continue;
+        }
+        as = listener->address_space;
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr == mr) {
+                MemoryRegionSection mrs = section_from_flat_range(fr, as);
+                hwaddr fr_start = MAX(start, mrs.offset_within_region);
+                hwaddr fr_end = MIN(start + len, mrs.offset_within_region +
+                                    int128_get64(mrs.size));
+
+                if (fr_start >= fr_end) {
+                    continue;
+                }
+                mrs.offset_within_address_space += fr_start -
+                                                   mrs.offset_within_region;
+                mrs.offset_within_region = fr_start;
+                mrs.size = int128_make64(fr_end - fr_start);
+                listener->log_clear(listener, &mrs);
+            }
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -1773,10 +1895,31 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client)
 {
     assert(mr->ram_block);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
     cpu_physical_memory_test_and_clear_dirty(
         memory_region_get_ram_addr(mr) + addr, size, client);
 }
 
+DirtyBitmapSnapshot *memory_region_snapshot_and_clear_dirty(MemoryRegion *mr,
+                                                            hwaddr addr,
+                                                            hwaddr size,
+                                                            unsigned client)
+{
+    assert(mr->ram_block);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
+    return cpu_physical_memory_snapshot_and_clear_dirty(
+                memory_region_get_ram_addr(mr) + addr, size, client);
+}
+
+bool memory_region_snapshot_get_dirty(MemoryRegion *mr,
+                                      DirtyBitmapSnapshot *snap,
+                                      hwaddr addr, hwaddr size)
+{
+    assert(mr->ram_block);
+    return cpu_physical_memory_snapshot_get_dirty(snap,
+                memory_region_get_ram_addr(mr) + addr, size);
+}
+
 int memory_region_get_fd(MemoryRegion *mr)
 {
     int fd;
@@ -1898,9 +2041,11 @@ void memory_region_add_coalescing(MemoryRegion *mr,
                                   hwaddr offset,
                                   uint64_t size)
 {
-    CoalescedMemoryRange *cmr = g_malloc(sizeof(*cmr));
+    CoalescedMemoryRange *cmr = g_new0(CoalescedMemoryRange, 1);
 
     cmr->addr = addrrange_make(int128_make64(offset), int128_make64(size));
+    /* Pairs with atomic_rcu_read in memory_region_is_coalesced.  */
+    smp_wmb();
     QTAILQ_INSERT_TAIL(&mr->coalesced, cmr, link);
     memory_region_update_coalesced_range(mr);
     memory_region_set_flush_coalesced(mr);
@@ -1917,7 +2062,7 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
     while (!QTAILQ_EMPTY(&mr->coalesced)) {
         cmr = QTAILQ_FIRST(&mr->coalesced);
         QTAILQ_REMOVE(&mr->coalesced, cmr, link);
-        g_free(cmr);
+        g_free_rcu(cmr, rcu);
         updated = true;
     }
 
@@ -1926,6 +2071,21 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
     }
 }
 
+bool memory_region_is_coalesced(MemoryRegion *mr, hwaddr addr, unsigned size)
+{
+    CoalescedMemoryRange *cmr;
+    AddrRange r = addrrange_make(int128_make64(addr), int128_make64(size));
+
+    for (cmr = atomic_rcu_read(&mr->coalesced.tqh_first); cmr;
+         cmr = atomic_rcu_read(&cmr->link.tqe_next)) {
+        if (int128_le(cmr->addr.start, r.start)
+            && int128_ge(addrrange_end(cmr->addr), addrrange_end(r))) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void memory_region_set_flush_coalesced(MemoryRegion *mr)
 {
     mr->flush_coalesced_mmio = true;
@@ -38,7 +38,11 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
-#define MAX_INFLIGHT_IO 512
+/* Most chunks that the bulk phase marks as zero without reading them,
+ * per call of mig_save_device_bulk
+ */
+#define MAX_ZERO_CHUNKS_SEARCH (MAX_IS_ALLOCATED_SEARCH / \
+                                BDRV_SECTORS_PER_DIRTY_CHUNK)
 
 //#define DEBUG_BLK_MIGRATION
 
@@ -131,9 +135,23 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
 {
     int len;
+
+    /* sector number and flags */
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
+                     | flags);
+
+    /* device name */
+    len = strlen(bmds->blk_name);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (uint8_t *) bmds->blk_name, len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
     if (block_mig_state.zero_blocks &&
@@ -141,14 +159,7 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
-    /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | flags);
-
-    /* device name */
-    len = strlen(blk->bmds->blk_name);
-    qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *) blk->bmds->blk_name, len);
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -263,6 +274,34 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
+/* Called with iothread lock and AioContext taken.
+ *
+ * Returns how many chunks starting at @sector read as zero according to
+ * the block status of the whole backing chain, and marks them clean.
+ * Writes after this are caught by the dirty bitmap as usual.
+ */
+static int bmds_clear_zero_chunks(BlkMigDevState *bmds, int64_t sector)
+{
+    BlockDriverState *file;
+    int chunks = 0;
+    int64_t ret;
+    int nr_sectors, n;
+
+    while (chunks < MAX_ZERO_CHUNKS_SEARCH && sector < bmds->total_sectors) {
+        nr_sectors = MIN(bmds->total_sectors - sector,
+                         BDRV_SECTORS_PER_DIRTY_CHUNK);
+        ret = bdrv_get_block_status_above(blk_bs(bmds->blk), NULL, sector,
+                                          nr_sectors, &n, &file);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || n < nr_sectors) {
+            break;
+        }
+        bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
+        sector += nr_sectors;
+        chunks++;
+    }
+    return chunks;
+}
+
 /* Called with no lock taken.  */
 
 static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
@@ -272,6 +311,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     BlockBackend *bb = bmds->blk;
     BlkMigBlock *blk;
     int nr_sectors;
+    int zero_chunks;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -294,6 +334,29 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
+    /* Chunks that are known to be zero, for example because they are not
+     * allocated in any image of the chain, are sent without reading them.
+     */
+    if (block_mig_state.zero_blocks) {
+        qemu_mutex_lock_iothread();
+        aio_context_acquire(blk_get_aio_context(bb));
+        zero_chunks = bmds_clear_zero_chunks(bmds, cur_sector);
+        aio_context_release(blk_get_aio_context(bb));
+        qemu_mutex_unlock_iothread();
+
+        if (zero_chunks) {
+            for (; zero_chunks > 0; zero_chunks--) {
+                blk_send_header(f, bmds, cur_sector,
+                                BLK_MIG_FLAG_DEVICE_BLOCK |
+                                BLK_MIG_FLAG_ZERO_BLOCK);
+                cur_sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
+            }
+            bmds->cur_sector = MIN(cur_sector, total_sectors);
+            bmds->completed_sectors = bmds->cur_sector;
+            return (bmds->cur_sector >= total_sectors);
+        }
+    }
+
     /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
@@ -565,6 +628,10 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             }
 
             bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
+            /* Move on, so that the next call can submit the following
+             * dirty chunk while this one is still being read.
+             */
+            bmds->cur_dirty = sector + BDRV_SECTORS_PER_DIRTY_CHUNK;
             break;
         }
         sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
@@ -746,7 +813,8 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
            qemu_file_get_rate_limit(f) &&
            (block_mig_state.submitted +
             block_mig_state.read_done) <
-           MAX_INFLIGHT_IO) {
+           migrate_block_queue_depth() &&
+           !qemu_file_rate_limit(f)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
@@ -812,11 +880,30 @@ static int block_save_complete(QEMUFile *f, void *opaque)
     assert(block_mig_state.submitted == 0);
     blk_mig_unlock();
 
+    /* The guest is stopped, so keep up to a full queue of reads in
+     * flight instead of reading one chunk at a time.
+     */
     do {
-        ret = blk_mig_save_dirty_block(f, 0);
+        bool full;
+
+        ret = blk_mig_save_dirty_block(f, 1);
         if (ret < 0) {
             return ret;
         }
+
+        blk_mig_lock();
+        full = block_mig_state.submitted + block_mig_state.read_done >=
+               migrate_block_queue_depth();
+        blk_mig_unlock();
+        if (ret > 0 || full) {
+            int flush_ret;
+
+            bdrv_drain_all();
+            flush_ret = flush_blks(f);
+            if (flush_ret) {
+                return flush_ret;
+            }
+        }
     } while (ret == 0);
 
     /* report completion */
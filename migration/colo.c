@@ -283,19 +283,30 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
         goto out;
     }
 
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
     /* Disable block migration */
     s->params.blk = 0;
     s->params.shared = 0;
-    qemu_savevm_state_header(fb);
-    qemu_savevm_state_begin(fb, &s->params);
+    /*
+     * Only the pages dirtied since the last checkpoint are sent, and they go
+     * straight to the stream; the Secondary keeps them in its RAM cache
+     * until the checkpoint is complete.  The device state is buffered, so
+     * that its size can be sent ahead of it.
+     */
+    qemu_savevm_state_begin(s->to_dst_file, &s->params);
     qemu_mutex_lock_iothread();
-    qemu_savevm_state_complete_precopy(fb, false);
+    qemu_savevm_state_complete_precopy(s->to_dst_file, true);
+    qemu_savevm_state_header(fb);
+    qemu_savevm_state_complete_precopy_non_iterable(fb);
     qemu_mutex_unlock_iothread();
 
-    qemu_fflush(fb);
-
-    colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
-    if (local_err) {
+    qemu_put_byte(s->to_dst_file, QEMU_VM_EOF);
+    qemu_fflush(s->to_dst_file);
+    if (qemu_file_get_error(s->to_dst_file) < 0) {
         goto out;
     }
     /*
@@ -474,6 +485,7 @@ void *colo_process_incoming_thread(void *opaque)
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
+    int ret;
 
     qemu_sem_init(&mis->colo_incoming_sem, 0);
 
@@ -499,6 +511,11 @@ void *colo_process_incoming_thread(void *opaque)
     fb = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
     object_unref(OBJECT(bioc));
 
+    if (colo_init_ram_cache() < 0) {
+        error_report("Failed to initialize ram cache");
+        goto out;
+    }
+
     colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_READY,
                       &local_err);
     if (local_err) {
@@ -531,6 +548,17 @@ void *colo_process_incoming_thread(void *opaque)
             goto out;
         }
 
+        /*
+         * The dirty pages of the checkpoint only go to the RAM cache, so
+         * the iothread lock is not needed; not holding it while blocked on
+         * the Primary lets a failover shut the stream down.
+         */
+        ret = qemu_loadvm_state_live(mis->from_src_file);
+        if (ret < 0) {
+            error_report("Load RAM of checkpoint failed");
+            goto out;
+        }
+
         value = colo_receive_message_value(mis->from_src_file,
                                  COLO_MESSAGE_VMSTATE_SIZE, &local_err);
         if (local_err) {
@@ -564,6 +592,7 @@ void *colo_process_incoming_thread(void *opaque)
         qemu_mutex_lock_iothread();
         qemu_system_reset(VMRESET_SILENT);
         vmstate_loading = true;
+        colo_flush_ram_cache();
         if (qemu_loadvm_state(fb) < 0) {
             error_report("COLO: loadvm failed");
             qemu_mutex_unlock_iothread();
@@ -598,6 +627,12 @@ out:
         qemu_fclose(fb);
     }
 
+    /*
+     * Guest RAM holds the last complete checkpoint, which is the one
+     * the device state was loaded from
+     */
+    colo_release_ram_cache();
+
     /* Hope this not to be too long to loop here */
     qemu_sem_wait(&mis->colo_incoming_sem);
     qemu_sem_destroy(&mis->colo_incoming_sem);
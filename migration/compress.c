@@ -0,0 +1,212 @@
+/*
+ * Compression methods for migrating RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#include "qapi/error.h"
+#include "migration/compress.h"
+
+typedef struct MigrationCompressOps {
+    size_t (*bound)(size_t size);
+    void (*init)(MigrationCompressor *c);
+    void (*cleanup)(MigrationCompressor *c);
+    ssize_t (*compress)(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen);
+    ssize_t (*decompress)(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                          const uint8_t *src, size_t slen);
+} MigrationCompressOps;
+
+struct MigrationCompressor {
+    const MigrationCompressOps *ops;
+    int level;
+    /* Contexts are created once per thread and reused for every page */
+    void *cctx;
+    void *dctx;
+};
+
+static size_t zlib_bound(size_t size)
+{
+    return compressBound(size);
+}
+
+static ssize_t zlib_compress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    uLongf blen = dlen;
+
+    if (compress2(dst, &blen, src, slen, c->level) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static ssize_t zlib_decompress(MigrationCompressor *c, uint8_t *dst,
+                               size_t dlen, const uint8_t *src, size_t slen)
+{
+    uLongf blen = dlen;
+
+    if (uncompress(dst, &blen, src, slen) != Z_OK) {
+        return -1;
+    }
+    return blen;
+}
+
+static const MigrationCompressOps zlib_ops = {
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+#ifdef CONFIG_LZ4
+static size_t lz4_bound(size_t size)
+{
+    return LZ4_compressBound(size);
+}
+
+/* lz4 has no levels; the level is ignored */
+static ssize_t lz4_compress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                            const uint8_t *src, size_t slen)
+{
+    int ret = LZ4_compress_default((const char *)src, (char *)dst, slen, dlen);
+
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                              const uint8_t *src, size_t slen)
+{
+    int ret = LZ4_decompress_safe((const char *)src, (char *)dst, slen, dlen);
+
+    return ret >= 0 ? ret : -1;
+}
+
+static const MigrationCompressOps lz4_ops = {
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+#ifdef CONFIG_ZSTD
+static size_t zstd_bound(size_t size)
+{
+    return ZSTD_compressBound(size);
+}
+
+static void zstd_init(MigrationCompressor *c)
+{
+    c->cctx = ZSTD_createCCtx();
+    c->dctx = ZSTD_createDCtx();
+}
+
+static void zstd_cleanup(MigrationCompressor *c)
+{
+    ZSTD_freeCCtx(c->cctx);
+    ZSTD_freeDCtx(c->dctx);
+}
+
+/* Levels 1 to 9 are passed to zstd as they are, 0 selects its default */
+static ssize_t zstd_compress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    size_t ret = ZSTD_compressCCtx(c->cctx, dst, dlen, src, slen, c->level);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static ssize_t zstd_decompress(MigrationCompressor *c, uint8_t *dst,
+                               size_t dlen, const uint8_t *src, size_t slen)
+{
+    size_t ret = ZSTD_decompressDCtx(c->dctx, dst, dlen, src, slen);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static const MigrationCompressOps zstd_ops = {
+    .bound = zstd_bound,
+    .init = zstd_init,
+    .cleanup = zstd_cleanup,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+static const MigrationCompressOps *
+compress_ops[MIGRATION_COMPRESS_METHOD__MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+#ifdef CONFIG_ZSTD
+    [MIGRATION_COMPRESS_METHOD_ZSTD] = &zstd_ops,
+#endif
+};
+
+bool migration_compress_method_supported(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD__MAX && compress_ops[method];
+}
+
+size_t migration_compress_bound(MigrationCompressMethod method, size_t size)
+{
+    assert(migration_compress_method_supported(method));
+    return compress_ops[method]->bound(size);
+}
+
+MigrationCompressor *migration_compressor_new(MigrationCompressMethod method,
+                                              int level, Error **errp)
+{
+    MigrationCompressor *c;
+
+    if (!migration_compress_method_supported(method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this QEMU binary", MigrationCompressMethod_lookup[method]);
+        return NULL;
+    }
+
+    c = g_new0(MigrationCompressor, 1);
+    c->ops = compress_ops[method];
+    c->level = level;
+    if (c->ops->init) {
+        c->ops->init(c);
+    }
+    return c;
+}
+
+void migration_compressor_free(MigrationCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+    if (c->ops->cleanup) {
+        c->ops->cleanup(c);
+    }
+    g_free(c);
+}
+
+size_t migration_compressor_bound(MigrationCompressor *c, size_t size)
+{
+    return c->ops->bound(size);
+}
+
+ssize_t migration_compress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                           const uint8_t *src, size_t slen)
+{
+    return c->ops->compress(c, dst, dlen, src, slen);
+}
+
+ssize_t migration_decompress(MigrationCompressor *c, uint8_t *dst, size_t dlen,
+                             const uint8_t *src, size_t slen)
+{
+    return c->ops->decompress(c, dst, dlen, src, slen);
+}
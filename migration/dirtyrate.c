@@ -0,0 +1,215 @@
+/*
+ * Guest dirty rate measurement
+ *
+ * Copyright (c) 2017 Red Hat Inc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+/* The pages sampled in one RAM block, and their hash at the start */
+typedef struct DirtyRateSample {
+    char idstr[256];
+    ram_addr_t used_length;
+    unsigned int npages;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+    unsigned int ndirty;
+} DirtyRateSample;
+
+/* Results are only written and read under the BQL */
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    int64_t dirty_rate;
+    DirtyRateBlockInfoList *blocks;
+} dirtyrate;
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32(0, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+static GArray *dirtyrate_sample_blocks(int64_t sample_pages)
+{
+    GArray *samples = g_array_new(FALSE, TRUE, sizeof(DirtyRateSample));
+    RAMBlock *block;
+    unsigned int i;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateSample sample = { };
+        uint64_t total = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!total) {
+            continue;
+        }
+        sample.npages = MIN(total, MAX(1, sample_pages *
+                                          block->used_length / (1ULL << 30)));
+        pstrcpy(sample.idstr, sizeof(sample.idstr), block->idstr);
+        sample.used_length = block->used_length;
+        sample.offsets = g_new(ram_addr_t, sample.npages);
+        sample.hashes = g_new(uint32_t, sample.npages);
+        for (i = 0; i < sample.npages; i++) {
+            uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+            sample.offsets[i] = (r % total) << TARGET_PAGE_BITS;
+            sample.hashes[i] = dirtyrate_hash_page(block, sample.offsets[i]);
+        }
+        g_array_append_val(samples, sample);
+    }
+    rcu_read_unlock();
+
+    return samples;
+}
+
+static void dirtyrate_compare_blocks(GArray *samples)
+{
+    unsigned int i, j;
+
+    rcu_read_lock();
+    for (i = 0; i < samples->len; i++) {
+        DirtyRateSample *sample = &g_array_index(samples, DirtyRateSample, i);
+        RAMBlock *block;
+
+        /* Blocks that went away or were resized are reported as clean */
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!strcmp(block->idstr, sample->idstr)) {
+                break;
+            }
+        }
+        if (!block || block->used_length != sample->used_length) {
+            continue;
+        }
+        for (j = 0; j < sample->npages; j++) {
+            if (dirtyrate_hash_page(block, sample->offsets[j]) !=
+                sample->hashes[j]) {
+                sample->ndirty++;
+            }
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    int64_t sample_pages = dirtyrate.sample_pages;
+    int64_t calc_time = dirtyrate.calc_time;
+    DirtyRateBlockInfoList *blocks = NULL;
+    uint64_t total_rate = 0;
+    int64_t start, elapsed;
+    GArray *samples;
+    unsigned int i;
+
+    rcu_register_thread();
+
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    samples = dirtyrate_sample_blocks(sample_pages);
+    g_usleep(calc_time * G_USEC_PER_SEC);
+    dirtyrate_compare_blocks(samples);
+    elapsed = MAX(1, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+
+    for (i = samples->len; i-- > 0; ) {
+        DirtyRateSample *sample = &g_array_index(samples, DirtyRateSample, i);
+        DirtyRateBlockInfoList *entry = g_new0(DirtyRateBlockInfoList, 1);
+        uint64_t rate;
+
+        /* MB/s = dirty fraction * block size / elapsed time */
+        rate = (double)sample->ndirty / sample->npages *
+               sample->used_length / (1 << 20) * 1000 / elapsed;
+        total_rate += rate;
+
+        entry->value = g_new0(DirtyRateBlockInfo, 1);
+        entry->value->id = g_strdup(sample->idstr);
+        entry->value->dirty_rate = rate;
+        entry->next = blocks;
+        blocks = entry;
+
+        trace_dirtyrate_block(sample->idstr, sample->ndirty, sample->npages,
+                              rate);
+        g_free(sample->offsets);
+        g_free(sample->hashes);
+    }
+    g_array_free(samples, TRUE);
+
+    qemu_mutex_lock_iothread();
+    qapi_free_DirtyRateBlockInfoList(dirtyrate.blocks);
+    dirtyrate.blocks = blocks;
+    dirtyrate.dirty_rate = total_rate;
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (dirtyrate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 128 to 4096");
+        return;
+    }
+
+    dirtyrate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirtyrate.calc_time = calc_time;
+    dirtyrate.sample_pages = sample_pages;
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = dirtyrate.status;
+    info->start_time = dirtyrate.start_time;
+    info->calc_time = dirtyrate.calc_time;
+    info->sample_pages = dirtyrate.sample_pages;
+    if (dirtyrate.status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirtyrate.dirty_rate;
+        info->has_blocks = true;
+        info->blocks = QAPI_CLONE(DirtyRateBlockInfoList, dirtyrate.blocks);
+    }
+
+    return info;
+}
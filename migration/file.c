@@ -0,0 +1,99 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+/* Path of the current file: migration, used by x-mapped-ram to open
+ * descriptors of its own.  */
+static char *file_path;
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_outgoing(filename);
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(file_path);
+    file_path = g_strdup(filename);
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(fioc), NULL);
+    object_unref(OBJECT(fioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(migrate_get_current(), ioc);
+    object_unref(OBJECT(ioc));
+    return FALSE; /* unregister */
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    trace_migration_file_incoming(filename);
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+
+    g_free(file_path);
+    file_path = g_strdup(filename);
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-incoming");
+    qio_channel_add_watch(QIO_CHANNEL(fioc),
+                          G_IO_IN,
+                          file_accept_incoming_migration,
+                          NULL,
+                          NULL);
+}
+
+/*
+ * Open another descriptor on the file of the current migration, for
+ * random access to the x-mapped-ram regions.  With @direct the page
+ * cache is bypassed, so the caller must align its buffers, offsets and
+ * sizes as the filesystem requires.
+ *
+ * Returns the descriptor, or -1 with @errp set.
+ */
+int file_mapped_ram_open(bool writable, bool direct, Error **errp)
+{
+    int flags = writable ? O_WRONLY : O_RDONLY;
+    int fd;
+
+    if (!file_path) {
+        error_setg(errp, "mapped-ram requires a file: migration");
+        return -1;
+    }
+    if (direct) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "direct I/O is not supported on this host");
+        return -1;
+#endif
+    }
+
+    fd = qemu_open(file_path, flags);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Unable to open %s", file_path);
+        return -1;
+    }
+    return fd;
+}
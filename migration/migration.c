@@ -37,6 +37,7 @@
 #include "io/channel-buffer.h"
 #include "io/channel-tls.h"
 #include "migration/colo.h"
+#include "migration/compress.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -68,6 +69,16 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Default number of x-multifd channels */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
+/* Default and maximum number of block migration reads in flight */
+#define DEFAULT_MIGRATE_BLOCK_QUEUE_DEPTH 512
+#define MAX_BLOCK_QUEUE_DEPTH 65536
+
+/* Maximum size of the postcopy prefetch window, in host pages */
+#define MAX_POSTCOPY_PREFETCH_PAGES 1024
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -101,6 +112,9 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
+            .x_block_queue_depth = DEFAULT_MIGRATE_BLOCK_QUEUE_DEPTH,
         },
     };
 
@@ -323,6 +337,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -340,6 +356,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        migrate_load_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -364,6 +381,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    migrate_load_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -423,12 +441,15 @@ static void process_incoming_migration_co(void *opaque)
 
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    multifd_load_cleanup();
+    postcopy_preempt_load_cleanup(false);
 
     if (ret < 0) {
         migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        migrate_load_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -441,6 +462,7 @@ void migration_fd_process_incoming(QEMUFile *f)
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
 
     migrate_decompress_threads_create();
+    migrate_load_threads_create();
     qemu_file_set_blocking(f, false);
     qemu_coroutine_enter(co);
 }
@@ -591,6 +613,18 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_x_multifd_channels = true;
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
+    params->has_x_postcopy_prefetch_pages = true;
+    params->x_postcopy_prefetch_pages = s->parameters.x_postcopy_prefetch_pages;
+    params->has_x_load_threads = true;
+    params->x_load_threads = s->parameters.x_load_threads;
+    params->has_x_rdma_pin_limit = true;
+    params->x_rdma_pin_limit = s->parameters.x_rdma_pin_limit;
+    params->has_x_block_queue_depth = true;
+    params->x_block_queue_depth = s->parameters.x_block_queue_depth;
 
     return params;
 }
@@ -623,10 +657,19 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
+        info->xbzrle_cache->cache_hit_rate = xbzrle_mig_cache_hit_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = compress_mig_stats();
+    }
+}
+
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
@@ -682,11 +725,19 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         if (cpu_throttle_active()) {
+            CPUState *cpu;
+
             info->has_cpu_throttle_percentage = true;
             info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+            CPU_FOREACH(cpu) {
+                info->cpu_throttle_percentage =
+                    MAX(info->cpu_throttle_percentage,
+                        cpu_throttle_vcpu_get_percentage(cpu));
+            }
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
         /* Mostly the same as active; TODO add some postcopy stats */
@@ -710,6 +761,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
@@ -717,6 +769,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -794,6 +847,105 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Pages sent on the multifd channels bypass the compression
+         * threads, the atomic placement needed by postcopy and the
+         * buffering of COLO checkpoints.
+         */
+        if (migrate_use_compression() || migrate_postcopy_ram() ||
+            migrate_colo_enabled()) {
+            error_report("Multifd is not currently compatible with "
+                         "compression, postcopy or COLO");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        /* Only pages requested by a postcopy destination use the channel */
+        error_report("Postcopy preemption requires postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT] =
+            false;
+    }
+
+    if (migrate_use_zero_copy_send() && !migrate_use_multifd()) {
+        /* The main stream reuses its buffer as soon as it is written */
+        error_report("Zero copy send requires multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] = false;
+    }
+
+    if (migrate_use_mapped_ram()) {
+        /* Each page has a single slot in the file, so only the latest
+         * copy of it can be kept; deltas, compressed streams and pages
+         * that are not in the file when the destination starts cannot.
+         */
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram() || migrate_use_multifd() ||
+            migrate_colo_enabled() || migrate_release_ram()) {
+            error_report("Mapped-ram is not currently compatible with "
+                         "xbzrle, compression, postcopy, multifd or COLO");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] = false;
+        }
+    }
+
+    if (migrate_use_direct_io() && !migrate_use_mapped_ram()) {
+        /* The stream itself is not block aligned */
+        error_report("Direct I/O requires mapped-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO] = false;
+    }
+
+    if (migrate_lazy_restore()) {
+        /* Pages are only found at a known place when they are in a file */
+        if (!migrate_use_mapped_ram()) {
+            error_report("Lazy restore requires mapped-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        } else if (runstate_check(RUN_STATE_INMIGRATE) &&
+                   !postcopy_ram_supported_by_host()) {
+            /* postcopy_ram_supported_by_host will have emitted a more
+             * detailed message
+             */
+            error_report("Lazy restore is not supported");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        }
+    }
+
+    if (migrate_background_snapshot()) {
+        /* RAM is saved exactly once, straight from the pages the guest
+         * had when the snapshot started
+         */
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram() || migrate_use_multifd() ||
+            migrate_use_mapped_ram() || migrate_colo_enabled() ||
+            migrate_release_ram()) {
+            error_report("Background snapshot is not currently compatible "
+                         "with xbzrle, compression, postcopy, multifd, "
+                         "mapped-ram or COLO");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT]
+                = false;
+        } else if (!runstate_check(RUN_STATE_INMIGRATE) &&
+                   !ram_write_tracking_supported()) {
+            error_report("Background snapshot is not supported");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT]
+                = false;
+        }
+    }
+
+    if (migrate_ignore_shared()) {
+        /* These all need every page of RAM to go through the stream, or
+         * to be individually tracked on the destination
+         */
+        if (migrate_postcopy_ram() || migrate_use_mapped_ram() ||
+            migrate_lazy_restore() || migrate_background_snapshot() ||
+            migrate_colo_enabled()) {
+            error_report("Ignore-shared is not currently compatible with "
+                         "postcopy, mapped-ram, lazy restore, background "
+                         "snapshot or COLO");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED] =
+                false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -854,6 +1006,49 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_x_multifd_channels &&
+        (params->x_multifd_channels < 1 || params->x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (params->has_compress_method &&
+        !migration_compress_method_supported(params->compress_method)) {
+        error_setg(errp, "Compression method '%s' is not supported by "
+                   "this build",
+                   MigrationCompressMethod_lookup[params->compress_method]);
+        return;
+    }
+    if (params->has_x_postcopy_prefetch_pages &&
+        (params->x_postcopy_prefetch_pages < 0 ||
+         params->x_postcopy_prefetch_pages > MAX_POSTCOPY_PREFETCH_PAGES)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 1024");
+        return;
+    }
+    if (params->has_x_load_threads &&
+        (params->x_load_threads < 0 || params->x_load_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_load_threads",
+                   "is invalid, it should be in the range of 0 to 255");
+        return;
+    }
+    if (params->has_x_rdma_pin_limit && params->x_rdma_pin_limit < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_rdma_pin_limit",
+                   "is invalid, it should be 0 or a size in bytes");
+        return;
+    }
+    if (params->has_x_block_queue_depth &&
+        (params->x_block_queue_depth < 1 ||
+         params->x_block_queue_depth > MAX_BLOCK_QUEUE_DEPTH)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_block_queue_depth",
+                   "is invalid, it should be in the range of 1 to 65536");
+        return;
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -895,6 +1090,25 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
             colo_checkpoint_notify(s);
         }
     }
+    if (params->has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = params->x_multifd_channels;
+    }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+    if (params->has_x_postcopy_prefetch_pages) {
+        s->parameters.x_postcopy_prefetch_pages =
+            params->x_postcopy_prefetch_pages;
+    }
+    if (params->has_x_load_threads) {
+        s->parameters.x_load_threads = params->x_load_threads;
+    }
+    if (params->has_x_rdma_pin_limit) {
+        s->parameters.x_rdma_pin_limit = params->x_rdma_pin_limit;
+    }
+    if (params->has_x_block_queue_depth) {
+        s->parameters.x_block_queue_depth = params->x_block_queue_depth;
+    }
 }
 
 
@@ -952,6 +1166,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
+    socket_cleanup_outgoing_migration();
 
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
@@ -1004,6 +1219,8 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
+        postcopy_preempt_save_shutdown();
     }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
@@ -1209,6 +1426,16 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "x-mapped-ram requires a file: migration URI");
+        return;
+    }
+    if (migrate_background_snapshot() && (params.blk || params.shared)) {
+        error_setg(errp, "x-background-snapshot does not support block "
+                   "migration");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1223,6 +1450,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -1345,6 +1574,141 @@ bool migrate_use_compression(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_PREEMPT];
+}
+
+bool migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_use_direct_io(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_DIRECT_IO];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_zero_page_runs(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_PAGE_RUNS];
+}
+
+bool migrate_ignore_shared(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
+}
+
+bool migrate_use_vcpu_throttle(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_VCPU_THROTTLE];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch_pages;
+}
+
+int migrate_load_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_load_threads;
+}
+
+int64_t migrate_rdma_pin_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_rdma_pin_limit;
+}
+
+int migrate_block_queue_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_block_queue_depth;
+}
+
 int migrate_compress_level(void)
 {
     MigrationState *s;
@@ -1354,6 +1718,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1868,6 +2241,70 @@ bool migrate_colo_enabled(void)
  * Master migration thread on the source VM.
  * It drives the migration and pumps the data down the outgoing channel.
  */
+/*
+ * Background snapshot: stop the guest just long enough to save the
+ * state of its devices to a buffer and to write protect its RAM, then
+ * let it run while RAM is saved.  Returns the buffer, or NULL on error.
+ */
+static QEMUFile *bg_snapshot_start(MigrationState *s, QIOChannelBuffer **bioc,
+                                   int64_t *downtime)
+{
+    QEMUFile *fb = NULL;
+    bool vm_running;
+    int64_t start_time;
+    int ret;
+
+    ram_write_tracking_prepare();
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    vm_running = runstate_is_running();
+    ret = global_state_store();
+    if (!ret && vm_running) {
+        ret = vm_stop(RUN_STATE_SAVE_VM);
+    }
+    if (!ret) {
+        ret = ram_write_tracking_start();
+    }
+    if (!ret) {
+        *bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(*bioc), "migration-snapshot-buffer");
+        fb = qemu_fopen_channel_output(QIO_CHANNEL(*bioc));
+        object_unref(OBJECT(*bioc));
+
+        cpu_synchronize_all_states();
+        qemu_savevm_state_complete_precopy_non_iterable(fb);
+        if (qemu_file_get_error(fb)) {
+            ram_write_tracking_stop();
+            qemu_fclose(fb);
+            fb = NULL;
+        }
+    }
+    if (vm_running) {
+        vm_start();
+    }
+    *downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+    qemu_mutex_unlock_iothread();
+
+    trace_bg_snapshot_start(fb != NULL, *downtime);
+    return fb;
+}
+
+/* All of RAM is in the stream: append the device state and finish */
+static void bg_snapshot_complete(MigrationState *s, QIOChannelBuffer *bioc)
+{
+    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
+    qemu_fflush(s->to_dst_file);
+
+    if (qemu_file_get_error(s->to_dst_file)) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+    } else {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_COMPLETED);
+    }
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -1883,6 +2320,10 @@ static void *migration_thread(void *opaque)
     /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
     enum MigrationStatus current_active_state = MIGRATION_STATUS_ACTIVE;
     bool enable_colo = migrate_colo_enabled();
+    bool bg_snapshot = migrate_background_snapshot();
+    QEMUFile *bg_state = NULL;
+    QIOChannelBuffer *bg_bioc = NULL;
+    int64_t bg_downtime = 0;
 
     rcu_register_thread();
 
@@ -1905,6 +2346,14 @@ static void *migration_thread(void *opaque)
 
     qemu_savevm_state_begin(s->to_dst_file, &s->params);
 
+    if (bg_snapshot) {
+        bg_state = bg_snapshot_start(s, &bg_bioc, &bg_downtime);
+        if (!bg_state) {
+            migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                              MIGRATION_STATUS_FAILED);
+        }
+    }
+
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     current_active_state = MIGRATION_STATUS_ACTIVE;
     migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
@@ -1925,7 +2374,15 @@ static void *migration_thread(void *opaque)
             pending_size = pend_nonpost + pend_post;
             trace_migrate_pending(pending_size, max_size,
                                   pend_post, pend_nonpost);
-            if (pending_size && pending_size >= max_size) {
+            if (bg_snapshot) {
+                /* The guest keeps running; there is no downtime to fit */
+                if (pending_size) {
+                    qemu_savevm_state_iterate(s->to_dst_file, false);
+                } else {
+                    bg_snapshot_complete(s, bg_bioc);
+                    break;
+                }
+            } else if (pending_size && pending_size >= max_size) {
                 /* Still a significant amount to transfer */
 
                 if (migrate_postcopy_ram() &&
@@ -1990,6 +2447,12 @@ static void *migration_thread(void *opaque)
     cpu_throttle_stop();
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
+    if (bg_state) {
+        /* Before taking the BQL: its holder may be waiting on a page */
+        ram_write_tracking_stop();
+        qemu_fclose(bg_state);
+    }
+
     qemu_mutex_lock_iothread();
     /*
      * The resource has been allocated by migration will be reused in COLO
@@ -2001,14 +2464,18 @@ static void *migration_thread(void *opaque)
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         uint64_t transferred_bytes = qemu_ftell(s->to_dst_file);
         s->total_time = end_time - s->total_time;
-        if (!entered_postcopy) {
+        if (bg_snapshot) {
+            s->downtime = bg_downtime;
+        } else if (!entered_postcopy) {
             s->downtime = end_time - start_time;
         }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (!bg_snapshot) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
         if (s->state == MIGRATION_STATUS_ACTIVE && enable_colo) {
             migrate_start_colo_process(s);
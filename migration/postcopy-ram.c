@@ -24,6 +24,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -60,19 +62,25 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
-static bool ufd_version_check(int ufd)
+static bool ufd_version_check(int ufd, uint64_t features)
 {
     struct uffdio_api api_struct;
     uint64_t ioctl_mask;
 
     api_struct.api = UFFD_API;
-    api_struct.features = 0;
+    api_struct.features = features;
     if (ioctl(ufd, UFFDIO_API, &api_struct)) {
         error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
                      strerror(errno));
         return false;
     }
 
+    if ((api_struct.features & features) != features) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.features & features));
+        return false;
+    }
+
     ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
                  (__u64)1 << _UFFDIO_UNREGISTER;
     if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
@@ -136,7 +144,7 @@ bool postcopy_ram_supported_by_host(void)
     }
 
     /* Version and features check */
-    if (!ufd_version_check(ufd)) {
+    if (!ufd_version_check(ufd, 0)) {
         goto out;
     }
 
@@ -259,9 +267,12 @@ static int cleanup_range(const char *block_name, void *host_addr,
 
     /*
      * We turned off hugepage for the precopy stage with postcopy enabled
-     * we can turn it back on now.
+     * we can turn it back on now.  The pages were placed one small page
+     * at a time, so also have the huge pages rebuilt in the background
+     * rather than waiting for khugepaged.
      */
     qemu_madvise(host_addr, length, QEMU_MADV_HUGEPAGE);
+    qemu_ram_collapse_schedule(host_addr, length);
 
     /*
      * We can also turn off userfault now since we should have all the
@@ -295,12 +306,10 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis, size_t ram_pages)
 }
 
 /*
- * At the end of a migration where postcopy_ram_incoming_init was called.
+ * Unregister RAM from the userfaultfd and stop the thread serving it
  */
-int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+static int postcopy_notify_stop(MigrationIncomingState *mis)
 {
-    trace_postcopy_ram_incoming_cleanup_entry();
-
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -326,6 +335,23 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         mis->have_fault_thread = false;
     }
 
+    return 0;
+}
+
+/*
+ * At the end of a migration where postcopy_ram_incoming_init was called.
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    /* Pages still arriving on the preemption channel need the userfaultfd */
+    postcopy_preempt_load_cleanup(qemu_file_get_error(mis->from_src_file) == 0);
+
+    if (postcopy_notify_stop(mis)) {
+        return -1;
+    }
+
     qemu_balloon_inhibit(false);
 
     if (enable_mlock) {
@@ -415,6 +441,86 @@ static int ram_block_enable_notify(const char *block_name, void *host_addr,
 /*
  * Handle faults detected by the USERFAULT markings
  */
+/*
+ * Fault-side prefetch state, only used by the fault thread.  Pages the
+ * source has already sent are not dirty any more and are skipped by it,
+ * so requesting a page twice only costs a few bytes on the return path.
+ */
+typedef struct PostcopyPrefetch {
+    RAMBlock *rb;
+    ram_addr_t last_fault;
+    ram_addr_t end;     /* End of the last range we requested */
+    size_t window;      /* Current window in bytes */
+} PostcopyPrefetch;
+
+static void postcopy_request_pages(MigrationIncomingState *mis,
+                                   RAMBlock **last_rb, RAMBlock *rb,
+                                   ram_addr_t start, size_t len)
+{
+    if (rb != *last_rb) {
+        *last_rb = rb;
+        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb), start, len);
+    } else {
+        /* Save some space */
+        migrate_send_rp_req_pages(mis, NULL, start, len);
+    }
+}
+
+/*
+ * Request pages around a fault after the faulting page itself has been
+ * requested, so that the latter is still served first.  A fault that
+ * lands in the range prefetched for the previous one is taken as a
+ * sequential scan: the window doubles up to x-postcopy-prefetch-pages,
+ * and only the part not yet requested is sent, which keeps several
+ * ranges in flight ahead of the guest.  Other faults get a small window
+ * split around the faulting page.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetch *pf, RAMBlock **last_rb,
+                              RAMBlock *rb, ram_addr_t offset,
+                              size_t hostpagesize)
+{
+    size_t max = migrate_postcopy_prefetch_pages() * hostpagesize;
+    ram_addr_t block_len = qemu_ram_get_used_length(rb);
+    ram_addr_t next = offset + hostpagesize;
+    ram_addr_t start, end;
+    size_t before;
+
+    if (!max) {
+        return;
+    }
+
+    if (pf->rb == rb && offset > pf->last_fault && offset <= pf->end) {
+        pf->window = MIN(pf->window * 2, max);
+        start = MAX(pf->end, next);
+        end = MIN(next + pf->window, block_len);
+        if (start < end) {
+            trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                     start, end - start, true);
+            postcopy_request_pages(mis, last_rb, rb, start, end - start);
+            pf->end = end;
+        }
+    } else {
+        pf->window = MAX(QEMU_ALIGN_DOWN(max / 4, hostpagesize), hostpagesize);
+        before = MIN(QEMU_ALIGN_DOWN(pf->window / 2, hostpagesize), offset);
+        end = MIN(next + pf->window - before, block_len);
+        if (before) {
+            trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                     offset - before, before,
+                                                     false);
+            postcopy_request_pages(mis, last_rb, rb, offset - before, before);
+        }
+        if (next < end) {
+            trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                     next, end - next, false);
+            postcopy_request_pages(mis, last_rb, rb, next, end - next);
+        }
+        pf->end = MAX(end, next);
+    }
+    pf->rb = rb;
+    pf->last_fault = offset;
+}
+
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
@@ -423,6 +529,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     size_t hostpagesize = getpagesize();
     RAMBlock *rb = NULL;
     RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    PostcopyPrefetch prefetch = { };
 
     trace_postcopy_ram_fault_thread_entry();
     qemu_sem_post(&mis->fault_thread_sem);
@@ -496,21 +603,21 @@ static void *postcopy_ram_fault_thread(void *opaque)
          * Send the request to the source - we want to request one
          * of our host page sizes (which is >= TPS)
          */
-        if (rb != last_rb) {
-            last_rb = rb;
-            migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                     rb_offset, hostpagesize);
-        } else {
-            /* Save some space */
-            migrate_send_rp_req_pages(mis, NULL,
-                                     rb_offset, hostpagesize);
-        }
+        postcopy_request_pages(mis, &last_rb, rb, rb_offset, hostpagesize);
+        postcopy_prefetch(mis, &prefetch, &last_rb, rb, rb_offset,
+                          hostpagesize);
     }
     trace_postcopy_ram_fault_thread_exit();
     return NULL;
 }
 
-int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+/*
+ * Open the userfaultfd, start the thread serving it and register all of
+ * RAM with it
+ */
+static int postcopy_notify_start(MigrationIncomingState *mis,
+                                 const char *name,
+                                 void *(*fn)(void *))
 {
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
@@ -524,7 +631,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
      * Although the host check already tested the API, we need to
      * do the check again as an ABI handshake on the new fd.
      */
-    if (!ufd_version_check(mis->userfault_fd)) {
+    if (!ufd_version_check(mis->userfault_fd, 0)) {
         return -1;
     }
 
@@ -538,8 +645,8 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     }
 
     qemu_sem_init(&mis->fault_thread_sem, 0);
-    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
-                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&mis->fault_thread, name, fn, mis,
+                       QEMU_THREAD_JOINABLE);
     qemu_sem_wait(&mis->fault_thread_sem);
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
@@ -549,6 +656,16 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    return 0;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    if (postcopy_notify_start(mis, "postcopy/fault",
+                              postcopy_ram_fault_thread)) {
+        return -1;
+    }
+
     /*
      * Ballooning can mark pages as absent while we're postcopying
      * that would cause false userfaults.
@@ -638,6 +755,413 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Lazy restore: the pages come from a local x-mapped-ram file instead of
+ * a source, so the fault thread fills and places them itself, and
+ * restores the rest of RAM in the background between faults.  Once
+ * nothing is left, userfaults are unregistered from a bottom half.
+ */
+
+/* Host pages restored in the background between two checks for faults */
+#define LAZY_RESTORE_BATCH 16
+
+static QEMUBH *lazy_restore_bh;
+
+/* Like postcopy_place_page, but the page may already have been placed
+ * for an earlier fault on the same page
+ */
+static int postcopy_lazy_restore_page(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t offset,
+                                      size_t pagesize)
+{
+    void *host = qemu_ram_get_host_addr(rb) + offset;
+    void *tmp = mis->postcopy_tmp_page;
+    int ret;
+
+    ret = ram_lazy_restore_fill(rb, offset, pagesize, tmp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret) {
+        struct uffdio_zeropage zero_struct;
+
+        zero_struct.range.start = (uint64_t)(uintptr_t)host;
+        zero_struct.range.len = pagesize;
+        zero_struct.mode = 0;
+        ret = ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
+    } else {
+        struct uffdio_copy copy_struct;
+
+        copy_struct.dst = (uint64_t)(uintptr_t)host;
+        copy_struct.src = (uint64_t)(uintptr_t)tmp;
+        copy_struct.len = pagesize;
+        copy_struct.mode = 0;
+        ret = ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct);
+    }
+    if (ret && errno != EEXIST) {
+        error_report("%s: %s placing %s:" RAM_ADDR_FMT, __func__,
+                     strerror(errno), qemu_ram_get_idstr(rb), offset);
+        return -errno;
+    }
+    return 0;
+}
+
+static void *postcopy_lazy_restore_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffd_msg msg;
+    size_t hostpagesize = getpagesize();
+    bool background = true;
+    RAMBlock *rb;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_lazy_restore_thread_entry();
+    qemu_sem_post(&mis->fault_thread_sem);
+
+    while (true) {
+        ram_addr_t rb_offset;
+        struct pollfd pfd[2];
+        int i;
+
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = mis->userfault_quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        /* Only block once the background pass is over */
+        if (poll(pfd, 2, background ? 0 : -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            trace_postcopy_ram_fault_thread_quit();
+            break;
+        }
+
+        if (!pfd[0].revents) {
+            for (i = 0; background && i < LAZY_RESTORE_BATCH; i++) {
+                if (!ram_lazy_restore_next(&rb, &rb_offset, hostpagesize)) {
+                    trace_postcopy_lazy_restore_done();
+                    background = false;
+                    qemu_bh_schedule(lazy_restore_bh);
+                } else if (postcopy_lazy_restore_page(mis, rb, rb_offset,
+                                                      hostpagesize) < 0) {
+                    /* The guest cannot run without its memory */
+                    exit(EXIT_FAILURE);
+                }
+            }
+            continue;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: Failed to read full userfault message: %s",
+                         __func__, strerror(errno));
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %ud from userfaultfd",
+                         __func__, msg.event);
+            continue;
+        }
+
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &rb_offset);
+        if (!rb) {
+            error_report("%s: Fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= ~(hostpagesize - 1);
+        trace_postcopy_lazy_restore_fault(msg.arg.pagefault.address,
+                                          qemu_ram_get_idstr(rb), rb_offset);
+        if (postcopy_lazy_restore_page(mis, rb, rb_offset, hostpagesize) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    trace_postcopy_ram_fault_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void postcopy_lazy_restore_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    qemu_bh_delete(lazy_restore_bh);
+    lazy_restore_bh = NULL;
+
+    postcopy_notify_stop(mis);
+    ram_lazy_restore_cleanup();
+    qemu_balloon_inhibit(false);
+
+    if (enable_mlock) {
+        if (os_mlock() < 0) {
+            error_report("mlock: %s", strerror(errno));
+        }
+    }
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_lazy_restore_end();
+}
+
+int postcopy_lazy_restore_start(MigrationIncomingState *mis)
+{
+    /* Come back to an empty RAM, as postcopy does; what had been loaded
+     * there at startup is in the file too.
+     */
+    if (qemu_ram_foreach_block(nhp_range, mis) ||
+        qemu_ram_foreach_block(init_range, mis)) {
+        return -1;
+    }
+    if (!postcopy_get_tmp_page(mis)) {
+        return -1;
+    }
+
+    lazy_restore_bh = qemu_bh_new(postcopy_lazy_restore_bh, mis);
+    qemu_balloon_inhibit(true);
+    if (postcopy_notify_start(mis, "postcopy/lazy",
+                              postcopy_lazy_restore_thread)) {
+        postcopy_notify_stop(mis);
+        qemu_balloon_inhibit(false);
+        qemu_bh_delete(lazy_restore_bh);
+        lazy_restore_bh = NULL;
+        return -1;
+    }
+
+    trace_postcopy_lazy_restore_start();
+    return 0;
+}
+
+/*
+ * Write protection of RAM for background snapshots.  Unlike postcopy this
+ * runs on the source, so it has its own userfaultfd; each write to a
+ * protected page blocks the writer until ram_write_tracking_copy has
+ * taken a copy of the page, then the page is made writable again.
+ */
+static struct {
+    int fd;
+    int quit_fd;
+    QemuThread thread;
+    QemuSemaphore thread_sem;
+} postcopy_wp = { .fd = -1, .quit_fd = -1 };
+
+static int postcopy_wp_set(int fd, uint64_t start, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect wp_struct;
+
+    wp_struct.range.start = start;
+    wp_struct.range.len = len;
+    wp_struct.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    if (ioctl(fd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        error_report("%s: %s %" PRIx64 "+%" PRIx64, __func__,
+                     strerror(errno), start, len);
+        return -errno;
+    }
+    return 0;
+}
+
+bool postcopy_wp_supported_by_host(void)
+{
+    bool ret;
+    int ufd;
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        return false;
+    }
+    ret = ufd_version_check(ufd, UFFD_FEATURE_PAGEFAULT_FLAG_WP);
+    close(ufd);
+    return ret;
+}
+
+static int wp_range_register(const char *block_name, void *host_addr,
+                             ram_addr_t offset, ram_addr_t length,
+                             void *opaque)
+{
+    struct uffdio_register reg_struct;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(postcopy_wp.fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register %s: %s", __func__, block_name,
+                     strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: RAM block %s cannot be write protected",
+                     __func__, block_name);
+        return -1;
+    }
+
+    return postcopy_wp_set(postcopy_wp.fd, (uintptr_t)host_addr, length,
+                           true);
+}
+
+static int wp_range_unregister(const char *block_name, void *host_addr,
+                               ram_addr_t offset, ram_addr_t length,
+                               void *opaque)
+{
+    struct uffdio_range range_struct;
+
+    /* Also wakes up anyone still waiting on a protected page */
+    range_struct.start = (uintptr_t)host_addr;
+    range_struct.len = length;
+    if (ioctl(postcopy_wp.fd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *postcopy_wp_thread(void *opaque)
+{
+    size_t hostpagesize = getpagesize();
+    struct uffd_msg msg;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_wp_thread_entry();
+    qemu_sem_post(&postcopy_wp.thread_sem);
+
+    while (true) {
+        ram_addr_t rb_offset;
+        struct pollfd pfd[2];
+        RAMBlock *rb;
+
+        pfd[0].fd = postcopy_wp.fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = postcopy_wp.quit_fd;
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(postcopy_wp.fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                continue;
+            }
+            error_report("%s: Failed to read full userfault message: %s",
+                         __func__, strerror(errno));
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        rb = qemu_ram_block_from_host(
+                 (void *)(uintptr_t)msg.arg.pagefault.address,
+                 true, &rb_offset);
+        if (!rb) {
+            error_report("%s: Fault outside guest: %" PRIx64, __func__,
+                         (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+        rb_offset &= ~(hostpagesize - 1);
+        trace_postcopy_wp_fault(qemu_ram_get_idstr(rb), rb_offset);
+
+        ram_write_tracking_copy(rb, rb_offset, hostpagesize);
+        if (postcopy_wp_set(postcopy_wp.fd,
+                            msg.arg.pagefault.address & ~(hostpagesize - 1),
+                            hostpagesize, false)) {
+            break;
+        }
+    }
+
+    trace_postcopy_wp_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int postcopy_wp_start(void)
+{
+    postcopy_wp.fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy_wp.fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    postcopy_wp.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (postcopy_wp.quit_fd == -1) {
+        error_report("%s: Opening quit fd: %s", __func__, strerror(errno));
+        close(postcopy_wp.fd);
+        postcopy_wp.fd = -1;
+        return -1;
+    }
+
+    if (!ufd_version_check(postcopy_wp.fd, UFFD_FEATURE_PAGEFAULT_FLAG_WP) ||
+        qemu_ram_foreach_block(wp_range_register, NULL)) {
+        qemu_ram_foreach_block(wp_range_unregister, NULL);
+        close(postcopy_wp.fd);
+        close(postcopy_wp.quit_fd);
+        postcopy_wp.fd = postcopy_wp.quit_fd = -1;
+        return -1;
+    }
+
+    qemu_sem_init(&postcopy_wp.thread_sem, 0);
+    qemu_thread_create(&postcopy_wp.thread, "snapshot/wp", postcopy_wp_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_sem_wait(&postcopy_wp.thread_sem);
+    qemu_sem_destroy(&postcopy_wp.thread_sem);
+
+    trace_postcopy_wp_start();
+    return 0;
+}
+
+void postcopy_wp_stop(void)
+{
+    uint64_t tmp64 = 1;
+
+    if (postcopy_wp.fd == -1) {
+        return;
+    }
+
+    /* Let writers go before waiting for a thread that may be serving one */
+    qemu_ram_foreach_block(wp_range_unregister, NULL);
+    if (write(postcopy_wp.quit_fd, &tmp64, 8) == 8) {
+        qemu_thread_join(&postcopy_wp.thread);
+    } else {
+        error_report("%s: incrementing quit fd: %s", __func__,
+                     strerror(errno));
+    }
+    close(postcopy_wp.fd);
+    close(postcopy_wp.quit_fd);
+    postcopy_wp.fd = postcopy_wp.quit_fd = -1;
+    trace_postcopy_wp_stop();
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -695,6 +1219,28 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+int postcopy_lazy_restore_start(MigrationIncomingState *mis)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+bool postcopy_wp_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_wp_start(void)
+{
+    assert(0);
+    return -1;
+}
+
+void postcopy_wp_stop(void)
+{
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
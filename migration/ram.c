@@ -28,8 +28,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "cpu.h"
-#include <zlib.h>
 #include "qapi-event.h"
+#include "qmp-commands.h"
+#include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -42,8 +43,12 @@
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
+#include "sysemu/kvm.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/iov.h"
 #include "migration/colo.h"
+#include "migration/compress.h"
+#include "io/channel-socket.h"
 
 static int dirty_rate_high_cnt;
 
@@ -53,6 +58,8 @@ static uint64_t bitmap_sync_count;
 /* ram save/restore */
 
 #define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/* Reuses the obsolete bit, only sent with the x-zero-page-runs capability */
+#define RAM_SAVE_FLAG_ZERO_RUN 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -61,9 +68,19 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/* Longest run of zero pages sent in one RAM_SAVE_FLAG_ZERO_RUN record */
+#define ZERO_RUN_MAX_PAGES 4096
 
 static uint8_t *ZERO_TARGET_PAGE;
 
+/* With x-ignore-shared, the destination maps the same file for these */
+static inline bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block);
+}
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -145,6 +162,7 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
@@ -206,6 +224,14 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+double xbzrle_mig_cache_hit_rate(void)
+{
+    uint64_t lookups = acct_info.xbzrle_cache_hit +
+                       acct_info.xbzrle_cache_miss;
+
+    return lookups ? (double)acct_info.xbzrle_cache_hit / lookups : 0;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -221,6 +247,42 @@ static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set once free page hints have cleared bits of the migration bitmap,
+ * so that the bulk stage stops assuming that every page is dirty.
+ */
+static bool ram_free_page_hinted;
+
+static NotifierList precopy_notifier_list =
+    NOTIFIER_LIST_INITIALIZER(precopy_notifier_list);
+
+void precopy_add_notifier(Notifier *n)
+{
+    notifier_list_add(&precopy_notifier_list, n);
+}
+
+void precopy_remove_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
+static void precopy_notify(PrecopyNotifyReason reason)
+{
+    notifier_list_notify(&precopy_notifier_list, &reason);
+}
+
+/* Ranges of ram_addr_t space that the guest reported free, queued by
+ * qemu_guest_free_page_hint() and dropped from the migration bitmap by
+ * the migration thread.
+ */
+typedef struct FreePageHint {
+    ram_addr_t start;
+    ram_addr_t length;
+} FreePageHint;
+
+static struct {
+    QemuMutex lock;
+    GArray *queue;
+} free_page_hints;
 
 /* used by the search for pages to send */
 struct PageSearchStatus {
@@ -230,6 +292,10 @@ struct PageSearchStatus {
     ram_addr_t   offset;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Set if the last page went to a multifd channel */
+    bool         multifd;
+    /* Set if the page was requested by the destination during postcopy */
+    bool         urgent;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -243,8 +309,47 @@ static struct BitmapRcu {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* One bit per BITMAP_SUMMARY_PAGES pages of bmap; a clear bit means
+     * that all those pages are clean.  Set bits may be stale, and are
+     * cleared when the search finds the chunk clean.
+     */
+    unsigned long *summary;
+    /* One bit per chunk of the summary whose dirty log has not been
+     * cleared since the last sync.  Only allocated when the accelerator
+     * leaves that to us (kvm with manual dirty log protection); the log
+     * is then cleared just before the first page of the chunk is sent.
+     */
+    unsigned long *clearmap;
 } *migration_bitmap_rcu;
 
+#define BITMAP_SUMMARY_SHIFT 12
+#define BITMAP_SUMMARY_PAGES (1UL << BITMAP_SUMMARY_SHIFT)
+
+static unsigned long *migration_bitmap_summary_new(unsigned long pages)
+{
+    unsigned long bits = DIV_ROUND_UP(pages, BITMAP_SUMMARY_PAGES);
+    unsigned long *summary = bitmap_new(bits);
+
+    bitmap_set(summary, 0, bits);
+    return summary;
+}
+
+static unsigned long *migration_bitmap_clearmap_new(unsigned long pages)
+{
+    if (!kvm_enabled() || !kvm_has_manual_dirty_log_protect()) {
+        return NULL;
+    }
+    return bitmap_new(DIV_ROUND_UP(pages, BITMAP_SUMMARY_PAGES));
+}
+
+/* Per compression thread counters, protected by comp_done_lock */
+struct CompressThreadStats {
+    uint64_t pages;
+    uint64_t bytes;
+    int64_t cpu_ns;
+};
+typedef struct CompressThreadStats CompressThreadStats;
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -253,6 +358,8 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    MigrationCompressor *comp;
+    CompressThreadStats *stats;
 };
 typedef struct CompressParam CompressParam;
 
@@ -264,11 +371,20 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    MigrationCompressor *comp;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
+/* Used by the migration thread for the first page of each block */
+static MigrationCompressor *comp_main;
+/* Survive migrate_compress_threads_join() so that query-migrate can
+ * still report them once the migration has completed.
+ */
+static CompressThreadStats *comp_stats;
+static int comp_stats_count;
+static MigrationCompressMethod comp_stats_method;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
  * comp_done_lock is used to co-work with comp_done_cond.
@@ -284,14 +400,28 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(QEMUFile *f, MigrationCompressor *comp,
+                                RAMBlock *block, ram_addr_t offset);
+
+static int64_t compress_thread_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+#endif
+    return 0;
+}
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
     RAMBlock *block;
     ram_addr_t offset;
+    int64_t start;
+    int bytes;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
@@ -301,9 +431,16 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            start = compress_thread_cpu_ns();
+            bytes = do_compress_ram_page(param->file, param->comp,
+                                         block, offset);
 
             qemu_mutex_lock(&comp_done_lock);
+            if (bytes > 0) {
+                param->stats->pages++;
+                param->stats->bytes += bytes;
+            }
+            param->stats->cpu_ns += compress_thread_cpu_ns() - start;
             param->done = true;
             qemu_cond_signal(&comp_done_cond);
             qemu_mutex_unlock(&comp_done_lock);
@@ -343,6 +480,7 @@ void migrate_compress_threads_join(void)
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        migration_compressor_free(comp_param[i].comp);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -352,19 +490,30 @@ void migrate_compress_threads_join(void)
     g_free(comp_param);
     compress_threads = NULL;
     comp_param = NULL;
+    migration_compressor_free(comp_main);
+    comp_main = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    MigrationCompressMethod method;
+    int i, thread_count, level;
 
     if (!migrate_use_compression()) {
         return;
     }
     compression_switch = true;
+    method = migrate_compress_method();
+    level = migrate_compress_level();
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
+    g_free(comp_stats);
+    comp_stats = g_new0(CompressThreadStats, thread_count);
+    comp_stats_count = thread_count;
+    comp_stats_method = method;
+    /* The method was checked by migrate-set-parameters */
+    comp_main = migration_compressor_new(method, level, &error_abort);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
     for (i = 0; i < thread_count; i++) {
@@ -372,6 +521,9 @@ void migrate_compress_threads_create(void)
          * set its ops to empty.
          */
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].comp = migration_compressor_new(method, level,
+                                                      &error_abort);
+        comp_param[i].stats = &comp_stats[i];
         comp_param[i].done = true;
         comp_param[i].quit = false;
         qemu_mutex_init(&comp_param[i].mutex);
@@ -416,12 +568,56 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
  */
+/*
+ * Throttle only the vCPUs that dirtied at least an even share of the
+ * pages since the last call.  Returns false if no vCPU accounted for any
+ * dirty page, i.e. the accelerator cannot tell which vCPU wrote a page.
+ */
+static bool mig_throttle_vcpus_down(uint64_t pct_initial,
+                                    uint64_t pct_increment)
+{
+    CPUState *cpu;
+    unsigned long *dirty, total = 0;
+    int ncpus = 0, i = 0;
+
+    CPU_FOREACH(cpu) {
+        ncpus++;
+    }
+    dirty = g_new(unsigned long, ncpus);
+    CPU_FOREACH(cpu) {
+        dirty[i] = atomic_xchg(&cpu->dirty_pages, 0);
+        total += dirty[i++];
+    }
+
+    if (total) {
+        i = 0;
+        CPU_FOREACH(cpu) {
+            int pct = cpu_throttle_vcpu_get_percentage(cpu);
+
+            if (dirty[i] * ncpus >= total) {
+                trace_migration_throttle_vcpu(cpu->cpu_index, dirty[i]);
+                cpu_throttle_vcpu_set(cpu, pct ? pct + pct_increment
+                                               : pct_initial);
+            }
+            i++;
+        }
+    }
+
+    g_free(dirty);
+    return total != 0;
+}
+
 static void mig_throttle_guest_down(void)
 {
     MigrationState *s = migrate_get_current();
     uint64_t pct_initial = s->parameters.cpu_throttle_initial;
     uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
 
+    if (migrate_use_vcpu_throttle() &&
+        mig_throttle_vcpus_down(pct_initial, pct_icrement)) {
+        return;
+    }
+
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
         cpu_throttle_set(pct_initial);
@@ -489,6 +685,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         return -1;
     }
 
+    acct_info.xbzrle_cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -538,6 +735,37 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
  *
  * Returns: byte offset within memory region of the start of a dirty page
  */
+static unsigned long migration_bitmap_find_next(struct BitmapRcu *bitmap,
+                                                unsigned long size,
+                                                unsigned long nr)
+{
+    while (nr < size) {
+        unsigned long chunk = nr >> BITMAP_SUMMARY_SHIFT;
+        unsigned long chunk_start, chunk_end, next;
+
+        chunk = find_next_bit(bitmap->summary,
+                              DIV_ROUND_UP(size, BITMAP_SUMMARY_PAGES), chunk);
+        chunk_start = chunk << BITMAP_SUMMARY_SHIFT;
+        if (chunk_start >= size) {
+            break;
+        }
+        nr = MAX(nr, chunk_start);
+        chunk_end = MIN(size, chunk_start + BITMAP_SUMMARY_PAGES);
+
+        next = find_next_bit(bitmap->bmap, chunk_end, nr);
+        if (next < chunk_end) {
+            return next;
+        }
+        /* Only forget about the chunk if all of it was looked at */
+        if (nr == chunk_start &&
+            chunk_end == chunk_start + BITMAP_SUMMARY_PAGES) {
+            clear_bit(chunk, bitmap->summary);
+        }
+        nr = chunk_end;
+    }
+    return size;
+}
+
 static inline
 ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
                                        ram_addr_t start,
@@ -547,15 +775,15 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
     uint64_t rb_size = rb->used_length;
     unsigned long size = base + (rb_size >> TARGET_PAGE_BITS);
-    unsigned long *bitmap;
+    struct BitmapRcu *bitmap;
 
     unsigned long next;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    if (ram_bulk_stage && nr > base) {
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    if (ram_bulk_stage && !ram_free_page_hinted && nr > base) {
         next = nr + 1;
     } else {
-        next = find_next_bit(bitmap, size, nr);
+        next = migration_bitmap_find_next(bitmap, size, nr);
     }
 
     *ram_addr_abs = next << TARGET_PAGE_BITS;
@@ -566,8 +794,21 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 {
     bool ret;
     int nr = addr >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-
+    struct BitmapRcu *rcu_bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    unsigned long *bitmap = rcu_bitmap->bmap;
+    unsigned long chunk = nr >> BITMAP_SUMMARY_SHIFT;
+
+    if (rcu_bitmap->clearmap &&
+        test_and_clear_bit(chunk, rcu_bitmap->clearmap)) {
+        /* Let the guest fault again on the chunk's pages before what
+         * they contain now is sent.
+         */
+        cpu_physical_memory_clear_dirty_log((ram_addr_t)chunk <<
+                                            (BITMAP_SUMMARY_SHIFT +
+                                             TARGET_PAGE_BITS),
+                                            BITMAP_SUMMARY_PAGES <<
+                                            TARGET_PAGE_BITS);
+    }
     ret = test_and_clear_bit(nr, bitmap);
 
     if (ret) {
@@ -576,12 +817,201 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/* The dirty log is synced in windows of ram_addr_t space that cover
+ * a whole word of the summary bitmap, and hence whole words of the
+ * migration bitmap and of the dirty log.  Different windows can then
+ * be synced in parallel.
+ */
+#define BITMAP_SYNC_WINDOW \
+    ((ram_addr_t)BITS_PER_LONG << (BITMAP_SUMMARY_SHIFT + TARGET_PAGE_BITS))
+
+/* Never use more threads than this, including the migration thread */
+#define BITMAP_SYNC_MAX_THREADS 8
+
+static uint64_t migration_bitmap_sync_window(struct BitmapRcu *bitmap,
+                                             ram_addr_t start)
 {
-    unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    ram_addr_t chunk_size = BITMAP_SUMMARY_PAGES << TARGET_PAGE_BITS;
+    ram_addr_t end = start + BITMAP_SYNC_WINDOW;
+    uint64_t num_dirty = 0;
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t addr = MAX(start, block->offset);
+        ram_addr_t block_end = MIN(end, block->offset + block->used_length);
+
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
+
+        while (addr < block_end) {
+            ram_addr_t chunk_end = MIN(block_end,
+                                       QEMU_ALIGN_DOWN(addr, chunk_size) +
+                                       chunk_size);
+            uint64_t n = cpu_physical_memory_sync_dirty_bitmap(bitmap->bmap,
+                                                               addr,
+                                                               chunk_end -
+                                                               addr);
+            if (n) {
+                set_bit(addr >> (TARGET_PAGE_BITS + BITMAP_SUMMARY_SHIFT),
+                        bitmap->summary);
+                num_dirty += n;
+            }
+            addr = chunk_end;
+        }
+    }
+    return num_dirty;
+}
+
+/* Pool of threads that help the migration thread in
+ * migration_bitmap_sync; they claim windows until all are synced.
+ */
+static struct {
+    QemuThread *threads;
+    int nthreads;
+    QemuMutex mutex;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    /* Protected by mutex */
+    unsigned int generation;
+    int active;
+    bool quit;
+    uint64_t num_dirty;
+    /* Constant during a pass */
+    struct BitmapRcu *bitmap;
+    int nwindows;
+    /* Next window to sync, claimed with atomic_fetch_inc */
+    int next_window;
+} bitmap_sync;
+
+static uint64_t migration_bitmap_sync_windows(void)
+{
+    uint64_t num_dirty = 0;
+    int i;
+
+    rcu_read_lock();
+    while ((i = atomic_fetch_inc(&bitmap_sync.next_window)) <
+           bitmap_sync.nwindows) {
+        num_dirty += migration_bitmap_sync_window(bitmap_sync.bitmap,
+                                                  i * BITMAP_SYNC_WINDOW);
+    }
+    rcu_read_unlock();
+    return num_dirty;
+}
+
+static void *migration_bitmap_sync_thread(void *opaque)
+{
+    unsigned int seen = 0;
+    uint64_t num_dirty;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&bitmap_sync.mutex);
+    while (true) {
+        while (!bitmap_sync.quit && bitmap_sync.generation == seen) {
+            qemu_cond_wait(&bitmap_sync.work_cond, &bitmap_sync.mutex);
+        }
+        if (bitmap_sync.quit) {
+            break;
+        }
+        seen = bitmap_sync.generation;
+        qemu_mutex_unlock(&bitmap_sync.mutex);
+
+        num_dirty = migration_bitmap_sync_windows();
+
+        qemu_mutex_lock(&bitmap_sync.mutex);
+        bitmap_sync.num_dirty += num_dirty;
+        if (--bitmap_sync.active == 0) {
+            qemu_cond_signal(&bitmap_sync.done_cond);
+        }
+    }
+    qemu_mutex_unlock(&bitmap_sync.mutex);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void migration_bitmap_sync_threads_create(void)
+{
+    int nwindows = DIV_ROUND_UP(last_ram_offset(), BITMAP_SYNC_WINDOW);
+    int n = MIN(nwindows, BITMAP_SYNC_MAX_THREADS);
+    int i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = MIN(n, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+    /* The migration thread is one of them */
+    n--;
+    if (n <= 0) {
+        return;
+    }
+
+    qemu_mutex_init(&bitmap_sync.mutex);
+    qemu_cond_init(&bitmap_sync.work_cond);
+    qemu_cond_init(&bitmap_sync.done_cond);
+    bitmap_sync.quit = false;
+    bitmap_sync.generation = 0;
+    bitmap_sync.nthreads = n;
+    bitmap_sync.threads = g_new0(QemuThread, n);
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&bitmap_sync.threads[i], "bitmapsync",
+                           migration_bitmap_sync_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migration_bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!bitmap_sync.nthreads) {
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync.mutex);
+    bitmap_sync.quit = true;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.mutex);
+    for (i = 0; i < bitmap_sync.nthreads; i++) {
+        qemu_thread_join(&bitmap_sync.threads[i]);
+    }
+    qemu_mutex_destroy(&bitmap_sync.mutex);
+    qemu_cond_destroy(&bitmap_sync.work_cond);
+    qemu_cond_destroy(&bitmap_sync.done_cond);
+    g_free(bitmap_sync.threads);
+    bitmap_sync.threads = NULL;
+    bitmap_sync.nthreads = 0;
+}
+
+/* Called with migration_bitmap_mutex and the RCU read lock held */
+static void migration_bitmap_sync_all(void)
+{
+    uint64_t num_dirty;
+
+    bitmap_sync.bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    bitmap_sync.nwindows = DIV_ROUND_UP(last_ram_offset(), BITMAP_SYNC_WINDOW);
+    atomic_set(&bitmap_sync.next_window, 0);
+    if (!bitmap_sync.nthreads) {
+        migration_dirty_pages += migration_bitmap_sync_windows();
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync.mutex);
+    bitmap_sync.num_dirty = 0;
+    bitmap_sync.active = bitmap_sync.nthreads;
+    bitmap_sync.generation++;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.mutex);
+
+    num_dirty = migration_bitmap_sync_windows();
+
+    qemu_mutex_lock(&bitmap_sync.mutex);
+    while (bitmap_sync.active) {
+        qemu_cond_wait(&bitmap_sync.done_cond, &bitmap_sync.mutex);
+    }
+    num_dirty += bitmap_sync.num_dirty;
+    qemu_mutex_unlock(&bitmap_sync.mutex);
+
+    migration_dirty_pages += num_dirty;
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -600,11 +1030,177 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-static void migration_bitmap_sync(void)
+/* Per-iteration statistics of the last outgoing migration, written by
+ * migration_bitmap_sync and read by query-migrate-iterations, both under
+ * the BQL.  Only the last MIGRATION_HISTORY_SIZE iterations are kept.
+ */
+#define MIGRATION_HISTORY_SIZE 1024
+
+static struct {
+    MigrationIteration entries[MIGRATION_HISTORY_SIZE];
+    uint64_t count;
+    int64_t start_time;
+    int64_t prev_time;
+    uint64_t prev_bytes;
+    uint64_t prev_pages;
+} iteration_history;
+
+static uint64_t ram_pages_sent(void)
+{
+    return acct_info.dup_pages + acct_info.norm_pages +
+           acct_info.xbzrle_pages;
+}
+
+static void iteration_history_reset(void)
+{
+    iteration_history.count = 0;
+    iteration_history.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    iteration_history.prev_time = iteration_history.start_time;
+    iteration_history.prev_bytes = ram_bytes_transferred();
+    iteration_history.prev_pages = ram_pages_sent();
+}
+
+static void iteration_history_record(uint64_t dirty_pages, int64_t sync_time)
+{
+    MigrationIteration *it = &iteration_history.entries[
+        iteration_history.count++ % MIGRATION_HISTORY_SIZE];
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t bytes = ram_bytes_transferred();
+    uint64_t pages = ram_pages_sent();
+
+    it->iteration = bitmap_sync_count;
+    it->time = now - iteration_history.start_time;
+    it->duration = now - iteration_history.prev_time;
+    it->pages = pages - iteration_history.prev_pages;
+    it->bytes = bytes - iteration_history.prev_bytes;
+    it->bandwidth = it->duration ? it->bytes * 1000 / it->duration : 0;
+    it->dirty_pages = dirty_pages;
+    it->dirty_rate = it->duration ? dirty_pages * 1000 / it->duration : 0;
+    it->remaining = migration_dirty_pages;
+    it->sync_time = sync_time;
+    it->throttle_percentage = cpu_throttle_get_percentage();
+
+    iteration_history.prev_time = now;
+    iteration_history.prev_bytes = bytes;
+    iteration_history.prev_pages = pages;
+
+    trace_migration_iteration(it->iteration, it->time, it->pages, it->bytes,
+                              it->bandwidth, it->dirty_pages, it->dirty_rate,
+                              it->remaining, it->sync_time,
+                              it->throttle_percentage);
+}
+
+MigrationIterationList *qmp_query_migrate_iterations(Error **errp)
+{
+    MigrationIterationList *head = NULL, **tail = &head;
+    uint64_t i = 0;
+
+    if (iteration_history.count > MIGRATION_HISTORY_SIZE) {
+        i = iteration_history.count - MIGRATION_HISTORY_SIZE;
+    }
+    for (; i < iteration_history.count; i++) {
+        MigrationIterationList *entry = g_new0(MigrationIterationList, 1);
+
+        entry->value = g_memdup(&iteration_history.entries[
+                                    i % MIGRATION_HISTORY_SIZE],
+                                sizeof(MigrationIteration));
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+/*
+ * qemu_guest_free_page_hint: queue a range of guest memory that the guest
+ * reported free, so that it is not sent by the current migration round
+ *
+ * Called with the iothread lock held, by devices that only forward hints
+ * between the PRECOPY_NOTIFY_AFTER_BITMAP_SYNC and the next
+ * PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC notification.  Pages dirtied after
+ * the hint are caught by the next bitmap sync.
+ *
+ * @addr: host address of the range
+ * @len: length of the range in bytes
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
 {
+    uint8_t *host = addr;
     RAMBlock *block;
+    ram_addr_t offset;
+    size_t used_len;
+
+    for (; len > 0; len -= used_len, host += used_len) {
+        FreePageHint hint;
+
+        block = qemu_ram_block_from_host(host, false, &offset);
+        if (unlikely(!block || offset >= block->used_length)) {
+            /* The guest should only hint pages of guest RAM */
+            error_report("%s: unexpected address %p", __func__, host);
+            return;
+        }
+
+        used_len = MIN(len, block->used_length - offset);
+        hint.start = block->offset + offset;
+        hint.length = used_len;
+        trace_ram_free_page_hint(hint.start, hint.length);
+
+        qemu_mutex_lock(&free_page_hints.lock);
+        g_array_append_val(free_page_hints.queue, hint);
+        qemu_mutex_unlock(&free_page_hints.lock);
+    }
+}
+
+/* Drop the queued free page hints from the migration bitmap */
+static void ram_apply_free_page_hints(void)
+{
+    struct BitmapRcu *bitmap;
+    unsigned long last = last_ram_offset() >> TARGET_PAGE_BITS;
+    GArray *queue;
+    uint64_t cleared = 0;
+    guint i;
+
+    qemu_mutex_lock(&free_page_hints.lock);
+    queue = free_page_hints.queue;
+    if (!queue->len) {
+        qemu_mutex_unlock(&free_page_hints.lock);
+        return;
+    }
+    free_page_hints.queue = g_array_new(false, false, sizeof(FreePageHint));
+    qemu_mutex_unlock(&free_page_hints.lock);
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    rcu_read_lock();
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    for (i = 0; bitmap && i < queue->len; i++) {
+        FreePageHint *hint = &g_array_index(queue, FreePageHint, i);
+        /* Only pages that are entirely free can be skipped */
+        unsigned long nr = DIV_ROUND_UP(hint->start, TARGET_PAGE_SIZE);
+        unsigned long end = MIN((hint->start + hint->length) >>
+                                TARGET_PAGE_BITS, last);
+
+        for (; nr < end; nr++) {
+            if (test_and_clear_bit(nr, bitmap->bmap)) {
+                cleared++;
+            }
+        }
+    }
+    rcu_read_unlock();
+    migration_dirty_pages -= cleared;
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+
+    if (cleared) {
+        ram_free_page_hinted = true;
+    }
+    trace_ram_apply_free_page_hints(queue->len, cleared);
+    g_array_free(queue, true);
+}
+
+static void migration_bitmap_sync(void)
+{
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
+    int64_t sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t end_time;
     int64_t bytes_xfer_now;
 
@@ -619,18 +1215,33 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    /* No hint may be applied after the sync: the page could have been
+     * reused and dirtied since it was hinted.
+     */
+    precopy_notify(PRECOPY_NOTIFY_BEFORE_BITMAP_SYNC);
+    ram_apply_free_page_hints();
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+    if (migration_bitmap_rcu->bmap) {
+        migration_bitmap_sync_all();
+    }
+    /* Every chunk can have pages that the sync left write enabled */
+    if (migration_bitmap_rcu->clearmap) {
+        bitmap_set(migration_bitmap_rcu->clearmap, 0,
+                   DIV_ROUND_UP(last_ram_offset() >> TARGET_PAGE_BITS,
+                                BITMAP_SUMMARY_PAGES));
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
+    precopy_notify(PRECOPY_NOTIFY_AFTER_BITMAP_SYNC);
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    iteration_history_record(migration_dirty_pages - num_dirty_pages_init,
+                             qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                             sync_start);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -705,6 +1316,62 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/**
+ * save_zero_run: Send a zero page, and the dirty zero pages that follow
+ *                it in the same block, as a single record
+ *
+ * The pages after the first one are taken out of the dirty bitmap as
+ * they are found, so the bitmap walk will not pick them again, and
+ * pss->offset is left on the last page of the run.
+ *
+ * Returns: Number of pages written, or -1 if the first page is not zero.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page being sent
+ * @offset: offset inside the block for the page, with flags
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int save_zero_run(QEMUFile *f, PageSearchStatus *pss,
+                         ram_addr_t offset, uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    unsigned long *unsentmap =
+        atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    ram_addr_t next = pss->offset + TARGET_PAGE_SIZE;
+    uint32_t pages = 1;
+
+    if (!is_zero_range(block->host + pss->offset, TARGET_PAGE_SIZE)) {
+        return -1;
+    }
+
+    while (pages < ZERO_RUN_MAX_PAGES && next < block->used_length) {
+        ram_addr_t abs = block->offset + next;
+
+        if (!test_bit(abs >> TARGET_PAGE_BITS, bitmap) ||
+            !is_zero_range(block->host + next, TARGET_PAGE_SIZE)) {
+            break;
+        }
+        migration_bitmap_clear_dirty(abs);
+        if (unsentmap) {
+            clear_bit(abs >> TARGET_PAGE_BITS, unsentmap);
+        }
+        xbzrle_cache_zero_page(abs);
+        pages++;
+        next += TARGET_PAGE_SIZE;
+    }
+
+    acct_info.dup_pages += pages;
+    *bytes_transferred += save_page_header(f, block,
+                                           offset | RAM_SAVE_FLAG_ZERO_RUN);
+    qemu_put_be32(f, pages);
+    *bytes_transferred += 4;
+    trace_ram_save_zero_run(block->idstr, pss->offset, pages);
+
+    pss->offset = next - TARGET_PAGE_SIZE;
+    return pages;
+}
+
 static void ram_release_pages(MigrationState *ms, const char *block_name,
                               uint64_t offset, int pages)
 {
@@ -715,1628 +1382,3952 @@ static void ram_release_pages(MigrationState *ms, const char *block_name,
     ram_discard_range(NULL, block_name, offset, pages << TARGET_PAGE_BITS);
 }
 
-/**
- * ram_save_page: Send the given page to the stream
+/* Multiple channel (x-multifd) support.
  *
- * Returns: Number of pages written.
- *          < 0 - error
- *          >=0 - Number of pages written - this might legally be 0
- *                if xbzrle noticed the page was the same.
+ * Normal pages are batched per RAMBlock and handed to a pool of threads,
+ * each owning one extra socket to the destination.  Every packet carries
+ * its block name and page offsets, so the destination threads can read
+ * the page contents straight into guest memory.  Zero and XBZRLE pages,
+ * and everything else, still go on the main stream.
  *
- * @ms: The current migration state.
- * @f: QEMUFile where to send the data
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
+ * At the end of each round the migration thread waits for all channels
+ * to go idle and puts RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream;
+ * the destination does not go past that flag until every channel has
+ * received the pages that were sent before it.  A page queued in one
+ * round can thus never overwrite a newer copy sent in the next.
+ *
+ * With x-zero-copy-send the kernel reads the pages from guest memory
+ * after qio_channel_writev_zero_copy returns, so each channel flushes
+ * before it acknowledges a sync.  That is what keeps the RAMBlocks
+ * alive, since the sync happens inside the RCU critical section that
+ * queued the pages.  Pages the guest rewrites in the meantime are
+ * dirty again and will be sent in a later round anyway.
  */
-static int ram_save_page(MigrationState *ms, QEMUFile *f, PageSearchStatus *pss,
-                         bool last_stage, uint64_t *bytes_transferred)
-{
-    int pages = -1;
-    uint64_t bytes_xmit;
-    ram_addr_t current_addr;
-    uint8_t *p;
-    int ret;
-    bool send_async = true;
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = pss->offset;
 
-    p = block->host + offset;
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
 
-    /* In doubt sent page as normal */
-    bytes_xmit = 0;
-    ret = ram_control_save_page(f, block->offset,
-                           offset, TARGET_PAGE_SIZE, &bytes_xmit);
-    if (bytes_xmit) {
-        *bytes_transferred += bytes_xmit;
-        pages = 1;
-    }
+#define MULTIFD_FLAG_SYNC (1 << 0)
 
-    XBZRLE_cache_lock();
+/* Maximum number of pages in one packet, all from the same RAMBlock */
+#define MULTIFD_PAGES_PER_PACKET 128
 
-    current_addr = block->offset + offset;
+/* Sent once by each channel when it connects */
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+} MultiFDInit;
 
-    if (block == last_sent_block) {
-        offset |= RAM_SAVE_FLAG_CONTINUE;
+/* All fields are big endian; followed by the contents of the pages */
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages;
+    uint32_t unused;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPacket;
+
+typedef struct {
+    RAMBlock *block;
+    unsigned int used;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    struct MultiFDSendState *state;
+    int id;
+    bool running;
+    bool zero_copy;
+    QemuThread thread;
+    QIOChannel *c;
+    /* Posted for every new job, and on quit */
+    QemuSemaphore sem;
+    QemuMutex mutex;
+    /* The fields below are protected by mutex */
+    bool quit;
+    /* pages belongs to the thread while this is set */
+    bool pending_pages;
+    bool pending_sync;
+    MultiFDPages *pages;
+    /* Only used by the thread */
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+} MultiFDSendParams;
+
+typedef struct MultiFDSendState {
+    MultiFDSendParams *params;
+    int count;
+    /* Pages being collected by the migration thread */
+    MultiFDPages *pages;
+    /* Number of channels that are not busy with pages */
+    QemuSemaphore channels_ready;
+    /* Posted by each channel once it has handled a sync request */
+    QemuSemaphore sem_sync;
+    int next_channel;
+    bool failed;
+} MultiFDSendState;
+
+/* Only changed by the migration thread, and freed with the BQL held */
+static MultiFDSendState *multifd_send_state;
+
+/* Transfer all of IOV, retrying after short reads and writes.
+ * End of file is an error.
+ */
+static int multifd_rw_all(QIOChannel *ioc, struct iovec *iov,
+                          unsigned int niov, bool is_write, bool zero_copy,
+                          Error **errp)
+{
+    while (niov > 0) {
+        ssize_t len;
+
+        if (is_write && zero_copy) {
+            len = qio_channel_writev_zero_copy(ioc, iov, niov, errp);
+        } else if (is_write) {
+            len = qio_channel_writev(ioc, iov, niov, errp);
+        } else {
+            len = qio_channel_readv(ioc, iov, niov, errp);
+        }
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(ioc, is_write ? G_IO_OUT : G_IO_IN);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            error_setg(errp, "multifd channel closed unexpectedly");
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
     }
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_xmit > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_xmit == 0) {
-                acct_info.dup_pages++;
+    return 0;
+}
+
+static int multifd_send_packet(MultiFDSendParams *p, MultiFDPages *pages,
+                               bool sync, Error **errp)
+{
+    MultiFDPacket *packet = &p->packet;
+    unsigned int i, used = pages ? pages->used : 0;
+
+    memset(packet, 0, sizeof(*packet));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->flags = cpu_to_be32(sync ? MULTIFD_FLAG_SYNC : 0);
+    packet->pages = cpu_to_be32(used);
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = sizeof(*packet);
+    if (used) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+    for (i = 0; i < used; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+        p->iov[i + 1].iov_base = pages->block->host + pages->offset[i];
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+    }
+    if (!p->zero_copy) {
+        return multifd_rw_all(p->c, p->iov, used + 1, true, false, errp);
+    }
+
+    /* The header is rewritten for the next packet, so it is copied */
+    if (multifd_rw_all(p->c, p->iov, 1, true, false, errp) < 0) {
+        return -1;
+    }
+    return multifd_rw_all(p->c, p->iov + 1, used, true, true, errp);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDSendState *state = p->state;
+    Error *local_err = NULL;
+    MultiFDInit init = {
+        .magic = cpu_to_be32(MULTIFD_MAGIC),
+        .version = cpu_to_be32(MULTIFD_VERSION),
+        .id = cpu_to_be32(p->id),
+    };
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    bool failed;
+
+    failed = multifd_rw_all(p->c, &iov, 1, true, false, &local_err) < 0;
+
+    while (true) {
+        bool pages, sync, quit;
+
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        pages = p->pending_pages;
+        sync = p->pending_sync;
+        quit = p->quit;
+        p->pending_sync = false;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (!pages && !sync) {
+            if (quit) {
+                break;
             }
+            continue;
         }
-    } else {
-        pages = save_zero_page(f, block, offset, p, bytes_transferred);
-        if (pages > 0) {
-            /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-             * page would be stale
-             */
-            xbzrle_cache_zero_page(current_addr);
-            ram_release_pages(ms, block->idstr, pss->offset, pages);
-        } else if (!ram_bulk_stage &&
-                   !migration_in_postcopy(ms) && migrate_use_xbzrle()) {
-            pages = save_xbzrle_page(f, &p, current_addr, block,
-                                     offset, last_stage, bytes_transferred);
-            if (!last_stage) {
-                /* Can't send this cached data async, since the cache page
-                 * might get updated before it gets to the wire
-                 */
-                send_async = false;
-            }
+
+        /* After an error keep completing jobs, so that the migration
+         * thread never waits for us, and let it see state->failed.
+         */
+        if (!failed &&
+            multifd_send_packet(p, pages ? p->pages : NULL, sync,
+                                &local_err) < 0) {
+            failed = true;
+        }
+        if (!failed && sync && qio_channel_flush(p->c, &local_err) < 0) {
+            failed = true;
+        }
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+        if (failed) {
+            atomic_set(&state->failed, true);
         }
-    }
 
-    /* XBZRLE overflow or normal page */
-    if (pages == -1) {
-        *bytes_transferred += save_page_header(f, block,
-                                               offset | RAM_SAVE_FLAG_PAGE);
-        if (send_async) {
-            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE,
-                                  migrate_release_ram() &
-                                  migration_in_postcopy(ms));
-        } else {
-            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        if (pages) {
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pending_pages = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&state->channels_ready);
+        }
+        if (sync) {
+            qemu_sem_post(&state->sem_sync);
         }
-        *bytes_transferred += TARGET_PAGE_SIZE;
-        pages = 1;
-        acct_info.norm_pages++;
     }
 
-    XBZRLE_cache_unlock();
+    return NULL;
+}
 
-    return pages;
+static void multifd_send_state_free(MultiFDSendState *state)
+{
+    int i;
+
+    for (i = 0; i < state->count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        if (p->running) {
+            qemu_mutex_lock(&p->mutex);
+            p->quit = true;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&p->sem);
+        }
+    }
+    for (i = 0; i < state->count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            qio_channel_close(p->c, NULL);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&state->channels_ready);
+    qemu_sem_destroy(&state->sem_sync);
+    g_free(state->pages);
+    g_free(state->params);
+    g_free(state);
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+/* Called from the migration thread when RAM migration starts */
+static int multifd_save_setup(Error **errp)
 {
-    int bytes_sent, blen;
-    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    MultiFDSendState *state;
+    int i;
 
-    bytes_sent = save_page_header(f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    if (blen < 0) {
-        bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
-        error_report("compressed data failed!");
-    } else {
-        bytes_sent += blen;
-        ram_release_pages(migrate_get_current(), block->idstr,
-                          offset & TARGET_PAGE_MASK, 1);
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds &&
+        *migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "multifd is not compatible with TLS");
+        return -1;
     }
 
-    return bytes_sent;
+    state = g_new0(MultiFDSendState, 1);
+    state->count = migrate_multifd_channels();
+    state->params = g_new0(MultiFDSendParams, state->count);
+    state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&state->channels_ready, state->count);
+    qemu_sem_init(&state->sem_sync, 0);
+    for (i = 0; i < state->count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        p->state = state;
+        p->id = i;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->pages = g_new0(MultiFDPages, 1);
+    }
+    for (i = 0; i < state->count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        p->c = socket_send_channel_create(errp);
+        if (!p->c) {
+            multifd_send_state_free(state);
+            return -1;
+        }
+        qio_channel_set_blocking(p->c, true, NULL);
+        if (migrate_use_zero_copy_send()) {
+            if (!qio_channel_has_feature(p->c,
+                                         QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+                error_setg(errp, "zero copy send is not supported on the "
+                           "multifd channels");
+                multifd_send_state_free(state);
+                return -1;
+            }
+            p->zero_copy = true;
+        }
+        p->running = true;
+        qemu_thread_create(&p->thread, "multifdsend", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    atomic_mb_set(&multifd_send_state, state);
+    return 0;
 }
 
-static uint64_t bytes_transferred;
+/* Called with the BQL held */
+static void multifd_save_cleanup(void)
+{
+    MultiFDSendState *state = multifd_send_state;
 
-static void flush_compressed_data(QEMUFile *f)
+    if (!state) {
+        return;
+    }
+    atomic_mb_set(&multifd_send_state, NULL);
+    multifd_send_state_free(state);
+}
+
+/* Unblock channels stuck on a dead connection; called with the BQL held */
+void multifd_save_shutdown(void)
 {
-    int idx, len, thread_count;
+    MultiFDSendState *state = atomic_mb_read(&multifd_send_state);
+    int i;
 
-    if (!migrate_use_compression()) {
+    if (!state) {
         return;
     }
-    thread_count = migrate_compress_threads();
+    for (i = 0; i < state->count; i++) {
+        QIOChannel *c = atomic_read(&state->params[i].c);
 
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        if (c) {
+            qio_channel_shutdown(c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
     }
-    qemu_mutex_unlock(&comp_done_lock);
+}
 
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+/* Hand the collected pages to the next idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDSendState *state = multifd_send_state;
+    MultiFDPages *pages = state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    qemu_sem_wait(&state->channels_ready);
+    for (i = state->next_channel;; i = (i + 1) % state->count) {
+        p = &state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_pages) {
+            break;
         }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        qemu_mutex_unlock(&p->mutex);
     }
+    state->next_channel = (i + 1) % state->count;
+    state->pages = p->pages;
+    p->pages = pages;
+    p->pending_pages = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return atomic_read(&state->failed) ? -EIO : 0;
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
 {
-    param->block = block;
-    param->offset = offset;
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->used && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -EIO;
+        }
+        pages = multifd_send_state->pages;
+    }
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+    return 0;
 }
 
-static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
-                                           ram_addr_t offset,
-                                           uint64_t *bytes_transferred)
+/* Must be called before leaving the RCU critical section in which the
+ * pages were queued, since the channels still access the RAMBlocks.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    MultiFDSendState *state = multifd_send_state;
+    int i, ret = 0;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
+    if (!state) {
+        return 0;
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    if (state->pages->used) {
+        ret = multifd_send_pages();
+    }
+    for (i = 0; i < state->count; i++) {
+        MultiFDSendParams *p = &state->params[i];
 
-    return pages;
+        qemu_mutex_lock(&p->mutex);
+        p->pending_sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    /* A channel replies after its pending pages are on the wire */
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_wait(&state->sem_sync);
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+
+    return atomic_read(&state->failed) ? -EIO : ret;
+}
+
+/* Postcopy preemption channel (x-postcopy-preempt).
+ *
+ * Pages requested by the destination during postcopy are written by
+ * the migration thread on a second socket, so that they do not wait
+ * behind the background push that fills the main stream.  Postcopy
+ * sends each host page at most once, so a page travels on only one of
+ * the two channels and the destination can place it as soon as it
+ * arrives.  POSTCOPY_PREEMPT_FLAG_EOS is sent by ram_save_complete; the
+ * destination drains the channel up to it before unregistering
+ * userfaults.
+ */
+
+#define POSTCOPY_PREEMPT_MAGIC 0x50435054U
+
+#define POSTCOPY_PREEMPT_FLAG_ZERO (1 << 0)
+#define POSTCOPY_PREEMPT_FLAG_EOS  (1 << 1)
+
+/* All fields are big endian; followed by one host page unless zero */
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t offset;
+    uint32_t len;
+    char ramblock[256];
+} PostcopyPreemptPacket;
+
+/* Only changed by the migration thread, and closed with the BQL held */
+static QIOChannel *postcopy_preempt_out;
+
+/* Called from the migration thread when RAM migration starts */
+static int postcopy_preempt_save_setup(Error **errp)
+{
+    QIOChannel *c;
+
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+    if (migrate_get_current()->parameters.tls_creds &&
+        *migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "postcopy preemption is not compatible with TLS");
+        return -1;
+    }
+    c = socket_send_channel_create(errp);
+    if (!c) {
+        return -1;
+    }
+    qio_channel_set_name(c, "migration-postcopy-preempt-outgoing");
+    qio_channel_set_blocking(c, true, NULL);
+    atomic_mb_set(&postcopy_preempt_out, c);
+    return 0;
+}
+
+/* Called with the BQL held */
+static void postcopy_preempt_save_cleanup(void)
+{
+    QIOChannel *c = postcopy_preempt_out;
+
+    if (!c) {
+        return;
+    }
+    atomic_mb_set(&postcopy_preempt_out, NULL);
+    qio_channel_close(c, NULL);
+    object_unref(OBJECT(c));
+}
+
+/* Unblock a send stuck on a dead connection; called with the BQL held */
+void postcopy_preempt_save_shutdown(void)
+{
+    QIOChannel *c = atomic_mb_read(&postcopy_preempt_out);
+
+    if (c) {
+        qio_channel_shutdown(c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+}
+
+static int postcopy_preempt_send(RAMBlock *block, ram_addr_t offset,
+                                 uint32_t flags, Error **errp)
+{
+    PostcopyPreemptPacket packet = { };
+    struct iovec iov[2];
+    unsigned int niov = 1;
+
+    packet.magic = cpu_to_be32(POSTCOPY_PREEMPT_MAGIC);
+    packet.flags = cpu_to_be32(flags);
+    iov[0].iov_base = &packet;
+    iov[0].iov_len = sizeof(packet);
+    if (block) {
+        packet.offset = cpu_to_be64(offset);
+        packet.len = cpu_to_be32(qemu_host_page_size);
+        pstrcpy(packet.ramblock, sizeof(packet.ramblock), block->idstr);
+        if (!(flags & POSTCOPY_PREEMPT_FLAG_ZERO)) {
+            iov[1].iov_base = block->host + offset;
+            iov[1].iov_len = qemu_host_page_size;
+            niov++;
+        }
+    }
+    return multifd_rw_all(postcopy_preempt_out, iov, niov, true, false, errp);
 }
 
 /**
- * ram_save_compressed_page: compress the given page and send it to the stream
+ * ram_save_preempt_host_page: Send the host page containing pss->offset
+ *                             on the postcopy preemption channel
  *
- * Returns: Number of pages written.
+ * Returns: Number of target pages written, 0 if the page had already
+ *          been sent, or < 0 on error.
  *
  * @ms: The current migration state.
- * @f: QEMUFile where to send the data
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
+ * @f: main migration stream, only used to report errors
+ * @pss: data about the requested page; offset is updated to the last
+ *       target page of the host page
  * @bytes_transferred: increase it with the number of transferred bytes
+ * @dirty_ram_abs: Address of the page in ram_addr_t space
  */
-static int ram_save_compressed_page(MigrationState *ms, QEMUFile *f,
-                                    PageSearchStatus *pss, bool last_stage,
-                                    uint64_t *bytes_transferred)
+static int ram_save_preempt_host_page(MigrationState *ms, QEMUFile *f,
+                                      PageSearchStatus *pss,
+                                      uint64_t *bytes_transferred,
+                                      ram_addr_t dirty_ram_abs)
 {
-    int pages = -1;
-    uint64_t bytes_xmit = 0;
-    uint8_t *p;
-    int ret, blen;
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = pss->offset;
+    ram_addr_t misalign = pss->offset & (qemu_host_page_size - 1);
+    ram_addr_t start = pss->offset - misalign;
+    unsigned long *unsentmap;
+    Error *local_err = NULL;
+    int i, pages = 0, npages = qemu_host_page_size / TARGET_PAGE_SIZE;
+    bool zero;
 
-    p = block->host + offset;
+    dirty_ram_abs -= misalign;
+    pss->offset = start + qemu_host_page_size - TARGET_PAGE_SIZE;
+    pss->multifd = false;
 
-    ret = ram_control_save_page(f, block->offset,
-                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
-    if (bytes_xmit) {
-        *bytes_transferred += bytes_xmit;
-        pages = 1;
+    /* Postcopy only ever sends whole host pages */
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    for (i = 0; i < npages; i++) {
+        ram_addr_t abs = dirty_ram_abs + i * TARGET_PAGE_SIZE;
+
+        if (migration_bitmap_clear_dirty(abs)) {
+            pages++;
+        }
+        if (unsentmap) {
+            clear_bit(abs >> TARGET_PAGE_BITS, unsentmap);
+        }
     }
-    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-        if (ret != RAM_SAVE_CONTROL_DELAYED) {
-            if (bytes_xmit > 0) {
-                acct_info.norm_pages++;
-            } else if (bytes_xmit == 0) {
-                acct_info.dup_pages++;
-            }
-        }
+    if (!pages) {
+        return 0;
+    }
+
+    zero = is_zero_range(pss->block->host + start, qemu_host_page_size);
+    trace_ram_save_preempt_host_page(pss->block->idstr, start, zero);
+    if (postcopy_preempt_send(pss->block, start,
+                              zero ? POSTCOPY_PREEMPT_FLAG_ZERO : 0,
+                              &local_err) < 0) {
+        error_report_err(local_err);
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+    if (zero) {
+        acct_info.dup_pages += pages;
+        *bytes_transferred += sizeof(PostcopyPreemptPacket);
     } else {
-        /* When starting the process of a new block, the first page of
-         * the block should be sent out before other pages in the same
-         * block, and all the pages in last block should have been sent
-         * out, keeping this order is important, because the 'cont' flag
-         * is used to avoid resending the block name.
-         */
-        if (block != last_sent_block) {
-            flush_compressed_data(f);
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    *bytes_transferred += bytes_xmit + blen;
-                    acct_info.norm_pages++;
-                    pages = 1;
-                } else {
-                    qemu_file_set_error(f, blen);
-                    error_report("compressed data failed!");
-                }
-            }
-            if (pages > 0) {
-                ram_release_pages(ms, block->idstr, pss->offset, pages);
-            }
-        } else {
-            offset |= RAM_SAVE_FLAG_CONTINUE;
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
-            } else {
-                ram_release_pages(ms, block->idstr, pss->offset, pages);
-            }
-        }
+        acct_info.norm_pages += pages;
+        *bytes_transferred += sizeof(PostcopyPreemptPacket) +
+                              qemu_host_page_size;
     }
+    ram_release_pages(ms, pss->block->idstr, start, pages);
 
     return pages;
 }
 
-/*
- * Find the next dirty page and update any state associated with
- * the search process.
+/* Mapped-ram layout (x-mapped-ram).
  *
- * Returns: True if a page is found
+ * With a file: URI, ram_save_setup reserves two regions of the file
+ * for each RAMBlock, right after the block's header in the stream:
  *
- * @f: Current migration stream.
- * @pss: Data about the state of the current dirty page scan.
- * @*again: Set to false if the search has scanned the whole of RAM
- * *ram_addr_abs: Pointer into which to store the address of the dirty page
- *               within the global ram_addr space
+ *   idstr, used_length, bitmap_offset, pages_offset    (stream)
+ *   bitmap_offset: one bit per target page, bit i in byte i / 8
+ *   pages_offset:  used_length bytes, page i at i * TARGET_PAGE_SIZE
+ *
+ * pages_offset is aligned to MAPPED_RAM_ALIGN so that the pages can be
+ * accessed with O_DIRECT, and the stream goes on after the last page
+ * region.  No page goes through the stream itself: a dirty page is
+ * written to its slot again each time it is sent, so the file never
+ * holds more than one copy of RAM, and ram_save_complete writes the
+ * bitmaps of the slots that hold data.  Zero pages are only cleared in
+ * the bitmap, since the destination's RAM starts out zeroed.
+ *
+ * Runs of contiguous pages are handed to x-multifd-channels threads
+ * that pwrite them straight from guest memory, or pread them straight
+ * into it on load, each with a descriptor of its own.  As with multifd,
+ * the migration thread waits for all of them at the end of each round,
+ * inside the RCU critical section that queued the pages; a page is
+ * queued at most once between two bitmap syncs, so two writes of the
+ * same slot are never in flight together.
  */
-static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
-                             bool *again, ram_addr_t *ram_addr_abs)
+
+#define MAPPED_RAM_ALIGN (1 << 20)
+
+/* Largest run of pages handed to a thread at once */
+#define MAPPED_RAM_JOB_SIZE (1 << 20)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t len;
+} MappedRamJob;
+
+typedef struct {
+    struct MappedRamState *state;
+    bool running;
+    QemuThread thread;
+    int fd;
+    /* Posted for every new job, and on quit */
+    QemuSemaphore sem;
+    QemuMutex mutex;
+    /* The fields below are protected by mutex */
+    bool quit;
+    /* job belongs to the thread while this is set */
+    bool pending;
+    MappedRamJob job;
+} MappedRamParams;
+
+typedef struct MappedRamState {
+    MappedRamParams *params;
+    int count;
+    bool writing;
+    /* Opened without O_DIRECT, for the bitmaps */
+    int fd;
+    /* Run being collected by the migration thread */
+    MappedRamJob job;
+    /* Number of threads that are not busy with a job */
+    QemuSemaphore threads_ready;
+    int next_thread;
+    bool failed;
+} MappedRamState;
+
+/* Outgoing state; only changed by the migration thread, and freed with
+ * the BQL held.  The incoming side keeps its own for the duration of
+ * the RAM_SAVE_FLAG_MEM_SIZE record.
+ */
+static MappedRamState *mapped_ram_state;
+
+static int mapped_ram_rw(int fd, bool writing, uint8_t *buf, size_t len,
+                         off_t pos, Error **errp)
 {
-    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
-                                              ram_addr_abs);
-    if (pss->complete_round && pss->block == last_seen_block &&
-        pss->offset >= last_offset) {
-        /*
-         * We've been once around the RAM and haven't found anything.
-         * Give up.
-         */
-        *again = false;
-        return false;
-    }
-    if (pss->offset >= pss->block->used_length) {
-        /* Didn't find anything in this RAM Block */
-        pss->offset = 0;
-        pss->block = QLIST_NEXT_RCU(pss->block, next);
-        if (!pss->block) {
-            /* Hit the end of the list */
-            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
-            /* Flag that we've looped */
-            pss->complete_round = true;
-            ram_bulk_stage = false;
-            if (migrate_use_xbzrle()) {
-                /* If xbzrle is on, stop using the data compression at this
-                 * point. In theory, xbzrle can do better than compression.
-                 */
-                flush_compressed_data(f);
-                compression_switch = false;
+    while (len) {
+        ssize_t done;
+
+        if (writing) {
+            done = pwrite(fd, buf, len, pos);
+        } else {
+            done = pread(fd, buf, len, pos);
+        }
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            error_setg_errno(errp, errno, "Unable to %s mapped-ram file",
+                             writing ? "write" : "read");
+            return -1;
         }
-        /* Didn't find anything this time, but try again on the new block */
-        *again = true;
-        return false;
-    } else {
-        /* Can go around again, but... */
-        *again = true;
-        /* We've found something so probably don't need to */
-        return true;
+        if (done == 0) {
+            error_setg(errp, "Unexpected end of mapped-ram file");
+            return -1;
+        }
+        buf += done;
+        pos += done;
+        len -= done;
     }
+    return 0;
 }
 
-/*
- * Helper for 'get_queued_page' - gets a page off the queue
- *      ms:      MigrationState in
- * *offset:      Used to return the offset within the RAMBlock
- * ram_addr_abs: global offset in the dirty/sent bitmaps
- *
- * Returns:      block (or NULL if none available)
- */
-static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+static void *mapped_ram_thread(void *opaque)
 {
-    RAMBlock *block = NULL;
+    MappedRamParams *p = opaque;
+    MappedRamState *state = p->state;
+    Error *local_err = NULL;
 
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
-        *ram_addr_abs = (entry->offset + entry->rb->offset) &
-                        TARGET_PAGE_MASK;
+    while (true) {
+        MappedRamJob *job = &p->job;
+        bool pending, quit;
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-            g_free(entry);
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        pending = p->pending;
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (!pending) {
+            if (quit) {
+                break;
+            }
+            continue;
+        }
+
+        /* After an error keep completing jobs, so that the migration
+         * thread never waits for us, and let it see state->failed.
+         */
+        if (!atomic_read(&state->failed) &&
+            mapped_ram_rw(p->fd, state->writing, job->block->host + job->offset,
+                          job->len, job->block->pages_offset + job->offset,
+                          &local_err) < 0) {
+            error_report_err(local_err);
+            local_err = NULL;
+            atomic_set(&state->failed, true);
         }
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending = false;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&state->threads_ready);
     }
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
 
-    return block;
+    return NULL;
 }
 
-/*
- * Unqueue a page from the queue fed by postcopy page requests; skips pages
- * that are already sent (!dirty)
- *
- *      ms:      MigrationState in
- *     pss:      PageSearchStatus structure updated with found block/offset
- * ram_addr_abs: global offset in the dirty/sent bitmaps
- *
- * Returns:      true if a queued page is found
- */
-static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
-                            ram_addr_t *ram_addr_abs)
+static void mapped_ram_free(MappedRamState *state)
 {
-    RAMBlock  *block;
-    ram_addr_t offset;
-    bool dirty;
+    int i;
 
-    do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
-        /*
-         * We're sending this page, and since it's postcopy nothing else
-         * will dirty it, and we must make sure it doesn't get sent again
-         * even if this queue request was received after the background
-         * search already sent it.
-         */
-        if (block) {
-            unsigned long *bitmap;
-            bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-            dirty = test_bit(*ram_addr_abs >> TARGET_PAGE_BITS, bitmap);
-            if (!dirty) {
-                trace_get_queued_page_not_dirty(
-                    block->idstr, (uint64_t)offset,
-                    (uint64_t)*ram_addr_abs,
-                    test_bit(*ram_addr_abs >> TARGET_PAGE_BITS,
-                         atomic_rcu_read(&migration_bitmap_rcu)->unsentmap));
-            } else {
-                trace_get_queued_page(block->idstr,
-                                      (uint64_t)offset,
-                                      (uint64_t)*ram_addr_abs);
-            }
+    for (i = 0; i < state->count; i++) {
+        MappedRamParams *p = &state->params[i];
+
+        if (p->running) {
+            qemu_mutex_lock(&p->mutex);
+            p->quit = true;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&p->sem);
         }
+    }
+    for (i = 0; i < state->count; i++) {
+        MappedRamParams *p = &state->params[i];
 
-    } while (block && !dirty);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->fd >= 0) {
+            close(p->fd);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+    }
+    if (state->fd >= 0) {
+        close(state->fd);
+    }
+    qemu_sem_destroy(&state->threads_ready);
+    g_free(state->params);
+    g_free(state);
+}
 
-    if (block) {
-        /*
-         * As soon as we start servicing pages out of order, then we have
-         * to kill the bulk stage, since the bulk stage assumes
-         * in (migration_bitmap_find_and_reset_dirty) that every page is
-         * dirty, that's no longer true.
-         */
-        ram_bulk_stage = false;
+static MappedRamState *mapped_ram_setup(bool writing, Error **errp)
+{
+    MappedRamState *state;
+    int i;
 
-        /*
-         * We want the background search to continue from the queued page
-         * since the guest is likely to want other pages near to the page
-         * it just requested.
-         */
-        pss->block = block;
-        pss->offset = offset;
+    state = g_new0(MappedRamState, 1);
+    state->count = migrate_multifd_channels();
+    state->writing = writing;
+    state->params = g_new0(MappedRamParams, state->count);
+    qemu_sem_init(&state->threads_ready, state->count);
+    for (i = 0; i < state->count; i++) {
+        MappedRamParams *p = &state->params[i];
+
+        p->state = state;
+        p->fd = -1;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
     }
 
-    return !!block;
+    state->fd = file_mapped_ram_open(writing, false, errp);
+    if (state->fd < 0) {
+        mapped_ram_free(state);
+        return NULL;
+    }
+    for (i = 0; i < state->count; i++) {
+        MappedRamParams *p = &state->params[i];
+
+        p->fd = file_mapped_ram_open(writing, migrate_use_direct_io(), errp);
+        if (p->fd < 0) {
+            mapped_ram_free(state);
+            return NULL;
+        }
+        p->running = true;
+        qemu_thread_create(&p->thread, "mappedram", mapped_ram_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    return state;
 }
 
-/**
- * flush_page_queue: Flush any remaining pages in the ram request queue
- *    it should be empty at the end anyway, but in error cases there may be
- *    some left.
- *
- * ms: MigrationState
- */
-void flush_page_queue(MigrationState *ms)
+/* Hand the collected run to the next idle thread */
+static int mapped_ram_dispatch(MappedRamState *state)
 {
-    struct MigrationSrcPageRequest *mspr, *next_mspr;
-    /* This queue generally should be empty - but in the case of a failed
-     * migration might have some droppings in.
-     */
-    rcu_read_lock();
-    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
-        memory_region_unref(mspr->rb->mr);
-        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
-        g_free(mspr);
+    MappedRamParams *p;
+    int i;
+
+    if (!state->job.len) {
+        return 0;
     }
-    rcu_read_unlock();
+    qemu_sem_wait(&state->threads_ready);
+    for (i = state->next_thread;; i = (i + 1) % state->count) {
+        p = &state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    state->next_thread = (i + 1) % state->count;
+    p->job = state->job;
+    p->pending = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+    state->job.len = 0;
+
+    return atomic_read(&state->failed) ? -EIO : 0;
 }
 
-/**
- * Queue the pages for transmission, e.g. a request from postcopy destination
- *   ms: MigrationStatus in which the queue is held
- *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
- *   start: Offset from the start of the RAMBlock
- *   len: Length (in bytes) to send
- *   Return: 0 on success
- */
-int ram_save_queue_pages(MigrationState *ms, const char *rbname,
-                         ram_addr_t start, ram_addr_t len)
+/* @len must not be larger than MAPPED_RAM_JOB_SIZE */
+static int mapped_ram_queue(MappedRamState *state, RAMBlock *block,
+                            ram_addr_t offset, ram_addr_t len)
 {
-    RAMBlock *ramblock;
+    MappedRamJob *job = &state->job;
 
-    ms->postcopy_requests++;
-    rcu_read_lock();
-    if (!rbname) {
-        /* Reuse last RAMBlock */
-        ramblock = ms->last_req_rb;
-
-        if (!ramblock) {
-            /*
-             * Shouldn't happen, we can't reuse the last RAMBlock if
-             * it's the 1st request.
-             */
-            error_report("ram_save_queue_pages no previous block");
-            goto err;
-        }
-    } else {
-        ramblock = qemu_ram_block_by_name(rbname);
-
-        if (!ramblock) {
-            /* We shouldn't be asked for a non-existent RAMBlock */
-            error_report("ram_save_queue_pages no block '%s'", rbname);
-            goto err;
+    if (job->len && (job->block != block || job->offset + job->len != offset ||
+                     job->len + len > MAPPED_RAM_JOB_SIZE)) {
+        if (mapped_ram_dispatch(state) < 0) {
+            return -EIO;
         }
-        ms->last_req_rb = ramblock;
     }
-    trace_ram_save_queue_pages(ramblock->idstr, start, len);
-    if (start+len > ramblock->used_length) {
-        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
-                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
-                     __func__, start, len, ramblock->used_length);
-        goto err;
+    if (!job->len) {
+        job->block = block;
+        job->offset = offset;
     }
+    job->len += len;
+    return 0;
+}
 
-    struct MigrationSrcPageRequest *new_entry =
-        g_malloc0(sizeof(struct MigrationSrcPageRequest));
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
+/* Wait until every queued page has been transferred */
+static int mapped_ram_sync(MappedRamState *state)
+{
+    int i, ret;
 
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&ms->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
-    qemu_mutex_unlock(&ms->src_page_req_mutex);
-    rcu_read_unlock();
+    ret = mapped_ram_dispatch(state);
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_wait(&state->threads_ready);
+    }
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_post(&state->threads_ready);
+    }
 
-    return 0;
+    return atomic_read(&state->failed) ? -EIO : ret;
+}
 
-err:
-    rcu_read_unlock();
-    return -1;
+/* Reserve the regions of a block after its header, and skip them */
+static void mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+    block->bitmap_offset = qemu_ftell(f) + 2 * sizeof(uint64_t);
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   DIV_ROUND_UP(pages, BITS_PER_BYTE),
+                                   MAPPED_RAM_ALIGN);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_fseek(f, block->pages_offset + block->used_length);
+
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(pages);
+    trace_ram_mapped_block(block->idstr, block->bitmap_offset,
+                           block->pages_offset);
 }
 
 /**
- * ram_save_target_page: Save one target page
+ * ram_save_mapped_page: Store the given page in its slot of the file
  *
+ * Returns: Number of pages written, < 0 on error.
  *
- * @f: QEMUFile where to send the data
- * @block: pointer to block that contains the page we want to send
- * @offset: offset inside the block for the page;
- * @last_stage: if we are at the completion stage
+ * @f: QEMUFile of the stream, for errors and rate limiting
+ * @pss: block and offset of the page
  * @bytes_transferred: increase it with the number of transferred bytes
- * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
- *
- * Returns: Number of pages written.
  */
-static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
-                                PageSearchStatus *pss,
-                                bool last_stage,
-                                uint64_t *bytes_transferred,
-                                ram_addr_t dirty_ram_abs)
+static int ram_save_mapped_page(QEMUFile *f, PageSearchStatus *pss,
+                                uint64_t *bytes_transferred)
 {
-    int res = 0;
+    RAMBlock *block = pss->block;
+    unsigned long page = pss->offset >> TARGET_PAGE_BITS;
 
-    /* Check the pages is dirty and if it is send it */
-    if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
-        unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
-            res = ram_save_compressed_page(ms, f, pss,
-                                           last_stage,
-                                           bytes_transferred);
-        } else {
-            res = ram_save_page(ms, f, pss, last_stage,
-                                bytes_transferred);
-        }
+    if (!block->file_bmap) {
+        error_report("RAM block %s has no room in the mapped-ram file",
+                     block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+    if (is_zero_range(block->host + pss->offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        acct_info.dup_pages++;
+        return 1;
+    }
 
-        if (res < 0) {
-            return res;
+    set_bit(page, block->file_bmap);
+    if (mapped_ram_queue(mapped_ram_state, block, pss->offset,
+                         TARGET_PAGE_SIZE) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
+/* Called by ram_save_complete once every page is in the file */
+static int mapped_ram_save_bitmaps(MappedRamState *state)
+{
+    Error *local_err = NULL;
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = DIV_ROUND_UP(pages, BITS_PER_BYTE);
+        uint8_t *buf;
+        unsigned long i;
+        int ret;
+
+        if (!block->file_bmap) {
+            continue;
         }
-        unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-        if (unsentmap) {
-            clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
+        buf = g_malloc0(size);
+        for (i = find_first_bit(block->file_bmap, pages); i < pages;
+             i = find_next_bit(block->file_bmap, pages, i + 1)) {
+            buf[i / BITS_PER_BYTE] |= 1 << (i % BITS_PER_BYTE);
         }
-        /* Only update last_sent_block if a block was actually sent; xbzrle
-         * might have decided the page was identical so didn't bother writing
-         * to the stream.
-         */
-        if (res > 0) {
-            last_sent_block = pss->block;
+        ret = mapped_ram_rw(state->fd, true, buf, size, block->bitmap_offset,
+                            &local_err);
+        g_free(buf);
+        if (ret < 0) {
+            error_report_err(local_err);
+            return -EIO;
         }
     }
 
-    return res;
+    /* Covers the pages written through the other descriptors too */
+    if (qemu_fdatasync(state->fd) < 0) {
+        error_report("Unable to sync mapped-ram file: %s", strerror(errno));
+        return -EIO;
+    }
+    return 0;
 }
 
-/**
- * ram_save_host_page: Starting at *offset send pages up to the end
- *                     of the current host page.  It's valid for the initial
- *                     offset to point into the middle of a host page
- *                     in which case the remainder of the hostpage is sent.
- *                     Only dirty target pages are sent.
- *
- * Returns: Number of pages written.
- *
- * @f: QEMUFile where to send the data
- * @block: pointer to block that contains the page we want to send
- * @offset: offset inside the block for the page; updated to last target page
- *          sent
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
- * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
- */
-static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
-                              PageSearchStatus *pss,
-                              bool last_stage,
-                              uint64_t *bytes_transferred,
-                              ram_addr_t dirty_ram_abs)
+/* Called with the BQL held */
+static void mapped_ram_save_cleanup(void)
 {
-    int tmppages, pages = 0;
-    do {
-        tmppages = ram_save_target_page(ms, f, pss, last_stage,
-                                        bytes_transferred, dirty_ram_abs);
-        if (tmppages < 0) {
-            return tmppages;
-        }
+    RAMBlock *block;
 
-        pages += tmppages;
-        pss->offset += TARGET_PAGE_SIZE;
-        dirty_ram_abs += TARGET_PAGE_SIZE;
-    } while (pss->offset & (qemu_host_page_size - 1));
+    if (!mapped_ram_state) {
+        return;
+    }
+    mapped_ram_free(mapped_ram_state);
+    mapped_ram_state = NULL;
 
-    /* The offset we leave with is the last one we looked at */
-    pss->offset -= TARGET_PAGE_SIZE;
-    return pages;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
 }
 
-/**
- * ram_find_and_save_block: Finds a dirty page and sends it to f
- *
- * Called within an RCU critical section.
- *
- * Returns:  The number of pages written
- *           0 means no dirty pages
- *
- * @f: QEMUFile where to send the data
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
- *
- * On systems where host-page-size > target-page-size it will send all the
- * pages in a host page that are dirty.
+/* Read the regions of a block from its header, queue its pages and
+ * skip to the next header.
  */
-
-static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
-                                   uint64_t *bytes_transferred)
+static int mapped_ram_load_block(QEMUFile *f, MappedRamState *state,
+                                 RAMBlock *block)
 {
-    PageSearchStatus pss;
-    MigrationState *ms = migrate_get_current();
-    int pages = 0;
-    bool again, found;
-    ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
-                                 ram_addr_t space */
+    unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long chunk = MAPPED_RAM_JOB_SIZE >> TARGET_PAGE_BITS;
+    size_t size = DIV_ROUND_UP(pages, BITS_PER_BYTE);
+    Error *local_err = NULL;
+    unsigned long *bmap;
+    unsigned long run, end, i;
+    uint8_t *buf;
+    int ret;
 
-    /* No dirty page as there is zero RAM */
-    if (!ram_bytes_total()) {
-        return pages;
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    if (block->pages_offset & (MAPPED_RAM_ALIGN - 1)) {
+        error_report("Misaligned pages for RAM block %s in mapped-ram file",
+                     block->idstr);
+        return -EINVAL;
     }
+    trace_ram_mapped_block(block->idstr, block->bitmap_offset,
+                           block->pages_offset);
 
-    pss.block = last_seen_block;
-    pss.offset = last_offset;
-    pss.complete_round = false;
-
-    if (!pss.block) {
-        pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
+    buf = g_malloc(size);
+    ret = mapped_ram_rw(state->fd, false, buf, size, block->bitmap_offset,
+                        &local_err);
+    if (ret < 0) {
+        error_report_err(local_err);
+        g_free(buf);
+        return -EIO;
     }
-
-    do {
-        again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
-
-        if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+    bmap = bitmap_new(pages);
+    for (i = 0; i < pages; i++) {
+        if (buf[i / BITS_PER_BYTE] & (1 << (i % BITS_PER_BYTE))) {
+            set_bit(i, bmap);
         }
+    }
+    g_free(buf);
 
-        if (found) {
-            pages = ram_save_host_page(ms, f, &pss,
-                                       last_stage, bytes_transferred,
-                                       dirty_ram_abs);
-        }
-    } while (!pages && again);
+    if (migrate_lazy_restore()) {
+        /* The pages are read when the guest touches them */
+        g_free(block->file_bmap);
+        block->file_bmap = bmap;
+        return qemu_fseek(f, block->pages_offset + block->used_length);
+    }
 
-    last_seen_block = pss.block;
-    last_offset = pss.offset;
+    for (run = find_first_bit(bmap, pages); !ret && run < pages;
+         run = find_next_bit(bmap, pages, end)) {
+        end = find_next_zero_bit(bmap, pages, run);
+        for (i = run; !ret && i < end; i += chunk) {
+            ret = mapped_ram_queue(state, block, i << TARGET_PAGE_BITS,
+                                   MIN(end - i, chunk) << TARGET_PAGE_BITS);
+        }
+    }
+    g_free(bmap);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return pages;
+    return qemu_fseek(f, block->pages_offset + block->used_length);
 }
 
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+/* Lazy restore (x-lazy-restore).
+ *
+ * Instead of reading a mapped-ram file before the guest starts, keep
+ * the bitmaps read by mapped_ram_load_block and let the postcopy fault
+ * thread fill host pages from the file as the guest touches them, and
+ * the remaining ones in the background.  The bits of a page are
+ * cleared once it is placed, so the background pass only visits pages
+ * that hold data and have not been faulted in yet; pages without data
+ * are zero anyway when userfaults are unregistered at the end.  Only
+ * that thread uses this state, until ram_lazy_restore_cleanup.
+ */
+static struct {
+    int fd;
+    RAMBlock *block;
+    unsigned long page;
+} lazy_restore = { .fd = -1 };
+
+static int ram_lazy_restore_start(void)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
-        bytes_transferred += size;
-        qemu_update_position(f, size);
+    Error *local_err = NULL;
+
+    lazy_restore.fd = file_mapped_ram_open(false, false, &local_err);
+    if (lazy_restore.fd < 0) {
+        error_report_err(local_err);
+        return -EINVAL;
     }
-}
+    lazy_restore.block = QLIST_FIRST_RCU(&ram_list.blocks);
+    lazy_restore.page = 0;
 
-static ram_addr_t ram_save_remaining(void)
-{
-    return migration_dirty_pages;
+    if (postcopy_lazy_restore_start(migration_incoming_get_current()) < 0) {
+        ram_lazy_restore_cleanup();
+        return -EINVAL;
+    }
+    return 0;
 }
 
-uint64_t ram_bytes_remaining(void)
+/*
+ * Fill @buf with the @len bytes at @offset of @rb; @offset is aligned
+ * to @len.  Returns 1 if they are all zero, in which case @buf is left
+ * untouched, 0 if @buf was filled, < 0 on error.
+ */
+int ram_lazy_restore_fill(RAMBlock *rb, ram_addr_t offset, size_t len,
+                          uint8_t *buf)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
-}
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = MIN(offset + len, rb->used_length) >>
+                         TARGET_PAGE_BITS;
+    Error *local_err = NULL;
+    unsigned long i;
+
+    if (!rb->file_bmap || find_next_bit(rb->file_bmap, last, first) == last) {
+        return 1;
+    }
 
-uint64_t ram_bytes_transferred(void)
-{
-    return bytes_transferred;
+    if (mapped_ram_rw(lazy_restore.fd, false, buf,
+                      (last - first) << TARGET_PAGE_BITS,
+                      rb->pages_offset + offset, &local_err) < 0) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+    memset(buf + ((last - first) << TARGET_PAGE_BITS), 0,
+           len - ((last - first) << TARGET_PAGE_BITS));
+    for (i = first; i < last; i++) {
+        if (!test_and_clear_bit(i, rb->file_bmap)) {
+            memset(buf + ((i - first) << TARGET_PAGE_BITS), 0,
+                   TARGET_PAGE_SIZE);
+        }
+    }
+    return 0;
 }
 
-uint64_t ram_bytes_total(void)
+/*
+ * Find the next @pagesize aligned page that still has data in the file.
+ * Returns false once there is none left.
+ */
+bool ram_lazy_restore_next(RAMBlock **rb, ram_addr_t *offset,
+                           size_t pagesize)
 {
     RAMBlock *block;
-    uint64_t total = 0;
 
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next)
-        total += block->used_length;
+    for (block = lazy_restore.block; block;
+         block = QLIST_NEXT_RCU(block, next), lazy_restore.page = 0) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!block->file_bmap) {
+            continue;
+        }
+        lazy_restore.page = find_next_bit(block->file_bmap, pages,
+                                          lazy_restore.page);
+        if (lazy_restore.page < pages) {
+            break;
+        }
+    }
+    lazy_restore.block = block;
     rcu_read_unlock();
-    return total;
-}
 
-void free_xbzrle_decoded_buf(void)
-{
-    g_free(xbzrle_decoded_buf);
-    xbzrle_decoded_buf = NULL;
+    if (!block) {
+        return false;
+    }
+    *rb = block;
+    *offset = QEMU_ALIGN_DOWN((ram_addr_t)lazy_restore.page << TARGET_PAGE_BITS,
+                              pagesize);
+    return true;
 }
 
-static void migration_bitmap_free(struct BitmapRcu *bmap)
+void ram_lazy_restore_cleanup(void)
 {
-    g_free(bmap->bmap);
-    g_free(bmap->unsentmap);
-    g_free(bmap);
-}
+    RAMBlock *block;
 
-static void ram_migration_cleanup(void *opaque)
-{
-    /* caller have hold iothread lock or is in a bh, so there is
-     * no writing race against this migration_bitmap
-     */
-    struct BitmapRcu *bitmap = migration_bitmap_rcu;
-    atomic_rcu_set(&migration_bitmap_rcu, NULL);
-    if (bitmap) {
-        memory_global_dirty_log_stop();
-        call_rcu(bitmap, migration_bitmap_free, rcu);
+    if (lazy_restore.fd >= 0) {
+        close(lazy_restore.fd);
+        lazy_restore.fd = -1;
     }
+    lazy_restore.block = NULL;
 
-    XBZRLE_cache_lock();
-    if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(ZERO_TARGET_PAGE);
-        XBZRLE.cache = NULL;
-        XBZRLE.encoded_buf = NULL;
-        XBZRLE.current_buf = NULL;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
-    XBZRLE_cache_unlock();
-}
-
-static void reset_ram_globals(void)
-{
-    last_seen_block = NULL;
-    last_sent_block = NULL;
-    last_offset = 0;
-    last_version = ram_list.version;
-    ram_bulk_stage = true;
+    rcu_read_unlock();
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
-
-void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
-{
-    /* called in qemu main thread, so there is
-     * no writing race against this migration_bitmap
-     */
-    if (migration_bitmap_rcu) {
-        struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
-        bitmap = g_new(struct BitmapRcu, 1);
-        bitmap->bmap = bitmap_new(new);
+/* Background snapshots (x-background-snapshot).
+ *
+ * RAM is saved once, as it was when the guest was stopped to save its
+ * device state, while the guest runs again.  RAM is write protected at
+ * that point (postcopy_wp_start), and the first write to a page that
+ * has not been saved yet copies it to a queue first; the migration
+ * thread saves queued copies before anything else.  The dirty bitmap
+ * is never synced again, so a page leaves it exactly once: under
+ * snapshot.lock, either into the queue or into snapshot.bounce.
+ */
 
-        /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
-         * it is safe to migration if migration_bitmap is cleared bit
-         * at the same time.
-         */
-        qemu_mutex_lock(&migration_bitmap_mutex);
-        bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
-        bitmap_set(bitmap->bmap, old, new - old);
+/* Copies kept before writers have to wait for the migration thread */
+#define SNAPSHOT_MAX_COPIES ((64 << 20) / TARGET_PAGE_SIZE)
 
-        /* We don't have a way to safely extend the sentmap
-         * with RCU; so mark it as missing, entry to postcopy
-         * will fail.
-         */
-        bitmap->unsentmap = NULL;
+typedef struct SnapshotCopy {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(SnapshotCopy) next;
+    uint8_t data[];
+} SnapshotCopy;
 
-        atomic_rcu_set(&migration_bitmap_rcu, bitmap);
-        qemu_mutex_unlock(&migration_bitmap_mutex);
-        migration_dirty_pages += new - old;
-        call_rcu(old_bitmap, migration_bitmap_free, rcu);
-    }
+static struct {
+    QemuMutex lock;
+    QemuCond cond;
+    /* The fields below are protected by lock */
+    bool active;
+    unsigned int copies;
+    QSIMPLEQ_HEAD(, SnapshotCopy) queue;
+    /* Only used by the migration thread */
+    uint8_t *bounce;
+} snapshot;
+
+bool ram_write_tracking_supported(void)
+{
+    return postcopy_wp_supported_by_host();
 }
 
-/*
- * 'expected' is the value you expect the bitmap mostly to be full
- * of; it won't bother printing lines that are all this value.
- * If 'todump' is null the migration bitmap is dumped.
+/* Map every page, so that pages the guest never touched are protected
+ * too; only pages that are present can be write protected.  Called
+ * before the guest is stopped, since it can take a while.
  */
-void ram_debug_dump_bitmap(unsigned long *todump, bool expected)
+void ram_write_tracking_prepare(void)
 {
-    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-
-    int64_t cur;
-    int64_t linelen = 128;
-    char linebuf[129];
+    RAMBlock *block;
 
-    if (!todump) {
-        todump = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    }
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t offset;
 
-    for (cur = 0; cur < ram_pages; cur += linelen) {
-        int64_t curb;
-        bool found = false;
-        /*
-         * Last line; catch the case where the line length
-         * is longer than remaining ram
-         */
-        if (cur + linelen > ram_pages) {
-            linelen = ram_pages - cur;
-        }
-        for (curb = 0; curb < linelen; curb++) {
-            bool thisbit = test_bit(cur + curb, todump);
-            linebuf[curb] = thisbit ? '1' : '.';
-            found = found || (thisbit != expected);
-        }
-        if (found) {
-            linebuf[curb] = '\0';
-            fprintf(stderr,  "0x%08" PRIx64 " : %s\n", cur, linebuf);
+        for (offset = 0; offset < block->used_length;
+             offset += qemu_host_page_size) {
+            (void)*(volatile uint8_t *)(block->host + offset);
         }
     }
+    rcu_read_unlock();
 }
 
-/* **** functions for postcopy ***** */
+/* Called with the guest stopped */
+int ram_write_tracking_start(void)
+{
+    snapshot.bounce = g_malloc(TARGET_PAGE_SIZE);
+    qemu_mutex_lock(&snapshot.lock);
+    snapshot.active = true;
+    qemu_mutex_unlock(&snapshot.lock);
 
-void ram_postcopy_migrated_memory_release(MigrationState *ms)
+    if (postcopy_wp_start() < 0) {
+        ram_write_tracking_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void ram_write_tracking_stop(void)
 {
-    struct RAMBlock *block;
-    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    SnapshotCopy *copy;
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        unsigned long first = block->offset >> TARGET_PAGE_BITS;
-        unsigned long range = first + (block->used_length >> TARGET_PAGE_BITS);
-        unsigned long run_start = find_next_zero_bit(bitmap, range, first);
+    /* Release writers waiting for room in the queue */
+    qemu_mutex_lock(&snapshot.lock);
+    snapshot.active = false;
+    qemu_cond_broadcast(&snapshot.cond);
+    qemu_mutex_unlock(&snapshot.lock);
 
-        while (run_start < range) {
-            unsigned long run_end = find_next_bit(bitmap, range, run_start + 1);
-            ram_discard_range(NULL, block->idstr, run_start << TARGET_PAGE_BITS,
-                              (run_end - run_start) << TARGET_PAGE_BITS);
-            run_start = find_next_zero_bit(bitmap, range, run_end + 1);
-        }
+    postcopy_wp_stop();
+
+    while ((copy = QSIMPLEQ_FIRST(&snapshot.queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&snapshot.queue, next);
+        g_free(copy);
     }
+    snapshot.copies = 0;
+    g_free(snapshot.bounce);
+    snapshot.bounce = NULL;
 }
 
-/*
- * Callback from postcopy_each_ram_send_discard for each RAMBlock
- * Note: At this point the 'unsentmap' is the processed bitmap combined
- *       with the dirtymap; so a '1' means it's either dirty or unsent.
- * start,length: Indexes into the bitmap for the first bit
- *            representing the named block and length in target-pages
+/* Called by the write protection thread before a write to @len bytes
+ * at @offset of @rb goes ahead
  */
-static int postcopy_send_discard_bm_ram(MigrationState *ms,
-                                        PostcopyDiscardState *pds,
-                                        unsigned long start,
-                                        unsigned long length)
+void ram_write_tracking_copy(RAMBlock *rb, ram_addr_t offset, size_t len)
 {
-    unsigned long end = start + length; /* one after the end */
-    unsigned long current;
-    unsigned long *unsentmap;
-
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-    for (current = start; current < end; ) {
-        unsigned long one = find_next_bit(unsentmap, end, current);
+    ram_addr_t end = MIN(offset + len, rb->used_length);
 
-        if (one <= end) {
-            unsigned long zero = find_next_zero_bit(unsentmap, end, one + 1);
-            unsigned long discard_length;
+    rcu_read_lock();
+    qemu_mutex_lock(&snapshot.lock);
+    for (; offset < end; offset += TARGET_PAGE_SIZE) {
+        SnapshotCopy *copy;
 
-            if (zero >= end) {
-                discard_length = end - one;
-            } else {
-                discard_length = zero - one;
-            }
-            if (discard_length) {
-                postcopy_discard_send_range(ms, pds, one, discard_length);
-            }
-            current = one + discard_length;
-        } else {
-            current = one;
+        while (snapshot.active && snapshot.copies >= SNAPSHOT_MAX_COPIES) {
+            qemu_cond_wait(&snapshot.cond, &snapshot.lock);
+        }
+        if (!snapshot.active) {
+            break;
         }
+        if (!migration_bitmap_clear_dirty(rb->offset + offset)) {
+            continue;
+        }
+        copy = g_malloc(sizeof(*copy) + TARGET_PAGE_SIZE);
+        copy->block = rb;
+        copy->offset = offset;
+        memcpy(copy->data, rb->host + offset, TARGET_PAGE_SIZE);
+        QSIMPLEQ_INSERT_TAIL(&snapshot.queue, copy, next);
+        snapshot.copies++;
     }
+    qemu_mutex_unlock(&snapshot.lock);
+    rcu_read_unlock();
+}
 
-    return 0;
+static int ram_save_snapshot_buffer(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, uint8_t *buf,
+                                    uint64_t *bytes_transferred)
+{
+    ram_addr_t header = offset;
+    int pages;
+
+    if (block == last_sent_block) {
+        header |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    pages = save_zero_page(f, block, header, buf, bytes_transferred);
+    if (pages < 0) {
+        *bytes_transferred += save_page_header(f, block,
+                                               header | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, buf, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        pages = 1;
+    }
+    last_sent_block = block;
+    return pages;
 }
 
-/*
- * Utility for the outgoing postcopy code.
- *   Calls postcopy_send_discard_bm_ram for each RAMBlock
- *   passing it bitmap indexes and name.
- * Returns: 0 on success
- * (qemu_ram_foreach_block ends up passing unscaled lengths
- *  which would mean postcopy code would have to deal with target page)
- */
-static int postcopy_each_ram_send_discard(MigrationState *ms)
+/* Save the oldest page copied ahead of a write; returns 0 if none */
+static int ram_save_snapshot_copy(QEMUFile *f, uint64_t *bytes_transferred)
 {
-    struct RAMBlock *block;
-    int ret;
+    SnapshotCopy *copy;
+    int pages;
+
+    qemu_mutex_lock(&snapshot.lock);
+    copy = QSIMPLEQ_FIRST(&snapshot.queue);
+    if (copy) {
+        QSIMPLEQ_REMOVE_HEAD(&snapshot.queue, next);
+        snapshot.copies--;
+        qemu_cond_signal(&snapshot.cond);
+    }
+    qemu_mutex_unlock(&snapshot.lock);
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        unsigned long first = block->offset >> TARGET_PAGE_BITS;
-        PostcopyDiscardState *pds = postcopy_discard_send_init(ms,
-                                                               first,
-                                                               block->idstr);
+    if (!copy) {
+        return 0;
+    }
+    pages = ram_save_snapshot_buffer(f, copy->block, copy->offset, copy->data,
+                                     bytes_transferred);
+    g_free(copy);
+    return pages;
+}
 
-        /*
-         * Postcopy sends chunks of bitmap over the wire, but it
-         * just needs indexes at this point, avoids it having
-         * target page specific code.
-         */
-        ret = postcopy_send_discard_bm_ram(ms, pds, first,
-                                    block->used_length >> TARGET_PAGE_BITS);
-        postcopy_discard_send_finish(ms, pds);
-        if (ret) {
-            return ret;
-        }
+/* Save a page from guest memory, unless a write copied it already */
+static int ram_save_snapshot_page(QEMUFile *f, PageSearchStatus *pss,
+                                  uint64_t *bytes_transferred,
+                                  ram_addr_t dirty_ram_abs)
+{
+    qemu_mutex_lock(&snapshot.lock);
+    if (!migration_bitmap_clear_dirty(dirty_ram_abs)) {
+        qemu_mutex_unlock(&snapshot.lock);
+        return 0;
     }
+    memcpy(snapshot.bounce, pss->block->host + pss->offset, TARGET_PAGE_SIZE);
+    qemu_mutex_unlock(&snapshot.lock);
 
-    return 0;
+    return ram_save_snapshot_buffer(f, pss->block, pss->offset,
+                                    snapshot.bounce, bytes_transferred);
 }
 
-/*
- * Helper for postcopy_chunk_hostpages; it's called twice to cleanup
- *   the two bitmaps, that are similar, but one is inverted.
+/**
+ * ram_save_page: Send the given page to the stream
  *
- * We search for runs of target-pages that don't start or end on a
- * host page boundary;
- * unsent_pass=true: Cleans up partially unsent host pages by searching
- *                 the unsentmap
- * unsent_pass=false: Cleans up partially dirty host pages by searching
- *                 the main migration bitmap
+ * Returns: Number of pages written.
+ *          < 0 - error
+ *          >=0 - Number of pages written - this might legally be 0
+ *                if xbzrle noticed the page was the same.
  *
+ * @ms: The current migration state.
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
  */
-static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
-                                          RAMBlock *block,
-                                          PostcopyDiscardState *pds)
+static int ram_save_page(MigrationState *ms, QEMUFile *f, PageSearchStatus *pss,
+                         bool last_stage, uint64_t *bytes_transferred)
 {
-    unsigned long *bitmap;
-    unsigned long *unsentmap;
-    unsigned int host_ratio = qemu_host_page_size / TARGET_PAGE_SIZE;
-    unsigned long first = block->offset >> TARGET_PAGE_BITS;
-    unsigned long len = block->used_length >> TARGET_PAGE_BITS;
-    unsigned long last = first + (len - 1);
-    unsigned long run_start;
+    int pages = -1;
+    uint64_t bytes_xmit;
+    ram_addr_t current_addr;
+    uint8_t *p;
+    int ret;
+    bool send_async = true;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    p = block->host + offset;
+    pss->multifd = false;
 
-    if (unsent_pass) {
-        /* Find a sent page */
-        run_start = find_next_zero_bit(unsentmap, last + 1, first);
-    } else {
-        /* Find a dirty page */
-        run_start = find_next_bit(bitmap, last + 1, first);
+    /* In doubt sent page as normal */
+    bytes_xmit = 0;
+    ret = ram_control_save_page(f, block->offset,
+                           offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
     }
 
-    while (run_start <= last) {
-        bool do_fixup = false;
-        unsigned long fixup_start_addr;
-        unsigned long host_offset;
+    XBZRLE_cache_lock();
 
-        /*
-         * If the start of this run of pages is in the middle of a host
-         * page, then we need to fixup this host page.
-         */
-        host_offset = run_start % host_ratio;
-        if (host_offset) {
-            do_fixup = true;
-            run_start -= host_offset;
-            fixup_start_addr = run_start;
-            /* For the next pass */
-            run_start = run_start + host_ratio;
-        } else {
-            /* Find the end of this run */
-            unsigned long run_end;
-            if (unsent_pass) {
-                run_end = find_next_bit(unsentmap, last + 1, run_start + 1);
-            } else {
-                run_end = find_next_zero_bit(bitmap, last + 1, run_start + 1);
+    current_addr = block->offset + offset;
+
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages++;
             }
-            /*
-             * If the end isn't at the start of a host page, then the
-             * run doesn't finish at the end of a host page
-             * and we need to discard.
+        }
+    } else {
+        if (migrate_zero_page_runs() && !migration_in_postcopy(ms)) {
+            pages = save_zero_run(f, pss, offset, bytes_transferred);
+        } else {
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+        }
+        if (pages > 0) {
+            /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+             * page would be stale
              */
-            host_offset = run_end % host_ratio;
-            if (host_offset) {
-                do_fixup = true;
-                fixup_start_addr = run_end - host_offset;
-                /*
-                 * This host page has gone, the next loop iteration starts
-                 * from after the fixup
-                 */
-                run_start = fixup_start_addr + host_ratio;
-            } else {
-                /*
-                 * No discards on this iteration, next loop starts from
-                 * next sent/dirty page
+            xbzrle_cache_zero_page(current_addr);
+            ram_release_pages(ms, block->idstr, pss->offset, pages);
+        } else if (!ram_bulk_stage &&
+                   !migration_in_postcopy(ms) && migrate_use_xbzrle()) {
+            pages = save_xbzrle_page(f, &p, current_addr, block,
+                                     offset, last_stage, bytes_transferred);
+            if (!last_stage) {
+                /* Can't send this cached data async, since the cache page
+                 * might get updated before it gets to the wire
                  */
-                run_start = run_end + 1;
+                send_async = false;
             }
         }
+    }
 
-        if (do_fixup) {
-            unsigned long page;
+    /* XBZRLE overflow or normal page */
+    if (pages == -1 && multifd_send_state && p == block->host + pss->offset) {
+        /* The channel reads the page from guest memory, like
+         * qemu_put_buffer_async would do.
+         */
+        if (multifd_queue_page(block, pss->offset) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+        pss->multifd = true;
+    } else if (pages == -1) {
+        *bytes_transferred += save_page_header(f, block,
+                                               offset | RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE,
+                                  migrate_release_ram() &
+                                  migration_in_postcopy(ms));
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    }
 
-            /* Tell the destination to discard this page */
-            if (unsent_pass || !test_bit(fixup_start_addr, unsentmap)) {
-                /* For the unsent_pass we:
-                 *     discard partially sent pages
-                 * For the !unsent_pass (dirty) we:
-                 *     discard partially dirty pages that were sent
-                 *     (any partially sent pages were already discarded
-                 *     by the previous unsent_pass)
-                 */
-                postcopy_discard_send_range(ms, pds, fixup_start_addr,
-                                            host_ratio);
-            }
+    XBZRLE_cache_unlock();
 
-            /* Clean up the bitmap */
-            for (page = fixup_start_addr;
-                 page < fixup_start_addr + host_ratio; page++) {
-                /* All pages in this host page are now not sent */
-                set_bit(page, unsentmap);
+    return pages;
+}
 
-                /*
-                 * Remark them as dirty, updating the count for any pages
-                 * that weren't previously dirty.
-                 */
-                migration_dirty_pages += !test_and_set_bit(page, bitmap);
-            }
+static int do_compress_ram_page(QEMUFile *f, MigrationCompressor *comp,
+                                RAMBlock *block, ram_addr_t offset)
+{
+    int bytes_sent, blen;
+    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+
+    bytes_sent = save_page_header(f, block, offset |
+                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
+    blen = qemu_put_compression_data(f, comp, p, TARGET_PAGE_SIZE);
+    if (blen < 0) {
+        bytes_sent = 0;
+        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
+        error_report("compressed data failed!");
+    } else {
+        bytes_sent += blen;
+        ram_release_pages(migrate_get_current(), block->idstr,
+                          offset & TARGET_PAGE_MASK, 1);
+    }
+
+    return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+CompressionStats *compress_mig_stats(void)
+{
+    CompressionStats *stats = g_new0(CompressionStats, 1);
+    intList **tail = &stats->thread_cpu_time;
+    int64_t cpu_ns = 0;
+    int i;
+
+    stats->method = comp_stats_method;
+    /* Threads only exist between create and join, both run under the BQL */
+    if (compress_threads) {
+        qemu_mutex_lock(&comp_done_lock);
+    }
+    for (i = 0; i < comp_stats_count; i++) {
+        intList *entry = g_new0(intList, 1);
+
+        stats->pages += comp_stats[i].pages;
+        stats->compressed_size += comp_stats[i].bytes;
+        cpu_ns += comp_stats[i].cpu_ns;
+        entry->value = comp_stats[i].cpu_ns / SCALE_MS;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (compress_threads) {
+        qemu_mutex_unlock(&comp_done_lock);
+    }
+
+    if (stats->compressed_size) {
+        stats->compression_rate = (double)stats->pages * TARGET_PAGE_SIZE /
+                                  stats->compressed_size;
+    }
+    if (cpu_ns) {
+        stats->throughput = (double)stats->pages * TARGET_PAGE_SIZE /
+                            (1 << 20) * NANOSECONDS_PER_SECOND / cpu_ns;
+    }
+
+    return stats;
+}
+
+static void flush_compressed_data(QEMUFile *f)
+{
+    int idx, len, thread_count;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    thread_count = migrate_compress_threads();
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!comp_param[idx].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
         }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
 
-        if (unsent_pass) {
-            /* Find the next sent page for the next iteration */
-            run_start = find_next_zero_bit(unsentmap, last + 1,
-                                           run_start);
+    for (idx = 0; idx < thread_count; idx++) {
+        qemu_mutex_lock(&comp_param[idx].mutex);
+        if (!comp_param[idx].quit) {
+            len = qemu_put_qemu_file(f, comp_param[idx].file);
+            bytes_transferred += len;
+        }
+        qemu_mutex_unlock(&comp_param[idx].mutex);
+    }
+}
+
+static inline void set_compress_params(CompressParam *param, RAMBlock *block,
+                                       ram_addr_t offset)
+{
+    param->block = block;
+    param->offset = offset;
+}
+
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset,
+                                           uint64_t *bytes_transferred)
+{
+    int idx, thread_count, bytes_xmit = -1, pages = -1;
+
+    thread_count = migrate_compress_threads();
+    qemu_mutex_lock(&comp_done_lock);
+    while (true) {
+        for (idx = 0; idx < thread_count; idx++) {
+            if (comp_param[idx].done) {
+                comp_param[idx].done = false;
+                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
+                qemu_mutex_lock(&comp_param[idx].mutex);
+                set_compress_params(&comp_param[idx], block, offset);
+                qemu_cond_signal(&comp_param[idx].cond);
+                qemu_mutex_unlock(&comp_param[idx].mutex);
+                pages = 1;
+                acct_info.norm_pages++;
+                *bytes_transferred += bytes_xmit;
+                break;
+            }
+        }
+        if (pages > 0) {
+            break;
         } else {
-            /* Find the next dirty page for the next iteration */
-            run_start = find_next_bit(bitmap, last + 1, run_start);
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
         }
     }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return pages;
+}
+
+/**
+ * ram_save_compressed_page: compress the given page and send it to the stream
+ *
+ * Returns: Number of pages written.
+ *
+ * @ms: The current migration state.
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_compressed_page(MigrationState *ms, QEMUFile *f,
+                                    PageSearchStatus *pss, bool last_stage,
+                                    uint64_t *bytes_transferred)
+{
+    int pages = -1;
+    uint64_t bytes_xmit = 0;
+    uint8_t *p;
+    int ret, blen;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+
+    p = block->host + offset;
+
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    }
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else {
+        /* When starting the process of a new block, the first page of
+         * the block should be sent out before other pages in the same
+         * block, and all the pages in last block should have been sent
+         * out, keeping this order is important, because the 'cont' flag
+         * is used to avoid resending the block name.
+         */
+        if (block != last_sent_block) {
+            flush_compressed_data(f);
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                /* Make sure the first page is sent out before other pages */
+                bytes_xmit = save_page_header(f, block, offset |
+                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
+                blen = qemu_put_compression_data(f, comp_main, p,
+                                                 TARGET_PAGE_SIZE);
+                if (blen > 0) {
+                    *bytes_transferred += bytes_xmit + blen;
+                    acct_info.norm_pages++;
+                    pages = 1;
+                } else {
+                    qemu_file_set_error(f, blen);
+                    error_report("compressed data failed!");
+                }
+            }
+            if (pages > 0) {
+                ram_release_pages(ms, block->idstr, pss->offset, pages);
+            }
+        } else {
+            offset |= RAM_SAVE_FLAG_CONTINUE;
+            pages = save_zero_page(f, block, offset, p, bytes_transferred);
+            if (pages == -1) {
+                pages = compress_page_with_multi_thread(f, block, offset,
+                                                        bytes_transferred);
+            } else {
+                ram_release_pages(ms, block->idstr, pss->offset, pages);
+            }
+        }
+    }
+
+    return pages;
+}
+
+/*
+ * Find the next dirty page and update any state associated with
+ * the search process.
+ *
+ * Returns: True if a page is found
+ *
+ * @f: Current migration stream.
+ * @pss: Data about the state of the current dirty page scan.
+ * @*again: Set to false if the search has scanned the whole of RAM
+ * *ram_addr_abs: Pointer into which to store the address of the dirty page
+ *               within the global ram_addr space
+ */
+static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
+                             bool *again, ram_addr_t *ram_addr_abs)
+{
+    pss->offset = migration_bitmap_find_dirty(pss->block, pss->offset,
+                                              ram_addr_abs);
+    if (pss->complete_round && pss->block == last_seen_block &&
+        pss->offset >= last_offset) {
+        /*
+         * We've been once around the RAM and haven't found anything.
+         * Give up.
+         */
+        *again = false;
+        return false;
+    }
+    if (pss->offset >= pss->block->used_length) {
+        /* Didn't find anything in this RAM Block */
+        pss->offset = 0;
+        pss->block = QLIST_NEXT_RCU(pss->block, next);
+        if (!pss->block) {
+            /* Hit the end of the list */
+            pss->block = QLIST_FIRST_RCU(&ram_list.blocks);
+            /* Flag that we've looped */
+            pss->complete_round = true;
+            ram_bulk_stage = false;
+            if (migrate_use_xbzrle()) {
+                /* If xbzrle is on, stop using the data compression at this
+                 * point. In theory, xbzrle can do better than compression.
+                 */
+                flush_compressed_data(f);
+                compression_switch = false;
+            }
+        }
+        /* Didn't find anything this time, but try again on the new block */
+        *again = true;
+        return false;
+    } else {
+        /* Can go around again, but... */
+        *again = true;
+        /* We've found something so probably don't need to */
+        return true;
+    }
+}
+
+/*
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *      ms:      MigrationState in
+ * *offset:      Used to return the offset within the RAMBlock
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      block (or NULL if none available)
+ */
+static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
+                              ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
+        struct MigrationSrcPageRequest *entry =
+                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+        block = entry->rb;
+        *offset = entry->offset;
+        *ram_addr_abs = (entry->offset + entry->rb->offset) &
+                        TARGET_PAGE_MASK;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * Unqueue a page from the queue fed by postcopy page requests; skips pages
+ * that are already sent (!dirty)
+ *
+ *      ms:      MigrationState in
+ *     pss:      PageSearchStatus structure updated with found block/offset
+ * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *
+ * Returns:      true if a queued page is found
+ */
+static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
+                            ram_addr_t *ram_addr_abs)
+{
+    RAMBlock  *block;
+    ram_addr_t offset;
+    bool dirty;
+
+    do {
+        block = unqueue_page(ms, &offset, ram_addr_abs);
+        /*
+         * We're sending this page, and since it's postcopy nothing else
+         * will dirty it, and we must make sure it doesn't get sent again
+         * even if this queue request was received after the background
+         * search already sent it.
+         */
+        if (block) {
+            unsigned long *bitmap;
+            bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+            dirty = test_bit(*ram_addr_abs >> TARGET_PAGE_BITS, bitmap);
+            if (!dirty) {
+                trace_get_queued_page_not_dirty(
+                    block->idstr, (uint64_t)offset,
+                    (uint64_t)*ram_addr_abs,
+                    test_bit(*ram_addr_abs >> TARGET_PAGE_BITS,
+                         atomic_rcu_read(&migration_bitmap_rcu)->unsentmap));
+            } else {
+                trace_get_queued_page(block->idstr,
+                                      (uint64_t)offset,
+                                      (uint64_t)*ram_addr_abs);
+            }
+        }
+
+    } while (block && !dirty);
+
+    if (block) {
+        /*
+         * As soon as we start servicing pages out of order, then we have
+         * to kill the bulk stage, since the bulk stage assumes
+         * in (migration_bitmap_find_and_reset_dirty) that every page is
+         * dirty, that's no longer true.
+         */
+        ram_bulk_stage = false;
+
+        /*
+         * We want the background search to continue from the queued page
+         * since the guest is likely to want other pages near to the page
+         * it just requested.
+         */
+        pss->block = block;
+        pss->offset = offset;
+    }
+
+    return !!block;
+}
+
+/**
+ * flush_page_queue: Flush any remaining pages in the ram request queue
+ *    it should be empty at the end anyway, but in error cases there may be
+ *    some left.
+ *
+ * ms: MigrationState
+ */
+void flush_page_queue(MigrationState *ms)
+{
+    struct MigrationSrcPageRequest *mspr, *next_mspr;
+    /* This queue generally should be empty - but in the case of a failed
+     * migration might have some droppings in.
+     */
+    rcu_read_lock();
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+        g_free(mspr);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Queue the pages for transmission, e.g. a request from postcopy destination
+ *   ms: MigrationStatus in which the queue is held
+ *   rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
+ *   start: Offset from the start of the RAMBlock
+ *   len: Length (in bytes) to send
+ *   Return: 0 on success
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+
+    ms->postcopy_requests++;
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = ms->last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = qemu_ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        ms->last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start+len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    struct MigrationSrcPageRequest *new_entry =
+        g_malloc0(sizeof(struct MigrationSrcPageRequest));
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+/**
+ * ram_save_target_page: Save one target page
+ *
+ *
+ * @f: QEMUFile where to send the data
+ * @block: pointer to block that contains the page we want to send
+ * @offset: offset inside the block for the page;
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
+ *
+ * Returns: Number of pages written.
+ */
+static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
+                                PageSearchStatus *pss,
+                                bool last_stage,
+                                uint64_t *bytes_transferred,
+                                ram_addr_t dirty_ram_abs)
+{
+    int res = 0;
+
+    if (migrate_background_snapshot()) {
+        return ram_save_snapshot_page(f, pss, bytes_transferred,
+                                      dirty_ram_abs);
+    }
+
+    /* Check the pages is dirty and if it is send it */
+    if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
+        unsigned long *unsentmap;
+        if (mapped_ram_state) {
+            res = ram_save_mapped_page(f, pss, bytes_transferred);
+        } else if (compression_switch && migrate_use_compression()) {
+            res = ram_save_compressed_page(ms, f, pss,
+                                           last_stage,
+                                           bytes_transferred);
+        } else {
+            res = ram_save_page(ms, f, pss, last_stage,
+                                bytes_transferred);
+        }
+
+        if (res < 0) {
+            return res;
+        }
+        unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+        if (unsentmap) {
+            clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
+        }
+        /* Only update last_sent_block if a block was actually sent; xbzrle
+         * might have decided the page was identical so didn't bother writing
+         * to the stream.  Pages sent on a multifd channel or stored in a
+         * mapped-ram file do not count, as they are not in the stream.
+         */
+        if (res > 0 && !pss->multifd && !mapped_ram_state) {
+            last_sent_block = pss->block;
+        }
+    }
+
+    return res;
+}
+
+/**
+ * ram_save_host_page: Starting at *offset send pages up to the end
+ *                     of the current host page.  It's valid for the initial
+ *                     offset to point into the middle of a host page
+ *                     in which case the remainder of the hostpage is sent.
+ *                     Only dirty target pages are sent.
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: pointer to block that contains the page we want to send
+ * @offset: offset inside the block for the page; updated to last target page
+ *          sent
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
+ */
+static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
+                              PageSearchStatus *pss,
+                              bool last_stage,
+                              uint64_t *bytes_transferred,
+                              ram_addr_t dirty_ram_abs)
+{
+    int tmppages, pages = 0;
+    do {
+        tmppages = ram_save_target_page(ms, f, pss, last_stage,
+                                        bytes_transferred, dirty_ram_abs);
+        if (tmppages < 0) {
+            return tmppages;
+        }
+
+        pages += tmppages;
+        /* A run of zero pages may have moved the offset past a page */
+        pss->offset += TARGET_PAGE_SIZE;
+        dirty_ram_abs = pss->block->offset + pss->offset;
+    } while (pss->offset & (qemu_host_page_size - 1));
+
+    /* The offset we leave with is the last one we looked at */
+    pss->offset -= TARGET_PAGE_SIZE;
+    return pages;
+}
+
+/**
+ * ram_find_and_save_block: Finds a dirty page and sends it to f
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns:  The number of pages written
+ *           0 means no dirty pages
+ *
+ * @f: QEMUFile where to send the data
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ *
+ * On systems where host-page-size > target-page-size it will send all the
+ * pages in a host page that are dirty.
+ */
+
+static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
+                                   uint64_t *bytes_transferred)
+{
+    PageSearchStatus pss;
+    MigrationState *ms = migrate_get_current();
+    int pages = 0;
+    bool again, found;
+    ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
+                                 ram_addr_t space */
+
+    /* No dirty page as there is zero RAM */
+    if (!ram_bytes_total()) {
+        return pages;
+    }
+
+    /* Pages copied ahead of a write go first, to make room for more */
+    if (migrate_background_snapshot()) {
+        pages = ram_save_snapshot_copy(f, bytes_transferred);
+        if (pages) {
+            return pages;
+        }
+    }
+
+    pss.block = last_seen_block;
+    pss.offset = last_offset;
+    pss.complete_round = false;
+
+    if (!pss.block) {
+        pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
+    }
+
+    do {
+        again = true;
+        found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        pss.urgent = found && postcopy_preempt_out &&
+                     migration_in_postcopy(ms);
+
+        if (!found) {
+            /* priority queue empty, so just search for something dirty */
+            found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+        }
+
+        if (pss.urgent) {
+            pages = ram_save_preempt_host_page(ms, f, &pss, bytes_transferred,
+                                               dirty_ram_abs);
+        } else if (found) {
+            pages = ram_save_host_page(ms, f, &pss,
+                                       last_stage, bytes_transferred,
+                                       dirty_ram_abs);
+        }
+    } while (!pages && again);
+
+    last_seen_block = pss.block;
+    last_offset = pss.offset;
+
+    return pages;
+}
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
+        bytes_transferred += size;
+        qemu_update_position(f, size);
+    }
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next)
+        total += block->used_length;
+    rcu_read_unlock();
+    return total;
+}
+
+void free_xbzrle_decoded_buf(void)
+{
+    g_free(xbzrle_decoded_buf);
+    xbzrle_decoded_buf = NULL;
+}
+
+static void migration_bitmap_free(struct BitmapRcu *bmap)
+{
+    g_free(bmap->bmap);
+    g_free(bmap->unsentmap);
+    g_free(bmap->summary);
+    g_free(bmap->clearmap);
+    g_free(bmap);
+}
+
+static void ram_migration_cleanup(void *opaque)
+{
+    /* caller have hold iothread lock or is in a bh, so there is
+     * no writing race against this migration_bitmap
+     */
+    struct BitmapRcu *bitmap = migration_bitmap_rcu;
+    atomic_rcu_set(&migration_bitmap_rcu, NULL);
+    if (bitmap) {
+        memory_global_dirty_log_stop();
+        call_rcu(bitmap, migration_bitmap_free, rcu);
+    }
+
+    migration_bitmap_sync_threads_join();
+    multifd_save_cleanup();
+    postcopy_preempt_save_cleanup();
+    mapped_ram_save_cleanup();
+
+    precopy_notify(PRECOPY_NOTIFY_CLEANUP);
+    qemu_mutex_lock(&free_page_hints.lock);
+    g_array_set_size(free_page_hints.queue, 0);
+    qemu_mutex_unlock(&free_page_hints.lock);
+
+    XBZRLE_cache_lock();
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        g_free(ZERO_TARGET_PAGE);
+        XBZRLE.cache = NULL;
+        XBZRLE.encoded_buf = NULL;
+        XBZRLE.current_buf = NULL;
+    }
+    XBZRLE_cache_unlock();
+}
+
+static void reset_ram_globals(void)
+{
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+    last_version = ram_list.version;
+    ram_bulk_stage = true;
+    ram_free_page_hinted = false;
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
+{
+    /* called in qemu main thread, so there is
+     * no writing race against this migration_bitmap
+     */
+    if (migration_bitmap_rcu) {
+        struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
+        bitmap = g_new(struct BitmapRcu, 1);
+        bitmap->bmap = bitmap_new(new);
+
+        /* prevent migration_bitmap content from being set bit
+         * by migration_bitmap_sync() at the same time.
+         * it is safe to migration if migration_bitmap is cleared bit
+         * at the same time.
+         */
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
+        bitmap_set(bitmap->bmap, old, new - old);
+        bitmap->summary = migration_bitmap_summary_new(new);
+        bitmap->clearmap = migration_bitmap_clearmap_new(new);
+        if (bitmap->clearmap) {
+            bitmap_set(bitmap->clearmap, 0,
+                       DIV_ROUND_UP(new, BITMAP_SUMMARY_PAGES));
+        }
+
+        /* We don't have a way to safely extend the sentmap
+         * with RCU; so mark it as missing, entry to postcopy
+         * will fail.
+         */
+        bitmap->unsentmap = NULL;
+
+        atomic_rcu_set(&migration_bitmap_rcu, bitmap);
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+        migration_dirty_pages += new - old;
+        call_rcu(old_bitmap, migration_bitmap_free, rcu);
+    }
+}
+
+/*
+ * 'expected' is the value you expect the bitmap mostly to be full
+ * of; it won't bother printing lines that are all this value.
+ * If 'todump' is null the migration bitmap is dumped.
+ */
+void ram_debug_dump_bitmap(unsigned long *todump, bool expected)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    int64_t cur;
+    int64_t linelen = 128;
+    char linebuf[129];
+
+    if (!todump) {
+        todump = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    }
+
+    for (cur = 0; cur < ram_pages; cur += linelen) {
+        int64_t curb;
+        bool found = false;
+        /*
+         * Last line; catch the case where the line length
+         * is longer than remaining ram
+         */
+        if (cur + linelen > ram_pages) {
+            linelen = ram_pages - cur;
+        }
+        for (curb = 0; curb < linelen; curb++) {
+            bool thisbit = test_bit(cur + curb, todump);
+            linebuf[curb] = thisbit ? '1' : '.';
+            found = found || (thisbit != expected);
+        }
+        if (found) {
+            linebuf[curb] = '\0';
+            fprintf(stderr,  "0x%08" PRIx64 " : %s\n", cur, linebuf);
+        }
+    }
+}
+
+/* **** functions for postcopy ***** */
+
+void ram_postcopy_migrated_memory_release(MigrationState *ms)
+{
+    struct RAMBlock *block;
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long range = first + (block->used_length >> TARGET_PAGE_BITS);
+        unsigned long run_start = find_next_zero_bit(bitmap, range, first);
+
+        while (run_start < range) {
+            unsigned long run_end = find_next_bit(bitmap, range, run_start + 1);
+            ram_discard_range(NULL, block->idstr, run_start << TARGET_PAGE_BITS,
+                              (run_end - run_start) << TARGET_PAGE_BITS);
+            run_start = find_next_zero_bit(bitmap, range, run_end + 1);
+        }
+    }
+}
+
+/*
+ * Callback from postcopy_each_ram_send_discard for each RAMBlock
+ * Note: At this point the 'unsentmap' is the processed bitmap combined
+ *       with the dirtymap; so a '1' means it's either dirty or unsent.
+ * start,length: Indexes into the bitmap for the first bit
+ *            representing the named block and length in target-pages
+ */
+static int postcopy_send_discard_bm_ram(MigrationState *ms,
+                                        PostcopyDiscardState *pds,
+                                        unsigned long start,
+                                        unsigned long length)
+{
+    unsigned long end = start + length; /* one after the end */
+    unsigned long current;
+    unsigned long *unsentmap;
+
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    for (current = start; current < end; ) {
+        unsigned long one = find_next_bit(unsentmap, end, current);
+
+        if (one <= end) {
+            unsigned long zero = find_next_zero_bit(unsentmap, end, one + 1);
+            unsigned long discard_length;
+
+            if (zero >= end) {
+                discard_length = end - one;
+            } else {
+                discard_length = zero - one;
+            }
+            if (discard_length) {
+                postcopy_discard_send_range(ms, pds, one, discard_length);
+            }
+            current = one + discard_length;
+        } else {
+            current = one;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Utility for the outgoing postcopy code.
+ *   Calls postcopy_send_discard_bm_ram for each RAMBlock
+ *   passing it bitmap indexes and name.
+ * Returns: 0 on success
+ * (qemu_ram_foreach_block ends up passing unscaled lengths
+ *  which would mean postcopy code would have to deal with target page)
+ */
+static int postcopy_each_ram_send_discard(MigrationState *ms)
+{
+    struct RAMBlock *block;
+    int ret;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        PostcopyDiscardState *pds = postcopy_discard_send_init(ms,
+                                                               first,
+                                                               block->idstr);
+
+        /*
+         * Postcopy sends chunks of bitmap over the wire, but it
+         * just needs indexes at this point, avoids it having
+         * target page specific code.
+         */
+        ret = postcopy_send_discard_bm_ram(ms, pds, first,
+                                    block->used_length >> TARGET_PAGE_BITS);
+        postcopy_discard_send_finish(ms, pds);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Helper for postcopy_chunk_hostpages; it's called twice to cleanup
+ *   the two bitmaps, that are similar, but one is inverted.
+ *
+ * We search for runs of target-pages that don't start or end on a
+ * host page boundary;
+ * unsent_pass=true: Cleans up partially unsent host pages by searching
+ *                 the unsentmap
+ * unsent_pass=false: Cleans up partially dirty host pages by searching
+ *                 the main migration bitmap
+ *
+ */
+static void postcopy_chunk_hostpages_pass(MigrationState *ms, bool unsent_pass,
+                                          RAMBlock *block,
+                                          PostcopyDiscardState *pds)
+{
+    unsigned long *bitmap;
+    unsigned long *unsentmap;
+    unsigned int host_ratio = qemu_host_page_size / TARGET_PAGE_SIZE;
+    unsigned long first = block->offset >> TARGET_PAGE_BITS;
+    unsigned long len = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long last = first + (len - 1);
+    unsigned long run_start;
+
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+
+    if (unsent_pass) {
+        /* Find a sent page */
+        run_start = find_next_zero_bit(unsentmap, last + 1, first);
+    } else {
+        /* Find a dirty page */
+        run_start = find_next_bit(bitmap, last + 1, first);
+    }
+
+    while (run_start <= last) {
+        bool do_fixup = false;
+        unsigned long fixup_start_addr;
+        unsigned long host_offset;
+
+        /*
+         * If the start of this run of pages is in the middle of a host
+         * page, then we need to fixup this host page.
+         */
+        host_offset = run_start % host_ratio;
+        if (host_offset) {
+            do_fixup = true;
+            run_start -= host_offset;
+            fixup_start_addr = run_start;
+            /* For the next pass */
+            run_start = run_start + host_ratio;
+        } else {
+            /* Find the end of this run */
+            unsigned long run_end;
+            if (unsent_pass) {
+                run_end = find_next_bit(unsentmap, last + 1, run_start + 1);
+            } else {
+                run_end = find_next_zero_bit(bitmap, last + 1, run_start + 1);
+            }
+            /*
+             * If the end isn't at the start of a host page, then the
+             * run doesn't finish at the end of a host page
+             * and we need to discard.
+             */
+            host_offset = run_end % host_ratio;
+            if (host_offset) {
+                do_fixup = true;
+                fixup_start_addr = run_end - host_offset;
+                /*
+                 * This host page has gone, the next loop iteration starts
+                 * from after the fixup
+                 */
+                run_start = fixup_start_addr + host_ratio;
+            } else {
+                /*
+                 * No discards on this iteration, next loop starts from
+                 * next sent/dirty page
+                 */
+                run_start = run_end + 1;
+            }
+        }
+
+        if (do_fixup) {
+            unsigned long page;
+
+            /* Tell the destination to discard this page */
+            if (unsent_pass || !test_bit(fixup_start_addr, unsentmap)) {
+                /* For the unsent_pass we:
+                 *     discard partially sent pages
+                 * For the !unsent_pass (dirty) we:
+                 *     discard partially dirty pages that were sent
+                 *     (any partially sent pages were already discarded
+                 *     by the previous unsent_pass)
+                 */
+                postcopy_discard_send_range(ms, pds, fixup_start_addr,
+                                            host_ratio);
+            }
+
+            /* Clean up the bitmap */
+            for (page = fixup_start_addr;
+                 page < fixup_start_addr + host_ratio; page++) {
+                /* All pages in this host page are now not sent */
+                set_bit(page, unsentmap);
+
+                /*
+                 * Remark them as dirty, updating the count for any pages
+                 * that weren't previously dirty.
+                 */
+                migration_dirty_pages += !test_and_set_bit(page, bitmap);
+                set_bit(page >> BITMAP_SUMMARY_SHIFT,
+                        atomic_rcu_read(&migration_bitmap_rcu)->summary);
+            }
+        }
+
+        if (unsent_pass) {
+            /* Find the next sent page for the next iteration */
+            run_start = find_next_zero_bit(unsentmap, last + 1,
+                                           run_start);
+        } else {
+            /* Find the next dirty page for the next iteration */
+            run_start = find_next_bit(bitmap, last + 1, run_start);
+        }
+    }
+}
+
+/*
+ * Utility for the outgoing postcopy code.
+ *
+ * Discard any partially sent host-page size chunks, mark any partially
+ * dirty host-page size chunks as all dirty.
+ *
+ * Returns: 0 on success
+ */
+static int postcopy_chunk_hostpages(MigrationState *ms)
+{
+    struct RAMBlock *block;
+
+    if (qemu_host_page_size == TARGET_PAGE_SIZE) {
+        /* Easy case - TPS==HPS - nothing to be done */
+        return 0;
+    }
+
+    /* Easiest way to make sure we don't resume in the middle of a host-page */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset     = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+
+        PostcopyDiscardState *pds =
+                         postcopy_discard_send_init(ms, first, block->idstr);
+
+        /* First pass: Discard all partially sent host pages */
+        postcopy_chunk_hostpages_pass(ms, true, block, pds);
+        /*
+         * Second pass: Ensure that all partially dirty host pages are made
+         * fully dirty.
+         */
+        postcopy_chunk_hostpages_pass(ms, false, block, pds);
+
+        postcopy_discard_send_finish(ms, pds);
+    } /* ram_list loop */
+
+    return 0;
+}
+
+/*
+ * Transmit the set of pages to be discarded after precopy to the target
+ * these are pages that:
+ *     a) Have been previously transmitted but are now dirty again
+ *     b) Pages that have never been transmitted, this ensures that
+ *        any pages on the destination that have been mapped by background
+ *        tasks get discarded (transparent huge pages is the specific concern)
+ * Hopefully this is pretty sparse
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    int ret;
+    unsigned long *bitmap, *unsentmap;
+
+    rcu_read_lock();
+
+    /* This should be our last sync, the src is now paused */
+    migration_bitmap_sync();
+
+    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
+    if (!unsentmap) {
+        /* We don't have a safe way to resize the sentmap, so
+         * if the bitmap was resized it will be NULL at this
+         * point.
+         */
+        error_report("migration ram resized during precopy phase");
+        rcu_read_unlock();
+        return -EINVAL;
+    }
+
+    /* Deal with TPS != HPS */
+    ret = postcopy_chunk_hostpages(ms);
+    if (ret) {
+        rcu_read_unlock();
+        return ret;
+    }
+
+    /*
+     * Update the unsentmap to be unsentmap = unsentmap | dirty
+     */
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    bitmap_or(unsentmap, unsentmap, bitmap,
+               last_ram_offset() >> TARGET_PAGE_BITS);
+
+
+    trace_ram_postcopy_send_discard_bitmap();
+#ifdef DEBUG_POSTCOPY
+    ram_debug_dump_bitmap(unsentmap, true);
+#endif
+
+    ret = postcopy_each_ram_send_discard(ms);
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * At the start of the postcopy phase of migration, any now-dirty
+ * precopied pages are discarded.
+ *
+ * start, length describe a byte address range within the RAMBlock
+ *
+ * Returns 0 on success.
+ */
+int ram_discard_range(MigrationIncomingState *mis,
+                      const char *block_name,
+                      uint64_t start, size_t length)
+{
+    int ret = -1;
+
+    rcu_read_lock();
+    RAMBlock *rb = qemu_ram_block_by_name(block_name);
+
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    uint8_t *host_startaddr = rb->host + start;
+
+    if ((uintptr_t)host_startaddr & (qemu_host_page_size - 1)) {
+        error_report("ram_discard_range: Unaligned start address: %p",
+                     host_startaddr);
+        goto err;
+    }
+
+    if ((start + length) <= rb->used_length) {
+        uint8_t *host_endaddr = host_startaddr + length;
+        if ((uintptr_t)host_endaddr & (qemu_host_page_size - 1)) {
+            error_report("ram_discard_range: Unaligned end address: %p",
+                         host_endaddr);
+            goto err;
+        }
+        ret = postcopy_ram_discard_range(mis, host_startaddr, length);
+    } else {
+        error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
+                     "/%zx/" RAM_ADDR_FMT")",
+                     block_name, start, length, rb->used_length);
+    }
+
+err:
+    rcu_read_unlock();
+
+    return ret;
+}
+
+static int ram_save_init_globals(void)
+{
+    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    uint64_t ignored_bytes = 0;
+    RAMBlock *block;
+    CPUState *cpu;
+
+    dirty_rate_high_cnt = 0;
+    bitmap_sync_count = 0;
+    migration_bitmap_sync_init();
+    qemu_mutex_init(&migration_bitmap_mutex);
+
+    if (migrate_use_xbzrle()) {
+        XBZRLE_cache_lock();
+        ZERO_TARGET_PAGE = g_malloc0(TARGET_PAGE_SIZE);
+        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                                  TARGET_PAGE_SIZE,
+                                  TARGET_PAGE_SIZE);
+        if (!XBZRLE.cache) {
+            XBZRLE_cache_unlock();
+            error_report("Error creating cache");
+            return -1;
+        }
+        XBZRLE_cache_unlock();
+
+        /* We prefer not to abort if there is no memory */
+        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+        if (!XBZRLE.encoded_buf) {
+            error_report("Error allocating encoded_buf");
+            return -1;
+        }
+
+        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+        if (!XBZRLE.current_buf) {
+            error_report("Error allocating current_buf");
+            g_free(XBZRLE.encoded_buf);
+            XBZRLE.encoded_buf = NULL;
+            return -1;
+        }
+
+        acct_clear();
+    }
+
+    /* For memory_global_dirty_log_start below.  */
+    qemu_mutex_lock_iothread();
+
+    qemu_mutex_lock_ramlist();
+    rcu_read_lock();
+    bytes_transferred = 0;
+    reset_ram_globals();
+    iteration_history_reset();
+
+    migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
+    /* Skip setting bitmap if there is no RAM */
+    if (ram_bytes_total()) {
+        ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+        migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
+        bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+        migration_bitmap_rcu->summary =
+            migration_bitmap_summary_new(ram_bitmap_pages);
+        migration_bitmap_rcu->clearmap =
+            migration_bitmap_clearmap_new(ram_bitmap_pages);
+
+        if (migrate_postcopy_ram()) {
+            migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
+            bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+        }
+
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (ramblock_is_ignored(block)) {
+                bitmap_clear(migration_bitmap_rcu->bmap,
+                             block->offset >> TARGET_PAGE_BITS,
+                             block->used_length >> TARGET_PAGE_BITS);
+                ignored_bytes += block->used_length;
+            }
+        }
+    }
+
+    /*
+     * Count the total number of pages used by ram blocks not including any
+     * gaps due to alignment or unplugs.
+     */
+    migration_dirty_pages = (ram_bytes_total() - ignored_bytes) >>
+                            TARGET_PAGE_BITS;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+    }
+
+    migration_bitmap_sync_threads_create();
+    memory_global_dirty_log_start();
+    migration_bitmap_sync();
+    qemu_mutex_unlock_ramlist();
+    qemu_mutex_unlock_iothread();
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
+ * long-running RCU critical section.  When rcu-reclaims in the code
+ * start to become numerous it will be necessary to reduce the
+ * granularity of these critical sections.
+ */
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    Error *local_err = NULL;
+
+    precopy_notify(PRECOPY_NOTIFY_SETUP);
+
+    /* migration has already setup the bitmap, reuse it. */
+    if (!migration_in_colo_state()) {
+        if (ram_save_init_globals() < 0) {
+            return -1;
+         }
+    }
+
+    if (multifd_save_setup(&local_err) < 0 ||
+        postcopy_preempt_save_setup(&local_err) < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    if (migrate_use_mapped_ram()) {
+        mapped_ram_state = mapped_ram_setup(true, &local_err);
+        if (!mapped_ram_state) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
+    rcu_read_lock();
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->used_length);
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
+        if (mapped_ram_state) {
+            mapped_ram_save_block_header(f, block);
+        }
+    }
+
+    rcu_read_unlock();
+
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    int done = 0;
+
+    rcu_read_lock();
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    /* Read version before ram_list.blocks */
+    smp_rmb();
+
+    ram_apply_free_page_hints();
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int pages;
+
+        pages = ram_find_and_save_block(f, false, &bytes_transferred);
+        /* no more pages to sent */
+        if (pages == 0) {
+            done = 1;
+            break;
+        }
+        acct_info.iterations++;
+
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                trace_ram_save_iterate_big_wait(t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+    flush_compressed_data(f);
+    if (multifd_send_sync_main(f) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    if (mapped_ram_state && mapped_ram_sync(mapped_ram_state) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    rcu_read_unlock();
+
+    /*
+     * Must occur before EOS (or any QEMUFile operation)
+     * because of RDMA protocol.
+     */
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    bytes_transferred += 8;
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return done;
+}
+
+/* Called with iothread lock */
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    precopy_notify(PRECOPY_NOTIFY_COMPLETE);
+    rcu_read_lock();
+
+    if (!migration_in_postcopy(migrate_get_current())) {
+        migration_bitmap_sync();
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int pages;
+
+        pages = ram_find_and_save_block(f, !migration_in_colo_state(),
+                                        &bytes_transferred);
+        /* no more blocks to sent */
+        if (pages == 0) {
+            break;
+        }
+    }
+
+    flush_compressed_data(f);
+    if (multifd_send_sync_main(f) < 0) {
+        qemu_file_set_error(f, -EIO);
+    }
+    if (mapped_ram_state &&
+        (mapped_ram_sync(mapped_ram_state) < 0 ||
+         mapped_ram_save_bitmaps(mapped_ram_state) < 0)) {
+        qemu_file_set_error(f, -EIO);
+    }
+    if (postcopy_preempt_out) {
+        Error *local_err = NULL;
+
+        if (postcopy_preempt_send(NULL, 0, POSTCOPY_PREEMPT_FLAG_EOS,
+                                  &local_err) < 0) {
+            error_report_err(local_err);
+            qemu_file_set_error(f, -EIO);
+        }
+    }
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+    rcu_read_unlock();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
+                             uint64_t *non_postcopiable_pending,
+                             uint64_t *postcopiable_pending)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (migrate_background_snapshot()) {
+        /* Each page is saved once, as it was when the snapshot started */
+        qemu_mutex_lock(&snapshot.lock);
+        remaining_size = (ram_save_remaining() + snapshot.copies) *
+                         TARGET_PAGE_SIZE;
+        qemu_mutex_unlock(&snapshot.lock);
+    } else if (!migration_in_postcopy(migrate_get_current()) &&
+               remaining_size < max_size) {
+        qemu_mutex_lock_iothread();
+        rcu_read_lock();
+        migration_bitmap_sync();
+        rcu_read_unlock();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+
+    /* We can do postcopy, and all the data is postcopiable */
+    *postcopiable_pending += remaining_size;
 }
 
-/*
- * Utility for the outgoing postcopy code.
- *
- * Discard any partially sent host-page size chunks, mark any partially
- * dirty host-page size chunks as all dirty.
- *
- * Returns: 0 on success
- */
-static int postcopy_chunk_hostpages(MigrationState *ms)
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
-    struct RAMBlock *block;
+    unsigned int xh_len;
+    int xh_flags;
+    uint8_t *loaded_data;
 
-    if (qemu_host_page_size == TARGET_PAGE_SIZE) {
-        /* Easy case - TPS==HPS - nothing to be done */
-        return 0;
+    if (!xbzrle_decoded_buf) {
+        xbzrle_decoded_buf = g_malloc(TARGET_PAGE_SIZE);
     }
+    loaded_data = xbzrle_decoded_buf;
 
-    /* Easiest way to make sure we don't resume in the middle of a host-page */
-    last_seen_block = NULL;
-    last_sent_block = NULL;
-    last_offset     = 0;
-
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
 
-        PostcopyDiscardState *pds =
-                         postcopy_discard_send_init(ms, first, block->idstr);
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        error_report("Failed to load XBZRLE page - wrong compression!");
+        return -1;
+    }
 
-        /* First pass: Discard all partially sent host pages */
-        postcopy_chunk_hostpages_pass(ms, true, block, pds);
-        /*
-         * Second pass: Ensure that all partially dirty host pages are made
-         * fully dirty.
-         */
-        postcopy_chunk_hostpages_pass(ms, false, block, pds);
+    if (xh_len > TARGET_PAGE_SIZE) {
+        error_report("Failed to load XBZRLE page - len overflow!");
+        return -1;
+    }
+    /* load data and decode */
+    qemu_get_buffer_in_place(f, &loaded_data, xh_len);
 
-        postcopy_discard_send_finish(ms, pds);
-    } /* ram_list loop */
+    /* decode RLE */
+    if (xbzrle_decode_buffer(loaded_data, xh_len, host,
+                             TARGET_PAGE_SIZE) == -1) {
+        error_report("Failed to load XBZRLE page - decode error!");
+        return -1;
+    }
 
     return 0;
 }
 
+/* Must be called from within a rcu critical section.
+ * Returns a pointer from within the RCU-protected ram_list.
+ */
 /*
- * Transmit the set of pages to be discarded after precopy to the target
- * these are pages that:
- *     a) Have been previously transmitted but are now dirty again
- *     b) Pages that have never been transmitted, this ensures that
- *        any pages on the destination that have been mapped by background
- *        tasks get discarded (transparent huge pages is the specific concern)
- * Hopefully this is pretty sparse
+ * Read a RAMBlock ID from the stream f.
+ *
+ * f: Stream to read from
+ * flags: Page flags (mostly to see if it's a continuation of previous block)
  */
-int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
+                                              int flags)
 {
-    int ret;
-    unsigned long *bitmap, *unsentmap;
+    static RAMBlock *block = NULL;
+    char id[256];
+    uint8_t len;
 
-    rcu_read_lock();
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            error_report("Ack, bad migration stream!");
+            return NULL;
+        }
+        return block;
+    }
 
-    /* This should be our last sync, the src is now paused */
-    migration_bitmap_sync();
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
 
-    unsentmap = atomic_rcu_read(&migration_bitmap_rcu)->unsentmap;
-    if (!unsentmap) {
-        /* We don't have a safe way to resize the sentmap, so
-         * if the bitmap was resized it will be NULL at this
-         * point.
-         */
-        error_report("migration ram resized during precopy phase");
-        rcu_read_unlock();
-        return -EINVAL;
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("Can't find block %s", id);
+        return NULL;
     }
 
-    /* Deal with TPS != HPS */
-    ret = postcopy_chunk_hostpages(ms);
-    if (ret) {
-        rcu_read_unlock();
-        return ret;
-    }
+    return block;
+}
 
-    /*
-     * Update the unsentmap to be unsentmap = unsentmap | dirty
-     */
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    bitmap_or(unsentmap, unsentmap, bitmap,
-               last_ram_offset() >> TARGET_PAGE_BITS);
+static inline void *host_from_ram_block_offset(RAMBlock *block,
+                                               ram_addr_t offset)
+{
+    if (!offset_in_ramblock(block, offset)) {
+        return NULL;
+    }
 
+    return block->host + offset;
+}
 
-    trace_ram_postcopy_send_discard_bitmap();
-#ifdef DEBUG_POSTCOPY
-    ram_debug_dump_bitmap(unsentmap, true);
-#endif
+/* COLO Secondary: set while the pages of each checkpoint are loaded into
+ * the RAM cache, see colo_init_ram_cache.
+ */
+static bool ram_cache_enabled;
 
-    ret = postcopy_each_ram_send_discard(ms);
-    rcu_read_unlock();
+static inline void *colo_cache_from_block_offset(RAMBlock *block,
+                                                 ram_addr_t offset)
+{
+    if (!offset_in_ramblock(block, offset)) {
+        return NULL;
+    }
 
-    return ret;
+    set_bit(offset >> TARGET_PAGE_BITS, block->colo_bmap);
+    return block->colo_cache + offset;
 }
 
 /*
- * At the start of the postcopy phase of migration, any now-dirty
- * precopied pages are discarded.
+ * colo_init_ram_cache: Copy guest RAM into a cache that receives the pages
+ *   of the following COLO checkpoints
  *
- * start, length describe a byte address range within the RAMBlock
+ * A checkpoint only carries the pages dirtied since the previous one, and
+ * it is streamed instead of buffered, so loading it into guest RAM would
+ * leave a mix of two checkpoints if the Primary failed halfway through.
+ * The pages go to the cache instead, and colo_flush_ram_cache copies them
+ * to guest RAM once the whole checkpoint is in.
  *
- * Returns 0 on success.
+ * Returns 0 for success or -ENOMEM
  */
-int ram_discard_range(MigrationIncomingState *mis,
-                      const char *block_name,
-                      uint64_t start, size_t length)
+int colo_init_ram_cache(void)
 {
-    int ret = -1;
+    RAMBlock *block;
 
     rcu_read_lock();
-    RAMBlock *rb = qemu_ram_block_by_name(block_name);
-
-    if (!rb) {
-        error_report("ram_discard_range: Failed to find block '%s'",
-                     block_name);
-        goto err;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->colo_cache = qemu_anon_ram_alloc(block->max_length, NULL);
+        if (!block->colo_cache) {
+            error_report("Can't allocate COLO cache of " RAM_ADDR_FMT
+                         " bytes for block %s", block->max_length,
+                         block->idstr);
+            rcu_read_unlock();
+            colo_release_ram_cache();
+            return -ENOMEM;
+        }
+        memcpy(block->colo_cache, block->host, block->used_length);
+        block->colo_bmap = bitmap_new(block->max_length >> TARGET_PAGE_BITS);
     }
+    rcu_read_unlock();
+    ram_cache_enabled = true;
 
-    uint8_t *host_startaddr = rb->host + start;
+    return 0;
+}
 
-    if ((uintptr_t)host_startaddr & (qemu_host_page_size - 1)) {
-        error_report("ram_discard_range: Unaligned start address: %p",
-                     host_startaddr);
-        goto err;
-    }
+/*
+ * colo_flush_ram_cache: Copy the pages of the last COLO checkpoint from the
+ *   cache to guest RAM
+ *
+ * Dirty pages tend to be clustered, so runs of them are copied at once.
+ */
+void colo_flush_ram_cache(void)
+{
+    RAMBlock *block;
+    unsigned long pages, first, last;
+    uint64_t flushed = 0;
 
-    if ((start + length) <= rb->used_length) {
-        uint8_t *host_endaddr = host_startaddr + length;
-        if ((uintptr_t)host_endaddr & (qemu_host_page_size - 1)) {
-            error_report("ram_discard_range: Unaligned end address: %p",
-                         host_endaddr);
-            goto err;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        first = find_first_bit(block->colo_bmap, pages);
+        while (first < pages) {
+            last = find_next_zero_bit(block->colo_bmap, pages, first + 1);
+            memcpy(block->host + (first << TARGET_PAGE_BITS),
+                   block->colo_cache + (first << TARGET_PAGE_BITS),
+                   (last - first) << TARGET_PAGE_BITS);
+            bitmap_clear(block->colo_bmap, first, last - first);
+            flushed += last - first;
+            first = find_next_bit(block->colo_bmap, pages, last);
         }
-        ret = postcopy_ram_discard_range(mis, host_startaddr, length);
-    } else {
-        error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
-                     "/%zx/" RAM_ADDR_FMT")",
-                     block_name, start, length, rb->used_length);
     }
+    rcu_read_unlock();
+    trace_colo_flush_ram_cache(flushed);
+}
 
-err:
+void colo_release_ram_cache(void)
+{
+    RAMBlock *block;
+
+    ram_cache_enabled = false;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->max_length);
+            block->colo_cache = NULL;
+        }
+        g_free(block->colo_bmap);
+        block->colo_bmap = NULL;
+    }
     rcu_read_unlock();
+}
 
-    return ret;
+/*
+ * If a page (or a whole RDMA chunk) has been
+ * determined to be zero, then zap it.
+ */
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+{
+    if (ch != 0 || !is_zero_range(host, size)) {
+        memset(host, ch, size);
+    }
 }
 
-static int ram_save_init_globals(void)
+static void *do_data_decompress(void *opaque)
 {
-    int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    DecompressParam *param = opaque;
+    uint8_t *des;
+    int len;
 
-    dirty_rate_high_cnt = 0;
-    bitmap_sync_count = 0;
-    migration_bitmap_sync_init();
-    qemu_mutex_init(&migration_bitmap_mutex);
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->des) {
+            des = param->des;
+            len = param->len;
+            param->des = 0;
+            qemu_mutex_unlock(&param->mutex);
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
-        ZERO_TARGET_PAGE = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            XBZRLE_cache_unlock();
-            error_report("Error creating cache");
-            return -1;
-        }
-        XBZRLE_cache_unlock();
+            /* Decompressing will fail in some case, especially when
+             * the page is dirtied when doing the compression, it's
+             * not a problem because the dirty page will be retransferred
+             * and the failure won't break the data in other pages.
+             */
+            migration_decompress(param->comp, des, TARGET_PAGE_SIZE,
+                                 param->compbuf, len);
 
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            error_report("Error allocating encoded_buf");
-            return -1;
-        }
+            qemu_mutex_lock(&decomp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
 
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            error_report("Error allocating current_buf");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
-            return -1;
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
         }
-
-        acct_clear();
     }
+    qemu_mutex_unlock(&param->mutex);
 
-    /* For memory_global_dirty_log_start below.  */
-    qemu_mutex_lock_iothread();
+    return NULL;
+}
 
-    qemu_mutex_lock_ramlist();
-    rcu_read_lock();
-    bytes_transferred = 0;
-    reset_ram_globals();
+static void wait_for_decompress_done(void)
+{
+    int idx, thread_count;
 
-    migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
-    /* Skip setting bitmap if there is no RAM */
-    if (ram_bytes_total()) {
-        ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-        migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
-        bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+    if (!migrate_use_compression()) {
+        return;
+    }
 
-        if (migrate_postcopy_ram()) {
-            migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
-            bitmap_set(migration_bitmap_rcu->unsentmap, 0, ram_bitmap_pages);
+    thread_count = migrate_decompress_threads();
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
         }
     }
+    qemu_mutex_unlock(&decomp_done_lock);
+}
 
-    /*
-     * Count the total number of pages used by ram blocks not including any
-     * gaps due to alignment or unplugs.
-     */
-    migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
-
-    memory_global_dirty_log_start();
-    migration_bitmap_sync();
-    qemu_mutex_unlock_ramlist();
-    qemu_mutex_unlock_iothread();
-    rcu_read_unlock();
+void migrate_decompress_threads_create(void)
+{
+    MigrationCompressMethod method = migrate_compress_method();
+    int i, thread_count;
 
-    return 0;
+    thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, thread_count);
+    decomp_param = g_new0(DecompressParam, thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < thread_count; i++) {
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        decomp_param[i].compbuf =
+            g_malloc0(migration_compress_bound(method, TARGET_PAGE_SIZE));
+        decomp_param[i].comp = migration_compressor_new(method, 0,
+                                                        &error_abort);
+        decomp_param[i].done = true;
+        decomp_param[i].quit = false;
+        qemu_thread_create(decompress_threads + i, "decompress",
+                           do_data_decompress, decomp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
 }
 
-/* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
- * long-running RCU critical section.  When rcu-reclaims in the code
- * start to become numerous it will be necessary to reduce the
- * granularity of these critical sections.
- */
-
-static int ram_save_setup(QEMUFile *f, void *opaque)
+void migrate_decompress_threads_join(void)
 {
-    RAMBlock *block;
+    int i, thread_count;
 
-    /* migration has already setup the bitmap, reuse it. */
-    if (!migration_in_colo_state()) {
-        if (ram_save_init_globals() < 0) {
-            return -1;
-         }
+    thread_count = migrate_decompress_threads();
+    for (i = 0; i < thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+        migration_compressor_free(decomp_param[i].comp);
     }
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+}
 
-    rcu_read_lock();
+/* Parallel loading of the main stream (x-load-threads).
+ *
+ * The incoming coroutine still parses the stream, but normal and zero
+ * pages are only collected in a small batch buffer, which stays in the
+ * cache; copying them into guest memory, and taking the page faults
+ * that come with populating it, is left to a pool of threads.  Within a
+ * RAM section each page is sent at most once, as the source only
+ * resyncs its dirty bitmap between sections, so batches can be loaded
+ * in any order.  The coroutine waits for all of them before it returns
+ * from ram_load, which keeps device state and the next round of pages
+ * ordered after them.
+ */
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+#define LOAD_BATCH_PAGES 64
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->used_length);
-    }
+typedef struct {
+    unsigned int used;
+    void *host[LOAD_BATCH_PAGES];
+    /* Fill byte for RAM_SAVE_FLAG_ZERO pages, -1 to copy from data */
+    int fill[LOAD_BATCH_PAGES];
+    uint8_t *data;
+} LoadBatch;
 
-    rcu_read_unlock();
+typedef struct {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* The fields below are protected by mutex */
+    bool quit;
+    bool start;
+    /* Owned by the thread between start and done, swapped when idle */
+    LoadBatch *batch;
+    /* Protected by load_done_lock */
+    bool done;
+} LoadParam;
 
-    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
-    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+static LoadParam *load_param;
+static int load_thread_count;
+/* Batch being filled by the incoming coroutine */
+static LoadBatch *load_batch;
+static QemuMutex load_done_lock;
+static QemuCond load_done_cond;
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+static LoadBatch *load_batch_new(void)
+{
+    LoadBatch *batch = g_new0(LoadBatch, 1);
 
-    return 0;
+    batch->data = qemu_memalign(TARGET_PAGE_SIZE,
+                                LOAD_BATCH_PAGES * TARGET_PAGE_SIZE);
+    return batch;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static void load_batch_free(LoadBatch *batch)
 {
-    int ret;
-    int i;
-    int64_t t0;
-    int done = 0;
+    qemu_vfree(batch->data);
+    g_free(batch);
+}
 
-    rcu_read_lock();
-    if (ram_list.version != last_version) {
-        reset_ram_globals();
+static void load_batch_run(LoadBatch *batch)
+{
+    unsigned int i;
+
+    for (i = 0; i < batch->used; i++) {
+        if (batch->fill[i] < 0) {
+            memcpy(batch->host[i], batch->data + i * TARGET_PAGE_SIZE,
+                   TARGET_PAGE_SIZE);
+        } else {
+            ram_handle_compressed(batch->host[i], batch->fill[i],
+                                  TARGET_PAGE_SIZE);
+        }
     }
+    batch->used = 0;
+}
 
-    /* Read version before ram_list.blocks */
-    smp_rmb();
+static void *do_data_load(void *opaque)
+{
+    LoadParam *param = opaque;
+    LoadBatch *batch;
 
-    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            batch = param->batch;
+            qemu_mutex_unlock(&param->mutex);
 
-    t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int pages;
+            load_batch_run(batch);
 
-        pages = ram_find_and_save_block(f, false, &bytes_transferred);
-        /* no more pages to sent */
-        if (pages == 0) {
-            done = 1;
-            break;
+            qemu_mutex_lock(&load_done_lock);
+            param->done = true;
+            qemu_cond_signal(&load_done_cond);
+            qemu_mutex_unlock(&load_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
         }
-        acct_info.iterations++;
+    }
+    qemu_mutex_unlock(&param->mutex);
 
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000;
-            if (t1 > MAX_WAIT) {
-                trace_ram_save_iterate_big_wait(t1, i);
+    return NULL;
+}
+
+/* Swap the full batch with the empty one of the next idle thread */
+static void load_batch_dispatch(void)
+{
+    LoadBatch *batch;
+    int idx;
+
+    qemu_mutex_lock(&load_done_lock);
+    while (true) {
+        for (idx = 0; idx < load_thread_count; idx++) {
+            if (load_param[idx].done) {
                 break;
             }
         }
-        i++;
+        if (idx < load_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&load_done_cond, &load_done_lock);
     }
-    flush_compressed_data(f);
-    rcu_read_unlock();
+    load_param[idx].done = false;
+    qemu_mutex_unlock(&load_done_lock);
+
+    qemu_mutex_lock(&load_param[idx].mutex);
+    batch = load_param[idx].batch;
+    load_param[idx].batch = load_batch;
+    load_param[idx].start = true;
+    qemu_cond_signal(&load_param[idx].cond);
+    qemu_mutex_unlock(&load_param[idx].mutex);
+    load_batch = batch;
+}
 
-    /*
-     * Must occur before EOS (or any QEMUFile operation)
-     * because of RDMA protocol.
-     */
-    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+/**
+ * load_queue_page: Queue a page to be loaded by the load threads
+ *
+ * Returns: where to read the contents of the page; only valid if
+ *          @fill is negative.
+ *
+ * @host: the page in guest memory
+ * @fill: byte to fill the page with, or -1 to copy the returned buffer
+ */
+static uint8_t *load_queue_page(void *host, int fill)
+{
+    unsigned int i;
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-    bytes_transferred += 8;
+    if (load_batch->used == LOAD_BATCH_PAGES) {
+        load_batch_dispatch();
+    }
+    i = load_batch->used++;
+    load_batch->host[i] = host;
+    load_batch->fill[i] = fill;
+    return load_batch->data + i * TARGET_PAGE_SIZE;
+}
 
-    ret = qemu_file_get_error(f);
-    if (ret < 0) {
-        return ret;
+static void wait_for_load_done(void)
+{
+    int idx;
+
+    if (!load_param) {
+        return;
+    }
+    if (load_batch->used) {
+        load_batch_dispatch();
     }
 
-    return done;
+    qemu_mutex_lock(&load_done_lock);
+    for (idx = 0; idx < load_thread_count; idx++) {
+        while (!load_param[idx].done) {
+            qemu_cond_wait(&load_done_cond, &load_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&load_done_lock);
 }
 
-/* Called with iothread lock */
-static int ram_save_complete(QEMUFile *f, void *opaque)
+void migrate_load_threads_create(void)
 {
-    rcu_read_lock();
+    int i;
 
-    if (!migration_in_postcopy(migrate_get_current())) {
-        migration_bitmap_sync();
+    load_thread_count = migrate_load_threads();
+    if (!load_thread_count) {
+        return;
+    }
+    load_param = g_new0(LoadParam, load_thread_count);
+    load_batch = load_batch_new();
+    qemu_mutex_init(&load_done_lock);
+    qemu_cond_init(&load_done_cond);
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_init(&load_param[i].mutex);
+        qemu_cond_init(&load_param[i].cond);
+        load_param[i].batch = load_batch_new();
+        load_param[i].done = true;
+        qemu_thread_create(&load_param[i].thread, "load",
+                           do_data_load, load_param + i,
+                           QEMU_THREAD_JOINABLE);
     }
+}
 
-    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
+void migrate_load_threads_join(void)
+{
+    int i;
 
-    /* try transferring iterative blocks of memory */
+    if (!load_param) {
+        return;
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_mutex_lock(&load_param[i].mutex);
+        load_param[i].quit = true;
+        qemu_cond_signal(&load_param[i].cond);
+        qemu_mutex_unlock(&load_param[i].mutex);
+    }
+    for (i = 0; i < load_thread_count; i++) {
+        qemu_thread_join(&load_param[i].thread);
+        qemu_mutex_destroy(&load_param[i].mutex);
+        qemu_cond_destroy(&load_param[i].cond);
+        load_batch_free(load_param[i].batch);
+    }
+    qemu_mutex_destroy(&load_done_lock);
+    qemu_cond_destroy(&load_done_cond);
+    load_batch_free(load_batch);
+    g_free(load_param);
+    load_param = NULL;
+    load_batch = NULL;
+}
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int pages;
+typedef struct {
+    struct MultiFDRecvState *state;
+    QemuThread thread;
+    /* Set under state->mutex once the channel has been accepted */
+    QIOChannel *c;
+    /* Posted by the main thread to start, and after each sync */
+    QemuSemaphore sem_sync;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+typedef struct MultiFDRecvState {
+    MultiFDRecvParams *params;
+    int count;
+    QIOChannel *listener;
+    /* Protects quit and the channel pointers */
+    QemuMutex mutex;
+    bool quit;
+    /* Posted once by each channel for every sync packet */
+    QemuSemaphore sem_sync;
+    bool failed;
+} MultiFDRecvState;
 
-        pages = ram_find_and_save_block(f, !migration_in_colo_state(),
-                                        &bytes_transferred);
-        /* no more blocks to sent */
-        if (pages == 0) {
-            break;
-        }
+/* Created and freed by the main thread */
+static MultiFDRecvState *multifd_recv_state;
+
+static int multifd_recv_init(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDInit init;
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+
+    if (multifd_rw_all(p->c, &iov, 1, false, false, errp) < 0) {
+        return -1;
     }
+    if (be32_to_cpu(init.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: bad magic %#x", be32_to_cpu(init.magic));
+        return -1;
+    }
+    if (be32_to_cpu(init.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: unsupported version %u",
+                   be32_to_cpu(init.version));
+        return -1;
+    }
+    if (be32_to_cpu(init.id) >= p->state->count) {
+        error_setg(errp, "multifd: channel %u out of range (%d channels)",
+                   be32_to_cpu(init.id), p->state->count);
+        return -1;
+    }
+    return 0;
+}
 
-    flush_compressed_data(f);
-    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    MultiFDPacket *packet = &p->packet;
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(*packet) };
+    RAMBlock *block = NULL;
+    uint32_t i, used;
+
+    if (multifd_rw_all(p->c, &iov, 1, false, false, errp) < 0) {
+        return -1;
+    }
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: bad packet magic %#x",
+                   be32_to_cpu(packet->magic));
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    used = be32_to_cpu(packet->pages);
+    if (used > MULTIFD_PAGES_PER_PACKET) {
+        error_setg(errp, "multifd: too many pages in packet (%u)", used);
+        return -1;
+    }
+    if (!used) {
+        return 0;
+    }
 
+    /* RAMBlocks are not unplugged while an incoming migration runs */
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    for (i = 0; block && i < used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+        void *host = host_from_ram_block_offset(block, offset);
+
+        if (!host || (offset & ~TARGET_PAGE_MASK)) {
+            rcu_read_unlock();
+            error_setg(errp, "multifd: illegal RAM offset " RAM_ADDR_FMT
+                       " in block %s", offset, packet->ramblock);
+            return -1;
+        }
+        p->iov[i].iov_base = host;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
     rcu_read_unlock();
+    if (!block) {
+        error_setg(errp, "multifd: unknown ramblock \"%s\"",
+                   packet->ramblock);
+        return -1;
+    }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
-    return 0;
+    return multifd_rw_all(p->c, p->iov, used, false, false, errp);
 }
 
-static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
-                             uint64_t *non_postcopiable_pending,
-                             uint64_t *postcopiable_pending)
+static void *multifd_recv_thread(void *opaque)
 {
-    uint64_t remaining_size;
+    MultiFDRecvParams *p = opaque;
+    MultiFDRecvState *state = p->state;
+    QIOChannelSocket *sioc;
+    Error *local_err = NULL;
+    uint32_t flags;
+    int i;
 
-    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    rcu_register_thread();
 
-    if (!migration_in_postcopy(migrate_get_current()) &&
-        remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        rcu_read_lock();
-        migration_bitmap_sync();
-        rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    sioc = qio_channel_socket_accept(QIO_CHANNEL_SOCKET(state->listener),
+                                     &local_err);
+    if (!sioc) {
+        goto out;
     }
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-incoming");
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
-    /* We can do postcopy, and all the data is postcopiable */
-    *postcopiable_pending += remaining_size;
-}
-
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
-{
-    unsigned int xh_len;
-    int xh_flags;
-    uint8_t *loaded_data;
+    qemu_mutex_lock(&state->mutex);
+    p->c = QIO_CHANNEL(sioc);
+    if (state->quit) {
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
+    qemu_mutex_unlock(&state->mutex);
 
-    if (!xbzrle_decoded_buf) {
-        xbzrle_decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    if (multifd_recv_init(p, &local_err) < 0) {
+        goto out;
     }
-    loaded_data = xbzrle_decoded_buf;
 
-    /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
-    xh_len = qemu_get_be16(f);
+    /* Wait until the main stream has set up the RAMBlocks */
+    qemu_sem_wait(&p->sem_sync);
 
-    if (xh_flags != ENCODING_FLAG_XBZRLE) {
-        error_report("Failed to load XBZRLE page - wrong compression!");
-        return -1;
+    while (!atomic_read(&state->quit)) {
+        if (multifd_recv_packet(p, &flags, &local_err) < 0) {
+            goto out;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
     }
 
-    if (xh_len > TARGET_PAGE_SIZE) {
-        error_report("Failed to load XBZRLE page - len overflow!");
-        return -1;
+out:
+    /* Errors are expected once the main thread has asked us to quit */
+    if (local_err && !atomic_read(&state->quit)) {
+        error_report_err(local_err);
+        atomic_set(&state->failed, true);
+        /* Do not leave the main thread waiting for our next sync */
+        for (i = 0; i < state->count; i++) {
+            qemu_sem_post(&state->sem_sync);
+        }
+    } else {
+        error_free(local_err);
     }
-    /* load data and decode */
-    qemu_get_buffer_in_place(f, &loaded_data, xh_len);
+    rcu_unregister_thread();
+    return NULL;
+}
 
-    /* decode RLE */
-    if (xbzrle_decode_buffer(loaded_data, xh_len, host,
-                             TARGET_PAGE_SIZE) == -1) {
-        error_report("Failed to load XBZRLE page - decode error!");
+/* Called from the main thread once the main channel has been accepted */
+int multifd_load_setup(QIOChannel *listener, Error **errp)
+{
+    MultiFDRecvState *state;
+    int i;
+
+    if (migrate_get_current()->parameters.tls_creds &&
+        *migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "multifd is not compatible with TLS");
         return -1;
     }
 
+    qio_channel_set_blocking(listener, true, NULL);
+
+    state = g_new0(MultiFDRecvState, 1);
+    state->count = migrate_multifd_channels();
+    state->params = g_new0(MultiFDRecvParams, state->count);
+    state->listener = listener;
+    object_ref(OBJECT(listener));
+    qemu_mutex_init(&state->mutex);
+    qemu_sem_init(&state->sem_sync, 0);
+    for (i = 0; i < state->count; i++) {
+        MultiFDRecvParams *p = &state->params[i];
+
+        p->state = state;
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_thread_create(&p->thread, "multifdrecv", multifd_recv_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+    multifd_recv_state = state;
     return 0;
 }
 
-/* Must be called from within a rcu critical section.
- * Returns a pointer from within the RCU-protected ram_list.
- */
-/*
- * Read a RAMBlock ID from the stream f.
- *
- * f: Stream to read from
- * flags: Page flags (mostly to see if it's a continuation of previous block)
- */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
-                                              int flags)
+void multifd_load_cleanup(void)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    MultiFDRecvState *state = multifd_recv_state;
+    int i;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            error_report("Ack, bad migration stream!");
-            return NULL;
-        }
-        return block;
+    if (!state) {
+        return;
     }
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+    qemu_mutex_lock(&state->mutex);
+    atomic_set(&state->quit, true);
+    qio_channel_shutdown(state->listener, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    for (i = 0; i < state->count; i++) {
+        if (state->params[i].c) {
+            qio_channel_shutdown(state->params[i].c,
+                                 QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+    }
+    qemu_mutex_unlock(&state->mutex);
 
-    block = qemu_ram_block_by_name(id);
-    if (!block) {
-        error_report("Can't find block %s", id);
-        return NULL;
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_post(&state->params[i].sem_sync);
     }
+    for (i = 0; i < state->count; i++) {
+        MultiFDRecvParams *p = &state->params[i];
 
-    return block;
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            qio_channel_close(p->c, NULL);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qio_channel_close(state->listener, NULL);
+    object_unref(OBJECT(state->listener));
+    qemu_mutex_destroy(&state->mutex);
+    qemu_sem_destroy(&state->sem_sync);
+    g_free(state->params);
+    g_free(state);
+    multifd_recv_state = NULL;
 }
 
-static inline void *host_from_ram_block_offset(RAMBlock *block,
-                                               ram_addr_t offset)
+/* Let the channels go once the main stream has described the RAMBlocks */
+static void multifd_recv_start(void)
 {
-    if (!offset_in_ramblock(block, offset)) {
-        return NULL;
-    }
+    int i;
 
-    return block->host + offset;
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
 }
 
-/*
- * If a page (or a whole RDMA chunk) has been
- * determined to be zero, then zap it.
+/* Wait until every channel has received the pages sent before the
+ * RAM_SAVE_FLAG_MULTIFD_SYNC that we just read.
  */
-void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+static int multifd_recv_sync_main(void)
 {
-    if (ch != 0 || !is_zero_range(host, size)) {
-        memset(host, ch, size);
+    MultiFDRecvState *state = multifd_recv_state;
+    int i;
+
+    if (!state) {
+        error_report("multifd sync received, but x-multifd is not enabled");
+        return -EINVAL;
     }
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_wait(&state->sem_sync);
+    }
+    if (atomic_read(&state->failed)) {
+        return -EIO;
+    }
+    for (i = 0; i < state->count; i++) {
+        qemu_sem_post(&state->params[i].sem_sync);
+    }
+    return 0;
 }
 
-static void *do_data_decompress(void *opaque)
-{
-    DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len;
+typedef struct PostcopyPreemptRecvState {
+    QemuThread thread;
+    QIOChannel *listener;
+    /* Protects quit and the channel pointer */
+    QemuMutex mutex;
+    QIOChannel *c;
+    bool quit;
+    /* Only used by the thread */
+    void *page;
+} PostcopyPreemptRecvState;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
+/* Created and freed by the main thread or the postcopy listen thread */
+static PostcopyPreemptRecvState *postcopy_preempt_recv_state;
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
-             * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
-             */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+static int postcopy_preempt_recv_page(PostcopyPreemptRecvState *state,
+                                      bool *eos, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyPreemptPacket packet;
+    struct iovec iov = { .iov_base = &packet, .iov_len = sizeof(packet) };
+    size_t pagesize = getpagesize();
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint32_t flags;
+    void *host = NULL;
+    int ret;
 
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
+    if (multifd_rw_all(state->c, &iov, 1, false, false, errp) < 0) {
+        return -1;
+    }
+    if (be32_to_cpu(packet.magic) != POSTCOPY_PREEMPT_MAGIC) {
+        error_setg(errp, "postcopy preempt: bad packet magic %#x",
+                   be32_to_cpu(packet.magic));
+        return -1;
+    }
+    flags = be32_to_cpu(packet.flags);
+    if (flags & POSTCOPY_PREEMPT_FLAG_EOS) {
+        *eos = true;
+        return 0;
+    }
+    if (be32_to_cpu(packet.len) != pagesize) {
+        error_setg(errp, "postcopy preempt: page size %u, expected %zu",
+                   be32_to_cpu(packet.len), pagesize);
+        return -1;
+    }
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
+    offset = be64_to_cpu(packet.offset);
+    packet.ramblock[sizeof(packet.ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet.ramblock);
+    if (block) {
+        host = host_from_ram_block_offset(block, offset);
     }
-    qemu_mutex_unlock(&param->mutex);
+    rcu_read_unlock();
+    if (!host || (offset & (pagesize - 1))) {
+        error_setg(errp, "postcopy preempt: illegal RAM offset " RAM_ADDR_FMT
+                   " in block %s", offset, packet.ramblock);
+        return -1;
+    }
+    trace_postcopy_preempt_recv_page(packet.ramblock, offset,
+                                     flags & POSTCOPY_PREEMPT_FLAG_ZERO);
 
-    return NULL;
+    if (flags & POSTCOPY_PREEMPT_FLAG_ZERO) {
+        ret = postcopy_place_page_zero(mis, host);
+    } else {
+        iov.iov_base = state->page;
+        iov.iov_len = pagesize;
+        if (multifd_rw_all(state->c, &iov, 1, false, false, errp) < 0) {
+            return -1;
+        }
+        ret = postcopy_place_page(mis, host, state->page);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "postcopy preempt: failed to place page");
+        return -1;
+    }
+    return 0;
 }
 
-static void wait_for_decompress_done(void)
+static void *postcopy_preempt_recv_thread(void *opaque)
 {
-    int idx, thread_count;
+    PostcopyPreemptRecvState *state = opaque;
+    QIOChannelSocket *sioc;
+    Error *local_err = NULL;
+    bool eos = false;
 
-    if (!migrate_use_compression()) {
-        return;
+    rcu_register_thread();
+
+    sioc = qio_channel_socket_accept(QIO_CHANNEL_SOCKET(state->listener),
+                                     &local_err);
+    if (!sioc) {
+        goto out;
+    }
+    qio_channel_set_name(QIO_CHANNEL(sioc),
+                         "migration-postcopy-preempt-incoming");
+    qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
+
+    qemu_mutex_lock(&state->mutex);
+    state->c = QIO_CHANNEL(sioc);
+    if (state->quit) {
+        qio_channel_shutdown(state->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+    qemu_mutex_unlock(&state->mutex);
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    while (!eos) {
+        if (postcopy_preempt_recv_page(state, &eos, &local_err) < 0) {
+            goto out;
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
+
+out:
+    /* Errors are expected once the main thread has asked us to quit */
+    if (local_err && !atomic_read(&state->quit)) {
+        MigrationIncomingState *mis = migration_incoming_get_current();
+
+        error_report_err(local_err);
+        qemu_file_set_error(mis->from_src_file, -EIO);
+    } else {
+        error_free(local_err);
+    }
+    rcu_unregister_thread();
+    return NULL;
 }
 
-void migrate_decompress_threads_create(void)
+/* Called from the main thread once the main channel has been accepted */
+int postcopy_preempt_load_setup(QIOChannel *listener, Error **errp)
 {
-    int i, thread_count;
+    PostcopyPreemptRecvState *state;
 
-    thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
-    decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
-        qemu_thread_create(decompress_threads + i, "decompress",
-                           do_data_decompress, decomp_param + i,
-                           QEMU_THREAD_JOINABLE);
+    if (migrate_get_current()->parameters.tls_creds &&
+        *migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "postcopy preemption is not compatible with TLS");
+        return -1;
     }
+
+    qio_channel_set_blocking(listener, true, NULL);
+
+    state = g_new0(PostcopyPreemptRecvState, 1);
+    state->listener = listener;
+    object_ref(OBJECT(listener));
+    qemu_mutex_init(&state->mutex);
+    state->page = g_malloc(getpagesize());
+    qemu_thread_create(&state->thread, "postcopy/preempt",
+                       postcopy_preempt_recv_thread, state,
+                       QEMU_THREAD_JOINABLE);
+    postcopy_preempt_recv_state = state;
+    return 0;
 }
 
-void migrate_decompress_threads_join(void)
+/*
+ * Stop the preemption channel.  With @drain, pages that are still in
+ * flight are placed first: the thread only exits once it has read the
+ * end of stream marker, or the source went away.
+ */
+void postcopy_preempt_load_cleanup(bool drain)
 {
-    int i, thread_count;
+    PostcopyPreemptRecvState *state = postcopy_preempt_recv_state;
 
-    thread_count = migrate_decompress_threads();
-    for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+    if (!state) {
+        return;
     }
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+
+    qemu_mutex_lock(&state->mutex);
+    /* Nothing to drain if the source never connected */
+    if (!drain || !state->c) {
+        atomic_set(&state->quit, true);
+        qio_channel_shutdown(state->listener, QIO_CHANNEL_SHUTDOWN_BOTH,
+                             NULL);
+        if (state->c) {
+            qio_channel_shutdown(state->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
     }
-    g_free(decompress_threads);
-    g_free(decomp_param);
-    decompress_threads = NULL;
-    decomp_param = NULL;
+    qemu_mutex_unlock(&state->mutex);
+
+    qemu_thread_join(&state->thread);
+    if (state->c) {
+        qio_channel_close(state->c, NULL);
+        object_unref(OBJECT(state->c));
+    }
+    qio_channel_close(state->listener, NULL);
+    object_unref(OBJECT(state->listener));
+    qemu_mutex_destroy(&state->mutex);
+    g_free(state->page);
+    g_free(state);
+    postcopy_preempt_recv_state = NULL;
 }
 
 static void decompress_data_with_multi_threads(QEMUFile *f,
@@ -2531,7 +5522,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        MappedRamState *mapped_state = NULL;
+        RAMBlock *block = NULL;
         void *host = NULL;
+        uint32_t pages, i;
         uint8_t ch;
 
         addr = qemu_get_be64(f);
@@ -2539,10 +5533,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         addr &= TARGET_PAGE_MASK;
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_ZERO_RUN)) {
+            block = ram_block_from_stream(f, flags);
 
-            host = host_from_ram_block_offset(block, addr);
+            if (ram_cache_enabled) {
+                host = colo_cache_from_block_offset(block, addr);
+            } else {
+                host = host_from_ram_block_offset(block, addr);
+            }
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
@@ -2554,6 +5553,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            if (migrate_use_mapped_ram()) {
+                Error *local_err = NULL;
+
+                mapped_state = mapped_ram_setup(false, &local_err);
+                if (!mapped_state) {
+                    error_report_err(local_err);
+                    ret = -EINVAL;
+                }
+            }
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 char id[256];
@@ -2575,8 +5583,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             error_report_err(local_err);
                         }
                     }
+                    if (migrate_ignore_shared() && qemu_get_byte(f) &&
+                        block->fd < 0) {
+                        /* The contents will not be sent; they can only
+                         * come from the file the source mapped
+                         */
+                        error_report("RAM block \"%s\" is not sent by the "
+                                     "source and is not backed by a file",
+                                     id);
+                        ret = -EINVAL;
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
+                    if (!ret && mapped_state) {
+                        ret = mapped_ram_load_block(f, mapped_state, block);
+                    }
                 } else {
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
@@ -2585,20 +5606,65 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+            if (mapped_state) {
+                if (mapped_ram_sync(mapped_state) < 0 && !ret) {
+                    ret = -EIO;
+                }
+                mapped_ram_free(mapped_state);
+                mapped_state = NULL;
+                if (!ret && migrate_lazy_restore()) {
+                    ret = ram_lazy_restore_start();
+                }
+            }
+            multifd_recv_start();
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (load_param) {
+                load_queue_page(host, ch);
+            } else {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            }
+            break;
+
+        case RAM_SAVE_FLAG_ZERO_RUN:
+            pages = qemu_get_be32(f);
+            if (!pages || pages > ZERO_RUN_MAX_PAGES ||
+                block->used_length - addr < (ram_addr_t)pages *
+                                            TARGET_PAGE_SIZE) {
+                error_report("Invalid run of %u zero pages at " RAM_ADDR_FMT
+                             " in %s", pages, addr, block->idstr);
+                ret = -EINVAL;
+                break;
+            }
+            if (ram_cache_enabled) {
+                bitmap_set(block->colo_bmap, addr >> TARGET_PAGE_BITS, pages);
+            }
+            if (load_param) {
+                for (i = 0; i < pages; i++) {
+                    load_queue_page((uint8_t *)host + i * TARGET_PAGE_SIZE, 0);
+                }
+            } else {
+                ram_handle_compressed(host, 0,
+                                      (uint64_t)pages * TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (load_param) {
+                qemu_get_buffer(f, load_queue_page(host, -1),
+                                TARGET_PAGE_SIZE);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > migration_compress_bound(migrate_compress_method(),
+                                               TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2614,6 +5680,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -2632,6 +5701,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     }
 
     wait_for_decompress_done();
+    wait_for_load_done();
     rcu_read_unlock();
     trace_ram_load_complete(ret, seq_iter);
     return ret;
@@ -2650,5 +5720,10 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&free_page_hints.lock);
+    free_page_hints.queue = g_array_new(false, false, sizeof(FreePageHint));
+    qemu_mutex_init(&snapshot.lock);
+    qemu_cond_init(&snapshot.cond);
+    QSIMPLEQ_INIT(&snapshot.queue);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
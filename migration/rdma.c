@@ -232,6 +232,7 @@ typedef struct RDMALocalBlock {
     int            nb_chunks;
     unsigned long *transit_bitmap;
     unsigned long *unregister_bitmap;
+    unsigned long *used_bitmap;     /* written since the unpin clock passed */
 } RDMALocalBlock;
 
 /*
@@ -374,6 +375,16 @@ typedef struct RDMAContext {
     int unregister_current, unregister_next;
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
+    /*
+     * Bytes of chunk-level registrations currently held, and the limit
+     * above which the source unregisters least recently used chunks
+     * (0 for no limit).  The clock hand walks every chunk of every block.
+     */
+    uint64_t pinned_bytes;
+    uint64_t pin_limit;
+    int unpin_index;
+    uint64_t unpin_chunk;
+
     GHashTable *blockmap;
 } RDMAContext;
 
@@ -581,6 +592,7 @@ static int rdma_add_block(RDMAContext *rdma, const char *block_name,
     bitmap_clear(block->transit_bitmap, 0, block->nb_chunks);
     block->unregister_bitmap = bitmap_new(block->nb_chunks);
     bitmap_clear(block->unregister_bitmap, 0, block->nb_chunks);
+    block->used_bitmap = bitmap_new(block->nb_chunks);
     block->remote_keys = g_new0(uint32_t, block->nb_chunks);
 
     block->is_ram_block = local->init ? false : true;
@@ -652,6 +664,7 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
             if (!block->pmr[j]) {
                 continue;
             }
+            rdma->pinned_bytes -= block->pmr[j]->length;
             ibv_dereg_mr(block->pmr[j]);
             rdma->total_registrations--;
         }
@@ -671,6 +684,9 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
     g_free(block->unregister_bitmap);
     block->unregister_bitmap = NULL;
 
+    g_free(block->used_bitmap);
+    block->used_bitmap = NULL;
+
     g_free(block->remote_keys);
     block->remote_keys = NULL;
 
@@ -1203,6 +1219,7 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
             return -1;
         }
         rdma->total_registrations++;
+        rdma->pinned_bytes += len;
     }
 
     if (lkey) {
@@ -1274,6 +1291,52 @@ const char *print_wrid(int wrid)
  * 2. Use an LRU.
  * 3. Use workload hints.
  */
+/*
+ * Drop the registration of one chunk that has no write in flight,
+ * first locally and then on the destination.
+ */
+static int qemu_rdma_unregister_chunk(RDMAContext *rdma, uint64_t index,
+                                      uint64_t chunk)
+{
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
+    RDMARegister reg = { .current_index = index };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
+                             };
+    RDMAControlHeader head = { .len = sizeof(RDMARegister),
+                               .type = RDMA_CONTROL_UNREGISTER_REQUEST,
+                               .repeat = 1,
+                             };
+    int ret;
+
+    trace_qemu_rdma_unregister_waiting_send(chunk);
+
+    rdma->pinned_bytes -= block->pmr[chunk]->length;
+    ret = ibv_dereg_mr(block->pmr[chunk]);
+    block->pmr[chunk] = NULL;
+    block->remote_keys[chunk] = 0;
+
+    if (ret != 0) {
+        perror("unregistration chunk failed");
+        return -ret;
+    }
+    rdma->total_registrations--;
+
+    /*
+     * The key is a chunk number, not an address: do not let
+     * register_to_network() translate it for the destination.
+     */
+    reg.key.chunk = htonll(chunk);
+    reg.current_index = htonl(reg.current_index);
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+                            &resp, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qemu_rdma_unregister_waiting_complete(chunk);
+    return 0;
+}
+
 static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
 {
     while (rdma->unregistrations[rdma->unregister_current]) {
@@ -1285,13 +1348,6 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
         RDMALocalBlock *block =
             &(rdma->local_ram_blocks.block[index]);
-        RDMARegister reg = { .current_index = index };
-        RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
-                                 };
-        RDMAControlHeader head = { .len = sizeof(RDMARegister),
-                                   .type = RDMA_CONTROL_UNREGISTER_REQUEST,
-                                   .repeat = 1,
-                                 };
 
         trace_qemu_rdma_unregister_waiting_proc(chunk,
                                                 rdma->unregister_current);
@@ -1318,27 +1374,10 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
             continue;
         }
 
-        trace_qemu_rdma_unregister_waiting_send(chunk);
-
-        ret = ibv_dereg_mr(block->pmr[chunk]);
-        block->pmr[chunk] = NULL;
-        block->remote_keys[chunk] = 0;
-
-        if (ret != 0) {
-            perror("unregistration chunk failed");
-            return -ret;
-        }
-        rdma->total_registrations--;
-
-        reg.key.chunk = chunk;
-        register_to_network(rdma, &reg);
-        ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                &resp, NULL, NULL);
+        ret = qemu_rdma_unregister_chunk(rdma, index, chunk);
         if (ret < 0) {
             return ret;
         }
-
-        trace_qemu_rdma_unregister_waiting_complete(chunk);
     }
 
     return 0;
@@ -1854,6 +1893,78 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Make room under the pinning limit for a registration of 'length' bytes
+ * by unregistering chunks on both sides.
+ *
+ * Least recently used chunks are approximated with a clock: the hand
+ * spares, once, every chunk that was written since it last passed.
+ * Chunks with a write in flight cannot be unregistered, so wait for
+ * completions when nothing else is left.
+ */
+static int qemu_rdma_unpin_lru(RDMAContext *rdma, uint64_t length)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    uint64_t total_chunks = 0, step;
+    int i, ret;
+
+    if (!rdma->pin_limit || rdma->pin_all) {
+        return 0;
+    }
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        total_chunks += local->block[i].nb_chunks;
+    }
+
+    while (rdma->pinned_bytes + length > rdma->pin_limit) {
+        bool unpinned = false;
+
+        for (step = 0; step < 2 * total_chunks && !unpinned; step++) {
+            RDMALocalBlock *block;
+            uint64_t chunk;
+
+            if (rdma->unpin_index >= local->nb_blocks) {
+                rdma->unpin_index = 0;
+                rdma->unpin_chunk = 0;
+            }
+            block = &local->block[rdma->unpin_index];
+            chunk = rdma->unpin_chunk++;
+            if (rdma->unpin_chunk >= block->nb_chunks) {
+                rdma->unpin_index++;
+                rdma->unpin_chunk = 0;
+            }
+
+            if (!block->pmr || !block->pmr[chunk] ||
+                !block->remote_keys[chunk] ||
+                test_bit(chunk, block->transit_bitmap) ||
+                test_and_clear_bit(chunk, block->used_bitmap)) {
+                continue;
+            }
+
+            trace_qemu_rdma_unpin_lru(block->index, chunk,
+                                      rdma->pinned_bytes);
+            ret = qemu_rdma_unregister_chunk(rdma, block->index, chunk);
+            if (ret < 0) {
+                return ret;
+            }
+            unpinned = true;
+        }
+
+        if (!unpinned) {
+            if (!rdma->nb_sent) {
+                /* Nothing left to unpin: the limit is below one write */
+                break;
+            }
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1966,8 +2077,14 @@ retry:
             }
 
             /*
-             * Otherwise, tell other side to register.
+             * Otherwise, tell other side to register, once older chunks
+             * have made room for it under the pinning limit.
              */
+            ret = qemu_rdma_unpin_lru(rdma, chunk_end - chunk_start);
+            if (ret < 0) {
+                return ret;
+            }
+
             reg.current_index = current_index;
             if (block->is_ram_block) {
                 reg.key.current_addr = current_addr;
@@ -2068,6 +2185,7 @@ retry:
     }
 
     set_bit(chunk, block->transit_bitmap);
+    set_bit(chunk, block->used_bitmap);
     acct_update_position(f, sge.length, false);
     rdma->total_writes++;
 
@@ -2287,6 +2405,7 @@ static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
      * after the connect() completes.
      */
     rdma->pin_all = pin_all;
+    rdma->pin_limit = migrate_rdma_pin_limit();
 
     ret = qemu_rdma_resolve_host(rdma, temp);
     if (ret) {
@@ -3319,8 +3438,24 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                 trace_qemu_rdma_registration_handle_unregister_loop(count,
                            reg->current_index, reg->key.chunk);
 
+                if (reg->current_index >= rdma->local_ram_blocks.nb_blocks) {
+                    error_report("rdma: 'unregister' bad block index %u "
+                                 "(vs %d)", (unsigned int)reg->current_index,
+                                 rdma->local_ram_blocks.nb_blocks);
+                    ret = -ENOENT;
+                    goto out;
+                }
                 block = &(rdma->local_ram_blocks.block[reg->current_index]);
+                if (reg->key.chunk >= block->nb_chunks || !block->pmr ||
+                    !block->pmr[reg->key.chunk]) {
+                    error_report("rdma: 'unregister' bad chunk %" PRIu64
+                                 " for block %s", reg->key.chunk,
+                                 block->block_name);
+                    ret = -ERANGE;
+                    goto out;
+                }
 
+                rdma->pinned_bytes -= block->pmr[reg->key.chunk]->length;
                 ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
                 block->pmr[reg->key.chunk] = NULL;
 
@@ -260,6 +260,11 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Cost of the last save or load, time in microseconds */
+    uint64_t setup_bytes;
+    int64_t setup_time;
+    uint64_t complete_bytes;
+    int64_t complete_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -722,6 +727,39 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     }
 }
 
+static void savevm_cost_reset(void)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->setup_bytes = 0;
+        se->setup_time = 0;
+        se->complete_bytes = 0;
+        se->complete_time = 0;
+    }
+}
+
+/*
+ * Charge the bytes moved on f since start_pos, and the time since
+ * start_time, to the setup or complete phase of se.
+ */
+static void savevm_cost_account(QEMUFile *f, SaveStateEntry *se, bool setup,
+                                int64_t start_pos, int64_t start_time)
+{
+    uint64_t bytes = qemu_ftell_fast(f) - start_pos;
+    int64_t time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
+
+    if (setup) {
+        se->setup_bytes += bytes;
+        se->setup_time += time;
+    } else {
+        se->complete_bytes += bytes;
+        se->complete_time += time;
+    }
+    trace_savevm_section_cost(se->idstr, se->instance_id,
+                              setup ? "setup" : "complete", bytes, time);
+}
+
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
@@ -973,9 +1011,11 @@ void qemu_savevm_state_begin(QEMUFile *f,
                              const MigrationParams *params)
 {
     SaveStateEntry *se;
+    int64_t start_pos, start_time;
     int ret;
 
     trace_savevm_state_begin();
+    savevm_cost_reset();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -992,10 +1032,13 @@ void qemu_savevm_state_begin(QEMUFile *f,
                 continue;
             }
         }
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_START);
 
         ret = se->ops->save_live_setup(f, se->opaque);
         save_section_footer(f, se);
+        savevm_cost_account(f, se, true, start_pos, start_time);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -1106,9 +1149,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 
 void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start_pos, start_time;
     int ret;
     bool in_postcopy = migration_in_postcopy(migrate_get_current());
 
@@ -1131,11 +1173,14 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        savevm_cost_account(f, se, false, start_pos, start_time);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return;
@@ -1146,6 +1191,20 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         return;
     }
 
+    qemu_savevm_state_complete_precopy_non_iterable(f);
+}
+
+/* Save the state of all devices that are not saved iteratively, and end
+ * the stream; the CPU state must be synchronized already.
+ */
+void qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+    SaveStateEntry *se;
+    int64_t start_pos, start_time;
+    bool in_postcopy = migration_in_postcopy(migrate_get_current());
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
@@ -1165,10 +1224,13 @@ void qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only)
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         vmstate_save(f, se, vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        savevm_cost_account(f, se, false, start_pos, start_time);
 
         json_end_object(vmdesc);
     }
@@ -1282,7 +1344,9 @@ done:
 static int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start_pos, start_time;
 
+    savevm_cost_reset();
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
@@ -1299,11 +1363,14 @@ static int qemu_save_device_state(QEMUFile *f)
             continue;
         }
 
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
 
         vmstate_save(f, se, NULL);
 
         save_section_footer(f, se);
+        savevm_cost_account(f, se, false, start_pos, start_time);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -1822,12 +1889,15 @@ void loadvm_free_handlers(MigrationIncomingState *mis)
 }
 
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t section_type)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     LoadStateEntry *le;
     char idstr[256];
+    int64_t start_pos = qemu_ftell_fast(f);
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int ret;
 
     /* Read section start */
@@ -1880,15 +1950,20 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    savevm_cost_account(f, se, section_type == QEMU_VM_SECTION_START,
+                        start_pos, start_time);
 
     return 0;
 }
 
 static int
-qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis,
+                             uint8_t section_type)
 {
     uint32_t section_id;
     LoadStateEntry *le;
+    int64_t start_pos = qemu_ftell_fast(f);
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int ret;
 
     section_id = qemu_get_be32(f);
@@ -1913,6 +1988,10 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, le)) {
         return -EINVAL;
     }
+    /* Iterations are not part of the downtime */
+    if (section_type == QEMU_VM_SECTION_END) {
+        savevm_cost_account(f, le->se, false, start_pos, start_time);
+    }
 
     return 0;
 }
@@ -1928,14 +2007,14 @@ static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
-            ret = qemu_loadvm_section_part_end(f, mis);
+            ret = qemu_loadvm_section_part_end(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
@@ -2001,6 +2080,7 @@ int qemu_loadvm_state(QEMUFile *f)
         }
     }
 
+    savevm_cost_reset();
     ret = qemu_loadvm_state_main(f, mis);
     qemu_event_set(&mis->main_thread_load_event);
 
@@ -2055,6 +2135,50 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
+/* Load a run of sections that is not preceded by a file header, up to
+ * the QEMU_VM_EOF that ends it.  COLO sends the RAM of each checkpoint
+ * this way, ahead of the buffered device state.
+ */
+int qemu_loadvm_state_live(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int ret;
+
+    ret = qemu_loadvm_state_main(f, mis);
+    loadvm_free_handlers(mis);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+
+    return ret;
+}
+
+VMStateCostList *qmp_query_vmstate_cost(Error **errp)
+{
+    VMStateCostList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        VMStateCostList *entry;
+
+        if (!se->setup_bytes && !se->complete_bytes) {
+            continue;
+        }
+        entry = g_new0(VMStateCostList, 1);
+        entry->value = g_new0(VMStateCost, 1);
+        entry->value->idstr = g_strdup(se->idstr);
+        entry->value->instance_id = se->instance_id;
+        entry->value->setup_bytes = se->setup_bytes;
+        entry->value->setup_time = se->setup_time;
+        entry->value->complete_bytes = se->complete_bytes;
+        entry->value->complete_time = se->complete_time;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 int save_vmstate(Monitor *mon, const char *name)
 {
     BlockDriverState *bs, *bs1;
@@ -55,6 +55,36 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the current outgoing migration, used to open the
+ * additional x-multifd and x-postcopy-preempt channels.  */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "multifd and postcopy preemption require a tcp: "
+                   "or unix: migration");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+void socket_cleanup_outgoing_migration(void)
+{
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = NULL;
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -107,7 +137,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -137,6 +168,7 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 {
     QIOChannelSocket *sioc;
     Error *err = NULL;
+    bool keep_listening = false;
 
     sioc = qio_channel_socket_accept(QIO_CHANNEL_SOCKET(ioc),
                                      &err);
@@ -148,14 +180,36 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
+    /* The multifd threads and the postcopy preemption thread accept
+     * their own channels on the listening socket, and close it when the
+     * migration is over.
+     */
+    if (migrate_use_multifd()) {
+        if (multifd_load_setup(ioc, &err) < 0) {
+            error_report_err(err);
+            object_unref(OBJECT(sioc));
+            goto out;
+        }
+        keep_listening = true;
+    } else if (migrate_postcopy_preempt()) {
+        if (postcopy_preempt_load_setup(ioc, &err) < 0) {
+            error_report_err(err);
+            object_unref(OBJECT(sioc));
+            goto out;
+        }
+        keep_listening = true;
+    }
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-incoming");
     migration_channel_process_incoming(migrate_get_current(),
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
 
 out:
-    /* Close listening socket as its no longer needed */
-    qio_channel_close(ioc, NULL);
+    if (!keep_listening) {
+        /* Close listening socket as its no longer needed */
+        qio_channel_close(ioc, NULL);
+    }
     return FALSE; /* unregister */
 }
 
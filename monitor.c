@@ -78,6 +78,7 @@
 #include "qmp-introspect.h"
 #include "sysemu/qtest.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
 #include "qapi/qmp/dispatch.h"
 
 #if defined(TARGET_S390X)
@@ -223,6 +224,30 @@ static mon_cmd_t info_cmds[];
 
 Monitor *cur_mon;
 
+/*
+ * QMP monitors created with MONITOR_USE_OOB read and parse their input
+ * in a thread of their own, so that a busy main loop doesn't hold up
+ * requests that don't need the BQL.  Everything else is queued to
+ * monitor_qmp_bh_dispatcher(), which runs under the BQL.
+ */
+typedef struct QMPRequest {
+    Monitor *mon;
+    QObject *req;
+    QObject *id;
+    QSIMPLEQ_ENTRY(QMPRequest) entry;
+} QMPRequest;
+
+static struct {
+    QemuThread thread;
+    GMainContext *context;
+    GMainLoop *loop;
+
+    /* Protects qmp_requests */
+    QemuMutex qmp_queue_lock;
+    QSIMPLEQ_HEAD(, QMPRequest) qmp_requests;
+    QEMUBH *qmp_dispatcher_bh;
+} mon_iothread;
+
 static QEMUClockType event_clock_type = QEMU_CLOCK_REALTIME;
 
 static void monitor_command_cb(void *opaque, const char *cmdline,
@@ -327,21 +352,16 @@ void monitor_flush(Monitor *mon)
 /* flush at every end of line */
 static void monitor_puts(Monitor *mon, const char *str)
 {
-    char c;
+    const char *nl;
 
     qemu_mutex_lock(&mon->out_lock);
-    for(;;) {
-        c = *str++;
-        if (c == '\0')
-            break;
-        if (c == '\n') {
-            qstring_append_chr(mon->outbuf, '\r');
-        }
-        qstring_append_chr(mon->outbuf, c);
-        if (c == '\n') {
-            monitor_flush_locked(mon);
-        }
+    while ((nl = strchr(str, '\n'))) {
+        qstring_append_len(mon->outbuf, str, nl - str);
+        qstring_append(mon->outbuf, "\r\n");
+        monitor_flush_locked(mon);
+        str = nl + 1;
     }
+    qstring_append(mon->outbuf, str);
     qemu_mutex_unlock(&mon->out_lock);
 }
 
@@ -565,7 +585,7 @@ static void monitor_qapi_event_init(void)
 
 void qmp_qmp_capabilities(Error **errp)
 {
-    cur_mon->qmp.in_command_mode = true;
+    atomic_set(&cur_mon->qmp.in_command_mode, true);
 }
 
 static void handle_hmp_command(Monitor *mon, const char *cmdline);
@@ -1066,6 +1086,13 @@ static void hmp_info_jit(Monitor *mon, const QDict *qdict)
     dump_drift_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    int max = qdict_get_try_int(qdict, "max", 10);
+
+    dump_tb_profile_info((FILE *)mon, monitor_fprintf, max);
+}
+
 static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
 {
     dump_opcount_info((FILE *)mon, monitor_fprintf);
@@ -3680,14 +3707,15 @@ static bool invalid_qmp_mode(const Monitor *mon, const char *cmd,
                              Error **errp)
 {
     bool is_cap = g_str_equal(cmd, "qmp_capabilities");
+    bool in_command_mode = atomic_read(&mon->qmp.in_command_mode);
 
-    if (is_cap && mon->qmp.in_command_mode) {
+    if (is_cap && in_command_mode) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
                   "Capabilities negotiation is already complete, command "
                   "'%s' ignored", cmd);
         return true;
     }
-    if (!is_cap && !mon->qmp.in_command_mode) {
+    if (!is_cap && !in_command_mode) {
         error_set(errp, ERROR_CLASS_COMMAND_NOT_FOUND,
                   "Expecting capabilities negotiation with "
                   "'qmp_capabilities' before command '%s'", cmd);
@@ -3700,8 +3728,8 @@ static bool invalid_qmp_mode(const Monitor *mon, const char *cmd,
  * Input object checking rules
  *
  * 1. Input object must be a dict
- * 2. The "execute" key must exist
- * 3. The "execute" key must be a string
+ * 2. Exactly one of the "execute" and "exec-oob" keys must exist
+ * 3. The "execute" or "exec-oob" key must be a string
  * 4. If the "arguments" key exists, it must be a dict
  * 5. If the "id" key exists, it can be anything (ie. json-value)
  * 6. Any argument not listed above is considered invalid
@@ -3723,10 +3751,14 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
         const char *arg_name = qdict_entry_key(ent);
         const QObject *arg_obj = qdict_entry_value(ent);
 
-        if (!strcmp(arg_name, "execute")) {
+        if (!strcmp(arg_name, "execute") || !strcmp(arg_name, "exec-oob")) {
             if (qobject_type(arg_obj) != QTYPE_QSTRING) {
                 error_setg(errp, QERR_QMP_BAD_INPUT_OBJECT_MEMBER,
-                           "execute", "string");
+                           arg_name, "string");
+                return NULL;
+            }
+            if (has_exec_key) {
+                error_setg(errp, QERR_QMP_EXTRA_MEMBER, arg_name);
                 return NULL;
             }
             has_exec_key = 1;
@@ -3752,12 +3784,124 @@ static QDict *qmp_check_input_obj(QObject *input_obj, Error **errp)
     return input_dict;
 }
 
+/* Send @rsp, or @err if set, tagged with @id.  Takes ownership of all */
+static void monitor_qmp_respond(Monitor *mon, QObject *rsp, Error *err,
+                                QObject *id)
+{
+    QDict *qdict;
+
+    if (err) {
+        qdict = qdict_new();
+        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
+        error_free(err);
+        rsp = QOBJECT(qdict);
+    }
+
+    if (rsp) {
+        if (id) {
+            qdict_put_obj(qobject_to_qdict(rsp), "id", id);
+            id = NULL;
+        }
+
+        monitor_json_emitter(mon, rsp);
+    }
+
+    qobject_decref(id);
+    qobject_decref(rsp);
+}
+
+/* Run a request that passed qmp_check_input_obj() and send the reply */
+static void monitor_qmp_dispatch(Monitor *mon, QObject *req, QObject *id)
+{
+    QDict *qdict = qobject_to_qdict(req);
+    const char *cmd_name = qdict_get_str(qdict, "execute");
+    QObject *rsp = NULL;
+    QString *json;
+    Error *err = NULL;
+
+    if (invalid_qmp_mode(mon, cmd_name, &err)) {
+        monitor_qmp_respond(mon, NULL, err, id);
+        return;
+    }
+
+    if (mon->flags & MONITOR_USE_PRETTY) {
+        rsp = qmp_dispatch(req);
+        monitor_qmp_respond(mon, rsp, NULL, id);
+        return;
+    }
+
+    /* Skip the QObject tree for the reply */
+    json = qmp_dispatch_json(req, id);
+    qobject_decref(id);
+    if (json) {
+        qstring_append_chr(json, '\n');
+        monitor_puts(mon, qstring_get_str(json));
+        QDECREF(json);
+    }
+}
+
+/* Run the queued requests of MONITOR_USE_OOB monitors, one per call */
+static void monitor_qmp_bh_dispatcher(void *data)
+{
+    Monitor *old_mon = cur_mon;
+    QMPRequest *req_obj;
+    bool more;
+
+    qemu_mutex_lock(&mon_iothread.qmp_queue_lock);
+    req_obj = QSIMPLEQ_FIRST(&mon_iothread.qmp_requests);
+    if (req_obj) {
+        QSIMPLEQ_REMOVE_HEAD(&mon_iothread.qmp_requests, entry);
+    }
+    more = !QSIMPLEQ_EMPTY(&mon_iothread.qmp_requests);
+    qemu_mutex_unlock(&mon_iothread.qmp_queue_lock);
+
+    if (!req_obj) {
+        return;
+    }
+
+    cur_mon = req_obj->mon;
+    monitor_qmp_dispatch(req_obj->mon, req_obj->req, req_obj->id);
+    cur_mon = old_mon;
+
+    qobject_decref(req_obj->req);
+    g_free(req_obj);
+
+    /* Let the main loop run between two commands */
+    if (more) {
+        qemu_bh_schedule(mon_iothread.qmp_dispatcher_bh);
+    }
+}
+
+/* Drop the requests that @mon queued but that didn't run yet */
+static void monitor_qmp_cleanup_queue(Monitor *mon)
+{
+    QMPRequest *req_obj, *next;
+
+    if (!mon_iothread.context) {
+        return;
+    }
+
+    qemu_mutex_lock(&mon_iothread.qmp_queue_lock);
+    QSIMPLEQ_FOREACH_SAFE(req_obj, &mon_iothread.qmp_requests, entry, next) {
+        if (req_obj->mon == mon) {
+            QSIMPLEQ_REMOVE(&mon_iothread.qmp_requests, req_obj,
+                            QMPRequest, entry);
+            qobject_decref(req_obj->req);
+            qobject_decref(req_obj->id);
+            g_free(req_obj);
+        }
+    }
+    qemu_mutex_unlock(&mon_iothread.qmp_queue_lock);
+}
+
 static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
 {
-    QObject *req, *rsp = NULL, *id = NULL;
+    QObject *req, *id = NULL;
     QDict *qdict = NULL;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
+    Monitor *mon = container_of(parser, Monitor, qmp.parser);
+    QmpCommand *cmd;
+    QMPRequest *req_obj;
     Error *err = NULL;
 
     req = json_parser_parse_err(tokens, NULL, &err);
@@ -3777,42 +3921,68 @@ static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
     qobject_incref(id);
     qdict_del(qdict, "id");
 
-    cmd_name = qdict_get_str(qdict, "execute");
-    trace_handle_qmp_command(mon, cmd_name);
-
-    if (invalid_qmp_mode(mon, cmd_name, &err)) {
-        goto err_out;
-    }
+    if (qdict_haskey(qdict, "exec-oob")) {
+        cmd_name = qdict_get_str(qdict, "exec-oob");
+        trace_handle_qmp_command(mon, cmd_name);
 
-    rsp = qmp_dispatch(req);
+        cmd = qmp_find_command(cmd_name);
+        if (!(mon->flags & MONITOR_USE_OOB)) {
+            error_setg(&err, "Out-of-band execution requires a monitor "
+                       "with x-oob=on");
+            goto err_out;
+        }
+        if (cmd && !qmp_command_allows_oob(cmd)) {
+            error_setg(&err, "Command '%s' can't be executed out-of-band",
+                       cmd_name);
+            goto err_out;
+        }
 
-err_out:
-    if (err) {
-        qdict = qdict_new();
-        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
-        error_free(err);
-        rsp = QOBJECT(qdict);
+        /* Run it right here, ahead of anything still queued */
+        qdict_put(qdict, "execute", qstring_from_str(cmd_name));
+        qdict_del(qdict, "exec-oob");
+        monitor_qmp_dispatch(mon, req, id);
+        qobject_decref(req);
+        return;
     }
 
-    if (rsp) {
-        if (id) {
-            qdict_put_obj(qobject_to_qdict(rsp), "id", id);
-            id = NULL;
-        }
+    cmd_name = qdict_get_str(qdict, "execute");
+    trace_handle_qmp_command(mon, cmd_name);
 
-        monitor_json_emitter(mon, rsp);
+    if (mon->flags & MONITOR_USE_OOB) {
+        req_obj = g_new0(QMPRequest, 1);
+        req_obj->mon = mon;
+        req_obj->req = req;
+        req_obj->id = id;
+
+        qemu_mutex_lock(&mon_iothread.qmp_queue_lock);
+        QSIMPLEQ_INSERT_TAIL(&mon_iothread.qmp_requests, req_obj, entry);
+        qemu_mutex_unlock(&mon_iothread.qmp_queue_lock);
+        qemu_bh_schedule(mon_iothread.qmp_dispatcher_bh);
+        return;
     }
 
-    qobject_decref(id);
-    qobject_decref(rsp);
+    monitor_qmp_dispatch(mon, req, id);
+    qobject_decref(req);
+    return;
+
+err_out:
+    monitor_qmp_respond(mon, NULL, err, id);
     qobject_decref(req);
 }
 
 static void monitor_qmp_read(void *opaque, const uint8_t *buf, int size)
 {
-    Monitor *old_mon = cur_mon;
+    Monitor *mon = opaque;
+    Monitor *old_mon;
 
-    cur_mon = opaque;
+    /* cur_mon belongs to the main thread */
+    if (mon->flags & MONITOR_USE_OOB) {
+        json_message_parser_feed(&mon->qmp.parser, (const char *) buf, size);
+        return;
+    }
+
+    old_mon = cur_mon;
+    cur_mon = mon;
 
     json_message_parser_feed(&cur_mon->qmp.parser, (const char *) buf, size);
 
@@ -3879,22 +4049,33 @@ static void monitor_qmp_event(void *opaque, int event)
 {
     QObject *data;
     Monitor *mon = opaque;
+    /* MONITOR_USE_OOB monitors get their read side events in their thread */
+    bool need_bql = !qemu_mutex_iothread_locked();
+
+    if (need_bql) {
+        qemu_mutex_lock_iothread();
+    }
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        mon->qmp.in_command_mode = false;
+        atomic_set(&mon->qmp.in_command_mode, false);
         data = get_qmp_greeting();
         monitor_json_emitter(mon, data);
         qobject_decref(data);
         mon_refcount++;
         break;
     case CHR_EVENT_CLOSED:
+        monitor_qmp_cleanup_queue(mon);
         json_message_parser_destroy(&mon->qmp.parser);
         json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
     }
+
+    if (need_bql) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static void monitor_event(void *opaque, int event)
@@ -4012,9 +4193,65 @@ static void __attribute__((constructor)) monitor_lock_init(void)
     qemu_mutex_init(&monitor_lock);
 }
 
+static void *monitor_iothread_run(void *opaque)
+{
+    g_main_loop_run(mon_iothread.loop);
+    return NULL;
+}
+
+static void monitor_iothread_init(void)
+{
+    if (mon_iothread.context) {
+        return;
+    }
+
+    qemu_mutex_init(&mon_iothread.qmp_queue_lock);
+    QSIMPLEQ_INIT(&mon_iothread.qmp_requests);
+    /*
+     * Not the main AioContext: commands must not run from the nested
+     * aio_poll() of e.g. a block job or drain.
+     */
+    mon_iothread.qmp_dispatcher_bh = aio_bh_new(iohandler_get_aio_context(),
+                                                monitor_qmp_bh_dispatcher,
+                                                NULL);
+
+    mon_iothread.context = g_main_context_new();
+    mon_iothread.loop = g_main_loop_new(mon_iothread.context, FALSE);
+    qemu_thread_create(&mon_iothread.thread, "mon_iothread",
+                       monitor_iothread_run, NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void monitor_iothread_destroy(void)
+{
+    QMPRequest *req_obj;
+
+    if (!mon_iothread.context) {
+        return;
+    }
+
+    g_main_loop_quit(mon_iothread.loop);
+    /* The thread may be waiting for the BQL in monitor_qmp_event() */
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&mon_iothread.thread);
+    qemu_mutex_lock_iothread();
+
+    while ((req_obj = QSIMPLEQ_FIRST(&mon_iothread.qmp_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&mon_iothread.qmp_requests, entry);
+        qobject_decref(req_obj->req);
+        qobject_decref(req_obj->id);
+        g_free(req_obj);
+    }
+    qemu_bh_delete(mon_iothread.qmp_dispatcher_bh);
+    qemu_mutex_destroy(&mon_iothread.qmp_queue_lock);
+    g_main_loop_unref(mon_iothread.loop);
+    g_main_context_unref(mon_iothread.context);
+    mon_iothread.context = NULL;
+}
+
 void monitor_init(Chardev *chr, int flags)
 {
     static int is_first_init = 1;
+    GMainContext *context = NULL;
     Monitor *mon;
 
     if (is_first_init) {
@@ -4023,6 +4260,13 @@ void monitor_init(Chardev *chr, int flags)
         is_first_init = 0;
     }
 
+    if ((flags & MONITOR_USE_OOB) && object_dynamic_cast(OBJECT(chr),
+                                                         TYPE_CHARDEV_MUX)) {
+        error_report("x-oob is not supported on multiplexed chardevs, "
+                     "ignoring it for '%s'", chr->label);
+        flags &= ~MONITOR_USE_OOB;
+    }
+
     mon = g_malloc(sizeof(*mon));
     monitor_data_init(mon);
 
@@ -4037,10 +4281,14 @@ void monitor_init(Chardev *chr, int flags)
     }
 
     if (monitor_is_qmp(mon)) {
+        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
+        if (flags & MONITOR_USE_OOB) {
+            monitor_iothread_init();
+            context = mon_iothread.context;
+        }
         qemu_chr_fe_set_handlers(&mon->chr, monitor_can_read, monitor_qmp_read,
-                                 monitor_qmp_event, mon, NULL, true);
+                                 monitor_qmp_event, mon, context, true);
         qemu_chr_fe_set_echo(&mon->chr, true);
-        json_message_parser_init(&mon->qmp.parser, handle_qmp_command);
     } else {
         qemu_chr_fe_set_handlers(&mon->chr, monitor_can_read, monitor_read,
                                  monitor_event, mon, NULL, true);
@@ -4055,6 +4303,8 @@ void monitor_cleanup(void)
 {
     Monitor *mon, *next;
 
+    monitor_iothread_destroy();
+
     qemu_mutex_lock(&monitor_lock);
     QLIST_FOREACH_SAFE(mon, &mon_list, entry, next) {
         QLIST_REMOVE(mon, entry);
@@ -4149,6 +4399,9 @@ QemuOptsList qemu_mon_opts = {
         },{
             .name = "pretty",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "x-oob",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
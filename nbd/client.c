@@ -94,7 +94,7 @@ static ssize_t drop_sync(QIOChannel *ioc, size_t size)
     char small[1024];
     char *buffer;
 
-    buffer = sizeof(small) < size ? small : g_malloc(MIN(65536, size));
+    buffer = sizeof(small) >= size ? small : g_malloc(MIN(65536, size));
     while (size > 0) {
         ssize_t count = read_sync(ioc, buffer, MIN(65536, size));
 
@@ -395,6 +395,124 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     }
 }
 
+/* Ask the server to use structured replies.  Return 1 if it agreed, 0
+ * if it does not support them, or -1 with errp set on failure. */
+static int nbd_request_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    nbd_opt_reply reply;
+    int ret;
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    if (nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY, &reply,
+                                 errp) < 0) {
+        return -1;
+    }
+    ret = nbd_handle_reply_err(ioc, &reply, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (reply.type != NBD_REP_ACK || reply.length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                   reply.type, NBD_REP_ACK);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the "base:allocation" metadata context of export @name, so
+ * that NBD_CMD_BLOCK_STATUS can be used.  Return 1 and set *@id if the
+ * server provides the context, 0 if it does not, or -1 with errp set
+ * on failure. */
+static int nbd_receive_base_allocation(QIOChannel *ioc, const char *name,
+                                       uint32_t *id, Error **errp)
+{
+    size_t name_len = strlen(name);
+    size_t ctx_len = strlen(NBD_META_BASE_ALLOCATION);
+    uint32_t len = sizeof(uint32_t) * 3 + name_len + ctx_len;
+    char *buf = g_malloc(len);
+    char *p = buf;
+    int found = 0;
+    int ret;
+
+    /* Request
+       [ 0 ..  3]   export name length
+       [ 4 ..  xx]  export name
+       [xx .. xx+3] number of queries (1)
+       [   ..   ]   query length, query
+     */
+    stl_be_p(p, name_len);
+    p += sizeof(uint32_t);
+    memcpy(p, name, name_len);
+    p += name_len;
+    stl_be_p(p, 1);
+    p += sizeof(uint32_t);
+    stl_be_p(p, ctx_len);
+    p += sizeof(uint32_t);
+    memcpy(p, NBD_META_BASE_ALLOCATION, ctx_len);
+
+    TRACE("Selecting metadata context '%s'", NBD_META_BASE_ALLOCATION);
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                  errp);
+    g_free(buf);
+    if (ret < 0) {
+        return -1;
+    }
+
+    while (1) {
+        nbd_opt_reply reply;
+        uint32_t ctx_id;
+        char ctx_name[NBD_MAX_NAME_SIZE + 1];
+
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            return -1;
+        }
+        ret = nbd_handle_reply_err(ioc, &reply, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        if (reply.type == NBD_REP_ACK) {
+            if (reply.length != 0) {
+                error_setg(errp, "length too long for option end");
+                nbd_send_opt_abort(ioc);
+                return -1;
+            }
+            return found;
+        } else if (reply.type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                       reply.type, NBD_REP_META_CONTEXT);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        if (reply.length < sizeof(ctx_id) ||
+            reply.length - sizeof(ctx_id) > NBD_MAX_NAME_SIZE) {
+            error_setg(errp, "incorrect option length %" PRIu32,
+                       reply.length);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        len = reply.length - sizeof(ctx_id);
+        if (read_sync(ioc, &ctx_id, sizeof(ctx_id)) != sizeof(ctx_id) ||
+            read_sync(ioc, ctx_name, len) != len) {
+            error_setg(errp, "failed to read metadata context");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        ctx_name[len] = '\0';
+        if (!strcmp(ctx_name, NBD_META_BASE_ALLOCATION)) {
+            *id = be32_to_cpu(ctx_id);
+            found = 1;
+        }
+    }
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -456,13 +574,14 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
+                          QIOChannel **outioc, NBDExportInfo *info,
                           off_t *size, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     int rc;
     bool zeroes = true;
+    bool want_structured = false;
 
     TRACE("Receiving negotiation tlscreds=%p hostname=%s.",
           tlscreds, hostname ? hostname : "<null>");
@@ -476,6 +595,11 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
     }
+    if (info) {
+        want_structured = info->structured_reply;
+        info->structured_reply = false;
+        info->base_allocation = false;
+    }
 
     if (read_sync(ioc, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -565,6 +689,24 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+
+            if (want_structured) {
+                int ret = nbd_request_structured_reply(ioc, errp);
+
+                if (ret < 0) {
+                    goto fail;
+                }
+                info->structured_reply = ret;
+            }
+            if (info && info->structured_reply) {
+                int ret = nbd_receive_base_allocation(
+                    ioc, name, &info->meta_base_allocation_id, errp);
+
+                if (ret < 0) {
+                    goto fail;
+                }
+                info->base_allocation = ret;
+            }
         }
         /* write the export name request */
         if (nbd_send_option_request(ioc, NBD_OPT_EXPORT_NAME, -1, name,
@@ -773,27 +915,57 @@ ssize_t nbd_send_request(QIOChannel *ioc, NBDRequest *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret <= 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+           [ 6 ..  7]    type    (NBD_REPLY_TYPE_OFFSET_DATA, ...)
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                        NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply chunk: { .flags = %" PRIx16
+              ", .type = %" PRIu16 ", handle = %" PRIu64
+              ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
@@ -815,3 +987,118 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
     return 0;
 }
 
+/* Read the payload of the structured reply chunk @reply, for a request
+ * covering [@from, @from + @len).  Data chunks are read into @qiov and
+ * holes are zeroed in it; the first descriptor of a block status chunk
+ * is stored in @extent; an error chunk sets reply->error.  Return 0 if
+ * the payload was consumed, or -errno if the chunk is malformed and the
+ * connection cannot be used anymore. */
+int nbd_receive_structured_chunk(QIOChannel *ioc, NBDReply *reply,
+                                 uint64_t from, uint32_t len,
+                                 QEMUIOVector *qiov, NBDExtent *extent)
+{
+    uint8_t buf[12];
+    uint64_t offset;
+    uint32_t size;
+    QEMUIOVector sub_qiov;
+    ssize_t ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (reply->length != 0 || !(reply->flags & NBD_REPLY_FLAG_DONE)) {
+            LOG("invalid NONE chunk");
+            return -EINVAL;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* [ 0 ..  7]    offset
+           [ 8 ..  xx]   data
+         */
+        if (!qiov || reply->length < sizeof(offset)) {
+            LOG("unexpected data chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, sizeof(offset)) != sizeof(offset)) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        size = reply->length - sizeof(offset);
+        if (offset < from || offset - from > len ||
+            size > len - (offset - from)) {
+            LOG("data chunk outside of the request");
+            return -EINVAL;
+        }
+
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - from, size);
+        ret = nbd_wr_syncv(ioc, sub_qiov.iov, sub_qiov.niov, size, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == size ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* [ 0 ..  7]    offset
+           [ 8 .. 11]    hole size
+         */
+        if (!qiov || reply->length != 12) {
+            LOG("unexpected hole chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 12) != 12) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        size = ldl_be_p(buf + 8);
+        if (offset < from || offset - from > len ||
+            size > len - (offset - from)) {
+            LOG("hole chunk outside of the request");
+            return -EINVAL;
+        }
+        qemu_iovec_memset(qiov, offset - from, 0, size);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* [ 0 ..  3]    metadata context id
+           [ 4 ..  7]    extent length
+           [ 8 .. 11]    extent flags (NBD_STATE_*)
+           ...           more descriptors
+         */
+        if (!extent || reply->length < 12 || (reply->length - 4) % 8) {
+            LOG("unexpected block status chunk");
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 12) != 12) {
+            return -EIO;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (extent->length == 0 || extent->length > len) {
+            LOG("invalid block status extent length %" PRIu32,
+                extent->length);
+            return -EINVAL;
+        }
+        size = reply->length - 12;
+        return drop_sync(ioc, size) == size ? 0 : -EIO;
+
+    default:
+        /* [ 0 ..  3]    error
+           [ 4 ..  5]    message length
+           ...           message, and for NBD_REPLY_TYPE_ERROR_OFFSET
+                         the offset of the error
+         */
+        if (!(reply->type & NBD_REPLY_ERR(0)) || reply->length < 6) {
+            LOG("unexpected chunk type %" PRIu16, reply->type);
+            return -EINVAL;
+        }
+        if (read_sync(ioc, buf, 6) != 6) {
+            return -EIO;
+        }
+        reply->error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (reply->error == 0 || lduw_be_p(buf + 4) > reply->length - 6) {
+            LOG("invalid error chunk");
+            return -EINVAL;
+        }
+        size = reply->length - 6;
+        return drop_sync(ioc, size) == size ? 0 : -EIO;
+    }
+}
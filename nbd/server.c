@@ -21,6 +21,13 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
+/* The only metadata context we provide */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of descriptors in a NBD_REPLY_TYPE_BLOCK_STATUS chunk;
+ * the client asks again for the rest of the range. */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -84,6 +91,8 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     bool no_zeroes;
+    bool structured_reply;
+    NBDExport *export_meta; /* export selected by NBD_OPT_SET_META_CONTEXT */
     NBDExport *exp;
     QCryptoTLSCreds *tlscreds;
     char *tlsaclname;
@@ -361,6 +370,174 @@ fail:
     return rc;
 }
 
+/* Handle NBD_OPT_STRUCTURED_REPLY.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          NBD_OPT_STRUCTURED_REPLY,
+                                          "OPT_STRUCTURED_REPLY should not "
+                                          "have length");
+    }
+
+    TRACE("Using structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Send a single NBD_REP_META_CONTEXT reply, including payload.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    size_t name_len = strlen(name);
+    int rc;
+
+    TRACE("Advertising metadata context %" PRIu32 " '%s'", id, name);
+    rc = nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                    sizeof(id) + name_len);
+    if (rc < 0) {
+        return rc;
+    }
+
+    id = cpu_to_be32(id);
+    if (nbd_negotiate_write(ioc, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, name, name_len) != name_len) {
+        LOG("write failed (context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Process NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The
+ * only context is "base:allocation", which NBD_CMD_BLOCK_STATUS reports.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. xx+3]  number of queries
+        ...           query length, query (repeated)
+     */
+    char name[NBD_MAX_NAME_SIZE + 1];
+    const size_t base_len = strlen(NBD_META_BASE_ALLOCATION);
+    uint8_t *buf, *p;
+    uint32_t left, name_len, nr_queries, query_len;
+    NBDExport *exp;
+    bool match = false;
+    int ret;
+
+    if (length > 65536) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, "option too long");
+    }
+
+    buf = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+
+    p = buf;
+    left = length;
+    if (opt == NBD_OPT_SET_META_CONTEXT && !client->structured_reply) {
+        ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                         "structured replies not negotiated");
+        goto out;
+    }
+    if (left < sizeof(name_len)) {
+        goto invalid;
+    }
+    name_len = ldl_be_p(p);
+    p += sizeof(name_len);
+    left -= sizeof(name_len);
+    if (name_len > NBD_MAX_NAME_SIZE || name_len > left) {
+        goto invalid;
+    }
+    memcpy(name, p, name_len);
+    name[name_len] = '\0';
+    p += name_len;
+    left -= name_len;
+    if (left < sizeof(nr_queries)) {
+        goto invalid;
+    }
+    nr_queries = ldl_be_p(p);
+    p += sizeof(nr_queries);
+    left -= sizeof(nr_queries);
+
+    /* With no queries, LIST returns every context and SET selects none */
+    if (nr_queries == 0 && opt == NBD_OPT_LIST_META_CONTEXT) {
+        match = true;
+    }
+    while (nr_queries--) {
+        if (left < sizeof(query_len)) {
+            goto invalid;
+        }
+        query_len = ldl_be_p(p);
+        p += sizeof(query_len);
+        left -= sizeof(query_len);
+        if (query_len > left) {
+            goto invalid;
+        }
+        if (query_len == base_len &&
+            !memcmp(p, NBD_META_BASE_ALLOCATION, base_len)) {
+            match = true;
+        } else if (opt == NBD_OPT_LIST_META_CONTEXT &&
+                   query_len == strlen("base:") &&
+                   !memcmp(p, "base:", query_len)) {
+            match = true;
+        }
+        p += query_len;
+        left -= query_len;
+    }
+    if (left) {
+        goto invalid;
+    }
+
+    exp = nbd_export_find(name);
+    if (!exp) {
+        ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN, opt,
+                                         "export '%s' not present", name);
+        goto out;
+    }
+
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->export_meta = match ? exp : NULL;
+    }
+    if (match) {
+        ret = nbd_negotiate_send_meta_context(client->ioc, opt,
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              NBD_META_BASE_ALLOCATION);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+    goto out;
+
+invalid:
+    ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                     "malformed metadata context request");
+out:
+    g_free(buf);
+    return ret;
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -550,6 +727,22 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -611,9 +804,14 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush from
+     * one connection covers the writes completed on every other one; this
+     * is what NBD_FLAG_CAN_MULTI_CONN promises. */
     const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
                               NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
-                              NBD_FLAG_SEND_WRITE_ZEROES);
+                              NBD_FLAG_SEND_WRITE_ZEROES |
+                              NBD_FLAG_CAN_MULTI_CONN);
+    uint16_t flags;
     bool oldStyle;
     size_t len;
 
@@ -674,10 +872,14 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
             goto fail;
         }
 
+        flags = client->exp->nbdflags | myflags;
+        if (client->structured_reply) {
+            flags |= NBD_FLAG_SEND_DF;
+        }
         TRACE("advertising size %" PRIu64 " and flags %x",
-              client->exp->size, client->exp->nbdflags | myflags);
+              client->exp->size, flags);
         stq_be_p(buf + 18, client->exp->size);
-        stw_be_p(buf + 26, client->exp->nbdflags | myflags);
+        stw_be_p(buf + 26, flags);
         len = client->no_zeroes ? 10 : sizeof(buf) - 18;
         if (nbd_negotiate_write(client->ioc, buf + 18, len) != len) {
             LOG("write failed");
@@ -1067,6 +1269,240 @@ static ssize_t nbd_co_send_reply(NBDRequestData *req, NBDReply *reply,
     return rc;
 }
 
+static void set_be_chunk(uint8_t *buf, uint16_t flags, uint16_t type,
+                         uint64_t handle, uint32_t length)
+{
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_OFFSET_DATA, ...)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
+}
+
+/* Send a whole structured reply chunk, header and payload.
+ * Return -errno on error, 0 on success. */
+static int nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                           unsigned niov)
+{
+    size_t size = iov_size(iov, niov);
+    ssize_t ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = nbd_wr_syncv(client->ioc, iov, niov, size, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret == size ? 0 : -EIO;
+}
+
+static int nbd_co_send_structured_read(NBDClient *client, uint64_t handle,
+                                       uint64_t offset, void *data,
+                                       size_t size, bool final)
+{
+    uint8_t chunk[NBD_STRUCTURED_REPLY_SIZE + 8];
+    struct iovec iov[] = {
+        { .iov_base = chunk, .iov_len = sizeof(chunk) },
+        { .iov_base = data, .iov_len = size },
+    };
+
+    TRACE("Sending data chunk: offset %" PRIu64 " size %zu", offset, size);
+    set_be_chunk(chunk, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle, 8 + size);
+    stq_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE, offset);
+    return nbd_co_send_iov(client, iov, ARRAY_SIZE(iov));
+}
+
+static int nbd_co_send_structured_hole(NBDClient *client, uint64_t handle,
+                                       uint64_t offset, uint32_t size,
+                                       bool final)
+{
+    uint8_t chunk[NBD_STRUCTURED_REPLY_SIZE + 12];
+    struct iovec iov[] = {
+        { .iov_base = chunk, .iov_len = sizeof(chunk) },
+    };
+
+    TRACE("Sending hole chunk: offset %" PRIu64 " size %" PRIu32,
+          offset, size);
+    set_be_chunk(chunk, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE, handle, 12);
+    stq_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE, offset);
+    stl_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE + 8, size);
+    return nbd_co_send_iov(client, iov, ARRAY_SIZE(iov));
+}
+
+/* Finish a structured reply with an error chunk */
+static int nbd_co_send_structured_error(NBDClient *client, uint64_t handle,
+                                        int error, const char *msg)
+{
+    uint8_t chunk[NBD_STRUCTURED_REPLY_SIZE + 6];
+    size_t msg_len = strlen(msg);
+    struct iovec iov[] = {
+        { .iov_base = chunk, .iov_len = sizeof(chunk) },
+        { .iov_base = (char *)msg, .iov_len = msg_len },
+    };
+
+    assert(error);
+    TRACE("Sending error chunk: error %d (%s)", error, msg);
+    set_be_chunk(chunk, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle,
+                 6 + msg_len);
+    stl_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE,
+             system_errno_to_nbd_errno(error));
+    stw_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE + 4, msg_len);
+    return nbd_co_send_iov(client, iov, ARRAY_SIZE(iov));
+}
+
+/* Query the allocation status of the export for at most @size bytes
+ * starting at @offset.  Return the BDRV_BLOCK_* flags and set *@pnum
+ * to the number of bytes that share them, or return -errno. */
+static int64_t coroutine_fn nbd_extent_status(NBDExport *exp, uint64_t offset,
+                                              uint32_t size, uint32_t *pnum)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BlockDriverState *file;
+    uint64_t start = exp->dev_offset + offset;
+    int64_t sector_num = start >> BDRV_SECTOR_BITS;
+    int nb_sectors, n = 0;
+    int64_t ret;
+
+    nb_sectors = MIN(DIV_ROUND_UP(start + size, BDRV_SECTOR_SIZE) - sector_num,
+                     BDRV_REQUEST_MAX_SECTORS);
+    ret = bs ? bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                           &n, &file)
+             : 0;
+    if (ret < 0) {
+        return ret;
+    }
+    if (!bs || n == 0) {
+        *pnum = size;
+        return BDRV_BLOCK_DATA;
+    }
+
+    /* Status is per sector, so it also holds for a partial first sector */
+    *pnum = MIN((uint64_t)(sector_num + n) * BDRV_SECTOR_SIZE - start, size);
+    return ret;
+}
+
+/* Reply to NBD_CMD_READ with a data chunk for every allocated extent and
+ * a hole chunk for every extent that reads as zeroes, so that sparse
+ * areas are neither read nor sent.  I/O errors are reported by a final
+ * error chunk.  Return -errno if the reply could not be sent. */
+static int coroutine_fn nbd_co_send_sparse_read(NBDRequestData *req,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                uint32_t size)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint32_t progress = 0;
+    int ret = 0;
+
+    while (progress < size) {
+        uint32_t pnum;
+        int64_t status = nbd_extent_status(exp, offset + progress,
+                                           size - progress, &pnum);
+        bool final;
+
+        if (status < 0) {
+            return nbd_co_send_structured_error(client, handle, -status,
+                                                "unable to check for holes");
+        }
+
+        final = progress + pnum == size;
+        if (status & BDRV_BLOCK_ZERO) {
+            ret = nbd_co_send_structured_hole(client, handle,
+                                              offset + progress, pnum, final);
+        } else {
+            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                            req->data + progress, pnum);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(client, handle, -ret,
+                                                    "reading from file "
+                                                    "failed");
+            }
+            ret = nbd_co_send_structured_read(client, handle,
+                                              offset + progress,
+                                              req->data + progress, pnum,
+                                              final);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        progress += pnum;
+    }
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the "base:allocation" context.
+ * Return -errno if the reply could not be sent. */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 uint64_t handle,
+                                                 uint64_t offset,
+                                                 uint32_t size,
+                                                 bool only_one)
+{
+    uint8_t chunk[NBD_STRUCTURED_REPLY_SIZE + 4];
+    NBDExtent *extents = g_new(NBDExtent, NBD_MAX_BLOCK_STATUS_EXTENTS);
+    struct iovec iov[2];
+    uint32_t progress = 0;
+    unsigned i, nb_extents = 0;
+    int ret;
+
+    while (progress < size) {
+        uint32_t pnum, flags;
+        int64_t status = nbd_extent_status(client->exp, offset + progress,
+                                           size - progress, &pnum);
+
+        if (status < 0) {
+            g_free(extents);
+            return nbd_co_send_structured_error(client, handle, -status,
+                                                "unable to get block status");
+        }
+
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += pnum;
+        } else {
+            if (nb_extents == NBD_MAX_BLOCK_STATUS_EXTENTS ||
+                (only_one && nb_extents)) {
+                break;
+            }
+            extents[nb_extents].length = pnum;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        }
+        progress += pnum;
+    }
+
+    TRACE("Sending %u block status descriptors", nb_extents);
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+    set_be_chunk(chunk, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                 handle, 4 + nb_extents * sizeof(NBDExtent));
+    stl_be_p(chunk + NBD_STRUCTURED_REPLY_SIZE, NBD_META_ID_BASE_ALLOCATION);
+
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = sizeof(chunk);
+    iov[1].iov_base = extents;
+    iov[1].iov_len = nb_extents * sizeof(NBDExtent);
+    ret = nbd_co_send_iov(client, iov, ARRAY_SIZE(iov));
+    g_free(extents);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1145,11 +1581,24 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
         rc = request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
+    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
+                           NBD_CMD_FLAG_DF | NBD_CMD_FLAG_REQ_ONE)) {
         LOG("unsupported flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
     }
+    if ((request->flags & NBD_CMD_FLAG_DF) &&
+        (request->type != NBD_CMD_READ || !client->structured_reply)) {
+        LOG("unexpected flags (got 0x%x)", request->flags);
+        rc = -EINVAL;
+        goto out;
+    }
+    if (request->type != NBD_CMD_BLOCK_STATUS &&
+        (request->flags & NBD_CMD_FLAG_REQ_ONE)) {
+        LOG("unexpected flags (got 0x%x)", request->flags);
+        rc = -EINVAL;
+        goto out;
+    }
     if (request->type != NBD_CMD_WRITE_ZEROES &&
         (request->flags & NBD_CMD_FLAG_NO_HOLE)) {
         LOG("unexpected flags (got 0x%x)", request->flags);
@@ -1222,6 +1671,15 @@ static coroutine_fn void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply &&
+            !(request.flags & NBD_CMD_FLAG_DF)) {
+            if (nbd_co_send_sparse_read(req, request.handle, request.from,
+                                        request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1231,8 +1689,16 @@ static coroutine_fn void nbd_trip(void *opaque)
         }
 
         TRACE("Read %" PRIu32" byte(s)", request.len);
-        if (nbd_co_send_reply(req, &reply, request.len) < 0)
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read(client, request.handle,
+                                              request.from, req->data,
+                                              request.len, true);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, request.len);
+        }
+        if (ret < 0) {
             goto out;
+        }
         break;
     case NBD_CMD_WRITE:
         TRACE("Request type is WRITE");
@@ -1321,14 +1787,40 @@ static coroutine_fn void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->structured_reply || client->export_meta != exp ||
+            !request.len) {
+            LOG("block status not negotiated or empty");
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(client, request.handle, request.from,
+                                     request.len,
+                                     request.flags & NBD_CMD_FLAG_REQ_ONE)
+            < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        /* Replies carrying data must stay structured once negotiated */
+        if (client->structured_reply &&
+            (request.type == NBD_CMD_READ ||
+             request.type == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(client, request.handle,
+                                               reply.error,
+                                               "request failed");
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -110,11 +110,33 @@ static gint seq_sorter(Packet *a, Packet *b, gpointer data)
     return ntohl(atcp->th_seq) - ntohl(btcp->th_seq);
 }
 
+/*
+ * The packets of a TCP connection mostly arrive in order, so look for the
+ * place of a new one from the tail rather than sorting the whole queue.
+ */
+static void colo_insert_packet(GQueue *queue, Packet *pkt)
+{
+    GList *sibling;
+
+    for (sibling = queue->tail; sibling; sibling = sibling->prev) {
+        if (seq_sorter(sibling->data, pkt, NULL) <= 0) {
+            break;
+        }
+    }
+
+    if (sibling) {
+        g_queue_insert_after(queue, sibling, pkt);
+    } else {
+        g_queue_push_head(queue, pkt);
+    }
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * is unsupported(arp and ipv6) and will be sent later.
+ * On success, *con is the connection the packet was queued on.
  */
-static int packet_enqueue(CompareState *s, int mode)
+static int packet_enqueue(CompareState *s, int mode, Connection **con)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
@@ -145,11 +167,10 @@ static int packet_enqueue(CompareState *s, int mode)
     if (mode == PRIMARY_IN) {
         if (g_queue_get_length(&conn->primary_list) <=
                                MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->primary_list, pkt);
             if (conn->ip_proto == IPPROTO_TCP) {
-                g_queue_sort(&conn->primary_list,
-                             (GCompareDataFunc)seq_sorter,
-                             NULL);
+                colo_insert_packet(&conn->primary_list, pkt);
+            } else {
+                g_queue_push_tail(&conn->primary_list, pkt);
             }
         } else {
             error_report("colo compare primary queue size too big,"
@@ -158,17 +179,17 @@ static int packet_enqueue(CompareState *s, int mode)
     } else {
         if (g_queue_get_length(&conn->secondary_list) <=
                                MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->secondary_list, pkt);
             if (conn->ip_proto == IPPROTO_TCP) {
-                g_queue_sort(&conn->secondary_list,
-                             (GCompareDataFunc)seq_sorter,
-                             NULL);
+                colo_insert_packet(&conn->secondary_list, pkt);
+            } else {
+                g_queue_push_tail(&conn->secondary_list, pkt);
             }
         } else {
             error_report("colo compare secondary queue size too big,"
                          "drop packet");
         }
     }
+    *con = conn;
 
     return 0;
 }
@@ -556,25 +577,27 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
+    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN)) {
+    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(&s->chr_out, pri_rs->buf, pri_rs->packet_len);
     } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        /* Only the connection of the new packet can have a new match */
+        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
+    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN)) {
+    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        /* Only the connection of the new packet can have a new match */
+        colo_compare_connection(conn, s);
     }
 }
 
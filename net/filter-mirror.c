@@ -33,6 +33,8 @@
 #define TYPE_FILTER_MIRROR "filter-mirror"
 #define TYPE_FILTER_REDIRECTOR "filter-redirector"
 #define REDIRECTOR_MAX_LEN NET_BUFSIZE
+/* Pending bytes after which outgoing packets are written out at once */
+#define MIRROR_SEND_BATCH (64 * 1024)
 
 typedef struct MirrorState {
     NetFilterState parent_obj;
@@ -41,40 +43,92 @@ typedef struct MirrorState {
     CharBackend chr_in;
     CharBackend chr_out;
     SocketReadState rs;
+    /*
+     * Framed packets not written to chr_out yet; a burst of them is
+     * written with a single call from send_bh.
+     */
+    GByteArray *send_buf;
+    QEMUBH *send_bh;
 } MirrorState;
 
-static int filter_mirror_send(CharBackend *chr_out,
+static int filter_mirror_flush(MirrorState *s)
+{
+    int ret, size = s->send_buf->len;
+
+    if (!size) {
+        return 0;
+    }
+
+    ret = qemu_chr_fe_write_all(&s->chr_out, s->send_buf->data, size);
+    g_byte_array_set_size(s->send_buf, 0);
+    if (ret != size) {
+        return ret < 0 ? ret : -EIO;
+    }
+
+    return 0;
+}
+
+static void filter_mirror_send_bh(void *opaque)
+{
+    MirrorState *s = opaque;
+    int ret;
+
+    ret = filter_mirror_flush(s);
+    if (ret) {
+        error_report("filter_mirror_send failed(%s)", strerror(-ret));
+    }
+}
+
+static void filter_mirror_send_init(MirrorState *s)
+{
+    s->send_buf = g_byte_array_new();
+    s->send_bh = qemu_bh_new(filter_mirror_send_bh, s);
+}
+
+static void filter_mirror_send_cleanup(MirrorState *s)
+{
+    if (!s->send_bh) {
+        return;
+    }
+
+    filter_mirror_send_bh(s);
+    qemu_bh_delete(s->send_bh);
+    s->send_bh = NULL;
+    g_byte_array_free(s->send_buf, true);
+    s->send_buf = NULL;
+}
+
+/*
+ * Frame the packet into the send buffer; it is written out at the end of
+ * the current burst, or now if enough data is pending already.
+ */
+static int filter_mirror_send(MirrorState *s,
                               const struct iovec *iov,
                               int iovcnt)
 {
     int ret = 0;
     ssize_t size = 0;
     uint32_t len =  0;
-    char *buf;
+    guint offset;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
         return 0;
     }
 
-    len = htonl(size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
-
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)buf, size);
-    g_free(buf);
-    if (ret != size) {
-        goto err;
+    if (s->send_buf->len + sizeof(len) + size > MIRROR_SEND_BATCH) {
+        ret = filter_mirror_flush(s);
     }
 
-    return 0;
-
-err:
-    return ret < 0 ? ret : -EIO;
+    len = htonl(size);
+    offset = s->send_buf->len;
+    g_byte_array_set_size(s->send_buf, offset + sizeof(len) + size);
+    memcpy(s->send_buf->data + offset, &len, sizeof(len));
+    iov_to_buf(iov, iovcnt, 0, s->send_buf->data + offset + sizeof(len),
+               size);
+    qemu_bh_schedule(s->send_bh);
+
+    return ret;
 }
 
 static void
@@ -140,7 +194,7 @@ static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
     MirrorState *s = FILTER_MIRROR(nf);
     int ret;
 
-    ret = filter_mirror_send(&s->chr_out, iov, iovcnt);
+    ret = filter_mirror_send(s, iov, iovcnt);
     if (ret) {
         error_report("filter_mirror_send failed(%s)", strerror(-ret));
     }
@@ -163,7 +217,7 @@ static ssize_t filter_redirector_receive_iov(NetFilterState *nf,
     int ret;
 
     if (qemu_chr_fe_get_driver(&s->chr_out)) {
-        ret = filter_mirror_send(&s->chr_out, iov, iovcnt);
+        ret = filter_mirror_send(s, iov, iovcnt);
         if (ret) {
             error_report("filter_mirror_send failed(%s)", strerror(-ret));
         }
@@ -177,6 +231,7 @@ static void filter_mirror_cleanup(NetFilterState *nf)
 {
     MirrorState *s = FILTER_MIRROR(nf);
 
+    filter_mirror_send_cleanup(s);
     qemu_chr_fe_deinit(&s->chr_out);
 }
 
@@ -184,6 +239,7 @@ static void filter_redirector_cleanup(NetFilterState *nf)
 {
     MirrorState *s = FILTER_REDIRECTOR(nf);
 
+    filter_mirror_send_cleanup(s);
     qemu_chr_fe_deinit(&s->chr_in);
     qemu_chr_fe_deinit(&s->chr_out);
 }
@@ -206,7 +262,11 @@ static void filter_mirror_setup(NetFilterState *nf, Error **errp)
         return;
     }
 
-    qemu_chr_fe_init(&s->chr_out, chr, errp);
+    if (!qemu_chr_fe_init(&s->chr_out, chr, errp)) {
+        return;
+    }
+
+    filter_mirror_send_init(s);
 }
 
 static void redirector_rs_finalize(SocketReadState *rs)
@@ -263,6 +323,8 @@ static void filter_redirector_setup(NetFilterState *nf, Error **errp)
         if (!qemu_chr_fe_init(&s->chr_out, chr, errp)) {
             return;
         }
+
+        filter_mirror_send_init(s);
     }
 }
 
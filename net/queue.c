@@ -38,14 +38,29 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * With QEMU_NET_PACKET_FLAG_NOCOPY and a sent callback, a queued packet
+ * only keeps a copy of the iovec array; data holds that array instead of
+ * the packet contents.
+ *
+ * A queue that is under backpressure keeps queueing packets, so the
+ * packets it has delivered go to a small pool and are reused, instead of
+ * allocating each one anew.  All of this runs in the context that the
+ * receiver of the queue runs in, so no locking is needed.
  */
 
+/* Delivered packets kept for reuse by each queue */
+#define NET_QUEUE_POOL_LEN 16
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    struct iovec *iov;      /* borrowed packet contents, or NULL */
+    int iovcnt;
+    size_t capacity;        /* size of data */
     uint8_t data[0];
 };
 
@@ -56,6 +71,8 @@ struct NetQueue {
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    struct packets pool;
+    uint32_t pool_count;
 
     unsigned delivering : 1;
 };
@@ -72,6 +89,7 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
@@ -87,9 +105,46 @@ void qemu_del_net_queue(NetQueue *queue)
         g_free(packet);
     }
 
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
+
     g_free(queue);
 }
 
+static NetPacket *qemu_net_queue_packet_new(NetQueue *queue, size_t size)
+{
+    NetPacket *packet = QTAILQ_FIRST(&queue->pool);
+
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+        if (packet->capacity >= size) {
+            return packet;
+        }
+        g_free(packet);
+    }
+
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->capacity = size;
+
+    return packet;
+}
+
+static void qemu_net_queue_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    /* Don't keep buffers for anything larger than a (GSO) frame around */
+    if (queue->pool_count >= NET_QUEUE_POOL_LEN ||
+        packet->capacity > NET_BUFSIZE) {
+        g_free(packet);
+        return;
+    }
+
+    QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+    queue->pool_count++;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -102,11 +157,12 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_packet_new(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -131,11 +187,27 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if ((flags & QEMU_NET_PACKET_FLAG_NOCOPY) && sent_cb) {
+        packet = qemu_net_queue_packet_new(queue, iovcnt * sizeof(*iov));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = max_len;
+        packet->iov = (struct iovec *)packet->data;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
+    packet = qemu_net_queue_packet_new(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_NOCOPY;
     packet->size = 0;
+    packet->iov = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -243,7 +315,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_packet_free(queue, packet);
         }
     }
 }
@@ -258,11 +330,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -273,7 +353,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_packet_free(queue, packet);
     }
     return true;
 }
@@ -44,6 +44,7 @@
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
+#include "block/aio.h"
 
 typedef struct TAPState {
     NetClientState nc;
@@ -59,6 +60,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx;
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -67,8 +69,20 @@ static void launch_script(const char *setup_script, const char *ifname,
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
 
+static void tap_send_aio(void *opaque);
+static void tap_writable_aio(void *opaque);
+
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, true,
+                           s->read_poll && s->enabled ? tap_send_aio : NULL,
+                           s->write_poll && s->enabled ?
+                           tap_writable_aio : NULL,
+                           NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -96,6 +110,16 @@ static void tap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+static void tap_writable_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_writable(s);
+    aio_context_release(ctx);
+}
+
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
@@ -185,6 +209,7 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    qemu_net_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -217,6 +242,17 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_net_batch_end(&s->nc);
+}
+
+static void tap_send_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_send(s);
+    aio_context_release(ctx);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -334,6 +370,24 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Unregister from the old context before polling in the new one */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, true, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -359,6 +413,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
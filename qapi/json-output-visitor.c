@@ -0,0 +1,196 @@
+/*
+ * JSON Output Visitor
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2.1 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/json-output-visitor.h"
+#include "qapi/visitor-impl.h"
+#include "qapi/qmp/qjson.h"
+
+struct JSONOutputVisitor {
+    Visitor visitor;
+    QString *str; /* Output buffer, referenced */
+    int depth; /* Number of unfinished containers */
+    bool comma; /* Whether the next value needs a separator */
+};
+
+static JSONOutputVisitor *to_jov(Visitor *v)
+{
+    return container_of(v, JSONOutputVisitor, visitor);
+}
+
+/* Start a new value, prefixed by its @name when inside a struct */
+static void json_output_name(JSONOutputVisitor *jov, const char *name)
+{
+    if (jov->comma) {
+        qstring_append_len(jov->str, ", ", 2);
+    }
+    /* The root value and list elements are unnamed */
+    if (jov->depth && name) {
+        qjson_append_string(jov->str, name);
+        qstring_append_len(jov->str, ": ", 2);
+    }
+    jov->comma = true;
+}
+
+static void json_output_start_struct(Visitor *v, const char *name,
+                                     void **obj, size_t unused, Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append_chr(jov->str, '{');
+    jov->depth++;
+    jov->comma = false;
+}
+
+static void json_output_end_struct(Visitor *v, void **obj)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    assert(jov->depth);
+    qstring_append_chr(jov->str, '}');
+    jov->depth--;
+    jov->comma = true;
+}
+
+static void json_output_start_list(Visitor *v, const char *name,
+                                   GenericList **listp, size_t size,
+                                   Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append_chr(jov->str, '[');
+    jov->depth++;
+    jov->comma = false;
+}
+
+static GenericList *json_output_next_list(Visitor *v, GenericList *tail,
+                                          size_t size)
+{
+    return tail->next;
+}
+
+static void json_output_end_list(Visitor *v, void **obj)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    assert(jov->depth);
+    qstring_append_chr(jov->str, ']');
+    jov->depth--;
+    jov->comma = true;
+}
+
+static void json_output_type_int64(Visitor *v, const char *name,
+                                   int64_t *obj, Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append_int(jov->str, *obj);
+}
+
+static void json_output_type_uint64(Visitor *v, const char *name,
+                                    uint64_t *obj, Error **errp)
+{
+    /* FIXME values larger than INT64_MAX become negative, as with
+     * the QObject output visitor */
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append_int(jov->str, *obj);
+}
+
+static void json_output_type_bool(Visitor *v, const char *name, bool *obj,
+                                  Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, *obj ? "true" : "false");
+}
+
+static void json_output_type_str(Visitor *v, const char *name, char **obj,
+                                 Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_string(jov->str, *obj ? *obj : "");
+}
+
+static void json_output_type_number(Visitor *v, const char *name,
+                                    double *obj, Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_number(jov->str, *obj);
+}
+
+static void json_output_type_any(Visitor *v, const char *name,
+                                 QObject **obj, Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qjson_append_qobject(jov->str, *obj);
+}
+
+static void json_output_type_null(Visitor *v, const char *name, Error **errp)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    json_output_name(jov, name);
+    qstring_append(jov->str, "null");
+}
+
+static void json_output_complete(Visitor *v, void *opaque)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    /* A visit must have occurred, with each start paired with end.  */
+    assert(jov->comma && !jov->depth);
+    assert(opaque == jov->str);
+}
+
+static void json_output_free(Visitor *v)
+{
+    JSONOutputVisitor *jov = to_jov(v);
+
+    QDECREF(jov->str);
+    g_free(jov);
+}
+
+Visitor *json_output_visitor_new(QString *str)
+{
+    JSONOutputVisitor *v;
+
+    v = g_malloc0(sizeof(*v));
+
+    v->visitor.type = VISITOR_OUTPUT;
+    v->visitor.start_struct = json_output_start_struct;
+    v->visitor.end_struct = json_output_end_struct;
+    v->visitor.start_list = json_output_start_list;
+    v->visitor.next_list = json_output_next_list;
+    v->visitor.end_list = json_output_end_list;
+    v->visitor.type_int64 = json_output_type_int64;
+    v->visitor.type_uint64 = json_output_type_uint64;
+    v->visitor.type_bool = json_output_type_bool;
+    v->visitor.type_str = json_output_type_str;
+    v->visitor.type_number = json_output_type_number;
+    v->visitor.type_any = json_output_type_any;
+    v->visitor.type_null = json_output_type_null;
+    v->visitor.complete = json_output_complete;
+    v->visitor.free = json_output_free;
+
+    QINCREF(str);
+    v->str = str;
+
+    return &v->visitor;
+}
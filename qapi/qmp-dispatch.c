@@ -62,13 +62,13 @@ static QDict *qmp_dispatch_check_obj(const QObject *request, Error **errp)
     return dict;
 }
 
-static QObject *do_qmp_dispatch(QObject *request, Error **errp)
+/* Find the command @request executes, and store its arguments in @args */
+static QmpCommand *qmp_dispatch_find(QObject *request, QDict **args,
+                                     Error **errp)
 {
-    Error *local_err = NULL;
     const char *command;
-    QDict *args, *dict;
+    QDict *dict;
     QmpCommand *cmd;
-    QObject *ret = NULL;
 
     dict = qmp_dispatch_check_obj(request, errp);
     if (!dict) {
@@ -89,12 +89,21 @@ static QObject *do_qmp_dispatch(QObject *request, Error **errp)
     }
 
     if (!qdict_haskey(dict, "arguments")) {
-        args = qdict_new();
+        *args = qdict_new();
     } else {
-        args = qdict_get_qdict(dict, "arguments");
-        QINCREF(args);
+        *args = qdict_get_qdict(dict, "arguments");
+        QINCREF(*args);
     }
 
+    return cmd;
+}
+
+/* Run @cmd, and return its return value unless it sends no response */
+static QObject *qmp_dispatch_call(QmpCommand *cmd, QDict *args, Error **errp)
+{
+    Error *local_err = NULL;
+    QObject *ret = NULL;
+
     cmd->fn(args, &ret, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -104,6 +113,22 @@ static QObject *do_qmp_dispatch(QObject *request, Error **errp)
         ret = QOBJECT(qdict_new());
     }
 
+    return ret;
+}
+
+static QObject *do_qmp_dispatch(QObject *request, Error **errp)
+{
+    QDict *args;
+    QmpCommand *cmd;
+    QObject *ret;
+
+    cmd = qmp_dispatch_find(request, &args, errp);
+    if (!cmd) {
+        return NULL;
+    }
+
+    ret = qmp_dispatch_call(cmd, args, errp);
+
     QDECREF(args);
 
     return ret;
@@ -137,3 +162,82 @@ QObject *qmp_dispatch(QObject *request)
 
     return QOBJECT(rsp);
 }
+
+/*
+ * Append the command's return value to @str as JSON text.  Commands
+ * with a JSON marshaller write the text directly; the others go
+ * through a QObject.  Return false if the command sends no response
+ * or fails.
+ */
+static bool do_qmp_dispatch_json(QObject *request, QString *str,
+                                 Error **errp)
+{
+    Error *local_err = NULL;
+    QDict *args;
+    QmpCommand *cmd;
+    QObject *obj;
+
+    cmd = qmp_dispatch_find(request, &args, errp);
+    if (!cmd) {
+        return false;
+    }
+
+    if (cmd->json_fn) {
+        cmd->json_fn(args, str, &local_err);
+        QDECREF(args);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return false;
+        }
+        return true;
+    }
+
+    obj = qmp_dispatch_call(cmd, args, errp);
+    QDECREF(args);
+    if (!obj) {
+        return false;
+    }
+    qjson_append_qobject(str, obj);
+    qobject_decref(obj);
+    return true;
+}
+
+/*
+ * Like qmp_dispatch(), but return the response as compact JSON text,
+ * with member "id": @id added unless @id is null.  For commands with
+ * a JSON marshaller, this avoids building the return value as a
+ * QObject tree just to serialize it.
+ */
+QString *qmp_dispatch_json(QObject *request, QObject *id)
+{
+    Error *err = NULL;
+    QString *rsp;
+    QDict *qdict;
+
+    rsp = qstring_from_str("{\"return\": ");
+    if (!do_qmp_dispatch_json(request, rsp, &err)) {
+        QDECREF(rsp);
+        if (!err) {
+            return NULL;
+        }
+
+        qdict = qdict_new();
+        qdict_put_obj(qdict, "error", qmp_build_error_object(err));
+        error_free(err);
+        if (id) {
+            qobject_incref(id);
+            qdict_put_obj(qdict, "id", id);
+        }
+        rsp = qobject_to_json(QOBJECT(qdict));
+        QDECREF(qdict);
+        return rsp;
+    }
+
+    if (id) {
+        qstring_append(rsp, ", \"id\": ");
+        qjson_append_qobject(rsp, id);
+    }
+    qstring_append_chr(rsp, '}');
+
+    return rsp;
+}
@@ -30,6 +30,18 @@ void qmp_register_command(const char *name, QmpCommandFunc *fn,
     QTAILQ_INSERT_TAIL(&qmp_commands, cmd, node);
 }
 
+/*
+ * Give the already registered command @name a marshaller that returns
+ * JSON text, for use by qmp_dispatch_json()
+ */
+void qmp_register_command_json(const char *name, QmpCommandJSONFunc *json_fn)
+{
+    QmpCommand *cmd = qmp_find_command(name);
+
+    assert(cmd && !(cmd->options & QCO_NO_SUCCESS_RESP));
+    cmd->json_fn = json_fn;
+}
+
 void qmp_unregister_command(const char *name)
 {
     QmpCommand *cmd = qmp_find_command(name);
@@ -87,6 +99,11 @@ bool qmp_has_success_response(const QmpCommand *cmd)
     return !(cmd->options & QCO_NO_SUCCESS_RESP);
 }
 
+bool qmp_command_allows_oob(const QmpCommand *cmd)
+{
+    return cmd->options & QCO_ALLOW_OOB;
+}
+
 void qmp_for_each_command(qmp_cmd_callback_fn fn, void *opaque)
 {
     QmpCommand *cmd;
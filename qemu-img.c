@@ -28,6 +28,7 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/types.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -59,6 +60,8 @@ enum {
     OPTION_PATTERN = 260,
     OPTION_FLUSH_INTERVAL = 261,
     OPTION_NO_DRAIN = 262,
+    OPTION_RANDOM = 263,
+    OPTION_RW_MIX = 264,
 };
 
 typedef enum OutputFormat {
@@ -149,6 +152,10 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for the convert process (defaults\n"
+           "       to 8, at most 16)\n"
+           "  '-W' allow the convert process to write out of order (only useful\n"
+           "       on storage that cannot take advantage of ordered writes)\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1448,48 +1455,67 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
-    int src_cur, src_num;
-    int64_t src_cur_offset;
+    int src_num;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+typedef struct ImgConvertCompressedReq {
+    Coroutine *co;
+    int in_flight;
+    int ret;
+} ImgConvertCompressedReq;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
-    int64_t ret;
-    int n;
+    int64_t ret, src_cur_offset;
+    int n, src_cur;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
 
     if (s->sector_next_status <= sector_num) {
         BlockDriverState *file;
-        ret = bdrv_get_block_status(blk_bs(s->src[s->src_cur]),
-                                    sector_num - s->src_cur_offset,
+        ret = bdrv_get_block_status(blk_bs(s->src[src_cur]),
+                                    sector_num - src_cur_offset,
                                     n, &n, &file);
         if (ret < 0) {
             return ret;
@@ -1505,8 +1531,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
             /* Check block status of the backing file chain to avoid
              * needlessly reading zeroes and limiting the iteration to the
              * buffer size */
-            ret = bdrv_get_block_status_above(blk_bs(s->src[s->src_cur]), NULL,
-                                              sector_num - s->src_cur_offset,
+            ret = bdrv_get_block_status_above(blk_bs(s->src[src_cur]), NULL,
+                                              sector_num - src_cur_offset,
                                               n, &n, &file);
             if (ret < 0) {
                 return ret;
@@ -1544,28 +1570,34 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
-    int n;
-    int ret;
+    int n, ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_pread(blk,
-                        (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
-                        buf, n << BDRV_SECTOR_BITS);
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(
+                blk, (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1578,15 +1610,91 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+typedef struct ImgConvertCompressedWrite {
+    ImgConvertCompressedReq *req;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ImgConvertCompressedWrite;
+
+static void convert_write_compressed_cb(void *opaque, int ret)
+{
+    ImgConvertCompressedWrite *w = opaque;
+    ImgConvertCompressedReq *req = w->req;
+
+    if (ret < 0 && !req->ret) {
+        req->ret = ret;
+    }
+    g_free(w);
+
+    if (--req->in_flight == 0) {
+        qemu_coroutine_enter(req->co);
+    }
+}
+
+/* Writes every cluster in buf as a separate compressed write.  The requests
+ * run concurrently, so that the target driver can compress several clusters
+ * at the same time; all of them have completed when this returns. */
+static int coroutine_fn convert_co_write_compressed(ImgConvertState *s,
+                                                    int64_t sector_num,
+                                                    int nb_sectors,
+                                                    const uint8_t *buf)
+{
+    ImgConvertCompressedReq req = {
+        .co         = qemu_coroutine_self(),
+        .in_flight  = 1,
+    };
+
+    while (nb_sectors > 0) {
+        int n = MIN(nb_sectors, s->cluster_sectors);
+
+        /* We can only save the write if the cluster is completely zeroed and
+         * we're allowed to keep the target sparse. */
+        if (s->has_zero_init && s->min_sparse &&
+            buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
+        {
+            assert(!s->target_has_backing);
+        } else {
+            ImgConvertCompressedWrite *w = g_new0(ImgConvertCompressedWrite, 1);
+
+            w->req = &req;
+            w->iov = (struct iovec) {
+                .iov_base   = (void *) buf,
+                .iov_len    = n << BDRV_SECTOR_BITS,
+            };
+            qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+
+            req.in_flight++;
+            blk_aio_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                            &w->qiov, BDRV_REQ_WRITE_COMPRESSED,
+                            convert_write_compressed_cb, w);
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    /* Completion callbacks run from bottom halves, never from within
+     * blk_aio_pwritev(), so they can only enter us once we have yielded */
+    if (--req.in_flight > 0) {
+        qemu_coroutine_yield();
+    }
+
+    return req.ret;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1596,20 +1704,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
 
         case BLK_DATA:
             /* We must always write compressed clusters as a whole, so don't
-             * try to find zeroed parts in the buffer. We can only save the
-             * write if the buffer is completely zeroed and we're allowed to
-             * keep the target sparse. */
+             * try to find zeroed parts in the buffer. */
             if (s->compressed) {
-                if (s->has_zero_init && s->min_sparse &&
-                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
-                {
-                    assert(!s->target_has_backing);
-                    break;
-                }
-
-                ret = blk_pwrite_compressed(s->target,
-                                            sector_num << BDRV_SECTOR_BITS,
-                                            buf, n << BDRV_SECTOR_BITS);
+                ret = convert_co_write_compressed(s, sector_num, n, buf);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1622,8 +1719,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                 buf, n << BDRV_SECTOR_BITS, 0);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1635,8 +1736,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, 0);
+            ret = blk_co_pwrite_zeroes(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       n << BDRV_SECTOR_BITS, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1651,12 +1753,122 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
-    int n;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            goto out;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            goto out;
+        }
+        /* save current sector and allocation status to local variables */
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && s->status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        /* increment global sector counter so that other coroutines can
+         * already continue reading beyond this request */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                        s->allocated_sectors, 0);
+        }
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            status = BLK_DATA;
+            memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            goto out;
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /*
+                     * A -> B -> A cannot occur because A has
+                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+                     * B will never enter A during this time window.
+                     */
+                    qemu_coroutine_enter(s->co[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
 
     /* Check whether we have zero initialisation or can get it efficiently */
     s->has_zero_init = s->min_sparse && !s->target_has_backing
@@ -1672,26 +1884,22 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Each coroutine has its own buffer for copied data. For compressed
+     * images, the buffer holds whole clusters only, which are compressed in
+     * parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
-    s->allocated_sectors = 0;
-    sector_num = 0;
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
         {
@@ -1701,61 +1909,29 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_pwrite_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1783,6 +1959,8 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1798,7 +1976,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1890,6 +2068,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -2138,6 +2328,12 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -2149,6 +2345,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3488,10 +3686,21 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+#define BENCH_MAX_DEPTHS 32
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start_ns;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int write_pct;
+    bool random;
     int bufsize;
     int step;
     int nrreq;
@@ -3499,12 +3708,25 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    QEMUIOVector write_qiov;
+    GRand *rand;
+
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nr_free_reqs;
+
+    /* Each job is a separate sequential stream of requests */
+    int nr_jobs;
+    int next_job;
+    uint64_t *offsets;
+
+    int64_t *latencies;
+    int nr_latencies;
+    int nr_writes;
 
     int in_flight;
     bool in_flush;
-    uint64_t offset;
-} BenchData;
+};
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3514,6 +3736,37 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+    int job;
+
+    if (b->random) {
+        uint64_t slots = b->image_size / b->bufsize;
+        return (uint64_t)(g_rand_double(b->rand) * slots) * b->bufsize;
+    }
+
+    job = b->next_job;
+    b->next_job = (job + 1) % b->nr_jobs;
+    offset = b->offsets[job];
+    b->offsets[job] = (offset + b->step) % b->image_size;
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_req_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    b->latencies[b->nr_latencies++] =
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - req->start_ns;
+    b->free_reqs[b->nr_free_reqs++] = req;
+
+    bench_cb(b, ret);
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -3559,18 +3812,25 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        int64_t offset = bench_next_offset(b);
+        BenchRequest *req = b->free_reqs[--b->nr_free_reqs];
+        bool write = b->write_pct == 100 ||
+                     (b->write_pct && g_rand_int_range(b->rand, 0, 100) <
+                                      b->write_pct);
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
+         * and the offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        req->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (write) {
+            b->nr_writes++;
+            acb = blk_aio_pwritev(b->blk, offset, &b->write_qiov, 0,
+                                  bench_req_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_req_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -3579,15 +3839,149 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static int bench_compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of the (sorted) latencies */
+static int64_t bench_percentile(BenchData *b, double pct)
+{
+    double rank = pct / 100 * b->nr_latencies;
+    int idx = rank;
+
+    if (!b->nr_latencies) {
+        return 0;
+    }
+    if (idx < rank) {
+        idx++;
+    }
+    return b->latencies[MAX(idx - 1, 0)];
+}
+
+/*
+ * Run one benchmark pass over @b, with @b->nrreq requests in flight, and
+ * print its results or append them to @results for JSON output.
+ */
+static void bench_run(BenchData *b, int pattern, OutputFormat output_format,
+                      QList *results)
+{
+    int64_t t1, t2;
+    double secs, iops, bw;
+    int i, count = b->n;
+
+    b->buf = blk_blockalign(b->blk, (b->nrreq + 1) * b->bufsize);
+    memset(b->buf, pattern, (b->nrreq + 1) * b->bufsize);
+
+    qemu_iovec_init(&b->write_qiov, 1);
+    qemu_iovec_add(&b->write_qiov, b->buf, b->bufsize);
+
+    b->reqs = g_new0(BenchRequest, b->nrreq);
+    b->free_reqs = g_new(BenchRequest *, b->nrreq);
+    for (i = 0; i < b->nrreq; i++) {
+        b->reqs[i].b = b;
+        qemu_iovec_init(&b->reqs[i].qiov, 1);
+        qemu_iovec_add(&b->reqs[i].qiov,
+                       b->buf + (i + 1) * b->bufsize, b->bufsize);
+        b->free_reqs[i] = &b->reqs[i];
+    }
+    b->nr_free_reqs = b->nrreq;
+    b->latencies = g_new(int64_t, MAX(count, 1));
+
+    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bench_cb(b, 0);
+
+    while (b->n > 0) {
+        main_loop_wait(false);
+    }
+    t2 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    qsort(b->latencies, b->nr_latencies, sizeof(b->latencies[0]),
+          bench_compare_latency);
+
+    secs = (double)(t2 - t1) / NANOSECONDS_PER_SECOND;
+    iops = secs > 0 ? count / secs : 0;
+    bw = iops * b->bufsize;
+
+    if (output_format == OFORMAT_JSON) {
+        QDict *run = qdict_new();
+        QDict *lat = qdict_new();
+
+        qdict_put(run, "depth", qint_from_int(b->nrreq / b->nr_jobs));
+        qdict_put(run, "jobs", qint_from_int(b->nr_jobs));
+        qdict_put(run, "requests", qint_from_int(count));
+        qdict_put(run, "reads", qint_from_int(count - b->nr_writes));
+        qdict_put(run, "writes", qint_from_int(b->nr_writes));
+        qdict_put(run, "seconds", qfloat_from_double(secs));
+        qdict_put(run, "iops", qfloat_from_double(iops));
+        qdict_put(run, "bytes-per-second", qfloat_from_double(bw));
+
+        qdict_put(lat, "min", qint_from_int(bench_percentile(b, 0)));
+        qdict_put(lat, "p50", qint_from_int(bench_percentile(b, 50)));
+        qdict_put(lat, "p99", qint_from_int(bench_percentile(b, 99)));
+        qdict_put(lat, "p99.9", qint_from_int(bench_percentile(b, 99.9)));
+        qdict_put(lat, "max", qint_from_int(bench_percentile(b, 100)));
+        qdict_put(run, "latency-ns", lat);
+
+        qlist_append(results, run);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", secs);
+        printf("%.0f IOPS, %.2f MiB/s; latency (us): "
+               "p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               iops, bw / (1024 * 1024),
+               bench_percentile(b, 50) / 1000.0,
+               bench_percentile(b, 99) / 1000.0,
+               bench_percentile(b, 99.9) / 1000.0,
+               bench_percentile(b, 100) / 1000.0);
+    }
+
+    for (i = 0; i < b->nrreq; i++) {
+        qemu_iovec_destroy(&b->reqs[i].qiov);
+    }
+    qemu_iovec_destroy(&b->write_qiov);
+    g_free(b->reqs);
+    g_free(b->free_reqs);
+    g_free(b->latencies);
+    qemu_vfree(b->buf);
+}
+
+/* Parse a comma-separated list of queue depths */
+static int bench_parse_depths(const char *str, int *depths)
+{
+    int nr = 0;
+
+    for (;;) {
+        unsigned long res;
+        const char *end;
+
+        if (nr == BENCH_MAX_DEPTHS ||
+            qemu_strtoul(str, &end, 0, &res) < 0 || res == 0 ||
+            res > INT_MAX || (*end && *end != ',')) {
+            return -1;
+        }
+        depths[nr++] = res;
+        if (!*end) {
+            return nr;
+        }
+        str = end + 1;
+    }
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
     const char *fmt = NULL, *filename;
     bool quiet = false;
     bool image_opts = false;
-    bool is_write = false;
+    int write_pct = 0;
+    bool random_offsets = false;
     int count = 75000;
-    int depth = 64;
+    int depths[BENCH_MAX_DEPTHS] = { 64 };
+    int nr_depths = 1;
+    int nr_jobs = 1;
     int64_t offset = 0;
     size_t bufsize = 4096;
     int pattern = 0;
@@ -3599,19 +3993,27 @@ static int img_bench(int argc, char **argv)
     BenchData data = {};
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
-    int i;
+    const char *output = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    QList *results = NULL;
+    GRand *rng = NULL;
+    int i, j;
 
     for (;;) {
         static const struct option long_options[] = {
             {"help", no_argument, 0, 'h'},
             {"flush-interval", required_argument, 0, OPTION_FLUSH_INTERVAL},
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
+            {"object", required_argument, 0, OPTION_OBJECT},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"rw-mix", required_argument, 0, OPTION_RW_MIX},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
+        c = getopt_long(argc, argv, "hc:d:f:j:no:qs:S:t:w", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -3633,19 +4035,27 @@ static int img_bench(int argc, char **argv)
             break;
         }
         case 'd':
-        {
-            unsigned long res;
-
-            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > INT_MAX) {
+            nr_depths = bench_parse_depths(optarg, depths);
+            if (nr_depths < 0) {
                 error_report("Invalid queue depth specified");
                 return 1;
             }
-            depth = res;
             break;
-        }
         case 'f':
             fmt = optarg;
             break;
+        case 'j':
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res == 0 ||
+                res > INT_MAX) {
+                error_report("Invalid number of jobs specified");
+                return 1;
+            }
+            nr_jobs = res;
+            break;
+        }
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
@@ -3671,7 +4081,7 @@ static int img_bench(int argc, char **argv)
             char *end;
 
             sval = qemu_strtosz_suffix(optarg, &end, QEMU_STRTOSZ_DEFSUFFIX_B);
-            if (sval < 0 || sval > INT_MAX || *end) {
+            if (sval <= 0 || sval > INT_MAX || *end) {
                 error_report("Invalid buffer size specified");
                 return 1;
             }
@@ -3702,8 +4112,7 @@ static int img_bench(int argc, char **argv)
             }
             break;
         case 'w':
-            flags |= BDRV_O_RDWR;
-            is_write = true;
+            write_pct = 100;
             break;
         case OPTION_PATTERN:
         {
@@ -3730,6 +4139,31 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random_offsets = true;
+            break;
+        case OPTION_RW_MIX:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_pct = res;
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        case OPTION_OBJECT: {
+            QemuOpts *opts;
+            opts = qemu_opts_parse_noisily(&qemu_object_opts,
+                                           optarg, true);
+            if (!opts) {
+                return 1;
+            }
+        }   break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -3741,17 +4175,39 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (!write_pct && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
     }
-    if (flush_interval && flush_interval < depth) {
-        error_report("Flush interval can't be smaller than depth");
+    for (i = 0; i < nr_depths; i++) {
+        if (flush_interval && flush_interval < depths[i] * nr_jobs) {
+            error_report("Flush interval can't be smaller than depth");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (qemu_opts_foreach(&qemu_object_opts,
+                          user_creatable_add_opts_foreach,
+                          NULL, NULL)) {
         ret = -1;
         goto out;
     }
 
+    if (write_pct) {
+        flags |= BDRV_O_RDWR;
+    }
+
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet);
     if (!blk) {
         ret = -1;
@@ -3763,51 +4219,83 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
-
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (random_offsets && image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
     }
 
-    data.buf = blk_blockalign(blk, data.nrreq * data.bufsize);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    rng = g_rand_new();
+    results = qlist_new();
+
+    for (i = 0; i < nr_depths; i++) {
+        data = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depths[i] * nr_jobs,
+            .n              = count,
+            .write_pct      = write_pct,
+            .random         = random_offsets,
+            .rand           = rng,
+            .nr_jobs        = nr_jobs,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+        };
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
-    }
+        /* Spread the jobs evenly over the image */
+        data.offsets = g_new(uint64_t, nr_jobs);
+        for (j = 0; j < nr_jobs; j++) {
+            data.offsets[j] = (offset + QEMU_ALIGN_DOWN(image_size / nr_jobs,
+                                                        bufsize) * j)
+                              % image_size;
+        }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+        if (output_format == OFORMAT_HUMAN) {
+            if (write_pct == 0 || write_pct == 100) {
+                printf("Sending %d %s requests, ", data.n,
+                       write_pct ? "write" : "read");
+            } else {
+                printf("Sending %d mixed requests (%d%% writes), ", data.n,
+                       write_pct);
+            }
+            printf("%d bytes each, %d in parallel", data.bufsize, depths[i]);
+            if (nr_jobs > 1) {
+                printf(" by each of %d jobs", nr_jobs);
+            }
+            if (random_offsets) {
+                printf(" (random offsets)\n");
+            } else {
+                printf(" (starting at offset %" PRId64 ", step size %d)\n",
+                       offset, data.step);
+            }
+            if (flush_interval) {
+                printf("Sending flush every %d requests\n", flush_interval);
+            }
+        }
 
-    while (data.n > 0) {
-        main_loop_wait(false);
+        bench_run(&data, pattern, output_format, results);
+        g_free(data.offsets);
     }
-    gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    if (output_format == OFORMAT_JSON) {
+        QDict *obj = qdict_new();
+        QString *str;
+
+        qdict_put(obj, "runs", results);
+        results = NULL;
+        str = qobject_to_json_pretty(QOBJECT(obj));
+        printf("%s\n", qstring_get_str(str));
+        QDECREF(str);
+        QDECREF(obj);
+    }
 
 out:
-    qemu_vfree(data.buf);
+    QDECREF(results);
+    if (rng) {
+        g_rand_free(rng);
+    }
     blk_unref(blk);
 
     if (ret) {
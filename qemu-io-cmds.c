@@ -1871,6 +1871,238 @@ static const cmdinfo_t map_cmd = {
        .oneline        = "prints the allocated areas of a file",
 };
 
+static void bench_help(void)
+{
+    printf(
+"\n"
+" runs a number of requests of the same size and reports their throughput\n"
+"\n"
+" Example:\n"
+" 'bench -d 16 -n 100000 0 4k' - 100000 reads of 4 KiB, 16 in flight\n"
+"\n"
+" Requests start at the given offset and move forward by the step size,\n"
+" starting over once they would go past the end of the image.  The data\n"
+" is neither initialized nor checked.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- number of requests in flight (default 1)\n"
+" -m, -- query the block status of each range instead of reading it\n"
+" -n, -- number of requests (default 10000)\n"
+" -q, -- quiet mode, do not show I/O statistics\n"
+" -S, -- distance between the start of two requests (default: length)\n"
+" -w, -- write instead of read\n"
+"\n");
+}
+
+static int bench_f(BlockBackend *blk, int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 2,
+    .argmax     = -1,
+    .args       = "[-Cmqw] [-d depth] [-n count] [-S step] off len",
+    .oneline    = "measures the throughput of a workload",
+    .help       = bench_help,
+};
+
+typedef struct BenchData {
+    BlockBackend *blk;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start;
+    int64_t end;
+    int64_t len;
+    int64_t step;
+    int64_t offset;
+    int depth;
+    int remaining;
+    int in_flight;
+    int ret;
+} BenchData;
+
+static int64_t bench_next_offset(BenchData *b)
+{
+    int64_t offset = b->offset;
+
+    b->offset += b->step;
+    if (b->offset < b->start || b->offset > b->end - b->len) {
+        b->offset = b->start;
+    }
+    return offset;
+}
+
+static void bench_submit(BenchData *b);
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
+    b->in_flight--;
+    if (ret < 0 && !b->ret) {
+        b->ret = ret;
+    }
+    bench_submit(b);
+}
+
+static void bench_submit(BenchData *b)
+{
+    while (!b->ret && b->remaining && b->in_flight < b->depth) {
+        int64_t offset = bench_next_offset(b);
+
+        b->remaining--;
+        b->in_flight++;
+        if (b->write) {
+            blk_aio_pwritev(b->blk, offset, &b->qiov, 0, bench_cb, b);
+        } else {
+            blk_aio_preadv(b->blk, offset, &b->qiov, 0, bench_cb, b);
+        }
+    }
+}
+
+static int bench_block_status(BenchData *b, int count)
+{
+    BlockDriverState *bs = blk_bs(b->blk);
+    BlockDriverState *file;
+    int64_t ret;
+    int pnum;
+
+    while (count--) {
+        int64_t offset = bench_next_offset(b);
+
+        ret = bdrv_get_block_status_above(bs, NULL,
+                                          offset >> BDRV_SECTOR_BITS,
+                                          b->len >> BDRV_SECTOR_BITS,
+                                          &pnum, &file);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int bench_f(BlockBackend *blk, int argc, char **argv)
+{
+    struct timeval t1, t2;
+    bool Cflag = false, mflag = false, qflag = false;
+    BenchData b = {
+        .blk = blk,
+        .depth = 1,
+    };
+    int count = 10000;
+    int64_t step = 0;
+    void *buf;
+    int c;
+
+    while ((c = getopt(argc, argv, "Cd:mn:qS:w")) != -1) {
+        switch (c) {
+        case 'C':
+            Cflag = true;
+            break;
+        case 'd':
+            b.depth = cvtnum(optarg);
+            if (b.depth <= 0) {
+                printf("invalid queue depth '%s'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'm':
+            mflag = true;
+            break;
+        case 'n':
+            count = cvtnum(optarg);
+            if (count <= 0) {
+                printf("invalid request count '%s'\n", optarg);
+                return 0;
+            }
+            break;
+        case 'q':
+            qflag = true;
+            break;
+        case 'S':
+            step = cvtnum(optarg);
+            if (step < 0) {
+                print_cvtnum_err(step, optarg);
+                return 0;
+            }
+            break;
+        case 'w':
+            b.write = true;
+            break;
+        default:
+            return qemuio_command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc - 2 || (mflag && b.write)) {
+        return qemuio_command_usage(&bench_cmd);
+    }
+
+    b.start = cvtnum(argv[optind]);
+    if (b.start < 0) {
+        print_cvtnum_err(b.start, argv[optind]);
+        return 0;
+    }
+
+    optind++;
+    b.len = cvtnum(argv[optind]);
+    if (b.len < 0) {
+        print_cvtnum_err(b.len, argv[optind]);
+        return 0;
+    } else if (!b.len || b.len > BDRV_REQUEST_MAX_BYTES) {
+        printf("length must be between 1 and %" PRIu64 ", given %s\n",
+               (uint64_t)BDRV_REQUEST_MAX_BYTES, argv[optind]);
+        return 0;
+    }
+    b.step = step ?: b.len;
+
+    if (mflag && ((b.start | b.len | b.step) & (BDRV_SECTOR_SIZE - 1))) {
+        printf("offset, length and step must be sector aligned with -m\n");
+        return 0;
+    }
+
+    b.end = blk_getlength(blk);
+    if (b.end < 0) {
+        printf("getlength: %s\n", strerror(-b.end));
+        return 0;
+    } else if (b.start > b.end - b.len) {
+        printf("request at offset %" PRId64 " goes past the end of the "
+               "image\n", b.start);
+        return 0;
+    }
+    b.offset = b.start;
+
+    gettimeofday(&t1, NULL);
+    if (mflag) {
+        b.ret = bench_block_status(&b, count);
+    } else {
+        buf = qemu_io_alloc(blk, b.len, 0xab);
+        qemu_iovec_init(&b.qiov, 1);
+        qemu_iovec_add(&b.qiov, buf, b.len);
+
+        b.remaining = count;
+        bench_submit(&b);
+        while (b.in_flight) {
+            main_loop_wait(false);
+        }
+
+        qemu_iovec_destroy(&b.qiov);
+        qemu_io_free(buf);
+    }
+    gettimeofday(&t2, NULL);
+
+    if (b.ret < 0) {
+        printf("bench failed: %s\n", strerror(-b.ret));
+        return 0;
+    }
+
+    if (!qflag) {
+        t2 = tsub(t2, t1);
+        print_report("bench", &t2, b.start, b.len * count, b.len * count,
+                     count, Cflag);
+    }
+    return 0;
+}
+
 static void reopen_help(void)
 {
     printf(
@@ -2265,6 +2497,7 @@ static void __attribute((constructor)) init_qemuio_commands(void)
     qemuio_add_command(&discard_cmd);
     qemuio_add_command(&alloc_cmd);
     qemuio_add_command(&map_cmd);
+    qemuio_add_command(&bench_cmd);
     qemuio_add_command(&reopen_cmd);
     qemuio_add_command(&break_cmd);
     qemuio_add_command(&remove_break_cmd);
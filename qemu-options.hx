@@ -87,6 +87,40 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi][,regalloc=bb|ebb]\n"
+    "                [,dirty-ring-size=n]\n"
+    "                select accelerator ('-accel help' for list)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                regalloc=bb|ebb (TCG register allocation scope)\n"
+    "                dirty-ring-size=n (KVM dirty ring entries per vCPU)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, hax or tcg can be available. By default, tcg is used. Supported
+properties are:
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads. When TCG is multi-threaded there is one
+host thread per vCPU, taking advantage of additional host cores. The default
+is to enable multi-threading where both the guest and the host support it and
+no incompatible TCG feature (e.g. icount or record/replay) has been enabled.
+@item regalloc=bb|ebb
+Controls how far TCG keeps guest registers in host registers. With
+@option{bb} (the default) they are written back and reloaded at every
+basic block boundary inside a translation block. With @option{ebb} they
+are only written back at conditional branches and stay in host registers
+on the fall-through path.
+@item dirty-ring-size=@var{n}
+When using KVM, collect dirty pages from a ring of @var{n} entries per
+vCPU instead of fetching a dirty bitmap for every memory slot.  @var{n}
+must be a power of two; the default of 0 keeps using the bitmaps, as
+does a host kernel without dirty ring support.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -517,9 +551,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,copy-on-read-prefetch=size][,copy-on-read-prefetch-speed=bps]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
+    "       [,merge-requests=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
@@ -560,7 +596,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -582,11 +618,23 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item copy-on-read-prefetch=@var{size}
+With copy-on-read, copy up to @var{size} bytes following sequential guest reads
+from the backing file into the image file in the background.  Prefetching
+backs off while the guest has requests in flight.  The default is 0 (off).
+@item copy-on-read-prefetch-speed=@var{bps}
+Limit copy-on-read prefetching to @var{bps} bytes per second.  The default is
+0 (unlimited).
 @item detect-zeroes=@var{detect-zeroes}
 @var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item merge-requests=@var{merge-requests}
+@var{merge-requests} is "on" or "off" and enables merging of contiguous read
+or write requests from the guest device into a single request.  Requests are
+held back until the device has submitted its current batch.  This helps
+device models that don't merge requests themselves.  The default is "off".
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1422,6 +1470,16 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings restores the original static behavior of encodings
 like Tight.
 
+@item h264
+@itemx h264-encoder=@var{element}
+
+Send frequently updated screen regions to clients that support the
+Open H.264 encoding as a single H.264 video stream, instead of a JPEG
+image per rectangle.  This requires @option{lossy} and adaptive
+encodings.  Encoding is done with GStreamer; @var{element} names the
+GStreamer H.264 encoder to use.  By default, the first usable encoder
+among vah264enc, vaapih264enc, nvh264enc and x264enc is picked.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1678,6 +1736,19 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off]\n"
+    "                attach to the existing network interface 'name' with one\n"
+    "                AF_XDP socket per queue\n"
+    "                use 'mode' to select the XDP program attach mode\n"
+    "                use 'force-copy=on' to use copy mode even if the device supports\n"
+    "                zero-copy (default: off)\n"
+    "                use 'queues=n' to use n queues of a multiqueue interface,\n"
+    "                starting from queue 'start-queue=m' (default: 1 and 0)\n"
+    "                use 'inhibit=on' to keep an XDP program already attached to\n"
+    "                the interface instead of loading the default one\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2160,9 +2231,9 @@ DEF("chardev", HAS_ARG, QEMU_OPTION_chardev,
     "-chardev null,id=id[,mux=on|off][,logfile=PATH][,logappend=on|off]\n"
     "-chardev socket,id=id[,host=host],port=port[,to=to][,ipv4][,ipv6][,nodelay][,reconnect=seconds]\n"
     "         [,server][,nowait][,telnet][,reconnect=seconds][,mux=on|off]\n"
-    "         [,logfile=PATH][,logappend=on|off][,tls-creds=ID] (tcp)\n"
+    "         [,coalesce=ms][,logfile=PATH][,logappend=on|off][,tls-creds=ID] (tcp)\n"
     "-chardev socket,id=id,path=path[,server][,nowait][,telnet][,reconnect=seconds]\n"
-    "         [,mux=on|off][,logfile=PATH][,logappend=on|off] (unix)\n"
+    "         [,coalesce=ms][,mux=on|off][,logfile=PATH][,logappend=on|off] (unix)\n"
     "-chardev udp,id=id[,host=host],port=port[,localaddr=localaddr]\n"
     "         [,localport=localport][,ipv4][,ipv6][,mux=on|off]\n"
     "         [,logfile=PATH][,logappend=on|off]\n"
@@ -2283,7 +2354,7 @@ Further options to each backend are described below.
 A void device. This device will not emit any data, and will drop any data it
 receives. The null backend does not take any options.
 
-@item -chardev socket ,id=@var{id} [@var{TCP options} or @var{unix options}] [,server] [,nowait] [,telnet] [,reconnect=@var{seconds}] [,tls-creds=@var{id}]
+@item -chardev socket ,id=@var{id} [@var{TCP options} or @var{unix options}] [,server] [,nowait] [,telnet] [,reconnect=@var{seconds}] [,coalesce=@var{ms}] [,tls-creds=@var{id}]
 
 Create a two-way stream socket, which can be either a TCP or a unix socket. A
 unix socket will be created if @option{path} is specified. Behaviour is
@@ -2301,6 +2372,12 @@ escape sequences.
 the remote end goes away.  qemu will delay this many seconds and then attempt
 to reconnect.  Zero disables reconnecting, and is the default.
 
+@option{coalesce} lets output sit in a buffer for up to this many milliseconds
+before it is written to the socket, so that a guest or filter issuing many
+small writes does not pay a system call for each of them.  Zero writes
+immediately, and is the default.  File descriptor passing always bypasses
+the buffer.
+
 @option{tls-creds} requests enablement of the TLS protocol for encryption,
 and specifies the id of the TLS credentials to use for the handshake. The
 credentials must be previously created with the @option{-object tls-creds}
@@ -2664,6 +2741,20 @@ This value may optionally have the suffix 'T', 'G', 'M', 'K', 'k' or 'b'. If it
 does not have a suffix, it will be assumed to be in bytes. The value must be a
 multiple of 512 bytes. It defaults to 256k.
 
+@item readahead-max
+While the guest reads sequentially, the read ahead amount doubles with each
+request up to this size.  It must be a multiple of 512 bytes and defaults to
+the larger of 2M and @option{readahead}.
+
+@item connections
+The maximum number of range requests in flight at the same time.  When the
+server speaks HTTP/2 they are multiplexed over one connection.  It defaults
+to 8.
+
+@item cache-size
+Size of an in-memory cache of data already fetched from the server.  It
+defaults to 0, which disables the cache.
+
 @item sslverify
 Whether to verify the remote server's certificate when connecting over SSL. It
 can have the value 'on' or 'off'. It defaults to 'on'.
@@ -3133,11 +3224,17 @@ Like -qmp but uses pretty JSON formatting.
 ETEXI
 
 DEF("mon", HAS_ARG, QEMU_OPTION_mon, \
-    "-mon [chardev=]name[,mode=readline|control]\n", QEMU_ARCH_ALL)
+    "-mon [chardev=]name[,mode=readline|control][,x-oob=on|off]\n", QEMU_ARCH_ALL)
 STEXI
-@item -mon [chardev=]name[,mode=readline|control]
+@item -mon [chardev=]name[,mode=readline|control][,x-oob=on|off]
 @findex -mon
 Setup monitor on chardev @var{name}.
+
+@option{x-oob} (control mode only) reads and parses QMP input in a separate
+thread.  Ordinary commands still run in order on the main loop, but those
+that may be run out-of-band can be sent with @code{exec-oob} instead of
+@code{execute} and are then answered immediately, even while the main loop
+is busy.  This is experimental.
 ETEXI
 
 DEF("debugcon", HAS_ARG, QEMU_OPTION_debugcon, \
@@ -3252,6 +3349,17 @@ the 0x200 sized block starting at 0xffffffc000080000 and another 0x1000 sized
 block starting at 0xffffffc00005f000.
 ETEXI
 
+DEF("perfmap", 0, QEMU_OPTION_perfmap, \
+    "-perfmap        generate a /tmp/perf-${pid}.map file for perf\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perfmap
+@findex -perfmap
+Write the host address range, guest PC and guest symbol (when known) of
+each translated block to @file{/tmp/perf-@var{pid}.map}, so that
+@command{perf} can attribute samples in generated code to guest code.
+ETEXI
+
 DEF("L", HAS_ARG, QEMU_OPTION_L, \
     "-L path         set the directory for the BIOS, VGA BIOS and keymaps\n",
     QEMU_ARCH_ALL)
@@ -37,6 +37,8 @@
 #include "qom/object_interfaces.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "qemu/lock-profile.h"
+#include "qemu/metrics.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -717,3 +719,18 @@ ACPIOSTInfoList *qmp_query_acpi_ospm_status(Error **errp)
 
     return head;
 }
+
+void qmp_lock_profile_set(bool enable, Error **errp)
+{
+    lock_profile_set_enabled(enable);
+}
+
+LockProfileInfoList *qmp_query_lock_profile(Error **errp)
+{
+    return lock_profile_query();
+}
+
+StatsInfoList *qmp_query_stats(Error **errp)
+{
+    return qemu_metrics_query();
+}
@@ -27,8 +27,11 @@
 #include "qemu/log.h"
 #include "exec/log.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
 #include "hw/qdev-properties.h"
+#include "qapi-visit.h"
 #include "trace-root.h"
 
 bool cpu_exists(int64_t id)
@@ -115,7 +118,15 @@ static void cpu_common_get_memory_mapping(CPUState *cpu,
 
 void cpu_reset_interrupt(CPUState *cpu, int mask)
 {
+    bool need_lock = !qemu_mutex_iothread_locked();
+
+    if (need_lock) {
+        qemu_mutex_lock_iothread();
+    }
     cpu->interrupt_request &= ~mask;
+    if (need_lock) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void cpu_exit(CPUState *cpu)
@@ -123,7 +134,12 @@ void cpu_exit(CPUState *cpu)
     atomic_set(&cpu->exit_request, 1);
     /* Ensure cpu_exec will see the exit request after TCG has exited.  */
     smp_wmb();
-    atomic_set(&cpu->tcg_exit_req, 1);
+    if (use_icount) {
+        /* Checked by the icount budget test in the TB prologue */
+        atomic_set(&cpu->icount_decr.u16.high, 0xffff);
+    } else {
+        atomic_set(&cpu->tcg_exit_req, 1);
+    }
 }
 
 int cpu_write_elf32_qemunote(WriteCoreDumpFunction f, CPUState *cpu,
@@ -285,6 +301,9 @@ static void cpu_common_reset(CPUState *cpu)
         for (i = 0; i < TB_JMP_CACHE_SIZE; ++i) {
             atomic_set(&cpu->tb_jmp_cache[i], NULL);
         }
+        for (i = 0; i < TB_JMP_CACHE2_SIZE; ++i) {
+            atomic_set(&cpu->tb_jmp_cache2[i], NULL);
+        }
 
 #ifdef CONFIG_SOFTMMU
         tlb_flush(cpu, 0);
@@ -383,6 +402,7 @@ static void cpu_common_initfn(Object *obj)
     cpu->nr_threads = 1;
 
     qemu_mutex_init(&cpu->work_mutex);
+    qemu_mutex_init(&cpu->coalesced_mmio_lock);
     QTAILQ_INIT(&cpu->breakpoints);
     QTAILQ_INIT(&cpu->watchpoints);
 
@@ -395,6 +415,7 @@ static void cpu_common_finalize(Object *obj)
 {
     CPUState *cpu = CPU(obj);
     g_free(cpu->trace_dstate);
+    g_free(cpu->coalesced_mmio);
 }
 
 static int64_t cpu_common_get_arch_id(CPUState *cpu)
@@ -407,6 +428,68 @@ static vaddr cpu_adjust_watchpoint_address(CPUState *cpu, vaddr addr, int len)
     return addr;
 }
 
+static void cpu_get_host_cpus(Object *obj, Visitor *v, const char *name,
+                              void *opaque, Error **errp)
+{
+    CPUState *cpu = CPU(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **tail = &host_cpus;
+    unsigned long i;
+
+    for (i = find_first_bit(cpu->host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+         i < QEMU_THREAD_MAX_HOST_CPUS;
+         i = find_next_bit(cpu->host_cpus, QEMU_THREAD_MAX_HOST_CPUS, i + 1)) {
+        *tail = g_new0(uint16List, 1);
+        (*tail)->value = i;
+        tail = &(*tail)->next;
+    }
+
+    visit_type_uint16List(v, name, &host_cpus, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+static void cpu_set_host_cpus(Object *obj, Visitor *v, const char *name,
+                              void *opaque, Error **errp)
+{
+    CPUState *cpu = CPU(obj);
+    DECLARE_BITMAP(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+    uint16List *list = NULL, *l;
+    Error *local_err = NULL;
+    int ret;
+
+    visit_type_uint16List(v, name, &list, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    bitmap_zero(host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+    for (l = list; l; l = l->next) {
+        if (l->value >= QEMU_THREAD_MAX_HOST_CPUS) {
+            error_setg(&local_err, "host CPU %d is out of range [0, %d]",
+                       l->value, QEMU_THREAD_MAX_HOST_CPUS - 1);
+            goto out;
+        }
+        set_bit(l->value, host_cpus);
+    }
+
+    /* A running vCPU is moved right away, others when their thread starts */
+    if (cpu->created && !bitmap_empty(host_cpus, QEMU_THREAD_MAX_HOST_CPUS)) {
+        ret = qemu_thread_set_affinity(cpu->thread, host_cpus,
+                                       QEMU_THREAD_MAX_HOST_CPUS);
+        if (ret < 0) {
+            error_setg_errno(&local_err, -ret,
+                             "cannot set vCPU thread affinity");
+            goto out;
+        }
+    }
+
+    bitmap_copy(cpu->host_cpus, host_cpus, QEMU_THREAD_MAX_HOST_CPUS);
+
+out:
+    qapi_free_uint16List(list);
+    error_propagate(errp, local_err);
+}
+
 static void cpu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -432,6 +515,9 @@ static void cpu_class_init(ObjectClass *klass, void *data)
     k->cpu_exec_exit = cpu_common_noop;
     k->cpu_exec_interrupt = cpu_common_exec_interrupt;
     k->adjust_watchpoint_address = cpu_adjust_watchpoint_address;
+    object_class_property_add(klass, "host-cpus", "int",
+                              cpu_get_host_cpus, cpu_set_host_cpus,
+                              NULL, NULL, &error_abort);
     set_bit(DEVICE_CATEGORY_CPU, dc->categories);
     dc->realize = cpu_common_realizefn;
     dc->unrealize = cpu_common_unrealizefn;
@@ -291,7 +291,7 @@ static void type_initialize(TypeImpl *ti)
         memcpy(ti->class, parent->class, parent->class_size);
         ti->class->interfaces = NULL;
         ti->class->properties = g_hash_table_new_full(
-            g_str_hash, g_str_equal, g_free, object_property_free);
+            NULL, NULL, NULL, object_property_free);
 
         for (e = parent->class->interfaces; e; e = e->next) {
             InterfaceClass *iface = e->data;
@@ -318,7 +318,7 @@ static void type_initialize(TypeImpl *ti)
         }
     } else {
         ti->class->properties = g_hash_table_new_full(
-            g_str_hash, g_str_equal, g_free, object_property_free);
+            NULL, NULL, NULL, object_property_free);
     }
 
     ti->class->type = ti;
@@ -984,20 +984,52 @@ object_class_property_add(ObjectClass *klass,
     prop->release = release;
     prop->opaque = opaque;
 
-    g_hash_table_insert(klass->properties, g_strdup(name), prop);
+    g_hash_table_insert(klass->properties, (gpointer)g_intern_string(name),
+                        prop);
 
     return prop;
 }
 
+/*
+ * Class property tables are keyed by the interned property name, so that
+ * a lookup through a deep class hierarchy hashes the string only once.
+ * Returns NULL if no class property can be called @name.
+ */
+static const char *object_class_property_key(const char *name)
+{
+    GQuark quark = g_quark_try_string(name);
+
+    return quark ? g_quark_to_string(quark) : NULL;
+}
+
+static ObjectProperty *object_class_property_lookup(ObjectClass *klass,
+                                                    const char *key)
+{
+    ObjectClass *parent_klass;
+    ObjectProperty *prop;
+
+    parent_klass = object_class_get_parent(klass);
+    if (parent_klass) {
+        prop = object_class_property_lookup(parent_klass, key);
+        if (prop) {
+            return prop;
+        }
+    }
+
+    return g_hash_table_lookup(klass->properties, key);
+}
+
 ObjectProperty *object_property_find(Object *obj, const char *name,
                                      Error **errp)
 {
-    ObjectProperty *prop;
-    ObjectClass *klass = object_get_class(obj);
+    ObjectProperty *prop = NULL;
+    const char *key = object_class_property_key(name);
 
-    prop = object_class_property_find(klass, name, NULL);
-    if (prop) {
-        return prop;
+    if (key) {
+        prop = object_class_property_lookup(object_get_class(obj), key);
+        if (prop) {
+            return prop;
+        }
     }
 
     prop = g_hash_table_lookup(obj->properties, name);
@@ -1032,18 +1064,12 @@ ObjectProperty *object_property_iter_next(ObjectPropertyIterator *iter)
 ObjectProperty *object_class_property_find(ObjectClass *klass, const char *name,
                                            Error **errp)
 {
-    ObjectProperty *prop;
-    ObjectClass *parent_klass;
+    ObjectProperty *prop = NULL;
+    const char *key = object_class_property_key(name);
 
-    parent_klass = object_class_get_parent(klass);
-    if (parent_klass) {
-        prop = object_class_property_find(parent_klass, name, NULL);
-        if (prop) {
-            return prop;
-        }
+    if (key) {
+        prop = object_class_property_lookup(klass, key);
     }
-
-    prop = g_hash_table_lookup(klass->properties, name);
     if (!prop) {
         error_setg(errp, "Property '.%s' not found", name);
     }
@@ -2287,9 +2313,12 @@ void object_class_property_set_description(ObjectClass *klass,
                                            const char *description,
                                            Error **errp)
 {
-    ObjectProperty *op;
+    ObjectProperty *op = NULL;
+    const char *key = object_class_property_key(name);
 
-    op = g_hash_table_lookup(klass->properties, name);
+    if (key) {
+        op = g_hash_table_lookup(klass->properties, key);
+    }
     if (!op) {
         error_setg(errp, "Property '.%s' not found", name);
         return;
@@ -14,7 +14,12 @@
 #include "sysemu/replay.h"
 #include "replay-internal.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
 #include "sysemu/sysemu.h"
+#include "migration/compress.h"
 
 /* Mutex to protect reading and writing events to the log.
    data_kind and has_unread_data are also protected
@@ -26,10 +31,243 @@ static QemuMutex lock;
 /* File for replay writing */
 FILE *replay_file;
 
+/*
+ * The log is stored as a sequence of blocks of up to REPLAY_BLOCK_SIZE
+ * bytes of event data.  When recording, full blocks are compressed and
+ * written out by a dedicated thread, so that the vCPU does not wait for
+ * file I/O.  An index of the blocks, written at the end of the file, lets
+ * replay seek to the log offset saved in a snapshot without decompressing
+ * everything in front of it.
+ *
+ * File layout, all integers big endian:
+ *   header:  u32 REPLAY_VERSION, u64 index file offset (0 if the recording
+ *            was not finished), u32 MigrationCompressMethod
+ *   blocks:  u32 compressed size (| REPLAY_BLOCK_RAW if stored as is),
+ *            u32 size, data
+ *   index:   u32 number of blocks, then u64 data offset and u64 file offset
+ *            of each block
+ */
+#define HEADER_SIZE (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t))
+
+#define REPLAY_BLOCK_SIZE   (256 * 1024)
+#define REPLAY_BLOCK_RAW    0x80000000U
+/* Blocks the writer thread may lag behind before recording waits for it */
+#define REPLAY_MAX_PENDING  16
+
+typedef struct ReplayBlock {
+    uint8_t *data;
+    size_t len;
+    QSIMPLEQ_ENTRY(ReplayBlock) next;
+} ReplayBlock;
+
+typedef struct ReplayIndexEntry {
+    uint64_t offset;        /* offset of the block's data in the log */
+    uint64_t file_offset;   /* offset of the block header in the file */
+} ReplayIndexEntry;
+
+typedef struct ReplayLog {
+    MigrationCompressor *compressor;
+    MigrationCompressMethod method;
+    GArray *index;          /* of ReplayIndexEntry */
+    uint8_t *cbuf;          /* compressed data */
+    size_t cbuf_size;
+
+    /* The block being filled when recording, or being read when replaying */
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    uint64_t offset;        /* log offset of buf[0] */
+    unsigned int next_block;
+    bool eof;
+    bool error;
+
+    /* Writer thread, only used when recording */
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, ReplayBlock) pending;
+    unsigned int n_pending;
+    bool stop;
+    uint64_t written;       /* log bytes written out by the thread */
+    uint64_t file_offset;   /* where the thread writes the next block */
+} ReplayLog;
+
+static ReplayLog replay_log;
+
+static void replay_log_write_block(ReplayBlock *b)
+{
+    ReplayIndexEntry e = {
+        .offset = replay_log.written,
+        .file_offset = replay_log.file_offset,
+    };
+    const uint8_t *data = replay_log.cbuf;
+    ssize_t clen;
+    uint32_t hdr[2];
+    uint32_t flags = 0;
+
+    clen = migration_compress(replay_log.compressor, replay_log.cbuf,
+                              replay_log.cbuf_size, b->data, b->len);
+    if (clen < 0 || clen >= b->len) {
+        clen = b->len;
+        data = b->data;
+        flags = REPLAY_BLOCK_RAW;
+    }
+
+    hdr[0] = cpu_to_be32(clen | flags);
+    hdr[1] = cpu_to_be32(b->len);
+    if ((fwrite(hdr, sizeof(hdr), 1, replay_file) != 1 ||
+         fwrite(data, clen, 1, replay_file) != 1) &&
+        !atomic_read(&replay_log.error)) {
+        error_report("replay write error: %s", strerror(errno));
+        atomic_set(&replay_log.error, true);
+    }
+
+    g_array_append_val(replay_log.index, e);
+    replay_log.written += b->len;
+    replay_log.file_offset += sizeof(hdr) + clen;
+}
+
+static void *replay_log_thread(void *opaque)
+{
+    ReplayBlock *b;
+
+    qemu_mutex_lock(&replay_log.lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&replay_log.pending) && !replay_log.stop) {
+            qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+        }
+        b = QSIMPLEQ_FIRST(&replay_log.pending);
+        if (!b) {
+            break;
+        }
+        qemu_mutex_unlock(&replay_log.lock);
+
+        replay_log_write_block(b);
+
+        qemu_mutex_lock(&replay_log.lock);
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.pending, next);
+        replay_log.n_pending--;
+        qemu_cond_broadcast(&replay_log.cond);
+        g_free(b->data);
+        g_free(b);
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+
+    return NULL;
+}
+
+/* Hand the current block to the writer thread and start a new one */
+static void replay_log_submit(void)
+{
+    ReplayBlock *b;
+
+    if (!replay_log.len) {
+        return;
+    }
+
+    b = g_new(ReplayBlock, 1);
+    b->data = replay_log.buf;
+    b->len = replay_log.len;
+    replay_log.offset += replay_log.len;
+    replay_log.buf = g_malloc(REPLAY_BLOCK_SIZE);
+    replay_log.len = 0;
+
+    qemu_mutex_lock(&replay_log.lock);
+    while (replay_log.n_pending >= REPLAY_MAX_PENDING) {
+        qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&replay_log.pending, b, next);
+    replay_log.n_pending++;
+    qemu_cond_broadcast(&replay_log.cond);
+    qemu_mutex_unlock(&replay_log.lock);
+}
+
+/* Read and decompress block @n into the current block */
+static bool replay_log_load_block(unsigned int n)
+{
+    ReplayIndexEntry *e;
+    uint32_t hdr[2];
+    size_t clen, len;
+
+    if (n >= replay_log.index->len) {
+        replay_log.eof = true;
+        return false;
+    }
+    e = &g_array_index(replay_log.index, ReplayIndexEntry, n);
+
+    if (fseek(replay_file, e->file_offset, SEEK_SET) ||
+        fread(hdr, sizeof(hdr), 1, replay_file) != 1) {
+        goto fail;
+    }
+    clen = be32_to_cpu(hdr[0]) & ~REPLAY_BLOCK_RAW;
+    len = be32_to_cpu(hdr[1]);
+    if (len > REPLAY_BLOCK_SIZE || clen > replay_log.cbuf_size) {
+        goto fail;
+    }
+
+    if (be32_to_cpu(hdr[0]) & REPLAY_BLOCK_RAW) {
+        if (clen != len || fread(replay_log.buf, len, 1, replay_file) != 1) {
+            goto fail;
+        }
+    } else if (fread(replay_log.cbuf, clen, 1, replay_file) != 1 ||
+               migration_decompress(replay_log.compressor, replay_log.buf,
+                                    REPLAY_BLOCK_SIZE, replay_log.cbuf,
+                                    clen) != len) {
+        goto fail;
+    }
+
+    replay_log.offset = e->offset;
+    replay_log.len = len;
+    replay_log.pos = 0;
+    replay_log.next_block = n + 1;
+    return true;
+
+fail:
+    replay_log.error = true;
+    return false;
+}
+
+static void replay_put_data(const uint8_t *buf, size_t size)
+{
+    size_t len;
+
+    while (size) {
+        len = MIN(size, REPLAY_BLOCK_SIZE - replay_log.len);
+        memcpy(replay_log.buf + replay_log.len, buf, len);
+        replay_log.len += len;
+        if (replay_log.len == REPLAY_BLOCK_SIZE) {
+            replay_log_submit();
+        }
+        buf += len;
+        size -= len;
+    }
+}
+
+static bool replay_get_data(uint8_t *buf, size_t size)
+{
+    size_t len;
+
+    while (size) {
+        if (replay_log.pos == replay_log.len &&
+            !replay_log_load_block(replay_log.next_block)) {
+            return false;
+        }
+        len = MIN(size, replay_log.len - replay_log.pos);
+        memcpy(buf, replay_log.buf + replay_log.pos, len);
+        replay_log.pos += len;
+        buf += len;
+        size -= len;
+    }
+    return true;
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        replay_log.buf[replay_log.len++] = byte;
+        if (replay_log.len == REPLAY_BLOCK_SIZE) {
+            replay_log_submit();
+        }
     }
 }
 
@@ -62,7 +300,7 @@ void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        replay_put_data(buf, size);
     }
 }
 
@@ -70,7 +308,11 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (replay_log.pos == replay_log.len &&
+            !replay_log_load_block(replay_log.next_block)) {
+            return EOF; /* like getc() */
+        }
+        byte = replay_log.buf[replay_log.pos++];
     }
     return byte;
 }
@@ -112,7 +354,7 @@ void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (!replay_get_data(buf, *size)) {
             error_report("replay read error");
         }
     }
@@ -123,20 +365,203 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (!replay_get_data(*buf, *size)) {
             error_report("replay read error");
         }
     }
 }
 
+/* Build the index by walking the blocks, for logs that were not finished */
+static bool replay_log_scan_index(void)
+{
+    ReplayIndexEntry e = { .offset = 0, .file_offset = HEADER_SIZE };
+    uint32_t hdr[2];
+
+    while (!fseek(replay_file, e.file_offset, SEEK_SET) &&
+           fread(hdr, sizeof(hdr), 1, replay_file) == 1) {
+        g_array_append_val(replay_log.index, e);
+        e.offset += be32_to_cpu(hdr[1]);
+        e.file_offset += sizeof(hdr) +
+                         (be32_to_cpu(hdr[0]) & ~REPLAY_BLOCK_RAW);
+    }
+    return !ferror(replay_file);
+}
+
+static bool replay_log_read_index(uint64_t index_offset)
+{
+    ReplayIndexEntry e;
+    uint64_t ent[2];
+    uint32_t count;
+
+    if (fseek(replay_file, index_offset, SEEK_SET) ||
+        fread(&count, sizeof(count), 1, replay_file) != 1) {
+        return false;
+    }
+    for (count = be32_to_cpu(count); count; count--) {
+        if (fread(ent, sizeof(ent), 1, replay_file) != 1) {
+            return false;
+        }
+        e.offset = be64_to_cpu(ent[0]);
+        e.file_offset = be64_to_cpu(ent[1]);
+        g_array_append_val(replay_log.index, e);
+    }
+    return true;
+}
+
+bool replay_log_open(uint32_t version)
+{
+    uint32_t hdr32[2];
+    uint64_t index_offset;
+    uint8_t header[HEADER_SIZE] = {};
+
+    replay_log.index = g_array_new(false, false, sizeof(ReplayIndexEntry));
+    replay_log.buf = g_malloc(REPLAY_BLOCK_SIZE);
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_log.method = migration_compress_method_supported(
+            MIGRATION_COMPRESS_METHOD_ZSTD) ? MIGRATION_COMPRESS_METHOD_ZSTD :
+                                              MIGRATION_COMPRESS_METHOD_ZLIB;
+
+        /* The header is filled in by replay_log_close() */
+        if (fwrite(header, sizeof(header), 1, replay_file) != 1) {
+            return false;
+        }
+        replay_log.file_offset = HEADER_SIZE;
+    } else {
+        if (fread(&hdr32[0], sizeof(hdr32[0]), 1, replay_file) != 1 ||
+            fread(&index_offset, sizeof(index_offset), 1, replay_file) != 1 ||
+            fread(&hdr32[1], sizeof(hdr32[1]), 1, replay_file) != 1 ||
+            be32_to_cpu(hdr32[0]) != version) {
+            return false;
+        }
+        replay_log.method = be32_to_cpu(hdr32[1]);
+        index_offset = be64_to_cpu(index_offset);
+    }
+
+    replay_log.compressor = migration_compressor_new(replay_log.method, 1,
+                                                     &error_fatal);
+    replay_log.cbuf_size = migration_compressor_bound(replay_log.compressor,
+                                                      REPLAY_BLOCK_SIZE);
+    replay_log.cbuf = g_malloc(replay_log.cbuf_size);
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        qemu_mutex_init(&replay_log.lock);
+        qemu_cond_init(&replay_log.cond);
+        QSIMPLEQ_INIT(&replay_log.pending);
+        qemu_thread_create(&replay_log.thread, "replay-log",
+                           replay_log_thread, NULL, QEMU_THREAD_JOINABLE);
+        return true;
+    }
+
+    if (index_offset) {
+        return replay_log_read_index(index_offset);
+    }
+    return replay_log_scan_index();
+}
+
+void replay_log_close(uint32_t version)
+{
+    ReplayIndexEntry *e;
+    uint64_t ent[2];
+    uint64_t index_offset;
+    uint32_t val;
+    unsigned int i;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_log_submit();
+        qemu_mutex_lock(&replay_log.lock);
+        replay_log.stop = true;
+        qemu_cond_broadcast(&replay_log.cond);
+        qemu_mutex_unlock(&replay_log.lock);
+        qemu_thread_join(&replay_log.thread);
+        qemu_cond_destroy(&replay_log.cond);
+        qemu_mutex_destroy(&replay_log.lock);
+
+        /* Append the index and point the header at it */
+        index_offset = replay_log.file_offset;
+        val = cpu_to_be32(replay_log.index->len);
+        fwrite(&val, sizeof(val), 1, replay_file);
+        for (i = 0; i < replay_log.index->len; i++) {
+            e = &g_array_index(replay_log.index, ReplayIndexEntry, i);
+            ent[0] = cpu_to_be64(e->offset);
+            ent[1] = cpu_to_be64(e->file_offset);
+            fwrite(ent, sizeof(ent), 1, replay_file);
+        }
+
+        fseek(replay_file, 0, SEEK_SET);
+        val = cpu_to_be32(version);
+        fwrite(&val, sizeof(val), 1, replay_file);
+        index_offset = cpu_to_be64(index_offset);
+        fwrite(&index_offset, sizeof(index_offset), 1, replay_file);
+        val = cpu_to_be32(replay_log.method);
+        fwrite(&val, sizeof(val), 1, replay_file);
+    }
+
+    migration_compressor_free(replay_log.compressor);
+    g_array_free(replay_log.index, true);
+    g_free(replay_log.cbuf);
+    g_free(replay_log.buf);
+    memset(&replay_log, 0, sizeof(replay_log));
+}
+
+uint64_t replay_log_tell(void)
+{
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        return replay_log.offset + replay_log.len;
+    }
+    return replay_log.offset + replay_log.pos;
+}
+
+int replay_log_seek(uint64_t offset)
+{
+    ReplayIndexEntry *e;
+    unsigned int lo, hi, mid;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        if (offset != replay_log_tell()) {
+            error_report("replay: can't rewind the log while recording");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    /* Find the last block that starts at or before @offset */
+    lo = 0;
+    hi = replay_log.index->len;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        e = &g_array_index(replay_log.index, ReplayIndexEntry, mid);
+        if (e->offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    replay_log.eof = false;
+    replay_log.error = false;
+    if (!replay_log.index->len) {
+        replay_log.offset = replay_log.len = replay_log.pos = 0;
+        replay_log.next_block = 0;
+        return offset ? -EINVAL : 0;
+    }
+    if (!replay_log_load_block(lo) ||
+        offset - replay_log.offset > replay_log.len) {
+        error_report("replay: invalid log offset %" PRIu64, offset);
+        return -EINVAL;
+    }
+    replay_log.pos = offset - replay_log.offset;
+    return 0;
+}
+
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_log.eof) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (atomic_read(&replay_log.error)) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
@@ -100,6 +100,19 @@ void replay_mutex_destroy(void);
 void replay_mutex_lock(void);
 void replay_mutex_unlock(void);
 
+/*! Sets up the compressed log on replay_file.  Writes a placeholder header
+    when recording, checks the header and loads the block index when
+    replaying.  Returns false if the file is not a valid replay log. */
+bool replay_log_open(uint32_t version);
+/*! Flushes the log, then writes the block index and the final header
+    when recording. */
+void replay_log_close(uint32_t version);
+/*! Returns the current position in the uncompressed log. */
+uint64_t replay_log_tell(void);
+/*! Moves to position @offset of the uncompressed log.  Only the current
+    position is accepted when recording. */
+int replay_log_seek(uint64_t offset);
+
 /*! Checks error status of the file. */
 void replay_check_error(void);
 
@@ -21,9 +21,7 @@
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
-#define REPLAY_VERSION              0xe02005
-/* Size of replay log header */
-#define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+#define REPLAY_VERSION              0xe02006
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 char *replay_snapshot;
@@ -244,16 +242,11 @@ static void replay_enable(const char *fname, int mode)
     replay_state.has_unread_data = 0;
 
     /* skip file header for RECORD and check it for PLAY */
-    if (replay_mode == REPLAY_MODE_RECORD) {
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
-    } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
-            fprintf(stderr, "Replay: invalid input log file version\n");
-            exit(1);
-        }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+    if (!replay_log_open(REPLAY_VERSION)) {
+        fprintf(stderr, "Replay: invalid input log file version\n");
+        exit(1);
+    }
+    if (replay_mode == REPLAY_MODE_PLAY) {
         replay_fetch_data_kind();
     }
 
@@ -334,12 +327,10 @@ void replay_finish(void)
         if (replay_mode == REPLAY_MODE_RECORD) {
             /* write end event */
             replay_put_event(EVENT_END);
-
-            /* write header */
-            fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
         }
 
+        /* flush the log and write the index and header */
+        replay_log_close(REPLAY_VERSION);
         fclose(replay_file);
         replay_file = NULL;
     }
@@ -0,0 +1,222 @@
+#!/usr/bin/env python
+#
+# Generate an instruction decoder from a table of patterns
+#
+# Copyright (c) 2017 Linaro Ltd.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Each non-empty line of the pattern file that is not a comment names a
+# translation function and gives the 32-bit encoding it handles, most
+# significant bit first:
+#
+#   add_sub_imm     ...10001 ........ ........ ........
+#
+# '0' and '1' are fixed bits, '.' matches either value, and spaces only
+# help readability.  The generated function calls
+#
+#   <prefix>_<name>(s, insn);
+#
+# for the first pattern that matches and returns true, or returns false if
+# no pattern matches.  Patterns may overlap, in which case the earlier one
+# in the file wins.
+#
+# The decoder is a tree of switch statements: each switch looks at a run
+# of bits that is fixed in every pattern that is still possible, so that
+# a typical instruction is classified with a handful of extract32() calls
+# instead of a linear scan.  Only where patterns overlap do we fall back
+# to testing them one by one in file order.
+
+import optparse
+import sys
+
+INSN_BITS = 32
+
+
+class Pattern(object):
+    def __init__(self, name, mask, bits, lineno):
+        self.name = name
+        self.mask = mask
+        self.bits = bits
+        self.lineno = lineno
+
+
+def error(filename, lineno, msg):
+    sys.stderr.write('%s:%d: %s\n' % (filename, lineno, msg))
+    sys.exit(1)
+
+
+def parse(filename):
+    patterns = []
+    with open(filename) as f:
+        for lineno, line in enumerate(f, 1):
+            line = line.split('#', 1)[0].split()
+            if not line:
+                continue
+            name = line[0]
+            enc = ''.join(line[1:])
+            if len(enc) != INSN_BITS or enc.strip('01.'):
+                error(filename, lineno,
+                      'encoding of %s must be %d of 0, 1 and .'
+                      % (name, INSN_BITS))
+            mask = bits = 0
+            for c in enc:
+                mask <<= 1
+                bits <<= 1
+                if c != '.':
+                    mask |= 1
+                if c == '1':
+                    bits |= 1
+            for p in patterns:
+                if mask & p.mask == p.mask and bits & p.mask == p.bits:
+                    error(filename, lineno,
+                          '%s can never match, %s on line %d comes first'
+                          % (name, p.name, p.lineno))
+            patterns.append(Pattern(name, mask, bits, lineno))
+    return patterns
+
+
+def longest_run(mask):
+    """Return (pos, len) of the longest run of set bits in mask,
+    preferring the most significant one"""
+    best = (0, 0)
+    pos = INSN_BITS - 1
+    while pos >= 0:
+        if mask & (1 << pos):
+            end = pos
+            while pos >= 0 and mask & (1 << pos):
+                pos -= 1
+            if end - pos > best[1]:
+                best = (pos + 1, end - pos)
+        else:
+            pos -= 1
+    return best
+
+
+INSN_BITS_MASK = (1 << INSN_BITS) - 1
+
+# Widest switch, in bits, that copies patterns into several cases
+MAX_FIELD = 6
+
+
+def expand(mask):
+    """Return every value that has bits only where mask has them"""
+    vals = [0]
+    for bit in range(INSN_BITS):
+        if mask & (1 << bit):
+            vals += [v | (1 << bit) for v in vals]
+    return vals
+
+
+class Output(object):
+    def __init__(self, prefix):
+        self.prefix = prefix
+        self.lines = []
+
+    def out(self, depth, text):
+        self.lines.append('    ' * depth + text if text else '')
+
+    def call(self, depth, p):
+        self.out(depth, '%s_%s(s, insn);' % (self.prefix, p.name))
+        self.out(depth, 'return true;')
+
+    def test(self, depth, p, tested):
+        mask = p.mask & ~tested
+        if mask:
+            self.out(depth, 'if ((insn & 0x%08x) == 0x%08x) {'
+                     % (mask, p.bits & mask))
+            self.call(depth + 1, p)
+            self.out(depth, '}')
+            return False
+        self.call(depth, p)
+        return True
+
+    def tree(self, depth, patterns, tested):
+        """Emit code for patterns, which agree on the bits in tested.
+        Return True if the code always returns."""
+        field = INSN_BITS_MASK & ~tested
+        for p in patterns:
+            field &= p.mask
+
+        if len(patterns) == 1 or not field:
+            # Nothing left to switch on: try the patterns in order
+            for p in patterns:
+                if self.test(depth, p, tested):
+                    return True
+            return False
+
+        # Also switch on bits that most of the patterns fix, copying the
+        # others into every case they can match.  This keeps the tree
+        # shallow where a few patterns leave a bit or two undecided.
+        for bit in range(INSN_BITS - 1, -1, -1):
+            bit = 1 << bit
+            if (tested | field) & bit or bin(field).count('1') >= MAX_FIELD:
+                continue
+            fixed = len([p for p in patterns if p.mask & bit])
+            if fixed * 4 >= len(patterns) * 3:
+                field |= bit
+
+        groups = {}
+        for p in patterns:
+            for val in expand(field & ~p.mask):
+                p1 = Pattern(p.name, p.mask | field, p.bits | val, p.lineno)
+                groups.setdefault(p1.bits & field, []).append(p1)
+
+        pos, length = longest_run(field)
+        if field == ((1 << length) - 1) << pos:
+            self.out(depth, 'switch (extract32(insn, %d, %d)) {'
+                     % (pos, length))
+            label = lambda val: '0x%x' % (val >> pos)
+        else:
+            self.out(depth, 'switch (insn & 0x%08x) {' % field)
+            label = lambda val: '0x%08x' % val
+        # Cases that generate the same code share it
+        cases = []
+        for val in sorted(groups):
+            sub = Output(self.prefix)
+            if not sub.tree(depth + 1, groups[val], tested | field):
+                sub.out(depth + 1, 'break;')
+            if cases and cases[-1][1] == sub.lines:
+                cases[-1][0].append(val)
+            else:
+                cases.append(([val], sub.lines))
+        for vals, lines in cases:
+            for val in vals:
+                self.out(depth, 'case %s:' % label(val))
+            self.lines += lines
+        self.out(depth, '}')
+        return False
+
+
+def main():
+    parser = optparse.OptionParser('usage: %prog [options] PATTERNS')
+    parser.add_option('--decode', dest='decode', default='decode',
+                      help='name of the generated function')
+    parser.add_option('--prefix', dest='prefix', default='disas',
+                      help='prefix of the translation functions')
+    parser.add_option('-o', dest='output', metavar='FILE',
+                      help='write the decoder to FILE instead of stdout')
+    opts, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('expected one pattern file')
+
+    patterns = parse(args[0])
+    o = Output(opts.prefix)
+    o.out(0, '/* This file is autogenerated by scripts/decode-table.py.  */')
+    o.out(0, '')
+    o.out(0, 'static bool %s(DisasContext *s, uint32_t insn)' % opts.decode)
+    o.out(0, '{')
+    if not o.tree(1, patterns, 0):
+        o.out(1, 'return false;')
+    o.out(0, '}')
+
+    f = open(opts.output, 'w') if opts.output else sys.stdout
+    f.write('\n'.join(o.lines) + '\n')
+    if opts.output:
+        f.close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
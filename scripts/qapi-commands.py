@@ -25,7 +25,7 @@ def gen_command_decl(name, arg_type, boxed, ret_type):
                  params=gen_params(arg_type, boxed, 'Error **errp'))
 
 
-def gen_call(name, arg_type, boxed, ret_type):
+def gen_call(name, arg_type, boxed, ret_type, json):
     ret = ''
 
     argstr = ''
@@ -54,8 +54,9 @@ def gen_call(name, arg_type, boxed, ret_type):
         goto out;
     }
 
-    qmp_marshal_output_%(c_name)s(retval, ret, &err);
+    qmp_marshal_output_%(json)s%(c_name)s(retval, ret, &err);
 ''',
+                     json='json_' if json else '',
                      c_name=ret_type.c_name())
     return ret
 
@@ -83,7 +84,33 @@ static void qmp_marshal_output_%(c_name)s(%(c_type)s ret_in, QObject **ret_out,
                  c_type=ret_type.c_type(), c_name=ret_type.c_name())
 
 
-def gen_marshal_proto(name):
+def gen_marshal_output_json(ret_type):
+    return mcgen('''
+
+static void qmp_marshal_output_json_%(c_name)s(%(c_type)s ret_in, QString *ret_out, Error **errp)
+{
+    Error *err = NULL;
+    Visitor *v;
+
+    v = json_output_visitor_new(ret_out);
+    visit_type_%(c_name)s(v, "unused", &ret_in, &err);
+    if (!err) {
+        visit_complete(v, ret_out);
+    }
+    error_propagate(errp, err);
+    visit_free(v);
+    v = qapi_dealloc_visitor_new();
+    visit_type_%(c_name)s(v, "unused", &ret_in, NULL);
+    visit_free(v);
+}
+''',
+                 c_type=ret_type.c_type(), c_name=ret_type.c_name())
+
+
+def gen_marshal_proto(name, json=False):
+    if json:
+        return ('static void qmp_marshal_json_%s(QDict *args, QString *ret, '
+                'Error **errp)' % c_name(name))
     return 'void qmp_marshal_%s(QDict *args, QObject **ret, Error **errp)' % c_name(name)
 
 
@@ -94,7 +121,7 @@ def gen_marshal_decl(name):
                  proto=gen_marshal_proto(name))
 
 
-def gen_marshal(name, arg_type, boxed, ret_type):
+def gen_marshal(name, arg_type, boxed, ret_type, json=False):
     have_args = arg_type and not arg_type.is_empty()
 
     ret = mcgen('''
@@ -103,7 +130,7 @@ def gen_marshal(name, arg_type, boxed, ret_type):
 {
     Error *err = NULL;
 ''',
-                proto=gen_marshal_proto(name))
+                proto=gen_marshal_proto(name, json))
 
     if ret_type:
         ret += mcgen('''
@@ -152,7 +179,7 @@ def gen_marshal(name, arg_type, boxed, ret_type):
     }
 ''')
 
-    ret += gen_call(name, arg_type, boxed, ret_type)
+    ret += gen_call(name, arg_type, boxed, ret_type, json)
 
     ret += mcgen('''
 
@@ -192,16 +219,26 @@ out:
     return ret
 
 
-def gen_register_command(name, success_response):
-    options = 'QCO_NO_OPTIONS'
+def gen_register_command(name, success_response, allow_oob, json):
+    options = []
     if not success_response:
-        options = 'QCO_NO_SUCCESS_RESP'
+        options += ['QCO_NO_SUCCESS_RESP']
+    if allow_oob:
+        options += ['QCO_ALLOW_OOB']
+    if not options:
+        options = ['QCO_NO_OPTIONS']
+    options = ' | '.join(options)
 
     ret = mcgen('''
     qmp_register_command("%(name)s", qmp_marshal_%(c_name)s, %(opts)s);
 ''',
                 name=name, c_name=c_name(name),
                 opts=options)
+    if json:
+        ret += mcgen('''
+    qmp_register_command_json("%(name)s", qmp_marshal_json_%(c_name)s);
+''',
+                     name=name, c_name=c_name(name))
     return ret
 
 
@@ -239,16 +276,23 @@ class QAPISchemaGenCommandVisitor(QAPISchemaVisitor):
         self._visited_ret_types = None
 
     def visit_command(self, name, info, arg_type, ret_type,
-                      gen, success_response, boxed):
+                      gen, success_response, boxed, allow_oob):
         if not gen:
             return
         self.decl += gen_command_decl(name, arg_type, boxed, ret_type)
         if ret_type and ret_type not in self._visited_ret_types:
             self._visited_ret_types.add(ret_type)
             self.defn += gen_marshal_output(ret_type)
+            self.defn += gen_marshal_output_json(ret_type)
         self.decl += gen_marshal_decl(name)
         self.defn += gen_marshal(name, arg_type, boxed, ret_type)
-        self._regy += gen_register_command(name, success_response)
+        # Commands with a return value can also serialize it straight
+        # to JSON text, see qmp_dispatch_json()
+        json = ret_type is not None and success_response
+        if json:
+            self.defn += gen_marshal(name, arg_type, boxed, ret_type, True)
+        self._regy += gen_register_command(name, success_response, allow_oob,
+                                           json)
 
 
 (input_file, output_dir, do_c, do_h, prefix, opts) = parse_command_line()
@@ -295,6 +339,7 @@ fdef.write(mcgen('''
 #include "qapi/visitor.h"
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qobject-input-visitor.h"
+#include "qapi/json-output-visitor.h"
 #include "qapi/dealloc-visitor.h"
 #include "%(prefix)sqapi-types.h"
 #include "%(prefix)sqapi-visit.h"
@@ -24,6 +24,11 @@ Backend attributes
 Attribute Description
 ========= ====================================================================
 PUBLIC    If exists and is set to 'True', the backend is considered "public".
+CHECK_TRACE_EVENT_GET_STATE
+          If exists and is set to 'True', the backend only emits events
+          enabled with trace_event_get_state().  When this holds for all
+          backends, the generated trace_foo() checks the state once, inline,
+          before running any backend code.
 ========= ====================================================================
 
 
@@ -105,6 +110,14 @@ class Wrapper:
         for backend in self._backends:
             assert exists(backend)
         assert tracetool.format.exists(self._format)
+        self._check_trace_event_get_state = all(
+            tracetool.try_import("tracetool.backend." + backend,
+                                 "CHECK_TRACE_EVENT_GET_STATE", False)[1]
+            for backend in self._backends)
+
+    @property
+    def check_trace_event_get_state(self):
+        return self._check_trace_event_get_state
 
     def _run_function(self, name, *args, **kwargs):
         for backend in self._backends:
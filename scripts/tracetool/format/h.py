@@ -56,6 +56,10 @@ def generate(events, backend, group):
                    % dict(
                        cpu=trace_cpu,
                        id=e.name.upper())
+        elif backend.check_trace_event_get_state:
+            # a disabled event costs a test and a branch, without calling
+            # into out-of-line backend code or evaluating its arguments
+            cond = "trace_event_get_state(TRACE_%s)" % e.name.upper()
         else:
             cond = "true"
 
@@ -198,13 +198,13 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
-    struct socket *tcp_last_so;
+    struct socket *tcp_so_cache[SO_CACHE_SIZE];
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
-    struct socket *udp_last_so;
+    struct socket *udp_so_cache[SO_CACHE_SIZE];
 
     /* icmp states */
     struct socket icmp;
@@ -16,13 +16,64 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
-struct socket *solookup(struct socket **last, struct socket *head,
+static unsigned int sockaddr_hash(struct sockaddr_storage *a)
+{
+    switch (a->ss_family) {
+    case AF_INET:
+    {
+        struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+        return a4->sin_addr.s_addr ^ a4->sin_port;
+    }
+    case AF_INET6:
+    {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+        uint32_t h = a6->sin6_port;
+        int i;
+
+        for (i = 0; i < 16; i += 4) {
+            h ^= a6->sin6_addr.s6_addr[i] << 24 |
+                 a6->sin6_addr.s6_addr[i + 1] << 16 |
+                 a6->sin6_addr.s6_addr[i + 2] << 8 |
+                 a6->sin6_addr.s6_addr[i + 3];
+        }
+        return h;
+    }
+    default:
+        g_assert_not_reached();
+    }
+
+    return 0;
+}
+
+static unsigned int socache_slot(struct sockaddr_storage *lhost,
+                                 struct sockaddr_storage *fhost)
+{
+    unsigned int h = sockaddr_hash(lhost);
+
+    if (fhost) {
+        h = h * 31 + sockaddr_hash(fhost);
+    }
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return h % SO_CACHE_SIZE;
+}
+
+/*
+ * Find the socket of a (lhost, fhost) pair in the list at head; fhost
+ * may be NULL to match on lhost only.
+ *
+ * cache is a direct-mapped cache of SO_CACHE_SIZE sockets that were found
+ * before.  Addresses of a socket can change after it was cached, so a hit
+ * is checked like any list entry, and a miss falls back to the list.
+ */
+struct socket *solookup(struct socket **cache, struct socket *head,
         struct sockaddr_storage *lhost, struct sockaddr_storage *fhost)
 {
-    struct socket *so = *last;
+    struct socket **slot = &cache[socache_slot(lhost, fhost)];
+    struct socket *so = *slot;
 
-    /* Optimisation */
-    if (so != head && sockaddr_equal(&(so->lhost.ss), lhost)
+    if (so && sockaddr_equal(&(so->lhost.ss), lhost)
             && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
         return so;
     }
@@ -30,7 +81,14 @@ struct socket *solookup(struct socket **last, struct socket *head,
     for (so = head->so_next; so != head; so = so->so_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost)
                 && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
-            *last = so;
+            if (*slot) {
+                (*slot)->so_cache_slot = NULL;
+            }
+            if (so->so_cache_slot) {
+                *so->so_cache_slot = NULL;
+            }
+            *slot = so;
+            so->so_cache_slot = slot;
             return so;
         }
     }
@@ -88,11 +146,10 @@ sofree(struct socket *so)
 	sofree(so->extra);
 	so->extra=NULL;
   }
-  if (so == slirp->tcp_last_so) {
-      slirp->tcp_last_so = &slirp->tcb;
-  } else if (so == slirp->udp_last_so) {
-      slirp->udp_last_so = &slirp->udb;
-  } else if (so == slirp->icmp_last_so) {
+  if (so->so_cache_slot) {
+      *so->so_cache_slot = NULL;
+  }
+  if (so == slirp->icmp_last_so) {
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
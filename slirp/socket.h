@@ -11,6 +11,9 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* Slots of the lookup caches in front of the TCP and UDP socket lists */
+#define SO_CACHE_SIZE 256
+
 /*
  * Our socket structure
  */
@@ -70,6 +73,8 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  struct socket **so_cache_slot;	/* Lookup cache slot holding us */
 };
 
 
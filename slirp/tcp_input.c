@@ -394,7 +394,7 @@ findso:
 	    g_assert_not_reached();
 	}
 
-	so = solookup(&slirp->tcp_last_so, &slirp->tcb, &lhost, &fhost);
+	so = solookup(slirp->tcp_so_cache, &slirp->tcb, &lhost, &fhost);
 
 	/*
 	 * If the state is CLOSED (i.e., TCB does not exist) then
@@ -32,6 +32,9 @@
 
 #define CPUArchState struct CPUARMState
 
+/* ARM processors have a weak memory model */
+#define TCG_GUEST_DEFAULT_MO      (0)
+
 #include "qemu-common.h"
 #include "cpu-qom.h"
 #include "exec/cpu-defs.h"
@@ -30,6 +30,17 @@ union CRYPTO_STATE {
 #define CR_ST_WORD(state, i)   (state.words[i])
 #endif
 
+/* An AArch64 host with the crypto extensions has the same SHA
+ * instructions, on the same register layout.
+ */
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO) && \
+    !defined(HOST_WORDS_BIGENDIAN)
+#include <arm_neon.h>
+#define HOST_SHA_INSNS
+#define LD_STATE(state)        vld1q_u32(state.words)
+#define ST_STATE(state, v)     vst1q_u32(state.words, v)
+#endif
+
 void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
                          uint32_t decrypt)
 {
@@ -52,6 +63,20 @@ void HELPER(crypto_aese)(CPUARMState *env, uint32_t rd, uint32_t rm,
     rk.l[0] ^= st.l[0];
     rk.l[1] ^= st.l[1];
 
+    if (aes_accel_available()) {
+        /* What is left is AESENCLAST or AESDECLAST with a zero key */
+        static const uint8_t zero[16];
+
+        if (decrypt) {
+            aes_accel_dec(rk.bytes, zero, true);
+        } else {
+            aes_accel_enc(rk.bytes, zero, true);
+        }
+        env->vfp.regs[rd] = make_float64(rk.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(rk.l[1]);
+        return;
+    }
+
     /* combine ShiftRows operation and sbox substitution */
     for (i = 0; i < 16; i++) {
         CR_ST_BYTE(st, i) = sbox[decrypt][CR_ST_BYTE(rk, shift[decrypt][i])];
@@ -205,6 +230,13 @@ void HELPER(crypto_aesmc)(CPUARMState *env, uint32_t rd, uint32_t rm,
 
     assert(decrypt < 2);
 
+    if (aes_accel_available()) {
+        aes_accel_mc(st.bytes, decrypt);
+        env->vfp.regs[rd] = make_float64(st.l[0]);
+        env->vfp.regs[rd + 1] = make_float64(st.l[1]);
+        return;
+    }
+
     for (i = 0; i < 16; i += 4) {
         CR_ST_WORD(st, i >> 2) =
             mc[decrypt][CR_ST_BYTE(st, i)] ^
@@ -217,6 +249,7 @@ void HELPER(crypto_aesmc)(CPUARMState *env, uint32_t rd, uint32_t rm,
     env->vfp.regs[rd + 1] = make_float64(st.l[1]);
 }
 
+#ifndef HOST_SHA_INSNS
 /*
  * SHA-1 logical functions
  */
@@ -235,6 +268,7 @@ static uint32_t maj(uint32_t x, uint32_t y, uint32_t z)
 {
     return (x & y) | ((x | y) & z);
 }
+#endif
 
 void HELPER(crypto_sha1_3reg)(CPUARMState *env, uint32_t rd, uint32_t rn,
                               uint32_t rm, uint32_t op)
@@ -252,6 +286,24 @@ void HELPER(crypto_sha1_3reg)(CPUARMState *env, uint32_t rd, uint32_t rn,
         float64_val(env->vfp.regs[rm + 1])
     } };
 
+#ifdef HOST_SHA_INSNS
+    switch (op) {
+    case 0:
+        ST_STATE(d, vsha1cq_u32(LD_STATE(d), n.words[0], LD_STATE(m)));
+        break;
+    case 1:
+        ST_STATE(d, vsha1pq_u32(LD_STATE(d), n.words[0], LD_STATE(m)));
+        break;
+    case 2:
+        ST_STATE(d, vsha1mq_u32(LD_STATE(d), n.words[0], LD_STATE(m)));
+        break;
+    case 3:
+        ST_STATE(d, vsha1su0q_u32(LD_STATE(d), LD_STATE(n), LD_STATE(m)));
+        break;
+    default:
+        g_assert_not_reached();
+    }
+#else
     if (op == 3) { /* sha1su0 */
         d.l[0] ^= d.l[1] ^ m.l[0];
         d.l[1] ^= n.l[0] ^ m.l[1];
@@ -284,6 +336,7 @@ void HELPER(crypto_sha1_3reg)(CPUARMState *env, uint32_t rd, uint32_t rn,
             CR_ST_WORD(d, 0) = t;
         }
     }
+#endif
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
 }
@@ -295,7 +348,11 @@ void HELPER(crypto_sha1h)(CPUARMState *env, uint32_t rd, uint32_t rm)
         float64_val(env->vfp.regs[rm + 1])
     } };
 
+#ifdef HOST_SHA_INSNS
+    CR_ST_WORD(m, 0) = vsha1h_u32(CR_ST_WORD(m, 0));
+#else
     CR_ST_WORD(m, 0) = ror32(CR_ST_WORD(m, 0), 2);
+#endif
     CR_ST_WORD(m, 1) = CR_ST_WORD(m, 2) = CR_ST_WORD(m, 3) = 0;
 
     env->vfp.regs[rd] = make_float64(m.l[0]);
@@ -313,15 +370,20 @@ void HELPER(crypto_sha1su1)(CPUARMState *env, uint32_t rd, uint32_t rm)
         float64_val(env->vfp.regs[rm + 1])
     } };
 
+#ifdef HOST_SHA_INSNS
+    ST_STATE(d, vsha1su1q_u32(LD_STATE(d), LD_STATE(m)));
+#else
     CR_ST_WORD(d, 0) = rol32(CR_ST_WORD(d, 0) ^ CR_ST_WORD(m, 1), 1);
     CR_ST_WORD(d, 1) = rol32(CR_ST_WORD(d, 1) ^ CR_ST_WORD(m, 2), 1);
     CR_ST_WORD(d, 2) = rol32(CR_ST_WORD(d, 2) ^ CR_ST_WORD(m, 3), 1);
     CR_ST_WORD(d, 3) = rol32(CR_ST_WORD(d, 3) ^ CR_ST_WORD(d, 0), 1);
+#endif
 
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
 }
 
+#ifndef HOST_SHA_INSNS
 /*
  * The SHA-256 logical functions, according to
  * http://csrc.nist.gov/groups/STM/cavp/documents/shs/sha256-384-512.pdf
@@ -346,6 +408,7 @@ static uint32_t s1(uint32_t x)
 {
     return ror32(x, 17) ^ ror32(x, 19) ^ (x >> 10);
 }
+#endif
 
 void HELPER(crypto_sha256h)(CPUARMState *env, uint32_t rd, uint32_t rn,
                             uint32_t rm)
@@ -362,6 +425,9 @@ void HELPER(crypto_sha256h)(CPUARMState *env, uint32_t rd, uint32_t rn,
         float64_val(env->vfp.regs[rm]),
         float64_val(env->vfp.regs[rm + 1])
     } };
+#ifdef HOST_SHA_INSNS
+    ST_STATE(d, vsha256hq_u32(LD_STATE(d), LD_STATE(n), LD_STATE(m)));
+#else
     int i;
 
     for (i = 0; i < 4; i++) {
@@ -382,6 +448,7 @@ void HELPER(crypto_sha256h)(CPUARMState *env, uint32_t rd, uint32_t rn,
         CR_ST_WORD(d, 1) = CR_ST_WORD(d, 0);
         CR_ST_WORD(d, 0) = t;
     }
+#endif
 
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
@@ -402,6 +469,9 @@ void HELPER(crypto_sha256h2)(CPUARMState *env, uint32_t rd, uint32_t rn,
         float64_val(env->vfp.regs[rm]),
         float64_val(env->vfp.regs[rm + 1])
     } };
+#ifdef HOST_SHA_INSNS
+    ST_STATE(d, vsha256h2q_u32(LD_STATE(d), LD_STATE(n), LD_STATE(m)));
+#else
     int i;
 
     for (i = 0; i < 4; i++) {
@@ -414,6 +484,7 @@ void HELPER(crypto_sha256h2)(CPUARMState *env, uint32_t rd, uint32_t rn,
         CR_ST_WORD(d, 1) = CR_ST_WORD(d, 0);
         CR_ST_WORD(d, 0) = CR_ST_WORD(n, 3 - i) + t;
     }
+#endif
 
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
@@ -430,10 +501,14 @@ void HELPER(crypto_sha256su0)(CPUARMState *env, uint32_t rd, uint32_t rm)
         float64_val(env->vfp.regs[rm + 1])
     } };
 
+#ifdef HOST_SHA_INSNS
+    ST_STATE(d, vsha256su0q_u32(LD_STATE(d), LD_STATE(m)));
+#else
     CR_ST_WORD(d, 0) += s0(CR_ST_WORD(d, 1));
     CR_ST_WORD(d, 1) += s0(CR_ST_WORD(d, 2));
     CR_ST_WORD(d, 2) += s0(CR_ST_WORD(d, 3));
     CR_ST_WORD(d, 3) += s0(CR_ST_WORD(m, 0));
+#endif
 
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
@@ -455,10 +530,14 @@ void HELPER(crypto_sha256su1)(CPUARMState *env, uint32_t rd, uint32_t rn,
         float64_val(env->vfp.regs[rm + 1])
     } };
 
+#ifdef HOST_SHA_INSNS
+    ST_STATE(d, vsha256su1q_u32(LD_STATE(d), LD_STATE(n), LD_STATE(m)));
+#else
     CR_ST_WORD(d, 0) += s1(CR_ST_WORD(m, 2)) + CR_ST_WORD(n, 1);
     CR_ST_WORD(d, 1) += s1(CR_ST_WORD(m, 3)) + CR_ST_WORD(n, 2);
     CR_ST_WORD(d, 2) += s1(CR_ST_WORD(d, 0)) + CR_ST_WORD(n, 3);
     CR_ST_WORD(d, 3) += s1(CR_ST_WORD(d, 1)) + CR_ST_WORD(m, 0);
+#endif
 
     env->vfp.regs[rd] = make_float64(d.l[0]);
     env->vfp.regs[rd + 1] = make_float64(d.l[1]);
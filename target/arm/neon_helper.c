@@ -481,12 +481,61 @@ uint64_t HELPER(neon_qsub_s64)(CPUARMState *env, uint64_t src1, uint64_t src2)
     return res;
 }
 
-#define NEON_FN(dest, src1, src2) dest = (src1 + src2) >> 1
-NEON_VOP(hadd_s8, neon_s8, 4)
-NEON_VOP(hadd_u8, neon_u8, 4)
-NEON_VOP(hadd_s16, neon_s16, 2)
-NEON_VOP(hadd_u16, neon_u16, 2)
-#undef NEON_FN
+/* Lane-wise operations on all the 8 or 16 bit elements of a 32 bit value
+   at once.  h has the top bit of each lane set: carries and borrows are
+   kept from crossing into the next lane by computing the top bits
+   separately.  */
+#define SWAR_H8 0x80808080u
+#define SWAR_H16 0x80008000u
+
+static inline uint32_t swar_add(uint32_t a, uint32_t b, uint32_t h)
+{
+    return ((a & ~h) + (b & ~h)) ^ ((a ^ b) & h);
+}
+
+static inline uint32_t swar_sub(uint32_t a, uint32_t b, uint32_t h)
+{
+    return ((a | h) - (b & ~h)) ^ ((a ^ ~b) & h);
+}
+
+/* Shift each lane right by one, arithmetic if sign is true.  */
+static inline uint32_t swar_shr1(uint32_t x, uint32_t h, bool sign)
+{
+    return ((x >> 1) & ~h) | (sign ? x & h : 0);
+}
+
+/* All ones in each lane of x that is nonzero, zero in the others.  */
+static inline uint32_t swar_nonzero(uint32_t x, uint32_t h, int bits)
+{
+    uint32_t t = (((x & ~h) + ~h) | x) & h;
+    return t | (t - (t >> (bits - 1)));
+}
+
+/* floor((a + b) / 2) == (a & b) + ((a ^ b) >> 1) without overflow.  */
+#define NEON_SWAR_HADD(name, h, sign) \
+uint32_t HELPER(glue(neon_, name))(uint32_t a, uint32_t b) \
+{ \
+    return swar_add(a & b, swar_shr1(a ^ b, h, sign), h); \
+}
+
+/* (a + b + 1) >> 1 == (a | b) - ((a ^ b) >> 1).  */
+#define NEON_SWAR_RHADD(name, h, sign) \
+uint32_t HELPER(glue(neon_, name))(uint32_t a, uint32_t b) \
+{ \
+    return swar_sub(a | b, swar_shr1(a ^ b, h, sign), h); \
+}
+
+/* (a - b) >> 1 == ((a ^ b) >> 1) - (~a & b).  */
+#define NEON_SWAR_HSUB(name, h, sign) \
+uint32_t HELPER(glue(neon_, name))(uint32_t a, uint32_t b) \
+{ \
+    return swar_sub(swar_shr1(a ^ b, h, sign), ~a & b, h); \
+}
+
+NEON_SWAR_HADD(hadd_s8, SWAR_H8, true)
+NEON_SWAR_HADD(hadd_u8, SWAR_H8, false)
+NEON_SWAR_HADD(hadd_s16, SWAR_H16, true)
+NEON_SWAR_HADD(hadd_u16, SWAR_H16, false)
 
 int32_t HELPER(neon_hadd_s32)(int32_t src1, int32_t src2)
 {
@@ -508,12 +557,10 @@ uint32_t HELPER(neon_hadd_u32)(uint32_t src1, uint32_t src2)
     return dest;
 }
 
-#define NEON_FN(dest, src1, src2) dest = (src1 + src2 + 1) >> 1
-NEON_VOP(rhadd_s8, neon_s8, 4)
-NEON_VOP(rhadd_u8, neon_u8, 4)
-NEON_VOP(rhadd_s16, neon_s16, 2)
-NEON_VOP(rhadd_u16, neon_u16, 2)
-#undef NEON_FN
+NEON_SWAR_RHADD(rhadd_s8, SWAR_H8, true)
+NEON_SWAR_RHADD(rhadd_u8, SWAR_H8, false)
+NEON_SWAR_RHADD(rhadd_s16, SWAR_H16, true)
+NEON_SWAR_RHADD(rhadd_u16, SWAR_H16, false)
 
 int32_t HELPER(neon_rhadd_s32)(int32_t src1, int32_t src2)
 {
@@ -535,12 +582,10 @@ uint32_t HELPER(neon_rhadd_u32)(uint32_t src1, uint32_t src2)
     return dest;
 }
 
-#define NEON_FN(dest, src1, src2) dest = (src1 - src2) >> 1
-NEON_VOP(hsub_s8, neon_s8, 4)
-NEON_VOP(hsub_u8, neon_u8, 4)
-NEON_VOP(hsub_s16, neon_s16, 2)
-NEON_VOP(hsub_u16, neon_u16, 2)
-#undef NEON_FN
+NEON_SWAR_HSUB(hsub_s8, SWAR_H8, true)
+NEON_SWAR_HSUB(hsub_u8, SWAR_H8, false)
+NEON_SWAR_HSUB(hsub_s16, SWAR_H16, true)
+NEON_SWAR_HSUB(hsub_u16, SWAR_H16, false)
 
 int32_t HELPER(neon_hsub_s32)(int32_t src1, int32_t src2)
 {
@@ -1143,20 +1188,12 @@ uint64_t HELPER(neon_qrshl_s64)(CPUARMState *env, uint64_t valop, uint64_t shift
 
 uint32_t HELPER(neon_add_u8)(uint32_t a, uint32_t b)
 {
-    uint32_t mask;
-    mask = (a ^ b) & 0x80808080u;
-    a &= ~0x80808080u;
-    b &= ~0x80808080u;
-    return (a + b) ^ mask;
+    return swar_add(a, b, SWAR_H8);
 }
 
 uint32_t HELPER(neon_add_u16)(uint32_t a, uint32_t b)
 {
-    uint32_t mask;
-    mask = (a ^ b) & 0x80008000u;
-    a &= ~0x80008000u;
-    b &= ~0x80008000u;
-    return (a + b) ^ mask;
+    return swar_add(a, b, SWAR_H16);
 }
 
 #define NEON_FN(dest, src1, src2) dest = src1 + src2
@@ -1164,10 +1201,15 @@ NEON_POP(padd_u8, neon_u8, 4)
 NEON_POP(padd_u16, neon_u16, 2)
 #undef NEON_FN
 
-#define NEON_FN(dest, src1, src2) dest = src1 - src2
-NEON_VOP(sub_u8, neon_u8, 4)
-NEON_VOP(sub_u16, neon_u16, 2)
-#undef NEON_FN
+uint32_t HELPER(neon_sub_u8)(uint32_t a, uint32_t b)
+{
+    return swar_sub(a, b, SWAR_H8);
+}
+
+uint32_t HELPER(neon_sub_u16)(uint32_t a, uint32_t b)
+{
+    return swar_sub(a, b, SWAR_H16);
+}
 
 #define NEON_FN(dest, src1, src2) dest = src1 * src2
 NEON_VOP(mul_u8, neon_u8, 4)
@@ -1228,17 +1270,35 @@ uint64_t HELPER(neon_mull_p8)(uint32_t op1, uint32_t op2)
     return result;
 }
 
-#define NEON_FN(dest, src1, src2) dest = (src1 & src2) ? -1 : 0
-NEON_VOP(tst_u8, neon_u8, 4)
-NEON_VOP(tst_u16, neon_u16, 2)
-NEON_VOP(tst_u32, neon_u32, 1)
-#undef NEON_FN
+uint32_t HELPER(neon_tst_u8)(uint32_t a, uint32_t b)
+{
+    return swar_nonzero(a & b, SWAR_H8, 8);
+}
 
-#define NEON_FN(dest, src1, src2) dest = (src1 == src2) ? -1 : 0
-NEON_VOP(ceq_u8, neon_u8, 4)
-NEON_VOP(ceq_u16, neon_u16, 2)
-NEON_VOP(ceq_u32, neon_u32, 1)
-#undef NEON_FN
+uint32_t HELPER(neon_tst_u16)(uint32_t a, uint32_t b)
+{
+    return swar_nonzero(a & b, SWAR_H16, 16);
+}
+
+uint32_t HELPER(neon_tst_u32)(uint32_t a, uint32_t b)
+{
+    return (a & b) ? -1 : 0;
+}
+
+uint32_t HELPER(neon_ceq_u8)(uint32_t a, uint32_t b)
+{
+    return ~swar_nonzero(a ^ b, SWAR_H8, 8);
+}
+
+uint32_t HELPER(neon_ceq_u16)(uint32_t a, uint32_t b)
+{
+    return ~swar_nonzero(a ^ b, SWAR_H16, 16);
+}
+
+uint32_t HELPER(neon_ceq_u32)(uint32_t a, uint32_t b)
+{
+    return (a == b) ? -1 : 0;
+}
 
 #define NEON_FN(dest, src, dummy) dest = (src < 0) ? -src : src
 NEON_VOP1(abs_s8, neon_s8, 4)
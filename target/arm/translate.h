@@ -134,6 +134,11 @@ static void disas_set_insn_syndrome(DisasContext *s, uint32_t syn)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* PC has been set, but the CPU state may have changed in a way that the
+ * main loop must look at (e.g. interrupts unmasked by an exception
+ * return), so do not try to find the next TB from generated code.
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
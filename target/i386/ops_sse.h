@@ -2187,6 +2187,10 @@ void glue(helper_aesdec, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_accel_available()) {
+        aes_accel_dec(d->_b_ZMMReg, rk._b_ZMMReg, false);
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Td0[st.B(AES_ishifts[4*i+0])] ^
                                     AES_Td1[st.B(AES_ishifts[4*i+1])] ^
@@ -2201,6 +2205,10 @@ void glue(helper_aesdeclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_accel_available()) {
+        aes_accel_dec(d->_b_ZMMReg, rk._b_ZMMReg, true);
+        return;
+    }
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_isbox[st.B(AES_ishifts[i])]);
     }
@@ -2212,6 +2220,10 @@ void glue(helper_aesenc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_accel_available()) {
+        aes_accel_enc(d->_b_ZMMReg, rk._b_ZMMReg, false);
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = rk.L(i) ^ bswap32(AES_Te0[st.B(AES_shifts[4*i+0])] ^
                                     AES_Te1[st.B(AES_shifts[4*i+1])] ^
@@ -2226,6 +2238,10 @@ void glue(helper_aesenclast, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     Reg st = *d;
     Reg rk = *s;
 
+    if (aes_accel_available()) {
+        aes_accel_enc(d->_b_ZMMReg, rk._b_ZMMReg, true);
+        return;
+    }
     for (i = 0; i < 16; i++) {
         d->B(i) = rk.B(i) ^ (AES_sbox[st.B(AES_shifts[i])]);
     }
@@ -2237,6 +2253,12 @@ void glue(helper_aesimc, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     int i;
     Reg tmp = *s;
 
+    if (aes_accel_available()) {
+        aes_accel_mc(tmp._b_ZMMReg, true);
+        d->Q(0) = tmp.Q(0);
+        d->Q(1) = tmp.Q(1);
+        return;
+    }
     for (i = 0 ; i < 4 ; i++) {
         d->L(i) = bswap32(AES_imc[tmp.B(4*i+0)][0] ^
                           AES_imc[tmp.B(4*i+1)][1] ^
@@ -2508,8 +2508,12 @@ static void gen_bnd_jmp(DisasContext *s)
 /* Generate an end of block. Trace exception is also generated if needed.
    If INHIBIT, set HF_INHIBIT_IRQ_MASK if it isn't already set.
    If RECHECK_TF, emit a rechecking helper for #DB, ignoring the state of
-   S->TF.  This is used by the syscall/sysret insns.  */
-static void gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf)
+   S->TF.  This is used by the syscall/sysret insns.
+   If JR, the TB ends with an indirect branch whose target has already
+   been stored to EIP; look up the next TB directly instead of going
+   back to the main loop.  */
+static void
+do_gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf, bool jr)
 {
     gen_update_cc_op(s);
 
@@ -2530,12 +2534,20 @@ static void gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf)
         tcg_gen_exit_tb(0);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr) {
+        tcg_gen_lookup_and_goto_ptr();
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static inline void
+gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf)
+{
+    do_gen_eob_worker(s, inhibit, recheck_tf, false);
+}
+
 /* End of block.
    If INHIBIT, set HF_INHIBIT_IRQ_MASK if it isn't already set.  */
 static void gen_eob_inhibit_irq(DisasContext *s, bool inhibit)
@@ -2549,6 +2561,12 @@ static void gen_eob(DisasContext *s)
     gen_eob_worker(s, false, false);
 }
 
+/* Jump to register */
+static void gen_jr(DisasContext *s)
+{
+    do_gen_eob_worker(s, false, false, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2621,6 +2639,72 @@ static inline void gen_op_movl(int d_offset, int s_offset)
     tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, d_offset);
 }
 
+/* Operations of sse_op_table1 that work on whole 64-bit lanes are
+   generated inline instead of calling their helper.  Returns false if
+   b is not one of them.  */
+static bool gen_sse_op_inline(int b, int d_offset, int s_offset, int is_xmm)
+{
+    TCGv_i64 t0, t1;
+    int i, ofs;
+
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0x55: /* andnps, andnpd */
+    case 0x56: /* orps, orpd */
+    case 0x57: /* xorps, xorpd */
+    case 0xd4: /* paddq */
+    case 0xdb: /* pand */
+    case 0xdf: /* pandn */
+    case 0xeb: /* por */
+    case 0xef: /* pxor */
+    case 0xfb: /* psubq */
+        break;
+    default:
+        return false;
+    }
+
+    t0 = cpu_tmp1_i64;
+    t1 = tcg_temp_new_i64();
+    for (i = 0; i < (is_xmm ? 2 : 1); i++) {
+        ofs = is_xmm ? offsetof(ZMMReg, ZMM_Q(i)) : offsetof(MMXReg, MMX_Q(0));
+        if (d_offset == s_offset && (b == 0x57 || b == 0xef || b == 0xfb)) {
+            /* The usual way to clear a register */
+            tcg_gen_movi_i64(t0, 0);
+            tcg_gen_st_i64(t0, cpu_env, d_offset + ofs);
+            continue;
+        }
+        tcg_gen_ld_i64(t0, cpu_env, d_offset + ofs);
+        tcg_gen_ld_i64(t1, cpu_env, s_offset + ofs);
+        switch (b) {
+        case 0x54:
+        case 0xdb:
+            tcg_gen_and_i64(t0, t0, t1);
+            break;
+        case 0x55:
+        case 0xdf:
+            tcg_gen_andc_i64(t0, t1, t0);
+            break;
+        case 0x56:
+        case 0xeb:
+            tcg_gen_or_i64(t0, t0, t1);
+            break;
+        case 0x57:
+        case 0xef:
+            tcg_gen_xor_i64(t0, t0, t1);
+            break;
+        case 0xd4:
+            tcg_gen_add_i64(t0, t0, t1);
+            break;
+        case 0xfb:
+            tcg_gen_sub_i64(t0, t0, t1);
+            break;
+        }
+        tcg_gen_st_i64(t0, cpu_env, d_offset + ofs);
+    }
+    tcg_temp_free_i64(t1);
+    return true;
+}
+
 static inline void gen_op_movq_env_0(int d_offset)
 {
     tcg_gen_movi_i64(cpu_tmp1_i64, 0);
@@ -4381,6 +4465,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_op_inline(b, op1_offset, op2_offset, is_xmm)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4966,7 +5053,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_push_v(s, cpu_T1);
             gen_op_jmp_v(cpu_T0);
             gen_bnd_jmp(s);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
@@ -4992,7 +5079,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             gen_op_jmp_v(cpu_T0);
             gen_bnd_jmp(s);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
@@ -6387,7 +6474,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T0);
         gen_bnd_jmp(s);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
@@ -6395,7 +6482,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T0);
         gen_bnd_jmp(s);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -907,6 +907,17 @@ void ppc_hash64_tlb_flush_hpte(PowerPCCPU *cpu,
                                target_ulong pte_index,
                                target_ulong pte0, target_ulong pte1)
 {
+    /*
+     * A translation is only ever cached after ppc_hash64_handle_mmu_fault()
+     * has set the referenced bit of the PTE it came from, so nothing can
+     * be cached for a PTE that still has R clear.  This is the common case
+     * when the guest tears down mappings it never touched, and skipping
+     * the flush there avoids dropping every TLB of every CPU.
+     */
+    if (!(pte1 & HPTE64_R_R)) {
+        return;
+    }
+
     /*
      * XXX: given the fact that there are too many segments to
      * invalidate, and we still don't have a tlb_flush_mask(env, n,
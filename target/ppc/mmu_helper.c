@@ -843,10 +843,9 @@ static int mmubooke_get_physical_address(CPUPPCState *env, mmu_ctx_t *ctx,
     return ret;
 }
 
-static void booke206_flush_tlb(CPUPPCState *env, int flags,
-                               const int check_iprot)
+static void booke206_invalidate_tlb(CPUPPCState *env, int flags,
+                                    const int check_iprot)
 {
-    PowerPCCPU *cpu = ppc_env_get_cpu(env);
     int tlb_size;
     int i, j;
     ppcmas_tlb_t *tlb = env->tlb.tlbm;
@@ -862,7 +861,14 @@ static void booke206_flush_tlb(CPUPPCState *env, int flags,
         }
         tlb += booke206_tlb_size(env, i);
     }
+}
+
+static void booke206_flush_tlb(CPUPPCState *env, int flags,
+                               const int check_iprot)
+{
+    PowerPCCPU *cpu = ppc_env_get_cpu(env);
 
+    booke206_invalidate_tlb(env, flags, check_iprot);
     tlb_flush(CPU(cpu));
 }
 
@@ -1725,15 +1731,13 @@ static inline void do_invalidate_BAT(CPUPPCState *env, target_ulong BATu,
                                      target_ulong mask)
 {
     CPUState *cs = CPU(ppc_env_get_cpu(env));
-    target_ulong base, end, page;
+    target_ulong base, end;
 
     base = BATu & ~0x0001FFFF;
     end = base + mask + 0x00020000;
     LOG_BATS("Flush BAT from " TARGET_FMT_lx " to " TARGET_FMT_lx " ("
              TARGET_FMT_lx ")\n", base, end, mask);
-    for (page = base; page != end; page += TARGET_PAGE_SIZE) {
-        tlb_flush_page(cs, page);
-    }
+    tlb_flush_range(cs, base, end - base);
     LOG_BATS("Flush done\n");
 }
 #endif
@@ -2305,7 +2309,7 @@ void helper_4xx_tlbwe_hi(CPUPPCState *env, target_ulong entry,
     PowerPCCPU *cpu = ppc_env_get_cpu(env);
     CPUState *cs = CPU(cpu);
     ppcemb_tlb_t *tlb;
-    target_ulong page, end;
+    target_ulong end;
 
     LOG_SWTLB("%s entry %d val " TARGET_FMT_lx "\n", __func__, (int)entry,
               val);
@@ -2316,9 +2320,7 @@ void helper_4xx_tlbwe_hi(CPUPPCState *env, target_ulong entry,
         end = tlb->EPN + tlb->size;
         LOG_SWTLB("%s: invalidate old TLB %d start " TARGET_FMT_lx " end "
                   TARGET_FMT_lx "\n", __func__, (int)entry, tlb->EPN, end);
-        for (page = tlb->EPN; page < end; page += TARGET_PAGE_SIZE) {
-            tlb_flush_page(cs, page);
-        }
+        tlb_flush_range(cs, tlb->EPN, end - tlb->EPN);
     }
     tlb->size = booke_tlb_to_page_size((val >> PPC4XX_TLBHI_SIZE_SHIFT)
                                        & PPC4XX_TLBHI_SIZE_MASK);
@@ -2355,9 +2357,7 @@ void helper_4xx_tlbwe_hi(CPUPPCState *env, target_ulong entry,
         end = tlb->EPN + tlb->size;
         LOG_SWTLB("%s: invalidate TLB %d start " TARGET_FMT_lx " end "
                   TARGET_FMT_lx "\n", __func__, (int)entry, tlb->EPN, end);
-        for (page = tlb->EPN; page < end; page += TARGET_PAGE_SIZE) {
-            tlb_flush_page(cs, page);
-        }
+        tlb_flush_range(cs, tlb->EPN, end - tlb->EPN);
     }
 }
 
@@ -2738,51 +2738,68 @@ void helper_booke206_tlbsx(CPUPPCState *env, target_ulong address)
 static inline void booke206_invalidate_ea_tlb(CPUPPCState *env, int tlbn,
                                               uint32_t ea)
 {
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
     int i;
     int ways = booke206_tlb_ways(env, tlbn);
-    target_ulong mask;
+    target_ulong mask, size;
+    uint32_t tlbncfg;
+    bool flushed = false;
 
     for (i = 0; i < ways; i++) {
         ppcmas_tlb_t *tlb = booke206_get_tlbm(env, tlbn, ea, i);
         if (!tlb) {
             continue;
         }
-        mask = ~(booke206_tlb_to_page_size(env, tlb) - 1);
+        size = booke206_tlb_to_page_size(env, tlb);
+        mask = ~(size - 1);
         if (((tlb->mas2 & MAS2_EPN_MASK) == (ea & mask)) &&
             !(tlb->mas1 & MAS1_IPROT)) {
             tlb->mas1 &= ~MAS1_VALID;
+            /* tlbivax is broadcast: drop the entry's pages on every CPU */
+            tlb_flush_range_all_cpus(cs, ea & mask, size);
+            flushed = true;
         }
     }
+
+    if (flushed) {
+        return;
+    }
+
+    /* Our own array has nothing to invalidate, but other CPUs may still
+     * have the EA mapped.  TLB0 entries are at most the largest TLB0 page
+     * size; TLB1 entries can be of any size, so flush everything.
+     */
+    if (tlbn == 0) {
+        tlbncfg = env->spr[SPR_BOOKE_TLB0CFG];
+        size = 1024ULL << (((tlbncfg & TLBnCFG_MAXSIZE) >>
+                            TLBnCFG_MAXSIZE_SHIFT) << 1);
+        tlb_flush_range_all_cpus(cs, ea & ~(size - 1), size);
+    } else {
+        tlb_flush_all_cpus(cs);
+    }
 }
 
 void helper_booke206_tlbivax(CPUPPCState *env, target_ulong address)
 {
-    CPUState *cs;
-
     if (address & 0x4) {
         /* flush all entries */
         if (address & 0x8) {
             /* flush all of TLB1 */
-            booke206_flush_tlb(env, BOOKE206_FLUSH_TLB1, 1);
+            booke206_invalidate_tlb(env, BOOKE206_FLUSH_TLB1, 1);
         } else {
             /* flush all of TLB0 */
-            booke206_flush_tlb(env, BOOKE206_FLUSH_TLB0, 0);
+            booke206_invalidate_tlb(env, BOOKE206_FLUSH_TLB0, 0);
         }
+        tlb_flush_all_cpus(CPU(ppc_env_get_cpu(env)));
         return;
     }
 
     if (address & 0x8) {
         /* flush TLB1 entries */
         booke206_invalidate_ea_tlb(env, 1, address);
-        CPU_FOREACH(cs) {
-            tlb_flush(cs);
-        }
     } else {
         /* flush TLB0 entries */
         booke206_invalidate_ea_tlb(env, 0, address);
-        CPU_FOREACH(cs) {
-            tlb_flush_page(cs, address & MAS2_EPN_MASK);
-        }
     }
 }
 
@@ -24,6 +24,11 @@ static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
     "%x8", "%x9", "%x10", "%x11", "%x12", "%x13", "%x14", "%x15",
     "%x16", "%x17", "%x18", "%x19", "%x20", "%x21", "%x22", "%x23",
     "%x24", "%x25", "%x26", "%x27", "%x28", "%fp", "%x30", "%sp",
+
+    "%v0", "%v1", "%v2", "%v3", "%v4", "%v5", "%v6", "%v7",
+    "%v8", "%v9", "%v10", "%v11", "%v12", "%v13", "%v14", "%v15",
+    "%v16", "%v17", "%v18", "%v19", "%v20", "%v21", "%v22", "%v23",
+    "%v24", "%v25", "%v26", "%v27", "%v28", "%v29", "%v30", "%v31",
 };
 #endif /* CONFIG_DEBUG_TCG */
 
@@ -43,6 +48,14 @@ static const int tcg_target_reg_alloc_order[] = {
     /* X19 reserved for AREG0 */
     /* X29 reserved as fp */
     /* X30 reserved as temporary */
+
+    TCG_REG_V0, TCG_REG_V1, TCG_REG_V2, TCG_REG_V3,
+    TCG_REG_V4, TCG_REG_V5, TCG_REG_V6, TCG_REG_V7,
+    /* V8 - V15 are call-saved, and the prologue does not save them.  */
+    TCG_REG_V16, TCG_REG_V17, TCG_REG_V18, TCG_REG_V19,
+    TCG_REG_V20, TCG_REG_V21, TCG_REG_V22, TCG_REG_V23,
+    TCG_REG_V24, TCG_REG_V25, TCG_REG_V26, TCG_REG_V27,
+    TCG_REG_V28, TCG_REG_V29, TCG_REG_V30, TCG_REG_V31,
 };
 
 static const int tcg_target_call_iarg_regs[8] = {
@@ -55,6 +68,9 @@ static const int tcg_target_call_oarg_regs[1] = {
 
 #define TCG_REG_TMP TCG_REG_X30
 
+/* The AdvSIMD registers usable for vector temporaries; see above.  */
+#define ALL_VECTOR_REGS 0xffff00ff00000000ull
+
 #ifndef CONFIG_SOFTMMU
 /* Note that XZR cannot be encoded in the address base register slot,
    as that actaully encodes SP.  So if we need to zero-extend the guest
@@ -121,11 +137,15 @@ static const char *target_parse_constraint(TCGArgConstraint *ct,
     switch (*ct_str++) {
     case 'r':
         ct->ct |= TCG_CT_REG;
-        tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffffu);
+        break;
+    case 'w':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, ALL_VECTOR_REGS);
         break;
     case 'l': /* qemu_ld / qemu_st address, data_reg */
         ct->ct |= TCG_CT_REG;
-        tcg_regset_set32(ct->u.regs, 0, (1ULL << TCG_TARGET_NB_REGS) - 1);
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffffu);
 #ifdef CONFIG_SOFTMMU
         /* x0 and x1 will be overwritten when reading the tlb entry,
            and x2, and x3 for helper args, better to avoid using them. */
@@ -288,6 +308,12 @@ typedef enum {
     I3312_LDRSHX    = 0x38000000 | LDST_LD_S_X << 22 | MO_16 << 30,
     I3312_LDRSWX    = 0x38000000 | LDST_LD_S_X << 22 | MO_32 << 30,
 
+    I3312_LDRVD     = 0x3c000000 | LDST_LD << 22 | MO_64 << 30,
+    I3312_STRVD     = 0x3c000000 | LDST_ST << 22 | MO_64 << 30,
+
+    I3312_LDRVQ     = 0x3c000000 | 3 << 22 | 0 << 30,
+    I3312_STRVQ     = 0x3c000000 | 2 << 22 | 0 << 30,
+
     I3312_TO_I3310  = 0x00200800,
     I3312_TO_I3313  = 0x01000000,
 
@@ -372,6 +398,37 @@ typedef enum {
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
 
+    /* AdvSIMD copy */
+    I3605_DUP       = 0x0e000c00,
+
+    /* AdvSIMD modified immediate */
+    I3606_MOVI      = 0x0f000400,
+
+    /* AdvSIMD scalar shift by immediate */
+    I3609_SSHR      = 0x5f000400,
+    I3609_SHL       = 0x5f005400,
+    I3609_USHR      = 0x7f000400,
+
+    /* AdvSIMD scalar three same */
+    I3611_ADD       = 0x5e208400,
+    I3611_CMGT      = 0x5e203400,
+    I3611_SUB       = 0x7e208400,
+    I3611_CMEQ      = 0x7e208c00,
+
+    /* AdvSIMD shift by immediate */
+    I3614_SSHR      = 0x0f000400,
+    I3614_SHL       = 0x0f005400,
+    I3614_USHR      = 0x2f000400,
+
+    /* AdvSIMD three same.  */
+    I3616_ADD       = 0x0e208400,
+    I3616_AND       = 0x0e201c00,
+    I3616_CMGT      = 0x0e203400,
+    I3616_ORR       = 0x0ea01c00,
+    I3616_SUB       = 0x2e208400,
+    I3616_EOR       = 0x2e201c00,
+    I3616_CMEQ      = 0x2e208c00,
+
     /* System instructions.  */
     DMB_ISH         = 0xd50338bf,
     DMB_LD          = 0x00000100,
@@ -512,26 +569,71 @@ static void tcg_out_insn_3509(TCGContext *s, AArch64Insn insn, TCGType ext,
     tcg_out32(s, insn | ext << 31 | rm << 16 | ra << 10 | rn << 5 | rd);
 }
 
+/* The vector register operands below are TCG_REG_V*, and may be the
+   RD of a load or store; only the low 5 bits select the register.  */
+
+static void tcg_out_insn_3605(TCGContext *s, AArch64Insn insn, bool q,
+                              TCGReg rd, TCGReg rn, int imm5)
+{
+    tcg_out32(s, insn | q << 30 | imm5 << 16 | (rn & 0x1f) << 5
+              | (rd & 0x1f));
+}
+
+static void tcg_out_insn_3606(TCGContext *s, AArch64Insn insn, bool q,
+                              TCGReg rd, bool op, int cmode, uint8_t imm8)
+{
+    tcg_out32(s, insn | q << 30 | op << 29 | cmode << 12 | (rd & 0x1f)
+              | (imm8 & 0xe0) << (16 - 5) | (imm8 & 0x1f) << 5);
+}
+
+static void tcg_out_insn_3609(TCGContext *s, AArch64Insn insn,
+                              TCGReg rd, TCGReg rn, unsigned immhb)
+{
+    tcg_out32(s, insn | immhb << 16 | (rn & 0x1f) << 5 | (rd & 0x1f));
+}
+
+static void tcg_out_insn_3611(TCGContext *s, AArch64Insn insn,
+                              unsigned size, TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    tcg_out32(s, insn | size << 22 | (rm & 0x1f) << 16
+              | (rn & 0x1f) << 5 | (rd & 0x1f));
+}
+
+static void tcg_out_insn_3614(TCGContext *s, AArch64Insn insn, bool q,
+                              TCGReg rd, TCGReg rn, unsigned immhb)
+{
+    tcg_out32(s, insn | q << 30 | immhb << 16
+              | (rn & 0x1f) << 5 | (rd & 0x1f));
+}
+
+static void tcg_out_insn_3616(TCGContext *s, AArch64Insn insn, bool q,
+                              unsigned size, TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    tcg_out32(s, insn | q << 30 | size << 22 | (rm & 0x1f) << 16
+              | (rn & 0x1f) << 5 | (rd & 0x1f));
+}
+
 static void tcg_out_insn_3310(TCGContext *s, AArch64Insn insn,
                               TCGReg rd, TCGReg base, TCGType ext,
                               TCGReg regoff)
 {
     /* Note the AArch64Insn constants above are for C3.3.12.  Adjust.  */
     tcg_out32(s, insn | I3312_TO_I3310 | regoff << 16 |
-              0x4000 | ext << 13 | base << 5 | rd);
+              0x4000 | ext << 13 | base << 5 | (rd & 0x1f));
 }
 
 static void tcg_out_insn_3312(TCGContext *s, AArch64Insn insn,
                               TCGReg rd, TCGReg rn, intptr_t offset)
 {
-    tcg_out32(s, insn | (offset & 0x1ff) << 12 | rn << 5 | rd);
+    tcg_out32(s, insn | (offset & 0x1ff) << 12 | rn << 5 | (rd & 0x1f));
 }
 
 static void tcg_out_insn_3313(TCGContext *s, AArch64Insn insn,
                               TCGReg rd, TCGReg rn, uintptr_t scaled_uimm)
 {
     /* Note the AArch64Insn constants above are for C3.3.12.  Adjust.  */
-    tcg_out32(s, insn | I3312_TO_I3313 | scaled_uimm << 10 | rn << 5 | rd);
+    tcg_out32(s, insn | I3312_TO_I3313 | scaled_uimm << 10
+              | rn << 5 | (rd & 0x1f));
 }
 
 /* Register to register move using ORR (shifted register with no shift). */
@@ -666,7 +768,13 @@ static void tcg_out_movi(TCGContext *s, TCGType type, TCGReg rd,
 static void tcg_out_ldst(TCGContext *s, AArch64Insn insn,
                          TCGReg rd, TCGReg rn, intptr_t offset)
 {
-    TCGMemOp size = (uint32_t)insn >> 30;
+    unsigned size = (uint32_t)insn >> 30;
+
+    /* The 128-bit vector forms encode SIZE as 0 and set the high bit
+       of OPC; they scale the offset by 16.  */
+    if ((insn & 0x04800000) == 0x04800000 && size == 0) {
+        size = 4;
+    }
 
     /* If the offset is naturally aligned and in range, then we can
        use the scaled uimm12 encoding */
@@ -692,29 +800,102 @@ static void tcg_out_ldst(TCGContext *s, AArch64Insn insn,
 static inline void tcg_out_mov(TCGContext *s,
                                TCGType type, TCGReg ret, TCGReg arg)
 {
-    if (ret != arg) {
+    if (ret == arg) {
+        return;
+    }
+    switch (type) {
+    case TCG_TYPE_V64:
+    case TCG_TYPE_V128:
+        tcg_out_insn(s, 3616, ORR, type == TCG_TYPE_V128, 0, ret, arg, arg);
+        break;
+    default:
         tcg_out_movr(s, type, ret, arg);
+        break;
     }
 }
 
 static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg arg,
                               TCGReg arg1, intptr_t arg2)
 {
-    tcg_out_ldst(s, type == TCG_TYPE_I32 ? I3312_LDRW : I3312_LDRX,
-                 arg, arg1, arg2);
+    AArch64Insn insn;
+
+    switch (type) {
+    case TCG_TYPE_I32:
+        insn = I3312_LDRW;
+        break;
+    case TCG_TYPE_V64:
+        insn = I3312_LDRVD;
+        break;
+    case TCG_TYPE_V128:
+        insn = I3312_LDRVQ;
+        break;
+    default:
+        insn = I3312_LDRX;
+        break;
+    }
+    tcg_out_ldst(s, insn, arg, arg1, arg2);
 }
 
 static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
                               TCGReg arg1, intptr_t arg2)
 {
-    tcg_out_ldst(s, type == TCG_TYPE_I32 ? I3312_STRW : I3312_STRX,
-                 arg, arg1, arg2);
+    AArch64Insn insn;
+
+    switch (type) {
+    case TCG_TYPE_I32:
+        insn = I3312_STRW;
+        break;
+    case TCG_TYPE_V64:
+        insn = I3312_STRVD;
+        break;
+    case TCG_TYPE_V128:
+        insn = I3312_STRVQ;
+        break;
+    default:
+        insn = I3312_STRX;
+        break;
+    }
+    tcg_out_ldst(s, insn, arg, arg1, arg2);
+}
+
+/* Load vector register RD with V64 replicated across all 64-bit lanes.  */
+static void tcg_out_dupi_vec(TCGContext *s, TCGType type, TCGReg rd,
+                             tcg_target_long v64)
+{
+    bool q = type == TCG_TYPE_V128;
+    int i, imm8;
+
+    /* A replicated byte is MOVI with cmode 0xe.  */
+    if (v64 == dup_const(MO_8, v64)) {
+        tcg_out_insn(s, 3606, MOVI, q, rd, 0, 0xe, v64);
+        return;
+    }
+
+    /* So is a 64-bit mask of whole bytes, with op set; this
+       includes all of the compare results.  */
+    for (i = imm8 = 0; i < 8; i++) {
+        uint8_t byte = v64 >> (i * 8);
+        if (byte == 0xff) {
+            imm8 |= 1 << i;
+        } else if (byte != 0) {
+            break;
+        }
+    }
+    if (i == 8) {
+        tcg_out_insn(s, 3606, MOVI, q, rd, 1, 0xe, imm8);
+        return;
+    }
+
+    /* Otherwise build the value in TMP and broadcast it.  There is no
+       64-bit DUP into a 64-bit vector, but the upper half is ignored.  */
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, v64);
+    tcg_out_insn(s, 3605, DUP, true, rd, TCG_REG_TMP, 1 << MO_64);
 }
 
 static inline bool tcg_out_sti(TCGContext *s, TCGType type, TCGArg val,
                                TCGReg base, intptr_t ofs)
 {
-    if (val == 0) {
+    if (type <= TCG_TYPE_I64 && val == 0) {
         tcg_out_st(s, type, TCG_REG_XZR, base, ofs);
         return true;
     }
@@ -1374,6 +1555,10 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         s->tb_jmp_reset_offset[a0] = tcg_current_code_size(s);
         break;
 
+    case INDEX_op_goto_ptr:
+        tcg_out_insn(s, 3207, BR, a0);
+        break;
+
     case INDEX_op_br:
         tcg_out_goto_label(s, arg_label(a0));
         break;
@@ -1719,8 +1904,94 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_mb(s, a0);
         break;
 
+    case INDEX_op_ld_vec:
+        tcg_out_ld(s, a2, a0, a1, args[3]);
+        break;
+    case INDEX_op_st_vec:
+        tcg_out_st(s, a2, a0, a1, args[3]);
+        break;
+    case INDEX_op_dupi_vec:
+        tcg_out_dupi_vec(s, a1, a0, a2);
+        break;
+    case INDEX_op_dup_vec:
+        /* DUP (general) into a 64-bit vector has no 64-bit lane form.  */
+        tcg_out_insn(s, 3605, DUP, a2 == TCG_TYPE_V128 || args[3] == MO_64,
+                     a0, a1, 1 << args[3]);
+        break;
+
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_cmp_vec:
+        {
+            bool q = args[3] == TCG_TYPE_V128;
+            unsigned vece = args[4];
+            bool scalar = !q && vece == MO_64;
+            TCGCond cond = TCG_COND_EQ;
+            AArch64Insn insn;
+
+            if (opc == INDEX_op_cmp_vec) {
+                /* The generic code reduces all other conditions to these.  */
+                cond = args[5];
+                tcg_debug_assert(cond == TCG_COND_EQ || cond == TCG_COND_GT);
+            }
+            /* The 64-bit lane forms need Q; use the scalar insns for V64.  */
+            if (opc == INDEX_op_add_vec) {
+                insn = scalar ? I3611_ADD : I3616_ADD;
+            } else if (opc == INDEX_op_sub_vec) {
+                insn = scalar ? I3611_SUB : I3616_SUB;
+            } else if (cond == TCG_COND_EQ) {
+                insn = scalar ? I3611_CMEQ : I3616_CMEQ;
+            } else {
+                insn = scalar ? I3611_CMGT : I3616_CMGT;
+            }
+            if (scalar) {
+                tcg_out_insn_3611(s, insn, vece, a0, a1, a2);
+            } else {
+                tcg_out_insn_3616(s, insn, q, vece, a0, a1, a2);
+            }
+        }
+        break;
+    case INDEX_op_and_vec:
+        tcg_out_insn(s, 3616, AND, args[3] == TCG_TYPE_V128, 0, a0, a1, a2);
+        break;
+    case INDEX_op_or_vec:
+        tcg_out_insn(s, 3616, ORR, args[3] == TCG_TYPE_V128, 0, a0, a1, a2);
+        break;
+    case INDEX_op_xor_vec:
+        tcg_out_insn(s, 3616, EOR, args[3] == TCG_TYPE_V128, 0, a0, a1, a2);
+        break;
+
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+    case INDEX_op_sari_vec:
+        {
+            bool q = a2 == TCG_TYPE_V128;
+            unsigned esize = 8 << args[3];
+            unsigned shift = args[4];
+            bool scalar = !q && esize == 64;
+            /* IMMH:IMMB encode the lane size and the shift together.  */
+            unsigned immhb = (opc == INDEX_op_shli_vec
+                              ? esize + shift : 2 * esize - shift);
+            AArch64Insn insn;
+
+            if (opc == INDEX_op_shli_vec) {
+                insn = scalar ? I3609_SHL : I3614_SHL;
+            } else if (opc == INDEX_op_shri_vec) {
+                insn = scalar ? I3609_USHR : I3614_USHR;
+            } else {
+                insn = scalar ? I3609_SSHR : I3614_SSHR;
+            }
+            if (scalar) {
+                tcg_out_insn_3609(s, insn, a0, a1, immhb);
+            } else {
+                tcg_out_insn_3614(s, insn, q, a0, a1, immhb);
+            }
+        }
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
+    case INDEX_op_mov_vec:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
     case INDEX_op_movi_i64:
     case INDEX_op_call:     /* Always emitted via tcg_out_call.  */
@@ -1734,6 +2005,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
 
     { INDEX_op_ld8u_i32, { "r", "r" } },
@@ -1852,6 +2124,20 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_mulsh_i64, { "r", "r", "r" } },
 
     { INDEX_op_mb, { } },
+
+    { INDEX_op_ld_vec, { "w", "r" } },
+    { INDEX_op_st_vec, { "w", "r" } },
+    { INDEX_op_dupi_vec, { "w" } },
+    { INDEX_op_dup_vec, { "w", "r" } },
+    { INDEX_op_add_vec, { "w", "w", "w" } },
+    { INDEX_op_sub_vec, { "w", "w", "w" } },
+    { INDEX_op_and_vec, { "w", "w", "w" } },
+    { INDEX_op_or_vec, { "w", "w", "w" } },
+    { INDEX_op_xor_vec, { "w", "w", "w" } },
+    { INDEX_op_cmp_vec, { "w", "w", "w" } },
+    { INDEX_op_shli_vec, { "w", "w" } },
+    { INDEX_op_shri_vec, { "w", "w" } },
+    { INDEX_op_sari_vec, { "w", "w" } },
     { -1 },
 };
 
@@ -1871,6 +2157,10 @@ static void tcg_target_init(TCGContext *s)
 {
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffffffff);
     tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffffffff);
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V64], 0,
+                     ALL_VECTOR_REGS);
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V128], 0,
+                     ALL_VECTOR_REGS);
 
     tcg_regset_set32(tcg_target_call_clobber_regs, 0,
                      (1 << TCG_REG_X0) | (1 << TCG_REG_X1) |
@@ -1883,6 +2173,7 @@ static void tcg_target_init(TCGContext *s)
                      (1 << TCG_REG_X14) | (1 << TCG_REG_X15) |
                      (1 << TCG_REG_X16) | (1 << TCG_REG_X17) |
                      (1 << TCG_REG_X18) | (1 << TCG_REG_X30));
+    tcg_regset_set32(tcg_target_call_clobber_regs, 0, ALL_VECTOR_REGS);
 
     tcg_regset_clear(s->reserved_regs);
     tcg_regset_set_reg(s->reserved_regs, TCG_REG_SP);
@@ -1942,6 +2233,14 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
     tcg_out_insn(s, 3207, BR, tcg_target_call_iarg_regs[1]);
 
+    /*
+     * Return path for goto_ptr. Set return value to 0, a-la exit_tb,
+     * and fall through to the rest of the epilogue.
+     */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_X0, 0);
+
+    /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
     /* Remove TCG locals stack space.  */
@@ -29,6 +29,9 @@ static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
 #if TCG_TARGET_REG_BITS == 64
     "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
     "%r8",  "%r9",  "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+    "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7",
+    "%xmm8", "%xmm9", "%xmm10", "%xmm11",
+    "%xmm12", "%xmm13", "%xmm14", "%xmm15",
 #else
     "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
 #endif
@@ -52,6 +55,26 @@ static const int tcg_target_reg_alloc_order[] = {
     TCG_REG_RSI,
     TCG_REG_RDI,
     TCG_REG_RAX,
+    TCG_REG_XMM0,
+    TCG_REG_XMM1,
+    TCG_REG_XMM2,
+    TCG_REG_XMM3,
+    TCG_REG_XMM4,
+    TCG_REG_XMM5,
+#ifndef _WIN64
+    /* The Win64 ABI preserves %xmm6-%xmm15 across calls; we do not save
+       them in the prologue, so they are not available for allocation.  */
+    TCG_REG_XMM6,
+    TCG_REG_XMM7,
+    TCG_REG_XMM8,
+    TCG_REG_XMM9,
+    TCG_REG_XMM10,
+    TCG_REG_XMM11,
+    TCG_REG_XMM12,
+    TCG_REG_XMM13,
+    TCG_REG_XMM14,
+    TCG_REG_XMM15,
+#endif
 #else
     TCG_REG_EBX,
     TCG_REG_ESI,
@@ -94,6 +117,13 @@ static const int tcg_target_call_oarg_regs[] = {
 #define TCG_CT_CONST_I32 0x400
 #define TCG_CT_CONST_WSZ 0x800
 
+/* The SSE registers usable for vector temporaries.  */
+#if defined(_WIN64)
+# define ALL_VECTOR_REGS 0x003f0000u
+#else
+# define ALL_VECTOR_REGS 0xffff0000u
+#endif
+
 /* Registers used with L constraint, which are the first argument 
    registers on x86_64, and two random call clobbered registers on
    i386. */
@@ -134,6 +164,7 @@ static bool have_movbe;
    it there.  Therefore we always define the variable.  */
 bool have_bmi1;
 bool have_popcnt;
+bool have_sse42;
 
 #if defined(CONFIG_CPUID_H) && defined(bit_BMI2)
 static bool have_bmi2;
@@ -221,6 +252,10 @@ static const char *target_parse_constraint(TCGArgConstraint *ct,
             tcg_regset_set32(ct->u.regs, 0, 0xff);
         }
         break;
+    case 'x':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, ALL_VECTOR_REGS);
+        break;
     case 'W':
         /* With TZCNT/LZCNT, we can have operand-size as an input.  */
         ct->ct |= TCG_CT_CONST_WSZ;
@@ -332,16 +367,48 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVL_Iv     (0xb8)
 #define OPC_MOVBE_GyMy  (0xf0 | P_EXT38)
 #define OPC_MOVBE_MyGy  (0xf1 | P_EXT38)
+#define OPC_MOVD_VyEy   (0x6e | P_EXT | P_DATA16)
+#define OPC_MOVDQA_VxWx (0x6f | P_EXT | P_DATA16)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
 #define OPC_MOVSBL	(0xbe | P_EXT)
 #define OPC_MOVSWL	(0xbf | P_EXT)
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPEQQ     (0x29 | P_EXT38 | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_PCMPGTQ     (0x37 | P_EXT38 | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_POPCNT      (0xb8 | P_EXT | P_SIMDF3)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /6 /4 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16)
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16)
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PUNPCKLBW   (0x60 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLWD   (0x61 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLQDQ  (0x6c | P_EXT | P_DATA16)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
 #define OPC_PUSH_Ib	(0x6a)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
 #define OPC_RET		(0xc3)
 #define OPC_SETCC	(0x90 | P_EXT | P_REXB_RM) /* ... plus cc */
 #define OPC_SHIFT_1	(0xd1)
@@ -430,8 +497,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, 0x65);
     }
     if (opc & P_DATA16) {
-        /* We should never be asking for both 16 and 64-bit operation.  */
-        tcg_debug_assert((opc & P_REXW) == 0);
+        /* We should never be asking for both 16 and 64-bit operation,
+           except where 0x66 is the mandatory prefix of an SSE insn.  */
+        tcg_debug_assert((opc & P_REXW) == 0 || (opc & P_EXT));
         tcg_out8(s, 0x66);
     }
     if (opc & P_ADDR32) {
@@ -651,7 +719,17 @@ static inline void tcg_out_mov(TCGContext *s, TCGType type,
                                TCGReg ret, TCGReg arg)
 {
     if (arg != ret) {
-        int opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+        int opc;
+
+        switch (type) {
+        case TCG_TYPE_V64:
+        case TCG_TYPE_V128:
+            opc = OPC_MOVDQA_VxWx;
+            break;
+        default:
+            opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+            break;
+        }
         tcg_out_modrm(s, opc, ret, arg);
     }
 }
@@ -727,17 +805,98 @@ static inline void tcg_out_pop(TCGContext *s, int reg)
 static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret,
                               TCGReg arg1, intptr_t arg2)
 {
-    int opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+    int opc;
+
+    switch (type) {
+    case TCG_TYPE_V64:
+        opc = OPC_MOVQ_VqWq;
+        break;
+    case TCG_TYPE_V128:
+        opc = OPC_MOVDQU_VxWx;
+        break;
+    default:
+        opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+        break;
+    }
     tcg_out_modrm_offset(s, opc, ret, arg1, arg2);
 }
 
 static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
                               TCGReg arg1, intptr_t arg2)
 {
-    int opc = OPC_MOVL_EvGv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+    int opc;
+
+    switch (type) {
+    case TCG_TYPE_V64:
+        opc = OPC_MOVQ_WqVq;
+        break;
+    case TCG_TYPE_V128:
+        opc = OPC_MOVDQU_WxVx;
+        break;
+    default:
+        opc = OPC_MOVL_EvGv + (type == TCG_TYPE_I64 ? P_REXW : 0);
+        break;
+    }
     tcg_out_modrm_offset(s, opc, arg, arg1, arg2);
 }
 
+/* Replicate the low VECE-sized lane of general register A into
+   vector register R.  */
+static void tcg_out_dup_vec(TCGContext *s, TCGType type, unsigned vece,
+                            TCGReg r, TCGReg a)
+{
+    tcg_out_modrm(s, OPC_MOVD_VyEy + (vece == MO_64 ? P_REXW : 0), r, a);
+    switch (vece) {
+    case MO_8:
+        tcg_out_modrm(s, OPC_PUNPCKLBW, r, r);
+        /* FALLTHRU */
+    case MO_16:
+        tcg_out_modrm(s, OPC_PUNPCKLWD, r, r);
+        /* FALLTHRU */
+    case MO_32:
+        tcg_out_modrm(s, OPC_PSHUFD, r, r);
+        tcg_out8(s, 0);
+        break;
+    case MO_64:
+        if (type == TCG_TYPE_V128) {
+            tcg_out_modrm(s, OPC_PUNPCKLQDQ, r, r);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Load vector register R with VAL replicated across all 64-bit lanes.  */
+static void tcg_out_dupi_vec(TCGContext *s, TCGType type, TCGReg r,
+                             tcg_target_long val)
+{
+    int size = (type == TCG_TYPE_V128 ? 16 : 8);
+    tcg_insn_unit *lit;
+
+    if (val == 0) {
+        tcg_out_modrm(s, OPC_PXOR, r, r);
+        return;
+    }
+    if (val == -1) {
+        tcg_out_modrm(s, OPC_PCMPEQB, r, r);
+        return;
+    }
+
+    /* We have no constant pool: branch around an inline copy of the
+       constant and load it rip-relative.  */
+    tcg_out8(s, OPC_JMP_short);
+    tcg_out8(s, size);
+    lit = s->code_ptr;
+    tcg_out64(s, val);
+    if (size == 16) {
+        tcg_out64(s, val);
+    }
+    tcg_out_opc(s, size == 16 ? OPC_MOVDQU_VxWx : OPC_MOVQ_VqWq, r, 0, 0);
+    tcg_out8(s, (LOWREGMASK(r) << 3) | 5);
+    tcg_out32(s, lit - (s->code_ptr + 4));
+}
+
 static bool tcg_out_sti(TCGContext *s, TCGType type, TCGArg val,
                         TCGReg base, intptr_t ofs)
 {
@@ -1315,8 +1474,10 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
                    TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
 
     tgen_arithi(s, ARITH_AND + trexw, r1, tlb_mask, 0);
-    tgen_arithi(s, ARITH_AND + tlbrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* and r0, env->tlb_mask[mem_index] */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + tlbrexw,
+                         r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
 
     tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
                              offsetof(CPUArchState, tlb_table[mem_index][0])
@@ -1858,6 +2019,24 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* SSE insns for each lane size, indexed by VECE.  */
+static const int vec_add_insn[4] = {
+    OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+};
+static const int vec_sub_insn[4] = {
+    OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+};
+static const int vec_cmpeq_insn[4] = {
+    OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD, OPC_PCMPEQQ
+};
+static const int vec_cmpgt_insn[4] = {
+    OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD, OPC_PCMPGTQ
+};
+/* There are no byte lane shifts; the generic code avoids asking.  */
+static const int vec_shift_imm_insn[4] = {
+    0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+};
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1906,6 +2085,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_jmp_reset_offset[a0] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp to the given host address (could be epilogue) */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, a0);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, arg_label(a0), 0);
         break;
@@ -2263,8 +2446,69 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_mb:
         tcg_out_mb(s, a0);
         break;
+
+    case INDEX_op_ld_vec:
+        tcg_out_ld(s, a2, a0, a1, args[3]);
+        break;
+    case INDEX_op_st_vec:
+        tcg_out_st(s, a2, a0, a1, args[3]);
+        break;
+    case INDEX_op_dupi_vec:
+        tcg_out_dupi_vec(s, a1, a0, a2);
+        break;
+    case INDEX_op_dup_vec:
+        tcg_out_dup_vec(s, a2, args[3], a0, a1);
+        break;
+    case INDEX_op_add_vec:
+        c = vec_add_insn[args[4]];
+        goto gen_vec;
+    case INDEX_op_sub_vec:
+        c = vec_sub_insn[args[4]];
+        goto gen_vec;
+    case INDEX_op_and_vec:
+        c = OPC_PAND;
+        goto gen_vec;
+    case INDEX_op_or_vec:
+        c = OPC_POR;
+        goto gen_vec;
+    case INDEX_op_xor_vec:
+        c = OPC_PXOR;
+        goto gen_vec;
+    case INDEX_op_cmp_vec:
+        /* The generic code reduces all other conditions to these.  */
+        switch (args[5]) {
+        case TCG_COND_EQ:
+            c = vec_cmpeq_insn[args[4]];
+            break;
+        case TCG_COND_GT:
+            c = vec_cmpgt_insn[args[4]];
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    gen_vec:
+        /* All of these are destructive: A0 was matched with A1.  */
+        tcg_out_modrm(s, c, a0, a2);
+        break;
+    case INDEX_op_shli_vec:
+        c = 6;
+        goto gen_shift_vec;
+    case INDEX_op_shri_vec:
+        c = 2;
+        goto gen_shift_vec;
+    case INDEX_op_sari_vec:
+        /* No psraq before AVX-512; TCG_TARGET_HAS_sar64_vec is 0.  */
+        tcg_debug_assert(args[3] != MO_64);
+        c = 4;
+    gen_shift_vec:
+        tcg_debug_assert(args[3] != MO_8);
+        tcg_out_modrm(s, vec_shift_imm_insn[args[3]], c, a0);
+        tcg_out8(s, args[4]);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
+    case INDEX_op_mov_vec:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
     case INDEX_op_movi_i64:
     case INDEX_op_call:     /* Always emitted via tcg_out_call.  */
@@ -2277,6 +2521,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
 static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
 {
+    static const TCGTargetOpDef r = { .args_ct_str = { "r" } };
     static const TCGTargetOpDef ri_r = { .args_ct_str = { "ri", "r" } };
     static const TCGTargetOpDef re_r = { .args_ct_str = { "re", "r" } };
     static const TCGTargetOpDef qi_r = { .args_ct_str = { "qi", "r" } };
@@ -2291,6 +2536,10 @@ static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
     static const TCGTargetOpDef r_L = { .args_ct_str = { "r", "L" } };
     static const TCGTargetOpDef L_L = { .args_ct_str = { "L", "L" } };
     static const TCGTargetOpDef r_L_L = { .args_ct_str = { "r", "L", "L" } };
+    static const TCGTargetOpDef x = { .args_ct_str = { "x" } };
+    static const TCGTargetOpDef x_r = { .args_ct_str = { "x", "r" } };
+    static const TCGTargetOpDef x_0 = { .args_ct_str = { "x", "0" } };
+    static const TCGTargetOpDef x_0_x = { .args_ct_str = { "x", "0", "x" } };
     static const TCGTargetOpDef r_r_L = { .args_ct_str = { "r", "r", "L" } };
     static const TCGTargetOpDef L_L_L = { .args_ct_str = { "L", "L", "L" } };
     static const TCGTargetOpDef r_r_L_L
@@ -2299,6 +2548,9 @@ static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
         = { .args_ct_str = { "L", "L", "L", "L" } };
 
     switch (op) {
+    case INDEX_op_goto_ptr:
+        return &r;
+
     case INDEX_op_ld8u_i32:
     case INDEX_op_ld8u_i64:
     case INDEX_op_ld8s_i32:
@@ -2495,6 +2747,24 @@ static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
             return &s2;
         }
 
+    case INDEX_op_dupi_vec:
+        return &x;
+    case INDEX_op_dup_vec:
+    case INDEX_op_ld_vec:
+    case INDEX_op_st_vec:
+        return &x_r;
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_cmp_vec:
+        return &x_0_x;
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+    case INDEX_op_sari_vec:
+        return &x_0;
+
     default:
         break;
     }
@@ -2567,6 +2837,13 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /*
+     * Return path for goto_ptr. Set return value to 0, a-la exit_tb,
+     * and fall through to the rest of the epilogue.
+     */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2606,6 +2883,10 @@ static void tcg_target_init(TCGContext *s)
 #endif
 #ifdef bit_POPCNT
         have_popcnt = (c & bit_POPCNT) != 0;
+#endif
+#ifdef bit_SSE4_2
+        /* PCMPEQQ is SSE4.1, PCMPGTQ is SSE4.2.  */
+        have_sse42 = (c & bit_SSE4_2) != 0;
 #endif
     }
 
@@ -2633,6 +2914,10 @@ static void tcg_target_init(TCGContext *s)
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffff);
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffff);
+        tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V64], 0,
+                         ALL_VECTOR_REGS);
+        tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V128], 0,
+                         ALL_VECTOR_REGS);
     } else {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xff);
     }
@@ -2650,6 +2935,7 @@ static void tcg_target_init(TCGContext *s)
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R9);
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R10);
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R11);
+        tcg_regset_set32(tcg_target_call_clobber_regs, 0, ALL_VECTOR_REGS);
     }
 
     tcg_regset_clear(s->reserved_regs);
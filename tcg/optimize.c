@@ -70,6 +70,20 @@ static void reset_all_temps(int nb_temps)
     bitmap_zero(temps_used.l, nb_temps);
 }
 
+/* Reset the temporaries that do not survive a conditional branch.  The
+   value of globals and local temps is unchanged on the fall-through path,
+   so what is known about them stays valid until the next label.  */
+static void reset_bb_temps(TCGContext *s, int nb_temps)
+{
+    int i;
+
+    for (i = s->nb_globals; i < nb_temps; i++) {
+        if (test_bit(i, temps_used.l) && !s->temps[i].temp_local) {
+            reset_temp(i);
+        }
+    }
+}
+
 /* Initialize and activate a temporary.  */
 static void init_temp_info(TCGArg temp)
 {
@@ -1241,7 +1255,7 @@ void tcg_optimize(TCGContext *s)
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
             do_brcond_high:
-                reset_all_temps(nb_temps);
+                reset_bb_temps(s, nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[0] = args[1];
                 args[1] = args[3];
@@ -1265,7 +1279,7 @@ void tcg_optimize(TCGContext *s)
                     goto do_default;
                 }
             do_brcond_low:
-                reset_all_temps(nb_temps);
+                reset_bb_temps(s, nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[1] = args[2];
                 args[2] = args[4];
@@ -1373,8 +1387,12 @@ void tcg_optimize(TCGContext *s)
                to compute the operation result) so no propagation is done.
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+               the non-zero bits mask for the first output arg.  Conditional
+               branches only end the life of normal temps.  */
+            if (opc == INDEX_op_brcond_i32 || opc == INDEX_op_brcond_i64
+                || opc == INDEX_op_brcond2_i32) {
+                reset_bb_temps(s, nb_temps);
+            } else if (def->flags & TCG_OPF_BB_END) {
                 reset_all_temps(nb_temps);
             } else {
         do_reset_output:
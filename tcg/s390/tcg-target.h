@@ -90,6 +90,7 @@ extern uint64_t s390_facilities;
 #define TCG_TARGET_HAS_muls2_i32      0
 #define TCG_TARGET_HAS_muluh_i32      0
 #define TCG_TARGET_HAS_mulsh_i32      0
+#define TCG_TARGET_HAS_goto_ptr       0
 #define TCG_TARGET_HAS_extrl_i64_i32  0
 #define TCG_TARGET_HAS_extrh_i64_i32  0
 
@@ -136,6 +137,15 @@ enum {
     TCG_AREG0 = TCG_REG_R10,
 };
 
+/* This defines the natural memory order supported by this
+ * architecture before guarantees made by various barrier
+ * instructions.
+ *
+ * The s390 has a pretty strong memory ordering which only really
+ * allows for some stores to be re-ordered after loads.
+ */
+#define TCG_TARGET_DEFAULT_MO (TCG_MO_ALL & ~TCG_MO_ST_LD)
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
 }
@@ -2573,6 +2573,245 @@ void tcg_gen_extr32_i64(TCGv_i64 lo, TCGv_i64 hi, TCGv_i64 arg)
     tcg_gen_shri_i64(hi, arg, 32);
 }
 
+/* Host vector operations.  */
+
+static inline TCGType vec_type(TCGv_vec v)
+{
+    return tcg_ctx.temps[GET_TCGV_VEC(v)].base_type;
+}
+
+void tcg_gen_mov_vec(TCGv_vec r, TCGv_vec a)
+{
+    if (!TCGV_EQUAL_VEC(r, a)) {
+        tcg_debug_assert(vec_type(r) == vec_type(a));
+        tcg_gen_op2(&tcg_ctx, INDEX_op_mov_vec,
+                    GET_TCGV_VEC(r), GET_TCGV_VEC(a));
+    }
+}
+
+void tcg_gen_dupi_vec(unsigned vece, TCGv_vec r, uint64_t a)
+{
+    uint64_t c = dup_const(vece, a);
+
+    /* The replicated constant travels as a single argument.  */
+    tcg_debug_assert(c == (TCGArg)c);
+    tcg_gen_op3(&tcg_ctx, INDEX_op_dupi_vec, GET_TCGV_VEC(r),
+                vec_type(r), c);
+}
+
+void tcg_gen_dup_i32_vec(unsigned vece, TCGv_vec r, TCGv_i32 a)
+{
+    tcg_debug_assert(vece <= MO_32);
+    tcg_gen_op4(&tcg_ctx, INDEX_op_dup_vec, GET_TCGV_VEC(r),
+                GET_TCGV_I32(a), vec_type(r), vece);
+}
+
+void tcg_gen_dup_i64_vec(unsigned vece, TCGv_vec r, TCGv_i64 a)
+{
+    tcg_debug_assert(TCG_TARGET_REG_BITS == 64);
+    tcg_gen_op4(&tcg_ctx, INDEX_op_dup_vec, GET_TCGV_VEC(r),
+                GET_TCGV_I64(a), vec_type(r), vece);
+}
+
+void tcg_gen_ld_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset)
+{
+    tcg_gen_op4(&tcg_ctx, INDEX_op_ld_vec, GET_TCGV_VEC(r),
+                GET_TCGV_PTR(base), vec_type(r), offset);
+}
+
+void tcg_gen_st_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset)
+{
+    tcg_gen_op4(&tcg_ctx, INDEX_op_st_vec, GET_TCGV_VEC(r),
+                GET_TCGV_PTR(base), vec_type(r), offset);
+}
+
+void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset,
+                     TCGType low_type)
+{
+    tcg_debug_assert(low_type <= vec_type(r));
+    tcg_gen_op4(&tcg_ctx, INDEX_op_st_vec, GET_TCGV_VEC(r),
+                GET_TCGV_PTR(base), low_type, offset);
+}
+
+static void vec_gen_op3(TCGOpcode opc, unsigned vece,
+                        TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type && vec_type(b) == type);
+    tcg_gen_op5(&tcg_ctx, opc, GET_TCGV_VEC(r), GET_TCGV_VEC(a),
+                GET_TCGV_VEC(b), type, vece);
+}
+
+void tcg_gen_add_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_add_vec, vece, r, a, b);
+}
+
+void tcg_gen_sub_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_sub_vec, vece, r, a, b);
+}
+
+/* The logical operations do not depend on the lane size.  */
+static void vec_gen_logic(TCGOpcode opc, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type && vec_type(b) == type);
+    tcg_gen_op4(&tcg_ctx, opc, GET_TCGV_VEC(r), GET_TCGV_VEC(a),
+                GET_TCGV_VEC(b), type);
+}
+
+void tcg_gen_and_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_logic(INDEX_op_and_vec, r, a, b);
+}
+
+void tcg_gen_or_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_logic(INDEX_op_or_vec, r, a, b);
+}
+
+void tcg_gen_xor_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_logic(INDEX_op_xor_vec, r, a, b);
+}
+
+static void vec_gen_shi(TCGOpcode opc, unsigned vece,
+                        TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type);
+    tcg_debug_assert(i >= 0 && i < (8 << vece));
+    if (i == 0) {
+        tcg_gen_mov_vec(r, a);
+        return;
+    }
+    tcg_gen_op5(&tcg_ctx, opc, GET_TCGV_VEC(r), GET_TCGV_VEC(a),
+                type, vece, i);
+}
+
+/* Without 8-bit lane shifts, shift 16-bit lanes and then clear the bits
+   that crossed into the neighbouring byte.  */
+void tcg_gen_shli_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    if (vece == MO_8 && !TCG_TARGET_HAS_shi8_vec && i != 0) {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+
+        tcg_gen_dupi_vec(MO_8, t, 0xff << i);
+        vec_gen_shi(INDEX_op_shli_vec, MO_16, r, a, i);
+        tcg_gen_and_vec(MO_8, r, r, t);
+        tcg_temp_free_vec(t);
+    } else {
+        vec_gen_shi(INDEX_op_shli_vec, vece, r, a, i);
+    }
+}
+
+void tcg_gen_shri_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    if (vece == MO_8 && !TCG_TARGET_HAS_shi8_vec && i != 0) {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+
+        tcg_gen_dupi_vec(MO_8, t, 0xff >> i);
+        vec_gen_shi(INDEX_op_shri_vec, MO_16, r, a, i);
+        tcg_gen_and_vec(MO_8, r, r, t);
+        tcg_temp_free_vec(t);
+    } else {
+        vec_gen_shi(INDEX_op_shri_vec, vece, r, a, i);
+    }
+}
+
+/* An arithmetic shift the host lacks is a logical shift followed by a
+   sign extension from the shifted sign bit S: (x ^ S) - S.  */
+void tcg_gen_sari_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    if (i != 0 && ((vece == MO_8 && !TCG_TARGET_HAS_shi8_vec) ||
+                   (vece == MO_64 && !TCG_TARGET_HAS_sar64_vec))) {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+
+        tcg_gen_dupi_vec(vece, t, 1ull << ((8 << vece) - 1 - i));
+        tcg_gen_shri_vec(vece, r, a, i);
+        tcg_gen_xor_vec(vece, r, r, t);
+        tcg_gen_sub_vec(vece, r, r, t);
+        tcg_temp_free_vec(t);
+    } else {
+        vec_gen_shi(INDEX_op_sari_vec, vece, r, a, i);
+    }
+}
+
+/* The cmp_vec opcode only implements signed-greater and equal, which is
+   what the common SIMD instruction sets provide.  Reduce the other
+   conditions to those by swapping the operands, inverting the result,
+   or flipping the sign bits of unsigned inputs.  */
+void tcg_gen_cmp_vec(TCGCond cond, unsigned vece, TCGv_vec r,
+                     TCGv_vec a, TCGv_vec b)
+{
+    TCGType type = vec_type(r);
+    bool inv = false;
+    TCGv_vec t;
+
+    tcg_debug_assert(vec_type(a) == type && vec_type(b) == type);
+    tcg_debug_assert(vece <= MO_32 || TCG_TARGET_HAS_cmp64_vec);
+
+    switch (cond) {
+    case TCG_COND_NEVER:
+    case TCG_COND_ALWAYS:
+        tcg_gen_dupi_vec(MO_64, r, -(uint64_t)(cond == TCG_COND_ALWAYS));
+        return;
+
+    case TCG_COND_LTU:
+    case TCG_COND_GEU:
+    case TCG_COND_LEU:
+    case TCG_COND_GTU:
+        {
+            TCGv_vec t0 = tcg_temp_new_vec(type);
+            TCGv_vec t1 = tcg_temp_new_vec(type);
+
+            tcg_gen_dupi_vec(vece, t0, 1ull << ((8 << vece) - 1));
+            tcg_gen_xor_vec(vece, t1, b, t0);
+            tcg_gen_xor_vec(vece, t0, a, t0);
+            tcg_gen_cmp_vec(tcg_signed_cond(cond), vece, r, t0, t1);
+            tcg_temp_free_vec(t0);
+            tcg_temp_free_vec(t1);
+        }
+        return;
+
+    case TCG_COND_EQ:
+    case TCG_COND_GT:
+        break;
+    case TCG_COND_NE:
+    case TCG_COND_LE:
+        inv = true;
+        cond = tcg_invert_cond(cond);
+        break;
+    case TCG_COND_LT:
+    case TCG_COND_GE:
+        t = a;
+        a = b;
+        b = t;
+        cond = tcg_swap_cond(cond);
+        if (cond == TCG_COND_LE) {
+            inv = true;
+            cond = TCG_COND_GT;
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    tcg_gen_op6(&tcg_ctx, INDEX_op_cmp_vec, GET_TCGV_VEC(r), GET_TCGV_VEC(a),
+                GET_TCGV_VEC(b), type, vece, cond);
+
+    if (inv) {
+        t = tcg_temp_new_vec(type);
+        tcg_gen_dupi_vec(MO_64, t, -1);
+        tcg_gen_xor_vec(vece, r, r, t);
+        tcg_temp_free_vec(t);
+    }
+}
+
 /* QEMU specific operations.  */
 
 void tcg_gen_goto_tb(unsigned idx)
@@ -2587,6 +2826,18 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+void tcg_gen_lookup_and_goto_ptr(void)
+{
+    if (TCG_TARGET_HAS_goto_ptr && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr, tcg_ctx.tcg_env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     /* Trigger the asserts within as early as possible.  */
@@ -722,6 +722,38 @@ static inline void tcg_gen_concat32_i64(TCGv_i64 ret, TCGv_i64 lo, TCGv_i64 hi)
     tcg_gen_deposit_i64(ret, lo, hi, 32, 32);
 }
 
+/* Host vector operations.  These may only be used when the host has
+   TCG_TARGET_HAS_v64 or TCG_TARGET_HAS_v128 for the type of the operands;
+   front ends should go through the expanders in tcg-op-gvec.h instead.
+   VECE is the log2 of the lane size in bytes, i.e. MO_8 to MO_64.  */
+
+void tcg_gen_mov_vec(TCGv_vec r, TCGv_vec a);
+void tcg_gen_dupi_vec(unsigned vece, TCGv_vec r, uint64_t a);
+void tcg_gen_dup_i32_vec(unsigned vece, TCGv_vec r, TCGv_i32 a);
+void tcg_gen_dup_i64_vec(unsigned vece, TCGv_vec r, TCGv_i64 a);
+
+void tcg_gen_ld_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset);
+void tcg_gen_st_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset);
+/* Store only the low LOW_TYPE-sized part of R.  */
+void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset,
+                     TCGType low_type);
+
+void tcg_gen_add_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b);
+void tcg_gen_sub_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b);
+void tcg_gen_and_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b);
+void tcg_gen_or_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b);
+void tcg_gen_xor_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b);
+
+/* Shift each lane of A by I, which must be less than the lane width.  */
+void tcg_gen_shli_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i);
+void tcg_gen_shri_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i);
+void tcg_gen_sari_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i);
+
+/* Set each lane of R to all ones if COND holds between the lanes of
+   A and B, and to zero otherwise.  */
+void tcg_gen_cmp_vec(TCGCond cond, unsigned vece, TCGv_vec r,
+                     TCGv_vec a, TCGv_vec b);
+
 /* QEMU specific operations.  */
 
 #ifndef TARGET_LONG_BITS
@@ -796,6 +828,19 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
  */
 void tcg_gen_goto_tb(unsigned idx);
 
+/**
+ * tcg_gen_lookup_and_goto_ptr() - look up the current TB, jump to it if valid
+ *
+ * Looks up a TB for the CPU state that the guest registers describe at
+ * this point, and jumps to it if found.  Otherwise, or if the backend
+ * cannot jump to a register, returns to the main loop as exit_tb(0) does.
+ * Use this instead of exit_tb(0) at the end of a TB ending in an indirect
+ * branch, once the new PC has been stored to the CPU state.  Do not use
+ * it when the TB changed state that the main loop must act upon, e.g.
+ * when interrupts may have been unmasked.
+ */
+void tcg_gen_lookup_and_goto_ptr(void);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
@@ -117,9 +117,14 @@ static bool tcg_out_tb_finalize(TCGContext *s);
 
 
 
-static TCGRegSet tcg_target_available_regs[2];
+static TCGRegSet tcg_target_available_regs[TCG_TYPE_COUNT];
 static TCGRegSet tcg_target_call_clobber_regs;
 
+/* Keep globals in host registers across conditional branches, i.e. over
+   extended basic blocks, rather than spilling them at every block end.
+   Selected with -accel tcg,regalloc=ebb.  */
+bool tcg_regalloc_ebb;
+
 #if TCG_TARGET_INSN_UNIT_SIZE == 1
 static __attribute__((unused)) inline void tcg_out8(TCGContext *s, uint8_t v)
 {
@@ -383,6 +388,81 @@ void tcg_context_init(TCGContext *s)
     }
 }
 
+/*
+ * Code buffer regions.
+ *
+ * The code buffer is split into equally sized regions that are filled
+ * one after the other.  Once every region has been handed out the
+ * translator reclaims the oldest one (see translate-all.c) rather than
+ * throwing away all translated code, so that hot code in the younger
+ * regions survives a full buffer.
+ */
+#define TCG_REGION_MIN_SIZE (2 * 1024 * 1024)
+
+/* Compute a high-water mark, at which we voluntarily leave a region.
+   The size here is arbitrary, significantly larger than we expect the
+   code generation for any one opcode to require.  */
+#define TCG_HIGHWATER 1024
+
+static void tcg_region_init(TCGContext *s)
+{
+    size_t n = s->code_gen_buffer_size / TCG_REGION_MIN_SIZE;
+
+    n = MAX(n, 1);
+    n = MIN(n, CODE_GEN_MAX_REGIONS);
+    s->region_count = n;
+    s->region_size = QEMU_ALIGN_DOWN(s->code_gen_buffer_size / n, 64);
+    tcg_region_reset_all(s);
+}
+
+void *tcg_region_start(TCGContext *s, size_t region)
+{
+    return s->code_gen_buffer + region * s->region_size;
+}
+
+/* Return the region containing @p, or region_count if there is none.  */
+size_t tcg_region_index(TCGContext *s, const void *p)
+{
+    size_t offset;
+
+    if (p < s->code_gen_buffer) {
+        return s->region_count;
+    }
+    offset = p - s->code_gen_buffer;
+    return MIN(offset / s->region_size, s->region_count);
+}
+
+/* Make @region the one that code is generated into, from its start.  */
+void tcg_region_set(TCGContext *s, size_t region)
+{
+    void *start = tcg_region_start(s, region);
+
+    s->region_current = region;
+    s->code_gen_ptr = start;
+    s->code_gen_highwater = start + s->region_size - TCG_HIGHWATER;
+}
+
+void tcg_region_reset_all(TCGContext *s)
+{
+    tcg_region_set(s, 0);
+    s->region_in_use = 1;
+}
+
+/*
+ * Move on to the next region if it has not been used since the last
+ * reset.  Returns false when all regions hold code, in which case the
+ * caller has to reclaim one.
+ */
+bool tcg_region_alloc(TCGContext *s)
+{
+    if (s->region_in_use == s->region_count) {
+        return false;
+    }
+    tcg_region_set(s, s->region_current + 1);
+    s->region_in_use++;
+    return true;
+}
+
 void tcg_prologue_init(TCGContext *s)
 {
     size_t prologue_size, total_size;
@@ -396,6 +476,8 @@ void tcg_prologue_init(TCGContext *s)
 
     /* Generate the prologue.  */
     tcg_target_qemu_prologue(s);
+    /* Backends implementing goto_ptr must provide the return path.  */
+    tcg_debug_assert(!TCG_TARGET_HAS_goto_ptr || s->code_gen_epilogue);
     buf1 = s->code_ptr;
     flush_icache_range((uintptr_t)buf0, (uintptr_t)buf1);
 
@@ -407,10 +489,9 @@ void tcg_prologue_init(TCGContext *s)
     total_size = s->code_gen_buffer_size - prologue_size;
     s->code_gen_buffer_size = total_size;
 
-    /* Compute a high-water mark, at which we voluntarily flush the buffer
-       and start over.  The size here is arbitrary, significantly larger
-       than we expect the code generation for any one opcode to require.  */
-    s->code_gen_highwater = s->code_gen_buffer + (total_size - 1024);
+    /* Split what is left into regions; this also sets the high-water
+       mark for the first one.  */
+    tcg_region_init(s);
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
@@ -641,6 +722,36 @@ TCGv_i64 tcg_temp_new_internal_i64(int temp_local)
     return MAKE_TCGV_I64(idx);
 }
 
+TCGv_vec tcg_temp_new_vec(TCGType type)
+{
+    int idx;
+
+#ifdef CONFIG_DEBUG_TCG
+    switch (type) {
+    case TCG_TYPE_V64:
+        assert(TCG_TARGET_HAS_v64);
+        break;
+    case TCG_TYPE_V128:
+        assert(TCG_TARGET_HAS_v128);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+#endif
+
+    idx = tcg_temp_new_internal(type, 0);
+    return MAKE_TCGV_VEC(idx);
+}
+
+/* Create a new temp of the same type as an existing temp.  */
+TCGv_vec tcg_temp_new_vec_matching(TCGv_vec match)
+{
+    TCGTemp *ts = &tcg_ctx.temps[GET_TCGV_VEC(match)];
+
+    tcg_debug_assert(ts->temp_allocated != 0);
+    return tcg_temp_new_vec(ts->base_type);
+}
+
 static void tcg_temp_free_internal(int idx)
 {
     TCGContext *s = &tcg_ctx;
@@ -673,6 +784,11 @@ void tcg_temp_free_i64(TCGv_i64 arg)
     tcg_temp_free_internal(GET_TCGV_I64(arg));
 }
 
+void tcg_temp_free_vec(TCGv_vec arg)
+{
+    tcg_temp_free_internal(GET_TCGV_VEC(arg));
+}
+
 TCGv_i32 tcg_const_i32(int32_t val)
 {
     TCGv_i32 t0;
@@ -1248,7 +1364,13 @@ static void process_op_defs(TCGContext *s)
         /* Missing TCGTargetOpDef entry. */
         tcg_debug_assert(tdefs != NULL);
 
-        type = (def->flags & TCG_OPF_64BIT ? TCG_TYPE_I64 : TCG_TYPE_I32);
+        if (def->flags & TCG_OPF_VECTOR) {
+            type = TCG_TYPE_V128;
+        } else if (def->flags & TCG_OPF_64BIT) {
+            type = TCG_TYPE_I64;
+        } else {
+            type = TCG_TYPE_I32;
+        }
         for (i = 0; i < nb_args; i++) {
             const char *ct_str = tdefs->args_ct_str[i];
             /* Incomplete TCGTargetOpDef entry. */
@@ -1400,14 +1522,69 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *temp_state)
     }
 }
 
+/* liveness analysis: end of basic block that continues at a label whose
+   global state is LSTATE, or at an unknown point if LSTATE is NULL.  If
+   FALLTHRU, the block may also continue with the next opcode, described
+   by the current TEMP_STATE.  As in tcg_la_bb_end, globals go back to
+   memory, except those overwritten before any use on every successor:
+   their value is never observed, so they need not be saved at all.
+
+   With tcg_regalloc_ebb, globals and local temps that are live on the
+   fallthrough path only need to be synced at a conditional branch, so
+   that they can stay in host registers on that path.  Indirect globals
+   are excluded, since liveness_pass_2 reloads them at every block end.  */
+static void tcg_la_bb_branch(TCGContext *s, uint8_t *temp_state,
+                             const uint8_t *lstate, bool fallthru)
+{
+    int i, n, nb_globals = s->nb_globals;
+
+    if (fallthru && tcg_regalloc_ebb) {
+        for (i = 0; i < nb_globals; i++) {
+            if (s->temps[i].indirect_reg) {
+                bool dead = lstate && lstate[i] == TS_DEAD
+                            && temp_state[i] == TS_DEAD;
+                temp_state[i] = dead ? TS_DEAD : TS_DEAD | TS_MEM;
+            } else if (!lstate || lstate[i] != TS_DEAD) {
+                temp_state[i] |= TS_MEM;
+            }
+        }
+        for (i = nb_globals, n = s->nb_temps; i < n; i++) {
+            if (s->temps[i].temp_local) {
+                temp_state[i] |= TS_MEM;
+            } else {
+                temp_state[i] = TS_DEAD;
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < nb_globals; i++) {
+        bool dead = lstate && lstate[i] == TS_DEAD
+                    && (!fallthru || temp_state[i] == TS_DEAD);
+        temp_state[i] = dead ? TS_DEAD : TS_DEAD | TS_MEM;
+    }
+    for (i = nb_globals, n = s->nb_temps; i < n; i++) {
+        temp_state[i] = s->temps[i].temp_local ? TS_DEAD | TS_MEM : TS_DEAD;
+    }
+}
+
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed.
+
+   The ops are scanned backward, so the state of the globals at a label
+   is known by the time the forward branches to it are reached; this
+   lets dead stores to globals be removed across the whole TB.  Backward
+   branches fall back to assuming every global is live.  */
 static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
 {
     int nb_globals = s->nb_globals;
+    uint8_t **label_state;
     int oi, oi_prev;
 
+    label_state = tcg_malloc(s->nb_labels * sizeof(uint8_t *));
+    memset(label_state, 0, s->nb_labels * sizeof(uint8_t *));
+
     tcg_la_func_end(s, temp_state);
 
     for (oi = s->gen_op_buf[0].prev; oi != 0; oi = oi_prev) {
@@ -1604,7 +1781,36 @@ static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, temp_state);
+                    TCGLabel *l;
+
+                    switch (opc) {
+                    case INDEX_op_set_label:
+                        l = arg_label(args[0]);
+                        label_state[l->id] = tcg_malloc(nb_globals);
+                        memcpy(label_state[l->id], temp_state, nb_globals);
+                        tcg_la_bb_branch(s, temp_state,
+                                         label_state[l->id], false);
+                        break;
+                    case INDEX_op_br:
+                        l = arg_label(args[0]);
+                        tcg_la_bb_branch(s, temp_state,
+                                         label_state[l->id], false);
+                        break;
+                    case INDEX_op_brcond_i32:
+                    case INDEX_op_brcond_i64:
+                        l = arg_label(args[3]);
+                        tcg_la_bb_branch(s, temp_state,
+                                         label_state[l->id], true);
+                        break;
+                    case INDEX_op_brcond2_i32:
+                        l = arg_label(args[5]);
+                        tcg_la_bb_branch(s, temp_state,
+                                         label_state[l->id], true);
+                        break;
+                    default:
+                        tcg_la_bb_end(s, temp_state);
+                        break;
+                    }
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     for (i = 0; i < nb_globals; i++) {
@@ -1864,21 +2070,32 @@ static void check_regs(TCGContext *s)
 static void temp_allocate_frame(TCGContext *s, int temp)
 {
     TCGTemp *ts;
+    tcg_target_long size;
+
     ts = &s->temps[temp];
+    switch (ts->type) {
+    case TCG_TYPE_V64:
+        size = 8;
+        break;
+    case TCG_TYPE_V128:
+        size = 16;
+        break;
+    default:
+        size = sizeof(tcg_target_long);
+        break;
+    }
 #if !(defined(__sparc__) && TCG_TARGET_REG_BITS == 64)
     /* Sparc64 stack is accessed with offset of 2047 */
-    s->current_frame_offset = (s->current_frame_offset +
-                               (tcg_target_long)sizeof(tcg_target_long) - 1) &
-        ~(sizeof(tcg_target_long) - 1);
+    s->current_frame_offset = (s->current_frame_offset + size - 1) &
+        ~(size - 1);
 #endif
-    if (s->current_frame_offset + (tcg_target_long)sizeof(tcg_target_long) >
-        s->frame_end) {
+    if (s->current_frame_offset + size > s->frame_end) {
         tcg_abort();
     }
     ts->mem_offset = s->current_frame_offset;
     ts->mem_base = s->frame_temp;
     ts->mem_allocated = 1;
-    s->current_frame_offset += sizeof(tcg_target_long);
+    s->current_frame_offset += size;
 }
 
 static void temp_load(TCGContext *, TCGTemp *, TCGRegSet, TCGRegSet);
@@ -2057,6 +2274,28 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* at a conditional branch with tcg_regalloc_ebb, globals and local temps
+   are synced to their canonical location, but may stay in registers for
+   the fallthrough path; normal temporaries are dead. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        /* The liveness analysis already ensures that locals are synced
+           and temps are dead.  Keep tcg_debug_asserts for safety. */
+        if (ts->temp_local) {
+            tcg_debug_assert(ts->val_type != TEMP_VAL_REG
+                             || ts->mem_coherent);
+        } else {
+            tcg_debug_assert(ts->val_type == TEMP_VAL_DEAD);
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
    all globals are stored at their canonical location. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
@@ -2273,7 +2512,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if ((def->flags & TCG_OPF_COND_BRANCH) && tcg_regalloc_ebb) {
+        tcg_reg_alloc_cbranch(s, i_allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, i_allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2612,6 +2853,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         switch (opc) {
         case INDEX_op_mov_i32:
         case INDEX_op_mov_i64:
+        case INDEX_op_mov_vec:
             tcg_reg_alloc_mov(s, def, args, arg_life);
             break;
         case INDEX_op_movi_i32:
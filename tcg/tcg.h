@@ -142,6 +142,26 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_extract_i64_valid(ofs, len) 1
 #endif
 
+/* Host vector support is optional; without it the generic vector
+   expanders fall back to integer registers and out-of-line helpers.  */
+#ifndef TCG_TARGET_HAS_v64
+#define TCG_TARGET_HAS_v64              0
+#endif
+#ifndef TCG_TARGET_HAS_v128
+#define TCG_TARGET_HAS_v128             0
+#endif
+#ifndef TCG_TARGET_HAS_cmp64_vec
+#define TCG_TARGET_HAS_cmp64_vec        0
+#endif
+/* Immediate shifts of 8-bit lanes, and arithmetic right shifts of 64-bit
+   lanes; without them tcg_gen_sh*i_vec expands these with other ops.  */
+#ifndef TCG_TARGET_HAS_shi8_vec
+#define TCG_TARGET_HAS_shi8_vec         0
+#endif
+#ifndef TCG_TARGET_HAS_sar64_vec
+#define TCG_TARGET_HAS_sar64_vec        0
+#endif
+
 /* Only one of DIV or DIV2 should be defined.  */
 #if defined(TCG_TARGET_HAS_div_i32)
 #define TCG_TARGET_HAS_div2_i32         0
@@ -246,6 +266,8 @@ typedef struct TCGPool {
 typedef enum TCGType {
     TCG_TYPE_I32,
     TCG_TYPE_I64,
+    TCG_TYPE_V64,
+    TCG_TYPE_V128,
     TCG_TYPE_COUNT, /* number of different types */
 
     /* An alias for the size of the host register.  */
@@ -385,6 +407,23 @@ static inline unsigned get_alignment_bits(TCGMemOp memop)
     return a;
 }
 
+/* Replicate the low VECE-sized part of C across 64 bits.  */
+static inline uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        g_assert_not_reached();
+    }
+}
+
 typedef tcg_target_ulong TCGArg;
 
 /* Define type and accessor macros for TCG variables.
@@ -421,6 +460,7 @@ typedef tcg_target_ulong TCGArg;
 typedef struct TCGv_i32_d *TCGv_i32;
 typedef struct TCGv_i64_d *TCGv_i64;
 typedef struct TCGv_ptr_d *TCGv_ptr;
+typedef struct TCGv_vec_d *TCGv_vec;
 typedef TCGv_ptr TCGv_env;
 #if TARGET_LONG_BITS == 32
 #define TCGv TCGv_i32
@@ -445,6 +485,11 @@ static inline TCGv_ptr QEMU_ARTIFICIAL MAKE_TCGV_PTR(intptr_t i)
     return (TCGv_ptr)i;
 }
 
+static inline TCGv_vec QEMU_ARTIFICIAL MAKE_TCGV_VEC(intptr_t i)
+{
+    return (TCGv_vec)i;
+}
+
 static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_I32(TCGv_i32 t)
 {
     return (intptr_t)t;
@@ -460,6 +505,11 @@ static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_PTR(TCGv_ptr t)
     return (intptr_t)t;
 }
 
+static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_VEC(TCGv_vec t)
+{
+    return (intptr_t)t;
+}
+
 #if TCG_TARGET_REG_BITS == 32
 #define TCGV_LOW(t) MAKE_TCGV_I32(GET_TCGV_I64(t))
 #define TCGV_HIGH(t) MAKE_TCGV_I32(GET_TCGV_I64(t) + 1)
@@ -468,6 +518,7 @@ static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_PTR(TCGv_ptr t)
 #define TCGV_EQUAL_I32(a, b) (GET_TCGV_I32(a) == GET_TCGV_I32(b))
 #define TCGV_EQUAL_I64(a, b) (GET_TCGV_I64(a) == GET_TCGV_I64(b))
 #define TCGV_EQUAL_PTR(a, b) (GET_TCGV_PTR(a) == GET_TCGV_PTR(b))
+#define TCGV_EQUAL_VEC(a, b) (GET_TCGV_VEC(a) == GET_TCGV_VEC(b))
 
 /* Dummy definition to avoid compiler warnings.  */
 #define TCGV_UNUSED_I32(x) x = MAKE_TCGV_I32(-1)
@@ -557,6 +608,12 @@ static inline TCGCond tcg_unsigned_cond(TCGCond c)
     return c & 2 ? (TCGCond)(c ^ 6) : c;
 }
 
+/* Create a "signed" version of an "unsigned" comparison.  */
+static inline TCGCond tcg_signed_cond(TCGCond c)
+{
+    return c & 4 ? (TCGCond)(c ^ 6) : c;
+}
+
 /* Must a comparison be considered unsigned?  */
 static inline bool is_unsigned_cond(TCGCond c)
 {
@@ -706,13 +763,20 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     void *code_gen_ptr;
 
-    /* Threshold to flush the translated code buffer.  */
+    /* Threshold to leave the current code buffer region.  */
     void *code_gen_highwater;
 
+    /* Code buffer regions, see tcg_region_init().  */
+    size_t region_size;
+    size_t region_count;
+    size_t region_current;
+    size_t region_in_use;
+
     TBContext tb_ctx;
 
     /* Track which vCPU triggers events */
@@ -738,6 +802,16 @@ struct TCGContext {
 
 extern TCGContext tcg_ctx;
 extern bool parallel_cpus;
+extern bool tcg_regalloc_ebb;
+
+/* Oversized TCG guests make things like MTTCG hard
+ * as we can't use atomics for cputlb updates.
+ */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+#define TCG_OVERSIZED_GUEST 1
+#else
+#define TCG_OVERSIZED_GUEST 0
+#endif
 
 static inline void tcg_set_insn_param(int op_idx, int arg, TCGArg v)
 {
@@ -785,6 +859,11 @@ static inline void *tcg_malloc(int size)
 
 void tcg_context_init(TCGContext *s);
 void tcg_prologue_init(TCGContext *s);
+void *tcg_region_start(TCGContext *s, size_t region);
+size_t tcg_region_index(TCGContext *s, const void *p);
+void tcg_region_set(TCGContext *s, size_t region);
+void tcg_region_reset_all(TCGContext *s);
+bool tcg_region_alloc(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
@@ -802,6 +881,12 @@ TCGv_i64 tcg_temp_new_internal_i64(int temp_local);
 void tcg_temp_free_i32(TCGv_i32 arg);
 void tcg_temp_free_i64(TCGv_i64 arg);
 
+/* Vector temporaries, of TCG_TYPE_V64 or TCG_TYPE_V128.  Only valid
+   when the host advertises TCG_TARGET_HAS_v64 or TCG_TARGET_HAS_v128.  */
+TCGv_vec tcg_temp_new_vec(TCGType type);
+TCGv_vec tcg_temp_new_vec_matching(TCGv_vec match);
+void tcg_temp_free_vec(TCGv_vec arg);
+
 static inline TCGv_i32 tcg_global_mem_new_i32(TCGv_ptr reg, intptr_t offset,
                                               const char *name)
 {
@@ -882,6 +967,12 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch; execution may fall through
+       to the next opcode.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
+    /* Instruction operands are host vectors; the first constant
+       argument is the TCGType of the operation.  */
+    TCG_OPF_VECTOR       = 0x40,
 };
 
 typedef struct TCGOpDef {
@@ -583,6 +583,11 @@ char *qtest_hmp(QTestState *s, const char *fmt, ...)
     return ret;
 }
 
+pid_t qtest_pid(QTestState *s)
+{
+    return s->qemu_pid;
+}
+
 const char *qtest_get_arch(void)
 {
     const char *qemu = getenv("QTEST_QEMU_BINARY");
@@ -0,0 +1,167 @@
+#!/usr/bin/env python
+#
+# Block layer benchmarks
+#
+# Runs a fixed set of workloads through the qemu-io "bench" command on
+# null-co, raw file and qcow2 images, and saves the best of a few runs of
+# each so that two builds can be compared:
+#
+#   ./bench.py -o before.json
+#   ... rebuild ...
+#   ./bench.py -o after.json -c before.json
+#
+# QEMU_IO_PROG and QEMU_IMG_PROG select the binaries as for ./check, and
+# images are created in TEST_DIR (a temporary directory by default).
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+
+import json
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import iotests
+
+IMAGE_SIZE = '1G'
+
+# The setup functions create the images below the given directory and
+# return the file name that %(img)s stands for in the options string.
+
+def setup_none(d):
+    return None
+
+def setup_raw(d):
+    img = os.path.join(d, 'bench.raw')
+    qemu_img_checked('create', '-f', 'raw', img, IMAGE_SIZE)
+    return img
+
+def setup_qcow2_empty(d):
+    img = os.path.join(d, 'bench.qcow2')
+    qemu_img_checked('create', '-f', 'qcow2', img, IMAGE_SIZE)
+    return img
+
+def setup_qcow2_prealloc(d):
+    img = os.path.join(d, 'bench-4k.qcow2')
+    qemu_img_checked('create', '-f', 'qcow2', '-o',
+                     'cluster_size=4k,preallocation=metadata', img, IMAGE_SIZE)
+    return img
+
+def setup_qcow2_backing(d):
+    base = setup_raw(d)
+    img = os.path.join(d, 'bench-overlay.qcow2')
+    qemu_io_checked('-f', 'raw', '-c', 'write -q 0 256M', base)
+    qemu_img_checked('create', '-f', 'qcow2', '-o',
+                     'backing_file=%s,backing_fmt=raw' % base, img)
+    qemu_io_checked('-f', 'qcow2', '-c', 'write -q 128M 256M', img)
+    return img
+
+NULL_CO = 'driver=null-co,size=%s' % IMAGE_SIZE
+RAW = 'driver=raw,file.filename=%(img)s'
+QCOW2 = 'driver=qcow2,file.filename=%(img)s'
+
+# name, image setup, qemu-io --image-opts string, bench arguments
+workloads = [
+    ('null-co-read-4k-qd1', setup_none, NULL_CO, '-n 200000 0 4k'),
+    ('null-co-read-4k-qd32', setup_none, NULL_CO, '-d 32 -n 200000 0 4k'),
+    ('null-co-write-64k-qd32', setup_none, NULL_CO,
+     '-w -d 32 -n 100000 0 64k'),
+    ('raw-read-4k-qd32', setup_raw, RAW, '-d 32 -n 100000 0 4k'),
+    ('raw-write-64k-qd32', setup_raw, RAW, '-w -d 32 -n 20000 0 64k'),
+    ('raw-block-status-64k', setup_raw, RAW, '-m -n 100000 0 64k'),
+    ('qcow2-read-4k-qd32', setup_qcow2_prealloc, QCOW2,
+     '-d 32 -n 100000 0 4k'),
+    # Every request needs a different L2 table, and only four fit the cache
+    ('qcow2-l2-cache-miss', setup_qcow2_prealloc,
+     QCOW2 + ',l2-cache-size=16k', '-d 32 -n 50000 -S 2052k 0 4k'),
+    ('qcow2-alloc-write-64k', setup_qcow2_empty, QCOW2,
+     '-w -d 32 -n 16384 0 64k'),
+    ('qcow2-block-status-64k', setup_qcow2_backing, QCOW2,
+     '-m -n 100000 0 64k'),
+]
+
+def qemu_img_checked(*args):
+    if iotests.qemu_img(*args) != 0:
+        raise Exception('qemu-img %s failed' % ' '.join(args))
+
+def qemu_io_checked(*args):
+    out = iotests.qemu_io(*args)
+    if 'failed' in out:
+        raise Exception('qemu-io %s failed: %s' % (' '.join(args), out))
+    return out
+
+def run_workload(test_dir, setup, opts, bench_args):
+    '''Run one workload and return its throughput in requests per second'''
+    d = tempfile.mkdtemp(dir=test_dir)
+    try:
+        img = setup(d)
+        out = qemu_io_checked('--image-opts', '-c', 'bench -C ' + bench_args,
+                              opts % {'img': img})
+    finally:
+        shutil.rmtree(d)
+
+    # bytes,ops,time,bytes/sec,ops/sec
+    fields = out.strip().split('\n')[-1].split(',')
+    if len(fields) != 5:
+        raise Exception('unexpected qemu-io output: %s' % out)
+    return float(fields[4])
+
+def git_commit():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'],
+                                       stderr=open(os.devnull, 'w')).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def print_results(results, baseline):
+    for name, _, _, _ in workloads:
+        if name not in results:
+            continue
+        line = '%-28s %12.0f ops/s' % (name, results[name])
+        if baseline and baseline.get(name):
+            line += '  %+7.1f%%' % ((results[name] / baseline[name] - 1) * 100)
+        print(line)
+
+def main():
+    parser = optparse.OptionParser('usage: %prog [options] [workload...]')
+    parser.add_option('-o', dest='output', metavar='FILE',
+                      help='save the results in FILE')
+    parser.add_option('-c', dest='compare', metavar='FILE',
+                      help='compare with the results saved in FILE')
+    parser.add_option('-r', dest='runs', type='int', default=3,
+                      help='keep the best of RUNS runs [default: %default]')
+    parser.add_option('-l', dest='list', action='store_true',
+                      help='list the workloads and exit')
+    opts, args = parser.parse_args()
+
+    if opts.list:
+        for name, _, image_opts, bench_args in workloads:
+            print('%-28s %s: bench %s' % (name, image_opts, bench_args))
+        return 0
+
+    baseline = None
+    if opts.compare:
+        with open(opts.compare) as f:
+            baseline = json.load(f)['results']
+
+    test_dir = iotests.test_dir or tempfile.gettempdir()
+    results = {}
+    for name, setup, image_opts, bench_args in workloads:
+        if args and name not in args:
+            continue
+        results[name] = max(run_workload(test_dir, setup, image_opts,
+                                         bench_args)
+                            for i in range(opts.runs))
+        print_results({name: results[name]}, baseline)
+
+    if opts.output:
+        with open(opts.output, 'w') as f:
+            json.dump({'commit': git_commit(), 'results': results}, f,
+                      indent=4, sort_keys=True)
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
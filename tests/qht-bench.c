@@ -9,8 +9,19 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/tb-hash-xx.h"
 
+/* latency histogram: LAT_N_BUCKETS buckets of LAT_RES_NS each */
+#define LAT_RES_NS 10
+#define LAT_N_BUCKETS 10000
+
+enum {
+    LAT_STEADY,     /* no resize in progress */
+    LAT_RESIZE,     /* at least one resize in progress */
+    LAT_MAX,
+};
+
 struct thread_stats {
     size_t rd;
     size_t not_rd;
@@ -28,6 +39,8 @@ struct thread_info {
     uint64_t r;
     bool write_op; /* writes alternate between insertions and removals */
     bool resize_down;
+    uint64_t *lat[LAT_MAX];
+    uint64_t lat_max[LAT_MAX];
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
 static struct qht ht;
@@ -61,6 +74,9 @@ static uint64_t resize_threshold;
 static size_t qht_n_elems = DEFAULT_QHT_N_ELEMS;
 static int qht_mode;
 
+static bool measure_latency;
+static int n_resizes_in_progress;
+
 static bool test_start;
 static bool test_stop;
 
@@ -84,7 +100,10 @@ static const char commands_string[] =
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
     " -D = delay (in us) between potential resizes\n"
-    " -N = number of resize threads";
+    " -N = number of resize threads\n"
+    "\n"
+    " -L = report lookup/update latency percentiles, split by whether\n"
+    "      a resize (-S) was in progress";
 
 static void usage_complete(int argc, char *argv[])
 {
@@ -127,7 +146,9 @@ static void do_rz(struct thread_info *info)
         size_t size = info->resize_down ? resize_min : resize_max;
         bool resized;
 
+        atomic_inc(&n_resizes_in_progress);
         resized = qht_resize(&ht, size);
+        atomic_dec(&n_resizes_in_progress);
         info->resize_down = !info->resize_down;
 
         if (resized) {
@@ -139,7 +160,7 @@ static void do_rz(struct thread_info *info)
     g_usleep(resize_delay);
 }
 
-static void do_rw(struct thread_info *info)
+static void do_rw_op(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
     uint32_t hash;
@@ -186,6 +207,25 @@ static void do_rw(struct thread_info *info)
     }
 }
 
+static void do_rw(struct thread_info *info)
+{
+    int64_t t0, delta;
+    int phase;
+
+    if (!measure_latency) {
+        do_rw_op(info);
+        return;
+    }
+
+    phase = atomic_read(&n_resizes_in_progress) ? LAT_RESIZE : LAT_STEADY;
+    t0 = get_clock();
+    do_rw_op(info);
+    delta = get_clock() - t0;
+
+    info->lat[phase][MIN(delta / LAT_RES_NS, LAT_N_BUCKETS - 1)]++;
+    info->lat_max[phase] = MAX(info->lat_max[phase], delta);
+}
+
 static void *thread_func(void *p)
 {
     struct thread_info *info = p;
@@ -219,6 +259,14 @@ static void prepare_thread_info(struct thread_info *info, int i)
     info->resize_down = true;
 
     memset(&info->stats, 0, sizeof(info->stats));
+    memset(info->lat_max, 0, sizeof(info->lat_max));
+    if (measure_latency) {
+        int j;
+
+        for (j = 0; j < LAT_MAX; j++) {
+            info->lat[j] = g_new0(uint64_t, LAT_N_BUCKETS);
+        }
+    }
 }
 
 static void
@@ -258,6 +306,7 @@ static void pr_params(void)
     printf(" initial size hint: %zu\n", qht_n_elems);
     printf(" auto-resize:       %s\n",
            qht_mode & QHT_MODE_AUTO_RESIZE ? "on" : "off");
+    printf(" latency:           %s\n", measure_latency ? "on" : "off");
     if (resize_rate) {
         printf(" resize_rate:       %f%%\n", resize_rate * 100.0);
         printf(" resize range:      %zu-%zu\n", resize_min, resize_max);
@@ -352,6 +401,53 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
     }
 }
 
+/* upper bound, in ns, of the bucket holding the @q quantile */
+static uint64_t lat_quantile(const uint64_t *hist, uint64_t total,
+                             uint64_t max, double q)
+{
+    uint64_t target = total * q;
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < LAT_N_BUCKETS - 1; i++) {
+        sum += hist[i];
+        if (sum > target) {
+            return MIN((uint64_t)(i + 1) * LAT_RES_NS, max);
+        }
+    }
+    return max;
+}
+
+static void pr_latency(const char *name, int phase)
+{
+    uint64_t *hist = g_new0(uint64_t, LAT_N_BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+    int i, j;
+
+    for (i = 0; i < n_rw_threads; i++) {
+        for (j = 0; j < LAT_N_BUCKETS; j++) {
+            hist[j] += rw_info[i].lat[phase][j];
+            total += rw_info[i].lat[phase][j];
+        }
+        max = MAX(max, rw_info[i].lat_max[phase]);
+    }
+
+    if (total) {
+        printf(" Latency (%s):%*s p50 %" PRIu64 " ns, p99 %" PRIu64
+               " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns (%.2f M ops)\n",
+               name, (int)(8 - strlen(name)), "",
+               lat_quantile(hist, total, max, 0.5),
+               lat_quantile(hist, total, max, 0.99),
+               lat_quantile(hist, total, max, 0.999),
+               max, (double)total / 1e6);
+    } else {
+        printf(" Latency (%s):%*s no samples\n",
+               name, (int)(8 - strlen(name)), "");
+    }
+    g_free(hist);
+}
+
 static void pr_stats(void)
 {
     struct thread_stats s = {};
@@ -383,6 +479,11 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    if (measure_latency) {
+        pr_latency("steady", LAT_STEADY);
+        pr_latency("resize", LAT_RESIZE);
+    }
 }
 
 static void run_test(void)
@@ -412,7 +513,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:k:K:l:Lhn:N:o:r:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -442,6 +543,9 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            measure_latency = true;
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
@@ -0,0 +1,199 @@
+/*
+ * Cost of QOM casts and property lookups
+ *
+ * Times the operations device models do on per-request paths: instance
+ * casts to an ancestor type (the OBJECT_CHECK macros), casts to an
+ * interface, class casts, and property lookups by name through a few
+ * levels of the class hierarchy.  Build with and without
+ * --disable-qom-cast-debug to compare the two flavours of casts.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+
+#define TYPE_BENCH_IFACE "bench-iface"
+#define TYPE_BENCH_BASE "bench-base"
+#define TYPE_BENCH_MID "bench-mid"
+#define TYPE_BENCH_LEAF "bench-leaf"
+
+#define BENCH_IFACE(obj) \
+    INTERFACE_CHECK(Object, (obj), TYPE_BENCH_IFACE)
+#define BENCH_BASE(obj) \
+    OBJECT_CHECK(BenchBase, (obj), TYPE_BENCH_BASE)
+#define BENCH_BASE_CLASS(klass) \
+    OBJECT_CLASS_CHECK(BenchBaseClass, (klass), TYPE_BENCH_BASE)
+
+typedef struct BenchBase {
+    Object parent_obj;
+    bool flag;
+} BenchBase;
+
+typedef struct BenchBaseClass {
+    ObjectClass parent_class;
+} BenchBaseClass;
+
+static unsigned long iterations = 10 * 1000 * 1000;
+static void *sink;
+
+static const char commands_string[] =
+    " -i = number of iterations, in millions";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static bool bench_get_flag(Object *obj, Error **errp)
+{
+    return BENCH_BASE(obj)->flag;
+}
+
+static void bench_set_flag(Object *obj, bool value, Error **errp)
+{
+    BENCH_BASE(obj)->flag = value;
+}
+
+static void bench_base_class_init(ObjectClass *oc, void *data)
+{
+    object_class_property_add_bool(oc, "flag", bench_get_flag,
+                                   bench_set_flag, &error_abort);
+}
+
+static void bench_leaf_init(Object *obj)
+{
+    object_property_add_bool(obj, "inst-flag", bench_get_flag,
+                             bench_set_flag, &error_abort);
+}
+
+static const TypeInfo bench_iface_info = {
+    .name = TYPE_BENCH_IFACE,
+    .parent = TYPE_INTERFACE,
+    .class_size = sizeof(InterfaceClass),
+};
+
+static const TypeInfo bench_base_info = {
+    .name = TYPE_BENCH_BASE,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(BenchBase),
+    .class_size = sizeof(BenchBaseClass),
+    .class_init = bench_base_class_init,
+};
+
+static const TypeInfo bench_mid_info = {
+    .name = TYPE_BENCH_MID,
+    .parent = TYPE_BENCH_BASE,
+};
+
+static const TypeInfo bench_leaf_info = {
+    .name = TYPE_BENCH_LEAF,
+    .parent = TYPE_BENCH_MID,
+    .instance_init = bench_leaf_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_BENCH_IFACE },
+        { }
+    },
+};
+
+static void pr_result(const char *name, int64_t start)
+{
+    double ns = (get_clock() - start) / (double)iterations;
+
+    printf(" %-24s %8.2f ns\n", name, ns);
+}
+
+static void run_bench(Object *obj)
+{
+    ObjectClass *oc = object_get_class(obj);
+    unsigned long i;
+    int64_t start;
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, BENCH_BASE(obj));
+    }
+    pr_result("OBJECT_CHECK", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, object_dynamic_cast(obj, TYPE_BENCH_BASE));
+    }
+    pr_result("object_dynamic_cast", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, BENCH_IFACE(obj));
+    }
+    pr_result("INTERFACE_CHECK", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, BENCH_BASE_CLASS(oc));
+    }
+    pr_result("OBJECT_CLASS_CHECK", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, object_property_find(obj, "flag", NULL));
+    }
+    pr_result("class property find", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, object_property_find(obj, "inst-flag", NULL));
+    }
+    pr_result("object property find", start);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        atomic_set(&sink, object_property_find(obj, "no-such-property", NULL));
+    }
+    pr_result("missing property find", start);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hi:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'i':
+            iterations = atol(optarg) * 1000 * 1000;
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Object *obj;
+
+    parse_args(argc, argv);
+
+    module_call_init(MODULE_INIT_QOM);
+    type_register_static(&bench_iface_info);
+    type_register_static(&bench_base_info);
+    type_register_static(&bench_mid_info);
+    type_register_static(&bench_leaf_info);
+
+    obj = object_new(TYPE_BENCH_LEAF);
+    printf("Iterations:          %lu\n", iterations);
+    printf("Cost/call:\n");
+    run_bench(obj);
+    object_unref(obj);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * QEMU crc32c test
+ *
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+
+static uint8_t buffer[4096];
+
+/* Bit at a time, independent of the table and of the instructions */
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *data, size_t len)
+{
+    int i;
+
+    while (len--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_1(void)
+{
+    size_t a, s;
+
+    /* The check value of the CRC-32C parameter set */
+    g_assert_cmphex(crc32c(0xffffffff, (const uint8_t *)"123456789", 9),
+                    ==, 0xe3069283);
+    g_assert_cmphex(crc32c(0xffffffff, buffer, 0), ==, 0);
+
+    /* Sizes and alignments that exercise every tail of the wide loops */
+    for (a = 0; a < 16; a++) {
+        for (s = 0; s < 256; s++) {
+            g_assert_cmphex(crc32c(0xffffffff, buffer + a, s), ==,
+                            crc32c_ref(0xffffffff, buffer + a, s));
+        }
+    }
+    g_assert_cmphex(crc32c(0x12345678, buffer, sizeof(buffer)), ==,
+                    crc32c_ref(0x12345678, buffer, sizeof(buffer)));
+}
+
+static void test_2(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = g_test_rand_int();
+    }
+    do {
+        test_1();
+    } while (test_crc32c_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/accel", test_2);
+
+    return g_test_run();
+}
@@ -241,6 +241,45 @@ static void test_hash_base64(void)
     }
 }
 
+/* Test one hash per buffer */
+static void test_hash_batch(void)
+{
+    struct iovec bufs[] = {
+        { .iov_base = (char *)INPUT_TEXT, .iov_len = strlen(INPUT_TEXT) },
+        { .iov_base = (char *)INPUT_TEXT2, .iov_len = strlen(INPUT_TEXT2) },
+        { .iov_base = (char *)"", .iov_len = 0 },
+        { .iov_base = (char *)INPUT_TEXT, .iov_len = strlen(INPUT_TEXT) },
+    };
+    size_t i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(expected_outputs) ; i++) {
+        uint8_t *results;
+        int ret;
+
+        if (!qcrypto_hash_supports(i)) {
+            continue;
+        }
+
+        results = g_new0(uint8_t, G_N_ELEMENTS(bufs) * expected_lens[i]);
+        ret = qcrypto_hash_bytes_batch(i, bufs, G_N_ELEMENTS(bufs),
+                                       results, NULL);
+        g_assert(ret == 0);
+
+        for (j = 0; j < G_N_ELEMENTS(bufs); j++) {
+            uint8_t *result = NULL;
+            size_t resultlen = 0;
+
+            ret = qcrypto_hash_bytes(i, bufs[j].iov_base, bufs[j].iov_len,
+                                     &result, &resultlen, NULL);
+            g_assert(ret == 0);
+            g_assert(resultlen == expected_lens[i]);
+            g_assert(memcmp(results + j * resultlen, result, resultlen) == 0);
+            g_free(result);
+        }
+        g_free(results);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_assert(qcrypto_init(NULL) == 0);
@@ -251,5 +290,6 @@ int main(int argc, char **argv)
     g_test_add_func("/crypto/hash/prealloc", test_hash_prealloc);
     g_test_add_func("/crypto/hash/digest", test_hash_digest);
     g_test_add_func("/crypto/hash/base64", test_hash_base64);
+    g_test_add_func("/crypto/hash/batch", test_hash_batch);
     return g_test_run();
 }
@@ -405,6 +405,40 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_is_zero_range(void)
+{
+    static const size_t lens[] = { 100, 37, 64 };
+    struct iovec iov[ARRAY_SIZE(lens)];
+    QEMUIOVector qiov;
+    size_t size, pos, offset, bytes;
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        iov[i].iov_base = g_malloc0(lens[i]);
+        iov[i].iov_len = lens[i];
+    }
+    qemu_iovec_init_external(&qiov, iov, ARRAY_SIZE(lens));
+    size = qiov.size;
+    g_assert(qemu_iovec_is_zero(&qiov));
+
+    /* Set one byte at a time and check every range around it */
+    for (pos = 0; pos < size; pos += 7) {
+        iov_memset(iov, ARRAY_SIZE(lens), pos, 0xff, 1);
+        g_assert(!qemu_iovec_is_zero(&qiov));
+        for (offset = 0; offset < size; offset += 5) {
+            for (bytes = 0; offset + bytes <= size; bytes += 11) {
+                g_assert(qemu_iovec_is_zero_range(&qiov, offset, bytes) ==
+                         (pos < offset || pos >= offset + bytes));
+            }
+        }
+        iov_memset(iov, ARRAY_SIZE(lens), pos, 0, 1);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        g_free(iov[i].iov_base);
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -413,5 +447,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/is-zero-range", test_is_zero_range);
     return g_test_run();
 }
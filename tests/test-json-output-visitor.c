@@ -0,0 +1,252 @@
+/*
+ * JSON Output Visitor unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/json-output-visitor.h"
+#include "qapi/qobject-output-visitor.h"
+#include "test-qapi-types.h"
+#include "test-qapi-visit.h"
+#include "qapi/qmp/types.h"
+#include "qapi/qmp/qjson.h"
+
+typedef struct TestOutputVisitorData {
+    Visitor *ov;
+    QString *str;
+} TestOutputVisitorData;
+
+static void visitor_output_setup(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    data->str = qstring_new();
+    data->ov = json_output_visitor_new(data->str);
+    g_assert(data->ov);
+}
+
+static void visitor_output_teardown(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    visit_free(data->ov);
+    data->ov = NULL;
+    QDECREF(data->str);
+    data->str = NULL;
+}
+
+static const char *visitor_get(TestOutputVisitorData *data)
+{
+    visit_complete(data->ov, data->str);
+    return qstring_get_str(data->str);
+}
+
+static void visitor_reset(TestOutputVisitorData *data)
+{
+    visitor_output_teardown(data, NULL);
+    visitor_output_setup(data, NULL);
+}
+
+static void test_visitor_out_scalars(TestOutputVisitorData *data,
+                                     const void *unused)
+{
+    int64_t i = -42;
+    bool b = true;
+    double d = 3.14159265358979;
+    char *s = NULL;
+
+    visit_type_int(data->ov, NULL, &i, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "-42");
+
+    visitor_reset(data);
+    visit_type_bool(data->ov, NULL, &b, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "true");
+
+    visitor_reset(data);
+    visit_type_number(data->ov, NULL, &d, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "3.141593");
+
+    /* A null string is output as "" */
+    visitor_reset(data);
+    visit_type_str(data->ov, NULL, &s, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "\"\"");
+
+    visitor_reset(data);
+    visit_type_null(data->ov, NULL, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "null");
+}
+
+static void test_visitor_out_string(TestOutputVisitorData *data,
+                                    const void *unused)
+{
+    char *s = (char *) "quote \" backslash \\ tab \t\x01 \xc3\xa9";
+
+    visit_type_str(data->ov, NULL, &s, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==,
+                    "\"quote \\\" backslash \\\\ tab \\t\\u0001 \\u00E9\"");
+}
+
+static void test_visitor_out_struct_nested(TestOutputVisitorData *data,
+                                           const void *unused)
+{
+    UserDefTwo *ud2;
+
+    ud2 = g_new0(UserDefTwo, 1);
+    ud2->string0 = g_strdup("zero");
+    ud2->dict1 = g_new0(UserDefTwoDict, 1);
+    ud2->dict1->string1 = g_strdup("one");
+    ud2->dict1->dict2 = g_new0(UserDefTwoDictDict, 1);
+    ud2->dict1->dict2->userdef = g_new0(UserDefOne, 1);
+    ud2->dict1->dict2->userdef->string = g_strdup("def");
+    ud2->dict1->dict2->userdef->integer = 42;
+    ud2->dict1->dict2->string = g_strdup("two");
+
+    visit_type_UserDefTwo(data->ov, "unused", &ud2, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==,
+                    "{\"string0\": \"zero\", \"dict1\": "
+                    "{\"string1\": \"one\", \"dict2\": "
+                    "{\"userdef\": {\"integer\": 42, \"string\": \"def\"}, "
+                    "\"string\": \"two\"}}}");
+
+    qapi_free_UserDefTwo(ud2);
+}
+
+static void test_visitor_out_list(TestOutputVisitorData *data,
+                                  const void *unused)
+{
+    TestStructList *p, *head = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        p = g_new0(TestStructList, 1);
+        p->value = g_new0(TestStruct, 1);
+        p->value->integer = 2 - i;
+        p->value->boolean = i & 1;
+        p->value->string = g_strdup("s");
+        p->next = head;
+        head = p;
+    }
+
+    visit_type_TestStructList(data->ov, NULL, &head, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==,
+                    "[{\"integer\": 0, \"boolean\": false, \"string\": \"s\"}, "
+                    "{\"integer\": 1, \"boolean\": true, \"string\": \"s\"}, "
+                    "{\"integer\": 2, \"boolean\": false, \"string\": \"s\"}]");
+    qapi_free_TestStructList(head);
+
+    /* An empty list */
+    visitor_reset(data);
+    head = NULL;
+    visit_type_TestStructList(data->ov, NULL, &head, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "[]");
+}
+
+static void test_visitor_out_any(TestOutputVisitorData *data,
+                                 const void *unused)
+{
+    QObject *qobj;
+
+    qobj = qobject_from_json("{\"a\": [1, \"x\"]}");
+    visit_type_any(data->ov, NULL, &qobj, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "{\"a\": [1, \"x\"]}");
+    qobject_decref(qobj);
+}
+
+static void test_visitor_out_union_flat(TestOutputVisitorData *data,
+                                        const void *unused)
+{
+    UserDefFlatUnion *tmp = g_new0(UserDefFlatUnion, 1);
+
+    tmp->enum1 = ENUM_ONE_VALUE1;
+    tmp->string = g_strdup("str");
+    tmp->integer = 41;
+    tmp->u.value1.boolean = true;
+
+    visit_type_UserDefFlatUnion(data->ov, NULL, &tmp, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==,
+                    "{\"integer\": 41, \"string\": \"str\", "
+                    "\"enum1\": \"value1\", \"boolean\": true}");
+
+    qapi_free_UserDefFlatUnion(tmp);
+}
+
+static void test_visitor_out_alternate(TestOutputVisitorData *data,
+                                       const void *unused)
+{
+    UserDefAlternate *tmp;
+
+    tmp = g_new0(UserDefAlternate, 1);
+    tmp->type = QTYPE_QINT;
+    tmp->u.i = 42;
+
+    visit_type_UserDefAlternate(data->ov, NULL, &tmp, &error_abort);
+    g_assert_cmpstr(visitor_get(data), ==, "42");
+
+    qapi_free_UserDefAlternate(tmp);
+}
+
+/* Single-member objects compare equal to the QObject path regardless
+ * of the QDict iteration order */
+static void test_visitor_out_matches_qobject(TestOutputVisitorData *data,
+                                             const void *unused)
+{
+    UserDefZero zero = { .integer = -7 };
+    UserDefZero *p = &zero;
+    QObject *obj;
+    QString *json;
+    Visitor *v;
+
+    visit_type_UserDefZero(data->ov, NULL, &p, &error_abort);
+
+    v = qobject_output_visitor_new(&obj);
+    visit_type_UserDefZero(v, NULL, &p, &error_abort);
+    visit_complete(v, &obj);
+    visit_free(v);
+    json = qobject_to_json(obj);
+
+    g_assert_cmpstr(visitor_get(data), ==, qstring_get_str(json));
+
+    QDECREF(json);
+    qobject_decref(obj);
+}
+
+static void output_visitor_test_add(const char *testpath,
+                                    TestOutputVisitorData *data,
+                                    void (*test_func)(TestOutputVisitorData *data,
+                                                      const void *user_data))
+{
+    g_test_add(testpath, TestOutputVisitorData, data, visitor_output_setup,
+               test_func, visitor_output_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    TestOutputVisitorData out_visitor_data;
+
+    g_test_init(&argc, &argv, NULL);
+
+    output_visitor_test_add("/visitor/json-output/scalars",
+                            &out_visitor_data, test_visitor_out_scalars);
+    output_visitor_test_add("/visitor/json-output/string",
+                            &out_visitor_data, test_visitor_out_string);
+    output_visitor_test_add("/visitor/json-output/struct-nested",
+                            &out_visitor_data, test_visitor_out_struct_nested);
+    output_visitor_test_add("/visitor/json-output/list",
+                            &out_visitor_data, test_visitor_out_list);
+    output_visitor_test_add("/visitor/json-output/any",
+                            &out_visitor_data, test_visitor_out_any);
+    output_visitor_test_add("/visitor/json-output/union-flat",
+                            &out_visitor_data, test_visitor_out_union_flat);
+    output_visitor_test_add("/visitor/json-output/alternate",
+                            &out_visitor_data, test_visitor_out_alternate);
+    output_visitor_test_add("/visitor/json-output/matches-qobject",
+                            &out_visitor_data,
+                            test_visitor_out_matches_qobject);
+
+    g_test_run();
+
+    return 0;
+}
@@ -587,6 +587,57 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_headroom(void)
+{
+    ThrottleConfig cfg;
+    double bytes, units;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1000;
+    cfg.buckets[THROTTLE_BPS_WRITE].max = 2000;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+
+    throttle_init(&ts);
+    throttle_timers_init(&tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, &tt, &cfg);
+
+    /* empty buckets: the bucket size is max * burst_length, and max
+     * defaults to avg / 10 */
+    throttle_compute_headroom(&ts, true, &bytes, &units);
+    g_assert(double_cmp(bytes, 2000));
+    g_assert(double_cmp(units, 1));
+
+    /* reads are not limited in bytes */
+    throttle_compute_headroom(&ts, false, &bytes, &units);
+    g_assert(isinf(bytes));
+    g_assert(double_cmp(units, 1));
+
+    /* reservations only go to the limited buckets */
+    throttle_reserve(&ts, true, 500, 0.25);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_WRITE].level, 500));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0.25));
+
+    throttle_compute_headroom(&ts, true, &bytes, &units);
+    g_assert(double_cmp(bytes, 1500));
+    g_assert(double_cmp(units, 0.75));
+
+    /* and can be given back, without going below zero */
+    throttle_reserve(&ts, true, -1000, -0.25);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_WRITE].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+
+    /* a full bucket leaves no room */
+    throttle_account(&ts, false, 512);
+    throttle_account(&ts, false, 512);
+    throttle_compute_headroom(&ts, true, &bytes, &units);
+    g_assert(double_cmp(bytes, 2000));
+    g_assert(double_cmp(units, 0));
+
+    throttle_timers_destroy(&tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -672,6 +723,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/headroom",           test_headroom);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -0,0 +1,173 @@
+/*
+ * Cost of a tracepoint on a hot path
+ *
+ * Each thread calls a util/ tracepoint in a loop.  Compare the throughput
+ * with the event disabled (the default), enabled with -e, and with -b,
+ * which runs the same loop without the tracepoint.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/processor.h"
+#include "trace/control.h"
+#include "util/trace.h"
+
+struct count {
+    unsigned long val;
+} QEMU_ALIGNED(64);
+
+static QemuThread *threads;
+static struct count *counts;
+static unsigned int n_threads = 1;
+static unsigned int n_ready_threads;
+static unsigned int duration = 1;
+static bool baseline;
+static bool enable;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of threads\n"
+    " -d = duration in seconds\n"
+    " -e = enable the tracepoint\n"
+    " -b = baseline, run the loop without the tracepoint";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void *thread_func(void *arg)
+{
+    struct count *count = arg;
+    unsigned long val = 0;
+
+    atomic_inc(&n_ready_threads);
+    while (!atomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    if (baseline) {
+        while (!atomic_read(&test_stop)) {
+            barrier();
+            val++;
+        }
+    } else {
+        while (!atomic_read(&test_stop)) {
+            trace_thread_pool_cancel(count, &val);
+            val++;
+        }
+    }
+
+    count->val = val;
+    return NULL;
+}
+
+static void run_test(void)
+{
+    unsigned int remaining;
+    unsigned int i;
+
+    while (atomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+    atomic_set(&test_start, true);
+    do {
+        remaining = sleep(duration);
+    } while (remaining);
+    atomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    threads = g_new(QemuThread, n_threads);
+    counts = qemu_memalign(64, sizeof(*counts) * n_threads);
+    memset(counts, 0, sizeof(*counts) * n_threads);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_create(&threads[i], NULL, thread_func, &counts[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" duration:          %u\n", duration);
+    printf(" tracepoint:        %s\n",
+           baseline ? "none" : enable ? "enabled" : "disabled");
+}
+
+static void pr_stats(void)
+{
+    unsigned long long val = 0;
+    unsigned int i;
+    double tx;
+
+    for (i = 0; i < n_threads; i++) {
+        val += counts[i].val;
+    }
+    tx = val / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f Mops/s\n", tx);
+    printf(" Throughput/thread:  %.2f Mops/s/thread\n", tx / n_threads);
+    printf(" Cost/call:          %.2f ns\n", 1e3 / (tx / n_threads));
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hbed:n:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'b':
+            baseline = true;
+            break;
+        case 'e':
+            enable = true;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    if (enable) {
+        if (!trace_init_backends()) {
+            exit(1);
+        }
+        trace_enable_events("thread_pool_cancel");
+    }
+    pr_params();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
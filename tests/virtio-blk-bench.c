@@ -0,0 +1,240 @@
+/*
+ * Throughput of the virtio-blk device model, driven through qtest
+ *
+ * Pushes requests through a virtio-blk-pci device backed by the null-co
+ * block driver, a queue full at a time, and reports requests per second
+ * and the CPU time QEMU spent per request.  Each descriptor and ring
+ * update is a qtest round trip, so the absolute numbers mostly reflect the
+ * qtest protocol; compare them between builds, not with a real guest.
+ *
+ * Copyright (c) 2017 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "qemu/bswap.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_blk.h"
+
+#define PCI_SLOT                0x04
+#define BENCH_TIMEOUT_US        (30 * 1000 * 1000)
+
+typedef struct BenchReq {
+    uint64_t addr;
+    uint32_t free_head;
+} BenchReq;
+
+static unsigned long n_requests = 20000;
+static unsigned int req_size = 4096;
+static bool do_write;
+
+static const char commands_string[] =
+    " -n = number of requests\n"
+    " -s = request size in bytes, a multiple of 512\n"
+    " -w = write instead of read";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* User and system time of the QEMU process, in seconds */
+static double qemu_cpu_time(QTestState *s)
+{
+#ifdef CONFIG_LINUX
+    char *path = g_strdup_printf("/proc/%d/stat", (int)qtest_pid(s));
+    unsigned long utime, stime;
+    char *contents, *p;
+    double ret = 0;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        /* Skip pid and comm, which may contain spaces */
+        p = strrchr(contents, ')');
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                        "%lu %lu", &utime, &stime) == 2) {
+            ret = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+        }
+        g_free(contents);
+    }
+    g_free(path);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+static void bench_set_header(QVirtioDevice *dev, uint64_t addr, uint64_t sector)
+{
+    struct virtio_blk_outhdr hdr = {
+        .type = do_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = sector,
+    };
+#ifdef HOST_WORDS_BIGENDIAN
+    const bool host_is_big_endian = true;
+#else
+    const bool host_is_big_endian = false;
+#endif
+
+    if (qvirtio_is_big_endian(dev) != host_is_big_endian) {
+        hdr.type = bswap32(hdr.type);
+        hdr.sector = bswap64(hdr.sector);
+    }
+    memwrite(addr, &hdr, sizeof(hdr));
+}
+
+/* Make @n requests available with a single notification, and wait for them */
+static void bench_submit(QVirtioDevice *dev, QVirtQueue *vq, BenchReq *reqs,
+                         unsigned int n)
+{
+    uint16_t idx = readw(vq->avail + 2);
+    uint16_t used_idx = readw(vq->used + 2);
+    gint64 deadline = g_get_monotonic_time() + BENCH_TIMEOUT_US;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        writew(vq->avail + 4 + 2 * ((idx + i) % vq->size), reqs[i].free_head);
+    }
+    writew(vq->avail + 2, idx + n);
+    dev->bus->virtqueue_kick(dev, vq);
+
+    while ((uint16_t)(readw(vq->used + 2) - used_idx) < n) {
+        g_assert(g_get_monotonic_time() < deadline);
+    }
+    qvirtio_wait_queue_isr(dev, vq, BENCH_TIMEOUT_US);
+}
+
+static void run_bench(void)
+{
+    QOSState *qs;
+    QVirtioPCIDevice *dev;
+    QVirtQueuePCI *vqpci;
+    QVirtQueue *vq;
+    BenchReq *reqs;
+    unsigned int batch, i, n;
+    unsigned long done;
+    uint32_t features;
+    double cpu_start, cpu_time, elapsed;
+    gint64 start;
+
+    qs = qtest_pc_boot("-drive if=none,id=drive0,driver=null-co,"
+                       "size=1G,format=raw "
+                       "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                       "addr=%x.0", PCI_SLOT);
+
+    dev = qvirtio_pci_device_find(qs->pcibus, VIRTIO_ID_BLOCK);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&dev->vdev);
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+
+    features = qvirtio_get_features(&dev->vdev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1u << VIRTIO_RING_F_EVENT_IDX) |
+                  (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    vq = &vqpci->vq;
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    /* Three descriptors per request: header, data and status */
+    batch = vq->size / 3;
+    reqs = g_new0(BenchReq, batch);
+    for (i = 0; i < batch; i++) {
+        reqs[i].addr = guest_alloc(qs->alloc, 16 + req_size + 1);
+        bench_set_header(&dev->vdev, reqs[i].addr, i * (req_size / 512));
+    }
+
+    start = g_get_monotonic_time();
+    cpu_start = qemu_cpu_time(qs->qts);
+    for (done = 0; done < n_requests; done += n) {
+        n = MIN(batch, n_requests - done);
+
+        /* All descriptors are free again once the previous batch is used */
+        vq->free_head = 0;
+        vq->num_free = vq->size;
+        for (i = 0; i < n; i++) {
+            reqs[i].free_head = qvirtqueue_add(vq, reqs[i].addr, 16,
+                                               false, true);
+            qvirtqueue_add(vq, reqs[i].addr + 16, req_size, !do_write, true);
+            qvirtqueue_add(vq, reqs[i].addr + 16 + req_size, 1, true, false);
+        }
+        bench_submit(&dev->vdev, vq, reqs, n);
+    }
+    elapsed = (g_get_monotonic_time() - start) / 1e6;
+    cpu_time = qemu_cpu_time(qs->qts) - cpu_start;
+
+    printf("Parameters:\n");
+    printf(" requests:           %lu\n", n_requests);
+    printf(" request size:       %u\n", req_size);
+    printf(" direction:          %s\n", do_write ? "write" : "read");
+    printf(" queue depth:        %u\n", batch);
+    printf("Results:\n");
+    printf(" Duration:           %.2f s\n", elapsed);
+    printf(" Throughput:         %.0f ops/s\n", n_requests / elapsed);
+    printf(" QEMU CPU time/op:   %.2f us\n", cpu_time * 1e6 / n_requests);
+
+    for (i = 0; i < batch; i++) {
+        guest_free(qs->alloc, reqs[i].addr);
+    }
+    g_free(reqs);
+    qvirtqueue_cleanup(dev->vdev.bus, vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hwn:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'w':
+            do_write = true;
+            break;
+        case 'n':
+            n_requests = atol(optarg);
+            break;
+        case 's':
+            req_size = atoi(optarg);
+            if (!req_size || req_size % 512) {
+                usage_complete(argv);
+                exit(1);
+            }
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *arch = qtest_get_arch();
+
+    parse_args(argc, argv);
+
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        g_printerr("virtio-blk-bench is only available on x86\n");
+        return 0;
+    }
+
+    run_bench();
+    return 0;
+}
@@ -13,6 +13,9 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
+#include "qemu/atomic.h"
 #include "trace/control.h"
 #include "trace/simple.h"
 
@@ -28,9 +31,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -43,13 +43,32 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16, /* per thread, must be a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Each thread that traces gets a ring buffer of its own, so that vCPU
+ * threads and iothreads tracing at the same time don't bounce a shared
+ * index around.  A ring has a single producer, its thread, and a single
+ * consumer, the writeout thread, which merges all rings by timestamp.
+ *
+ * Rings are never freed: when a thread exits, its ring is left for the
+ * writeout thread to drain and is then handed to the next new thread.
+ */
+struct TraceThreadBuf {
+    uint8_t buf[TRACE_BUF_LEN];
+    unsigned int head;      /* end of published records, set by the owner */
+    unsigned int tail;      /* end of written out records, set by writeout */
+    int in_use;             /* owned by a live thread */
+    bool in_record;         /* between trace_record_start() and _finish() */
+    TraceThreadBuf *next;
+};
+
+static TraceThreadBuf *trace_thread_bufs;
+static __thread TraceThreadBuf *trace_thread_buf;
+static __thread Notifier trace_thread_exit_notifier;
+
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
@@ -74,53 +93,25 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
+static void read_from_buffer(TraceThreadBuf *tb, unsigned int idx,
+                             void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t len = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, &tb->buf[off], len);
+    memcpy((uint8_t *)dataptr + len, tb->buf, size - len);
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
-{
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
+static unsigned int write_to_buffer(TraceThreadBuf *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t len = MIN(size, TRACE_BUF_LEN - off);
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    memcpy(&tb->buf[off], dataptr, len);
+    memcpy(tb->buf, (const uint8_t *)dataptr + len, size - len);
+    return idx + size; /* most callers wants to know where to write next */
 }
 
 /**
@@ -152,14 +143,54 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
+/**
+ * Write out the oldest published record of all rings
+ *
+ * Returns false if all rings are empty.
+ */
+static bool writeout_oldest_record(void)
+{
+    TraceThreadBuf *tb, *oldest = NULL;
+    TraceRecord record, oldest_record;
+    unsigned int off;
+    size_t len;
+    size_t unused __attribute__ ((unused));
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
+
+    for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+        if (tb->tail == atomic_mb_read(&tb->head)) {
+            continue;
+        }
+        read_from_buffer(tb, tb->tail, &record, sizeof(record));
+        if (!oldest || record.timestamp_ns < oldest_record.timestamp_ns) {
+            oldest = tb;
+            oldest_record = record;
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+
+    /* The record may wrap around the end of the ring */
+    off = oldest->tail & (TRACE_BUF_LEN - 1);
+    len = MIN(oldest_record.length, TRACE_BUF_LEN - off);
+    unused = fwrite(&type, sizeof(type), 1, trace_fp);
+    unused = fwrite(&oldest->buf[off], len, 1, trace_fp);
+    if (len < oldest_record.length) {
+        unused = fwrite(oldest->buf, oldest_record.length - len, 1, trace_fp);
+    }
+
+    /* Done reading, the owner may overwrite the record now */
+    atomic_mb_set(&oldest->tail, oldest->tail + oldest_record.length);
+    return true;
+}
+
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
@@ -181,12 +212,8 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        while (writeout_oldest_record()) {
+            /* nothing */
         }
 
         fflush(trace_fp);
@@ -194,86 +221,107 @@ static gpointer writeout_thread(gpointer opaque)
     return NULL;
 }
 
+static void trace_thread_exit(Notifier *n, void *unused)
+{
+    TraceThreadBuf *tb = trace_thread_buf;
+
+    /* The writeout thread still drains what is left in the ring, and the
+     * next thread to claim it carries on from the current head.
+     */
+    trace_thread_buf = NULL;
+    atomic_mb_set(&tb->in_use, false);
+}
+
+/* Return the calling thread's ring, or NULL if none could be allocated */
+static TraceThreadBuf *trace_thread_buf_get(void)
+{
+    TraceThreadBuf *tb = trace_thread_buf;
+    TraceThreadBuf *next;
+
+    if (likely(tb)) {
+        return tb;
+    }
+
+    /* Reuse the ring of a thread that exited... */
+    for (tb = atomic_rcu_read(&trace_thread_bufs); tb; tb = tb->next) {
+        if (!atomic_read(&tb->in_use) &&
+            !atomic_cmpxchg(&tb->in_use, false, true)) {
+            break;
+        }
+    }
+
+    /* ...or add a new one */
+    if (!tb) {
+        /* don't use g_malloc, can deadlock when traced */
+        tb = calloc(1, sizeof(*tb));
+        if (!tb) {
+            return NULL;
+        }
+        tb->in_use = true;
+        do {
+            next = atomic_read(&trace_thread_bufs);
+            tb->next = next;
+        } while (atomic_cmpxchg(&trace_thread_bufs, next, tb) != next);
+    }
+
+    trace_thread_exit_notifier.notify = trace_thread_exit;
+    qemu_thread_atexit_add(&trace_thread_exit_notifier);
+    trace_thread_buf = tb;
+    return tb;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuf *tb = trace_thread_buf_get();
+    TraceRecord record;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
 
-    idx = old_idx % TRACE_BUF_LEN;
+    /*
+     * A signal handler tracing in the middle of another record of the
+     * same thread would interleave with it; drop the nested one.
+     */
+    if (!tb || tb->in_record ||
+        tb->head + rec_len - atomic_mb_read(&tb->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
+    }
+    tb->in_record = true;
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.pid = trace_pid;
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->rec_off = write_to_buffer(tb, tb->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuf *tb = rec->tbuf;
+
+    /* Publish the record to the writeout thread */
+    atomic_mb_set(&tb->head, rec->rec_off);
+    tb->in_record = false;
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (rec->rec_off - atomic_read(&tb->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -56,6 +56,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "exec/log.h"
+#include "qemu/error-report.h"
 
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
@@ -69,10 +70,14 @@
 #endif
 
 /* Access to the various translations structures need to be serialised via locks
- * for consistency. This is automatic for SoftMMU based system
- * emulation due to its single threaded nature. In user-mode emulation
- * access to the memory related structures are protected with the
- * mmap_lock.
+ * for consistency.  In user-mode emulation access to the memory related
+ * structures are protected with the mmap_lock, which is sharded by guest
+ * address range: page_set_flags only needs the shards covering the pages
+ * it changes, and page_find_alloc fills in the radix tree without any
+ * lock, so that disjoint ranges can be updated concurrently.  In !user-mode
+ * we use
+ * per-page locks (the BQL for now) and tb_lock for the TB structures;
+ * with MTTCG several vCPU threads may translate concurrently.
  */
 #ifdef DEBUG_LOCKING
 #define DEBUG_MEM_LOCKS 1
@@ -145,9 +150,7 @@ TCGContext tcg_ctx;
 bool parallel_cpus;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
 static void page_table_config_init(void)
 {
@@ -171,30 +174,24 @@ static void page_table_config_init(void)
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 #ifdef DEBUG_LOCKING
@@ -203,15 +200,11 @@ void tb_lock_reset(void)
 #define DEBUG_TB_LOCKS 0
 #endif
 
-#ifdef CONFIG_SOFTMMU
-#define assert_tb_lock() do { /* nothing */ } while (0)
-#else
 #define assert_tb_lock() do {               \
         if (DEBUG_TB_LOCKS) {               \
             g_assert(have_tb_lock);         \
         }                                   \
     } while (0)
-#endif
 
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -469,7 +462,8 @@ static void page_init(void)
 
 /* If alloc=1:
  * Called with tb_lock held for system emulation.
- * Called with mmap_lock held for user-mode emulation.
+ * Called with mmap_lock held for user-mode emulation, possibly only for
+ * some shards, so the intermediate levels are installed with cmpxchg.
  */
 static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 {
@@ -489,11 +483,17 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         void **p = atomic_rcu_read(lp);
 
         if (p == NULL) {
+            void *existing;
+
             if (!alloc) {
                 return NULL;
             }
             p = g_new0(void *, V_L2_SIZE);
-            atomic_rcu_set(lp, p);
+            existing = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                g_free(p);
+                p = existing;
+            }
         }
 
         lp = p + ((index >> (i * V_L2_BITS)) & (V_L2_SIZE - 1));
@@ -501,11 +501,17 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 
     pd = atomic_rcu_read(lp);
     if (pd == NULL) {
+        void *existing;
+
         if (!alloc) {
             return NULL;
         }
         pd = g_new0(PageDesc, V_L2_SIZE);
-        atomic_rcu_set(lp, pd);
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            g_free(pd);
+            pd = existing;
+        }
     }
 
     return pd + (index & (V_L2_SIZE - 1));
@@ -710,6 +716,7 @@ static inline void *alloc_code_gen_buffer(void)
     int flags = MAP_PRIVATE | MAP_ANONYMOUS;
     uintptr_t start = 0;
     size_t size = tcg_ctx.code_gen_buffer_size;
+    size_t align = 0;
     void *buf;
 
     /* Constrain the position of the buffer based on the host cpu.
@@ -740,12 +747,34 @@ static inline void *alloc_code_gen_buffer(void)
 #  endif
 # endif
 
-    buf = mmap((void *)start, size + qemu_real_host_page_size,
+    /* Transparent hugepages can only back the part of the buffer that is
+       aligned to the huge page size, so over-allocate and trim on hosts
+       where that is larger than a page.  Otherwise the code generated
+       first, which is usually the hottest, ends up on small pages and
+       keeps missing in the iTLB.  */
+    if (QEMU_VMALLOC_ALIGN > qemu_real_host_page_size) {
+        align = QEMU_VMALLOC_ALIGN;
+    }
+
+    buf = mmap((void *)start, size + align + qemu_real_host_page_size,
                PROT_NONE, flags, -1, 0);
     if (buf == MAP_FAILED) {
         return NULL;
     }
 
+    if (align) {
+        void *aligned = (void *)ROUND_UP((uintptr_t)buf, align);
+        size_t head = aligned - buf;
+
+        if (head) {
+            munmap(buf, head);
+        }
+        if (align - head) {
+            munmap(aligned + size + qemu_real_host_page_size, align - head);
+        }
+        buf = aligned;
+    }
+
 #ifdef __mips__
     if (cross_256mb(buf, size)) {
         /* Try again, with the original still mapped, to avoid re-acquiring
@@ -837,43 +866,76 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
+/* Each code buffer region gets an equal share of the TB descriptors.  */
+static inline int tb_region_max_tbs(void)
+{
+    return tcg_ctx.code_gen_max_blocks / tcg_ctx.region_count;
+}
+
+static inline TranslationBlock *tb_region_tbs(size_t region)
+{
+    return &tcg_ctx.tb_ctx.tbs[region * tb_region_max_tbs()];
+}
+
 /*
- * Allocate a new translation block. Flush the translation buffer if
- * too many translation blocks or too much generated code.
+ * Allocate a new translation block from the current region.  Returns
+ * NULL if the region has run out of TB descriptors.
  *
  * Called with tb_lock held.
  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    size_t region = tcg_ctx.region_current;
+    int *nb_tbs = &tcg_ctx.tb_ctx.region_nb_tbs[region];
     TranslationBlock *tb;
 
     assert_tb_lock();
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (*nb_tbs >= tb_region_max_tbs()) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tb_region_tbs(region)[(*nb_tbs)++];
+    tcg_ctx.tb_ctx.nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
-    tb->invalid = false;
+    /* Not reachable until tb_link_page() */
+    tb->invalid = true;
     return tb;
 }
 
 /* Called with tb_lock held.  */
 void tb_free(TranslationBlock *tb)
 {
+    size_t region = tcg_ctx.region_current;
+    int *nb_tbs = &tcg_ctx.tb_ctx.region_nb_tbs[region];
+
     assert_tb_lock();
 
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (*nb_tbs > 0 && tb == &tb_region_tbs(region)[*nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        (*nb_tbs)--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
 
+/* Host code generated so far; regions we have moved on from count as full */
+static size_t tb_code_size(void)
+{
+    size_t r, size = 0;
+
+    for (r = 0; r < tcg_ctx.region_count; r++) {
+        if (r == tcg_ctx.region_current) {
+            size += tcg_ctx.code_gen_ptr - tcg_region_start(&tcg_ctx, r);
+        } else if (tcg_ctx.tb_ctx.region_nb_tbs[r]) {
+            size += tcg_ctx.region_size;
+        }
+    }
+    return size;
+}
+
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
 #ifdef CONFIG_SOFTMMU
@@ -929,14 +991,13 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     }
 
 #if defined(DEBUG_TB_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush code_size=%zd nb_tbs=%d avg_tb_size=%zd\n",
+           tb_code_size(), tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
+           tb_code_size() / tcg_ctx.tb_ctx.nb_tbs : 0);
 #endif
-    if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
-        > tcg_ctx.code_gen_buffer_size) {
+    if (tcg_ctx.code_gen_ptr >
+        tcg_region_start(&tcg_ctx, tcg_ctx.region_current) +
+        tcg_ctx.region_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
 
@@ -946,13 +1007,18 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         for (i = 0; i < TB_JMP_CACHE_SIZE; ++i) {
             atomic_set(&cpu->tb_jmp_cache[i], NULL);
         }
+        for (i = 0; i < TB_JMP_CACHE2_SIZE; ++i) {
+            atomic_set(&cpu->tb_jmp_cache2[i], NULL);
+        }
     }
 
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    memset(tcg_ctx.tb_ctx.region_nb_tbs, 0,
+           sizeof(tcg_ctx.tb_ctx.region_nb_tbs));
     qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tcg_region_reset_all(&tcg_ctx);
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
@@ -971,6 +1037,62 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+/* Throw away the TBs of the oldest region and start filling it again.  */
+static void do_tb_region_reclaim(CPUState *cpu, run_on_cpu_data data)
+{
+    size_t region = data.host_int;
+    TranslationBlock *tbs;
+    int i, nb_tbs;
+
+    tb_lock();
+
+    /* Another CPU may have beaten us to it, or flushed everything.  */
+    if (tcg_ctx.region_in_use != tcg_ctx.region_count ||
+        (tcg_ctx.region_current + 1) % tcg_ctx.region_count != region) {
+        goto done;
+    }
+
+    tbs = tb_region_tbs(region);
+    nb_tbs = tcg_ctx.tb_ctx.region_nb_tbs[region];
+    for (i = 0; i < nb_tbs; i++) {
+        if (!tbs[i].invalid) {
+            tb_phys_invalidate(&tbs[i], -1);
+        }
+    }
+    tcg_ctx.tb_ctx.nb_tbs -= nb_tbs;
+    tcg_ctx.tb_ctx.region_nb_tbs[region] = 0;
+
+    tcg_region_set(&tcg_ctx, region);
+    tcg_ctx.tb_ctx.tb_region_reclaim_count++;
+
+done:
+    tb_unlock();
+}
+
+/*
+ * The current region is full.  Move on to an unused one if there is
+ * one left; otherwise schedule the oldest region to be reclaimed and
+ * return false, in which case the caller must leave the execution loop.
+ *
+ * Called with tb_lock held.
+ */
+static bool tb_region_next(CPUState *cpu)
+{
+    size_t region;
+
+    if (tcg_region_alloc(&tcg_ctx)) {
+        return true;
+    }
+    if (tcg_ctx.region_count == 1) {
+        tb_flush(cpu);
+        return false;
+    }
+    region = (tcg_ctx.region_current + 1) % tcg_ctx.region_count;
+    async_safe_run_on_cpu(cpu, do_tb_region_reclaim,
+                          RUN_ON_CPU_HOST_INT(region));
+    return false;
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void
@@ -1101,7 +1223,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
-    uint32_t h;
+    uint32_t h, h2;
     tb_page_addr_t phys_pc;
 
     assert_tb_lock();
@@ -1127,10 +1249,14 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
+    h2 = tb_jmp_cache2_hash_func(tb->pc, tb->cs_base, tb->flags);
     CPU_FOREACH(cpu) {
         if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
             atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
+        if (atomic_read(&cpu->tb_jmp_cache2[h2]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache2[h2], NULL);
+        }
     }
 
     /* suppress this TB from the two jump lists */
@@ -1255,6 +1381,7 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     }
 
     /* add in the hash table */
+    tb->invalid = false;
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
     qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
 
@@ -1264,6 +1391,94 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 }
 
 /* Called with mmap_lock held for user mode emulation.  */
+/* perf map support: /tmp/perf-PID.map lets "perf report" and "perf top"
+ * attribute samples in the code buffer to guest code.  Each line gives
+ * the host code range of a TB and its guest PC, plus the guest symbol
+ * when one is known.  The code buffer is reused after a flush, and perf
+ * does not cope with overlapping entries, so profiles that span a
+ * tb_flush may be misattributed.
+ */
+static FILE *perfmap_file;
+
+void perf_enable_perfmap(void)
+{
+    char path[32];
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    perfmap_file = fopen(path, "w");
+    if (!perfmap_file) {
+        error_report("Could not open %s: %s", path, strerror(errno));
+        return;
+    }
+    /* perf may read the map while we are running; emit whole lines.  */
+    setvbuf(perfmap_file, NULL, _IOLBF, 0);
+}
+
+static void perfmap_record(TranslationBlock *tb, int gen_code_size)
+{
+    const char *symbol = lookup_symbol(tb->pc);
+
+    if (symbol[0] != '\0') {
+        fprintf(perfmap_file, "%" PRIxPTR " %x %s (guest 0x" TARGET_FMT_lx
+                ")\n", (uintptr_t)tb->tc_ptr, gen_code_size, symbol, tb->pc);
+    } else {
+        fprintf(perfmap_file, "%" PRIxPTR " %x guest 0x" TARGET_FMT_lx "\n",
+                (uintptr_t)tb->tc_ptr, gen_code_size, tb->pc);
+    }
+}
+
+#ifndef CONFIG_USER_ONLY
+/* With icount, TBs that cpu_io_recompile() had to split around an I/O
+ * instruction.  Later translations of the same block (after a flush or an
+ * invalidation) directly get the cflags of the split TB instead of faulting
+ * and being retranslated again.  A stale entry merely yields a shorter TB.
+ * Protected by tb_lock.
+ */
+#define TB_IO_HINT_BITS 10
+#define TB_IO_HINT_SIZE (1 << TB_IO_HINT_BITS)
+
+typedef struct TBIOHint {
+    tb_page_addr_t phys_pc;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    int cflags;
+} TBIOHint;
+
+static TBIOHint tb_io_hints[TB_IO_HINT_SIZE];
+
+static TBIOHint *tb_io_hint(tb_page_addr_t phys_pc, target_ulong pc,
+                            uint32_t flags)
+{
+    return &tb_io_hints[tb_hash_func(phys_pc, pc, flags) &
+                        (TB_IO_HINT_SIZE - 1)];
+}
+
+static void tb_io_hint_set(tb_page_addr_t phys_pc, target_ulong pc,
+                           target_ulong cs_base, uint32_t flags, int cflags)
+{
+    TBIOHint *h = tb_io_hint(phys_pc, pc, flags);
+
+    h->phys_pc = phys_pc;
+    h->pc = pc;
+    h->cs_base = cs_base;
+    h->flags = flags;
+    h->cflags = cflags;
+}
+
+static int tb_io_hint_get(tb_page_addr_t phys_pc, target_ulong pc,
+                          target_ulong cs_base, uint32_t flags)
+{
+    TBIOHint *h = tb_io_hint(phys_pc, pc, flags);
+
+    if (h->cflags && h->phys_pc == phys_pc && h->pc == pc &&
+        h->cs_base == cs_base && h->flags == flags) {
+        return h->cflags;
+    }
+    return 0;
+}
+#endif
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               uint32_t flags, int cflags)
@@ -1274,6 +1489,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size;
+    int64_t gen_start;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -1282,13 +1498,23 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     phys_pc = get_page_addr_code(env, pc);
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
+#ifndef CONFIG_USER_ONLY
+        if (!(cflags & CF_COUNT_MASK)) {
+            cflags |= tb_io_hint_get(phys_pc, pc, cs_base, flags);
+        }
+#endif
+    }
+    if (qemu_loglevel_mask(CPU_LOG_TB_PROFILE)) {
+        cflags |= CF_PROFILE;
     }
 
+ retry:
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        if (tb_region_next(cpu)) {
+            goto retry;
+        }
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1300,6 +1526,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->exec_count = 0;
+    gen_start = cpu_get_host_ticks();
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1340,13 +1568,18 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
        re-initialize it per above, and re-do the actual code generation.  */
     gen_code_size = tcg_gen_code(&tcg_ctx, tb);
     if (unlikely(gen_code_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
     search_size = encode_search(tb, (void *)gen_code_buf + gen_code_size);
     if (unlikely(search_size < 0)) {
+        tb_free(tb);
         goto buffer_overflow;
     }
 
+    tb->tc_size = gen_code_size;
+    tb->gen_ticks = cpu_get_host_ticks() - gen_start;
+
 #ifdef CONFIG_PROFILER
     tcg_ctx.code_time += profile_getclock();
     tcg_ctx.code_in_len += tb->size;
@@ -1366,6 +1599,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+    if (unlikely(perfmap_file)) {
+        perfmap_record(tb, gen_code_size);
+    }
+
     tcg_ctx.code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
@@ -1670,21 +1907,28 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
     uintptr_t v;
-    TranslationBlock *tb;
+    size_t region;
+    TranslationBlock *tbs, *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    /* TBs within a region are allocated in code address order */
+    region = tcg_region_index(&tcg_ctx, (void *)tc_ptr);
+    if (region >= tcg_ctx.region_count) {
+        return NULL;
+    }
+    tbs = tb_region_tbs(region);
+    m_max = tcg_ctx.tb_ctx.region_nb_tbs[region] - 1;
+    if (m_max < 0 || tc_ptr < (uintptr_t)tbs[0].tc_ptr) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
+    if (region == tcg_ctx.region_current &&
         tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1694,7 +1938,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1748,13 +1992,12 @@ void tb_check_watchpoint(CPUState *cpu)
    must be at the end of the TB */
 void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 {
-#if defined(TARGET_MIPS) || defined(TARGET_SH4)
     CPUArchState *env = cpu->env_ptr;
-#endif
     TranslationBlock *tb;
     uint32_t n, cflags;
     target_ulong pc, cs_base;
     uint32_t flags;
+    bool restart_at_io = true;
 
     tb_lock();
     tb = tb_find_pc(retaddr);
@@ -1778,6 +2021,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
         env->active_tc.PC -= (env->hflags & MIPS_HFLAG_B16 ? 2 : 4);
         cpu->icount_decr.u16.low++;
         env->hflags &= ~MIPS_HFLAG_BMASK;
+        restart_at_io = false;
     }
 #elif defined(TARGET_SH4)
     if ((env->flags & ((DELAY_SLOT | DELAY_SLOT_CONDITIONAL))) != 0
@@ -1785,6 +2029,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
         env->pc -= 2;
         cpu->icount_decr.u16.low++;
         env->flags &= ~(DELAY_SLOT | DELAY_SLOT_CONDITIONAL);
+        restart_at_io = false;
     }
 #endif
     /* This should never happen.  */
@@ -1796,6 +2041,8 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     pc = tb->pc;
     cs_base = tb->cs_base;
     flags = tb->flags;
+    tb_io_hint_set(tb->page_addr[0] + (pc & ~TARGET_PAGE_MASK), pc, cs_base,
+                   flags, cflags);
     tb_phys_invalidate(tb, -1);
     if (tb->cflags & CF_NOCACHE) {
         if (tb->orig_tb) {
@@ -1809,13 +2056,19 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(cpu, pc, cs_base, flags, cflags);
 
-    /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
-     * the first in the TB) then we end up generating a whole new TB and
-     *  repeating the fault, which is horribly inefficient.
-     *  Better would be to execute just this insn uncached, or generate a
-     *  second new TB.
-     *
-     * cpu_loop_exit_noexc will longjmp back to cpu_exec where the
+    /* If the I/O insn was not the first in the TB, execution now resumes
+     * at the I/O insn itself.  Give it a TB of its own right away, rather
+     * than translating a full block there only to fault and split it again.
+     */
+    if (n > 1 && restart_at_io) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+        cflags = 1 | CF_LAST_IO;
+        tb_io_hint_set(get_page_addr_code(env, pc), pc, cs_base, flags,
+                       cflags);
+        tb_gen_code(cpu, pc, cs_base, flags, cflags);
+    }
+
+    /* cpu_loop_exit_noexc will longjmp back to cpu_exec where the
      * tb_lock gets reset.
      */
     cpu_loop_exit_noexc(cpu);
@@ -1878,6 +2131,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t r, code_size;
     TranslationBlock *tb;
     struct qht_stats hst;
 
@@ -1888,40 +2142,41 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+    for (r = 0; r < tcg_ctx.region_count; r++) {
+        for (i = 0; i < tcg_ctx.tb_ctx.region_nb_tbs[r]; i++) {
+            tb = &tb_region_tbs(r)[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
+    code_size = tb_code_size();
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %zd/%zd in use, %zd bytes each\n",
+                tcg_ctx.region_in_use, tcg_ctx.region_count,
+                tcg_ctx.region_size);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1940,14 +2195,95 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %u\n",
             atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
+    cpu_fprintf(f, "TB region reclaims  %u\n",
+            tcg_ctx.tb_ctx.tb_region_reclaim_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tlb_dump_stats(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 
     tb_unlock();
 }
 
+static gint tb_exec_count_cmp(gconstpointer ap, gconstpointer bp)
+{
+    const TranslationBlock *a = *(TranslationBlock * const *)ap;
+    const TranslationBlock *b = *(TranslationBlock * const *)bp;
+
+    return a->exec_count < b->exec_count ? 1 :
+           a->exec_count > b->exec_count ? -1 : 0;
+}
+
+static gint tb_gen_ticks_cmp(gconstpointer ap, gconstpointer bp)
+{
+    const TranslationBlock *a = *(TranslationBlock * const *)ap;
+    const TranslationBlock *b = *(TranslationBlock * const *)bp;
+
+    return a->gen_ticks < b->gen_ticks ? 1 :
+           a->gen_ticks > b->gen_ticks ? -1 : 0;
+}
+
+static void dump_tb_profile_list(FILE *f, fprintf_function cpu_fprintf,
+                                 GPtrArray *tbs, int max)
+{
+    int i;
+
+    cpu_fprintf(f, "%-18s %6s %6s %8s %20s %14s\n",
+                "guest pc", "insns", "bytes", "host", "execs", "gen ticks");
+    for (i = 0; i < tbs->len && i < max; i++) {
+        TranslationBlock *tb = g_ptr_array_index(tbs, i);
+
+        cpu_fprintf(f, "0x" TARGET_FMT_lx " %*s%6u %6u %8u %20" PRIu64
+                    " %14" PRId64 "\n",
+                    tb->pc, (int)(16 - 2 * sizeof(target_ulong)), "",
+                    tb->icount, tb->size, tb->tc_size,
+                    tb->exec_count, tb->gen_ticks);
+    }
+}
+
+void dump_tb_profile_info(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    GPtrArray *tbs;
+    uint64_t total = 0;
+    size_t r;
+    int i;
+
+    if (!qemu_loglevel_mask(CPU_LOG_TB_PROFILE)) {
+        cpu_fprintf(f, "TB profiling is disabled; "
+                    "enable it with \"log tbprofile\"\n");
+    }
+
+    tb_lock();
+
+    tbs = g_ptr_array_new();
+    for (r = 0; r < tcg_ctx.region_count; r++) {
+        for (i = 0; i < tcg_ctx.tb_ctx.region_nb_tbs[r]; i++) {
+            TranslationBlock *tb = &tb_region_tbs(r)[i];
+
+            if ((tb->cflags & CF_PROFILE) && !tb->invalid) {
+                g_ptr_array_add(tbs, tb);
+                total += tb->exec_count;
+            }
+        }
+    }
+
+    cpu_fprintf(f, "%u profiled TBs, %" PRIu64 " executions\n",
+                tbs->len, total);
+
+    cpu_fprintf(f, "\nTop TBs by execution count:\n");
+    g_ptr_array_sort(tbs, tb_exec_count_cmp);
+    dump_tb_profile_list(f, cpu_fprintf, tbs, max);
+
+    cpu_fprintf(f, "\nTop TBs by translation cost:\n");
+    g_ptr_array_sort(tbs, tb_gen_ticks_cmp);
+    dump_tb_profile_list(f, cpu_fprintf, tbs, max);
+
+    g_ptr_array_free(tbs, true);
+
+    tb_unlock();
+}
+
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
 {
     tcg_dump_op_count(f, cpu_fprintf);
@@ -2125,7 +2461,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
+    PageDesc *p = NULL;
     target_ulong end;
     target_ulong addr;
 
@@ -2151,9 +2487,15 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
+        /* Syscalls check whole I/O buffers here; only walk the radix
+           tree when crossing into a new leaf of PageDescs.  */
+        if (p == NULL || ((addr >> TARGET_PAGE_BITS) & (V_L2_SIZE - 1)) == 0) {
+            p = page_find(addr >> TARGET_PAGE_BITS);
+            if (!p) {
+                return -1;
+            }
+        } else {
+            p++;
         }
         if (!(p->flags & PAGE_VALID)) {
             return -1;
@@ -133,6 +133,9 @@ struct QemuConsole {
     QEMUTimer *ui_timer;
     const GraphicHwOps *hw_ops;
     void *hw;
+    bool hw_dirty;          /* display updated since the last gfx_update */
+    int hw_idle;            /* gfx_update calls in a row that found nothing */
+    int hw_skip;            /* refreshes left to skip */
 
     /* Text console state */
     int width;
@@ -254,13 +257,40 @@ static void gui_setup_refresh(DisplayState *ds)
     ds->have_text = have_text;
 }
 
+/*
+ * When a device keeps finding nothing to draw, poll it less often from the
+ * refresh timer, at most every GUI_REFRESH_IDLE_SKIP + 1 refreshes.  Other
+ * callers, e.g. screendump, always get a full update.
+ */
+#define GUI_REFRESH_IDLE_SKIP 3
+
 void graphic_hw_update(QemuConsole *con)
 {
+    bool refreshing;
+
     if (!con) {
         con = active_console;
     }
-    if (con && con->hw_ops->gfx_update) {
-        con->hw_ops->gfx_update(con->hw);
+    if (!con || !con->hw_ops->gfx_update) {
+        return;
+    }
+
+    refreshing = con->ds && con->ds->refreshing;
+    if (refreshing && con->hw_skip) {
+        con->hw_skip--;
+        return;
+    }
+
+    con->hw_ops->gfx_update(con->hw);
+
+    if (con->hw_dirty) {
+        con->hw_idle = 0;
+    } else if (con->hw_idle < GUI_REFRESH_IDLE_SKIP) {
+        con->hw_idle++;
+    }
+    con->hw_dirty = false;
+    if (refreshing) {
+        con->hw_skip = con->hw_idle;
     }
 }
 
@@ -1518,6 +1548,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
     w = MIN(w, width - x);
     h = MIN(h, height - y);
 
+    con->hw_dirty = true;
     if (!qemu_console_is_visible(con)) {
         return;
     }
@@ -1538,6 +1569,7 @@ void dpy_gfx_replace_surface(QemuConsole *con,
     DisplaySurface *old_surface = con->surface;
     DisplayChangeListener *dcl;
 
+    con->hw_dirty = true;
     con->surface = surface;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
@@ -1592,6 +1624,7 @@ void dpy_gfx_copy(QemuConsole *con, int src_x, int src_y,
     DisplayState *s = con->ds;
     DisplayChangeListener *dcl;
 
+    con->hw_dirty = true;
     if (!qemu_console_is_visible(con)) {
         return;
     }
@@ -1630,6 +1663,7 @@ void dpy_text_update(QemuConsole *con, int x, int y, int w, int h)
     DisplayState *s = con->ds;
     DisplayChangeListener *dcl;
 
+    con->hw_dirty = true;
     if (!qemu_console_is_visible(con)) {
         return;
     }
@@ -0,0 +1,335 @@
+/*
+ * QEMU VNC display driver: Open H.264 encoding
+ *
+ * Full-motion areas of the screen, as found by the adaptive update
+ * statistics, are sent as a single H.264 video stream instead of one
+ * JPEG per rectangle.  Encoding is done by GStreamer, so any H.264
+ * encoder element can be used: VA-API and NVENC are preferred, and
+ * x264 is the software fallback.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "vnc.h"
+#include "trace.h"
+
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+/* Open H.264 rectangle flags */
+#define VNC_H264_RESET_CONTEXT          (1 << 0)
+#define VNC_H264_RESET_ALL_CONTEXTS     (1 << 1)
+
+/* Update frequency (in Hz) above which an area is considered full-motion */
+#define VNC_H264_MIN_FREQ   10.
+/* Smallest full-motion area that is worth a video stream */
+#define VNC_H264_MIN_SIZE   (2 * VNC_STAT_RECT)
+
+/* Nominal frame rate, only used to timestamp the frames */
+#define VNC_H264_FPS        30
+#define VNC_H264_TIMEOUT    GST_SECOND
+
+/* Tried in order when no encoder is given on the command line */
+static const char *const vnc_h264_encoders[] = {
+    "vah264enc",        /* VA-API */
+    "vaapih264enc",     /* VA-API, gstreamer-vaapi */
+    "nvh264enc",        /* NVENC */
+    "x264enc",
+};
+
+static void vnc_h264_set_arg(GstElement *elem, const char *prop,
+                             const char *value)
+{
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(elem), prop)) {
+        gst_util_set_object_arg(G_OBJECT(elem), prop, value);
+    }
+}
+
+static void vnc_h264_close(VncH264 *h264)
+{
+    if (h264->pipeline) {
+        gst_element_set_state(h264->pipeline, GST_STATE_NULL);
+        gst_object_unref(h264->source);
+        gst_object_unref(h264->sink);
+        gst_object_unref(h264->pipeline);
+    }
+    memset(h264, 0, sizeof(*h264));
+}
+
+static int vnc_h264_open(VncH264 *h264, const char *encoder,
+                         int x, int y, int w, int h)
+{
+    GError *err = NULL;
+    GstElement *enc;
+    GstCaps *caps;
+    char *desc;
+
+    desc = g_strdup_printf("appsrc name=src ! videoconvert ! "
+                           "%s name=enc ! h264parse ! "
+                           "video/x-h264,stream-format=byte-stream,"
+                           "alignment=au ! appsink name=sink", encoder);
+    h264->pipeline = gst_parse_launch(desc, &err);
+    g_free(desc);
+    if (!h264->pipeline) {
+        trace_vnc_h264_open_failed(encoder, err->message);
+        g_error_free(err);
+        return -1;
+    }
+    if (err) {
+        /* missing elements in an otherwise valid description */
+        trace_vnc_h264_open_failed(encoder, err->message);
+        g_error_free(err);
+        gst_object_unref(h264->pipeline);
+        h264->pipeline = NULL;
+        return -1;
+    }
+
+    h264->source = gst_bin_get_by_name(GST_BIN(h264->pipeline), "src");
+    h264->sink = gst_bin_get_by_name(GST_BIN(h264->pipeline), "sink");
+    h264->x = x;
+    h264->y = y;
+    h264->width = w;
+    h264->height = h;
+    h264->frames = 0;
+
+    /* Every frame must come out as soon as it goes in */
+    enc = gst_bin_get_by_name(GST_BIN(h264->pipeline), "enc");
+    vnc_h264_set_arg(enc, "tune", "zerolatency");
+    vnc_h264_set_arg(enc, "speed-preset", "ultrafast");
+    vnc_h264_set_arg(enc, "zerolatency", "true");
+    vnc_h264_set_arg(enc, "bframes", "0");
+    vnc_h264_set_arg(enc, "b-frames", "0");
+    vnc_h264_set_arg(enc, "max-bframes", "0");
+    gst_object_unref(enc);
+
+    caps = gst_caps_new_simple("video/x-raw",
+                               "format", G_TYPE_STRING, "BGRx",
+                               "width", G_TYPE_INT, w,
+                               "height", G_TYPE_INT, h,
+                               "framerate", GST_TYPE_FRACTION, VNC_H264_FPS, 1,
+                               NULL);
+    g_object_set(h264->source, "caps", caps, "format", GST_FORMAT_TIME,
+                 "is-live", TRUE, NULL);
+    gst_caps_unref(caps);
+    g_object_set(h264->sink, "sync", FALSE, NULL);
+
+    if (gst_element_set_state(h264->pipeline, GST_STATE_PLAYING) ==
+        GST_STATE_CHANGE_FAILURE) {
+        trace_vnc_h264_open_failed(encoder, "cannot start pipeline");
+        vnc_h264_close(h264);
+        return -1;
+    }
+
+    trace_vnc_h264_open(encoder, x, y, w, h);
+    return 0;
+}
+
+/* Encode one frame; @src points to the top-left pixel in the server format */
+static GstSample *vnc_h264_encode(VncH264 *h264, const uint8_t *src,
+                                  int stride)
+{
+    size_t line = h264->width * VNC_SERVER_FB_BYTES;
+    GstBuffer *buf;
+    GstMapInfo map;
+    int i;
+
+    buf = gst_buffer_new_allocate(NULL, line * h264->height, NULL);
+    if (!buf || !gst_buffer_map(buf, &map, GST_MAP_WRITE)) {
+        if (buf) {
+            gst_buffer_unref(buf);
+        }
+        return NULL;
+    }
+    for (i = 0; i < h264->height; i++) {
+        memcpy(map.data + i * line, src + i * stride, line);
+    }
+    gst_buffer_unmap(buf, &map);
+
+    GST_BUFFER_PTS(buf) = gst_util_uint64_scale(h264->frames, GST_SECOND,
+                                                VNC_H264_FPS);
+    GST_BUFFER_DURATION(buf) = GST_SECOND / VNC_H264_FPS;
+    h264->frames++;
+
+    /* appsrc takes ownership of the buffer */
+    if (gst_app_src_push_buffer(GST_APP_SRC(h264->source), buf) !=
+        GST_FLOW_OK) {
+        return NULL;
+    }
+    return gst_app_sink_try_pull_sample(GST_APP_SINK(h264->sink),
+                                        VNC_H264_TIMEOUT);
+}
+
+/*
+ * Pick the encoder element for a display: @name if given, otherwise the
+ * first one from vnc_h264_encoders[] that can actually encode a frame (a
+ * hardware encoder may be installed without the hardware being present).
+ */
+char *vnc_h264_probe_encoder(const char *name, Error **errp)
+{
+    GError *err = NULL;
+    uint8_t *frame;
+    char *found = NULL;
+    int i;
+
+    if (!gst_init_check(NULL, NULL, &err)) {
+        error_setg(errp, "Cannot initialize GStreamer: %s", err->message);
+        g_error_free(err);
+        return NULL;
+    }
+
+    frame = g_malloc0(VNC_H264_MIN_SIZE * VNC_H264_MIN_SIZE *
+                      VNC_SERVER_FB_BYTES);
+    for (i = 0; i < ARRAY_SIZE(vnc_h264_encoders) && !found; i++) {
+        const char *encoder = name ? name : vnc_h264_encoders[i];
+        VncH264 h264 = { 0 };
+        GstSample *sample;
+
+        if (vnc_h264_open(&h264, encoder, 0, 0, VNC_H264_MIN_SIZE,
+                          VNC_H264_MIN_SIZE) == 0) {
+            sample = vnc_h264_encode(&h264, frame,
+                                     VNC_H264_MIN_SIZE * VNC_SERVER_FB_BYTES);
+            if (sample) {
+                found = g_strdup(encoder);
+                gst_sample_unref(sample);
+            }
+            vnc_h264_close(&h264);
+        }
+        if (name) {
+            break;
+        }
+    }
+    g_free(frame);
+
+    if (!found) {
+        if (name) {
+            error_setg(errp, "H.264 encoder '%s' is not usable", name);
+        } else {
+            error_setg(errp, "No usable GStreamer H.264 encoder found");
+        }
+    }
+    return found;
+}
+
+/*
+ * Called from vnc_update_client(): find the bounding box of the areas
+ * updated at video rates.  The region is kept while the motion stays
+ * inside it, so that the stream (and the client's decoder) does not have
+ * to restart every time the statistics move a little.
+ */
+void vnc_h264_update_region(VncState *vs, int width, int height)
+{
+    VncRect *region = &vs->h264_region;
+    int x1 = width, y1 = height, x2 = 0, y2 = 0;
+    int hot = 0, cells;
+    int x, y;
+
+    for (y = 0; y < height; y += VNC_STAT_RECT) {
+        for (x = 0; x < width; x += VNC_STAT_RECT) {
+            if (vnc_update_freq(vs, x, y, 0, 0) < VNC_H264_MIN_FREQ) {
+                continue;
+            }
+            x1 = MIN(x1, x);
+            y1 = MIN(y1, y);
+            x2 = MAX(x2, MIN(x + VNC_STAT_RECT, width));
+            y2 = MAX(y2, MIN(y + VNC_STAT_RECT, height));
+            hot++;
+        }
+    }
+    if (!hot) {
+        region->w = region->h = 0;
+        return;
+    }
+
+    /* The stream must cover whole dirty bits and have even dimensions */
+    x2 = x1 + QEMU_ALIGN_DOWN(x2 - x1, VNC_DIRTY_PIXELS_PER_BIT);
+    y2 = y1 + QEMU_ALIGN_DOWN(y2 - y1, 2);
+
+    /* Ignore small or scattered animations, tight handles them better */
+    cells = DIV_ROUND_UP(x2 - x1, VNC_STAT_RECT) *
+            DIV_ROUND_UP(y2 - y1, VNC_STAT_RECT);
+    if (x2 - x1 < VNC_H264_MIN_SIZE || y2 - y1 < VNC_H264_MIN_SIZE ||
+        hot * 2 < cells) {
+        region->w = region->h = 0;
+        return;
+    }
+
+    if (region->w &&
+        x1 >= region->x && x2 <= region->x + region->w &&
+        y1 >= region->y && y2 <= region->y + region->h &&
+        region->x + region->w <= width && region->y + region->h <= height) {
+        return;
+    }
+
+    region->x = x1;
+    region->y = y1;
+    region->w = x2 - x1;
+    region->h = y2 - y1;
+}
+
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    VncH264 *h264 = &vs->h264;
+    uint32_t flags = 0;
+    GstSample *sample;
+    GstBuffer *buf;
+    GstMapInfo map;
+
+    /* A different rectangle is a different decoder context on the client */
+    if (h264->pipeline &&
+        (h264->x != x || h264->y != y ||
+         h264->width != w || h264->height != h)) {
+        vnc_h264_close(h264);
+    }
+    if (!h264->pipeline) {
+        if (vnc_h264_open(h264, vs->vd->h264_encoder, x, y, w, h) < 0) {
+            return -1;
+        }
+        flags = VNC_H264_RESET_ALL_CONTEXTS;
+    }
+
+    sample = vnc_h264_encode(h264, vnc_server_fb_ptr(vs->vd, x, y),
+                             vnc_server_fb_stride(vs->vd));
+    buf = sample ? gst_sample_get_buffer(sample) : NULL;
+    if (!buf || !gst_buffer_map(buf, &map, GST_MAP_READ)) {
+        if (sample) {
+            gst_sample_unref(sample);
+        }
+        vnc_h264_close(h264);
+        return -1;
+    }
+
+    vnc_framebuffer_update(vs, x, y, w, h, VNC_ENCODING_H264);
+    vnc_write_u32(vs, map.size);
+    vnc_write_u32(vs, flags);
+    vnc_write(vs, map.data, map.size);
+
+    gst_buffer_unmap(buf, &map);
+    gst_sample_unref(sample);
+
+    /* Resend losslessly once the motion stops */
+    vnc_sent_lossy_rect(vs, x, y, w, h);
+    return 1;
+}
+
+void vnc_h264_clear(VncState *vs)
+{
+    vnc_h264_close(&vs->h264);
+}
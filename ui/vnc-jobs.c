@@ -44,30 +44,39 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds a shared reference on the
+ * VncDisplay global lock to avoid screen corruption (this does not block
+ * vnc_refresh() because it uses trylock()) but the output lock is not held
+ * because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Up to VNC_WORKER_THREADS workers encode jobs of different clients in
+ * parallel.  A job only starts once no earlier job of the same client is
+ * queued or running, so that each client gets its updates in order and
+ * its persistent encoder state (zlib streams) is never shared.
  */
 
+#define VNC_WORKER_THREADS 4
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
     bool exit;
+    int nr_threads;
+    int nr_idle;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all worker threads
  */
 static VncJobQueue *queue;
 
+static void vnc_start_worker_thread_locked(VncJobQueue *queue);
+
 static void vnc_lock_queue(VncJobQueue *queue)
 {
     qemu_mutex_lock(&queue->mutex);
@@ -89,7 +98,8 @@ VncJob *vnc_job_new(VncState *vs)
     return job;
 }
 
-int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
+static int vnc_job_add_entry(VncJob *job, int x, int y, int w, int h,
+                             bool video)
 {
     VncRectEntry *entry = g_new0(VncRectEntry, 1);
 
@@ -97,6 +107,7 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     entry->rect.y = y;
     entry->rect.w = w;
     entry->rect.h = h;
+    entry->video = video;
 
     vnc_lock_queue(queue);
     QLIST_INSERT_HEAD(&job->rectangles, entry, next);
@@ -104,6 +115,17 @@ int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
     return 1;
 }
 
+int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h)
+{
+    return vnc_job_add_entry(job, x, y, w, h, false);
+}
+
+/* The rectangle is part of a video stream rather than a regular update */
+int vnc_job_add_video_rect(VncJob *job, int x, int y, int w, int h)
+{
+    return vnc_job_add_entry(job, x, y, w, h, true);
+}
+
 void vnc_job_push(VncJob *job)
 {
     vnc_lock_queue(queue);
@@ -111,11 +133,35 @@ void vnc_job_push(VncJob *job)
         g_free(job);
     } else {
         QTAILQ_INSERT_TAIL(&queue->jobs, job, next);
+        if (!queue->nr_idle && queue->nr_threads < VNC_WORKER_THREADS) {
+            vnc_start_worker_thread_locked(queue);
+        }
         qemu_cond_broadcast(&queue->cond);
     }
     vnc_unlock_queue(queue);
 }
 
+/* Called with the queue lock held */
+static VncJob *vnc_queue_next_job(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        QTAILQ_FOREACH(prev, &queue->jobs, next) {
+            if (prev == job || prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 static bool vnc_has_job_locked(VncState *vs)
 {
     VncJob *job;
@@ -181,6 +227,9 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
+#ifdef CONFIG_VNC_H264
+    local->h264 = orig->h264;
+#endif
 }
 
 static void vnc_async_encoding_end(VncState *orig, VncState *local)
@@ -189,6 +238,9 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
+#ifdef CONFIG_VNC_H264
+    orig->h264 = local->h264;
+#endif
     orig->lossy_rect = local->lossy_rect;
 }
 
@@ -201,11 +253,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    queue->nr_idle++;
+    while (!(job = vnc_queue_next_job(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
+    queue->nr_idle--;
     /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
+    if (job) {
+        job->running = true;
+    }
     vnc_unlock_queue(queue);
 
     if (queue->exit) {
@@ -237,26 +293,36 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
             vnc_async_encoding_end(job->vs, &vs);
             goto disconnected;
         }
 
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
+        n = -1;
+#ifdef CONFIG_VNC_H264
+        if (entry->video) {
+            n = vnc_h264_send_framebuffer_update(&vs, entry->rect.x,
+                                                 entry->rect.y,
+                                                 entry->rect.w, entry->rect.h);
+        }
+#endif
+        if (n < 0) {
+            n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
+                                            entry->rect.w, entry->rect.h);
+        }
 
         if (n >= 0) {
             n_rectangles += n;
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -306,14 +372,28 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
-
-    qemu_thread_get_self(&queue->thread);
+    bool last;
 
     while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+
+    vnc_lock_queue(queue);
+    last = !--queue->nr_threads;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static void vnc_start_worker_thread_locked(VncJobQueue *queue)
+{
+    QemuThread thread;
+
+    queue->nr_threads++;
+    qemu_thread_create(&thread, "vnc_worker", vnc_worker_thread, queue,
+                       QEMU_THREAD_DETACHED);
+}
+
 static bool vnc_worker_thread_running(void)
 {
     return queue; /* Check global queue */
@@ -327,7 +407,8 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
     queue = q; /* Set global queue */
+    vnc_lock_queue(q);
+    vnc_start_worker_thread_locked(q);
+    vnc_unlock_queue(q);
 }
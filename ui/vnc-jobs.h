@@ -33,6 +33,7 @@
 /* Jobs */
 VncJob *vnc_job_new(VncState *vs);
 int vnc_job_add_rect(VncJob *job, int x, int y, int w, int h);
+int vnc_job_add_video_rect(VncJob *job, int x, int y, int w, int h);
 void vnc_job_push(VncJob *job);
 void vnc_jobs_join(VncState *vs);
 
@@ -42,16 +43,34 @@ void vnc_start_worker_thread(void);
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    int ret = qemu_mutex_trylock(&vd->mutex);
+
+    if (!ret && vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        ret = -EBUSY;
+    }
+    return ret;
+}
+
+static inline void vnc_unlock_display(VncDisplay *vd)
+{
+    qemu_mutex_unlock(&vd->mutex);
 }
 
-static inline void vnc_lock_display(VncDisplay *vd)
+/* Encoders only read the server surface, so several of them can work on
+ * the same display at once; vnc_trylock_display() fails meanwhile.
+ */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
 {
     qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
 }
 
-static inline void vnc_unlock_display(VncDisplay *vd)
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
 {
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
     qemu_mutex_unlock(&vd->mutex);
 }
 
@@ -45,6 +45,7 @@
 #include "crypto/tlscredsx509.h"
 #include "qom/object_interfaces.h"
 #include "qemu/cutils.h"
+#include "qemu/bswap.h"
 #include "io/dns-resolver.h"
 
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
@@ -1055,6 +1056,36 @@ static int find_and_clear_dirty_height(VncState *vs,
     return h;
 }
 
+#ifdef CONFIG_VNC_H264
+/* Send the full-motion area, if there is one, as a single video frame */
+static int vnc_update_client_video(VncState *vs, VncJob *job,
+                                   int width, int height)
+{
+    VncRect *region = &vs->h264_region;
+    bool dirty = false;
+    int x, x2, y;
+
+    vnc_h264_update_region(vs, width, height);
+    if (!region->w) {
+        return 0;
+    }
+
+    x = region->x / VNC_DIRTY_PIXELS_PER_BIT;
+    x2 = (region->x + region->w) / VNC_DIRTY_PIXELS_PER_BIT;
+    for (y = region->y; y < region->y + region->h; y++) {
+        if (find_next_bit(vs->dirty[y], x2, x) < x2) {
+            dirty = true;
+            bitmap_clear(vs->dirty[y], x, x2 - x);
+        }
+    }
+    if (!dirty) {
+        return 0;
+    }
+    return vnc_job_add_video_rect(job, region->x, region->y,
+                                  region->w, region->h);
+}
+#endif
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     if (vs->disconnecting) {
@@ -1088,6 +1119,12 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         height = pixman_image_get_height(vd->server);
         width = pixman_image_get_width(vd->server);
 
+#ifdef CONFIG_VNC_H264
+        if (vnc_has_feature(vs, VNC_FEATURE_H264)) {
+            n += vnc_update_client_video(vs, job, width, height);
+        }
+#endif
+
         y = 0;
         for (;;) {
             int x, h;
@@ -1237,6 +1274,9 @@ void vnc_disconnect_finish(VncState *vs)
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
     vnc_zrle_clear(vs);
+#ifdef CONFIG_VNC_H264
+    vnc_h264_clear(vs);
+#endif
 
 #ifdef CONFIG_VNC_SASL
     vnc_sasl_client_cleanup(vs);
@@ -2054,6 +2094,14 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_ZYWRLE_MASK;
             vs->vnc_encoding = enc;
             break;
+#ifdef CONFIG_VNC_H264
+        case VNC_ENCODING_H264:
+            /* only used for full-motion areas, not as the main encoding */
+            if (vs->vd->h264_encoder) {
+                vs->features |= VNC_FEATURE_H264_MASK;
+            }
+            break;
+#endif
         case VNC_ENCODING_DESKTOPRESIZE:
             vs->features |= VNC_FEATURE_RESIZE_MASK;
             break;
@@ -2838,6 +2886,23 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Compare a full dirty chunk of the guest and server surfaces.  Unlike
+ * memcmp() this does not stop at the first difference, which lets the
+ * compiler turn the loop into wide vector loads and compares; most chunks
+ * handed to us are unchanged anyway, so early exit rarely pays off.
+ */
+static bool vnc_chunk_equal(const uint8_t *a, const uint8_t *b)
+{
+    uint64_t diff = 0;
+    int i;
+
+    for (i = 0; i < VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES; i += 8) {
+        diff |= ldq_he_p(a + i) ^ ldq_he_p(b + i);
+    }
+    return !diff;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2912,7 +2977,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (_cmp_bytes == VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES
+                ? vnc_chunk_equal(server_ptr, guest_ptr)
+                : memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
                 continue;
             }
             memcpy(server_ptr, guest_ptr, _cmp_bytes);
@@ -3202,6 +3269,10 @@ static void vnc_display_close(VncDisplay *vd)
     }
     g_free(vd->tlsaclname);
     vd->tlsaclname = NULL;
+#ifdef CONFIG_VNC_H264
+    g_free(vd->h264_encoder);
+    vd->h264_encoder = NULL;
+#endif
     if (vd->lock_key_sync) {
         qemu_remove_led_event_handler(vd->led);
     }
@@ -3333,6 +3404,12 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "non-adaptive",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "h264",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "h264-encoder",
+            .type = QEMU_OPT_STRING,
         },
         { /* end of list */ }
     },
@@ -3999,6 +4076,25 @@ void vnc_display_open(const char *id, Error **errp)
         vd->non_adaptive = true;
     }
 
+    if (qemu_opt_get_bool(opts, "h264", false)) {
+#ifdef CONFIG_VNC_H264
+        /* full-motion areas are found by the adaptive update statistics */
+        if (vd->non_adaptive) {
+            error_setg(errp, "VNC H.264 streams require lossy and "
+                       "adaptive updates");
+            goto fail;
+        }
+        vd->h264_encoder = vnc_h264_probe_encoder(
+            qemu_opt_get(opts, "h264-encoder"), errp);
+        if (!vd->h264_encoder) {
+            goto fail;
+        }
+#else
+        error_setg(errp, "VNC H.264 streams require GStreamer support");
+        goto fail;
+#endif
+    }
+
     if (acl) {
         if (strcmp(vd->id, "default") == 0) {
             vd->tlsaclname = g_strdup("vnc.x509dname");
@@ -38,6 +38,9 @@
 #include "io/channel-socket.h"
 #include "io/channel-tls.h"
 #include <zlib.h>
+#ifdef CONFIG_VNC_H264
+#include <gst/gst.h>
+#endif
 
 #include "keymaps.h"
 #include "vnc-palette.h"
@@ -160,6 +163,7 @@ struct VncDisplay
     int ledstate;
     int key_delay_ms;
     QemuMutex mutex;
+    int encoders;              /* workers reading the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -179,6 +183,9 @@ struct VncDisplay
     int ws_subauth; /* Used by websockets */
     bool lossy;
     bool non_adaptive;
+#ifdef CONFIG_VNC_H264
+    char *h264_encoder;        /* GStreamer element, NULL if disabled */
+#endif
     QCryptoTLSCreds *tlscreds;
     char *tlsaclname;
 #ifdef CONFIG_VNC_SASL
@@ -230,6 +237,19 @@ typedef struct VncZywrle {
     int buf[VNC_ZRLE_TILE_WIDTH * VNC_ZRLE_TILE_HEIGHT];
 } VncZywrle;
 
+#ifdef CONFIG_VNC_H264
+typedef struct VncH264 {
+    GstElement *pipeline;
+    GstElement *source;
+    GstElement *sink;
+    int x;
+    int y;
+    int width;
+    int height;
+    uint64_t frames;
+} VncH264;
+#endif
+
 struct VncRect
 {
     int x;
@@ -241,12 +261,14 @@ struct VncRect
 struct VncRectEntry
 {
     struct VncRect rect;
+    bool video;
     QLIST_ENTRY(VncRectEntry) next;
 };
 
 struct VncJob
 {
     VncState *vs;
+    bool running;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -322,6 +344,10 @@ struct VncState
     VncHextile hextile;
     VncZrle zrle;
     VncZywrle zywrle;
+#ifdef CONFIG_VNC_H264
+    VncH264 h264;
+    VncRect h264_region;       /* full-motion area, w == 0 if none */
+#endif
 
     Notifier mouse_mode_notifier;
 
@@ -378,6 +404,7 @@ enum {
 #define VNC_ENCODING_TRLE                 0x0000000f
 #define VNC_ENCODING_ZRLE                 0x00000010
 #define VNC_ENCODING_ZYWRLE               0x00000011
+#define VNC_ENCODING_H264                 0x00000032 /* Open H.264 */
 #define VNC_ENCODING_COMPRESSLEVEL0       0xFFFFFF00 /* -256 */
 #define VNC_ENCODING_QUALITYLEVEL0        0xFFFFFFE0 /* -32  */
 #define VNC_ENCODING_XCURSOR              0xFFFFFF10 /* -240 */
@@ -429,6 +456,7 @@ enum {
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
 #define VNC_FEATURE_LED_STATE               11
+#define VNC_FEATURE_H264                    12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -442,6 +470,7 @@ enum {
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
 #define VNC_FEATURE_LED_STATE_MASK           (1 << VNC_FEATURE_LED_STATE)
+#define VNC_FEATURE_H264_MASK                (1 << VNC_FEATURE_H264)
 
 
 /* Client -> Server message IDs */
@@ -577,4 +606,11 @@ int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 void vnc_zrle_clear(VncState *vs);
 
+#ifdef CONFIG_VNC_H264
+char *vnc_h264_probe_encoder(const char *name, Error **errp);
+void vnc_h264_update_region(VncState *vs, int width, int height);
+int vnc_h264_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
+void vnc_h264_clear(VncState *vs);
+#endif
+
 #endif /* QEMU_VNC_H */
@@ -35,9 +35,23 @@ struct AioHandler
     int deleted;
     void *opaque;
     bool is_external;
+    bool poll_progress;     /* io_poll() succeeded in this polling window */
+    unsigned poll_idle;     /* consecutive polling windows without progress */
+#ifdef CONFIG_LINUX_IO_URING
+    bool uring_armed;       /* a POLL_ADD for pfd.fd is in flight */
+    bool uring_removing;    /* a POLL_REMOVE for it has been queued */
+    gushort uring_events;   /* events of the POLL_ADD in flight */
+#endif
     QLIST_ENTRY(AioHandler) node;
 };
 
+/* Handlers that did not become ready in this many consecutive busy polling
+ * windows are only checked once at the end of each window, not in the busy
+ * loop itself, so that an idle handler sharing the AioContext with a busy
+ * one does not slow down the loop.
+ */
+#define AIO_POLL_IDLE_WINDOWS 16
+
 #ifdef CONFIG_EPOLL_CREATE1
 
 /* The fd number threashold to switch to epoll */
@@ -187,6 +201,221 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
 
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+
+/* Size of the submission queue.  There is at most one POLL_ADD in flight
+ * per handler, so this only bounds how many are queued between submits.
+ */
+#define AIO_URING_ENTRIES 128
+
+/*
+ * fd monitoring with io_uring(7).  Each handler has a one-shot POLL_ADD in
+ * flight, which is re-armed after it completes.  aio_set_fd_handler() may
+ * run in any thread, so it only updates the handler; the thread running
+ * aio_poll() turns the changes into POLL_ADD/POLL_REMOVE requests and
+ * submits them together with the wait for events.  A whole aio_poll()
+ * iteration thus takes a single io_uring_enter(2).
+ *
+ * A handler is not freed while its POLL_ADD is in flight, because the
+ * completion points back to it.
+ */
+static bool aio_uring_enabled(AioContext *ctx)
+{
+    return ctx->fdmon_io_uring_enabled;
+}
+
+static bool aio_node_can_free(AioHandler *node)
+{
+    return !node->uring_armed;
+}
+
+static struct io_uring_sqe *aio_uring_get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_ring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+    if (!sqe) {
+        /* Submission queue is full, make room */
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+        assert(sqe);
+    }
+    return sqe;
+}
+
+static void aio_uring_arm(AioContext *ctx)
+{
+    struct io_uring_sqe *sqe;
+    AioHandler *node;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->uring_armed) {
+            if ((node->deleted || node->pfd.events != node->uring_events) &&
+                !node->uring_removing) {
+                /* The POLL_ADD then completes with -ECANCELED */
+                sqe = aio_uring_get_sqe(ctx);
+                io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, node, 0, 0);
+                io_uring_sqe_set_data(sqe, NULL);
+                node->uring_removing = true;
+            }
+            continue;
+        }
+
+        if (!node->deleted && node->pfd.events &&
+            aio_node_check(ctx, node->is_external)) {
+            sqe = aio_uring_get_sqe(ctx);
+            io_uring_prep_poll_add(sqe, node->pfd.fd, node->pfd.events);
+            io_uring_sqe_set_data(sqe, node);
+            node->uring_armed = true;
+            node->uring_events = node->pfd.events;
+        }
+    }
+}
+
+static int aio_uring(AioContext *ctx, int64_t timeout)
+{
+    struct io_uring *ring = &ctx->fdmon_ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts;
+    unsigned head, ncqe = 0;
+    int ret;
+
+    aio_uring_arm(ctx);
+
+    if (timeout > 0) {
+        /* Completes with the first event, or when the time is up */
+        ts.tv_sec = timeout / NANOSECONDS_PER_SECOND;
+        ts.tv_nsec = timeout % NANOSECONDS_PER_SECOND;
+        sqe = aio_uring_get_sqe(ctx);
+        io_uring_prep_timeout(sqe, &ts, 1, 0);
+        io_uring_sqe_set_data(sqe, NULL);
+    }
+
+    ret = io_uring_submit_and_wait(ring, timeout == 0 ? 0 : 1);
+    if (ret < 0 && ret != -EINTR) {
+        return ret;
+    }
+
+    ret = 0;
+    io_uring_for_each_cqe(ring, head, cqe) {
+        AioHandler *node = io_uring_cqe_get_data(cqe);
+
+        ncqe++;
+        if (!node) {
+            continue;       /* POLL_REMOVE or timeout */
+        }
+
+        node->uring_armed = false;
+        node->uring_removing = false;
+        if (cqe->res > 0) {
+            node->pfd.revents |= cqe->res;
+        }
+        /* Count cancellations too, so that deleted nodes get freed */
+        ret++;
+    }
+    io_uring_cq_advance(ring, ncqe);
+
+    return ret;
+}
+
+static bool aio_uring_try_enable(AioContext *ctx)
+{
+    if (io_uring_queue_init(AIO_URING_ENTRIES, &ctx->fdmon_ring, 0) < 0) {
+        return false;
+    }
+    ctx->fdmon_io_uring_enabled = true;
+    return true;
+}
+
+static void aio_uring_destroy(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->fdmon_ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    AioHandler *node, *tmp;
+    unsigned head, ncqe, armed = 0;
+    int ret;
+
+    if (!aio_uring_enabled(ctx)) {
+        return;
+    }
+
+    /* Cancel the polls that are still in flight.  Each of them completes
+     * exactly once, either with its event or with -ECANCELED.
+     */
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->uring_armed) {
+            continue;
+        }
+        if (!node->uring_removing) {
+            sqe = aio_uring_get_sqe(ctx);
+            io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, node, 0, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+            node->uring_removing = true;
+        }
+        armed++;
+    }
+
+    /* Wait for the completions, since they point to the nodes */
+    while (armed) {
+        ret = io_uring_submit_and_wait(ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            break;
+        }
+        ncqe = 0;
+        io_uring_for_each_cqe(ring, head, cqe) {
+            node = io_uring_cqe_get_data(cqe);
+            ncqe++;
+            if (node) {
+                node->uring_armed = false;
+                node->uring_removing = false;
+                armed--;
+            }
+        }
+        io_uring_cq_advance(ring, ncqe);
+    }
+
+    /* Nobody walks the list anymore, so free the nodes that were pinned */
+    QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+        if (node->deleted && aio_node_can_free(node)) {
+            QLIST_REMOVE(node, node);
+            g_free(node);
+        }
+    }
+
+    io_uring_queue_exit(ring);
+    ctx->fdmon_io_uring_enabled = false;
+}
+
+#else
+
+static bool aio_uring_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_node_can_free(AioHandler *node)
+{
+    return true;
+}
+
+static int aio_uring(AioContext *ctx, int64_t timeout)
+{
+    assert(false);
+}
+
+static bool aio_uring_try_enable(AioContext *ctx)
+{
+    return false;
+}
+
+static void aio_uring_destroy(AioContext *ctx)
+{
+}
+
+#endif
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -225,8 +454,10 @@ void aio_set_fd_handler(AioContext *ctx,
 
         g_source_remove_poll(&ctx->source, &node->pfd);
 
-        /* If the lock is held, just mark the node as deleted */
-        if (qemu_lockcnt_count(&ctx->list_lock)) {
+        /* If the lock is held, or io_uring still refers to the node,
+         * just mark the node as deleted
+         */
+        if (qemu_lockcnt_count(&ctx->list_lock) || !aio_node_can_free(node)) {
             node->deleted = 1;
             node->pfd.revents = 0;
         } else {
@@ -401,6 +632,8 @@ static bool aio_dispatch_handlers(AioContext *ctx)
             /* aio_notify() does not count as progress */
             if (node->opaque != &ctx->notifier) {
                 progress = true;
+                /* The handler is getting events, poll it again */
+                node->poll_idle = 0;
             }
         }
         if (!node->deleted &&
@@ -411,7 +644,7 @@ static bool aio_dispatch_handlers(AioContext *ctx)
             progress = true;
         }
 
-        if (node->deleted) {
+        if (node->deleted && aio_node_can_free(node)) {
             if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
                 QLIST_REMOVE(node, node);
                 g_free(node);
@@ -479,19 +712,63 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
-static bool run_poll_handlers_once(AioContext *ctx)
+/* run_poll_handlers_once:
+ * @ctx: the AioContext
+ * @skip_idle: do not call handlers that have been idle for a while
+ * @polled: set to true if at least one handler was called, may be NULL
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool run_poll_handlers_once(AioContext *ctx, bool skip_idle,
+                                   bool *polled)
 {
     bool progress = false;
     AioHandler *node;
 
     QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (skip_idle && node->poll_idle >= AIO_POLL_IDLE_WINDOWS) {
+            continue;
+        }
         if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external)) {
+            if (polled) {
+                *polled = true;
+            }
+            if (node->io_poll(node->opaque)) {
+                node->poll_progress = true;
+                progress = true;
+            }
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* Check the handlers skipped by the busy loop, and update the per-handler
+ * statistics at the end of a polling window.
+ */
+static bool run_poll_handlers_end_window(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->poll_idle >= AIO_POLL_IDLE_WINDOWS &&
+            !node->deleted && node->io_poll &&
             aio_node_check(ctx, node->is_external) &&
             node->io_poll(node->opaque)) {
+            node->poll_progress = true;
             progress = true;
         }
 
-        /* Caller handles freeing deleted nodes.  Don't do it here. */
+        if (node->poll_progress) {
+            node->poll_idle = 0;
+        } else if (node->poll_idle < AIO_POLL_IDLE_WINDOWS) {
+            node->poll_idle++;
+        }
+        node->poll_progress = false;
     }
 
     return progress;
@@ -513,6 +790,7 @@ static bool run_poll_handlers_once(AioContext *ctx)
 static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
 {
     bool progress;
+    bool polled;
     int64_t end_time;
 
     assert(ctx->notify_me);
@@ -523,9 +801,14 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
 
     end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
 
+    /* If every handler is idle there is nothing to busy wait for */
     do {
-        progress = run_poll_handlers_once(ctx);
-    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+        polled = false;
+        progress = run_poll_handlers_once(ctx, true, &polled);
+    } while (!progress && polled &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    progress |= run_poll_handlers_end_window(ctx);
 
     trace_run_poll_handlers_end(ctx, progress);
 
@@ -563,7 +846,7 @@ static bool try_poll_mode(AioContext *ctx, bool blocking)
     /* Even if we don't run busy polling, try polling once in case it can make
      * progress and the caller will be able to avoid ppoll(2)/epoll_wait(2).
      */
-    return run_poll_handlers_once(ctx);
+    return run_poll_handlers_once(ctx, false, NULL);
 }
 
 bool aio_poll(AioContext *ctx, bool blocking)
@@ -598,7 +881,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
         /* fill pollfds */
 
-        if (!aio_epoll_enabled(ctx)) {
+        if (!aio_epoll_enabled(ctx) && !aio_uring_enabled(ctx)) {
             QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
                 if (!node->deleted && node->pfd.events
                     && aio_node_check(ctx, node->is_external)) {
@@ -610,7 +893,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
         /* wait until next event */
-        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+        if (aio_uring_enabled(ctx)) {
+            ret = aio_uring(ctx, timeout);
+        } else if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
             AioHandler epoll_handler;
 
             epoll_handler.pfd.fd = ctx->epollfd;
@@ -701,6 +986,10 @@ void aio_context_setup(AioContext *ctx)
         exit(1);
     }
 
+    if (aio_uring_try_enable(ctx)) {
+        return;
+    }
+
 #ifdef CONFIG_EPOLL_CREATE1
     assert(!ctx->epollfd);
     ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -713,6 +1002,11 @@ void aio_context_setup(AioContext *ctx)
 #endif
 }
 
+void aio_context_destroy(AioContext *ctx)
+{
+    aio_uring_destroy(ctx);
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
@@ -28,6 +28,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/crc32c.h"
+#include "qemu/bswap.h"
 
 /*
  * This is the CRC-32C table
@@ -106,11 +107,144 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_int(uint32_t crc, const uint8_t *data,
+                           unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+/* The crc32c instructions compute the same step as crc32c_table, so the
+ * accelerated variants can finish the unaligned tail a byte at a time.
+ */
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE4_2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+#include <nmmintrin.h>
+
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        crc64 = _mm_crc32_u64(crc64, ldq_he_p(data));
+    }
+    crc = crc64;
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = _mm_crc32_u32(crc, ldl_he_p(data));
+    }
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+/* Note that for test_crc32c_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_SSE42   1
+
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL crc32c_int
+#else
+# define INIT_CACHE CACHE_SSE42
+# define INIT_ACCEL crc32c_sse42
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint32_t (*crc32c_accel)(uint32_t, const uint8_t *, unsigned int)
+    = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    uint32_t (*fn)(uint32_t, const uint8_t *, unsigned int) = crc32c_int;
+
+    if (cache & CACHE_SSE42) {
+        fn = crc32c_sse42;
+    }
+    crc32c_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_SSE4_2) {
+            cache |= CACHE_SSE42;
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_crc32c_next_accel(void)
+{
+    /* If no bits set, we just tested crc32c_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c_accel(uint32_t crc, const uint8_t *data,
+                             unsigned int length)
+{
+    for (; length >= 8; length -= 8, data += 8) {
+        crc = __crc32cd(crc, ldq_he_p(data));
+    }
+    for (; length >= 4; length -= 4, data += 4) {
+        crc = __crc32cw(crc, ldl_he_p(data));
+    }
+    while (length--) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+bool test_crc32c_next_accel(void)
+{
+    return false;
+}
+
+#else
+#define crc32c_accel  crc32c_int
+bool test_crc32c_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
 }
 
@@ -552,6 +552,12 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+
+    /* The last level was overwritten directly, so count its bits again */
+    bitmap->count = 0;
+    for (i = 0; i < bitmap->sizes[HBITMAP_LEVELS - 1]; i++) {
+        bitmap->count += ctpopl(bitmap->levels[HBITMAP_LEVELS - 1][i]);
+    }
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -0,0 +1,119 @@
+/*
+ * Lock contention profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/lock-profile.h"
+#include "trace.h"
+
+typedef struct LockProfileSite {
+    LockProfileType kind;
+    const char *file;
+    int line;
+    uint64_t count;
+    int64_t wait_ns;
+    int64_t max_wait_ns;
+    int64_t hold_ns;
+    int64_t max_hold_ns;
+} LockProfileSite;
+
+bool lock_profile_enabled;
+
+/* Protects lock_profile_sites.  A spinlock is enough because the critical
+ * sections are short, and it keeps the profiler from showing up in its own
+ * statistics.
+ */
+static QemuSpin lock_profile_spin;
+static GHashTable *lock_profile_sites;
+
+static guint lock_profile_site_hash(gconstpointer p)
+{
+    const LockProfileSite *site = p;
+
+    return g_str_hash(site->file) ^ (site->line << 1) ^ site->kind;
+}
+
+static gboolean lock_profile_site_equal(gconstpointer a, gconstpointer b)
+{
+    const LockProfileSite *sa = a;
+    const LockProfileSite *sb = b;
+
+    return sa->kind == sb->kind && sa->line == sb->line &&
+           !strcmp(sa->file, sb->file);
+}
+
+void lock_profile_record(LockProfileType kind, const char *file, int line,
+                         int64_t wait_ns, int64_t hold_ns)
+{
+    LockProfileSite key = { .kind = kind, .file = file, .line = line };
+    LockProfileSite *site;
+
+    trace_lock_profile_record(LockProfileType_lookup[kind], file, line,
+                              wait_ns, hold_ns);
+
+    qemu_spin_lock(&lock_profile_spin);
+    if (!lock_profile_sites) {
+        lock_profile_sites = g_hash_table_new_full(lock_profile_site_hash,
+                                                   lock_profile_site_equal,
+                                                   g_free, NULL);
+    }
+
+    site = g_hash_table_lookup(lock_profile_sites, &key);
+    if (!site) {
+        site = g_memdup(&key, sizeof(key));
+        g_hash_table_insert(lock_profile_sites, site, site);
+    }
+
+    site->count++;
+    site->wait_ns += wait_ns;
+    site->max_wait_ns = MAX(site->max_wait_ns, wait_ns);
+    site->hold_ns += hold_ns;
+    site->max_hold_ns = MAX(site->max_hold_ns, hold_ns);
+    qemu_spin_unlock(&lock_profile_spin);
+}
+
+void lock_profile_set_enabled(bool enable)
+{
+    qemu_spin_lock(&lock_profile_spin);
+    if (enable && !lock_profile_enabled && lock_profile_sites) {
+        g_hash_table_remove_all(lock_profile_sites);
+    }
+    atomic_set(&lock_profile_enabled, enable);
+    qemu_spin_unlock(&lock_profile_spin);
+}
+
+LockProfileInfoList *lock_profile_query(void)
+{
+    LockProfileInfoList *head = NULL;
+    GHashTableIter iter;
+    LockProfileSite *site;
+
+    qemu_spin_lock(&lock_profile_spin);
+    if (lock_profile_sites) {
+        g_hash_table_iter_init(&iter, lock_profile_sites);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&site)) {
+            LockProfileInfoList *elem = g_new0(LockProfileInfoList, 1);
+            LockProfileInfo *info = g_new0(LockProfileInfo, 1);
+
+            info->kind = site->kind;
+            info->file = g_strdup(site->file);
+            info->line = site->line;
+            info->count = site->count;
+            info->wait_ns = site->wait_ns;
+            info->max_wait_ns = site->max_wait_ns;
+            info->hold_ns = site->hold_ns;
+            info->max_hold_ns = site->max_hold_ns;
+
+            elem->value = info;
+            elem->next = head;
+            head = elem;
+        }
+    }
+    qemu_spin_unlock(&lock_profile_spin);
+
+    return head;
+}
@@ -35,6 +35,7 @@
 #ifndef _WIN32
 
 #include "qemu/compatfd.h"
+#include "qemu/metrics.h"
 
 /* If we have signalfd, we mask out the signals we want to handle and then
  * use signalfd to listen for them.  We rely on whatever the current signal
@@ -140,6 +141,9 @@ void qemu_notify_event(void)
 
 static GArray *gpollfds;
 
+static QemuMetric *main_loop_iterations;
+static QemuMetric *main_loop_timers_ns;
+
 int qemu_init_main_loop(Error **errp)
 {
     int ret;
@@ -148,6 +152,13 @@ int qemu_init_main_loop(Error **errp)
 
     init_clocks();
 
+    main_loop_iterations =
+        qemu_metric_counter_new("main-loop.iterations",
+                                "main loop iterations");
+    main_loop_timers_ns =
+        qemu_metric_histogram_new("main-loop.timers-ns",
+                                  "time spent running main loop timers");
+
     ret = qemu_signal_init();
     if (ret) {
         return ret;
@@ -483,6 +494,7 @@ int main_loop_wait(int nonblocking)
     int ret;
     uint32_t timeout = UINT32_MAX;
     int64_t timeout_ns;
+    int64_t start;
 
     if (nonblocking) {
         timeout = 0;
@@ -513,7 +525,10 @@ int main_loop_wait(int nonblocking)
     /* CPU thread can infinitely wait for event after
        missing the warp */
     qemu_start_warp_timer();
+    start = get_clock();
     qemu_clock_run_all_timers();
+    qemu_metric_observe(main_loop_timers_ns, get_clock() - start);
+    qemu_metric_inc(main_loop_iterations);
 
     return ret;
 }
@@ -0,0 +1,201 @@
+/*
+ * Always-on metrics registry
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/metrics.h"
+
+/* Number of shards per metric; threads are assigned one round-robin */
+#define METRIC_SHARDS 16
+
+/* Bucket 0 counts zeroes, bucket i counts values in [2^(i-1), 2^i) */
+#define METRIC_HIST_BUCKETS 65
+
+/* Layout of a shard, in uint64_t units */
+#define METRIC_SUM     0    /* counter value, or sum of the samples */
+#define METRIC_COUNT   1    /* number of samples */
+#define METRIC_BUCKET  2    /* first histogram bucket */
+
+#define METRIC_SHARD_ALIGN 64
+
+struct QemuMetric {
+    const char *name;
+    const char *help;
+    StatsType kind;
+    size_t shard_size;
+    uint64_t *shards;
+#ifndef CONFIG_ATOMIC64
+    QemuSpin lock;
+#endif
+    QTAILQ_ENTRY(QemuMetric) next;
+};
+
+/* Protects the list of metrics.  A spinlock needs no initialization, so
+ * metrics can be registered from constructors.
+ */
+static QemuSpin metrics_lock;
+static QTAILQ_HEAD(, QemuMetric) metrics = QTAILQ_HEAD_INITIALIZER(metrics);
+
+static unsigned int metric_next_shard;
+static __thread int metric_shard = -1;
+
+static QemuMetric *qemu_metric_new(const char *name, const char *help,
+                                   StatsType kind, size_t n)
+{
+    QemuMetric *m = g_new0(QemuMetric, 1);
+    size_t bytes;
+
+    m->name = name;
+    m->help = help;
+    m->kind = kind;
+    m->shard_size = ROUND_UP(n * sizeof(uint64_t), METRIC_SHARD_ALIGN) /
+                    sizeof(uint64_t);
+
+    bytes = METRIC_SHARDS * m->shard_size * sizeof(uint64_t);
+    m->shards = qemu_memalign(METRIC_SHARD_ALIGN, bytes);
+    memset(m->shards, 0, bytes);
+#ifndef CONFIG_ATOMIC64
+    qemu_spin_init(&m->lock);
+#endif
+
+    qemu_spin_lock(&metrics_lock);
+    QTAILQ_INSERT_TAIL(&metrics, m, next);
+    qemu_spin_unlock(&metrics_lock);
+    return m;
+}
+
+QemuMetric *qemu_metric_counter_new(const char *name, const char *help)
+{
+    return qemu_metric_new(name, help, STATS_TYPE_COUNTER, 1);
+}
+
+QemuMetric *qemu_metric_histogram_new(const char *name, const char *help)
+{
+    return qemu_metric_new(name, help, STATS_TYPE_HISTOGRAM,
+                           METRIC_BUCKET + METRIC_HIST_BUCKETS);
+}
+
+static inline uint64_t *qemu_metric_get_shard(QemuMetric *m)
+{
+    if (unlikely(metric_shard < 0)) {
+        metric_shard = atomic_fetch_inc(&metric_next_shard) % METRIC_SHARDS;
+    }
+    return &m->shards[metric_shard * m->shard_size];
+}
+
+/*
+ * Shards are shared by all threads that were assigned the same index, so
+ * updates must be atomic.  Hosts without 64-bit atomics fall back to a
+ * per-metric spinlock.
+ */
+static inline void metric_add(QemuMetric *m, uint64_t *p, uint64_t n)
+{
+#ifdef CONFIG_ATOMIC64
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+#else
+    qemu_spin_lock(&m->lock);
+    *p += n;
+    qemu_spin_unlock(&m->lock);
+#endif
+}
+
+static inline uint64_t metric_read(QemuMetric *m, uint64_t *p)
+{
+#ifdef CONFIG_ATOMIC64
+    return atomic_read__nocheck(p);
+#else
+    uint64_t val;
+
+    qemu_spin_lock(&m->lock);
+    val = *p;
+    qemu_spin_unlock(&m->lock);
+    return val;
+#endif
+}
+
+void qemu_metric_add(QemuMetric *m, uint64_t n)
+{
+    metric_add(m, qemu_metric_get_shard(m) + METRIC_SUM, n);
+}
+
+void qemu_metric_observe(QemuMetric *m, uint64_t value)
+{
+    uint64_t *shard = qemu_metric_get_shard(m);
+    int bucket = value ? 64 - clz64(value) : 0;
+
+    assert(m->kind == STATS_TYPE_HISTOGRAM);
+    metric_add(m, shard + METRIC_SUM, value);
+    metric_add(m, shard + METRIC_COUNT, 1);
+    metric_add(m, shard + METRIC_BUCKET + bucket, 1);
+}
+
+static uint64_t qemu_metric_sum(QemuMetric *m, size_t offset)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < METRIC_SHARDS; i++) {
+        sum += metric_read(m, &m->shards[i * m->shard_size + offset]);
+    }
+    return sum;
+}
+
+static StatsInfo *qemu_metric_info(QemuMetric *m)
+{
+    StatsInfo *info = g_new0(StatsInfo, 1);
+    StatsBucketList *head = NULL, **tail = &head;
+    int i;
+
+    info->name = g_strdup(m->name);
+    info->help = g_strdup(m->help);
+    info->kind = m->kind;
+    info->value = qemu_metric_sum(m, METRIC_SUM);
+    if (m->kind != STATS_TYPE_HISTOGRAM) {
+        return info;
+    }
+
+    info->has_count = true;
+    info->count = qemu_metric_sum(m, METRIC_COUNT);
+    for (i = 0; i < METRIC_HIST_BUCKETS; i++) {
+        uint64_t n = qemu_metric_sum(m, METRIC_BUCKET + i);
+        StatsBucketList *entry;
+
+        if (!n) {
+            continue;
+        }
+        entry = g_new0(StatsBucketList, 1);
+        entry->value = g_new0(StatsBucket, 1);
+        entry->value->le = i < 64 ? (1ULL << i) - 1 : UINT64_MAX;
+        entry->value->count = n;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_buckets = true;
+    info->buckets = head;
+    return info;
+}
+
+StatsInfoList *qemu_metrics_query(void)
+{
+    StatsInfoList *head = NULL, **tail = &head;
+    QemuMetric *m;
+
+    qemu_spin_lock(&metrics_lock);
+    QTAILQ_FOREACH(m, &metrics, next) {
+        StatsInfoList *entry = g_new0(StatsInfoList, 1);
+
+        entry->value = qemu_metric_info(m);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_spin_unlock(&metrics_lock);
+
+    return head;
+}
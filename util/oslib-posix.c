@@ -38,6 +38,8 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -316,56 +318,204 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+#define MAX_MEM_PREALLOC_THREAD_COUNT 16
+
+/* Don't bother creating a thread for less than this much memory */
+#define MEM_PREALLOC_MIN_PER_THREAD (64 * 1024 * 1024)
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    QemuThread pgthread;
+    sigjmp_buf env;
+    bool *failed;
+} MemsetThread;
+
+/* Several preallocations may run at once, so each touch thread finds its
+ * own jump buffer, and the SIGBUS handler stays installed until the last
+ * of them is done.
+ */
+static __thread MemsetThread *memset_thread_self;
+static pthread_mutex_t sigbus_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sigbus_users;
+static struct sigaction sigbus_oldact;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    if (memset_thread_self) {
+        siglongjmp(memset_thread_self->env, 1);
+    }
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+static void *do_touch_pages(void *arg)
 {
-    int ret;
-    struct sigaction act, oldact;
+    MemsetThread *memset_args = arg;
+    char *addr = memset_args->addr;
+    size_t numpages = memset_args->numpages;
+    size_t hpagesize = memset_args->hpagesize;
     sigset_t set, oldset;
+    size_t i;
+
+#ifdef MADV_POPULATE_WRITE
+    /* Let the kernel fault in the whole range at once.  Unlike touching
+     * the pages, this reports failures with an error instead of SIGBUS.
+     * Older kernels return EINVAL, so fall back to touching the pages.
+     */
+    if (!madvise(addr, numpages * hpagesize, MADV_POPULATE_WRITE)) {
+        return NULL;
+    }
+    if (errno != EINVAL) {
+        *memset_args->failed = true;
+        return NULL;
+    }
+#endif
+
+    /* unblock SIGBUS */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    memset_thread_self = memset_args;
+    if (sigsetjmp(memset_args->env, 1)) {
+        *memset_args->failed = true;
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < numpages; i++) {
+            /* Read and write back the same value, so that data already
+             * in the backing file is not corrupted.  'volatile' keeps the
+             * compiler from optimizing this away.
+             */
+            *(volatile char *)addr = *addr;
+            addr += hpagesize;
+        }
+    }
+    memset_thread_self = NULL;
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return NULL;
+}
+
+static int get_memset_num_threads(size_t hpagesize, size_t numpages)
+{
+    long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t per_thread = MAX(MEM_PREALLOC_MIN_PER_THREAD, hpagesize);
+    int n = MAX(1, MIN(host_cpus, MAX_MEM_PREALLOC_THREAD_COUNT));
+
+    return MAX(1, MIN(n, (uint64_t)numpages * hpagesize / per_thread));
+}
+
+static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages)
+{
+    MemsetThread *memset_thread;
+    int memset_num_threads;
+    bool failed = false;
+    size_t numpages_per_thread;
+    char *addr = area;
+    int i;
+
+    memset_num_threads = get_memset_num_threads(hpagesize, numpages);
+    memset_thread = g_new0(MemsetThread, memset_num_threads);
+    numpages_per_thread = numpages / memset_num_threads;
+
+    trace_os_mem_prealloc(area, numpages * hpagesize, hpagesize,
+                          memset_num_threads);
+    for (i = 0; i < memset_num_threads; i++) {
+        memset_thread[i].addr = addr;
+        memset_thread[i].numpages = (i == memset_num_threads - 1) ?
+                                    numpages : numpages_per_thread;
+        memset_thread[i].hpagesize = hpagesize;
+        memset_thread[i].failed = &failed;
+        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
+                           do_touch_pages, &memset_thread[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += numpages_per_thread * hpagesize;
+        numpages -= numpages_per_thread;
+    }
+    for (i = 0; i < memset_num_threads; i++) {
+        qemu_thread_join(&memset_thread[i].pgthread);
+        trace_os_mem_prealloc_thread_done(i, memset_thread[i].addr,
+                                          memset_thread[i].numpages *
+                                          hpagesize);
+    }
+    g_free(memset_thread);
+
+    return failed;
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+{
+    int ret = 0;
+    struct sigaction act;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
     act.sa_flags = 0;
 
-    ret = sigaction(SIGBUS, &act, &oldact);
+    pthread_mutex_lock(&sigbus_lock);
+    if (!sigbus_users) {
+        ret = sigaction(SIGBUS, &act, &sigbus_oldact);
+    }
+    if (!ret) {
+        sigbus_users++;
+    }
+    pthread_mutex_unlock(&sigbus_lock);
     if (ret) {
         error_setg_errno(errp, errno,
             "os_mem_prealloc: failed to install signal handler");
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    /* touch pages simultaneously */
+    if (touch_all_pages(area, hpagesize, numpages)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
     }
 
-    ret = sigaction(SIGBUS, &oldact, NULL);
+    pthread_mutex_lock(&sigbus_lock);
+    if (!--sigbus_users) {
+        ret = sigaction(SIGBUS, &sigbus_oldact, NULL);
+    }
+    pthread_mutex_unlock(&sigbus_lock);
     if (ret) {
         /* Terminate QEMU since it can't recover from error */
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+size_t qemu_thp_pagesize(void)
+{
+    static size_t thp_pagesize = -1;
+
+    if (thp_pagesize == (size_t)-1) {
+#ifdef CONFIG_LINUX
+        gchar *content = NULL;
+        const char *endptr;
+        uint64_t size;
+
+        thp_pagesize = 0;
+        /* With "never", the huge page size is still reported */
+        if (g_file_get_contents("/sys/kernel/mm/transparent_hugepage/enabled",
+                                &content, NULL, NULL) &&
+            !strstr(content, "[never]")) {
+            g_free(content);
+            content = NULL;
+            if (g_file_get_contents("/sys/kernel/mm/transparent_hugepage/"
+                                    "hpage_pmd_size", &content, NULL, NULL) &&
+                !qemu_strtou64(content, &endptr, 0, &size) &&
+                is_power_of_2(size) && size > getpagesize()) {
+                thp_pagesize = size;
+            }
+        }
+        g_free(content);
+#else
+        thp_pagesize = 0;
+#endif
+    }
+
+    return thp_pagesize;
 }
 
 
@@ -552,6 +552,11 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
     }
 }
 
+size_t qemu_thp_pagesize(void)
+{
+    return 0;
+}
+
 
 /* XXX: put correct support for win32 */
 int qemu_read_password(char *buf, int buf_size)
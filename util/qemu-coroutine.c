@@ -17,6 +17,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "qemu/coroutine.h"
 #include "qemu/coroutine_int.h"
 #include "block/aio.h"
@@ -25,6 +26,9 @@ enum {
     POOL_BATCH_SIZE = 64,
 };
 
+/* How often the per-thread pool limit is recomputed */
+#define POOL_WINDOW_NS (10 * NANOSECONDS_PER_SECOND)
+
 /** Free list to speed up creation */
 static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int release_pool_size;
@@ -32,6 +36,41 @@ static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(po
 static __thread unsigned int alloc_pool_size;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
+/* The thread-local pool keeps as many coroutines as this thread had alive
+ * at the same time during the current or the previous window, so that a
+ * thread with many requests in flight does not keep allocating new stacks,
+ * and a thread whose load went down eventually frees them.  Coroutines
+ * may terminate in a different thread than the one that created them, so
+ * this is only a heuristic.
+ */
+static __thread int pool_nr_alive;
+static __thread int pool_peak_alive[2];
+static __thread unsigned int pool_max_size = POOL_BATCH_SIZE;
+static __thread unsigned int pool_nr_deleted;
+static __thread int64_t pool_window_start;
+
+static void coroutine_pool_update_size(void)
+{
+    int64_t now = get_clock();
+
+    if (now - pool_window_start >= POOL_WINDOW_NS) {
+        pool_window_start = now;
+        pool_peak_alive[1] = pool_peak_alive[0];
+        pool_peak_alive[0] = MAX(pool_nr_alive, 0);
+    }
+
+    pool_max_size = MAX(POOL_BATCH_SIZE,
+                        MAX(pool_peak_alive[0], pool_peak_alive[1]));
+
+    /* Give memory back to the system if the pool grew beyond that */
+    while (alloc_pool_size > pool_max_size) {
+        Coroutine *co = QSLIST_FIRST(&alloc_pool);
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        alloc_pool_size--;
+        qemu_coroutine_delete(co);
+    }
+}
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
@@ -76,6 +115,12 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         co = qemu_coroutine_new();
     }
 
+    if (CONFIG_COROUTINE_POOL) {
+        if (++pool_nr_alive > pool_peak_alive[0]) {
+            pool_peak_alive[0] = pool_nr_alive;
+        }
+    }
+
     co->entry = entry;
     co->entry_arg = opaque;
     QSIMPLEQ_INIT(&co->co_queue_wakeup);
@@ -87,12 +132,17 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        pool_nr_alive--;
+        if (++pool_nr_deleted % POOL_BATCH_SIZE == 0) {
+            coroutine_pool_update_size();
+        }
+
         if (release_pool_size < POOL_BATCH_SIZE * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             atomic_inc(&release_pool_size);
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (alloc_pool_size < pool_max_size) {
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;
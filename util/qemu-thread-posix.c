@@ -14,6 +14,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitmap.h"
 
 static bool name_threads;
 
@@ -491,6 +492,33 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+int qemu_thread_set_affinity(QemuThread *thread, unsigned long *host_cpus,
+                             unsigned long nbits)
+{
+#if defined(CONFIG_LINUX) && defined(CPU_ALLOC)
+    cpu_set_t *cpuset = CPU_ALLOC(nbits);
+    size_t setsize = CPU_ALLOC_SIZE(nbits);
+    unsigned long cpu;
+    int err;
+
+    if (!cpuset) {
+        return -ENOMEM;
+    }
+
+    CPU_ZERO_S(setsize, cpuset);
+    for (cpu = find_first_bit(host_cpus, nbits); cpu < nbits;
+         cpu = find_next_bit(host_cpus, nbits, cpu + 1)) {
+        CPU_SET_S(cpu, setsize, cpuset);
+    }
+
+    err = pthread_setaffinity_np(thread->thread, setsize, cpuset);
+    CPU_FREE(cpuset);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
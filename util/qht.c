@@ -43,10 +43,13 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing migrates the old map one bucket at a time: each bucket's spinlock is
+ * taken (so that no other writers can race with us on it) and its entries are
+ * copied into the new hash map. Writers to buckets that have not been migrated
+ * yet can proceed in the meantime; only those hitting an already-migrated
+ * bucket wait for the resize to complete. Once all buckets have been copied,
+ * the ht->map pointer is set, and the old map is freed once no RCU readers can
+ * see it anymore.
  *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occured
@@ -739,6 +742,24 @@ static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
     qht_insert__locked(ht, new, b, p, hash, NULL);
 }
 
+/*
+ * Acquire all bucket locks from @old in order, copying each bucket into @new
+ * as soon as its lock is taken. Buckets are left locked so that they cannot
+ * change until @new is published.
+ */
+static void qht_map_lock_and_copy_buckets(struct qht *ht, struct qht_map *old,
+                                          struct qht_map *new)
+{
+    size_t i;
+
+    for (i = 0; i < old->n_buckets; i++) {
+        struct qht_bucket *b = &old->buckets[i];
+
+        qemu_spin_lock(&b->lock);
+        qht_bucket_iter(ht, b, qht_map_copy, new);
+    }
+}
+
 /*
  * Atomically perform a resize and/or reset.
  * Call with ht->lock held.
@@ -748,19 +769,22 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     struct qht_map *old;
 
     old = ht->map;
-    qht_map_lock_buckets(old);
-
-    if (reset) {
-        qht_map_reset__all_locked(old);
-    }
+    if (new && !reset) {
+        g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
+        qht_map_lock_and_copy_buckets(ht, old, new);
+    } else {
+        qht_map_lock_buckets(old);
+
+        if (reset) {
+            qht_map_reset__all_locked(old);
+        }
 
-    if (new == NULL) {
-        qht_map_unlock_buckets(old);
-        return;
+        if (new == NULL) {
+            qht_map_unlock_buckets(old);
+            return;
+        }
+        g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
     }
-
-    g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
-    qht_map_iter__all_locked(ht, old, qht_map_copy, new);
     qht_map_debug__all_locked(new);
 
     atomic_rcu_set(&ht->map, new);
@@ -89,10 +89,12 @@ static void wait_for_readers(void)
             atomic_set(&index->waiting, true);
         }
 
-        /* Here, order the stores to index->waiting before the
-         * loads of index->ctr.
+        /* Here, order the stores to index->waiting before the loads of
+         * index->ctr.  Pairs with smp_mb_placeholder() in rcu_read_lock()
+         * and rcu_read_unlock(), ensuring that the loads of index->ctr are
+         * sequentially consistent.
          */
-        smp_mb();
+        smp_mb_global();
 
         QLIST_FOREACH_SAFE(index, &registry, node, tmp) {
             if (!rcu_gp_ongoing(&index->ctr)) {
@@ -335,11 +337,13 @@ static void rcu_init_unlock(void)
 void rcu_after_fork(void)
 {
     memset(&registry, 0, sizeof(registry));
+    smp_mb_global_init();
     rcu_init_complete();
 }
 
 static void __attribute__((__constructor__)) rcu_init(void)
 {
+    smp_mb_global_init();
 #ifdef CONFIG_POSIX
     pthread_atfork(rcu_init_lock, rcu_init_unlock, rcu_init_unlock);
 #endif
@@ -0,0 +1,42 @@
+/*
+ * Process-wide memory barrier system call
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/sys_membarrier.h"
+
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+
+bool have_sys_membarrier;
+
+static int membarrier(int cmd, int flags)
+{
+    return syscall(__NR_membarrier, cmd, flags);
+}
+
+void smp_mb_global(void)
+{
+    if (likely(have_sys_membarrier)) {
+        membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+    } else {
+        /* Readers use a full barrier too, see smp_mb_placeholder() */
+        smp_mb();
+    }
+}
+
+void smp_mb_global_init(void)
+{
+    int ret = membarrier(MEMBARRIER_CMD_QUERY, 0);
+
+    /* MEMBARRIER_CMD_SHARED is also available on older kernels, but it
+     * waits for a scheduler grace period and would make synchronize_rcu()
+     * slower instead of faster.
+     */
+    have_sys_membarrier = ret > 0 &&
+        (ret & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
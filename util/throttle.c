@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
@@ -120,6 +121,16 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
     return 0;
 }
 
+/* The buckets that apply to each type of operation */
+static const BucketType to_check[2][4] = { {THROTTLE_BPS_TOTAL,
+                                            THROTTLE_OPS_TOTAL,
+                                            THROTTLE_BPS_READ,
+                                            THROTTLE_OPS_READ},
+                                           {THROTTLE_BPS_TOTAL,
+                                            THROTTLE_OPS_TOTAL,
+                                            THROTTLE_BPS_WRITE,
+                                            THROTTLE_OPS_WRITE}, };
+
 /* This function compute the time that must be waited while this IO
  *
  * @is_write:   true if the current IO is a write, false if it's a read
@@ -128,14 +139,6 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
 static int64_t throttle_compute_wait_for(ThrottleState *ts,
                                          bool is_write)
 {
-    BucketType to_check[2][4] = { {THROTTLE_BPS_TOTAL,
-                                   THROTTLE_OPS_TOTAL,
-                                   THROTTLE_BPS_READ,
-                                   THROTTLE_OPS_READ},
-                                  {THROTTLE_BPS_TOTAL,
-                                   THROTTLE_OPS_TOTAL,
-                                   THROTTLE_BPS_WRITE,
-                                   THROTTLE_OPS_WRITE}, };
     int64_t wait, max_wait = 0;
     int i;
 
@@ -460,6 +463,82 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* Compute how much I/O of a given type can still be done without making
+ * any of the buckets wait, i.e. before the first one is full.  The leak
+ * is not updated, so this should follow throttle_schedule_timer().
+ *
+ * @is_write: the type of operation (read/write)
+ * @bytes:    the number of bytes, or INFINITY if they are not limited
+ * @units:    the number of operations, or INFINITY if they are not limited
+ */
+void throttle_compute_headroom(ThrottleState *ts, bool is_write,
+                               double *bytes, double *units)
+{
+    int i;
+
+    *bytes = *units = INFINITY;
+
+    for (i = 0; i < 4; i++) {
+        BucketType index = to_check[is_write][i];
+        LeakyBucket *bkt = &ts->cfg.buckets[index];
+        double room;
+
+        if (!bkt->avg) {
+            continue;
+        }
+
+        room = bkt->max * bkt->burst_length - bkt->level;
+        if (bkt->burst_length > 1) {
+            /* See throttle_compute_wait() */
+            room = MIN(room, bkt->max / 10 - bkt->burst_level);
+        }
+        room = MAX(room, 0);
+
+        if (index == THROTTLE_BPS_TOTAL || index == THROTTLE_BPS_READ ||
+            index == THROTTLE_BPS_WRITE) {
+            *bytes = MIN(*bytes, room);
+        } else {
+            *units = MIN(*units, room);
+        }
+    }
+}
+
+/* Add (or, for negative values, remove) I/O to the limited buckets of a
+ * given type of operation, without the rounding done by throttle_account().
+ * This is used to set aside part of the headroom before the I/O is done.
+ *
+ * @is_write: the type of operation (read/write)
+ * @bytes:    the number of bytes, ignored if INFINITY
+ * @units:    the number of operations, ignored if INFINITY
+ */
+void throttle_reserve(ThrottleState *ts, bool is_write,
+                      double bytes, double units)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        BucketType index = to_check[is_write][i];
+        LeakyBucket *bkt = &ts->cfg.buckets[index];
+        double amount;
+
+        if (index == THROTTLE_BPS_TOTAL || index == THROTTLE_BPS_READ ||
+            index == THROTTLE_BPS_WRITE) {
+            amount = bytes;
+        } else {
+            amount = units;
+        }
+
+        if (!bkt->avg || isinf(amount)) {
+            continue;
+        }
+
+        bkt->level = MAX(bkt->level + amount, 0);
+        if (bkt->burst_length > 1) {
+            bkt->burst_level = MAX(bkt->burst_level + amount, 0);
+        }
+    }
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
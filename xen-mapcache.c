@@ -57,17 +57,23 @@ typedef struct MapCacheEntry {
     struct MapCacheEntry *next;
 } MapCacheEntry;
 
+/* A locked mapping, found by the address that was returned for it.  A
+ * locked entry is never remapped, so every lock that returned the same
+ * address refers to the same entry and shares one MapCacheRev.
+ */
 typedef struct MapCacheRev {
     uint8_t *vaddr_req;
     hwaddr paddr_index;
     hwaddr size;
-    QTAILQ_ENTRY(MapCacheRev) next;
+    unsigned long count;
 } MapCacheRev;
 
 typedef struct MapCache {
     MapCacheEntry *entry;
     unsigned long nr_buckets;
-    QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
+    /* vaddr_req -> MapCacheRev, one lookup per unmap even with many
+     * DMA mappings in flight */
+    GHashTable *locked_entries;
 
     /* For most cases (>99.9%), the page address is the same. */
     MapCacheEntry *last_entry;
@@ -111,7 +117,9 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     mapcache->opaque = opaque;
     qemu_mutex_init(&mapcache->lock);
 
-    QTAILQ_INIT(&mapcache->locked_entries);
+    mapcache->locked_entries = g_hash_table_new_full(g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL, g_free);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -287,12 +295,19 @@ tryagain:
 
     mapcache->last_entry = entry;
     if (lock) {
-        MapCacheRev *reventry = g_malloc0(sizeof(MapCacheRev));
+        uint8_t *vaddr_req = entry->vaddr_base + address_offset;
+        MapCacheRev *reventry = g_hash_table_lookup(mapcache->locked_entries,
+                                                    vaddr_req);
+
+        if (!reventry) {
+            reventry = g_new0(MapCacheRev, 1);
+            reventry->vaddr_req = vaddr_req;
+            reventry->paddr_index = entry->paddr_index;
+            reventry->size = entry->size;
+            g_hash_table_insert(mapcache->locked_entries, vaddr_req, reventry);
+        }
+        reventry->count++;
         entry->lock++;
-        reventry->vaddr_req = mapcache->last_entry->vaddr_base + address_offset;
-        reventry->paddr_index = mapcache->last_entry->paddr_index;
-        reventry->size = entry->size;
-        QTAILQ_INSERT_HEAD(&mapcache->locked_entries, reventry, next);
     }
 
     trace_xen_map_cache_return(mapcache->last_entry->vaddr_base + address_offset);
@@ -310,6 +325,12 @@ uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
     return p;
 }
 
+static void dump_locked_entry(gpointer key, gpointer value, gpointer opaque)
+{
+    DPRINTF("   "TARGET_FMT_plx" -> %p is present\n",
+            ((MapCacheRev *)value)->paddr_index, key);
+}
+
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 {
     MapCacheEntry *entry = NULL;
@@ -317,26 +338,17 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
     hwaddr paddr_index;
     hwaddr size;
     ram_addr_t raddr;
-    int found = 0;
 
     mapcache_lock();
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == ptr) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    reventry = g_hash_table_lookup(mapcache->locked_entries, ptr);
+    if (!reventry) {
         fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
-        QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-            DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
-                    reventry->vaddr_req);
-        }
+        g_hash_table_foreach(mapcache->locked_entries, dump_locked_entry, NULL);
         abort();
         return 0;
     }
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
     while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
@@ -359,25 +371,18 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
-    int found = 0;
-
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        if (reventry->vaddr_req == buffer) {
-            paddr_index = reventry->paddr_index;
-            size = reventry->size;
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+
+    reventry = g_hash_table_lookup(mapcache->locked_entries, buffer);
+    if (!reventry) {
         DPRINTF("%s, could not find %p\n", __func__, buffer);
-        QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-            DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index, reventry->vaddr_req);
-        }
+        g_hash_table_foreach(mapcache->locked_entries, dump_locked_entry, NULL);
         return;
     }
-    QTAILQ_REMOVE(&mapcache->locked_entries, reventry, next);
-    g_free(reventry);
+    paddr_index = reventry->paddr_index;
+    size = reventry->size;
+    if (--reventry->count == 0) {
+        g_hash_table_remove(mapcache->locked_entries, buffer);
+    }
 
     if (mapcache->last_entry != NULL &&
         mapcache->last_entry->paddr_index == paddr_index) {
@@ -418,17 +423,15 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
 void xen_invalidate_map_cache(void)
 {
     unsigned long i;
-    MapCacheRev *reventry;
 
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
 
     mapcache_lock();
 
-    QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-        DPRINTF("There should be no locked mappings at this time, "
-                "but "TARGET_FMT_plx" -> %p is present\n",
-                reventry->paddr_index, reventry->vaddr_req);
+    if (g_hash_table_size(mapcache->locked_entries)) {
+        DPRINTF("There should be no locked mappings at this time\n");
+        g_hash_table_foreach(mapcache->locked_entries, dump_locked_entry, NULL);
     }
 
     for (i = 0; i < mapcache->nr_buckets; i++) {